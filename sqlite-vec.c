@@ -1940,6 +1940,9 @@ enum Vec0TokenType {
   TOKEN_TYPE_RBRACKET,
   TOKEN_TYPE_PLUS,
   TOKEN_TYPE_EQ,
+  TOKEN_TYPE_LPAREN,
+  TOKEN_TYPE_RPAREN,
+  TOKEN_TYPE_COMMA,
 };
 struct Vec0Token {
   enum Vec0TokenType token_type;
@@ -1990,6 +1993,24 @@ int vec0_token_next(char *start, char *end, struct Vec0Token *out) {
       out->end = ptr;
       out->token_type = TOKEN_TYPE_EQ;
       return VEC0_TOKEN_RESULT_SOME;
+    } else if (curr == '(') {
+      ptr++;
+      out->start = ptr;
+      out->end = ptr;
+      out->token_type = TOKEN_TYPE_LPAREN;
+      return VEC0_TOKEN_RESULT_SOME;
+    } else if (curr == ')') {
+      ptr++;
+      out->start = ptr;
+      out->end = ptr;
+      out->token_type = TOKEN_TYPE_RPAREN;
+      return VEC0_TOKEN_RESULT_SOME;
+    } else if (curr == ',') {
+      ptr++;
+      out->start = ptr;
+      out->end = ptr;
+      out->token_type = TOKEN_TYPE_COMMA;
+      return VEC0_TOKEN_RESULT_SOME;
     } else if (is_alpha(curr)) {
       char *start = ptr;
       while (ptr < end && (is_alpha(*ptr) || is_digit(*ptr) || *ptr == '_')) {
@@ -2231,12 +2252,17 @@ typedef enum {
   VEC0_METADATA_COLUMN_KIND_INTEGER,
   VEC0_METADATA_COLUMN_KIND_FLOAT,
   VEC0_METADATA_COLUMN_KIND_TEXT,
+  // TEXT declared as `xxx text dictionary`, stored as i64 codes into a
+  // _metadatadictNN table
+  VEC0_METADATA_COLUMN_KIND_DICTIONARY,
   // future: blob, date, datetime
 } vec0_metadata_column_kind;
 
 /**
  * @brief Parse an argv[i] entry of a vec0 virtual table definition, and see if
- * it's an metadata column definition, ie `[name] [type]` like `is_released boolean`
+ * it's an metadata column definition, ie `[name] [type]` like `is_released boolean`,
+ * or `[name] text dictionary` for a dictionary-encoded TEXT column. Either can
+ * be followed by `indexed`, ie `author_id integer indexed`.
  *
  * @param source: argv[i] source string
  * @param source_length: length of the source string
@@ -2244,12 +2270,14 @@ typedef enum {
  * as source, points to specific char *
  * @param out_column_name_length: Length of out_column_name in bytes
  * @param out_column_type: one of vec0_metadata_column_kind
+ * @param out_indexed: 1 if the column was declared `indexed`, 0 otherwise
  * @return int: SQLITE_EMPTY if not an metadata column, SQLITE_OK if it is.
  */
 int vec0_parse_metadata_column_definition(const char *source, int source_length,
                                  char **out_column_name,
                                  int *out_column_name_length,
-                                 vec0_metadata_column_kind *out_column_type) {
+                                 vec0_metadata_column_kind *out_column_type,
+                                 int *out_indexed) {
   struct Vec0Scanner scanner;
   struct Vec0Token token;
   char *column_name;
@@ -2287,9 +2315,25 @@ int vec0_parse_metadata_column_definition(const char *source, int source_length,
     return SQLITE_EMPTY;
   }
 
+  int indexed = 0;
+  while (vec0_scanner_next(&scanner, &token) == VEC0_TOKEN_RESULT_SOME &&
+         token.token_type == TOKEN_TYPE_IDENTIFIER) {
+    t = token.start;
+    n = token.end - token.start;
+    if (column_type == VEC0_METADATA_COLUMN_KIND_TEXT &&
+        sqlite3_strnicmp(t, "dictionary", n) == 0) {
+      column_type = VEC0_METADATA_COLUMN_KIND_DICTIONARY;
+    } else if (n == 7 && sqlite3_strnicmp(t, "indexed", n) == 0) {
+      indexed = 1;
+    } else {
+      break;
+    }
+  }
+
   *out_column_name = column_name;
   *out_column_name_length = column_name_length;
   *out_column_type = column_type;
+  *out_indexed = indexed;
 
   return SQLITE_OK;
 }
@@ -2377,12 +2421,79 @@ enum Vec0DistanceMetrics {
   VEC0_DISTANCE_METRIC_L1 = 3,
 };
 
+enum Vec0IndexType {
+  // brute-force scan over every chunk, the default
+  VEC0_INDEX_TYPE_FLAT = 1,
+  // inverted file index, `indexed_by=ivf(nlist=N, nprobe=M)`
+  VEC0_INDEX_TYPE_IVF = 2,
+  // HNSW graph, `indexed_by=hnsw(m=16, ef_construction=200, ef_search=64)`
+  VEC0_INDEX_TYPE_HNSW = 3,
+  // Vamana graph stored in shadow tables, navigated with PQ codes,
+  // `indexed_by=diskann(r=32, l=100, l_search=64, pq=16)`
+  VEC0_INDEX_TYPE_DISKANN = 4,
+};
+
+#define VEC0_IVF_DEFAULT_NLIST 128
+#define VEC0_IVF_DEFAULT_NPROBE 8
+#define VEC0_IVF_MAX_NLIST 65536
+
+struct Vec0IvfDefinition {
+  // number of lists (k-means centroids) to train
+  int nlist;
+  // number of nearest lists probed by a KNN query, unless overriden by the
+  // `nprobe` hidden column
+  int nprobe;
+};
+
+#define VEC0_HNSW_DEFAULT_M 16
+#define VEC0_HNSW_DEFAULT_EF_CONSTRUCTION 200
+#define VEC0_HNSW_DEFAULT_EF_SEARCH 64
+#define VEC0_HNSW_MAX_M 128
+#define VEC0_HNSW_MAX_EF 4096
+
+struct Vec0HnswDefinition {
+  // max number of neighbors per node on layers above 0, 2*m on layer 0
+  int m;
+  // size of the dynamic candidate list when inserting
+  int ef_construction;
+  // size of the dynamic candidate list of a KNN query, unless overriden by
+  // the `ef_search` hidden column
+  int ef_search;
+};
+
+#define VEC0_DISKANN_DEFAULT_R 32
+#define VEC0_DISKANN_DEFAULT_L 100
+#define VEC0_DISKANN_DEFAULT_L_SEARCH 64
+#define VEC0_DISKANN_MAX_R 256
+#define VEC0_DISKANN_MAX_L 4096
+#define VEC0_DISKANN_MAX_PQ 256
+
+struct Vec0DiskannDefinition {
+  // max number of out-neighbors per node
+  int r;
+  // size of the search list when inserting
+  int l;
+  // size of the search list of a KNN query, unless overriden by the
+  // `ef_search` hidden column
+  int l_search;
+  // number of PQ subspaces, one byte code per subspace. 0 until parsed means
+  // dimensions / 4
+  int pq;
+};
+
 struct VectorColumnDefinition {
   char *name;
   int name_length;
   size_t dimensions;
   enum VectorElementType element_type;
   enum Vec0DistanceMetrics distance_metric;
+  enum Vec0IndexType index_type;
+  // only set when index_type is VEC0_INDEX_TYPE_IVF
+  struct Vec0IvfDefinition ivf;
+  // only set when index_type is VEC0_INDEX_TYPE_HNSW
+  struct Vec0HnswDefinition hnsw;
+  // only set when index_type is VEC0_INDEX_TYPE_DISKANN
+  struct Vec0DiskannDefinition diskann;
 };
 
 struct Vec0PartitionColumnDefinition {
@@ -2400,6 +2511,8 @@ struct Vec0MetadataColumnDefinition {
   vec0_metadata_column_kind kind;
   char * name;
   int name_length;
+  // declared `indexed`, with a _metadataindexNN bitmap index
+  int indexed;
 };
 
 size_t vector_byte_size(enum VectorElementType element_type,
@@ -2419,6 +2532,128 @@ size_t vector_column_byte_size(struct VectorColumnDefinition column) {
   return vector_byte_size(column.element_type, column.dimensions);
 }
 
+/**
+ * @brief Parse the parameter list of an index definition, ie the
+ * `(nlist=128, nprobe=8)` in `indexed_by=ivf(nlist=128, nprobe=8)` or the
+ * `(m=16)` in `indexed_by=hnsw(m=16)`. The scanner must be positioned right
+ * before the optional `(`.
+ *
+ * @param scanner scanner over the column definition
+ * @param column column being defined, which index_type is already set
+ * @return int SQLITE_OK on success, SQLITE_ERROR on unknown or invalid
+ * parameters.
+ */
+static int vec0_parse_index_parameters(struct Vec0Scanner *scanner,
+                                       struct VectorColumnDefinition *column) {
+  struct Vec0Scanner peek = *scanner;
+  struct Vec0Token token;
+  int rc = vec0_scanner_next(&peek, &token);
+  if (rc != VEC0_TOKEN_RESULT_SOME || token.token_type != TOKEN_TYPE_LPAREN) {
+    // no parameters, use the defaults
+    return SQLITE_OK;
+  }
+  *scanner = peek;
+
+  while (1) {
+    rc = vec0_scanner_next(scanner, &token);
+    if (rc != VEC0_TOKEN_RESULT_SOME) {
+      return SQLITE_ERROR;
+    }
+    if (token.token_type == TOKEN_TYPE_RPAREN) {
+      break;
+    }
+    if (token.token_type != TOKEN_TYPE_IDENTIFIER) {
+      return SQLITE_ERROR;
+    }
+    char *key = token.start;
+    int keyLength = token.end - token.start;
+
+    rc = vec0_scanner_next(scanner, &token);
+    if (rc != VEC0_TOKEN_RESULT_SOME || token.token_type != TOKEN_TYPE_EQ) {
+      return SQLITE_ERROR;
+    }
+    rc = vec0_scanner_next(scanner, &token);
+    if (rc != VEC0_TOKEN_RESULT_SOME || token.token_type != TOKEN_TYPE_DIGIT) {
+      return SQLITE_ERROR;
+    }
+    errno = 0;
+    char *endptr;
+    long value = strtol(token.start, &endptr, 10);
+    if (errno == ERANGE || endptr != token.end || value <= 0 ||
+        value > INT_MAX) {
+      return SQLITE_ERROR;
+    }
+
+    if (column->index_type == VEC0_INDEX_TYPE_IVF && keyLength == 5 &&
+        sqlite3_strnicmp(key, "nlist", 5) == 0) {
+      if (value > VEC0_IVF_MAX_NLIST) {
+        return SQLITE_ERROR;
+      }
+      column->ivf.nlist = (int)value;
+    } else if (column->index_type == VEC0_INDEX_TYPE_IVF && keyLength == 6 &&
+               sqlite3_strnicmp(key, "nprobe", 6) == 0) {
+      column->ivf.nprobe = (int)value;
+    } else if (column->index_type == VEC0_INDEX_TYPE_HNSW && keyLength == 1 &&
+               sqlite3_strnicmp(key, "m", 1) == 0) {
+      if (value < 2 || value > VEC0_HNSW_MAX_M) {
+        return SQLITE_ERROR;
+      }
+      column->hnsw.m = (int)value;
+    } else if (column->index_type == VEC0_INDEX_TYPE_HNSW &&
+               keyLength == 15 &&
+               sqlite3_strnicmp(key, "ef_construction", 15) == 0) {
+      if (value > VEC0_HNSW_MAX_EF) {
+        return SQLITE_ERROR;
+      }
+      column->hnsw.ef_construction = (int)value;
+    } else if (column->index_type == VEC0_INDEX_TYPE_HNSW && keyLength == 9 &&
+               sqlite3_strnicmp(key, "ef_search", 9) == 0) {
+      if (value > VEC0_HNSW_MAX_EF) {
+        return SQLITE_ERROR;
+      }
+      column->hnsw.ef_search = (int)value;
+    } else if (column->index_type == VEC0_INDEX_TYPE_DISKANN &&
+               keyLength == 1 && sqlite3_strnicmp(key, "r", 1) == 0) {
+      if (value < 2 || value > VEC0_DISKANN_MAX_R) {
+        return SQLITE_ERROR;
+      }
+      column->diskann.r = (int)value;
+    } else if (column->index_type == VEC0_INDEX_TYPE_DISKANN &&
+               keyLength == 1 && sqlite3_strnicmp(key, "l", 1) == 0) {
+      if (value > VEC0_DISKANN_MAX_L) {
+        return SQLITE_ERROR;
+      }
+      column->diskann.l = (int)value;
+    } else if (column->index_type == VEC0_INDEX_TYPE_DISKANN &&
+               keyLength == 8 && sqlite3_strnicmp(key, "l_search", 8) == 0) {
+      if (value > VEC0_DISKANN_MAX_L) {
+        return SQLITE_ERROR;
+      }
+      column->diskann.l_search = (int)value;
+    } else if (column->index_type == VEC0_INDEX_TYPE_DISKANN &&
+               keyLength == 2 && sqlite3_strnicmp(key, "pq", 2) == 0) {
+      if (value > VEC0_DISKANN_MAX_PQ) {
+        return SQLITE_ERROR;
+      }
+      column->diskann.pq = (int)value;
+    } else {
+      return SQLITE_ERROR;
+    }
+
+    rc = vec0_scanner_next(scanner, &token);
+    if (rc != VEC0_TOKEN_RESULT_SOME) {
+      return SQLITE_ERROR;
+    }
+    if (token.token_type == TOKEN_TYPE_RPAREN) {
+      break;
+    }
+    if (token.token_type != TOKEN_TYPE_COMMA) {
+      return SQLITE_ERROR;
+    }
+  }
+  return SQLITE_OK;
+}
+
 /**
  * @brief Parse an vec0 vtab argv[i] column definition and see if
  * it's a vector column defintion, ex `contents_embedding float[768]`.
@@ -2443,13 +2678,16 @@ int vec0_parse_vector_column(const char *source, int source_length,
   enum VectorElementType elementType;
   enum Vec0DistanceMetrics distanceMetric = VEC0_DISTANCE_METRIC_L2;
   int dimensions;
+  struct VectorColumnDefinition index;
+  memset(&index, 0, sizeof(index));
+  index.index_type = VEC0_INDEX_TYPE_FLAT;
 
   vec0_scanner_init(&scanner, source, source_length);
 
   // starts with an identifier
   rc = vec0_scanner_next(&scanner, &token);
 
-  if (rc != VEC0_TOKEN_RESULT_SOME &&
+  if (rc != VEC0_TOKEN_RESULT_SOME ||
       token.token_type != TOKEN_TYPE_IDENTIFIER) {
     return SQLITE_EMPTY;
   }
@@ -2549,12 +2787,73 @@ int vec0_parse_vector_column(const char *source, int source_length,
         return SQLITE_ERROR;
       }
     }
+    else if (keyLength == 10 && sqlite3_strnicmp(key, "indexed_by", 10) == 0) {
+      rc = vec0_scanner_next(&scanner, &token);
+      if (rc != VEC0_TOKEN_RESULT_SOME || token.token_type != TOKEN_TYPE_EQ) {
+        return SQLITE_ERROR;
+      }
+      rc = vec0_scanner_next(&scanner, &token);
+      if (rc != VEC0_TOKEN_RESULT_SOME ||
+          token.token_type != TOKEN_TYPE_IDENTIFIER) {
+        return SQLITE_ERROR;
+      }
+      char *value = token.start;
+      int valueLength = token.end - token.start;
+      if (valueLength == 4 && sqlite3_strnicmp(value, "flat", 4) == 0) {
+        index.index_type = VEC0_INDEX_TYPE_FLAT;
+      } else if (valueLength == 3 && sqlite3_strnicmp(value, "ivf", 3) == 0) {
+        // bit vectors are compared with hamming distance, which k-means
+        // centroids don't support
+        if (elementType == SQLITE_VEC_ELEMENT_TYPE_BIT) {
+          return SQLITE_ERROR;
+        }
+        index.index_type = VEC0_INDEX_TYPE_IVF;
+        index.ivf.nlist = VEC0_IVF_DEFAULT_NLIST;
+        index.ivf.nprobe = VEC0_IVF_DEFAULT_NPROBE;
+      } else if (valueLength == 4 && sqlite3_strnicmp(value, "hnsw", 4) == 0) {
+        index.index_type = VEC0_INDEX_TYPE_HNSW;
+        index.hnsw.m = VEC0_HNSW_DEFAULT_M;
+        index.hnsw.ef_construction = VEC0_HNSW_DEFAULT_EF_CONSTRUCTION;
+        index.hnsw.ef_search = VEC0_HNSW_DEFAULT_EF_SEARCH;
+      } else if (valueLength == 7 &&
+                 sqlite3_strnicmp(value, "diskann", 7) == 0) {
+        // PQ codebooks are k-means centroids too
+        if (elementType == SQLITE_VEC_ELEMENT_TYPE_BIT) {
+          return SQLITE_ERROR;
+        }
+        index.index_type = VEC0_INDEX_TYPE_DISKANN;
+        index.diskann.r = VEC0_DISKANN_DEFAULT_R;
+        index.diskann.l = VEC0_DISKANN_DEFAULT_L;
+        index.diskann.l_search = VEC0_DISKANN_DEFAULT_L_SEARCH;
+      } else {
+        return SQLITE_ERROR;
+      }
+      rc = vec0_parse_index_parameters(&scanner, &index);
+      if (rc != SQLITE_OK) {
+        return SQLITE_ERROR;
+      }
+    }
     // unknown key
     else {
       return SQLITE_ERROR;
     }
   }
 
+  if (index.index_type == VEC0_INDEX_TYPE_DISKANN) {
+    if (index.diskann.pq == 0) {
+      index.diskann.pq = dimensions / 4;
+      if (index.diskann.pq < 1) {
+        index.diskann.pq = 1;
+      }
+      if (index.diskann.pq > VEC0_DISKANN_MAX_PQ) {
+        index.diskann.pq = VEC0_DISKANN_MAX_PQ;
+      }
+    }
+    if (index.diskann.pq > dimensions) {
+      return SQLITE_ERROR;
+    }
+  }
+
   outColumn->name = sqlite3_mprintf("%.*s", nameLength, name);
   if (!outColumn->name) {
     return SQLITE_ERROR;
@@ -2563,6 +2862,10 @@ int vec0_parse_vector_column(const char *source, int source_length,
   outColumn->distance_metric = distanceMetric;
   outColumn->element_type = elementType;
   outColumn->dimensions = dimensions;
+  outColumn->index_type = index.index_type;
+  outColumn->ivf = index.ivf;
+  outColumn->hnsw = index.hnsw;
+  outColumn->diskann = index.diskann;
   return SQLITE_OK;
 }
 
@@ -3521,6 +3824,15 @@ static sqlite3_module vec_npy_eachModule = {
 #define VEC0_COLUMN_OFFSET_K 2
 #define VEC0_COLUMN_OFFSET_TABLE_NAME 3
 #define VEC0_COLUMN_OFFSET_MMR_LAMBDA 4
+#define VEC0_COLUMN_OFFSET_NPROBE 5
+#define VEC0_COLUMN_OFFSET_EF_SEARCH 6
+#define VEC0_COLUMN_OFFSET_PAGE_TOKEN 7
+#define VEC0_COLUMN_OFFSET_WEIGHTS 8
+#define VEC0_COLUMN_OFFSET_K_PER_PARTITION 9
+#define VEC0_COLUMN_OFFSET_MAX_CHUNKS 10
+#define VEC0_COLUMN_OFFSET_TIME_BUDGET_MS 11
+#define VEC0_COLUMN_OFFSET_EXACT 12
+#define VEC0_COLUMN_OFFSET_FILTER 13
 
 #define VEC0_SHADOW_INFO_NAME "\"%w\".\"%w_info\""
 
@@ -3534,6 +3846,23 @@ static sqlite3_module vec_npy_eachModule = {
   "rowids BLOB NOT NULL"                                                       \
   ");"
 
+// Index on the partition key columns of the _chunks shadow table
+#define VEC0_SHADOW_CHUNKS_PARTITIONS_INDEX_NAME "\"%w\".\"%w_chunks_partitions\""
+
+// Chunks with free offsets and an upper bound of how many, see
+// vec0_free_chunks_set()
+#define VEC0_SHADOW_FREE_CHUNKS_NAME "\"%w\".\"%w_free_chunks\""
+// Index on the partition key columns and free count of _free_chunks
+#define VEC0_SHADOW_FREE_CHUNKS_INDEX_NAME "\"%w\".\"%w_free_chunks_free\""
+
+// Rows not merged into chunks yet, only with `delta_size=N`. See
+// vec0_create_delta() for its columns.
+#define VEC0_SHADOW_DELTA_NAME "\"%w\".\"%w_delta\""
+
+// chunk_id of the rows in _delta: their _rowids position is NULL, and KNN
+// queries scan them as one more chunk with this id
+#define VEC0_DELTA_CHUNK_ID -1
+
 #define VEC0_SHADOW_ROWIDS_NAME "\"%w\".\"%w_rowids\""
 /// 1) schema, 2) original vtab table name
 #define VEC0_SHADOW_ROWIDS_CREATE_BASIC                                        \
@@ -3565,11 +3894,133 @@ static sqlite3_module vec_npy_eachModule = {
   "vectors BLOB NOT NULL"                                                      \
   ");"
 
+/// 1) schema, 2) original vtab table name, 3) vector column index
+#define VEC0_SHADOW_VECTOR_SUMMARY_N_NAME "\"%w\".\"%w_vector_summaries%02d\""
+
+/// Per-chunk summary of a vector column, only created with `chunk_summaries=true`.
+/// rowid is the chunk_id. centroid/lo/hi are float32 blobs of `dimensions`
+/// entries, radius is the max L2 distance of any vector in the chunk to the
+/// centroid. All are NULL while count is 0.
+#define VEC0_SHADOW_VECTOR_SUMMARY_N_CREATE                                    \
+  "CREATE TABLE " VEC0_SHADOW_VECTOR_SUMMARY_N_NAME "("                        \
+  "rowid INTEGER PRIMARY KEY,"                                                 \
+  "count INTEGER NOT NULL,"                                                    \
+  "radius REAL,"                                                               \
+  "centroid BLOB,"                                                             \
+  "lo BLOB,"                                                                   \
+  "hi BLOB"                                                                    \
+  ");"
+
+/// 1) schema, 2) original vtab table name, 3) vector column index
+#define VEC0_SHADOW_IVF_CENTROIDS_N_NAME "\"%w\".\"%w_ivf_centroids%02d\""
+
+/// Trained k-means centroids of an `indexed_by=ivf` vector column. rowid is
+/// the list id, from 0 to nlist-1. centroid is a float32 blob of `dimensions`
+/// entries.
+#define VEC0_SHADOW_IVF_CENTROIDS_N_CREATE                                     \
+  "CREATE TABLE " VEC0_SHADOW_IVF_CENTROIDS_N_NAME "("                         \
+  "rowid INTEGER PRIMARY KEY,"                                                 \
+  "centroid BLOB NOT NULL"                                                     \
+  ");"
+
+/// 1) schema, 2) original vtab table name, 3) vector column index
+#define VEC0_SHADOW_IVF_LISTS_N_NAME "\"%w\".\"%w_ivf_lists%02d\""
+
+/// List membership of an `indexed_by=ivf` vector column: rowid is the rowid of
+/// the vec0 row, list_id the rowid of its nearest centroid. The UNIQUE
+/// constraint is only there for its automatic (list_id, rowid) index, which
+/// unlike a named index follows the table on ALTER TABLE RENAME.
+#define VEC0_SHADOW_IVF_LISTS_N_CREATE                                         \
+  "CREATE TABLE " VEC0_SHADOW_IVF_LISTS_N_NAME "("                             \
+  "rowid INTEGER PRIMARY KEY,"                                                 \
+  "list_id INTEGER NOT NULL,"                                                  \
+  "UNIQUE (list_id, rowid)"                                                    \
+  ");"
+
+/// 1) schema, 2) original vtab table name, 3) vector column index
+#define VEC0_SHADOW_HNSW_NODES_N_NAME "\"%w\".\"%w_hnsw_nodes%02d\""
+
+/// Nodes of the HNSW graph of an `indexed_by=hnsw` vector column. rowid is the
+/// rowid of the vec0 row, level its top layer. neighbors packs, for every
+/// layer from 0 to level, a 32-bit neighbor count followed by that many
+/// 64-bit neighbor rowids.
+#define VEC0_SHADOW_HNSW_NODES_N_CREATE                                        \
+  "CREATE TABLE " VEC0_SHADOW_HNSW_NODES_N_NAME "("                            \
+  "rowid INTEGER PRIMARY KEY,"                                                 \
+  "level INTEGER NOT NULL,"                                                    \
+  "neighbors BLOB NOT NULL"                                                    \
+  ");"
+
+/// 1) schema, 2) original vtab table name, 3) vector column index
+#define VEC0_SHADOW_DISKANN_NEIGHBORS_N_NAME                                   \
+  "\"%w\".\"%w_diskann_neighbors%02d\""
+
+/// Adjacency of the Vamana graph of an `indexed_by=diskann` vector column,
+/// one row per chunk: rowid is the chunk_id, neighbors holds chunk_size lists
+/// of r + 1 64-bit values, a neighbor count followed by the neighbors' slots
+/// (chunk_id * chunk_size + chunk_offset).
+#define VEC0_SHADOW_DISKANN_NEIGHBORS_N_CREATE                                 \
+  "CREATE TABLE " VEC0_SHADOW_DISKANN_NEIGHBORS_N_NAME "("                     \
+  "rowid INTEGER PRIMARY KEY,"                                                 \
+  "neighbors BLOB NOT NULL"                                                    \
+  ");"
+
+/// 1) schema, 2) original vtab table name, 3) vector column index
+#define VEC0_SHADOW_DISKANN_CODES_N_NAME "\"%w\".\"%w_diskann_codes%02d\""
+
+/// PQ codes of an `indexed_by=diskann` vector column, one row per chunk:
+/// rowid is the chunk_id, codes holds chunk_size codes of pq bytes.
+#define VEC0_SHADOW_DISKANN_CODES_N_CREATE                                     \
+  "CREATE TABLE " VEC0_SHADOW_DISKANN_CODES_N_NAME "("                         \
+  "rowid INTEGER PRIMARY KEY,"                                                 \
+  "codes BLOB NOT NULL"                                                        \
+  ");"
+
 #define VEC0_SHADOW_AUXILIARY_NAME "\"%w\".\"%w_auxiliary\""
 
 #define VEC0_SHADOW_METADATA_N_NAME "\"%w\".\"%w_metadatachunks%02d\""
 #define VEC0_SHADOW_METADATA_TEXT_DATA_NAME "\"%w\".\"%w_metadatatext%02d\""
 
+/// 1) schema, 2) original vtab table name, 3) metadata column index
+#define VEC0_SHADOW_METADATA_DICT_N_NAME "\"%w\".\"%w_metadatadict%02d\""
+
+/// Values of a dictionary-encoded TEXT metadata column. Rows store the code of
+/// their value, codes start at 1 and are never reused.
+#define VEC0_SHADOW_METADATA_DICT_N_CREATE                                     \
+  "CREATE TABLE " VEC0_SHADOW_METADATA_DICT_N_NAME "("                         \
+  "code INTEGER PRIMARY KEY,"                                                  \
+  "value TEXT NOT NULL UNIQUE"                                                 \
+  ");"
+
+/// 1) schema, 2) original vtab table name, 3) metadata column index
+#define VEC0_SHADOW_METADATA_ZONES_N_NAME "\"%w\".\"%w_metadatazones%02d\""
+
+/// Per-chunk zone map of a metadata column, only created with
+/// `chunk_summaries=true`. rowid is the chunk_id, lo/hi the smallest and
+/// largest value written to the chunk, 0/1 for BOOLEAN columns. Both are NULL
+/// once the chunk holds a NaN or a TEXT value longer than its inline view.
+#define VEC0_SHADOW_METADATA_ZONES_N_CREATE                                    \
+  "CREATE TABLE " VEC0_SHADOW_METADATA_ZONES_N_NAME "("                        \
+  "rowid INTEGER PRIMARY KEY,"                                                 \
+  "lo,"                                                                        \
+  "hi"                                                                         \
+  ");"
+
+/// 1) schema, 2) original vtab table name, 3) metadata column index
+#define VEC0_SHADOW_METADATA_INDEX_N_NAME "\"%w\".\"%w_metadataindex%02d\""
+
+/// Bitmap index of a metadata column declared `indexed`: one row per value and
+/// chunk holding it, slots is the chunk_size bitmap of the chunk positions
+/// with that value. TEXT values are stored in full, dictionary-encoded columns
+/// store codes.
+#define VEC0_SHADOW_METADATA_INDEX_N_CREATE                                    \
+  "CREATE TABLE " VEC0_SHADOW_METADATA_INDEX_N_NAME "("                        \
+  "value NOT NULL,"                                                            \
+  "chunk_id INTEGER NOT NULL,"                                                 \
+  "slots BLOB NOT NULL,"                                                       \
+  "PRIMARY KEY (value, chunk_id)"                                              \
+  ") WITHOUT ROWID;"
+
 #define VEC_INTERAL_ERROR "Internal sqlite-vec error: "
 #define REPORT_URL "https://github.com/asg017/sqlite-vec/issues/new"
 
@@ -3598,6 +4049,367 @@ typedef enum {
   SQLITE_VEC0_USER_COLUMN_KIND_METADATA = 4,
 } vec0_user_column_kind;
 
+/**
+ * In-memory copy of the trained centroids of an `indexed_by=ivf` vector
+ * column, loaded lazily from the _ivf_centroidsNN shadow table. Validated
+ * against the IVF_GENERATION_NN key in the _info shadow table, which is bumped
+ * every time the index is trained.
+ */
+struct Vec0IvfCentroids {
+  // 1 if centroids/nlist/generation reflect the shadow tables
+  int loaded;
+  // value of the IVF_GENERATION_NN _info key when loaded, 0 if never trained
+  i64 generation;
+  // number of trained lists, 0 when the index hasn't been trained yet.
+  int nlist;
+  // nlist * dimensions float32 values. Must be freed with sqlite3_free()
+  f32 *centroids;
+};
+
+/**
+ * A hash map of i64 keys to pointers, with open addressing. A NULL value marks
+ * an empty slot, so NULL values can't be stored.
+ */
+struct Vec0I64Map {
+  i64 *keys;
+  void **values;
+  // always a power of 2, or 0 before the first insert
+  size_t capacity;
+  size_t size;
+};
+
+static size_t vec0_i64_map_slot(const struct Vec0I64Map *map, i64 key) {
+  u64 h = (u64)key * 0x9E3779B97F4A7C15ULL;
+  return (size_t)(h ^ (h >> 32)) & (map->capacity - 1);
+}
+
+void *vec0_i64_map_get(const struct Vec0I64Map *map, i64 key) {
+  if (map->capacity == 0) {
+    return NULL;
+  }
+  for (size_t i = vec0_i64_map_slot(map, key);; i = (i + 1) & (map->capacity - 1)) {
+    if (!map->values[i]) {
+      return NULL;
+    }
+    if (map->keys[i] == key) {
+      return map->values[i];
+    }
+  }
+}
+
+/**
+ * @brief Insert or replace the value of a key.
+ *
+ * @return int SQLITE_OK on success, SQLITE_NOMEM when the map couldn't grow
+ */
+int vec0_i64_map_put(struct Vec0I64Map *map, i64 key, void *value) {
+  assert(value);
+  if ((map->size + 1) * 4 > map->capacity * 3) {
+    struct Vec0I64Map grown;
+    grown.capacity = map->capacity ? map->capacity * 2 : 64;
+    grown.size = 0;
+    grown.keys = sqlite3_malloc64(grown.capacity * sizeof(i64));
+    grown.values = sqlite3_malloc64(grown.capacity * sizeof(void *));
+    if (!grown.keys || !grown.values) {
+      sqlite3_free(grown.keys);
+      sqlite3_free(grown.values);
+      return SQLITE_NOMEM;
+    }
+    memset(grown.values, 0, grown.capacity * sizeof(void *));
+    for (size_t i = 0; i < map->capacity; i++) {
+      if (map->values[i]) {
+        vec0_i64_map_put(&grown, map->keys[i], map->values[i]);
+      }
+    }
+    sqlite3_free(map->keys);
+    sqlite3_free(map->values);
+    *map = grown;
+  }
+  size_t i = vec0_i64_map_slot(map, key);
+  while (map->values[i] && map->keys[i] != key) {
+    i = (i + 1) & (map->capacity - 1);
+  }
+  if (!map->values[i]) {
+    map->size++;
+  }
+  map->keys[i] = key;
+  map->values[i] = value;
+  return SQLITE_OK;
+}
+
+/**
+ * @brief Remove a key, returning its value or NULL if it wasn't in the map.
+ */
+void *vec0_i64_map_remove(struct Vec0I64Map *map, i64 key) {
+  if (map->capacity == 0) {
+    return NULL;
+  }
+  size_t i = vec0_i64_map_slot(map, key);
+  while (map->values[i] && map->keys[i] != key) {
+    i = (i + 1) & (map->capacity - 1);
+  }
+  void *value = map->values[i];
+  if (!value) {
+    return NULL;
+  }
+  map->values[i] = NULL;
+  map->size--;
+  // re-insert the rest of the probe run, so lookups don't stop early
+  for (size_t j = (i + 1) & (map->capacity - 1); map->values[j];
+       j = (j + 1) & (map->capacity - 1)) {
+    i64 k = map->keys[j];
+    void *v = map->values[j];
+    map->values[j] = NULL;
+    map->size--;
+    vec0_i64_map_put(map, k, v);
+  }
+  return value;
+}
+
+/**
+ * @brief Free the map's memory, calling free_value() on every value first if
+ * provided.
+ */
+void vec0_i64_map_clear(struct Vec0I64Map *map, void (*free_value)(void *)) {
+  if (free_value) {
+    for (size_t i = 0; i < map->capacity; i++) {
+      if (map->values[i]) {
+        free_value(map->values[i]);
+      }
+    }
+  }
+  sqlite3_free(map->keys);
+  sqlite3_free(map->values);
+  memset(map, 0, sizeof(*map));
+}
+
+/**
+ * A node of an HNSW graph, as cached in memory. Allocated as a single block
+ * by vec0_hnsw_node_new(), so a single sqlite3_free() releases it.
+ */
+struct Vec0HnswNode {
+  i64 rowid;
+  // top layer of the node
+  int level;
+  // position of the node's row, used to evaluate KNN filters
+  i64 chunk_id;
+  i64 chunk_offset;
+  // search tag of the last search that visited this node
+  u32 visited;
+  // 1 if the neighbors changed and weren't written to _hnsw_nodesNN yet
+  int dirty;
+  // level + 1 neighbor counts and lists. The list of layer 0 has room for
+  // 2*m + 1 neighbors, the others m + 1.
+  int *counts;
+  i64 **neighbors;
+  // copy of the vector, in the column's element type
+  void *vector;
+};
+
+/**
+ * In-memory state of the HNSW graph of an `indexed_by=hnsw` vector column.
+ * Validated against the HNSW_GENERATION_NN key in the _info shadow table,
+ * which every write to the graph bumps.
+ */
+struct Vec0HnswGraph {
+  // 1 if entrypoint/maxLevel/generation reflect the shadow tables
+  int loaded;
+  i64 generation;
+  // rowid of the entry point, only valid when the graph isn't empty
+  i64 entrypoint;
+  // top layer of the graph, -1 when the graph is empty
+  int maxLevel;
+  // tag of the current search, see Vec0HnswNode.visited
+  u32 searchTag;
+  // rowid -> struct Vec0HnswNode *, loaded lazily
+  struct Vec0I64Map nodes;
+  sqlite3_stmt *stmtNodeRead;
+  sqlite3_stmt *stmtNodeWrite;
+};
+
+/**
+ * In-memory state of the Vamana graph of an `indexed_by=diskann` vector
+ * column: only the PQ codebook and codes stay resident, adjacency and full
+ * vectors are read from the shadow tables. Validated against the
+ * DISKANN_GENERATION_NN key in the _info shadow table, which every write to
+ * the graph bumps.
+ */
+struct Vec0DiskannIndex {
+  // 1 if medoid/codebook/generation reflect the shadow tables
+  int loaded;
+  i64 generation;
+  // slot of the entry point, -1 when the graph is empty
+  i64 medoid;
+  // centroids per PQ subspace, 0 until trained by 'optimize'
+  int ksub;
+  // ksub centroids of every subspace, full-width: the centroid c of subspace
+  // i is at codebook[c * dimensions + start of i]
+  f32 *codebook;
+  // chunk_id -> u8 codes[chunk_size * pq], loaded lazily
+  struct Vec0I64Map codes;
+};
+
+/**
+ * Position of a row in the (distance, rowid) order of paged KNN results.
+ * A page resumes with the rows strictly after the bound.
+ */
+struct Vec0KnnPageBound {
+  f32 distance;
+  i64 rowid;
+};
+
+/**
+ * A fused KNN query, with MATCH constraints on more than one vector column
+ * and a `weights` constraint. A row's distance is the weighted sum of its
+ * distances on every matched column. weight applies to the vector column of
+ * idxNum, the others are listed in declaration order.
+ */
+struct Vec0KnnFusion {
+  f32 weight;
+  int n;
+  int vectorColumnIdxs[VEC0_MAX_VECTOR_COLUMNS];
+  void *queryVectors[VEC0_MAX_VECTOR_COLUMNS];
+  vector_cleanup queryVectorCleanups[VEC0_MAX_VECTOR_COLUMNS];
+  f32 weights[VEC0_MAX_VECTOR_COLUMNS];
+};
+
+/**
+ * Limits of a KNN chunk scan with `max_chunks` or `time_budget_ms`
+ * constraints. The scan stops before the first chunk past either one, and the
+ * rows found so far are the result.
+ */
+struct Vec0KnnBudget {
+  // most chunks to read vectors from, -1 for no limit
+  i64 maxChunks;
+  // vec0_now_ms() time after which no more chunks are read, 0 for no limit
+  sqlite3_int64 deadline;
+  // output: 1 if the scan stopped with chunks left
+  int exhausted;
+};
+
+// Number of paged KNN queries whose results a vec0 table keeps around
+#define VEC0_KNN_PAGE_CACHE_SIZE 4
+
+/**
+ * Live row, chunk and partition counts of a vec0 table, which vec0BestIndex()
+ * turns into plan costs. Persisted in the STATS_* keys of the _info shadow
+ * table on xSync, and re-read when another connection changed the table.
+ */
+struct Vec0TableStats {
+  // 1 if the counts below are known for the current transaction
+  int loaded;
+  // 1 if the counts differ from the STATS_* keys in _info
+  int dirty;
+  i64 rows;
+  i64 chunks;
+  // number of distinct partition key values, at most 1 without partition keys
+  i64 partitions;
+};
+
+/**
+ * Results of a paged KNN query, ordered by (distance, rowid), kept so the
+ * next pages are served without rescanning. Holds every matching row after
+ * the start position up to the last one, or to the end when complete. Only
+ * valid while the table's write generation and the database's data version
+ * are unchanged.
+ */
+struct Vec0KnnPageCacheEntry {
+  // 0 if the entry is unused
+  int used;
+  // hash of the query vector and every constraint except k/page_token
+  u64 fingerprint;
+  u32 dataVersion;
+  i64 writeGeneration;
+  // 1 if the rows start after (startDistance, startRowid)
+  int hasStart;
+  f32 startDistance;
+  i64 startRowid;
+  i64 *rowids;
+  f32 *distances;
+  i64 n;
+  // 1 if no rows come after the last one
+  int complete;
+  // LRU clock of the last query served
+  i64 lastUsed;
+};
+
+/**
+ * Final rows of a KNN query, kept by tables declared with `result_cache=N`
+ * so identical queries are answered without a scan.
+ */
+struct Vec0KnnResultCacheEntry {
+  // k and the serialized query, see vec0_result_cache_key(). NULL if unused
+  char *key;
+  int nKey;
+  u64 hash;
+  i64 *rowids;
+  f32 *distances;
+  i64 n;
+  // value of the exact column for the rows
+  int exact;
+  // LRU clock of the last query served
+  i64 lastUsed;
+};
+
+// Most entries a `result_cache=N` table option allows
+#define VEC0_RESULT_CACHE_MAX_ENTRIES 4096
+// Memory budget of the result cache without `result_cache_bytes=N`
+#define VEC0_RESULT_CACHE_DEFAULT_BYTES (4 * 1024 * 1024)
+
+/**
+ * The chunk inserts of a partition go to, kept for the rest of the write
+ * transaction so inserts neither look it up nor read its validity bitmap, see
+ * vec0_write_chunk_position().
+ */
+struct Vec0WriteChunk {
+  i64 chunk_id;
+  sqlite3_value *partitionKeyValues[VEC0_MAX_PARTITION_COLUMNS];
+  // the chunk's validity bitmap, as written. NULL if the entry is unused
+  u8 *validity;
+  // no offset before it is free
+  i64 nextFree;
+  // LRU clock of the last insert
+  i64 lastUsed;
+  // 1 if deletes freed offsets of the chunk, so its _free_chunks count is
+  // written back
+  int freed;
+};
+
+#define VEC0_WRITE_CHUNK_CACHE_SIZE 16
+
+/**
+ * Rows of a bulk load (see 'bulk-begin') given a position in a chunk but not
+ * written to it yet. Vectors and rowids sit at their chunk offset and are
+ * written in runs of consecutive offsets, metadata chunks are read whole when
+ * the chunk is started and written back whole by vec0_bulk_flush().
+ */
+struct Vec0BulkChunk {
+  // chunk the buffered rows go to, -1 if no chunk is started
+  i64 chunk_id;
+  sqlite3_value *partitionKeyValues[VEC0_MAX_PARTITION_COLUMNS];
+  // the chunk's validity bitmap, with the bits of buffered rows set
+  u8 *validity;
+  // chunk offsets of the buffered rows, increasing
+  i64 *offsets;
+  i64 n;
+  // chunk_size entries each, indexed by chunk offset
+  i64 *rowids;
+  void *vectors[VEC0_MAX_VECTOR_COLUMNS];
+  u8 *metadata[VEC0_MAX_METADATA_COLUMNS];
+  int metadataSizes[VEC0_MAX_METADATA_COLUMNS];
+  // 1 while inside xUpdate or a flush, so savepoints opened by their own
+  // statements on shadow tables don't flush or discard the buffer
+  int busy;
+};
+
+/**
+ * vec0 tables open on a database connection. It is the client data of the
+ * vec0 module, so vec_result_cache_stats() can find a table by name.
+ */
+struct Vec0Connection {
+  vec0_vtab *tables;
+};
+
 struct vec0_vtab {
   sqlite3_vtab base;
 
@@ -3662,6 +4474,76 @@ struct vec0_vtab {
 
   int chunk_size;
 
+  // True if the table was declared with `chunk_summaries=true`. Maintains a
+  // _vector_summariesNN shadow table for every non-bit vector column, which
+  // KNN queries use to skip chunks that can't contain a top-k result.
+  int chunkSummaries;
+
+  // Rows a table declared with `delta_size=N` keeps in its _delta shadow table
+  // before they are merged into chunks, see vec0_delta_insert(). 0 without.
+  int deltaSize;
+
+  // Cached centroids of every `indexed_by=ivf` vector column, see
+  // vec0_ivf_load_centroids(). Cleared on rollback, since it may hold
+  // centroids trained in the rolled back transaction.
+  struct Vec0IvfCentroids ivfCentroids[VEC0_MAX_VECTOR_COLUMNS];
+
+  // Cached graphs of every `indexed_by=hnsw` vector column, see
+  // vec0_hnsw_load(). Cleared on rollback.
+  struct Vec0HnswGraph hnswGraphs[VEC0_MAX_VECTOR_COLUMNS];
+
+  // Cached PQ state of every `indexed_by=diskann` vector column, see
+  // vec0_diskann_load(). Cleared on rollback.
+  struct Vec0DiskannIndex diskannIndexes[VEC0_MAX_VECTOR_COLUMNS];
+
+  // Bumped on every write through this connection and on rollback, so paged
+  // KNN results cached in pageCache are never served over changed rows.
+  i64 writeGeneration;
+  struct Vec0KnnPageCacheEntry pageCache[VEC0_KNN_PAGE_CACHE_SIZE];
+  i64 pageCacheClock;
+
+  // Number of entries in resultCache, from the `result_cache=N` option. 0 if
+  // the table has no result cache. The entries are dropped as soon as
+  // writeGeneration or the data version differ from the ones they were
+  // filled at.
+  int resultCacheSize;
+  i64 resultCacheMaxBytes;
+  struct Vec0KnnResultCacheEntry *resultCache;
+  i64 resultCacheBytes;
+  i64 resultCacheWriteGeneration;
+  u32 resultCacheDataVersion;
+  i64 resultCacheClock;
+  i64 resultCacheHits;
+  i64 resultCacheMisses;
+
+  // see vec0_stats_load(). statsDataVersion is the data version stats were
+  // read or committed at, statsSavepoints[i] the stats when savepoint i began.
+  // statsStored are the counts in _info, not loaded if they may differ.
+  struct Vec0TableStats stats;
+  struct Vec0TableStats statsStored;
+  u32 statsDataVersion;
+  struct Vec0TableStats *statsSavepoints;
+  int nStatsSavepoints;
+
+  // buffered rows while a bulk load is on, NULL otherwise
+  struct Vec0BulkChunk *bulk;
+
+  // Chunks the inserts of the current write transaction go to, by partition.
+  // Dropped on xSync and rollbacks, and when optimize moves rows.
+  struct Vec0WriteChunk writeChunks[VEC0_WRITE_CHUNK_CACHE_SIZE];
+  i64 writeChunksClock;
+  // Offsets deletes freed in chunks outside writeChunks, by chunk_id, not yet
+  // added to _free_chunks. See vec0_free_chunks_pending_flush().
+  struct Vec0I64Map freedChunks;
+
+  // 1 if the _free_chunks shadow table exists, 0 if not (tables created
+  // before it, until optimize), -1 if not checked yet
+  int freeChunks;
+
+  // the connection's list of open vec0 tables this table is on, if any
+  struct Vec0Connection *connection;
+  vec0_vtab *nextOpen;
+
   // select latest chunk from _chunks, getting chunk_id
   sqlite3_stmt *stmtLatestChunk;
 
@@ -3724,17 +4606,157 @@ struct vec0_vtab {
  *
  * @param p vec0_vtab pointer
  */
-void vec0_free_resources(vec0_vtab *p) {
-  sqlite3_finalize(p->stmtLatestChunk);
-  p->stmtLatestChunk = NULL;
-  sqlite3_finalize(p->stmtRowidsInsertRowid);
-  p->stmtRowidsInsertRowid = NULL;
-  sqlite3_finalize(p->stmtRowidsInsertId);
+static void vec0_write_chunk_clear(struct Vec0WriteChunk *entry) {
+  for (int i = 0; i < VEC0_MAX_PARTITION_COLUMNS; i++) {
+    sqlite3_value_free(entry->partitionKeyValues[i]);
+    entry->partitionKeyValues[i] = NULL;
+  }
+  sqlite3_free(entry->validity);
+  entry->validity = NULL;
+  entry->freed = 0;
+}
+
+/**
+ * @brief Forget the chunks inserts go to, and the offsets deletes freed, after
+ * they may have changed other than through vec0Update().
+ */
+static void vec0_write_chunks_clear(vec0_vtab *p) {
+  for (int i = 0; i < VEC0_WRITE_CHUNK_CACHE_SIZE; i++) {
+    vec0_write_chunk_clear(&p->writeChunks[i]);
+  }
+  vec0_i64_map_clear(&p->freedChunks, NULL);
+}
+
+/**
+ * @brief Forget the rows buffered by a bulk load without writing them. The
+ * buffers are kept for the next chunk.
+ */
+static void vec0_bulk_discard(struct Vec0BulkChunk *bulk) {
+  for (int i = 0; i < VEC0_MAX_PARTITION_COLUMNS; i++) {
+    sqlite3_value_free(bulk->partitionKeyValues[i]);
+    bulk->partitionKeyValues[i] = NULL;
+  }
+  bulk->chunk_id = -1;
+  bulk->n = 0;
+}
+
+static void vec0_bulk_free(struct Vec0BulkChunk *bulk) {
+  if (!bulk) {
+    return;
+  }
+  vec0_bulk_discard(bulk);
+  sqlite3_free(bulk->validity);
+  sqlite3_free(bulk->offsets);
+  sqlite3_free(bulk->rowids);
+  for (int i = 0; i < VEC0_MAX_VECTOR_COLUMNS; i++) {
+    sqlite3_free(bulk->vectors[i]);
+  }
+  for (int i = 0; i < VEC0_MAX_METADATA_COLUMNS; i++) {
+    sqlite3_free(bulk->metadata[i]);
+  }
+  sqlite3_free(bulk);
+}
+
+void vec0_free_resources(vec0_vtab *p) {
+  sqlite3_finalize(p->stmtLatestChunk);
+  p->stmtLatestChunk = NULL;
+  sqlite3_finalize(p->stmtRowidsInsertRowid);
+  p->stmtRowidsInsertRowid = NULL;
+  sqlite3_finalize(p->stmtRowidsInsertId);
   p->stmtRowidsInsertId = NULL;
   sqlite3_finalize(p->stmtRowidsUpdatePosition);
   p->stmtRowidsUpdatePosition = NULL;
   sqlite3_finalize(p->stmtRowidsGetChunkPosition);
   p->stmtRowidsGetChunkPosition = NULL;
+  for (int i = 0; i < VEC0_MAX_VECTOR_COLUMNS; i++) {
+    sqlite3_finalize(p->hnswGraphs[i].stmtNodeRead);
+    p->hnswGraphs[i].stmtNodeRead = NULL;
+    sqlite3_finalize(p->hnswGraphs[i].stmtNodeWrite);
+    p->hnswGraphs[i].stmtNodeWrite = NULL;
+  }
+}
+
+/**
+ * @brief Drop the cached IVF centroids of every vector column, so they are
+ * re-read from the shadow tables on next use.
+ *
+ * @param p vec0_vtab pointer
+ */
+void vec0_ivf_clear_centroids(vec0_vtab *p) {
+  for (int i = 0; i < VEC0_MAX_VECTOR_COLUMNS; i++) {
+    sqlite3_free(p->ivfCentroids[i].centroids);
+    memset(&p->ivfCentroids[i], 0, sizeof(p->ivfCentroids[i]));
+  }
+}
+
+/**
+ * @brief Drop the cached HNSW nodes of a vector column, so the graph is
+ * re-read from the shadow tables on next use. Prepared statements are kept.
+ *
+ * @param p vec0_vtab pointer
+ * @param vector_column_idx vector column
+ */
+void vec0_hnsw_clear_graph(vec0_vtab *p, int vector_column_idx) {
+  struct Vec0HnswGraph *graph = &p->hnswGraphs[vector_column_idx];
+  vec0_i64_map_clear(&graph->nodes, sqlite3_free);
+  graph->loaded = 0;
+}
+
+/**
+ * @brief Drop the cached PQ codebook and codes of a DiskANN vector column, so
+ * they are re-read from the shadow tables on next use.
+ *
+ * @param p vec0_vtab pointer
+ * @param vector_column_idx vector column
+ */
+void vec0_diskann_clear_index(vec0_vtab *p, int vector_column_idx) {
+  struct Vec0DiskannIndex *index = &p->diskannIndexes[vector_column_idx];
+  vec0_i64_map_clear(&index->codes, sqlite3_free);
+  sqlite3_free(index->codebook);
+  index->codebook = NULL;
+  index->ksub = 0;
+  index->loaded = 0;
+}
+
+/**
+ * @brief Drop one entry of the result cache.
+ */
+static void vec0_result_cache_entry_free(vec0_vtab *p,
+                                         struct Vec0KnnResultCacheEntry *entry) {
+  if (entry->key) {
+    p->resultCacheBytes -=
+        entry->nKey + entry->n * (i64)(sizeof(i64) + sizeof(f32));
+  }
+  sqlite3_free(entry->key);
+  sqlite3_free(entry->rowids);
+  sqlite3_free(entry->distances);
+  memset(entry, 0, sizeof(*entry));
+}
+
+/**
+ * @brief Drop all entries of the result cache. The hit/miss counters are
+ * kept.
+ *
+ * @param p vec0_vtab pointer
+ */
+void vec0_result_cache_clear(vec0_vtab *p) {
+  for (int i = 0; i < p->resultCacheSize; i++) {
+    vec0_result_cache_entry_free(p, &p->resultCache[i]);
+  }
+  p->resultCacheBytes = 0;
+}
+
+/**
+ * @brief Drop all cached results of paged KNN queries.
+ *
+ * @param p vec0_vtab pointer
+ */
+void vec0_knn_page_cache_clear(vec0_vtab *p) {
+  for (int i = 0; i < VEC0_KNN_PAGE_CACHE_SIZE; i++) {
+    sqlite3_free(p->pageCache[i].rowids);
+    sqlite3_free(p->pageCache[i].distances);
+    memset(&p->pageCache[i], 0, sizeof(p->pageCache[i]));
+  }
 }
 
 /**
@@ -3746,6 +4768,32 @@ void vec0_free_resources(vec0_vtab *p) {
  */
 void vec0_free(vec0_vtab *p) {
   vec0_free_resources(p);
+  vec0_ivf_clear_centroids(p);
+  for (int i = 0; i < VEC0_MAX_VECTOR_COLUMNS; i++) {
+    vec0_hnsw_clear_graph(p, i);
+    vec0_diskann_clear_index(p, i);
+  }
+  vec0_knn_page_cache_clear(p);
+  sqlite3_free(p->statsSavepoints);
+  p->statsSavepoints = NULL;
+  vec0_bulk_free(p->bulk);
+  p->bulk = NULL;
+  vec0_write_chunks_clear(p);
+  if (p->resultCache) {
+    vec0_result_cache_clear(p);
+    sqlite3_free(p->resultCache);
+    p->resultCache = NULL;
+  }
+  if (p->connection) {
+    vec0_vtab **pp = &p->connection->tables;
+    while (*pp && *pp != p) {
+      pp = &(*pp)->nextOpen;
+    }
+    if (*pp) {
+      *pp = p->nextOpen;
+    }
+    p->connection = NULL;
+  }
 
   sqlite3_free(p->schemaName);
   p->schemaName = NULL;
@@ -3826,6 +4874,78 @@ int vec0_column_mmr_lambda_idx(vec0_vtab *p) {
          VEC0_COLUMN_OFFSET_MMR_LAMBDA;
 }
 
+/**
+ * Returns the column index for the hidden "nprobe" column.
+ */
+int vec0_column_nprobe_idx(vec0_vtab *p) {
+  return VEC0_COLUMN_USERN_START + (vec0_num_defined_user_columns(p) - 1) +
+         VEC0_COLUMN_OFFSET_NPROBE;
+}
+
+/**
+ * Returns the column index for the hidden "ef_search" column.
+ */
+int vec0_column_ef_search_idx(vec0_vtab *p) {
+  return VEC0_COLUMN_USERN_START + (vec0_num_defined_user_columns(p) - 1) +
+         VEC0_COLUMN_OFFSET_EF_SEARCH;
+}
+
+/**
+ * Returns the column index for the hidden "page_token" column.
+ */
+int vec0_column_page_token_idx(vec0_vtab *p) {
+  return VEC0_COLUMN_USERN_START + (vec0_num_defined_user_columns(p) - 1) +
+         VEC0_COLUMN_OFFSET_PAGE_TOKEN;
+}
+
+/**
+ * Returns the column index for the hidden "weights" column.
+ */
+int vec0_column_weights_idx(vec0_vtab *p) {
+  return VEC0_COLUMN_USERN_START + (vec0_num_defined_user_columns(p) - 1) +
+         VEC0_COLUMN_OFFSET_WEIGHTS;
+}
+
+/**
+ * Returns the column index for the hidden "k_per_partition" column.
+ */
+int vec0_column_k_per_partition_idx(vec0_vtab *p) {
+  return VEC0_COLUMN_USERN_START + (vec0_num_defined_user_columns(p) - 1) +
+         VEC0_COLUMN_OFFSET_K_PER_PARTITION;
+}
+
+/**
+ * Returns the column index for the hidden "max_chunks" column.
+ */
+int vec0_column_max_chunks_idx(vec0_vtab *p) {
+  return VEC0_COLUMN_USERN_START + (vec0_num_defined_user_columns(p) - 1) +
+         VEC0_COLUMN_OFFSET_MAX_CHUNKS;
+}
+
+/**
+ * Returns the column index for the hidden "time_budget_ms" column.
+ */
+int vec0_column_time_budget_ms_idx(vec0_vtab *p) {
+  return VEC0_COLUMN_USERN_START + (vec0_num_defined_user_columns(p) - 1) +
+         VEC0_COLUMN_OFFSET_TIME_BUDGET_MS;
+}
+
+/**
+ * Returns the column index for the hidden "exact" column.
+ */
+int vec0_column_exact_idx(vec0_vtab *p) {
+  return VEC0_COLUMN_USERN_START + (vec0_num_defined_user_columns(p) - 1) +
+         VEC0_COLUMN_OFFSET_EXACT;
+}
+
+/**
+ * Returns the column index for the hidden "filter" column.
+ */
+int vec0_column_filter_idx(vec0_vtab *p) {
+  return VEC0_COLUMN_USERN_START + (vec0_num_defined_user_columns(p) - 1) +
+         VEC0_COLUMN_OFFSET_FILTER;
+}
+
 /**
  * Returns 1 if the given column-based index is a valid vector column,
  * 0 otherwise.
@@ -3909,7 +5029,8 @@ int vec0_column_idx_to_metadata_idx(vec0_vtab *pVtab, int column_idx) {
  * @param rowid the rowid of the row to query
  * @param id output, optional sqlite3_value to provide the id.
  *            Useful for text PK rows. Must be freed with sqlite3_value_free()
- * @param chunk_id output, the chunk_id the row belongs to
+ * @param chunk_id output, the chunk_id the row belongs to, VEC0_DELTA_CHUNK_ID
+ *            for rows still in _delta
  * @param chunk_offset  output, the offset within the chunk the row belongs to
  * @return SQLITE_ROW on success, error code otherwise. SQLITE_EMPTY if row DNE
  */
@@ -3960,6 +5081,11 @@ int vec0_get_chunk_position(vec0_vtab *p, i64 rowid, sqlite3_value **id,
 
   if (chunk_id) {
     *chunk_id = sqlite3_column_int64(p->stmtRowidsGetChunkPosition, 1);
+    // rows still in _delta have no position yet
+    if (p->deltaSize > 0 &&
+        sqlite3_column_type(p->stmtRowidsGetChunkPosition, 1) == SQLITE_NULL) {
+      *chunk_id = VEC0_DELTA_CHUNK_ID;
+    }
   }
   if (chunk_offset) {
     *chunk_offset = sqlite3_column_int64(p->stmtRowidsGetChunkPosition, 2);
@@ -4046,6 +5172,38 @@ int vec0_result_id(vec0_vtab *p, sqlite3_context *context, i64 rowid) {
   return SQLITE_OK;
 }
 
+/**
+ * @brief Read a column of a row still in the _delta shadow table, like
+ * `vector00` for zColumn "vector" and idx 0. On SQLITE_OK, the value is column
+ * 0 of *outStmt, which the caller must finalize.
+ */
+static int vec0_delta_read(vec0_vtab *p, i64 rowid, const char *zColumn,
+                           int idx, sqlite3_stmt **outStmt) {
+  int rc;
+  sqlite3_stmt *stmt = NULL;
+  char *zSql = sqlite3_mprintf("SELECT %s%02d FROM " VEC0_SHADOW_DELTA_NAME
+                               " WHERE rowid = ?",
+                               zColumn, idx, p->schemaName, p->tableName);
+  if (!zSql) {
+    return SQLITE_NOMEM;
+  }
+  rc = sqlite3_prepare_v2(p->db, zSql, -1, &stmt, NULL);
+  sqlite3_free(zSql);
+  if (rc != SQLITE_OK) {
+    return rc;
+  }
+  sqlite3_bind_int64(stmt, 1, rowid);
+  rc = sqlite3_step(stmt);
+  if (rc != SQLITE_ROW) {
+    sqlite3_finalize(stmt);
+    vtab_set_error(&p->base, "Could not find row %lld in the delta of %s",
+                   rowid, p->tableName);
+    return SQLITE_ERROR;
+  }
+  *outStmt = stmt;
+  return SQLITE_OK;
+}
+
 /**
  * @brief
  *
@@ -4080,6 +5238,33 @@ int vec0_get_vector_data(vec0_vtab *pVtab, i64 rowid, int vector_column_idx,
     goto cleanup;
   }
 
+  size = vector_column_byte_size(pVtab->vector_columns[vector_column_idx]);
+  if (chunk_id == VEC0_DELTA_CHUNK_ID) {
+    sqlite3_stmt *stmt;
+    rc = vec0_delta_read(p, rowid, "vector", vector_column_idx, &stmt);
+    if (rc != SQLITE_OK) {
+      goto cleanup;
+    }
+    if ((size_t)sqlite3_column_bytes(stmt, 0) != size) {
+      sqlite3_finalize(stmt);
+      vtab_set_error(&pVtab->base,
+                     "Could not fetch vector data for %lld, wrong size in "
+                     "the delta",
+                     rowid);
+      rc = SQLITE_ERROR;
+      goto cleanup;
+    }
+    buf = sqlite3_malloc(size);
+    if (!buf) {
+      sqlite3_finalize(stmt);
+      rc = SQLITE_NOMEM;
+      goto cleanup;
+    }
+    memcpy(buf, sqlite3_column_blob(stmt, 0), size);
+    sqlite3_finalize(stmt);
+    goto found;
+  }
+
   rc = sqlite3_blob_open(p->db, p->schemaName,
                          p->shadowVectorChunksNames[vector_column_idx],
                          "vectors", chunk_id, 0, &vectorBlob);
@@ -4092,7 +5277,6 @@ int vec0_get_vector_data(vec0_vtab *pVtab, i64 rowid, int vector_column_idx,
     goto cleanup;
   }
 
-  size = vector_column_byte_size(pVtab->vector_columns[vector_column_idx]);
   blobOffset = chunk_offset * size;
 
   buf = sqlite3_malloc(size);
@@ -4113,6 +5297,7 @@ int vec0_get_vector_data(vec0_vtab *pVtab, i64 rowid, int vector_column_idx,
     goto cleanup;
   }
 
+found:
   *outVector = buf;
   if (outVectorSize) {
     *outVectorSize = size;
@@ -4149,6 +5334,13 @@ int vec0_get_partition_value_for_rowid(vec0_vtab *pVtab, i64 rowid, int partitio
     return rc;
   }
   sqlite3_stmt * stmt = NULL;
+  if(chunk_id == VEC0_DELTA_CHUNK_ID) {
+    rc = vec0_delta_read(pVtab, rowid, "partition", partition_idx, &stmt);
+    if(rc != SQLITE_OK) {
+      return rc;
+    }
+    goto found;
+  }
   char * zSql = sqlite3_mprintf("SELECT partition%02d FROM " VEC0_SHADOW_CHUNKS_NAME " WHERE chunk_id = ?", partition_idx, pVtab->schemaName, pVtab->tableName);
   if(!zSql) {
     return SQLITE_NOMEM;
@@ -4164,6 +5356,7 @@ int vec0_get_partition_value_for_rowid(vec0_vtab *pVtab, i64 rowid, int partitio
     rc = SQLITE_ERROR;
     goto done;
   }
+  found:
   *outValue = sqlite3_value_dup(sqlite3_column_value(stmt, 0));
   if(!*outValue) {
     rc = SQLITE_NOMEM;
@@ -4234,6 +5427,17 @@ int vec0_result_metadata_value_for_rowid(vec0_vtab *p, i64 rowid, int metadata_i
   if(rc != SQLITE_OK) {
     return rc;
   }
+  // values in _delta are stored as their column's type, see vec0_delta_insert()
+  if(chunk_id == VEC0_DELTA_CHUNK_ID) {
+    sqlite3_stmt * stmt;
+    rc = vec0_delta_read(p, rowid, "metadata", metadata_idx, &stmt);
+    if(rc != SQLITE_OK) {
+      return rc;
+    }
+    sqlite3_result_value(context, sqlite3_column_value(stmt, 0));
+    sqlite3_finalize(stmt);
+    return SQLITE_OK;
+  }
   sqlite3_blob * blobValue;
   rc = sqlite3_blob_open(p->db, p->schemaName, p->shadowMetadataChunksNames[metadata_idx], "data", chunk_id, 0, &blobValue);
   if(rc != SQLITE_OK) {
@@ -4304,6 +5508,35 @@ int vec0_result_metadata_value_for_rowid(vec0_vtab *p, i64 rowid, int metadata_i
       }
       break;
     }
+    case VEC0_METADATA_COLUMN_KIND_DICTIONARY: {
+      i64 code;
+      rc = sqlite3_blob_read(blobValue, &code, sizeof(code), chunk_offset * sizeof(i64));
+      if(rc != SQLITE_OK) {
+        goto done;
+      }
+      sqlite3_stmt * stmt;
+      const char * zSql = sqlite3_mprintf("SELECT value FROM " VEC0_SHADOW_METADATA_DICT_N_NAME " WHERE code = ?", p->schemaName, p->tableName, metadata_idx);
+      if(!zSql) {
+        rc = SQLITE_NOMEM;
+        goto done;
+      }
+      rc = sqlite3_prepare_v2(p->db, zSql, -1, &stmt, NULL);
+      sqlite3_free((void *) zSql);
+      if(rc != SQLITE_OK) {
+        goto done;
+      }
+      sqlite3_bind_int64(stmt, 1, code);
+      rc = sqlite3_step(stmt);
+      if(rc != SQLITE_ROW) {
+        sqlite3_finalize(stmt);
+        rc = SQLITE_ERROR;
+        goto done;
+      }
+      sqlite3_result_value(context, sqlite3_column_value(stmt, 0));
+      sqlite3_finalize(stmt);
+      rc = SQLITE_OK;
+      break;
+    }
   }
   done:
     // blobValue is read-only, will not fail on close
@@ -4522,6 +5755,8 @@ int vec0_metadata_chunk_size(vec0_metadata_column_kind kind, int chunk_size) {
       return chunk_size * sizeof(double);
     case VEC0_METADATA_COLUMN_KIND_TEXT:
       return chunk_size * VEC0_METADATA_TEXT_VIEW_BUFFER_LENGTH;
+    case VEC0_METADATA_COLUMN_KIND_DICTIONARY:
+      return chunk_size * sizeof(i64);
   }
   return 0;
 }
@@ -4575,54 +5810,257 @@ cleanup:
 }
 
 /**
- * @brief Adds a new chunk for the vec0 table, and the corresponding vector
- * chunks.
- *
- * Inserts a new row into the _chunks table, with blank data, and uses that new
- * rowid to insert new blank rows into _vector_chunksXX tables.
+ * @brief Whether the given vector column keeps a _vector_summariesNN table.
+ * Bit vectors use hamming distance and aren't summarized.
+ */
+static int vec0_has_chunk_summary(vec0_vtab *p, int vector_column_idx) {
+  return p->chunkSummaries &&
+         p->vector_columns[vector_column_idx].element_type !=
+             SQLITE_VEC_ELEMENT_TYPE_BIT;
+}
+
+/**
+ * @brief Record rows, chunks or partitions this connection added (or removed)
+ * in p->stats, see vec0_stats_load().
+ */
+static void vec0_stats_add(vec0_vtab *p, i64 rows, i64 chunks,
+                           i64 partitions) {
+  if (!p->stats.loaded) {
+    return;
+  }
+  p->stats.rows += rows;
+  p->stats.chunks += chunks;
+  p->stats.partitions += partitions;
+  p->stats.dirty = 1;
+}
+
+/**
+ * @brief Whether the _free_chunks shadow table exists, checked on first use
+ * for tables opened with xConnect.
+ */
+static int vec0_has_free_chunks(vec0_vtab *p) {
+  if (p->freeChunks < 0) {
+    sqlite3_stmt *stmt = NULL;
+    char *zSql = sqlite3_mprintf("SELECT 1 FROM " VEC0_SHADOW_FREE_CHUNKS_NAME,
+                                 p->schemaName, p->tableName);
+    if (!zSql) {
+      return 0;
+    }
+    int rc = sqlite3_prepare_v2(p->db, zSql, -1, &stmt, NULL);
+    sqlite3_free(zSql);
+    sqlite3_finalize(stmt);
+    if (rc != SQLITE_OK && rc != SQLITE_ERROR) {
+      return 0;
+    }
+    p->freeChunks = rc == SQLITE_OK;
+  }
+  return p->freeChunks;
+}
+
+/**
+ * @brief Number of free offsets in a chunk's validity bitmap.
+ */
+static i64 vec0_validity_free_count(vec0_vtab *p, const u8 *validity) {
+  i64 n = 0;
+  for (i64 i = 0; i < p->chunk_size / CHAR_BIT; i++) {
+    n += CHAR_BIT - __builtin_popcountl(validity[i]);
+  }
+  return n;
+}
+
+/**
+ * @brief Record in _free_chunks that a chunk has nFree free offsets, or nFree
+ * more than before if add is set. Full chunks have no row.
  *
- * @param p: vec0 table to add new chunk
- * @param paritionKeyValues: Array of partition key valeus for the new chunk, if available
- * @param chunk_rowid: Output pointer, if not NULL, then will be filled with the
- * new chunk rowid.
- * @return int SQLITE_OK on success, error code otherwise.
+ * Every chunk with free offsets has a row, so inserts fill the holes deletes
+ * leave without an optimize. Counts may be too high, as inserts through
+ * vec0_vtab.writeChunks only write theirs back when deletes also freed offsets
+ * of the chunk, or when the chunk fills. Offsets are always taken from the
+ * validity bitmap, so a stale count only orders chunks wrong, and the row of a
+ * chunk found full is deleted then. Optimize recounts them, and
+ * 'optimize:' corrects those of the chunks it finds fuller than recorded.
  */
-int vec0_new_chunk(vec0_vtab *p, sqlite3_value ** partitionKeyValues, i64 *chunk_rowid) {
-  int rc;
+static int vec0_free_chunks_set(vec0_vtab *p, i64 chunk_id, i64 nFree,
+                                int add) {
+  sqlite3_stmt *stmt = NULL;
   char *zSql;
-  sqlite3_stmt *stmt;
-  i64 rowid;
+  int rc;
+  int remove = nFree == 0 && !add;
 
-  // Step 1: Insert a new row in _chunks, capture that new rowid
-  if(p->numPartitionColumns > 0) {
-    sqlite3_str * s = sqlite3_str_new(NULL);
-    sqlite3_str_appendf(s, "INSERT INTO " VEC0_SHADOW_CHUNKS_NAME, p->schemaName, p->tableName);
-    sqlite3_str_appendall(s, "(size, validity, rowids");
-    for(int i = 0; i < p->numPartitionColumns; i++) {
+  if (!vec0_has_free_chunks(p)) {
+    return SQLITE_OK;
+  }
+  if (remove) {
+    zSql = sqlite3_mprintf("DELETE FROM " VEC0_SHADOW_FREE_CHUNKS_NAME
+                           " WHERE chunk_id = ?1",
+                           p->schemaName, p->tableName);
+  } else {
+    sqlite3_str *s = sqlite3_str_new(NULL);
+    sqlite3_str_appendf(s, "INSERT INTO " VEC0_SHADOW_FREE_CHUNKS_NAME "(chunk_id, free",
+                        p->schemaName, p->tableName);
+    for (int i = 0; i < p->numPartitionColumns; i++) {
       sqlite3_str_appendf(s, ", partition%02d", i);
     }
-    sqlite3_str_appendall(s, ") VALUES (?, ?, ?");
-    for(int i = 0; i < p->numPartitionColumns; i++) {
-      sqlite3_str_appendall(s, ", ?");
+    sqlite3_str_appendall(s, ") SELECT chunk_id, ?2");
+    for (int i = 0; i < p->numPartitionColumns; i++) {
+      sqlite3_str_appendf(s, ", partition%02d", i);
     }
-    sqlite3_str_appendall(s, ")");
-
+    sqlite3_str_appendf(s,
+                        " FROM " VEC0_SHADOW_CHUNKS_NAME " WHERE chunk_id = ?1"
+                        " ON CONFLICT(chunk_id) DO UPDATE SET free = %s",
+                        p->schemaName, p->tableName,
+                        add ? "min(free + excluded.free, ?3)" : "excluded.free");
     zSql = sqlite3_str_finish(s);
-  }else {
-    zSql = sqlite3_mprintf("INSERT INTO " VEC0_SHADOW_CHUNKS_NAME
-                         "(size, validity, rowids) "
-                         "VALUES (?, ?, ?);",
-                         p->schemaName, p->tableName);
   }
-
   if (!zSql) {
     return SQLITE_NOMEM;
   }
   rc = sqlite3_prepare_v2(p->db, zSql, -1, &stmt, NULL);
   sqlite3_free(zSql);
-  if (rc != SQLITE_OK) {
-    sqlite3_finalize(stmt);
-    return rc;
+  if (rc == SQLITE_OK) {
+    sqlite3_bind_int64(stmt, 1, chunk_id);
+    if (!remove) {
+      sqlite3_bind_int64(stmt, 2, nFree);
+    }
+    if (add) {
+      sqlite3_bind_int64(stmt, 3, p->chunk_size);
+    }
+    rc = sqlite3_step(stmt) == SQLITE_DONE ? SQLITE_OK : SQLITE_ERROR;
+  }
+  sqlite3_finalize(stmt);
+  if (rc != SQLITE_OK) {
+    vtab_set_error(&p->base,
+                   VEC_INTERAL_ERROR "could not update free offsets of %s.%s.%lld",
+                   p->schemaName, p->shadowChunksName, chunk_id);
+  }
+  return rc;
+}
+
+/**
+ * @brief Record that a delete freed an offset of a chunk outside
+ * vec0_vtab.writeChunks. Added to _free_chunks in one write per chunk by
+ * vec0_free_chunks_pending_flush().
+ */
+static int vec0_free_chunks_pending_add(vec0_vtab *p, i64 chunk_id) {
+  if (!vec0_has_free_chunks(p)) {
+    return SQLITE_OK;
+  }
+  intptr_t n = (intptr_t)vec0_i64_map_get(&p->freedChunks, chunk_id);
+  return vec0_i64_map_put(&p->freedChunks, chunk_id, (void *)(n + 1));
+}
+
+/**
+ * @brief Add the offsets deletes freed to _free_chunks, before it's read or
+ * on xSync.
+ */
+static int vec0_free_chunks_pending_flush(vec0_vtab *p) {
+  int rc = SQLITE_OK;
+  for (size_t i = 0; i < p->freedChunks.capacity && rc == SQLITE_OK; i++) {
+    if (p->freedChunks.values[i]) {
+      rc = vec0_free_chunks_set(p, p->freedChunks.keys[i],
+                                (i64)(intptr_t)p->freedChunks.values[i], 1);
+    }
+  }
+  vec0_i64_map_clear(&p->freedChunks, NULL);
+  return rc;
+}
+
+/**
+ * @brief Find the fullest chunk of the given partition with free offsets, per
+ * _free_chunks. SQLITE_EMPTY if there is none.
+ */
+static int vec0_free_chunks_fullest(vec0_vtab *p,
+                                    sqlite3_value **partitionKeyValues,
+                                    i64 *chunk_rowid) {
+  sqlite3_stmt *stmt = NULL;
+  int rc = vec0_free_chunks_pending_flush(p);
+  if (rc != SQLITE_OK) {
+    return rc;
+  }
+  sqlite3_str *s = sqlite3_str_new(NULL);
+  sqlite3_str_appendf(s, "SELECT chunk_id FROM " VEC0_SHADOW_FREE_CHUNKS_NAME,
+                      p->schemaName, p->tableName);
+  for (int i = 0; i < p->numPartitionColumns; i++) {
+    sqlite3_str_appendf(s, "%s partition%02d = ?", i ? " AND" : " WHERE", i);
+  }
+  sqlite3_str_appendall(s, " ORDER BY free, chunk_id LIMIT 1");
+  char *zSql = sqlite3_str_finish(s);
+  if (!zSql) {
+    return SQLITE_NOMEM;
+  }
+  rc = sqlite3_prepare_v2(p->db, zSql, -1, &stmt, NULL);
+  sqlite3_free(zSql);
+  if (rc != SQLITE_OK) {
+    vtab_set_error(&p->base, VEC_INTERAL_ERROR
+                   "could not initialize 'free chunks' statement");
+    return rc;
+  }
+  for (int i = 0; i < p->numPartitionColumns; i++) {
+    sqlite3_bind_value(stmt, i + 1, partitionKeyValues[i]);
+  }
+  rc = sqlite3_step(stmt);
+  if (rc == SQLITE_ROW) {
+    *chunk_rowid = sqlite3_column_int64(stmt, 0);
+    rc = SQLITE_OK;
+  } else if (rc == SQLITE_DONE) {
+    rc = SQLITE_EMPTY;
+  } else {
+    vtab_set_error(&p->base, VEC_INTERAL_ERROR "Could not find a free chunk");
+    rc = SQLITE_ERROR;
+  }
+  sqlite3_finalize(stmt);
+  return rc;
+}
+
+/**
+ * @brief Adds a new chunk for the vec0 table, and the corresponding vector
+ * chunks.
+ *
+ * Inserts a new row into the _chunks table, with blank data, and uses that new
+ * rowid to insert new blank rows into _vector_chunksXX tables.
+ *
+ * @param p: vec0 table to add new chunk
+ * @param paritionKeyValues: Array of partition key valeus for the new chunk, if available
+ * @param chunk_rowid: Output pointer, if not NULL, then will be filled with the
+ * new chunk rowid.
+ * @return int SQLITE_OK on success, error code otherwise.
+ */
+int vec0_new_chunk(vec0_vtab *p, sqlite3_value ** partitionKeyValues, i64 *chunk_rowid) {
+  int rc;
+  char *zSql;
+  sqlite3_stmt *stmt;
+  i64 rowid;
+
+  // Step 1: Insert a new row in _chunks, capture that new rowid
+  if(p->numPartitionColumns > 0) {
+    sqlite3_str * s = sqlite3_str_new(NULL);
+    sqlite3_str_appendf(s, "INSERT INTO " VEC0_SHADOW_CHUNKS_NAME, p->schemaName, p->tableName);
+    sqlite3_str_appendall(s, "(size, validity, rowids");
+    for(int i = 0; i < p->numPartitionColumns; i++) {
+      sqlite3_str_appendf(s, ", partition%02d", i);
+    }
+    sqlite3_str_appendall(s, ") VALUES (?, ?, ?");
+    for(int i = 0; i < p->numPartitionColumns; i++) {
+      sqlite3_str_appendall(s, ", ?");
+    }
+    sqlite3_str_appendall(s, ")");
+
+    zSql = sqlite3_str_finish(s);
+  }else {
+    zSql = sqlite3_mprintf("INSERT INTO " VEC0_SHADOW_CHUNKS_NAME
+                         "(size, validity, rowids) "
+                         "VALUES (?, ?, ?);",
+                         p->schemaName, p->tableName);
+  }
+
+  if (!zSql) {
+    return SQLITE_NOMEM;
+  }
+  rc = sqlite3_prepare_v2(p->db, zSql, -1, &stmt, NULL);
+  sqlite3_free(zSql);
+  if (rc != SQLITE_OK) {
+    sqlite3_finalize(stmt);
+    return rc;
   }
 
 #if SQLITE_THREADSAFE
@@ -4719,7 +6157,37 @@ int vec0_new_chunk(vec0_vtab *p, sqlite3_value ** partitionKeyValues, i64 *chunk
     }
   }
 
+  // Step 4: Create an empty summary row for each summarized vector column
+  for (int i = 0; i < p->numVectorColumns; i++) {
+    if (!vec0_has_chunk_summary(p, i)) {
+      continue;
+    }
+    zSql = sqlite3_mprintf("INSERT INTO " VEC0_SHADOW_VECTOR_SUMMARY_N_NAME
+                           "(rowid, count) VALUES (?, 0)",
+                           p->schemaName, p->tableName, i);
+    if (!zSql) {
+      return SQLITE_NOMEM;
+    }
+    rc = sqlite3_prepare_v2(p->db, zSql, -1, &stmt, NULL);
+    sqlite3_free(zSql);
+    if (rc != SQLITE_OK) {
+      sqlite3_finalize(stmt);
+      return rc;
+    }
+    sqlite3_bind_int64(stmt, 1, rowid);
+    rc = sqlite3_step(stmt);
+    sqlite3_finalize(stmt);
+    if (rc != SQLITE_DONE) {
+      return rc;
+    }
+  }
+
+  rc = vec0_free_chunks_set(p, rowid, p->chunk_size, 0);
+  if (rc != SQLITE_OK) {
+    return rc;
+  }
 
+  vec0_stats_add(p, 0, 1, 0);
   if (chunk_rowid) {
     *chunk_rowid = rowid;
   }
@@ -4727,6 +6195,233 @@ int vec0_new_chunk(vec0_vtab *p, sqlite3_value ** partitionKeyValues, i64 *chunk
   return SQLITE_OK;
 }
 
+/**
+ * @brief Copy the i-th dimension of a float32 or int8 vector as a double.
+ */
+static double vec0_vector_element_as_double(const void *vector,
+                                            enum VectorElementType element_type,
+                                            size_t i) {
+  if (element_type == SQLITE_VEC_ELEMENT_TYPE_INT8) {
+    return (double)((const i8 *)vector)[i];
+  }
+  return (double)((const f32 *)vector)[i];
+}
+
+/**
+ * @brief Add a vector to the summary of the chunk it was written to.
+ *
+ * The centroid is kept as a running mean. Since earlier vectors aren't
+ * re-read, the radius is grown to max(radius + |c' - c|, |x - c'|), which by
+ * the triangle inequality still bounds every vector in the chunk. The per
+ * dimension lo/hi bounds are exact.
+ *
+ * @param p vec0 table
+ * @param vector_column_idx which vector column the vector belongs to
+ * @param chunk_id chunk the vector was written to
+ * @param vector float32 or int8 vector data, `dimensions` elements
+ * @param isupdate 1 if the vector replaced an existing one, so the count of
+ * the chunk stays the same
+ * @return int SQLITE_OK on success, error code otherwise
+ */
+int vec0_chunk_summary_add(vec0_vtab *p, int vector_column_idx, i64 chunk_id,
+                           const void *vector, int isupdate) {
+  int rc;
+  char *zSql;
+  sqlite3_stmt *stmt = NULL;
+  struct VectorColumnDefinition *column = &p->vector_columns[vector_column_idx];
+  size_t dimensions = column->dimensions;
+  f32 *buffer = NULL;
+
+  zSql = sqlite3_mprintf("SELECT count, radius, centroid, lo, hi FROM "
+                         VEC0_SHADOW_VECTOR_SUMMARY_N_NAME " WHERE rowid = ?",
+                         p->schemaName, p->tableName, vector_column_idx);
+  if (!zSql) {
+    return SQLITE_NOMEM;
+  }
+  rc = sqlite3_prepare_v2(p->db, zSql, -1, &stmt, NULL);
+  sqlite3_free(zSql);
+  if (rc != SQLITE_OK) {
+    goto cleanup;
+  }
+  sqlite3_bind_int64(stmt, 1, chunk_id);
+  rc = sqlite3_step(stmt);
+  if (rc != SQLITE_ROW) {
+    vtab_set_error(&p->base,
+                   VEC_INTERAL_ERROR "no summary for chunk %lld on %s.%s",
+                   chunk_id, p->schemaName, p->tableName);
+    rc = SQLITE_ERROR;
+    goto cleanup;
+  }
+
+  // centroid, lo, hi, in that order
+  buffer = sqlite3_malloc(3 * dimensions * sizeof(f32));
+  if (!buffer) {
+    rc = SQLITE_NOMEM;
+    goto cleanup;
+  }
+  f32 *centroid = buffer;
+  f32 *lo = buffer + dimensions;
+  f32 *hi = buffer + 2 * dimensions;
+
+  i64 count = sqlite3_column_int64(stmt, 0);
+  double radius = 0.0;
+  i64 expectedBytes = dimensions * sizeof(f32);
+  if (count > 0 && sqlite3_column_bytes(stmt, 2) == expectedBytes &&
+      sqlite3_column_bytes(stmt, 3) == expectedBytes &&
+      sqlite3_column_bytes(stmt, 4) == expectedBytes) {
+    radius = sqlite3_column_double(stmt, 1);
+    memcpy(centroid, sqlite3_column_blob(stmt, 2), expectedBytes);
+    memcpy(lo, sqlite3_column_blob(stmt, 3), expectedBytes);
+    memcpy(hi, sqlite3_column_blob(stmt, 4), expectedBytes);
+
+    double shift = 0.0;
+    double distance = 0.0;
+    for (size_t i = 0; i < dimensions; i++) {
+      double x = vec0_vector_element_as_double(vector, column->element_type, i);
+      f32 next = (f32)(centroid[i] + (x - centroid[i]) / (double)(count + 1));
+      shift += ((double)next - centroid[i]) * ((double)next - centroid[i]);
+      distance += (x - next) * (x - next);
+      centroid[i] = next;
+      if (x < lo[i]) {
+        lo[i] = (f32)x;
+      }
+      if (x > hi[i]) {
+        hi[i] = (f32)x;
+      }
+    }
+    radius = radius + sqrt(shift);
+    if (sqrt(distance) > radius) {
+      radius = sqrt(distance);
+    }
+  } else {
+    count = 0;
+    for (size_t i = 0; i < dimensions; i++) {
+      centroid[i] = lo[i] = hi[i] =
+          (f32)vec0_vector_element_as_double(vector, column->element_type, i);
+    }
+  }
+  sqlite3_finalize(stmt);
+  stmt = NULL;
+
+  zSql = sqlite3_mprintf("UPDATE " VEC0_SHADOW_VECTOR_SUMMARY_N_NAME
+                         " SET count = ?, radius = ?, centroid = ?, lo = ?, "
+                         "hi = ? WHERE rowid = ?",
+                         p->schemaName, p->tableName, vector_column_idx);
+  if (!zSql) {
+    rc = SQLITE_NOMEM;
+    goto cleanup;
+  }
+  rc = sqlite3_prepare_v2(p->db, zSql, -1, &stmt, NULL);
+  sqlite3_free(zSql);
+  if (rc != SQLITE_OK) {
+    goto cleanup;
+  }
+  sqlite3_bind_int64(stmt, 1, isupdate && count > 0 ? count : count + 1);
+  sqlite3_bind_double(stmt, 2, radius);
+  sqlite3_bind_blob(stmt, 3, centroid, expectedBytes, SQLITE_STATIC);
+  sqlite3_bind_blob(stmt, 4, lo, expectedBytes, SQLITE_STATIC);
+  sqlite3_bind_blob(stmt, 5, hi, expectedBytes, SQLITE_STATIC);
+  sqlite3_bind_int64(stmt, 6, chunk_id);
+  rc = sqlite3_step(stmt);
+  if (rc != SQLITE_DONE) {
+    vtab_set_error(&p->base, "could not update summary for chunk %lld",
+                   chunk_id);
+    rc = SQLITE_ERROR;
+    goto cleanup;
+  }
+  rc = SQLITE_OK;
+
+cleanup:
+  sqlite3_finalize(stmt);
+  sqlite3_free(buffer);
+  return rc;
+}
+
+/**
+ * @brief Account for a deleted vector in the summaries of a chunk.
+ *
+ * The centroid, radius and bounds of the remaining vectors are still covered
+ * by the old values, so only the count changes. Once a chunk is empty its
+ * summary is reset, so the next insert starts from a tight bound again.
+ *
+ * @param p vec0 table
+ * @param chunk_id chunk the vector was deleted from
+ * @return int SQLITE_OK on success, error code otherwise
+ */
+int vec0_chunk_summary_remove(vec0_vtab *p, i64 chunk_id) {
+  for (int i = 0; i < p->numVectorColumns; i++) {
+    int rc;
+    sqlite3_stmt *stmt;
+    if (!vec0_has_chunk_summary(p, i)) {
+      continue;
+    }
+    char *zSql = sqlite3_mprintf(
+        "UPDATE " VEC0_SHADOW_VECTOR_SUMMARY_N_NAME " SET "
+        "count = max(count - 1, 0), "
+        "radius = iif(count <= 1, NULL, radius), "
+        "centroid = iif(count <= 1, NULL, centroid), "
+        "lo = iif(count <= 1, NULL, lo), "
+        "hi = iif(count <= 1, NULL, hi) "
+        "WHERE rowid = ?",
+        p->schemaName, p->tableName, i);
+    if (!zSql) {
+      return SQLITE_NOMEM;
+    }
+    rc = sqlite3_prepare_v2(p->db, zSql, -1, &stmt, NULL);
+    sqlite3_free(zSql);
+    if (rc != SQLITE_OK) {
+      return rc;
+    }
+    sqlite3_bind_int64(stmt, 1, chunk_id);
+    rc = sqlite3_step(stmt);
+    sqlite3_finalize(stmt);
+    if (rc != SQLITE_DONE) {
+      return SQLITE_ERROR;
+    }
+  }
+  return SQLITE_OK;
+}
+
+/**
+ * @brief Lower bound of the distance between a query vector and any vector
+ * summarized by a chunk summary.
+ *
+ * Uses the larger of the centroid/radius ball bound, |q - c| - radius, and the
+ * distance from q to the lo/hi bounding box. Both bound the L2 distance, and
+ * since L1 >= L2 they also bound the L1 distance, where the box distance is
+ * taken with the L1 norm instead.
+ *
+ * @return the lower bound, or 0 if no bound could be computed.
+ */
+static double vec0_chunk_summary_lower_bound(
+    struct VectorColumnDefinition *column, const void *queryVector,
+    double radius, const f32 *centroid, const f32 *lo, const f32 *hi) {
+  double toCentroid = 0.0;
+  double box = 0.0;
+  for (size_t i = 0; i < column->dimensions; i++) {
+    double q = vec0_vector_element_as_double(queryVector, column->element_type, i);
+    double d = q - centroid[i];
+    toCentroid += d * d;
+    double outside = 0.0;
+    if (q < lo[i]) {
+      outside = lo[i] - q;
+    } else if (q > hi[i]) {
+      outside = q - hi[i];
+    }
+    box += column->distance_metric == VEC0_DISTANCE_METRIC_L1
+               ? outside
+               : outside * outside;
+  }
+  double bound = sqrt(toCentroid) - radius;
+  if (column->distance_metric != VEC0_DISTANCE_METRIC_L1) {
+    box = sqrt(box);
+  }
+  if (box > bound) {
+    bound = box;
+  }
+  return bound > 0.0 ? bound : 0.0;
+}
+
 struct vec0_query_fullscan_data {
   sqlite3_stmt *rowids_stmt;
   i8 done;
@@ -4750,6 +6445,15 @@ struct vec0_query_knn_data {
   // Array of distances of size k. Must be freed with sqlite3_free().
   f32 *distances;
   i64 current_idx;
+  // 1 if the page_token column is computed for every row, from the fields
+  // below and the row's rowid/distance
+  int paging;
+  u64 fingerprint;
+  u32 dataVersion;
+  i64 writeGeneration;
+  // value of the exact column: 1 if the rows are the true nearest ones, 0 if
+  // an approximate index or a scan budget may have left some out
+  int exact;
 };
 void vec0_query_knn_data_clear(struct vec0_query_knn_data *knn_data) {
   if (!knn_data)
@@ -4816,15 +6520,138 @@ void vec0_cursor_clear(vec0_cursor *pCur) {
 }
 
 #define VEC_CONSTRUCTOR_ERROR "vec0 constructor error: "
-static int vec0_init(sqlite3 *db, void *pAux, int argc, const char *const *argv,
-                     sqlite3_vtab **ppVtab, char **pzErr, bool isCreate) {
-  UNUSED_PARAMETER(pAux);
-  vec0_vtab *pNew;
-  int rc;
-  const char *zSql;
+/**
+ * @brief Parse the value of a boolean table option, ie `chunk_summaries=true`.
+ *
+ * Accepts true/false and 1/0, case-insensitive.
+ *
+ * @return SQLITE_OK on success, SQLITE_ERROR if value isn't a boolean.
+ */
+static int vec0_parse_boolean_option(const char *value, int valueLength,
+                                     int *out) {
+  if ((valueLength == 4 && sqlite3_strnicmp(value, "true", 4) == 0) ||
+      (valueLength == 1 && value[0] == '1')) {
+    *out = 1;
+    return SQLITE_OK;
+  }
+  if ((valueLength == 5 && sqlite3_strnicmp(value, "false", 5) == 0) ||
+      (valueLength == 1 && value[0] == '0')) {
+    *out = 0;
+    return SQLITE_OK;
+  }
+  return SQLITE_ERROR;
+}
 
-  pNew = sqlite3_malloc(sizeof(*pNew));
-  if (pNew == 0)
+/**
+ * @brief Create the index on the partition key columns of the _chunks shadow
+ * table, so that KNN queries and inserts seek the chunks of a partition
+ * directly. Tables created without it get it on 'optimize'.
+ *
+ * Renamed tables keep the index under its old name: it follows the _chunks
+ * table, and can't be dropped while the ALTER TABLE statement runs.
+ */
+static int vec0_create_partition_index(sqlite3 *db, const char *schemaName,
+                                       const char *tableName,
+                                       int numPartitionColumns) {
+  int rc;
+  char *zSql;
+  if (numPartitionColumns == 0) {
+    return SQLITE_OK;
+  }
+  sqlite3_str *s = sqlite3_str_new(NULL);
+  sqlite3_str_appendf(s,
+                      "CREATE INDEX IF NOT EXISTS "
+                      VEC0_SHADOW_CHUNKS_PARTITIONS_INDEX_NAME
+                      " ON \"%w_chunks\"(",
+                      schemaName, tableName, tableName);
+  for (int i = 0; i < numPartitionColumns; i++) {
+    sqlite3_str_appendf(s, "%spartition%02d", i ? ", " : "", i);
+  }
+  sqlite3_str_appendall(s, ")");
+  zSql = sqlite3_str_finish(s);
+  if (!zSql) {
+    return SQLITE_NOMEM;
+  }
+  rc = sqlite3_exec(db, zSql, NULL, NULL, NULL);
+  sqlite3_free(zSql);
+  return rc;
+}
+
+/**
+ * @brief Create the _free_chunks shadow table and its index, if they don't
+ * exist yet. Tables created before it get it on optimize.
+ */
+static int vec0_create_free_chunks(sqlite3 *db, const char *schemaName,
+                                   const char *tableName,
+                                   int numPartitionColumns) {
+  int rc;
+  char *zSql;
+  sqlite3_str *s = sqlite3_str_new(NULL);
+  sqlite3_str_appendf(s,
+                      "CREATE TABLE IF NOT EXISTS " VEC0_SHADOW_FREE_CHUNKS_NAME
+                      "(chunk_id INTEGER PRIMARY KEY, free INTEGER NOT NULL",
+                      schemaName, tableName);
+  for (int i = 0; i < numPartitionColumns; i++) {
+    sqlite3_str_appendf(s, ", partition%02d", i);
+  }
+  sqlite3_str_appendf(s,
+                      "); CREATE INDEX IF NOT EXISTS "
+                      VEC0_SHADOW_FREE_CHUNKS_INDEX_NAME
+                      " ON \"%w_free_chunks\"(",
+                      schemaName, tableName, tableName);
+  for (int i = 0; i < numPartitionColumns; i++) {
+    sqlite3_str_appendf(s, "partition%02d, ", i);
+  }
+  sqlite3_str_appendall(s, "free)");
+  zSql = sqlite3_str_finish(s);
+  if (!zSql) {
+    return SQLITE_NOMEM;
+  }
+  rc = sqlite3_exec(db, zSql, NULL, NULL, NULL);
+  sqlite3_free(zSql);
+  return rc;
+}
+
+/**
+ * @brief Create the _delta shadow table of a table declared with
+ * `delta_size=N`: the partition key values, vectors and metadata values of
+ * the rows inserted since the last merge, by rowid.
+ */
+static int vec0_create_delta(vec0_vtab *p) {
+  int rc;
+  char *zSql;
+  sqlite3_str *s = sqlite3_str_new(NULL);
+  sqlite3_str_appendf(s,
+                      "CREATE TABLE " VEC0_SHADOW_DELTA_NAME
+                      "(rowid INTEGER PRIMARY KEY",
+                      p->schemaName, p->tableName);
+  for (int i = 0; i < p->numPartitionColumns; i++) {
+    sqlite3_str_appendf(s, ", partition%02d", i);
+  }
+  for (int i = 0; i < p->numVectorColumns; i++) {
+    sqlite3_str_appendf(s, ", vector%02d BLOB NOT NULL", i);
+  }
+  for (int i = 0; i < p->numMetadataColumns; i++) {
+    sqlite3_str_appendf(s, ", metadata%02d", i);
+  }
+  sqlite3_str_appendall(s, ")");
+  zSql = sqlite3_str_finish(s);
+  if (!zSql) {
+    return SQLITE_NOMEM;
+  }
+  rc = sqlite3_exec(p->db, zSql, NULL, NULL, NULL);
+  sqlite3_free(zSql);
+  return rc;
+}
+
+static int vec0_init(sqlite3 *db, void *pAux, int argc, const char *const *argv,
+                     sqlite3_vtab **ppVtab, char **pzErr, bool isCreate) {
+  vec0_vtab *pNew;
+  int rc;
+  const char *zSql;
+
+  pNew = sqlite3_malloc(sizeof(*pNew));
+  if (pNew == 0)
     return SQLITE_NOMEM;
   memset(pNew, 0, sizeof(*pNew));
 
@@ -4832,6 +6659,10 @@ static int vec0_init(sqlite3 *db, void *pAux, int argc, const char *const *argv,
   // -1 to use the defualt, otherwise will get re-assigned on `chunk_size=N`
   // option
   int chunk_size = -1;
+  int chunkSummaries = 0;
+  int resultCacheSize = 0;
+  i64 resultCacheMaxBytes = VEC0_RESULT_CACHE_DEFAULT_BYTES;
+  int deltaSize = 0;
   int numVectorColumns = 0;
   int numPartitionColumns = 0;
   int numAuxiliaryColumns = 0;
@@ -4958,8 +6789,9 @@ static int vec0_init(sqlite3 *db, void *pAux, int argc, const char *const *argv,
     }
 
     vec0_metadata_column_kind kind;
+    int indexed;
     rc = vec0_parse_metadata_column_definition(argv[i], strlen(argv[i]), &cName,
-                                      &cNameLength, &kind);
+                                      &cNameLength, &kind, &indexed);
     if(rc == SQLITE_OK) {
       if (numMetadataColumns >= VEC0_MAX_METADATA_COLUMNS) {
         *pzErr = sqlite3_mprintf(
@@ -4968,7 +6800,17 @@ static int vec0_init(sqlite3 *db, void *pAux, int argc, const char *const *argv,
             VEC0_MAX_METADATA_COLUMNS);
         goto error;
       }
+      if (indexed && (kind == VEC0_METADATA_COLUMN_KIND_BOOLEAN ||
+                      kind == VEC0_METADATA_COLUMN_KIND_FLOAT)) {
+        *pzErr = sqlite3_mprintf(
+            VEC_CONSTRUCTOR_ERROR
+            "indexed is only supported on INTEGER or TEXT metadata columns, "
+            "not on '%.*s'",
+            cNameLength, cName);
+        goto error;
+      }
       metadataColumn.kind = kind;
+      metadataColumn.indexed = indexed;
       metadataColumn.name_length = cNameLength;
       metadataColumn.name = sqlite3_mprintf("%.*s", cNameLength, cName);
       if(!metadataColumn.name) {
@@ -5022,6 +6864,52 @@ static int vec0_init(sqlite3 *db, void *pAux, int argc, const char *const *argv,
               sqlite3_mprintf(VEC_CONSTRUCTOR_ERROR "chunk_size too large");
           goto error;
         }
+      } else if (keyLength == 15 &&
+                 sqlite3_strnicmp(key, "chunk_summaries", keyLength) == 0) {
+        if (vec0_parse_boolean_option(value, valueLength, &chunkSummaries) !=
+            SQLITE_OK) {
+          *pzErr = sqlite3_mprintf(VEC_CONSTRUCTOR_ERROR
+                                   "chunk_summaries must be true or false");
+          goto error;
+        }
+      } else if (keyLength == 12 &&
+                 sqlite3_strnicmp(key, "result_cache", keyLength) == 0) {
+        errno = 0;
+        char *endptr;
+        long parsed = strtol(value, &endptr, 10);
+        if (errno == ERANGE || endptr != value + valueLength || parsed < 0 ||
+            parsed > VEC0_RESULT_CACHE_MAX_ENTRIES) {
+          *pzErr = sqlite3_mprintf(
+              VEC_CONSTRUCTOR_ERROR
+              "result_cache must be an integer between 0 and %d",
+              VEC0_RESULT_CACHE_MAX_ENTRIES);
+          goto error;
+        }
+        resultCacheSize = (int)parsed;
+      } else if (keyLength == 18 &&
+                 sqlite3_strnicmp(key, "result_cache_bytes", keyLength) == 0) {
+        errno = 0;
+        char *endptr;
+        long long parsed = strtoll(value, &endptr, 10);
+        if (errno == ERANGE || endptr != value + valueLength || parsed <= 0) {
+          *pzErr = sqlite3_mprintf(
+              VEC_CONSTRUCTOR_ERROR
+              "result_cache_bytes must be a positive integer");
+          goto error;
+        }
+        resultCacheMaxBytes = parsed;
+      } else if (keyLength == 10 &&
+                 sqlite3_strnicmp(key, "delta_size", keyLength) == 0) {
+        errno = 0;
+        char *endptr;
+        long parsed = strtol(value, &endptr, 10);
+        if (errno == ERANGE || endptr != value + valueLength || parsed < 0 ||
+            parsed > INT_MAX) {
+          *pzErr = sqlite3_mprintf(VEC_CONSTRUCTOR_ERROR
+                                   "delta_size must be a non-negative integer");
+          goto error;
+        }
+        deltaSize = (int)parsed;
       } else {
         // IMP: V27642_11712
         *pzErr = sqlite3_mprintf(
@@ -5047,6 +6935,25 @@ static int vec0_init(sqlite3 *db, void *pAux, int argc, const char *const *argv,
     goto error;
   }
 
+  // KNN queries scan the whole delta as a single chunk
+  if (deltaSize > chunk_size) {
+    *pzErr = sqlite3_mprintf(VEC_CONSTRUCTOR_ERROR
+                             "delta_size can't be larger than chunk_size (%d)",
+                             chunk_size);
+    goto error;
+  }
+  for (int i = 0; deltaSize > 0 && i < numVectorColumns; i++) {
+    if (pNew->vector_columns[i].index_type == VEC0_INDEX_TYPE_HNSW ||
+        pNew->vector_columns[i].index_type == VEC0_INDEX_TYPE_DISKANN) {
+      *pzErr = sqlite3_mprintf(
+          VEC_CONSTRUCTOR_ERROR
+          "delta_size isn't supported with indexed_by=hnsw or "
+          "indexed_by=diskann vector columns, their graphs only hold rows "
+          "in chunks");
+      goto error;
+    }
+  }
+
   const char *schemaName = argv[1];
   const char *tableName = argv[2];
 
@@ -5092,7 +6999,7 @@ static int vec0_init(sqlite3 *db, void *pAux, int argc, const char *const *argv,
 
   }
   sqlite3_str_appendall(createStr, " distance hidden, k hidden, ");
-  sqlite3_str_appendf(createStr, "%s hidden, mmr_lambda hidden) ", tableName);
+  sqlite3_str_appendf(createStr, "%s hidden, mmr_lambda hidden, nprobe hidden, ef_search hidden, page_token hidden, weights hidden, k_per_partition hidden, max_chunks hidden, time_budget_ms hidden, exact hidden, filter hidden) ", tableName);
   if (pkColumnName) {
     sqlite3_str_appendall(createStr, "without rowid ");
   }
@@ -5147,6 +7054,19 @@ static int vec0_init(sqlite3 *db, void *pAux, int argc, const char *const *argv,
     }
   }
   pNew->chunk_size = chunk_size;
+  pNew->chunkSummaries = chunkSummaries;
+  pNew->deltaSize = deltaSize;
+  if (resultCacheSize > 0) {
+    pNew->resultCache =
+        sqlite3_malloc(resultCacheSize * sizeof(*pNew->resultCache));
+    if (!pNew->resultCache) {
+      goto error;
+    }
+    memset(pNew->resultCache, 0,
+           resultCacheSize * sizeof(*pNew->resultCache));
+    pNew->resultCacheSize = resultCacheSize;
+    pNew->resultCacheMaxBytes = resultCacheMaxBytes;
+  }
 
   // if xCreate, then create the necessary shadow tables
   if (isCreate) {
@@ -5277,6 +7197,90 @@ static int vec0_init(sqlite3 *db, void *pAux, int argc, const char *const *argv,
         goto error;
       }
       sqlite3_finalize(stmt);
+
+      if (vec0_has_chunk_summary(pNew, i)) {
+        zSql = sqlite3_mprintf(VEC0_SHADOW_VECTOR_SUMMARY_N_CREATE,
+                               pNew->schemaName, pNew->tableName, i);
+        if (!zSql) {
+          goto error;
+        }
+        rc = sqlite3_prepare_v2(db, zSql, -1, &stmt, 0);
+        sqlite3_free((void *)zSql);
+        if ((rc != SQLITE_OK) || (sqlite3_step(stmt) != SQLITE_DONE)) {
+          sqlite3_finalize(stmt);
+          *pzErr = sqlite3_mprintf(
+              "Could not create '_vector_summaries%02d' shadow table: %s", i,
+              sqlite3_errmsg(db));
+          goto error;
+        }
+        sqlite3_finalize(stmt);
+      }
+
+      if (pNew->vector_columns[i].index_type == VEC0_INDEX_TYPE_HNSW) {
+        zSql = sqlite3_mprintf(VEC0_SHADOW_HNSW_NODES_N_CREATE,
+                               pNew->schemaName, pNew->tableName, i);
+        if (!zSql) {
+          goto error;
+        }
+        rc = sqlite3_prepare_v2(db, zSql, -1, &stmt, 0);
+        sqlite3_free((void *)zSql);
+        if ((rc != SQLITE_OK) || (sqlite3_step(stmt) != SQLITE_DONE)) {
+          sqlite3_finalize(stmt);
+          *pzErr = sqlite3_mprintf(
+              "Could not create '_hnsw_nodes%02d' shadow table: %s", i,
+              sqlite3_errmsg(db));
+          goto error;
+        }
+        sqlite3_finalize(stmt);
+      }
+
+      if (pNew->vector_columns[i].index_type == VEC0_INDEX_TYPE_IVF) {
+        const char *azCreate[] = {
+            VEC0_SHADOW_IVF_CENTROIDS_N_CREATE,
+            VEC0_SHADOW_IVF_LISTS_N_CREATE,
+        };
+        for (size_t j = 0; j < sizeof(azCreate) / sizeof(azCreate[0]); j++) {
+          zSql = sqlite3_mprintf(azCreate[j], pNew->schemaName,
+                                 pNew->tableName, i);
+          if (!zSql) {
+            goto error;
+          }
+          rc = sqlite3_prepare_v2(db, zSql, -1, &stmt, 0);
+          sqlite3_free((void *)zSql);
+          if ((rc != SQLITE_OK) || (sqlite3_step(stmt) != SQLITE_DONE)) {
+            sqlite3_finalize(stmt);
+            *pzErr = sqlite3_mprintf(
+                "Could not create IVF shadow tables for vector column %d: %s",
+                i, sqlite3_errmsg(db));
+            goto error;
+          }
+          sqlite3_finalize(stmt);
+        }
+      }
+
+      if (pNew->vector_columns[i].index_type == VEC0_INDEX_TYPE_DISKANN) {
+        const char *azCreate[] = {
+            VEC0_SHADOW_DISKANN_NEIGHBORS_N_CREATE,
+            VEC0_SHADOW_DISKANN_CODES_N_CREATE,
+        };
+        for (size_t j = 0; j < sizeof(azCreate) / sizeof(azCreate[0]); j++) {
+          zSql = sqlite3_mprintf(azCreate[j], pNew->schemaName,
+                                 pNew->tableName, i);
+          if (!zSql) {
+            goto error;
+          }
+          rc = sqlite3_prepare_v2(db, zSql, -1, &stmt, 0);
+          sqlite3_free((void *)zSql);
+          if ((rc != SQLITE_OK) || (sqlite3_step(stmt) != SQLITE_DONE)) {
+            sqlite3_finalize(stmt);
+            *pzErr = sqlite3_mprintf("Could not create DiskANN shadow tables "
+                                     "for vector column %d: %s",
+                                     i, sqlite3_errmsg(db));
+            goto error;
+          }
+          sqlite3_finalize(stmt);
+        }
+      }
     }
 
     for (int i = 0; i < pNew->numMetadataColumns; i++) {
@@ -5314,6 +7318,61 @@ static int vec0_init(sqlite3 *db, void *pAux, int argc, const char *const *argv,
         sqlite3_finalize(stmt);
 
       }
+
+      if (pNew->metadata_columns[i].kind ==
+          VEC0_METADATA_COLUMN_KIND_DICTIONARY) {
+        char *zSql = sqlite3_mprintf(VEC0_SHADOW_METADATA_DICT_N_CREATE,
+                                     pNew->schemaName, pNew->tableName, i);
+        if (!zSql) {
+          goto error;
+        }
+        rc = sqlite3_prepare_v2(db, zSql, -1, &stmt, 0);
+        sqlite3_free((void *)zSql);
+        if ((rc != SQLITE_OK) || (sqlite3_step(stmt) != SQLITE_DONE)) {
+          sqlite3_finalize(stmt);
+          *pzErr = sqlite3_mprintf(
+              "Could not create '_metadatadict%02d' shadow table: %s", i,
+              sqlite3_errmsg(db));
+          goto error;
+        }
+        sqlite3_finalize(stmt);
+      }
+
+      if (pNew->metadata_columns[i].indexed) {
+        char *zSql = sqlite3_mprintf(VEC0_SHADOW_METADATA_INDEX_N_CREATE,
+                                     pNew->schemaName, pNew->tableName, i);
+        if (!zSql) {
+          goto error;
+        }
+        rc = sqlite3_prepare_v2(db, zSql, -1, &stmt, 0);
+        sqlite3_free((void *)zSql);
+        if ((rc != SQLITE_OK) || (sqlite3_step(stmt) != SQLITE_DONE)) {
+          sqlite3_finalize(stmt);
+          *pzErr = sqlite3_mprintf(
+              "Could not create '_metadataindex%02d' shadow table: %s", i,
+              sqlite3_errmsg(db));
+          goto error;
+        }
+        sqlite3_finalize(stmt);
+      }
+
+      if (pNew->chunkSummaries) {
+        char *zSql = sqlite3_mprintf(VEC0_SHADOW_METADATA_ZONES_N_CREATE,
+                                     pNew->schemaName, pNew->tableName, i);
+        if (!zSql) {
+          goto error;
+        }
+        rc = sqlite3_prepare_v2(db, zSql, -1, &stmt, 0);
+        sqlite3_free((void *)zSql);
+        if ((rc != SQLITE_OK) || (sqlite3_step(stmt) != SQLITE_DONE)) {
+          sqlite3_finalize(stmt);
+          *pzErr = sqlite3_mprintf(
+              "Could not create '_metadatazones%02d' shadow table: %s", i,
+              sqlite3_errmsg(db));
+          goto error;
+        }
+        sqlite3_finalize(stmt);
+      }
     }
 
     if(pNew->numAuxiliaryColumns > 0) {
@@ -5341,6 +7400,40 @@ static int vec0_init(sqlite3 *db, void *pAux, int argc, const char *const *argv,
       sqlite3_free(zSql);
       sqlite3_finalize(stmt);
     }
+
+    rc = vec0_create_partition_index(db, pNew->schemaName, pNew->tableName,
+                                     pNew->numPartitionColumns);
+    if (rc != SQLITE_OK) {
+      *pzErr = sqlite3_mprintf(
+          "Could not create index on the '_chunks' shadow table: %s",
+          sqlite3_errmsg(db));
+      goto error;
+    }
+
+    rc = vec0_create_free_chunks(db, pNew->schemaName, pNew->tableName,
+                                 pNew->numPartitionColumns);
+    if (rc != SQLITE_OK) {
+      *pzErr = sqlite3_mprintf(
+          "Could not create '_free_chunks' shadow table: %s",
+          sqlite3_errmsg(db));
+      goto error;
+    }
+
+    if (pNew->deltaSize > 0) {
+      rc = vec0_create_delta(pNew);
+      if (rc != SQLITE_OK) {
+        *pzErr = sqlite3_mprintf("Could not create '_delta' shadow table: %s",
+                                 sqlite3_errmsg(db));
+        goto error;
+      }
+    }
+  }
+  pNew->freeChunks = isCreate ? 1 : -1;
+
+  if (pAux) {
+    pNew->connection = (struct Vec0Connection *)pAux;
+    pNew->nextOpen = pNew->connection->tables;
+    pNew->connection->tables = pNew;
   }
 
   *ppVtab = (sqlite3_vtab *)pNew;
@@ -5389,6 +7482,31 @@ static int vec0Destroy(sqlite3_vtab *pVtab) {
   }
   sqlite3_finalize(stmt);
 
+  // tables created before _free_chunks only have it after an optimize
+  zSql = sqlite3_mprintf("DROP TABLE IF EXISTS " VEC0_SHADOW_FREE_CHUNKS_NAME,
+                         p->schemaName, p->tableName);
+  rc = sqlite3_prepare_v2(p->db, zSql, -1, &stmt, 0);
+  sqlite3_free((void *)zSql);
+  if ((rc != SQLITE_OK) || (sqlite3_step(stmt) != SQLITE_DONE)) {
+    rc = SQLITE_ERROR;
+    vtab_set_error(pVtab, "could not drop free_chunks shadow table");
+    goto done;
+  }
+  sqlite3_finalize(stmt);
+
+  if (p->deltaSize > 0) {
+    zSql = sqlite3_mprintf("DROP TABLE " VEC0_SHADOW_DELTA_NAME, p->schemaName,
+                           p->tableName);
+    rc = sqlite3_prepare_v2(p->db, zSql, -1, &stmt, 0);
+    sqlite3_free((void *)zSql);
+    if ((rc != SQLITE_OK) || (sqlite3_step(stmt) != SQLITE_DONE)) {
+      rc = SQLITE_ERROR;
+      vtab_set_error(pVtab, "could not drop delta shadow table");
+      goto done;
+    }
+    sqlite3_finalize(stmt);
+  }
+
   zSql = sqlite3_mprintf("DROP TABLE " VEC0_SHADOW_INFO_NAME, p->schemaName,
                          p->tableName);
   rc = sqlite3_prepare_v2(p->db, zSql, -1, &stmt, 0);
@@ -5420,6 +7538,68 @@ static int vec0Destroy(sqlite3_vtab *pVtab) {
       goto done;
     }
     sqlite3_finalize(stmt);
+
+    if (vec0_has_chunk_summary(p, i)) {
+      zSql = sqlite3_mprintf("DROP TABLE " VEC0_SHADOW_VECTOR_SUMMARY_N_NAME,
+                             p->schemaName, p->tableName, i);
+      rc = sqlite3_prepare_v2(p->db, zSql, -1, &stmt, 0);
+      sqlite3_free((void *)zSql);
+      if ((rc != SQLITE_OK) || (sqlite3_step(stmt) != SQLITE_DONE)) {
+        rc = SQLITE_ERROR;
+        vtab_set_error(pVtab, "could not drop vector_summaries shadow table");
+        goto done;
+      }
+      sqlite3_finalize(stmt);
+    }
+
+    if (p->vector_columns[i].index_type == VEC0_INDEX_TYPE_HNSW) {
+      zSql = sqlite3_mprintf("DROP TABLE " VEC0_SHADOW_HNSW_NODES_N_NAME,
+                             p->schemaName, p->tableName, i);
+      rc = sqlite3_prepare_v2(p->db, zSql, -1, &stmt, 0);
+      sqlite3_free((void *)zSql);
+      if ((rc != SQLITE_OK) || (sqlite3_step(stmt) != SQLITE_DONE)) {
+        rc = SQLITE_ERROR;
+        vtab_set_error(pVtab, "could not drop hnsw_nodes shadow table");
+        goto done;
+      }
+      sqlite3_finalize(stmt);
+    }
+
+    if (p->vector_columns[i].index_type == VEC0_INDEX_TYPE_IVF) {
+      const char *azDrop[] = {
+          "DROP TABLE " VEC0_SHADOW_IVF_CENTROIDS_N_NAME,
+          "DROP TABLE " VEC0_SHADOW_IVF_LISTS_N_NAME,
+      };
+      for (size_t j = 0; j < sizeof(azDrop) / sizeof(azDrop[0]); j++) {
+        zSql = sqlite3_mprintf(azDrop[j], p->schemaName, p->tableName, i);
+        rc = sqlite3_prepare_v2(p->db, zSql, -1, &stmt, 0);
+        sqlite3_free((void *)zSql);
+        if ((rc != SQLITE_OK) || (sqlite3_step(stmt) != SQLITE_DONE)) {
+          rc = SQLITE_ERROR;
+          vtab_set_error(pVtab, "could not drop IVF shadow tables");
+          goto done;
+        }
+        sqlite3_finalize(stmt);
+      }
+    }
+
+    if (p->vector_columns[i].index_type == VEC0_INDEX_TYPE_DISKANN) {
+      const char *azDrop[] = {
+          "DROP TABLE " VEC0_SHADOW_DISKANN_NEIGHBORS_N_NAME,
+          "DROP TABLE " VEC0_SHADOW_DISKANN_CODES_N_NAME,
+      };
+      for (size_t j = 0; j < sizeof(azDrop) / sizeof(azDrop[0]); j++) {
+        zSql = sqlite3_mprintf(azDrop[j], p->schemaName, p->tableName, i);
+        rc = sqlite3_prepare_v2(p->db, zSql, -1, &stmt, 0);
+        sqlite3_free((void *)zSql);
+        if ((rc != SQLITE_OK) || (sqlite3_step(stmt) != SQLITE_DONE)) {
+          rc = SQLITE_ERROR;
+          vtab_set_error(pVtab, "could not drop DiskANN shadow tables");
+          goto done;
+        }
+        sqlite3_finalize(stmt);
+      }
+    }
   }
 
   if(p->numAuxiliaryColumns > 0) {
@@ -5454,18 +7634,57 @@ static int vec0Destroy(sqlite3_vtab *pVtab) {
       }
       sqlite3_finalize(stmt);
     }
-  }
 
-  stmt = NULL;
-  rc = SQLITE_OK;
+    if (p->metadata_columns[i].kind == VEC0_METADATA_COLUMN_KIND_DICTIONARY) {
+      zSql = sqlite3_mprintf("DROP TABLE " VEC0_SHADOW_METADATA_DICT_N_NAME,
+                             p->schemaName, p->tableName, i);
+      rc = sqlite3_prepare_v2(p->db, zSql, -1, &stmt, 0);
+      sqlite3_free((void *)zSql);
+      if ((rc != SQLITE_OK) || (sqlite3_step(stmt) != SQLITE_DONE)) {
+        rc = SQLITE_ERROR;
+        vtab_set_error(pVtab, "could not drop metadatadict shadow table");
+        goto done;
+      }
+      sqlite3_finalize(stmt);
+    }
 
-done:
-  sqlite3_finalize(stmt);
-  vec0_free(p);
-  return rc;
-}
+    if (p->metadata_columns[i].indexed) {
+      zSql = sqlite3_mprintf("DROP TABLE " VEC0_SHADOW_METADATA_INDEX_N_NAME,
+                             p->schemaName, p->tableName, i);
+      rc = sqlite3_prepare_v2(p->db, zSql, -1, &stmt, 0);
+      sqlite3_free((void *)zSql);
+      if ((rc != SQLITE_OK) || (sqlite3_step(stmt) != SQLITE_DONE)) {
+        rc = SQLITE_ERROR;
+        vtab_set_error(pVtab, "could not drop metadataindex shadow table");
+        goto done;
+      }
+      sqlite3_finalize(stmt);
+    }
 
-static int vec0Open(sqlite3_vtab *p, sqlite3_vtab_cursor **ppCursor) {
+    if (p->chunkSummaries) {
+      zSql = sqlite3_mprintf("DROP TABLE " VEC0_SHADOW_METADATA_ZONES_N_NAME,
+                             p->schemaName, p->tableName, i);
+      rc = sqlite3_prepare_v2(p->db, zSql, -1, &stmt, 0);
+      sqlite3_free((void *)zSql);
+      if ((rc != SQLITE_OK) || (sqlite3_step(stmt) != SQLITE_DONE)) {
+        rc = SQLITE_ERROR;
+        vtab_set_error(pVtab, "could not drop metadatazones shadow table");
+        goto done;
+      }
+      sqlite3_finalize(stmt);
+    }
+  }
+
+  stmt = NULL;
+  rc = SQLITE_OK;
+
+done:
+  sqlite3_finalize(stmt);
+  vec0_free(p);
+  return rc;
+}
+
+static int vec0Open(sqlite3_vtab *p, sqlite3_vtab_cursor **ppCursor) {
   UNUSED_PARAMETER(p);
   vec0_cursor *pCur;
   pCur = sqlite3_malloc(sizeof(*pCur));
@@ -5505,8 +7724,21 @@ typedef enum  {
   // ~~~ ??? ~~~ //
   VEC0_IDXSTR_KIND_METADATA_CONSTRAINT = '&',
   VEC0_IDXSTR_KIND_KNN_MMR_LAMBDA = '#',
+  VEC0_IDXSTR_KIND_KNN_NPROBE = '$',
+  VEC0_IDXSTR_KIND_KNN_EF_SEARCH = '%',
+  VEC0_IDXSTR_KIND_KNN_PAGE_TOKEN = '^',
+  VEC0_IDXSTR_KIND_KNN_WEIGHTS = '@',
+  VEC0_IDXSTR_KIND_KNN_K_PER_PARTITION = '~',
+  VEC0_IDXSTR_KIND_KNN_MAX_CHUNKS = '<',
+  VEC0_IDXSTR_KIND_KNN_TIME_BUDGET = '>',
+  VEC0_IDXSTR_KIND_KNN_FILTER = '|',
 } vec0_idxstr_kind;
 
+// Set in the idxNum of a KNN plan, next to the vector column index, when the
+// query selects or constrains the page_token column.
+#define VEC0_KNN_IDXNUM_PAGING 0x100
+#define VEC0_KNN_IDXNUM_VECTOR_MASK 0xff
+
 // The different SQLITE_INDEX_CONSTRAINT values that vec0 partition key columns
 // support, but as characters that fit nicely in idxstr.
 typedef enum  {
@@ -5529,6 +7761,9 @@ typedef enum  {
   
   // "Not equal to" constraint on a PARTITON KEY column, ex `year != 2024`
   VEC0_PARTITION_OPERATOR_NE = 'f',
+
+  // "In" constraint on a PARTITON KEY column, ex `user_id in (1, 2, 3)`
+  VEC0_PARTITION_OPERATOR_IN = 'g',
 } vec0_partition_operator;
 typedef enum  {
   VEC0_METADATA_OPERATOR_EQ = 'a',
@@ -5555,6 +7790,207 @@ typedef enum {
   VEC0_DISTANCE_CONSTRAINT_LE = 'd',
 } vec0_distance_constraint_operator;
 
+/**
+ * @brief SQLite's data version of the schema the table lives on, which
+ * changes whenever any connection commits to it. 0 if unavailable.
+ */
+static u32 vec0_data_version(vec0_vtab *p) {
+  unsigned int version = 0;
+#ifdef SQLITE_FCNTL_DATA_VERSION
+  if (sqlite3_file_control(p->db, p->schemaName, SQLITE_FCNTL_DATA_VERSION,
+                           &version) != SQLITE_OK) {
+    version = 0;
+  }
+#else
+  UNUSED_PARAMETER(p);
+#endif
+  return version;
+}
+
+/**
+ * @brief Count rows, chunks and distinct partitions from the shadow tables.
+ */
+static int vec0_stats_recount(vec0_vtab *p, struct Vec0TableStats *stats) {
+  int rc = SQLITE_OK;
+  sqlite3_str *s = sqlite3_str_new(NULL);
+  sqlite3_stmt *stmt = NULL;
+  char *zSql;
+
+  sqlite3_str_appendf(s, "SELECT (SELECT count(*) FROM " VEC0_SHADOW_ROWIDS_NAME
+                         "), (SELECT count(*) FROM " VEC0_SHADOW_CHUNKS_NAME "), ",
+                      p->schemaName, p->tableName, p->schemaName, p->tableName);
+  if (p->numPartitionColumns > 0) {
+    sqlite3_str_appendall(s, "(SELECT count(*) FROM (SELECT DISTINCT ");
+    for (int i = 0; i < p->numPartitionColumns; i++) {
+      sqlite3_str_appendf(s, "%spartition%02d", i ? ", " : "", i);
+    }
+    sqlite3_str_appendf(s, " FROM " VEC0_SHADOW_CHUNKS_NAME "))",
+                        p->schemaName, p->tableName);
+  } else {
+    sqlite3_str_appendf(s, "EXISTS (SELECT 1 FROM " VEC0_SHADOW_CHUNKS_NAME ")",
+                        p->schemaName, p->tableName);
+  }
+  zSql = sqlite3_str_finish(s);
+  if (!zSql) {
+    return SQLITE_NOMEM;
+  }
+  rc = sqlite3_prepare_v2(p->db, zSql, -1, &stmt, NULL);
+  sqlite3_free(zSql);
+  if (rc != SQLITE_OK) {
+    goto done;
+  }
+  rc = sqlite3_step(stmt);
+  if (rc != SQLITE_ROW) {
+    rc = rc == SQLITE_DONE ? SQLITE_ERROR : rc;
+    goto done;
+  }
+  stats->rows = sqlite3_column_int64(stmt, 0);
+  stats->chunks = sqlite3_column_int64(stmt, 1);
+  stats->partitions = sqlite3_column_int64(stmt, 2);
+  rc = SQLITE_OK;
+
+done:
+  sqlite3_finalize(stmt);
+  return rc;
+}
+
+/**
+ * @brief Bring p->stats up to date: a no-op while this connection is
+ * changing them, otherwise re-read from the STATS_* keys of the _info shadow
+ * table whenever the data version changed. Tables without those keys (created
+ * before they existed, or never written to) are counted when recount is set,
+ * on writes, and the counts are written when the transaction commits.
+ *
+ * @return SQLITE_EMPTY if the keys are missing and recount isn't set
+ */
+static int vec0_stats_load(vec0_vtab *p, int recount) {
+  int rc;
+  sqlite3_stmt *stmt = NULL;
+  struct Vec0TableStats stats = {1, 0, -1, -1, -1};
+  u32 dataVersion = vec0_data_version(p);
+
+  if (p->stats.loaded &&
+      (p->stats.dirty || p->statsDataVersion == dataVersion)) {
+    return SQLITE_OK;
+  }
+
+  char *zSql = sqlite3_mprintf(
+      "SELECT key, value FROM " VEC0_SHADOW_INFO_NAME
+      " WHERE key IN ('STATS_ROW_COUNT', 'STATS_CHUNK_COUNT', "
+      "'STATS_PARTITION_COUNT')",
+      p->schemaName, p->tableName);
+  if (!zSql) {
+    return SQLITE_NOMEM;
+  }
+  rc = sqlite3_prepare_v2(p->db, zSql, -1, &stmt, NULL);
+  sqlite3_free(zSql);
+  if (rc != SQLITE_OK) {
+    return rc;
+  }
+  while ((rc = sqlite3_step(stmt)) == SQLITE_ROW) {
+    const char *key = (const char *)sqlite3_column_text(stmt, 0);
+    i64 value = sqlite3_column_int64(stmt, 1);
+    if (sqlite3_stricmp(key, "STATS_ROW_COUNT") == 0) {
+      stats.rows = value;
+    } else if (sqlite3_stricmp(key, "STATS_CHUNK_COUNT") == 0) {
+      stats.chunks = value;
+    } else {
+      stats.partitions = value;
+    }
+  }
+  sqlite3_finalize(stmt);
+  if (rc != SQLITE_DONE) {
+    return rc;
+  }
+
+  if (stats.rows < 0 || stats.chunks < 0 || stats.partitions < 0) {
+    memset(&p->statsStored, 0, sizeof(p->statsStored));
+    if (!recount) {
+      memset(&p->stats, 0, sizeof(p->stats));
+      return SQLITE_EMPTY;
+    }
+    rc = vec0_stats_recount(p, &stats);
+    if (rc != SQLITE_OK) {
+      return rc;
+    }
+    stats.dirty = 1;
+  } else {
+    p->statsStored = stats;
+  }
+  p->stats = stats;
+  p->statsDataVersion = dataVersion;
+  return SQLITE_OK;
+}
+
+/**
+ * @brief Write p->stats to the _info shadow table, if they changed.
+ */
+static int vec0_stats_write(vec0_vtab *p) {
+  int rc;
+  sqlite3_stmt *stmt = NULL;
+  if (!p->stats.loaded || !p->stats.dirty) {
+    return SQLITE_OK;
+  }
+  // rows inserted and deleted again, or an optimize that dropped no chunk
+  if (p->statsStored.loaded && p->statsStored.rows == p->stats.rows &&
+      p->statsStored.chunks == p->stats.chunks &&
+      p->statsStored.partitions == p->stats.partitions) {
+    return SQLITE_OK;
+  }
+  char *zSql = sqlite3_mprintf(
+      "INSERT OR REPLACE INTO " VEC0_SHADOW_INFO_NAME "(key, value) VALUES "
+      "('STATS_ROW_COUNT', ?), ('STATS_CHUNK_COUNT', ?), "
+      "('STATS_PARTITION_COUNT', ?)",
+      p->schemaName, p->tableName);
+  if (!zSql) {
+    return SQLITE_NOMEM;
+  }
+  rc = sqlite3_prepare_v2(p->db, zSql, -1, &stmt, NULL);
+  sqlite3_free(zSql);
+  if (rc != SQLITE_OK) {
+    return rc;
+  }
+  sqlite3_bind_int64(stmt, 1, p->stats.rows);
+  sqlite3_bind_int64(stmt, 2, p->stats.chunks);
+  sqlite3_bind_int64(stmt, 3, p->stats.partitions);
+  rc = sqlite3_step(stmt);
+  sqlite3_finalize(stmt);
+  if (rc != SQLITE_DONE) {
+    return rc;
+  }
+  p->statsStored = p->stats;
+  return SQLITE_OK;
+}
+
+// Plan costs of vec0BestIndex(), in units of one distance computation of a
+// chunk scan: reading a row (or a chunk's blobs) costs VEC0_COST_ROW.
+#define VEC0_COST_ROW 16.0
+// estimates when the table's stats or the query's k can't be read
+#define VEC0_DEFAULT_ESTIMATED_ROWS 100000
+#define VEC0_DEFAULT_ESTIMATED_K 10
+// partitions selected by a partition key `in (...)` constraint
+#define VEC0_DEFAULT_ESTIMATED_IN_VALUES 4
+
+/**
+ * @brief The integer right-hand side of constraint iTerm, if it's a constant
+ * SQLite makes available at plan time, otherwise fallback.
+ */
+static i64 vec0_best_index_rhs_int(sqlite3_index_info *pIdxInfo, int iTerm,
+                                   i64 fallback) {
+#if COMPILER_SUPPORTS_VTAB_IN
+  sqlite3_value *value = NULL;
+  if (iTerm >= 0 && sqlite3_libversion_number() >= 3038000 &&
+      sqlite3_vtab_rhs_value(pIdxInfo, iTerm, &value) == SQLITE_OK && value &&
+      sqlite3_value_numeric_type(value) == SQLITE_INTEGER) {
+    return sqlite3_value_int64(value);
+  }
+#else
+  UNUSED_PARAMETER(pIdxInfo);
+  UNUSED_PARAMETER(iTerm);
+#endif
+  return fallback;
+}
+
 static int vec0BestIndex(sqlite3_vtab *pVTab, sqlite3_index_info *pIdxInfo) {
   vec0_vtab *p = (vec0_vtab *)pVTab;
   /**
@@ -5575,8 +8011,40 @@ static int vec0BestIndex(sqlite3_vtab *pVTab, sqlite3_index_info *pIdxInfo) {
   int iRowidTerm = -1;
   int iKTerm = -1;
   int iMmrLambdaTerm = -1;
+  int iNprobeTerm = -1;
+  int iEfSearchTerm = -1;
+  int iPageTokenTerm = -1;
+  int iWeightsTerm = -1;
+  int iKPerPartitionTerm = -1;
+  int iMaxChunksTerm = -1;
+  int iTimeBudgetTerm = -1;
+  int iFilterTerm = -1;
   int iRowidInTerm = -1;
   int hasAuxConstraint = 0;
+  // MATCH constraint of every vector column, fused KNN queries have several
+  int aMatchTerms[VEC0_MAX_VECTOR_COLUMNS];
+  int nMatchTerms = 0;
+  int hasUnusableWeights = 0;
+  for (int i = 0; i < VEC0_MAX_VECTOR_COLUMNS; i++) {
+    aMatchTerms[i] = -1;
+  }
+  int hasPartitionEq = 0;
+  int hasPartitionIn = 0;
+
+  // Live stats drive the costs below, so the planner can order joins with
+  // other tables. Tables without stats in _info, until their first write,
+  // get fixed costs instead: counting them here would scan the shadow tables
+  // on every prepare. Stats that can't be read aren't an error here, the
+  // query reports the underlying problem when it runs.
+  double nRows = VEC0_DEFAULT_ESTIMATED_ROWS;
+  double nChunks = nRows / p->chunk_size + 1;
+  double nPartitions = 1;
+  int hasStats = vec0_stats_load(p, 0) == SQLITE_OK;
+  if (hasStats) {
+    nRows = (double)p->stats.rows;
+    nChunks = (double)p->stats.chunks;
+    nPartitions = p->stats.partitions > 1 ? (double)p->stats.partitions : 1;
+  }
 
 #ifdef SQLITE_VEC_DEBUG
   printf("pIdxInfo->nOrderBy=%d, pIdxInfo->nConstraint=%d\n", pIdxInfo->nOrderBy, pIdxInfo->nConstraint);
@@ -5596,8 +8064,13 @@ static int vec0BestIndex(sqlite3_vtab *pVTab, sqlite3_index_info *pIdxInfo) {
            pIdxInfo->aConstraint[i].usable, pIdxInfo->aConstraint[i].iColumn,
            pIdxInfo->aConstraint[i].op, vtabIn);
 #endif
-    if (!pIdxInfo->aConstraint[i].usable)
+    if (!pIdxInfo->aConstraint[i].usable) {
+      if (pIdxInfo->aConstraint[i].op == SQLITE_INDEX_CONSTRAINT_EQ &&
+          pIdxInfo->aConstraint[i].iColumn == vec0_column_weights_idx(p)) {
+        hasUnusableWeights = 1;
+      }
       continue;
+    }
 
     int iColumn = pIdxInfo->aConstraint[i].iColumn;
     int op = pIdxInfo->aConstraint[i].op;
@@ -5607,13 +8080,14 @@ static int vec0BestIndex(sqlite3_vtab *pVTab, sqlite3_index_info *pIdxInfo) {
     }
     if (op == SQLITE_INDEX_CONSTRAINT_MATCH &&
         vec0_column_idx_is_vector(p, iColumn)) {
-      if (iMatchTerm > -1) {
+      int vector_idx = vec0_column_idx_to_vector_idx(p, iColumn);
+      if (aMatchTerms[vector_idx] > -1) {
         vtab_set_error(
             pVTab, "only 1 MATCH operator is allowed in a single vec0 query");
         return SQLITE_ERROR;
       }
-      iMatchTerm = i;
-      iMatchVectorTerm = vec0_column_idx_to_vector_idx(p, iColumn);
+      aMatchTerms[vector_idx] = i;
+      nMatchTerms++;
     }
     if (op == SQLITE_INDEX_CONSTRAINT_EQ && iColumn == VEC0_COLUMN_ID) {
       if (vtabIn) {
@@ -5634,6 +8108,30 @@ static int vec0BestIndex(sqlite3_vtab *pVTab, sqlite3_index_info *pIdxInfo) {
     if (op == SQLITE_INDEX_CONSTRAINT_EQ && iColumn == vec0_column_mmr_lambda_idx(p)) {
       iMmrLambdaTerm = i;
     }
+    if (op == SQLITE_INDEX_CONSTRAINT_EQ && iColumn == vec0_column_nprobe_idx(p)) {
+      iNprobeTerm = i;
+    }
+    if (op == SQLITE_INDEX_CONSTRAINT_EQ && iColumn == vec0_column_ef_search_idx(p)) {
+      iEfSearchTerm = i;
+    }
+    if (op == SQLITE_INDEX_CONSTRAINT_EQ && iColumn == vec0_column_page_token_idx(p)) {
+      iPageTokenTerm = i;
+    }
+    if (op == SQLITE_INDEX_CONSTRAINT_EQ && iColumn == vec0_column_weights_idx(p)) {
+      iWeightsTerm = i;
+    }
+    if (op == SQLITE_INDEX_CONSTRAINT_EQ && iColumn == vec0_column_k_per_partition_idx(p)) {
+      iKPerPartitionTerm = i;
+    }
+    if (op == SQLITE_INDEX_CONSTRAINT_EQ && iColumn == vec0_column_max_chunks_idx(p)) {
+      iMaxChunksTerm = i;
+    }
+    if (op == SQLITE_INDEX_CONSTRAINT_EQ && iColumn == vec0_column_time_budget_ms_idx(p)) {
+      iTimeBudgetTerm = i;
+    }
+    if (op == SQLITE_INDEX_CONSTRAINT_EQ && iColumn == vec0_column_filter_idx(p)) {
+      iFilterTerm = i;
+    }
     if(
       (op != SQLITE_INDEX_CONSTRAINT_LIMIT && op != SQLITE_INDEX_CONSTRAINT_OFFSET)
       && vec0_column_idx_is_auxiliary(p, iColumn)) {
@@ -5641,11 +8139,45 @@ static int vec0BestIndex(sqlite3_vtab *pVTab, sqlite3_index_info *pIdxInfo) {
       }
   }
 
+  // MATCH constraints on several vector columns are only fused with weights.
+  // A weights constraint that isn't usable in this plan may be in another.
+  if (nMatchTerms > 1 && iWeightsTerm < 0) {
+    if (hasUnusableWeights) {
+      return SQLITE_CONSTRAINT;
+    }
+    vtab_set_error(
+        pVTab, "only 1 MATCH operator is allowed in a single vec0 query");
+    return SQLITE_ERROR;
+  }
+  // the first matched vector column drives the plan, the others are fused
+  for (int i = 0; i < p->numVectorColumns && iMatchTerm < 0; i++) {
+    if (aMatchTerms[i] >= 0) {
+      iMatchTerm = aMatchTerms[i];
+      iMatchVectorTerm = i;
+    }
+  }
+
   sqlite3_str *idxStr = sqlite3_str_new(NULL);
   int rc;
 
   if (iMatchTerm >= 0) {
-    if (iLimitTerm < 0 && iKTerm < 0) {
+    if (iKPerPartitionTerm >= 0) {
+      if (iKTerm >= 0) {
+        vtab_set_error(pVTab, "Only 'k = ?' or 'k_per_partition = ?' can be "
+                              "provided, not both");
+        rc = SQLITE_ERROR;
+        goto done;
+      }
+      if (p->numPartitionColumns == 0) {
+        vtab_set_error(pVTab, "k_per_partition is only supported on vec0 "
+                              "tables with partition key columns");
+        rc = SQLITE_ERROR;
+        goto done;
+      }
+      // a LIMIT applies to the rows of all partitions, SQLite handles it
+      iLimitTerm = -1;
+    }
+    if (iKPerPartitionTerm < 0 && iLimitTerm < 0 && iKTerm < 0) {
       vtab_set_error(
           pVTab,
           "A LIMIT or 'k = ?' constraint is required on vec0 knn queries.");
@@ -5696,15 +8228,34 @@ static int vec0BestIndex(sqlite3_vtab *pVTab, sqlite3_index_info *pIdxInfo) {
     sqlite3_str_appendchar(idxStr, 1, VEC0_IDXSTR_KIND_KNN_MATCH);
     sqlite3_str_appendchar(idxStr, 3, '_');
 
-    if (iLimitTerm >= 0) {
-      pIdxInfo->aConstraintUsage[iLimitTerm].argvIndex = argvIndex++;
-      pIdxInfo->aConstraintUsage[iLimitTerm].omit = 1;
+    // the other MATCH constraints of a fused query
+    for (int i = iMatchVectorTerm + 1; i < p->numVectorColumns; i++) {
+      if (aMatchTerms[i] < 0) {
+        continue;
+      }
+      pIdxInfo->aConstraintUsage[aMatchTerms[i]].argvIndex = argvIndex++;
+      pIdxInfo->aConstraintUsage[aMatchTerms[i]].omit = 1;
+      sqlite3_str_appendchar(idxStr, 1, VEC0_IDXSTR_KIND_KNN_MATCH);
+      sqlite3_str_appendchar(idxStr, 1, 'A' + i);
+      sqlite3_str_appendchar(idxStr, 2, '_');
+    }
+
+    if (iKPerPartitionTerm >= 0) {
+      pIdxInfo->aConstraintUsage[iKPerPartitionTerm].argvIndex = argvIndex++;
+      pIdxInfo->aConstraintUsage[iKPerPartitionTerm].omit = 1;
+      sqlite3_str_appendchar(idxStr, 1, VEC0_IDXSTR_KIND_KNN_K_PER_PARTITION);
+      sqlite3_str_appendchar(idxStr, 3, '_');
     } else {
-      pIdxInfo->aConstraintUsage[iKTerm].argvIndex = argvIndex++;
-      pIdxInfo->aConstraintUsage[iKTerm].omit = 1;
+      if (iLimitTerm >= 0) {
+        pIdxInfo->aConstraintUsage[iLimitTerm].argvIndex = argvIndex++;
+        pIdxInfo->aConstraintUsage[iLimitTerm].omit = 1;
+      } else {
+        pIdxInfo->aConstraintUsage[iKTerm].argvIndex = argvIndex++;
+        pIdxInfo->aConstraintUsage[iKTerm].omit = 1;
+      }
+      sqlite3_str_appendchar(idxStr, 1, VEC0_IDXSTR_KIND_KNN_K);
+      sqlite3_str_appendchar(idxStr, 3, '_');
     }
-    sqlite3_str_appendchar(idxStr, 1, VEC0_IDXSTR_KIND_KNN_K);
-    sqlite3_str_appendchar(idxStr, 3, '_');
 
 #if COMPILER_SUPPORTS_VTAB_IN
     if (iRowidInTerm >= 0) {
@@ -5737,7 +8288,19 @@ static int vec0BestIndex(sqlite3_vtab *pVTab, sqlite3_index_info *pIdxInfo) {
 
       switch(op) {
         case SQLITE_INDEX_CONSTRAINT_EQ: {
+          // `in (...)` lists are read all at once, so every selected
+          // partition is scanned in a single pass
+          #if COMPILER_SUPPORTS_VTAB_IN
+          if (sqlite3_libversion_number() >= 3038000 &&
+              sqlite3_vtab_in(pIdxInfo, i, -1)) {
+            sqlite3_vtab_in(pIdxInfo, i, 1);
+            value = VEC0_PARTITION_OPERATOR_IN;
+            hasPartitionIn = 1;
+            break;
+          }
+          #endif
           value = VEC0_PARTITION_OPERATOR_EQ;
+          hasPartitionEq = 1;
           break;
         }
         case SQLITE_INDEX_CONSTRAINT_GT: {
@@ -5808,7 +8371,8 @@ static int vec0BestIndex(sqlite3_vtab *pVTab, sqlite3_index_info *pIdxInfo) {
                 break;
               }
               case VEC0_METADATA_COLUMN_KIND_INTEGER:
-              case VEC0_METADATA_COLUMN_KIND_TEXT: {
+              case VEC0_METADATA_COLUMN_KIND_TEXT:
+              case VEC0_METADATA_COLUMN_KIND_DICTIONARY: {
                 break;
               }
             }
@@ -5888,7 +8452,8 @@ static int vec0BestIndex(sqlite3_vtab *pVTab, sqlite3_index_info *pIdxInfo) {
       }
 
       if(value == VEC0_METADATA_OPERATOR_LIKE) {
-        if(p->metadata_columns[metadata_idx].kind != VEC0_METADATA_COLUMN_KIND_TEXT) {
+        if(p->metadata_columns[metadata_idx].kind != VEC0_METADATA_COLUMN_KIND_TEXT &&
+           p->metadata_columns[metadata_idx].kind != VEC0_METADATA_COLUMN_KIND_DICTIONARY) {
           rc = SQLITE_ERROR;
           vtab_set_error(pVTab, "LIKE operator is only allowed on TEXT metadata columns.");
           goto done;
@@ -5896,7 +8461,8 @@ static int vec0BestIndex(sqlite3_vtab *pVTab, sqlite3_index_info *pIdxInfo) {
       }
 
       if(value == VEC0_METADATA_OPERATOR_GLOB) {
-        if(p->metadata_columns[metadata_idx].kind != VEC0_METADATA_COLUMN_KIND_TEXT) {
+        if(p->metadata_columns[metadata_idx].kind != VEC0_METADATA_COLUMN_KIND_TEXT &&
+           p->metadata_columns[metadata_idx].kind != VEC0_METADATA_COLUMN_KIND_DICTIONARY) {
           rc = SQLITE_ERROR;
           vtab_set_error(pVTab, "GLOB operator is only allowed on TEXT metadata columns.");
           goto done;
@@ -5971,9 +8537,136 @@ static int vec0BestIndex(sqlite3_vtab *pVTab, sqlite3_index_info *pIdxInfo) {
       sqlite3_str_appendchar(idxStr, 3, '_');
     }
 
+    if (iNprobeTerm >= 0) {
+      pIdxInfo->aConstraintUsage[iNprobeTerm].argvIndex = argvIndex++;
+      pIdxInfo->aConstraintUsage[iNprobeTerm].omit = 1;
+      sqlite3_str_appendchar(idxStr, 1, VEC0_IDXSTR_KIND_KNN_NPROBE);
+      sqlite3_str_appendchar(idxStr, 3, '_');
+    }
+
+    if (iEfSearchTerm >= 0) {
+      pIdxInfo->aConstraintUsage[iEfSearchTerm].argvIndex = argvIndex++;
+      pIdxInfo->aConstraintUsage[iEfSearchTerm].omit = 1;
+      sqlite3_str_appendchar(idxStr, 1, VEC0_IDXSTR_KIND_KNN_EF_SEARCH);
+      sqlite3_str_appendchar(idxStr, 3, '_');
+    }
+
+    if (iPageTokenTerm >= 0) {
+      pIdxInfo->aConstraintUsage[iPageTokenTerm].argvIndex = argvIndex++;
+      pIdxInfo->aConstraintUsage[iPageTokenTerm].omit = 1;
+      sqlite3_str_appendchar(idxStr, 1, VEC0_IDXSTR_KIND_KNN_PAGE_TOKEN);
+      sqlite3_str_appendchar(idxStr, 3, '_');
+    }
+
+    if (iWeightsTerm >= 0) {
+      pIdxInfo->aConstraintUsage[iWeightsTerm].argvIndex = argvIndex++;
+      pIdxInfo->aConstraintUsage[iWeightsTerm].omit = 1;
+      sqlite3_str_appendchar(idxStr, 1, VEC0_IDXSTR_KIND_KNN_WEIGHTS);
+      sqlite3_str_appendchar(idxStr, 3, '_');
+    }
+
+    if (iMaxChunksTerm >= 0) {
+      pIdxInfo->aConstraintUsage[iMaxChunksTerm].argvIndex = argvIndex++;
+      pIdxInfo->aConstraintUsage[iMaxChunksTerm].omit = 1;
+      sqlite3_str_appendchar(idxStr, 1, VEC0_IDXSTR_KIND_KNN_MAX_CHUNKS);
+      sqlite3_str_appendchar(idxStr, 3, '_');
+    }
+
+    if (iTimeBudgetTerm >= 0) {
+      pIdxInfo->aConstraintUsage[iTimeBudgetTerm].argvIndex = argvIndex++;
+      pIdxInfo->aConstraintUsage[iTimeBudgetTerm].omit = 1;
+      sqlite3_str_appendchar(idxStr, 1, VEC0_IDXSTR_KIND_KNN_TIME_BUDGET);
+      sqlite3_str_appendchar(idxStr, 3, '_');
+    }
+
+    if (iFilterTerm >= 0) {
+      pIdxInfo->aConstraintUsage[iFilterTerm].argvIndex = argvIndex++;
+      pIdxInfo->aConstraintUsage[iFilterTerm].omit = 1;
+      sqlite3_str_appendchar(idxStr, 1, VEC0_IDXSTR_KIND_KNN_FILTER);
+      sqlite3_str_appendchar(idxStr, 3, '_');
+    }
+
     pIdxInfo->idxNum = iMatchVectorTerm;
-    pIdxInfo->estimatedCost = 30.0;
-    pIdxInfo->estimatedRows = 10;
+    // colUsed has a bit per column, the last one shared by all columns >= 63
+    int iPageTokenColumn = vec0_column_page_token_idx(p);
+    if (iPageTokenTerm >= 0 ||
+        (pIdxInfo->colUsed &
+         ((sqlite3_uint64)1 << (iPageTokenColumn < 63 ? iPageTokenColumn : 63)))) {
+      pIdxInfo->idxNum |= VEC0_KNN_IDXNUM_PAGING;
+    }
+
+    if (!hasStats) {
+      pIdxInfo->estimatedCost = 30.0;
+      pIdxInfo->estimatedRows = 10;
+    } else {
+      // A flat KNN query reads every chunk of the matched partitions and
+      // computes a distance for each of their rows. Partition counts are kept
+      // per table, so a partition is assumed to hold an average share of rows.
+      struct VectorColumnDefinition *column =
+          &p->vector_columns[iMatchVectorTerm];
+      double scanned = nRows;
+      double chunksScanned = nChunks;
+      if (hasPartitionEq) {
+        scanned /= nPartitions;
+        chunksScanned /= nPartitions;
+      } else if (hasPartitionIn && nPartitions > VEC0_DEFAULT_ESTIMATED_IN_VALUES) {
+        scanned = scanned * VEC0_DEFAULT_ESTIMATED_IN_VALUES / nPartitions;
+        chunksScanned = chunksScanned * VEC0_DEFAULT_ESTIMATED_IN_VALUES / nPartitions;
+      }
+      // fused queries scan every chunk and compute a distance per matched column
+      switch (iWeightsTerm >= 0 ? VEC0_INDEX_TYPE_FLAT : column->index_type) {
+      case VEC0_INDEX_TYPE_IVF: {
+        i64 nprobe = vec0_best_index_rhs_int(pIdxInfo, iNprobeTerm,
+                                             column->ivf.nprobe);
+        if (nprobe > 0 && nprobe < column->ivf.nlist) {
+          scanned = scanned * nprobe / column->ivf.nlist;
+          chunksScanned = scanned / p->chunk_size;
+        }
+        break;
+      }
+      case VEC0_INDEX_TYPE_HNSW:
+      case VEC0_INDEX_TYPE_DISKANN: {
+        // a greedy graph search visits about ef nodes per layer it descends
+        i64 ef = vec0_best_index_rhs_int(
+            pIdxInfo, iEfSearchTerm,
+            column->index_type == VEC0_INDEX_TYPE_HNSW ? column->hnsw.ef_search
+                                                       : column->diskann.l_search);
+        double visited = (ef > 0 ? ef : 1) * log2(nRows + 2);
+        if (visited < scanned) {
+          scanned = visited;
+        }
+        chunksScanned = 0;
+        break;
+      }
+      default:
+        break;
+      }
+      // a chunk budget stops the scan early
+      i64 maxChunks = vec0_best_index_rhs_int(pIdxInfo, iMaxChunksTerm, 0);
+      if (maxChunks > 0 && chunksScanned > maxChunks) {
+        scanned = scanned * maxChunks / chunksScanned;
+        chunksScanned = maxChunks;
+      }
+      double k;
+      if (iKPerPartitionTerm >= 0) {
+        // k rows from each of the selected partitions
+        double selected = nPartitions;
+        if (hasPartitionEq) {
+          selected = 1;
+        } else if (hasPartitionIn && nPartitions > VEC0_DEFAULT_ESTIMATED_IN_VALUES) {
+          selected = VEC0_DEFAULT_ESTIMATED_IN_VALUES;
+        }
+        k = selected * vec0_best_index_rhs_int(pIdxInfo, iKPerPartitionTerm,
+                                               VEC0_DEFAULT_ESTIMATED_K);
+      } else {
+        k = vec0_best_index_rhs_int(pIdxInfo, iKTerm >= 0 ? iKTerm : iLimitTerm,
+                                    VEC0_DEFAULT_ESTIMATED_K);
+      }
+      double rows = k < scanned ? k : scanned;
+      pIdxInfo->estimatedRows = rows >= 1 ? (sqlite3_int64)rows : 1;
+      pIdxInfo->estimatedCost = 1.0 + scanned * nMatchTerms +
+                                (chunksScanned + rows) * VEC0_COST_ROW;
+    }
 
   } else if (iRowidTerm >= 0) {
     sqlite3_str_appendchar(idxStr, 1, VEC0_QUERY_PLAN_POINT);
@@ -5982,12 +8675,20 @@ static int vec0BestIndex(sqlite3_vtab *pVTab, sqlite3_index_info *pIdxInfo) {
     sqlite3_str_appendchar(idxStr, 1, VEC0_IDXSTR_KIND_POINT_ID);
     sqlite3_str_appendchar(idxStr, 3, '_');
     pIdxInfo->idxNum = pIdxInfo->colUsed;
-    pIdxInfo->estimatedCost = 10.0;
+    // one _rowids b-tree lookup, then the row's chunk blobs
+    pIdxInfo->estimatedCost =
+        hasStats ? log2(nRows + 2) + VEC0_COST_ROW : 10.0;
     pIdxInfo->estimatedRows = 1;
+    pIdxInfo->idxFlags |= SQLITE_INDEX_SCAN_UNIQUE;
   } else {
     sqlite3_str_appendchar(idxStr, 1, VEC0_QUERY_PLAN_FULLSCAN);
-    pIdxInfo->estimatedCost = 3000000.0;
-    pIdxInfo->estimatedRows = 100000;
+    if (!hasStats) {
+      pIdxInfo->estimatedCost = 3000000.0;
+      pIdxInfo->estimatedRows = VEC0_DEFAULT_ESTIMATED_ROWS;
+    } else {
+      pIdxInfo->estimatedCost = 1.0 + nRows * VEC0_COST_ROW;
+      pIdxInfo->estimatedRows = nRows >= 1 ? (sqlite3_int64)nRows : 1;
+    }
   }
   pIdxInfo->idxStr = sqlite3_str_finish(idxStr);
   idxStr = NULL;
@@ -6009,9 +8710,15 @@ static int vec0BestIndex(sqlite3_vtab *pVTab, sqlite3_index_info *pIdxInfo) {
 // forward delcaration bc vec0Filter uses it
 static int vec0Next(sqlite3_vtab_cursor *cur);
 
-void merge_sorted_lists(f32 *a, i64 *a_rowids, i64 a_length, f32 *b,
-                        i64 *b_rowids, i32 *b_top_idxs, i64 b_length, f32 *out,
-                        i64 *out_rowids, i64 out_length, i64 *out_used) {
+/**
+ * @brief merge_sorted_lists(), also recording where each output entry came
+ * from in out_sources (if not NULL): its index in a, or -1 - i for b[i].
+ */
+static void merge_sorted_lists_sources(f32 *a, i64 *a_rowids, i64 a_length,
+                                       f32 *b, i64 *b_rowids, i32 *b_top_idxs,
+                                       i64 b_length, f32 *out, i64 *out_rowids,
+                                       i64 *out_sources, i64 out_length,
+                                       i64 *out_used) {
   // assert((a_length >= out_length) || (b_length >= out_length));
   i64 ptrA = 0;
   i64 ptrB = 0;
@@ -6020,30 +8727,42 @@ void merge_sorted_lists(f32 *a, i64 *a_rowids, i64 a_length, f32 *b,
       *out_used = i;
       return;
     }
+    int fromA;
     if (ptrA >= a_length) {
-      out[i] = b[b_top_idxs[ptrB]];
-      out_rowids[i] = b_rowids[b_top_idxs[ptrB]];
-      ptrB++;
+      fromA = 0;
     } else if (ptrB >= b_length) {
+      fromA = 1;
+    } else {
+      fromA = a[ptrA] <= b[b_top_idxs[ptrB]];
+    }
+    if (fromA) {
       out[i] = a[ptrA];
       out_rowids[i] = a_rowids[ptrA];
+      if (out_sources) {
+        out_sources[i] = ptrA;
+      }
       ptrA++;
     } else {
-      if (a[ptrA] <= b[b_top_idxs[ptrB]]) {
-        out[i] = a[ptrA];
-        out_rowids[i] = a_rowids[ptrA];
-        ptrA++;
-      } else {
-        out[i] = b[b_top_idxs[ptrB]];
-        out_rowids[i] = b_rowids[b_top_idxs[ptrB]];
-        ptrB++;
+      out[i] = b[b_top_idxs[ptrB]];
+      out_rowids[i] = b_rowids[b_top_idxs[ptrB]];
+      if (out_sources) {
+        out_sources[i] = -1 - b_top_idxs[ptrB];
       }
+      ptrB++;
     }
   }
 
   *out_used = out_length;
 }
 
+void merge_sorted_lists(f32 *a, i64 *a_rowids, i64 a_length, f32 *b,
+                        i64 *b_rowids, i32 *b_top_idxs, i64 b_length, f32 *out,
+                        i64 *out_rowids, i64 out_length, i64 *out_used) {
+  merge_sorted_lists_sources(a, a_rowids, a_length, b, b_rowids, b_top_idxs,
+                             b_length, out, out_rowids, NULL, out_length,
+                             out_used);
+}
+
 u8 *bitmap_new(i32 n) {
   assert(n % 8 == 0);
   u8 *p = sqlite3_malloc(n * sizeof(u8) / CHAR_BIT);
@@ -6095,6 +8814,31 @@ void bitmap_fill(u8 *bitmap, i32 n) {
   memset(bitmap, 0xFF, n / CHAR_BIT);
 }
 
+/**
+ * @brief Finds the first and last non-zero bytes of a bitmap.
+ *
+ * @param lo output, index of the first byte with a set bit
+ * @param hi output, index of the last byte with a set bit
+ * @return int 0 if no bit is set, 1 otherwise
+ */
+int bitmap_span(const u8 *bitmap, i32 n, i32 *lo, i32 *hi) {
+  assert((n % 8) == 0);
+  i32 first = 0;
+  i32 last = n / CHAR_BIT - 1;
+  while (first <= last && !bitmap[first]) {
+    first++;
+  }
+  if (first > last) {
+    return 0;
+  }
+  while (!bitmap[last]) {
+    last--;
+  }
+  *lo = first;
+  *hi = last;
+  return 1;
+}
+
 /**
  * @brief Finds the minimum k items in distances, and writes the indicies to
  * out.
@@ -6137,70 +8881,52 @@ int min_idx(const f32 *distances, i32 n, u8 *candidates, i32 *out, i32 k,
   return SQLITE_OK;
 }
 
-int vec0_get_metadata_text_long_value(
-  vec0_vtab * p,
-  sqlite3_stmt ** stmt,
-  int metadata_idx,
-  i64 rowid,
-  int *n,
-  char ** s) {
-  int rc;
-  if(!(*stmt)) {
-    const char * zSql = sqlite3_mprintf("select data from " VEC0_SHADOW_METADATA_TEXT_DATA_NAME " where rowid = ?", p->schemaName, p->tableName, metadata_idx);
-    if(!zSql) {
-      rc = SQLITE_NOMEM;
-      goto done;
-    }
-    rc = sqlite3_prepare_v2(p->db, zSql, -1, stmt, NULL);
-    sqlite3_free( (void *) zSql);
-    if(rc != SQLITE_OK) {
-      goto done;
-    }
-  }
+/**
+ * @brief Check if the i-th constraint of a query is an equality or
+ * `in (...)` constraint on a metadata column declared `indexed`.
+ *
+ * @return int the metadata column index of the constraint, -1 if it isn't one
+ */
+static int vec0_indexed_metadata_constraint(vec0_vtab *p, const char *idxStr,
+                                            int i) {
+  int idx = 1 + (i * 4);
+  if (idxStr[idx + 0] != VEC0_IDXSTR_KIND_METADATA_CONSTRAINT) {
+    return -1;
+  }
+  int metadata_idx = idxStr[idx + 1] - 'A';
+  char op = idxStr[idx + 2];
+  if (!p->metadata_columns[metadata_idx].indexed ||
+      (op != VEC0_METADATA_OPERATOR_EQ && op != VEC0_METADATA_OPERATOR_IN)) {
+    return -1;
+  }
+  return metadata_idx;
+}
 
-  sqlite3_reset(*stmt);
-  sqlite3_bind_int64(*stmt, 1, rowid);
-  rc = sqlite3_step(*stmt);
-  if(rc != SQLITE_ROW) {
-    rc = SQLITE_ERROR;
-    goto done;
+// Binds a constraint value the way the column's filter kernels read it
+static void vec0_bind_indexed_metadata_value(vec0_vtab *p, sqlite3_stmt *stmt,
+                                             int iParam, int metadata_idx,
+                                             sqlite3_value *value) {
+  if (p->metadata_columns[metadata_idx].kind ==
+      VEC0_METADATA_COLUMN_KIND_INTEGER) {
+    sqlite3_bind_int64(stmt, iParam, sqlite3_value_int64(value));
+  } else {
+    sqlite3_bind_text(stmt, iParam, (const char *)sqlite3_value_text(value),
+                      sqlite3_value_bytes(value), SQLITE_TRANSIENT);
   }
-  *s = (char *) sqlite3_column_text(*stmt, 0);
-  *n = sqlite3_column_bytes(*stmt, 0);
-  rc = SQLITE_OK;
-  done:
-    return rc;
 }
 
 /**
- * @brief Crete at "iterator" (sqlite3_stmt) of chunks with the given constraints
- *
- * Any VEC0_IDXSTR_KIND_KNN_PARTITON_CONSTRAINT values in idxStr/argv will be applied
- * as WHERE constraints in the underlying stmt SQL, and any consumer of the stmt
- * can freely step through the stmt with all constraints satisfied.
+ * @brief Append the VEC0_IDXSTR_KIND_KNN_PARTITON_CONSTRAINT values in
+ * idxStr/argv to the WHERE clause of a query on the _chunks or _delta shadow
+ * tables, one parameter per value, see vec0_partition_constraints_bind().
  *
- * @param p - vec0_vtab
- * @param idxStr - the xBestIndex/xFilter idxstr containing VEC0_IDXSTR values
- * @param argc - number of argv values from xFilter
- * @param argv - array of sqlite3_value from xFilter
- * @param outStmt - output sqlite3_stmt of chunks with all filters applied
- * @return int SQLITE_OK on success, error code otherwise
+ * @param appendedWhere in/out: whether s already has a WHERE
  */
-int vec0_chunks_iter(vec0_vtab * p, const char * idxStr, int argc, sqlite3_value ** argv, sqlite3_stmt** outStmt) {
-  // always null terminated, enforced by SQLite
-  int idxStrLength = strlen(idxStr);
-  // "1" refers to the initial vec0_query_plan char, 4 is the number of chars per "element"
-  int numValueEntries = (idxStrLength-1) / 4;
-  assert(argc == numValueEntries);
-
-  int rc;
-  sqlite3_str * s = sqlite3_str_new(NULL);
-  sqlite3_str_appendf(s, "select chunk_id, validity, rowids "
-                         " from " VEC0_SHADOW_CHUNKS_NAME,
-                         p->schemaName, p->tableName);
-
-  int appendedWhere = 0;
-  for(int i = 0; i < numValueEntries; i++) {
+static int vec0_partition_constraints_append(sqlite3_str *s,
+                                             const char *idxStr, int argc,
+                                             sqlite3_value **argv,
+                                             int *appendedWhere) {
+  for(int i = 0; i < argc; i++) {
     int idx = 1 + (i * 4);
     char kind = idxStr[idx + 0];
     if(kind != VEC0_IDXSTR_KIND_KNN_PARTITON_CONSTRAINT) {
@@ -6211,9 +8937,9 @@ int vec0_chunks_iter(vec0_vtab * p, const char * idxStr, int argc, sqlite3_value
     int operator = idxStr[idx + 2];
     // idxStr[idx + 3] is just null, a '_' placeholder
 
-    if(!appendedWhere) {
+    if(!*appendedWhere) {
       sqlite3_str_appendall(s, " WHERE ");
-      appendedWhere = 1;
+      *appendedWhere = 1;
     }else {
       sqlite3_str_appendall(s, " AND ");
     }
@@ -6236,15 +8962,205 @@ int vec0_chunks_iter(vec0_vtab * p, const char * idxStr, int argc, sqlite3_value
      case VEC0_PARTITION_OPERATOR_NE:
       sqlite3_str_appendf(s, " partition%02d != ? ", partition_idx);
       break;
+#if COMPILER_SUPPORTS_VTAB_IN
+     case VEC0_PARTITION_OPERATOR_IN: {
+      // one parameter per value of the list
+      sqlite3_value *item;
+      int nItems = 0;
+      int rc;
+      sqlite3_str_appendf(s, " partition%02d IN (", partition_idx);
+      for (rc = sqlite3_vtab_in_first(argv[i], &item); rc == SQLITE_OK && item;
+           rc = sqlite3_vtab_in_next(argv[i], &item)) {
+        sqlite3_str_appendall(s, nItems++ ? ", ?" : "?");
+      }
+      sqlite3_str_appendall(s, ") ");
+      if (rc != SQLITE_DONE) {
+        return rc;
+      }
+      break;
+     }
+#endif
      default: {
-      char * zSql = sqlite3_str_finish(s);
-      sqlite3_free(zSql);
       return SQLITE_ERROR;
      }
 
     }
 
   }
+  return SQLITE_OK;
+}
+
+/**
+ * @brief Bind the values of the partition key constraints appended by
+ * vec0_partition_constraints_append(), from parameter *n on.
+ *
+ * @param n in/out: the next parameter to bind
+ */
+static int vec0_partition_constraints_bind(sqlite3_stmt *stmt,
+                                           const char *idxStr, int argc,
+                                           sqlite3_value **argv, int *n) {
+  for(int i = 0; i < argc; i++) {
+    int idx = 1 + (i * 4);
+    char kind = idxStr[idx + 0];
+    if(kind != VEC0_IDXSTR_KIND_KNN_PARTITON_CONSTRAINT) {
+      continue;
+    }
+#if COMPILER_SUPPORTS_VTAB_IN
+    if (idxStr[idx + 2] == VEC0_PARTITION_OPERATOR_IN) {
+      sqlite3_value *item;
+      int rc;
+      for (rc = sqlite3_vtab_in_first(argv[i], &item); rc == SQLITE_OK && item;
+           rc = sqlite3_vtab_in_next(argv[i], &item)) {
+        sqlite3_bind_value(stmt, (*n)++, item);
+      }
+      if (rc != SQLITE_DONE) {
+        return rc;
+      }
+      continue;
+    }
+#endif
+    sqlite3_bind_value(stmt, (*n)++, argv[i]);
+  }
+  return SQLITE_OK;
+}
+
+// Order in which vec0_chunks_iter() returns chunks
+enum vec0_chunks_order {
+  // storage order
+  VEC0_CHUNKS_ORDER_NONE,
+  // by partition key
+  VEC0_CHUNKS_ORDER_PARTITION,
+  // most recently created chunks first
+  VEC0_CHUNKS_ORDER_NEWEST,
+};
+
+/**
+ * @brief Crete at "iterator" (sqlite3_stmt) of chunks with the given constraints
+ *
+ * Any VEC0_IDXSTR_KIND_KNN_PARTITON_CONSTRAINT values in idxStr/argv will be applied
+ * as WHERE constraints in the underlying stmt SQL, and any consumer of the stmt
+ * can freely step through the stmt with all constraints satisfied.
+ *
+ * @param p - vec0_vtab
+ * @param idxStr - the xBestIndex/xFilter idxstr containing VEC0_IDXSTR values
+ * @param argc - number of argv values from xFilter
+ * @param argv - array of sqlite3_value from xFilter
+ * @param byChunkId - if 1, also constrain on `chunk_id = ?`, the last parameter
+ *  of the stmt, which the caller binds before every step
+ * @param order - order of the chunks. VEC0_CHUNKS_ORDER_PARTITION also selects
+ *  the partition key columns after rowids
+ * @param outStmt - output sqlite3_stmt of chunks with all filters applied
+ * @return int SQLITE_OK on success, error code otherwise
+ */
+int vec0_chunks_iter(vec0_vtab * p, const char * idxStr, int argc, sqlite3_value ** argv, int byChunkId, enum vec0_chunks_order order, sqlite3_stmt** outStmt) {
+  int byPartition = order == VEC0_CHUNKS_ORDER_PARTITION;
+  // always null terminated, enforced by SQLite
+  int idxStrLength = strlen(idxStr);
+  // "1" refers to the initial vec0_query_plan char, 4 is the number of chars per "element"
+  int numValueEntries = (idxStrLength-1) / 4;
+  assert(argc == numValueEntries);
+
+  // with `delta_size=N`, the rows of the _delta table come as one more chunk
+  // with VEC0_DELTA_CHUNK_ID, see vec0_delta_chunk_load(): one per partition
+  // with VEC0_CHUNKS_ORDER_PARTITION, and before the others with
+  // VEC0_CHUNKS_ORDER_NEWEST, by an extra column.
+  int withDelta = p->deltaSize > 0 && !byChunkId;
+  int newestDelta = withDelta && order == VEC0_CHUNKS_ORDER_NEWEST;
+
+  int rc;
+  sqlite3_str * s = sqlite3_str_new(NULL);
+  sqlite3_str_appendall(s, "select chunk_id, validity, rowids");
+  for (int i = 0; byPartition && i < p->numPartitionColumns; i++) {
+    sqlite3_str_appendf(s, ", partition%02d", i);
+  }
+  if (newestDelta) {
+    sqlite3_str_appendall(s, ", 0");
+  }
+  sqlite3_str_appendf(s, " from " VEC0_SHADOW_CHUNKS_NAME,
+                         p->schemaName, p->tableName);
+
+  int appendedWhere = 0;
+  rc = vec0_partition_constraints_append(s, idxStr, argc, argv,
+                                         &appendedWhere);
+  if (rc != SQLITE_OK) {
+    sqlite3_free(sqlite3_str_finish(s));
+    return rc;
+  }
+
+  // equality and `in (...)` constraints on `indexed` metadata columns only
+  // keep the chunks that the column's bitmap index lists for the values
+  for(int i = 0; i < numValueEntries; i++) {
+    int metadata_idx = vec0_indexed_metadata_constraint(p, idxStr, i);
+    if(metadata_idx < 0) {
+      continue;
+    }
+    sqlite3_str_appendall(s, appendedWhere ? " AND " : " WHERE ");
+    appendedWhere = 1;
+    sqlite3_str_appendf(s, " chunk_id IN (SELECT chunk_id FROM " VEC0_SHADOW_METADATA_INDEX_N_NAME " WHERE value",
+                        p->schemaName, p->tableName, metadata_idx);
+    if(p->metadata_columns[metadata_idx].kind == VEC0_METADATA_COLUMN_KIND_DICTIONARY) {
+      sqlite3_str_appendf(s, " IN (SELECT code FROM " VEC0_SHADOW_METADATA_DICT_N_NAME " WHERE value",
+                          p->schemaName, p->tableName, metadata_idx);
+    }
+#if COMPILER_SUPPORTS_VTAB_IN
+    if(idxStr[1 + (i * 4) + 2] == VEC0_METADATA_OPERATOR_IN) {
+      sqlite3_value *item;
+      int nItems = 0;
+      sqlite3_str_appendall(s, " IN (");
+      for (rc = sqlite3_vtab_in_first(argv[i], &item); rc == SQLITE_OK && item;
+           rc = sqlite3_vtab_in_next(argv[i], &item)) {
+        sqlite3_str_appendall(s, nItems++ ? ", ?" : "?");
+      }
+      sqlite3_str_appendall(s, ")");
+      if (rc != SQLITE_DONE) {
+        sqlite3_free(sqlite3_str_finish(s));
+        return rc;
+      }
+    } else
+#endif
+    {
+      sqlite3_str_appendall(s, " = ?");
+    }
+    sqlite3_str_appendall(s, p->metadata_columns[metadata_idx].kind == VEC0_METADATA_COLUMN_KIND_DICTIONARY ? ")) " : ") ");
+  }
+
+  if (byChunkId) {
+    sqlite3_str_appendall(s, appendedWhere ? " AND " : " WHERE ");
+    sqlite3_str_appendall(s, " chunk_id = ? ");
+  }
+  if (withDelta) {
+    int deltaWhere = 0;
+    if (byPartition) {
+      sqlite3_str_appendall(s, " UNION ALL SELECT DISTINCT -1, NULL, NULL");
+      for (int i = 0; i < p->numPartitionColumns; i++) {
+        sqlite3_str_appendf(s, ", partition%02d", i);
+      }
+      sqlite3_str_appendf(s, " FROM " VEC0_SHADOW_DELTA_NAME, p->schemaName,
+                          p->tableName);
+    } else {
+      sqlite3_str_appendf(s,
+                          " UNION ALL SELECT -1, NULL, NULL%s WHERE EXISTS "
+                          "(SELECT 1 FROM " VEC0_SHADOW_DELTA_NAME,
+                          newestDelta ? ", 1" : "", p->schemaName,
+                          p->tableName);
+    }
+    rc = vec0_partition_constraints_append(s, idxStr, argc, argv,
+                                           &deltaWhere);
+    if (rc != SQLITE_OK) {
+      sqlite3_free(sqlite3_str_finish(s));
+      return rc;
+    }
+    if (!byPartition) {
+      sqlite3_str_appendall(s, ")");
+    }
+  }
+  for (int i = 0; byPartition && i < p->numPartitionColumns; i++) {
+    sqlite3_str_appendf(s, "%s partition%02d", i ? "," : " ORDER BY", i);
+  }
+  if (order == VEC0_CHUNKS_ORDER_NEWEST) {
+    sqlite3_str_appendall(s, newestDelta ? " ORDER BY 4 DESC, 1 DESC"
+                                         : " ORDER BY chunk_id DESC");
+  }
 
   char *zSql = sqlite3_str_finish(s);
   if (!zSql) {
@@ -6258,26 +9174,62 @@ int vec0_chunks_iter(vec0_vtab * p, const char * idxStr, int argc, sqlite3_value
   }
 
   int n = 1;
+  rc = vec0_partition_constraints_bind(*outStmt, idxStr, argc, argv, &n);
+  if (rc != SQLITE_OK) {
+    sqlite3_finalize(*outStmt);
+    *outStmt = NULL;
+    return rc;
+  }
+
   for(int i = 0; i < numValueEntries; i++) {
-    int idx = 1 + (i * 4);
-    char kind = idxStr[idx + 0];
-    if(kind != VEC0_IDXSTR_KIND_KNN_PARTITON_CONSTRAINT) {
+    int metadata_idx = vec0_indexed_metadata_constraint(p, idxStr, i);
+    if(metadata_idx < 0) {
+      continue;
+    }
+#if COMPILER_SUPPORTS_VTAB_IN
+    if (idxStr[1 + (i * 4) + 2] == VEC0_METADATA_OPERATOR_IN) {
+      sqlite3_value *item;
+      for (rc = sqlite3_vtab_in_first(argv[i], &item); rc == SQLITE_OK && item;
+           rc = sqlite3_vtab_in_next(argv[i], &item)) {
+        vec0_bind_indexed_metadata_value(p, *outStmt, n++, metadata_idx, item);
+      }
+      if (rc != SQLITE_DONE) {
+        sqlite3_finalize(*outStmt);
+        *outStmt = NULL;
+        return rc;
+      }
+      rc = SQLITE_OK;
       continue;
     }
-    sqlite3_bind_value(*outStmt, n++, argv[i]);
+#endif
+    vec0_bind_indexed_metadata_value(p, *outStmt, n++, metadata_idx, argv[i]);
+  }
+
+  if (withDelta) {
+    rc = vec0_partition_constraints_bind(*outStmt, idxStr, argc, argv, &n);
+    if (rc != SQLITE_OK) {
+      sqlite3_finalize(*outStmt);
+      *outStmt = NULL;
+      return rc;
+    }
   }
 
   return rc;
 }
 
+struct Vec0FilterProgram;
+
 // a single `xxx in (...)` constraint on a metadata column. TEXT or INTEGER only for now.
 struct Vec0MetadataIn{
   // index of argv[i]` the constraint is on
   int argv_idx;
-  // metadata column index of the constraint, derived from idxStr + argv_idx
+  // metadata column index of the constraint, derived from idxStr + argv_idx.
+  // -1 for a `filter = '...'` constraint.
   int metadata_idx;
   // array of the copied `(...)` values from sqlite3_vtab_in_first()/sqlite3_vtab_in_next()
   struct Array array;
+  // the compiled expression of a `filter = '...'` constraint, NULL otherwise
+  struct Vec0FilterProgram *program;
 };
 
 // Array elements for `xxx in (...)` values for a text column. basically just a string
@@ -6331,37 +9283,188 @@ static int vec0_is_prefix_only_glob_pattern(const char *pattern, int n) {
 }
 
 
-int vec0_metadata_filter_text(vec0_vtab * p, sqlite3_value * value, const void * buffer, int size, vec0_metadata_operator op, u8* b, int metadata_idx, int chunk_rowid, struct Array * aMetadataIn, int argv_idx) {
-  int rc;
-  sqlite3_stmt * stmt = NULL;
-  i64 * rowids = NULL;
-  sqlite3_blob * rowidsBlob;
-  const char * sTarget = (const char *) sqlite3_value_text(value);
-  int nTarget = sqlite3_value_bytes(value);
-
-
-  // TODO(perf): only text metadata news the rowids BLOB. Make it so that
-  // rowids BLOB is re-used when multiple fitlers on text columns,
-  // ex "name BETWEEN 'a' and 'b'""
-  rc = sqlite3_blob_open(p->db, p->schemaName, p->shadowChunksName, "rowids", chunk_rowid, 0, &rowidsBlob);
-  if(rc != SQLITE_OK) {
-    return rc;
+/**
+ * @brief Compare two TEXT values byte by byte, the shorter one first on a tie,
+ * like SQLite's BINARY collation.
+ */
+static int vec0_text_cmp(const char *a, int na, const char *b, int nb) {
+  int cmp = memcmp(a, b, min(na, nb));
+  if (cmp == 0) {
+    cmp = na - nb;
   }
-  assert(sqlite3_blob_bytes(rowidsBlob) % sizeof(i64) == 0);
-  assert((size_t)(sqlite3_blob_bytes(rowidsBlob) / sizeof(i64)) == (size_t)size);
+  return cmp;
+}
 
-  rowids = sqlite3_malloc(sqlite3_blob_bytes(rowidsBlob));
-  if(!rowids) {
-    sqlite3_blob_close(rowidsBlob);
-    return SQLITE_NOMEM;
+/**
+ * @brief Whether a complete TEXT metadata value passes a constraint.
+ *
+ * @param s the value, NUL-terminated
+ * @param n length of s in bytes
+ * @param aTarget the `(...)` values for IN, NULL otherwise
+ */
+static int vec0_metadata_text_matches(vec0_metadata_operator op, const char *s,
+                                      int n, const char *sTarget, int nTarget,
+                                      struct Array *aTarget) {
+  switch (op) {
+  case VEC0_METADATA_OPERATOR_EQ:
+    return n == nTarget && memcmp(s, sTarget, n) == 0;
+  case VEC0_METADATA_OPERATOR_NE:
+    return !(n == nTarget && memcmp(s, sTarget, n) == 0);
+  case VEC0_METADATA_OPERATOR_GT:
+    return vec0_text_cmp(s, n, sTarget, nTarget) > 0;
+  case VEC0_METADATA_OPERATOR_GE:
+    return vec0_text_cmp(s, n, sTarget, nTarget) >= 0;
+  case VEC0_METADATA_OPERATOR_LT:
+    return vec0_text_cmp(s, n, sTarget, nTarget) < 0;
+  case VEC0_METADATA_OPERATOR_LE:
+    return vec0_text_cmp(s, n, sTarget, nTarget) <= 0;
+  case VEC0_METADATA_OPERATOR_IN:
+    for (size_t i = 0; i < aTarget->length; i++) {
+      struct Vec0MetadataInTextEntry *entry =
+          &((struct Vec0MetadataInTextEntry *)aTarget->z)[i];
+      if (entry->n == n && memcmp(s, entry->zString, n) == 0) {
+        return 1;
+      }
+    }
+    return 0;
+  case VEC0_METADATA_OPERATOR_LIKE:
+    // sqlite3_strlike returns 0 on match, non-zero otherwise
+    return sqlite3_strlike(sTarget, s, 0) == 0;
+  case VEC0_METADATA_OPERATOR_GLOB:
+    return sqlite3_strglob(sTarget, s) == 0;
+  case VEC0_METADATA_OPERATOR_ISNOTNULL:
+    return 1;
+  default:
+    // IS NULL, metadata columns don't support NULL
+    return 0;
   }
+}
 
-  rc = sqlite3_blob_read(rowidsBlob, rowids, sqlite3_blob_bytes(rowidsBlob), 0);
-  if(rc != SQLITE_OK) {
-    sqlite3_blob_close(rowidsBlob);
-    return rc;
+/**
+ * @brief Try to decide a constraint on a TEXT metadata value from its inline
+ * view alone: the whole value when it fits, otherwise its first
+ * VEC0_METADATA_TEXT_VIEW_DATA_LENGTH bytes and its length.
+ *
+ * @param prefixOnly length of the pattern before its trailing wildcard for
+ * prefix-only LIKE/GLOB patterns like 'abc%', -1 otherwise
+ * @param match output, whether the value passes, when decided
+ * @return int 1 if decided, 0 if the full text is needed
+ */
+static int vec0_metadata_text_view_matches(vec0_metadata_operator op,
+                                           const u8 *view, const char *sTarget,
+                                           int nTarget, struct Array *aTarget,
+                                           int prefixOnly, int *match) {
+  int n = ((const int *)view)[0];
+  const char *s = (const char *)&view[4];
+  if (n <= VEC0_METADATA_TEXT_VIEW_DATA_LENGTH) {
+    char full[VEC0_METADATA_TEXT_VIEW_DATA_LENGTH + 1];
+    memcpy(full, s, n);
+    full[n] = '\0';
+    *match = vec0_metadata_text_matches(op, full, n, sTarget, nTarget, aTarget);
+    return 1;
+  }
+
+  int nInline = VEC0_METADATA_TEXT_VIEW_DATA_LENGTH;
+  switch (op) {
+  case VEC0_METADATA_OPERATOR_EQ:
+  case VEC0_METADATA_OPERATOR_NE: {
+    if (n == nTarget && memcmp(s, sTarget, nInline) == 0) {
+      return 0;
+    }
+    *match = op == VEC0_METADATA_OPERATOR_NE;
+    return 1;
+  }
+  case VEC0_METADATA_OPERATOR_GT:
+  case VEC0_METADATA_OPERATOR_GE:
+  case VEC0_METADATA_OPERATOR_LT:
+  case VEC0_METADATA_OPERATOR_LE: {
+    int cmp = memcmp(s, sTarget, min(nInline, nTarget));
+    if (cmp == 0) {
+      // a target that fits in the prefix is a prefix of the longer value
+      if (nTarget > nInline) {
+        return 0;
+      }
+      cmp = 1;
+    }
+    *match = (op == VEC0_METADATA_OPERATOR_GT && cmp > 0) ||
+             (op == VEC0_METADATA_OPERATOR_GE && cmp >= 0) ||
+             (op == VEC0_METADATA_OPERATOR_LT && cmp < 0) ||
+             (op == VEC0_METADATA_OPERATOR_LE && cmp <= 0);
+    return 1;
+  }
+  case VEC0_METADATA_OPERATOR_IN: {
+    for (size_t i = 0; i < aTarget->length; i++) {
+      struct Vec0MetadataInTextEntry *entry =
+          &((struct Vec0MetadataInTextEntry *)aTarget->z)[i];
+      if (entry->n == n && memcmp(s, entry->zString, nInline) == 0) {
+        return 0;
+      }
+    }
+    *match = 0;
+    return 1;
+  }
+  case VEC0_METADATA_OPERATOR_LIKE:
+  case VEC0_METADATA_OPERATOR_GLOB: {
+    if (prefixOnly < 0) {
+      return 0;
+    }
+    int nCompare = min(prefixOnly, nInline);
+    int cmp = op == VEC0_METADATA_OPERATOR_LIKE
+                  ? sqlite3_strnicmp(s, sTarget, nCompare)
+                  : memcmp(s, sTarget, nCompare);
+    if (cmp == 0 && prefixOnly > nInline) {
+      return 0;
+    }
+    *match = cmp == 0 && n >= prefixOnly;
+    return 1;
+  }
+  default:
+    *match = vec0_metadata_text_matches(op, s, n, sTarget, nTarget, aTarget);
+    return 1;
   }
-  sqlite3_blob_close(rowidsBlob);
+}
+
+// A chunk offset and the rowid stored there
+struct Vec0TextRow {
+  i64 rowid;
+  int i;
+};
+
+static int vec0_text_row_cmp(const void *a, const void *b) {
+  i64 x = ((const struct Vec0TextRow *)a)->rowid;
+  i64 y = ((const struct Vec0TextRow *)b)->rowid;
+  return (x > y) - (x < y);
+}
+
+/**
+ * @brief Filter the rows of a chunk on a TEXT metadata column.
+ *
+ * Most rows are decided from their inline views. The long values that aren't
+ * are read from _metadatatextNN together, in rowid order, with one range query
+ * per run of rowids less than a chunk apart, instead of one query per row.
+ *
+ * @param p vec0_vtab
+ * @param value value of the constraint
+ * @param buffer the chunk's text views
+ * @param size size of the chunk
+ * @param op operator of the constraint
+ * @param mask rows to evaluate, the others are left at 0 in b
+ * @param b output bitmap, zeroed by the caller
+ * @param metadata_idx index of the TEXT metadata column
+ * @param rowids rowids of the chunk
+ * @param aMetadataIn `xxx in (...)` metadata values, NULL if none
+ * @param argv_idx index of the constraint in argv
+ * @return int SQLITE_OK on success, error code otherwise
+ */
+int vec0_metadata_filter_text(vec0_vtab * p, sqlite3_value * value, const void * buffer, int size, vec0_metadata_operator op, u8 * mask, u8* b, int metadata_idx, const i64 * rowids, struct Array * aMetadataIn, int argv_idx) {
+  int rc = SQLITE_OK;
+  sqlite3_stmt * stmt = NULL;
+  struct Vec0TextRow * undecided = NULL;
+  int nUndecided = 0;
+  const char * sTarget = (const char *) sqlite3_value_text(value);
+  int nTarget = sqlite3_value_bytes(value);
+  struct Array * aTarget = NULL;
+  int prefixOnly = -1;
 
   // Map IS/ISNOT to EQ/NE (they behave identically for text)
   if(op == VEC0_METADATA_OPERATOR_IS) {
@@ -6370,482 +9473,456 @@ int vec0_metadata_filter_text(vec0_vtab * p, sqlite3_value * value, const void *
     op = VEC0_METADATA_OPERATOR_NE;
   }
 
-  switch(op) {
-    int nPrefix;
-    char * sPrefix;
-    char *sFull;
-    int nFull;
-    u8 * view;
-    case VEC0_METADATA_OPERATOR_EQ: {
-      for(int i = 0; i < size; i++) {
-        view = &((u8*) buffer)[i * VEC0_METADATA_TEXT_VIEW_BUFFER_LENGTH];
-        nPrefix = ((int*) view)[0];
-        sPrefix = (char *) &view[4];
-
-        // for EQ the text lengths must match
-        if(nPrefix != nTarget) {
-          bitmap_set(b, i, 0);
-          continue;
-        }
-        int cmpPrefix = strncmp(sPrefix, sTarget, min(nPrefix, VEC0_METADATA_TEXT_VIEW_DATA_LENGTH));
-
-        // for short strings, use the prefix comparison direclty
-        if(nPrefix <= VEC0_METADATA_TEXT_VIEW_DATA_LENGTH) {
-          bitmap_set(b, i, cmpPrefix == 0);
-          continue;
-        }
-        // for EQ on longs strings, the prefix must match
-        if(cmpPrefix) {
-          bitmap_set(b, i, 0);
-          continue;
-        }
-        // consult the full string
-        rc = vec0_get_metadata_text_long_value(p, &stmt, metadata_idx, rowids[i], &nFull, &sFull);
-        if(rc != SQLITE_OK) {
-          goto done;
-        }
-        if(nPrefix != nFull) {
-          rc = SQLITE_ERROR;
-          goto done;
-        }
-        bitmap_set(b, i, strncmp(sFull, sTarget, nFull) == 0);
+  if(op == VEC0_METADATA_OPERATOR_IN) {
+    for(size_t i = 0; i < aMetadataIn->length; i++) {
+      struct Vec0MetadataIn * metadataIn = &(((struct Vec0MetadataIn *) aMetadataIn->z)[i]);
+      if(metadataIn->argv_idx == argv_idx) {
+        aTarget = &metadataIn->array;
+        break;
       }
-      break;
     }
-    case VEC0_METADATA_OPERATOR_NE: {
-      for(int i = 0; i < size; i++) {
-        view = &((u8*) buffer)[i * VEC0_METADATA_TEXT_VIEW_BUFFER_LENGTH];
-        nPrefix = ((int*) view)[0];
-        sPrefix = (char *) &view[4];
-
-        // for NE if text lengths dont match, it never will
-        if(nPrefix != nTarget) {
-          bitmap_set(b, i, 1);
-          continue;
-        }
-
-        int cmpPrefix = strncmp(sPrefix, sTarget, min(nPrefix, VEC0_METADATA_TEXT_VIEW_DATA_LENGTH));
-
-        // for short strings, use the prefix comparison direclty
-        if(nPrefix <= VEC0_METADATA_TEXT_VIEW_DATA_LENGTH) {
-          bitmap_set(b, i, cmpPrefix != 0);
-          continue;
-        }
-        // for NE on longs strings, if prefixes dont match, then long string wont
-        if(cmpPrefix) {
-          bitmap_set(b, i, 1);
-          continue;
-        }
-        // consult the full string
-        rc = vec0_get_metadata_text_long_value(p, &stmt, metadata_idx, rowids[i], &nFull, &sFull);
-        if(rc != SQLITE_OK) {
-          goto done;
-        }
-        if(nPrefix != nFull) {
-          rc = SQLITE_ERROR;
-          goto done;
-        }
-        bitmap_set(b, i, strncmp(sFull, sTarget, nFull) != 0);
-      }
-      break;
+    if(!aTarget) {
+      return SQLITE_ERROR;
     }
-    case VEC0_METADATA_OPERATOR_GT: {
-      for(int i = 0; i < size; i++) {
-        view = &((u8*) buffer)[i * VEC0_METADATA_TEXT_VIEW_BUFFER_LENGTH];
-        nPrefix = ((int*) view)[0];
-        sPrefix = (char *) &view[4];
-        int cmpPrefix = strncmp(sPrefix, sTarget, min(min(nPrefix, VEC0_METADATA_TEXT_VIEW_DATA_LENGTH), nTarget));
-
-        if(nPrefix < VEC0_METADATA_TEXT_VIEW_DATA_LENGTH) {
-          // if prefix match, check which is longer
-          if(cmpPrefix == 0) {
-            bitmap_set(b, i, nPrefix > nTarget);
-          }
-          else {
-            bitmap_set(b, i, cmpPrefix > 0);
-          }
-          continue;
-        }
-        // TODO(perf): may not need to compare full text in some cases
+  }
+  // prefix-only patterns (ie 'abc%') are mostly decided by the inline prefix
+  if(op == VEC0_METADATA_OPERATOR_LIKE && vec0_is_prefix_only_like_pattern(sTarget, nTarget)) {
+    prefixOnly = nTarget - 1;
+  } else if(op == VEC0_METADATA_OPERATOR_GLOB && vec0_is_prefix_only_glob_pattern(sTarget, nTarget)) {
+    prefixOnly = nTarget - 1;
+  }
 
-        rc = vec0_get_metadata_text_long_value(p, &stmt, metadata_idx, rowids[i], &nFull, &sFull);
-        if(rc != SQLITE_OK) {
-          goto done;
-        }
-        if(nPrefix != nFull) {
-          rc = SQLITE_ERROR;
-          goto done;
-        }
-        bitmap_set(b, i, strncmp(sFull, sTarget, nFull) > 0);
+  for(int i = 0; i < size; i++) {
+    if(!bitmap_get(mask, i)) {
+      continue;
+    }
+    const u8 * view = &((const u8*) buffer)[i * VEC0_METADATA_TEXT_VIEW_BUFFER_LENGTH];
+    int match;
+    if(vec0_metadata_text_view_matches(op, view, sTarget, nTarget, aTarget, prefixOnly, &match)) {
+      bitmap_set(b, i, match);
+      continue;
+    }
+    if(!undecided) {
+      undecided = sqlite3_malloc(size * sizeof(*undecided));
+      if(!undecided) {
+        return SQLITE_NOMEM;
       }
-      break;
     }
-    case VEC0_METADATA_OPERATOR_GE: {
-      for(int i = 0; i < size; i++) {
-        view = &((u8*) buffer)[i * VEC0_METADATA_TEXT_VIEW_BUFFER_LENGTH];
-        nPrefix = ((int*) view)[0];
-        sPrefix = (char *) &view[4];
-        int cmpPrefix = strncmp(sPrefix, sTarget, min(min(nPrefix, VEC0_METADATA_TEXT_VIEW_DATA_LENGTH), nTarget));
-
-        if(nPrefix < VEC0_METADATA_TEXT_VIEW_DATA_LENGTH) {
-          // if prefix match, check which is longer
-          if(cmpPrefix == 0) {
-            bitmap_set(b, i, nPrefix >= nTarget);
-          }
-          else {
-            bitmap_set(b, i, cmpPrefix >= 0);
-          }
-          continue;
-        }
-        // TODO(perf): may not need to compare full text in some cases
-
-        rc = vec0_get_metadata_text_long_value(p, &stmt, metadata_idx, rowids[i], &nFull, &sFull);
-        if(rc != SQLITE_OK) {
-          goto done;
-        }
-        if(nPrefix != nFull) {
-          rc = SQLITE_ERROR;
-          goto done;
-        }
-        bitmap_set(b, i, strncmp(sFull, sTarget, nFull) >= 0);
-      }
-      break;
-    }
-    case VEC0_METADATA_OPERATOR_LE: {
-      for(int i = 0; i < size; i++) {
-        view = &((u8*) buffer)[i * VEC0_METADATA_TEXT_VIEW_BUFFER_LENGTH];
-        nPrefix = ((int*) view)[0];
-        sPrefix = (char *) &view[4];
-        int cmpPrefix = strncmp(sPrefix, sTarget, min(min(nPrefix, VEC0_METADATA_TEXT_VIEW_DATA_LENGTH), nTarget));
-
-        if(nPrefix < VEC0_METADATA_TEXT_VIEW_DATA_LENGTH) {
-          // if prefix match, check which is longer
-          if(cmpPrefix == 0) {
-            bitmap_set(b, i, nPrefix <= nTarget);
-          }
-          else {
-            bitmap_set(b, i, cmpPrefix <= 0);
-          }
-          continue;
-        }
-        // TODO(perf): may not need to compare full text in some cases
+    undecided[nUndecided].rowid = rowids[i];
+    undecided[nUndecided].i = i;
+    nUndecided++;
+  }
+  if(!nUndecided) {
+    return SQLITE_OK;
+  }
 
-        rc = vec0_get_metadata_text_long_value(p, &stmt, metadata_idx, rowids[i], &nFull, &sFull);
-        if(rc != SQLITE_OK) {
-          goto done;
-        }
-        if(nPrefix != nFull) {
-          rc = SQLITE_ERROR;
-          goto done;
-        }
-        bitmap_set(b, i, strncmp(sFull, sTarget, nFull) <= 0);
-      }
-      break;
-    }
-    case VEC0_METADATA_OPERATOR_LT: {
-      for(int i = 0; i < size; i++) {
-        view = &((u8*) buffer)[i * VEC0_METADATA_TEXT_VIEW_BUFFER_LENGTH];
-        nPrefix = ((int*) view)[0];
-        sPrefix = (char *) &view[4];
-        int cmpPrefix = strncmp(sPrefix, sTarget, min(min(nPrefix, VEC0_METADATA_TEXT_VIEW_DATA_LENGTH), nTarget));
-
-        if(nPrefix < VEC0_METADATA_TEXT_VIEW_DATA_LENGTH) {
-          // if prefix match, check which is longer
-          if(cmpPrefix == 0) {
-            bitmap_set(b, i, nPrefix < nTarget);
-          }
-          else {
-            bitmap_set(b, i, cmpPrefix < 0);
-          }
-          continue;
-        }
-        // TODO(perf): may not need to compare full text in some cases
+  qsort(undecided, nUndecided, sizeof(*undecided), vec0_text_row_cmp);
+  char * zSql = sqlite3_mprintf("SELECT rowid, data FROM " VEC0_SHADOW_METADATA_TEXT_DATA_NAME " WHERE rowid BETWEEN ?1 AND ?2 ORDER BY rowid", p->schemaName, p->tableName, metadata_idx);
+  if(!zSql) {
+    rc = SQLITE_NOMEM;
+    goto done;
+  }
+  rc = sqlite3_prepare_v2(p->db, zSql, -1, &stmt, NULL);
+  sqlite3_free(zSql);
+  if(rc != SQLITE_OK) {
+    goto done;
+  }
 
-        rc = vec0_get_metadata_text_long_value(p, &stmt, metadata_idx, rowids[i], &nFull, &sFull);
-        if(rc != SQLITE_OK) {
-          goto done;
-        }
-        if(nPrefix != nFull) {
-          rc = SQLITE_ERROR;
-          goto done;
-        }
-        bitmap_set(b, i, strncmp(sFull, sTarget, nFull) < 0);
-      }
-      break;
+  for(int start = 0; start < nUndecided; ) {
+    int end = start;
+    while(end + 1 < nUndecided && undecided[end + 1].rowid - undecided[end].rowid <= p->chunk_size) {
+      end++;
     }
-
-    case VEC0_METADATA_OPERATOR_IN: {
-      int metadataInIdx = -1;
-      for(size_t i = 0; i < aMetadataIn->length; i++) {
-        struct Vec0MetadataIn * metadataIn = &(((struct Vec0MetadataIn *) aMetadataIn->z)[i]);
-        if(metadataIn->argv_idx == argv_idx) {
-          metadataInIdx = i;
-          break;
-        }
+    sqlite3_reset(stmt);
+    sqlite3_bind_int64(stmt, 1, undecided[start].rowid);
+    sqlite3_bind_int64(stmt, 2, undecided[end].rowid);
+    int j = start;
+    while(j <= end && (rc = sqlite3_step(stmt)) == SQLITE_ROW) {
+      i64 rowid = sqlite3_column_int64(stmt, 0);
+      // other long values in the range
+      if(rowid < undecided[j].rowid) {
+        continue;
       }
-      if(metadataInIdx < 0) {
+      if(rowid > undecided[j].rowid) {
+        break;
+      }
+      const u8 * view = &((const u8*) buffer)[undecided[j].i * VEC0_METADATA_TEXT_VIEW_BUFFER_LENGTH];
+      const char * sFull = (const char *) sqlite3_column_text(stmt, 1);
+      int nFull = sqlite3_column_bytes(stmt, 1);
+      if(!sFull || nFull != ((const int *)view)[0]) {
         rc = SQLITE_ERROR;
         goto done;
       }
-
-      struct Vec0MetadataIn * metadataIn = &((struct Vec0MetadataIn *) aMetadataIn->z)[metadataInIdx];
-      struct Array * aTarget = &(metadataIn->array);
-
-
-      int nPrefix;
-      char * sPrefix;
-      char *sFull;
-      int nFull;
-      u8 * view;
-      for(int i = 0; i < size; i++) {
-        view = &((u8*) buffer)[i * VEC0_METADATA_TEXT_VIEW_BUFFER_LENGTH];
-        nPrefix = ((int*) view)[0];
-        sPrefix = (char *) &view[4];
-        for(size_t target_idx = 0; target_idx < aTarget->length; target_idx++) {
-          struct Vec0MetadataInTextEntry * entry = &(((struct Vec0MetadataInTextEntry*)aTarget->z)[target_idx]);
-          if(entry->n != nPrefix) {
-            continue;
-          }
-          int cmpPrefix = strncmp(sPrefix, entry->zString, min(nPrefix, VEC0_METADATA_TEXT_VIEW_DATA_LENGTH));
-          if(nPrefix <= VEC0_METADATA_TEXT_VIEW_DATA_LENGTH) {
-            if(cmpPrefix == 0) {
-              bitmap_set(b, i, 1);
-              break;
-            }
-            continue;
-          }
-          if(cmpPrefix) {
-            continue;
-          }
-
-          rc = vec0_get_metadata_text_long_value(p, &stmt, metadata_idx, rowids[i], &nFull, &sFull);
-          if(rc != SQLITE_OK) {
-            goto done;
-          }
-          if(nPrefix != nFull) {
-            rc = SQLITE_ERROR;
-            goto done;
-          }
-          if(strncmp(sFull, entry->zString, nFull) == 0) {
-            bitmap_set(b, i, 1);
-            break;
-          }
-        }
-      }
-      break;
+      bitmap_set(b, undecided[j].i, vec0_metadata_text_matches(op, sFull, nFull, sTarget, nTarget, aTarget));
+      j++;
     }
+    if(rc != SQLITE_ROW && rc != SQLITE_DONE) {
+      goto done;
+    }
+    // a long value is missing from _metadatatextNN
+    if(j <= end) {
+      rc = SQLITE_ERROR;
+      goto done;
+    }
+    start = end + 1;
+  }
+  rc = SQLITE_OK;
 
-    case VEC0_METADATA_OPERATOR_LIKE: {
-      int is_prefix_only = vec0_is_prefix_only_like_pattern(sTarget, nTarget);
-
-      if (is_prefix_only) {
-        // Fast path: prefix-only pattern (e.g., 'abc%')
-        // Can use the 12-byte cache for optimization
-        int nPattern = nTarget - 1;  // Exclude trailing '%'
-
-        for(int i = 0; i < size; i++) {
-          view = &((u8*) buffer)[i * VEC0_METADATA_TEXT_VIEW_BUFFER_LENGTH];
-          nPrefix = ((int*) view)[0];
-          sPrefix = (char *) &view[4];
+  done:
+    sqlite3_finalize(stmt);
+    sqlite3_free(undecided);
+    return rc;
+}
 
-          // String must be at least as long as the pattern prefix
-          if(nPrefix < nPattern) {
-            bitmap_set(b, i, 0);
-            continue;
-          }
+// IN lists on INTEGER metadata columns up to this long are matched by
+// comparing every row to every value, longer ones with a binary search.
+#define VEC0_METADATA_IN_SMALL_SET 16
 
-          // Compare pattern prefix against cached prefix (case-insensitive)
-          int cmpLen = min(nPattern, VEC0_METADATA_TEXT_VIEW_DATA_LENGTH);
-          int cmpPrefix = sqlite3_strnicmp(sPrefix, sTarget, cmpLen);
+// One bitmap byte out of 8 comparisons: bit j is v[j] OP t
+#define VEC0_METADATA_CMP8(v, OP, t)                                           \
+  (u8)(((v)[0] OP(t)) | (((v)[1] OP(t)) << 1) | (((v)[2] OP(t)) << 2) |        \
+       (((v)[3] OP(t)) << 3) | (((v)[4] OP(t)) << 4) |                         \
+       (((v)[5] OP(t)) << 5) | (((v)[6] OP(t)) << 6) | (((v)[7] OP(t)) << 7))
 
-          // For short strings (fits in cache), prefix comparison is enough
-          if(nPrefix <= VEC0_METADATA_TEXT_VIEW_DATA_LENGTH) {
-            bitmap_set(b, i, cmpPrefix == 0);
-            continue;
-          }
+#define VEC0_METADATA_CMP_LOOP(OP)                                             \
+  for (int i = 0; i < size / CHAR_BIT; i++) {                                  \
+    b[i] = VEC0_METADATA_CMP8(&array[i * CHAR_BIT], OP, target);               \
+  }
 
-          // For long strings, if cached prefix doesn't match, reject early
-          if(cmpPrefix != 0) {
-            bitmap_set(b, i, 0);
-            continue;
-          }
+static int vec0_cmp_i64(const void *a, const void *b) {
+  i64 x = *(const i64 *)a;
+  i64 y = *(const i64 *)b;
+  return (x > y) - (x < y);
+}
 
-          // If pattern fits in cache, it matches
-          if(nPattern <= VEC0_METADATA_TEXT_VIEW_DATA_LENGTH) {
-            bitmap_set(b, i, 1);
-            continue;
-          }
+#ifdef SQLITE_VEC_ENABLE_AVX
+/**
+ * SSE4.2 version of vec0_metadata_cmp_i64(), for the comparison operators.
+ * NE, LE and GE are the complements of EQ, GT and LT.
+ */
+static void vec0_metadata_cmp_i64_sse(const i64 *array, i64 target,
+                                      vec0_metadata_operator op, u8 *b,
+                                      int size) {
+  __m128i t = _mm_set1_epi64x(target);
+  int eq = op == VEC0_METADATA_OPERATOR_EQ || op == VEC0_METADATA_OPERATOR_NE;
+  int swap = op == VEC0_METADATA_OPERATOR_LT || op == VEC0_METADATA_OPERATOR_GE;
+  int invert = op == VEC0_METADATA_OPERATOR_NE ||
+               op == VEC0_METADATA_OPERATOR_LE ||
+               op == VEC0_METADATA_OPERATOR_GE;
+  for (int i = 0; i < size / CHAR_BIT; i++) {
+    int m = 0;
+    for (int j = 0; j < CHAR_BIT; j += 2) {
+      __m128i v = _mm_loadu_si128((const __m128i *)&array[i * CHAR_BIT + j]);
+      __m128i r = eq     ? _mm_cmpeq_epi64(v, t)
+                  : swap ? _mm_cmpgt_epi64(t, v)
+                         : _mm_cmpgt_epi64(v, t);
+      m |= _mm_movemask_pd(_mm_castsi128_pd(r)) << j;
+    }
+    b[i] = (u8)(invert ? ~m : m);
+  }
+}
 
-          // Pattern is longer than cache, need to check full string
-          rc = vec0_get_metadata_text_long_value(p, &stmt, metadata_idx, rowids[i], &nFull, &sFull);
-          if(rc != SQLITE_OK) {
-            goto done;
-          }
-          if(nPrefix != nFull) {
-            rc = SQLITE_ERROR;
-            goto done;
-          }
+#define VEC0_METADATA_CMP_PD_LOOP(PRED)                                        \
+  for (int i = 0; i < size / CHAR_BIT; i++) {                                  \
+    const double *v = &array[i * CHAR_BIT];                                    \
+    b[i] = (u8)(_mm256_movemask_pd(                                            \
+                    _mm256_cmp_pd(_mm256_loadu_pd(v), t, PRED)) |              \
+                (_mm256_movemask_pd(                                           \
+                     _mm256_cmp_pd(_mm256_loadu_pd(v + 4), t, PRED))           \
+                 << 4));                                                       \
+  }
+#endif
 
-          // Check if full string starts with pattern prefix (case-insensitive)
-          bitmap_set(b, i, sqlite3_strnicmp(sFull, sTarget, nPattern) == 0);
-        }
-      } else {
-        // Slow path: complex pattern (e.g., '%abc', 'a%b', etc.)
-        // Must fetch and check full string for each row
-        for(int i = 0; i < size; i++) {
-          view = &((u8*) buffer)[i * VEC0_METADATA_TEXT_VIEW_BUFFER_LENGTH];
-          nPrefix = ((int*) view)[0];
-          sPrefix = (char *) &view[4];
-
-          // For short strings, use cached value directly
-          if(nPrefix <= VEC0_METADATA_TEXT_VIEW_DATA_LENGTH) {
-            // sqlite3_strlike returns 0 on match, non-zero otherwise
-            bitmap_set(b, i, sqlite3_strlike(sTarget, sPrefix, 0) == 0);
-            continue;
-          }
+/**
+ * @brief Evaluates a comparison on the values of an INTEGER metadata chunk,
+ * writing the matches to b a byte (8 rows) at a time.
+ *
+ * @param size chunk size, a multiple of 8
+ */
+static void vec0_metadata_cmp_i64(const i64 *array, i64 target,
+                                  vec0_metadata_operator op, u8 *b, int size) {
+  // IS/IS NOT behave like =/!= for non-NULL values
+  if (op == VEC0_METADATA_OPERATOR_IS) {
+    op = VEC0_METADATA_OPERATOR_EQ;
+  } else if (op == VEC0_METADATA_OPERATOR_ISNOT) {
+    op = VEC0_METADATA_OPERATOR_NE;
+  }
+  switch (op) {
+  case VEC0_METADATA_OPERATOR_EQ:
+  case VEC0_METADATA_OPERATOR_GT:
+  case VEC0_METADATA_OPERATOR_LE:
+  case VEC0_METADATA_OPERATOR_LT:
+  case VEC0_METADATA_OPERATOR_GE:
+  case VEC0_METADATA_OPERATOR_NE:
+#ifdef SQLITE_VEC_ENABLE_AVX
+    vec0_metadata_cmp_i64_sse(array, target, op, b, size);
+    return;
+#else
+    break;
+#endif
+  case VEC0_METADATA_OPERATOR_ISNULL:
+    // metadata columns don't support NULL
+    bitmap_clear(b, size);
+    return;
+  case VEC0_METADATA_OPERATOR_ISNOTNULL:
+    bitmap_fill(b, size);
+    return;
+  default:
+    // IN is vec0_metadata_in_i64(), LIKE/GLOB only apply to TEXT columns
+    return;
+  }
+  switch (op) {
+  case VEC0_METADATA_OPERATOR_EQ: VEC0_METADATA_CMP_LOOP(==); break;
+  case VEC0_METADATA_OPERATOR_GT: VEC0_METADATA_CMP_LOOP(>); break;
+  case VEC0_METADATA_OPERATOR_LE: VEC0_METADATA_CMP_LOOP(<=); break;
+  case VEC0_METADATA_OPERATOR_LT: VEC0_METADATA_CMP_LOOP(<); break;
+  case VEC0_METADATA_OPERATOR_GE: VEC0_METADATA_CMP_LOOP(>=); break;
+  case VEC0_METADATA_OPERATOR_NE: VEC0_METADATA_CMP_LOOP(!=); break;
+  default: break;
+  }
+}
 
-          // For long strings, fetch full value
-          rc = vec0_get_metadata_text_long_value(p, &stmt, metadata_idx, rowids[i], &nFull, &sFull);
-          if(rc != SQLITE_OK) {
-            goto done;
-          }
-          if(nPrefix != nFull) {
-            rc = SQLITE_ERROR;
-            goto done;
-          }
+/**
+ * @brief FLOAT metadata version of vec0_metadata_cmp_i64(). Comparisons with
+ * NaN are false, except for !=.
+ */
+static void vec0_metadata_cmp_f64(const double *array, double target,
+                                  vec0_metadata_operator op, u8 *b, int size) {
+  if (op == VEC0_METADATA_OPERATOR_IS) {
+    op = VEC0_METADATA_OPERATOR_EQ;
+  } else if (op == VEC0_METADATA_OPERATOR_ISNOT) {
+    op = VEC0_METADATA_OPERATOR_NE;
+  }
+#ifdef SQLITE_VEC_ENABLE_AVX
+  __m256d t = _mm256_set1_pd(target);
+  switch (op) {
+  case VEC0_METADATA_OPERATOR_EQ: VEC0_METADATA_CMP_PD_LOOP(_CMP_EQ_OQ); return;
+  case VEC0_METADATA_OPERATOR_GT: VEC0_METADATA_CMP_PD_LOOP(_CMP_GT_OQ); return;
+  case VEC0_METADATA_OPERATOR_LE: VEC0_METADATA_CMP_PD_LOOP(_CMP_LE_OQ); return;
+  case VEC0_METADATA_OPERATOR_LT: VEC0_METADATA_CMP_PD_LOOP(_CMP_LT_OQ); return;
+  case VEC0_METADATA_OPERATOR_GE: VEC0_METADATA_CMP_PD_LOOP(_CMP_GE_OQ); return;
+  case VEC0_METADATA_OPERATOR_NE: VEC0_METADATA_CMP_PD_LOOP(_CMP_NEQ_UQ); return;
+  default: break;
+  }
+#endif
+  switch (op) {
+  case VEC0_METADATA_OPERATOR_EQ: VEC0_METADATA_CMP_LOOP(==); break;
+  case VEC0_METADATA_OPERATOR_GT: VEC0_METADATA_CMP_LOOP(>); break;
+  case VEC0_METADATA_OPERATOR_LE: VEC0_METADATA_CMP_LOOP(<=); break;
+  case VEC0_METADATA_OPERATOR_LT: VEC0_METADATA_CMP_LOOP(<); break;
+  case VEC0_METADATA_OPERATOR_GE: VEC0_METADATA_CMP_LOOP(>=); break;
+  case VEC0_METADATA_OPERATOR_NE: VEC0_METADATA_CMP_LOOP(!=); break;
+  case VEC0_METADATA_OPERATOR_ISNULL:
+    // metadata columns don't support NULL
+    bitmap_clear(b, size);
+    break;
+  case VEC0_METADATA_OPERATOR_ISNOTNULL:
+    bitmap_fill(b, size);
+    break;
+  default:
+    // IN/LIKE/GLOB aren't supported on FLOAT columns
+    break;
+  }
+}
 
-          // Use SQLite's LIKE implementation
-          bitmap_set(b, i, sqlite3_strlike(sTarget, sFull, 0) == 0);
-        }
+/**
+ * @brief `x in (...)` on the values of an INTEGER metadata chunk.
+ *
+ * @param targets the values of the list, sorted
+ */
+static void vec0_metadata_in_i64(const i64 *array, const i64 *targets,
+                                 size_t n, u8 *b, int size) {
+  if (n <= VEC0_METADATA_IN_SMALL_SET) {
+    for (int i = 0; i < size / CHAR_BIT; i++) {
+      const i64 *v = &array[i * CHAR_BIT];
+      u8 m = 0;
+      for (size_t j = 0; j < n; j++) {
+        m |= VEC0_METADATA_CMP8(v, ==, targets[j]);
       }
-      break;
+      b[i] = m;
     }
+    return;
+  }
+  for (int i = 0; i < size / CHAR_BIT; i++) {
+    u8 m = 0;
+    for (int j = 0; j < CHAR_BIT; j++) {
+      if (bsearch(&array[i * CHAR_BIT + j], targets, n, sizeof(i64),
+                  vec0_cmp_i64)) {
+        m |= 1 << j;
+      }
+    }
+    b[i] = m;
+  }
+}
 
-    case VEC0_METADATA_OPERATOR_GLOB: {
-      int is_prefix_only = vec0_is_prefix_only_glob_pattern(sTarget, nTarget);
-
-      if (is_prefix_only) {
-        // Fast path: prefix-only pattern (e.g., 'abc*')
-        // Can use the 12-byte cache for optimization
-        int nPattern = nTarget - 1;  // Exclude trailing '*'
-
-        for(int i = 0; i < size; i++) {
-          view = &((u8*) buffer)[i * VEC0_METADATA_TEXT_VIEW_BUFFER_LENGTH];
-          nPrefix = ((int*) view)[0];
-          sPrefix = (char *) &view[4];
-
-          // String must be at least as long as the pattern prefix
-          if(nPrefix < nPattern) {
-            bitmap_set(b, i, 0);
-            continue;
-          }
-
-          // Compare pattern prefix against cached prefix (case-sensitive for GLOB)
-          int cmpLen = min(nPattern, VEC0_METADATA_TEXT_VIEW_DATA_LENGTH);
-          int cmpPrefix = strncmp(sPrefix, sTarget, cmpLen);
-
-          // For short strings (fits in cache), prefix comparison is enough
-          if(nPrefix <= VEC0_METADATA_TEXT_VIEW_DATA_LENGTH) {
-            bitmap_set(b, i, cmpPrefix == 0);
-            continue;
-          }
-
-          // For long strings, if cached prefix doesn't match, reject early
-          if(cmpPrefix != 0) {
-            bitmap_set(b, i, 0);
-            continue;
-          }
-
-          // If pattern fits in cache, it matches
-          if(nPattern <= VEC0_METADATA_TEXT_VIEW_DATA_LENGTH) {
-            bitmap_set(b, i, 1);
-            continue;
-          }
-
-          // Pattern is longer than cache, need to check full string
-          rc = vec0_get_metadata_text_long_value(p, &stmt, metadata_idx, rowids[i], &nFull, &sFull);
-          if(rc != SQLITE_OK) {
-            goto done;
-          }
-          if(nPrefix != nFull) {
-            rc = SQLITE_ERROR;
-            goto done;
-          }
+/**
+ * @brief BOOLEAN metadata chunks are bitmaps already: = and != copy or invert
+ * them a byte at a time.
+ */
+static void vec0_metadata_cmp_bool(const u8 *values, int target,
+                                   vec0_metadata_operator op, u8 *b,
+                                   int size) {
+  int invert;
+  switch (op) {
+  case VEC0_METADATA_OPERATOR_EQ:
+  case VEC0_METADATA_OPERATOR_IS:
+    invert = !target;
+    break;
+  case VEC0_METADATA_OPERATOR_NE:
+  case VEC0_METADATA_OPERATOR_ISNOT:
+    invert = !!target;
+    break;
+  case VEC0_METADATA_OPERATOR_ISNULL:
+    // metadata columns don't support NULL
+    bitmap_clear(b, size);
+    return;
+  case VEC0_METADATA_OPERATOR_ISNOTNULL:
+    bitmap_fill(b, size);
+    return;
+  default:
+    // Should not reach here if xBestIndex validation works correctly
+    return;
+  }
+  if (!invert) {
+    memcpy(b, values, size / CHAR_BIT);
+    return;
+  }
+  for (int i = 0; i < size / CHAR_BIT; i++) {
+    b[i] = (u8)~values[i];
+  }
+}
 
-          // Check if full string starts with pattern prefix (case-sensitive)
-          bitmap_set(b, i, strncmp(sFull, sTarget, nPattern) == 0);
-        }
-      } else {
-        // Slow path: complex pattern (e.g., '*abc', 'a*b', etc.)
-        // Must fetch and check full string for each row
-        for(int i = 0; i < size; i++) {
-          view = &((u8*) buffer)[i * VEC0_METADATA_TEXT_VIEW_BUFFER_LENGTH];
-          nPrefix = ((int*) view)[0];
-          sPrefix = (char *) &view[4];
-
-          // For short strings, use cached value directly
-          if(nPrefix <= VEC0_METADATA_TEXT_VIEW_DATA_LENGTH) {
-            // sqlite3_strglob returns 0 on match, non-zero otherwise
-            bitmap_set(b, i, sqlite3_strglob(sTarget, sPrefix) == 0);
-            continue;
-          }
+/**
+ * @brief Resolve a constraint on a `text dictionary` metadata column to the
+ * sorted codes of the dictionary values that pass it. Done once per query, so
+ * chunks are filtered with vec0_metadata_in_i64() over the codes instead of
+ * comparing strings row by row.
+ *
+ * @param p vec0_vtab
+ * @param metadata_idx index of the dictionary-encoded metadata column
+ * @param op operator of the constraint
+ * @param value value of the constraint, the `(...)` list for IN
+ * @param codes initialized i64 array the codes are appended to
+ * @return int SQLITE_OK on success, error code otherwise
+ */
+static int vec0_metadata_dictionary_codes(vec0_vtab *p, int metadata_idx,
+                                          vec0_metadata_operator op,
+                                          sqlite3_value *value,
+                                          struct Array *codes) {
+  int rc;
+  const char *zWhere;
+  switch (op) {
+  case VEC0_METADATA_OPERATOR_EQ:
+  case VEC0_METADATA_OPERATOR_IS:
+  case VEC0_METADATA_OPERATOR_IN:
+    zWhere = "value = ?1";
+    break;
+  case VEC0_METADATA_OPERATOR_NE:
+  case VEC0_METADATA_OPERATOR_ISNOT:
+    zWhere = "value != ?1";
+    break;
+  case VEC0_METADATA_OPERATOR_GT:
+    zWhere = "value > ?1";
+    break;
+  case VEC0_METADATA_OPERATOR_GE:
+    zWhere = "value >= ?1";
+    break;
+  case VEC0_METADATA_OPERATOR_LT:
+    zWhere = "value < ?1";
+    break;
+  case VEC0_METADATA_OPERATOR_LE:
+    zWhere = "value <= ?1";
+    break;
+  case VEC0_METADATA_OPERATOR_LIKE:
+    zWhere = "value LIKE ?1";
+    break;
+  case VEC0_METADATA_OPERATOR_GLOB:
+    zWhere = "value GLOB ?1";
+    break;
+  case VEC0_METADATA_OPERATOR_ISNULL:
+    // metadata columns don't support NULL
+    return SQLITE_OK;
+  case VEC0_METADATA_OPERATOR_ISNOTNULL:
+    zWhere = "1";
+    break;
+  default:
+    return SQLITE_ERROR;
+  }
 
-          // For long strings, fetch full value
-          rc = vec0_get_metadata_text_long_value(p, &stmt, metadata_idx, rowids[i], &nFull, &sFull);
-          if(rc != SQLITE_OK) {
-            goto done;
-          }
-          if(nPrefix != nFull) {
-            rc = SQLITE_ERROR;
-            goto done;
-          }
+  sqlite3_stmt *stmt = NULL;
+  char *zSql = sqlite3_mprintf("SELECT code FROM " VEC0_SHADOW_METADATA_DICT_N_NAME
+                               " WHERE %s",
+                               p->schemaName, p->tableName, metadata_idx, zWhere);
+  if (!zSql) {
+    return SQLITE_NOMEM;
+  }
+  rc = sqlite3_prepare_v2(p->db, zSql, -1, &stmt, NULL);
+  sqlite3_free(zSql);
+  if (rc != SQLITE_OK) {
+    goto done;
+  }
 
-          // Use SQLite's GLOB implementation
-          bitmap_set(b, i, sqlite3_strglob(sTarget, sFull) == 0);
-        }
-      }
-      break;
+  sqlite3_value *entry = value;
+#if COMPILER_SUPPORTS_VTAB_IN
+  if (op == VEC0_METADATA_OPERATOR_IN) {
+    rc = sqlite3_vtab_in_first(value, &entry);
+    if (rc != SQLITE_OK) {
+      goto done;
     }
-
-    case VEC0_METADATA_OPERATOR_IS:
-    case VEC0_METADATA_OPERATOR_ISNOT: {
-      // Should never be reached - IS/ISNOT are mapped to EQ/NE before the switch
-      break;
+  }
+#endif
+  while (entry) {
+    if (op != VEC0_METADATA_OPERATOR_ISNOTNULL) {
+      sqlite3_bind_value(stmt, 1, entry);
     }
-
-    case VEC0_METADATA_OPERATOR_ISNULL: {
-      // IS NULL always returns false (metadata columns don't support NULL)
-      // All bits stay 0 (already initialized)
-      break;
+    while ((rc = sqlite3_step(stmt)) == SQLITE_ROW) {
+      i64 code = sqlite3_column_int64(stmt, 0);
+      rc = array_append(codes, &code);
+      if (rc != SQLITE_OK) {
+        goto done;
+      }
     }
-
-    case VEC0_METADATA_OPERATOR_ISNOTNULL: {
-      // IS NOT NULL always returns true (metadata columns don't support NULL)
-      for(int i = 0; i < size; i++) {
-        bitmap_set(b, i, 1);
+    if (rc != SQLITE_DONE) {
+      goto done;
+    }
+    sqlite3_reset(stmt);
+    entry = NULL;
+#if COMPILER_SUPPORTS_VTAB_IN
+    if (op == VEC0_METADATA_OPERATOR_IN) {
+      rc = sqlite3_vtab_in_next(value, &entry);
+      if (rc != SQLITE_OK && rc != SQLITE_DONE) {
+        goto done;
       }
-      break;
     }
-
+#endif
   }
+  // sorted for vec0_metadata_in_i64()
+  qsort(codes->z, codes->length, sizeof(i64), vec0_cmp_i64);
   rc = SQLITE_OK;
 
-  done:
-    sqlite3_finalize(stmt);
-    sqlite3_free(rowids);
-    return rc;
-
+done:
+  sqlite3_finalize(stmt);
+  return rc;
 }
 
+static int vec0_metadata_data_read(sqlite3_blob *blob, u8 *data, void *z, int n, int offset);
+
 /**
  * @brief Fill in bitmap of chunk values, whether or not the values match a metadata constraint
  *
+ * Only the bytes of the metadata blob between the first and last rows set in
+ * mask are read and evaluated.
+ *
  * @param p vec0_vtab
  * @param metadata_idx index of the metatadata column to perfrom constraints on
  * @param value sqlite3_value of the constraints value
  * @param blob sqlite3_blob that is already opened on the metdata column's shadow chunk table
+ * @param data the values in memory instead of blob, in the same layout, or NULL
  * @param chunk_rowid rowid of the chunk to calculate on
- * @param b pre-allocated and zero'd out bitmap to write results to
+ * @param rowids rowids of the chunk, to look up long TEXT values
+ * @param mask rows still passing the previous filters, must have a bit set
+ * @param b pre-allocated and zero'd out bitmap to write results to. Rows
+ * outside of mask's set bytes are left at 0.
  * @param size size of the chunk
  * @return int SQLITE_OK on success, error code otherwise
  */
@@ -6855,241 +9932,98 @@ int vec0_set_metadata_filter_bitmap(
   vec0_metadata_operator op,
   sqlite3_value * value,
   sqlite3_blob * blob,
+  u8 * data,
   i64 chunk_rowid,
+  const i64 * rowids,
+  u8 * mask,
   u8* b,
   int size,
   struct Array * aMetadataIn, int argv_idx) {
-  // TODO: shouldn't this skip in-valid entries from the chunk's  validity bitmap?
-
   int rc;
-  rc = sqlite3_blob_reopen(blob, chunk_rowid);
-  if(rc != SQLITE_OK) {
-    return rc;
+  if(!data) {
+    rc = sqlite3_blob_reopen(blob, chunk_rowid);
+    if(rc != SQLITE_OK) {
+      return rc;
+    }
   }
 
   vec0_metadata_column_kind kind = p->metadata_columns[metadata_idx].kind;
-  int szMatch = 0;
-  int blobSize = sqlite3_blob_bytes(blob);
+  // bytes per 8 rows
+  int szByte = 0;
   switch(kind) {
     case VEC0_METADATA_COLUMN_KIND_BOOLEAN: {
-      szMatch = blobSize == size / CHAR_BIT;
+      szByte = 1;
       break;
     }
-    case VEC0_METADATA_COLUMN_KIND_INTEGER: {
-      szMatch = blobSize == (int)(size * sizeof(i64));
+    case VEC0_METADATA_COLUMN_KIND_INTEGER:
+    case VEC0_METADATA_COLUMN_KIND_DICTIONARY: {
+      szByte = CHAR_BIT * sizeof(i64);
       break;
     }
     case VEC0_METADATA_COLUMN_KIND_FLOAT: {
-      szMatch = blobSize == (int)(size * sizeof(double));
+      szByte = CHAR_BIT * sizeof(double);
       break;
     }
     case VEC0_METADATA_COLUMN_KIND_TEXT: {
-      szMatch = blobSize == size * VEC0_METADATA_TEXT_VIEW_BUFFER_LENGTH;
+      szByte = CHAR_BIT * VEC0_METADATA_TEXT_VIEW_BUFFER_LENGTH;
       break;
     }
   }
-  if(!szMatch) {
+  if(!data && sqlite3_blob_bytes(blob) != (size / CHAR_BIT) * szByte) {
     return SQLITE_ERROR;
   }
+  int lo, hi;
+  if(!bitmap_span(mask, size, &lo, &hi)) {
+    return SQLITE_OK;
+  }
+  // evaluate rows [lo * 8, (hi + 1) * 8) only
+  int n = (hi - lo + 1) * CHAR_BIT;
+  int blobSize = (hi - lo + 1) * szByte;
   void * buffer = sqlite3_malloc(blobSize);
   if(!buffer) {
     return SQLITE_NOMEM;
   }
-  rc = sqlite3_blob_read(blob, buffer, blobSize, 0);
+  rc = vec0_metadata_data_read(blob, data, buffer, blobSize, lo * szByte);
   if(rc != SQLITE_OK) {
     goto done;
   }
+  b += lo;
   switch(kind) {
     case VEC0_METADATA_COLUMN_KIND_BOOLEAN: {
-      int target = sqlite3_value_int(value);
-      switch(op) {
-        case VEC0_METADATA_OPERATOR_EQ:
-        case VEC0_METADATA_OPERATOR_IS: {
-          // EQ and IS behave identically for booleans
-          if(target) {
-            for(int i = 0; i < size; i++) { bitmap_set(b, i, bitmap_get((u8*) buffer, i)); }
-          } else {
-            for(int i = 0; i < size; i++) { bitmap_set(b, i, !bitmap_get((u8*) buffer, i)); }
-          }
-          break;
-        }
-        case VEC0_METADATA_OPERATOR_NE:
-        case VEC0_METADATA_OPERATOR_ISNOT: {
-          // NE and IS NOT behave identically for booleans
-          if(target) {
-            for(int i = 0; i < size; i++) { bitmap_set(b, i, !bitmap_get((u8*) buffer, i)); }
-          } else {
-            for(int i = 0; i < size; i++) { bitmap_set(b, i, bitmap_get((u8*) buffer, i)); }
-          }
-          break;
-        }
-        case VEC0_METADATA_OPERATOR_ISNULL: {
-          // IS NULL always returns false (metadata columns don't support NULL)
-          for(int i = 0; i < size; i++) { bitmap_set(b, i, 0); }
-          break;
-        }
-        case VEC0_METADATA_OPERATOR_ISNOTNULL: {
-          // IS NOT NULL always returns true (metadata columns don't support NULL)
-          for(int i = 0; i < size; i++) { bitmap_set(b, i, 1); }
-          break;
-        }
-        default: {
-          // Should not reach here if xBestIndex validation works correctly
-          break;
-        }
-      }
+      vec0_metadata_cmp_bool((u8 *) buffer, sqlite3_value_int(value), op, b, n);
       break;
     }
-    case VEC0_METADATA_COLUMN_KIND_INTEGER: {
+    case VEC0_METADATA_COLUMN_KIND_INTEGER:
+    case VEC0_METADATA_COLUMN_KIND_DICTIONARY: {
       i64 * array = (i64*) buffer;
-      i64 target = sqlite3_value_int64(value);
-      switch(op) {
-        case VEC0_METADATA_OPERATOR_EQ: {
-          for(int i = 0; i < size; i++) { bitmap_set(b, i, array[i] == target); }
-          break;
-        }
-        case VEC0_METADATA_OPERATOR_GT: {
-          for(int i = 0; i < size; i++) { bitmap_set(b, i, array[i] > target); }
-          break;
-        }
-        case VEC0_METADATA_OPERATOR_LE: {
-          for(int i = 0; i < size; i++) { bitmap_set(b, i, array[i] <= target); }
-          break;
-        }
-        case VEC0_METADATA_OPERATOR_LT: {
-          for(int i = 0; i < size; i++) { bitmap_set(b, i, array[i] < target); }
-          break;
-        }
-        case VEC0_METADATA_OPERATOR_GE: {
-          for(int i = 0; i < size; i++) { bitmap_set(b, i, array[i] >= target); }
-          break;
-        }
-        case VEC0_METADATA_OPERATOR_NE: {
-          for(int i = 0; i < size; i++) { bitmap_set(b, i, array[i] != target); }
-          break;
-        }
-        case VEC0_METADATA_OPERATOR_IN: {
-          int metadataInIdx = -1;
-          for(size_t i = 0; i < aMetadataIn->length; i++) {
-            struct Vec0MetadataIn * metadataIn = &((struct Vec0MetadataIn *) aMetadataIn->z)[i];
-            if(metadataIn->argv_idx == argv_idx) {
-              metadataInIdx = i;
-              break;
-            }
-          }
-          if(metadataInIdx < 0) {
-            rc = SQLITE_ERROR;
-            goto done;
-          }
-          struct Vec0MetadataIn * metadataIn = &((struct Vec0MetadataIn *) aMetadataIn->z)[metadataInIdx];
-          struct Array * aTarget = &(metadataIn->array);
-
-          for(int i = 0; i < size; i++) {
-            for(size_t target_idx = 0; target_idx < aTarget->length; target_idx++) {
-              if( ((i64*)aTarget->z)[target_idx] == array[i]) {
-                bitmap_set(b, i, 1);
-                break;
-              }
-            }
-          }
-          break;
-        }
-        case VEC0_METADATA_OPERATOR_LIKE: {
-          // should never be reached (LIKE only applies to TEXT columns)
-          break;
-        }
-        case VEC0_METADATA_OPERATOR_GLOB: {
-          // should never be reached (GLOB only applies to TEXT columns)
-          break;
-        }
-        case VEC0_METADATA_OPERATOR_IS: {
-          // IS behaves like = for non-NULL values
-          for(int i = 0; i < size; i++) { bitmap_set(b, i, array[i] == target); }
-          break;
-        }
-        case VEC0_METADATA_OPERATOR_ISNOT: {
-          // IS NOT behaves like != for non-NULL values
-          for(int i = 0; i < size; i++) { bitmap_set(b, i, array[i] != target); }
-          break;
-        }
-        case VEC0_METADATA_OPERATOR_ISNULL: {
-          // IS NULL always returns false (metadata columns don't support NULL)
-          for(int i = 0; i < size; i++) { bitmap_set(b, i, 0); }
-          break;
-        }
-        case VEC0_METADATA_OPERATOR_ISNOTNULL: {
-          // IS NOT NULL always returns true (metadata columns don't support NULL)
-          for(int i = 0; i < size; i++) { bitmap_set(b, i, 1); }
+      // every constraint on a dictionary column was resolved to a set of codes
+      if(kind == VEC0_METADATA_COLUMN_KIND_INTEGER && op != VEC0_METADATA_OPERATOR_IN) {
+        vec0_metadata_cmp_i64(array, sqlite3_value_int64(value), op, b, n);
+        break;
+      }
+      int metadataInIdx = -1;
+      for(size_t i = 0; i < aMetadataIn->length; i++) {
+        struct Vec0MetadataIn * metadataIn = &((struct Vec0MetadataIn *) aMetadataIn->z)[i];
+        if(metadataIn->argv_idx == argv_idx) {
+          metadataInIdx = i;
           break;
         }
       }
+      if(metadataInIdx < 0) {
+        rc = SQLITE_ERROR;
+        goto done;
+      }
+      struct Vec0MetadataIn * metadataIn = &((struct Vec0MetadataIn *) aMetadataIn->z)[metadataInIdx];
+      struct Array * aTarget = &(metadataIn->array);
+      vec0_metadata_in_i64(array, (i64 *) aTarget->z, aTarget->length, b, n);
       break;
     }
     case VEC0_METADATA_COLUMN_KIND_FLOAT: {
-      double * array = (double*) buffer;
-      double target = sqlite3_value_double(value);
-      switch(op) {
-        case VEC0_METADATA_OPERATOR_EQ: {
-          for(int i = 0; i < size; i++) { bitmap_set(b, i, array[i] == target); }
-          break;
-        }
-        case VEC0_METADATA_OPERATOR_GT: {
-          for(int i = 0; i < size; i++) { bitmap_set(b, i, array[i] > target); }
-          break;
-        }
-        case VEC0_METADATA_OPERATOR_LE: {
-          for(int i = 0; i < size; i++) { bitmap_set(b, i, array[i] <= target); }
-          break;
-        }
-        case VEC0_METADATA_OPERATOR_LT: {
-          for(int i = 0; i < size; i++) { bitmap_set(b, i, array[i] < target); }
-          break;
-        }
-        case VEC0_METADATA_OPERATOR_GE: {
-          for(int i = 0; i < size; i++) { bitmap_set(b, i, array[i] >= target); }
-          break;
-        }
-        case VEC0_METADATA_OPERATOR_NE: {
-          for(int i = 0; i < size; i++) { bitmap_set(b, i, array[i] != target); }
-          break;
-        }
-        case VEC0_METADATA_OPERATOR_IN: {
-          // should never be reached
-          break;
-        }
-        case VEC0_METADATA_OPERATOR_LIKE: {
-          // should never be reached (LIKE only applies to TEXT columns)
-          break;
-        }
-        case VEC0_METADATA_OPERATOR_GLOB: {
-          // should never be reached (GLOB only applies to TEXT columns)
-          break;
-        }
-        case VEC0_METADATA_OPERATOR_IS: {
-          // IS behaves like = for non-NULL values
-          for(int i = 0; i < size; i++) { bitmap_set(b, i, array[i] == target); }
-          break;
-        }
-        case VEC0_METADATA_OPERATOR_ISNOT: {
-          // IS NOT behaves like != for non-NULL values
-          for(int i = 0; i < size; i++) { bitmap_set(b, i, array[i] != target); }
-          break;
-        }
-        case VEC0_METADATA_OPERATOR_ISNULL: {
-          // IS NULL always returns false (metadata columns don't support NULL)
-          for(int i = 0; i < size; i++) { bitmap_set(b, i, 0); }
-          break;
-        }
-        case VEC0_METADATA_OPERATOR_ISNOTNULL: {
-          // IS NOT NULL always returns true (metadata columns don't support NULL)
-          for(int i = 0; i < size; i++) { bitmap_set(b, i, 1); }
-          break;
-        }
-      }
+      vec0_metadata_cmp_f64((double *) buffer, sqlite3_value_double(value), op, b, n);
       break;
     }
     case VEC0_METADATA_COLUMN_KIND_TEXT: {
-      rc = vec0_metadata_filter_text(p, value, buffer, size, op, b, metadata_idx, chunk_rowid, aMetadataIn, argv_idx);
+      rc = vec0_metadata_filter_text(p, value, buffer, n, op, mask + lo, b, metadata_idx, rowids + lo * CHAR_BIT, aMetadataIn, argv_idx);
       if(rc != SQLITE_OK) {
         goto done;
       }
@@ -7101,3131 +10035,12802 @@ int vec0_set_metadata_filter_bitmap(
     return rc;
 }
 
-int vec0Filter_knn_chunks_iter(vec0_vtab *p, sqlite3_stmt *stmtChunks,
-                               struct VectorColumnDefinition *vector_column,
-                               int vectorColumnIdx, struct Array *arrayRowidsIn,
-                               struct Array * aMetadataIn,
-                               const char * idxStr, int argc, sqlite3_value ** argv,
-                               void *queryVector, i64 k, i64 **out_topk_rowids,
-                               f32 **out_topk_distances, i64 *out_used) {
-  // for each chunk, get top min(k, chunk_size) rowid + distances to query vec.
-  // then reconcile all topk_chunks for a true top k.
-  // output only rowids + distances for now
-
-  int rc = SQLITE_OK;
-  sqlite3_blob *blobVectors = NULL;
+// ---- vec0 filter expressions ----
 
-  void *baseVectors = NULL; // memory: chunk_size * dimensions * element_size
+// Instructions of a compiled `filter = '...'` expression, in postfix order
+typedef enum {
+  // push the bitmap of a metadata constraint
+  VEC0_FILTER_OP_LEAF,
+  // pop two bitmaps, push their intersection
+  VEC0_FILTER_OP_AND,
+  // pop two bitmaps, push their union
+  VEC0_FILTER_OP_OR,
+  // complement the bitmap on top of the stack
+  VEC0_FILTER_OP_NOT,
+} vec0_filter_op;
+
+struct Vec0FilterInstr {
+  vec0_filter_op op;
+  // VEC0_FILTER_OP_LEAF only: the constraint, like a metadata constraint in
+  // idxStr/argv
+  int metadata_idx;
+  vec0_metadata_operator operator;
+  sqlite3_value *value;
+};
 
-  // OWNED BY CALLER ON SUCCESS
-  i64 *topk_rowids = NULL; // memory: k * 4
-  // OWNED BY CALLER ON SUCCESS
-  f32 *topk_distances = NULL; // memory: k * 4
+/**
+ * A boolean expression over metadata columns, compiled once per KNN query by
+ * vec0_filter_compile() and run on every chunk by vec0_filter_eval() as a
+ * small stack machine over chunk bitmaps.
+ */
+struct Vec0FilterProgram {
+  // struct Vec0FilterInstr
+  struct Array instrs;
+  // struct Vec0MetadataIn of the IN leaves and of every leaf on a dictionary
+  // column, with the index of the leaf's instruction as argv_idx
+  struct Array leavesIn;
+  // most bitmaps on the stack at once
+  int nStack;
+  // nStack chunk_size bitmaps
+  u8 *stack;
+};
 
-  i64 *tmp_topk_rowids = NULL;    // memory: k * 4
-  f32 *tmp_topk_distances = NULL; // memory: k * 4
-  f32 *chunk_distances = NULL;    // memory: chunk_size * 4
-  u8 *b = NULL;                   // memory: chunk_size / 8
-  u8 *bTaken = NULL;              // memory: chunk_size / 8
-  i32 *chunk_topk_idxs = NULL;    // memory: k * 4
-  u8 *bmRowids = NULL;            // memory: chunk_size / 8
-  u8 *bmMetadata = NULL;            // memory: chunk_size / 8
-  //                        // total: a lot???
+// Deepest nesting of parentheses and NOT in a filter expression
+#define VEC0_FILTER_MAX_DEPTH 64
 
-  // 6 * (k * 4) + (k * 2) + (chunk_size / 8) + (chunk_size * dimensions * 4)
+static void vec0_filter_program_free(vec0_vtab *p,
+                                     struct Vec0FilterProgram *program);
 
-  topk_rowids = sqlite3_malloc(k * sizeof(i64));
-  if (!topk_rowids) {
-    rc = SQLITE_NOMEM;
-    goto cleanup;
+/**
+ * @brief Frees the entries of an aMetadataIn array, and the array itself.
+ */
+static void vec0_metadata_in_cleanup(vec0_vtab *p, struct Array *aMetadataIn) {
+  if (!aMetadataIn) {
+    return;
   }
-  memset(topk_rowids, 0, k * sizeof(i64));
-
-  topk_distances = sqlite3_malloc(k * sizeof(f32));
-  if (!topk_distances) {
-    rc = SQLITE_NOMEM;
-    goto cleanup;
+  for (size_t i = 0; i < aMetadataIn->length; i++) {
+    struct Vec0MetadataIn *item = &((struct Vec0MetadataIn *)aMetadataIn->z)[i];
+    if (item->program) {
+      vec0_filter_program_free(p, item->program);
+    } else if (p->metadata_columns[item->metadata_idx].kind ==
+               VEC0_METADATA_COLUMN_KIND_TEXT) {
+      vec0_metadata_in_text_cleanup(&item->array);
+    } else {
+      array_cleanup(&item->array);
+    }
   }
-  memset(topk_distances, 0, k * sizeof(f32));
+  array_cleanup(aMetadataIn);
+}
 
-  tmp_topk_rowids = sqlite3_malloc(k * sizeof(i64));
-  if (!tmp_topk_rowids) {
-    rc = SQLITE_NOMEM;
-    goto cleanup;
+static void vec0_filter_program_free(vec0_vtab *p,
+                                     struct Vec0FilterProgram *program) {
+  if (!program) {
+    return;
   }
-  memset(tmp_topk_rowids, 0, k * sizeof(i64));
-
-  tmp_topk_distances = sqlite3_malloc(k * sizeof(f32));
-  if (!tmp_topk_distances) {
-    rc = SQLITE_NOMEM;
-    goto cleanup;
+  for (size_t i = 0; i < program->instrs.length; i++) {
+    sqlite3_value_free(((struct Vec0FilterInstr *)program->instrs.z)[i].value);
   }
-  memset(tmp_topk_distances, 0, k * sizeof(f32));
+  array_cleanup(&program->instrs);
+  vec0_metadata_in_cleanup(p, &program->leavesIn);
+  sqlite3_free(program->stack);
+  sqlite3_free(program);
+}
 
-  i64 k_used = 0;
-  i64 baseVectorsSize = p->chunk_size * vector_column_byte_size(*vector_column);
-  baseVectors = sqlite3_malloc(baseVectorsSize);
-  if (!baseVectors) {
-    rc = SQLITE_NOMEM;
-    goto cleanup;
-  }
+typedef enum {
+  VEC0_FILTER_TOKEN_EOF,
+  VEC0_FILTER_TOKEN_IDENTIFIER,
+  // a string or a number, parsed by SQLite
+  VEC0_FILTER_TOKEN_LITERAL,
+  VEC0_FILTER_TOKEN_LPAREN,
+  VEC0_FILTER_TOKEN_RPAREN,
+  VEC0_FILTER_TOKEN_COMMA,
+  // =, ==, !=, <>, <, <=, >, >=
+  VEC0_FILTER_TOKEN_OPERATOR,
+} vec0_filter_token_type;
+
+struct Vec0FilterParser {
+  vec0_vtab *p;
+  struct Vec0FilterProgram *program;
+  const char *z;
+  int n;
+  int offset;
+  // current token
+  vec0_filter_token_type type;
+  const char *zToken;
+  int nToken;
+  // literal values of the leaves, "SELECT <literal>, <literal>, ..."
+  sqlite3_str *literals;
+  int nLiterals;
+  // for each literal, the index of its leaf's instruction, and -1 or the
+  // index of its leavesIn entry for `in (...)` values
+  struct Array literalLeaves;
+  // current and deepest bitmap stack depth
+  int depth;
+  int nestingDepth;
+  char *zErr;
+};
 
-  chunk_distances = sqlite3_malloc(p->chunk_size * sizeof(f32));
-  if (!chunk_distances) {
-    rc = SQLITE_NOMEM;
-    goto cleanup;
+static int vec0_filter_error(struct Vec0FilterParser *parser, const char *zMsg) {
+  if (!parser->zErr) {
+    if (parser->type == VEC0_FILTER_TOKEN_EOF) {
+      parser->zErr = sqlite3_mprintf("%s at the end of the filter", zMsg);
+    } else {
+      parser->zErr = sqlite3_mprintf("%s near \"%.*s\"", zMsg, parser->nToken,
+                                     parser->zToken);
+    }
   }
+  return SQLITE_ERROR;
+}
 
-  b = bitmap_new(p->chunk_size);
-  if (!b) {
-    rc = SQLITE_NOMEM;
-    goto cleanup;
-  }
+static int vec0_filter_is_id_char(char c) {
+  return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') ||
+         (c >= '0' && c <= '9') || c == '_';
+}
 
-  bTaken = bitmap_new(p->chunk_size);
-  if (!bTaken) {
-    rc = SQLITE_NOMEM;
-    goto cleanup;
-  }
+static int vec0_filter_is_digit(char c) { return c >= '0' && c <= '9'; }
 
-  chunk_topk_idxs = sqlite3_malloc(k * sizeof(i32));
-  if (!chunk_topk_idxs) {
-    rc = SQLITE_NOMEM;
-    goto cleanup;
+/**
+ * @brief Moves the parser to the next token of the expression.
+ */
+static int vec0_filter_next(struct Vec0FilterParser *parser) {
+  const char *z = parser->z;
+  int n = parser->n;
+  int i = parser->offset;
+  while (i < n && (z[i] == ' ' || z[i] == '\t' || z[i] == '\n' ||
+                   z[i] == '\r')) {
+    i++;
+  }
+  parser->zToken = &z[i];
+  if (i >= n) {
+    parser->type = VEC0_FILTER_TOKEN_EOF;
+    parser->nToken = 0;
+    parser->offset = i;
+    return SQLITE_OK;
   }
-
-  bmRowids = arrayRowidsIn ? bitmap_new(p->chunk_size) : NULL;
-  if (arrayRowidsIn && !bmRowids) {
-    rc = SQLITE_NOMEM;
-    goto cleanup;
+  int start = i;
+  char c = z[i];
+  if (c == '(' || c == ')' || c == ',') {
+    parser->type = c == '(' ? VEC0_FILTER_TOKEN_LPAREN
+                   : c == ')' ? VEC0_FILTER_TOKEN_RPAREN
+                              : VEC0_FILTER_TOKEN_COMMA;
+    i++;
+  } else if (c == '=' || c == '<' || c == '>' || c == '!') {
+    parser->type = VEC0_FILTER_TOKEN_OPERATOR;
+    i++;
+    if (i < n && (z[i] == '=' || (c == '<' && z[i] == '>'))) {
+      i++;
+    } else if (c == '!') {
+      parser->nToken = 1;
+      return vec0_filter_error(parser, "unexpected character");
+    }
+  } else if (c == '\'') {
+    // '' is a quote inside of a string
+    parser->type = VEC0_FILTER_TOKEN_LITERAL;
+    i++;
+    while (1) {
+      if (i >= n) {
+        parser->nToken = i - start;
+        return vec0_filter_error(parser, "unterminated string");
+      }
+      if (z[i] == '\'') {
+        if (i + 1 < n && z[i + 1] == '\'') {
+          i += 2;
+          continue;
+        }
+        i++;
+        break;
+      }
+      i++;
+    }
+  } else if (c == '"') {
+    parser->type = VEC0_FILTER_TOKEN_IDENTIFIER;
+    i++;
+    while (i < n && z[i] != '"') {
+      i++;
+    }
+    if (i >= n) {
+      parser->nToken = i - start;
+      return vec0_filter_error(parser, "unterminated identifier");
+    }
+    i++;
+  } else if (vec0_filter_is_digit(c) || c == '.' || c == '-' || c == '+') {
+    // numbers, with an optional sign
+    parser->type = VEC0_FILTER_TOKEN_LITERAL;
+    if (c == '-' || c == '+') {
+      i++;
+    }
+    if (i + 1 < n && z[i] == '0' && (z[i + 1] == 'x' || z[i + 1] == 'X')) {
+      i += 2;
+      while (i < n && vec0_filter_is_id_char(z[i])) {
+        i++;
+      }
+    } else {
+      int digits = 0;
+      while (i < n && vec0_filter_is_digit(z[i])) {
+        i++;
+        digits++;
+      }
+      if (i < n && z[i] == '.') {
+        i++;
+        while (i < n && vec0_filter_is_digit(z[i])) {
+          i++;
+          digits++;
+        }
+      }
+      if (digits && i < n && (z[i] == 'e' || z[i] == 'E')) {
+        i++;
+        if (i < n && (z[i] == '-' || z[i] == '+')) {
+          i++;
+        }
+        while (i < n && vec0_filter_is_digit(z[i])) {
+          i++;
+        }
+      }
+      if (!digits || (i < n && vec0_filter_is_id_char(z[i]))) {
+        parser->nToken = i - start + (i < n);
+        return vec0_filter_error(parser, "invalid number");
+      }
+    }
+  } else if (vec0_filter_is_id_char(c)) {
+    parser->type = VEC0_FILTER_TOKEN_IDENTIFIER;
+    while (i < n && vec0_filter_is_id_char(z[i])) {
+      i++;
+    }
+  } else {
+    parser->nToken = 1;
+    return vec0_filter_error(parser, "unexpected character");
   }
+  parser->nToken = i - start;
+  parser->offset = i;
+  return SQLITE_OK;
+}
 
-  sqlite3_blob * metadataBlobs[VEC0_MAX_METADATA_COLUMNS];
-  memset(metadataBlobs, 0, sizeof(sqlite3_blob*) * VEC0_MAX_METADATA_COLUMNS);
+// Whether the current token is the given keyword, in any case
+static int vec0_filter_is_keyword(struct Vec0FilterParser *parser,
+                                  const char *zKeyword) {
+  return parser->type == VEC0_FILTER_TOKEN_IDENTIFIER &&
+         parser->nToken == (int)strlen(zKeyword) &&
+         sqlite3_strnicmp(parser->zToken, zKeyword, parser->nToken) == 0;
+}
 
-  bmMetadata = bitmap_new(p->chunk_size);
-  if(!bmMetadata) {
-    rc = SQLITE_NOMEM;
-    goto cleanup;
-  }
+static int vec0_filter_emit(struct Vec0FilterParser *parser,
+                            vec0_filter_op op) {
+  struct Vec0FilterInstr instr;
+  memset(&instr, 0, sizeof(instr));
+  instr.op = op;
+  instr.metadata_idx = -1;
+  if (op == VEC0_FILTER_OP_LEAF) {
+    parser->depth++;
+    if (parser->depth > parser->program->nStack) {
+      parser->program->nStack = parser->depth;
+    }
+  } else if (op != VEC0_FILTER_OP_NOT) {
+    parser->depth--;
+  }
+  return array_append(&parser->program->instrs, &instr);
+}
 
-  int idxStrLength = strlen(idxStr);
-  int numValueEntries = (idxStrLength-1) / 4;
-  assert(numValueEntries == argc);
-  int hasMetadataFilters = 0;
-  int hasDistanceConstraints = 0;
-  for(int i = 0; i < argc; i++) {
-    int idx = 1 + (i * 4);
-    char kind = idxStr[idx + 0];
-    if(kind == VEC0_IDXSTR_KIND_METADATA_CONSTRAINT) {
-      hasMetadataFilters = 1;
-    }
-    else if(kind == VEC0_IDXSTR_KIND_KNN_DISTANCE_CONSTRAINT) {
-      hasDistanceConstraints = 1;
-    }
+/**
+ * @brief Adds a literal to the values of the last leaf.
+ *
+ * @param leafIn index of the leaf's leavesIn entry for `in (...)` values, -1
+ * for the value of the leaf itself
+ */
+static int vec0_filter_add_literal(struct Vec0FilterParser *parser,
+                                   const char *zLiteral, int nLiteral,
+                                   int leafIn) {
+  sqlite3_str_appendf(parser->literals, "%s%.*s", parser->nLiterals ? ", " : "",
+                      nLiteral, zLiteral);
+  parser->nLiterals++;
+  int target[2] = {(int)parser->program->instrs.length - 1, leafIn};
+  return array_append(&parser->literalLeaves, target);
+}
+
+/**
+ * @brief Adds the current token, a string, a number, TRUE or FALSE, to the
+ * values of the last leaf, and moves past it.
+ */
+static int vec0_filter_literal(struct Vec0FilterParser *parser, int leafIn) {
+  if (parser->type != VEC0_FILTER_TOKEN_LITERAL &&
+      !vec0_filter_is_keyword(parser, "true") &&
+      !vec0_filter_is_keyword(parser, "false")) {
+    return vec0_filter_error(parser, "expected a string or a number");
+  }
+  int rc = vec0_filter_add_literal(parser, parser->zToken, parser->nToken,
+                                   leafIn);
+  if (rc != SQLITE_OK) {
+    return rc;
   }
+  return vec0_filter_next(parser);
+}
 
-  while (true) {
-    rc = sqlite3_step(stmtChunks);
-    if (rc == SQLITE_DONE) {
-      break;
-    }
-    if (rc != SQLITE_ROW) {
-      vtab_set_error(&p->base, "chunks iter error");
-      rc = SQLITE_ERROR;
-      goto cleanup;
-    }
-    memset(chunk_distances, 0, p->chunk_size * sizeof(f32));
-    memset(chunk_topk_idxs, 0, k * sizeof(i32));
-    bitmap_clear(b, p->chunk_size);
+/**
+ * @brief Adds a leaf to the program, with a leavesIn entry if its values are
+ * resolved to a set: `in (...)` values, and codes of dictionary columns.
+ */
+static int vec0_filter_leaf(struct Vec0FilterParser *parser, int metadata_idx,
+                            vec0_metadata_operator operator) {
+  vec0_metadata_column_kind kind =
+      parser->p->metadata_columns[metadata_idx].kind;
+  int rc = vec0_filter_emit(parser, VEC0_FILTER_OP_LEAF);
+  if (rc != SQLITE_OK) {
+    return rc;
+  }
+  struct Vec0FilterInstr *leaf =
+      &((struct Vec0FilterInstr *)parser->program->instrs.z)
+          [parser->program->instrs.length - 1];
+  leaf->metadata_idx = metadata_idx;
+  leaf->operator = operator;
+  if (operator != VEC0_METADATA_OPERATOR_IN &&
+      kind != VEC0_METADATA_COLUMN_KIND_DICTIONARY) {
+    return SQLITE_OK;
+  }
+  struct Vec0MetadataIn item;
+  memset(&item, 0, sizeof(item));
+  item.argv_idx = (int)parser->program->instrs.length - 1;
+  item.metadata_idx = metadata_idx;
+  rc = array_init(&item.array,
+                  kind == VEC0_METADATA_COLUMN_KIND_TEXT
+                      ? sizeof(struct Vec0MetadataInTextEntry)
+                      : sizeof(i64),
+                  8);
+  if (rc != SQLITE_OK) {
+    return rc;
+  }
+  rc = array_append(&parser->program->leavesIn, &item);
+  if (rc != SQLITE_OK) {
+    array_cleanup(&item.array);
+  }
+  return rc;
+}
 
-    i64 chunk_id = sqlite3_column_int64(stmtChunks, 0);
-    unsigned char *chunkValidity =
-        (unsigned char *)sqlite3_column_blob(stmtChunks, 1);
-    i64 validitySize = sqlite3_column_bytes(stmtChunks, 1);
-    if (validitySize != p->chunk_size / CHAR_BIT) {
-      // IMP: V05271_22109
-      vtab_set_error(
-          &p->base,
-          "chunk validity size doesn't match - expected %lld, found %lld",
-          p->chunk_size / CHAR_BIT, validitySize);
-      rc = SQLITE_ERROR;
-      goto cleanup;
+/**
+ * @brief Parses one comparison: `column op literal`, `column [NOT] IN (...)`,
+ * `column [NOT] LIKE/GLOB literal`, `column [NOT] BETWEEN literal AND literal`
+ * or `column IS [NOT] NULL/literal`.
+ */
+static int vec0_filter_parse_predicate(struct Vec0FilterParser *parser) {
+  vec0_vtab *p = parser->p;
+  int rc;
+  if (parser->type != VEC0_FILTER_TOKEN_IDENTIFIER) {
+    return vec0_filter_error(parser, "expected a metadata column");
+  }
+  const char *zName = parser->zToken;
+  int nName = parser->nToken;
+  if (zName[0] == '"') {
+    zName++;
+    nName -= 2;
+  }
+  int metadata_idx = -1;
+  for (int i = 0; i < p->numMetadataColumns; i++) {
+    if (p->metadata_columns[i].name_length == nName &&
+        sqlite3_strnicmp(p->metadata_columns[i].name, zName, nName) == 0) {
+      metadata_idx = i;
+      break;
     }
+  }
+  if (metadata_idx < 0) {
+    return vec0_filter_error(parser, "unknown metadata column");
+  }
+  rc = vec0_filter_next(parser);
+  if (rc != SQLITE_OK) {
+    return rc;
+  }
 
-    i64 *chunkRowids = (i64 *)sqlite3_column_blob(stmtChunks, 2);
-    i64 rowidsSize = sqlite3_column_bytes(stmtChunks, 2);
-    if (rowidsSize != (i64)(p->chunk_size * sizeof(i64))) {
-      // IMP: V02796_19635
-      vtab_set_error(&p->base, "rowids size doesn't match");
-      vtab_set_error(
-          &p->base,
-          "chunk rowids size doesn't match - expected %lld, found %lld",
-          p->chunk_size * sizeof(i64), rowidsSize);
-      rc = SQLITE_ERROR;
-      goto cleanup;
+  int negate = 0;
+  // BETWEEN is a GE leaf and a LE leaf
+  int between = 0;
+  vec0_metadata_operator operator;
+  if (parser->type == VEC0_FILTER_TOKEN_OPERATOR) {
+    const char *z = parser->zToken;
+    switch (z[0]) {
+    case '=':
+      operator = VEC0_METADATA_OPERATOR_EQ;
+      break;
+    case '!':
+      operator = VEC0_METADATA_OPERATOR_NE;
+      break;
+    case '<':
+      operator = parser->nToken == 1 ? VEC0_METADATA_OPERATOR_LT
+                 : z[1] == '=' ? VEC0_METADATA_OPERATOR_LE
+                               : VEC0_METADATA_OPERATOR_NE;
+      break;
+    default:
+      operator = parser->nToken == 1 ? VEC0_METADATA_OPERATOR_GT
+                                     : VEC0_METADATA_OPERATOR_GE;
+      break;
     }
-
-    // open the vector chunk blob for the current chunk
-    rc = sqlite3_blob_open(p->db, p->schemaName,
-                           p->shadowVectorChunksNames[vectorColumnIdx],
-                           "vectors", chunk_id, 0, &blobVectors);
+    rc = vec0_filter_next(parser);
+  } else if (vec0_filter_is_keyword(parser, "is")) {
+    rc = vec0_filter_next(parser);
     if (rc != SQLITE_OK) {
-      vtab_set_error(&p->base, "could not open vectors blob for chunk %lld",
-                     chunk_id);
-      rc = SQLITE_ERROR;
-      goto cleanup;
+      return rc;
     }
-
-    i64 currentBaseVectorsSize = sqlite3_blob_bytes(blobVectors);
-    i64 expectedBaseVectorsSize =
-        p->chunk_size * vector_column_byte_size(*vector_column);
-    if (currentBaseVectorsSize != expectedBaseVectorsSize) {
-      // IMP: V16465_00535
-      vtab_set_error(
-          &p->base,
-          "vectors blob size doesn't match - expected %lld, found %lld",
-          expectedBaseVectorsSize, currentBaseVectorsSize);
-      rc = SQLITE_ERROR;
-      goto cleanup;
+    operator = VEC0_METADATA_OPERATOR_IS;
+    if (vec0_filter_is_keyword(parser, "not")) {
+      operator = VEC0_METADATA_OPERATOR_ISNOT;
+      rc = vec0_filter_next(parser);
+      if (rc != SQLITE_OK) {
+        return rc;
+      }
+    }
+    if (vec0_filter_is_keyword(parser, "null")) {
+      operator = operator == VEC0_METADATA_OPERATOR_IS
+                     ? VEC0_METADATA_OPERATOR_ISNULL
+                     : VEC0_METADATA_OPERATOR_ISNOTNULL;
+      rc = vec0_filter_next(parser);
+    }
+  } else {
+    if (vec0_filter_is_keyword(parser, "not")) {
+      negate = 1;
+      rc = vec0_filter_next(parser);
+      if (rc != SQLITE_OK) {
+        return rc;
+      }
+    }
+    if (vec0_filter_is_keyword(parser, "in")) {
+      operator = VEC0_METADATA_OPERATOR_IN;
+    } else if (vec0_filter_is_keyword(parser, "like")) {
+      operator = VEC0_METADATA_OPERATOR_LIKE;
+    } else if (vec0_filter_is_keyword(parser, "glob")) {
+      operator = VEC0_METADATA_OPERATOR_GLOB;
+    } else if (vec0_filter_is_keyword(parser, "between")) {
+      operator = VEC0_METADATA_OPERATOR_GE;
+      between = 1;
+    } else {
+      return vec0_filter_error(parser, "expected a comparison operator");
     }
-    rc = sqlite3_blob_read(blobVectors, baseVectors, currentBaseVectorsSize, 0);
+    rc = vec0_filter_next(parser);
+  }
+  if (rc != SQLITE_OK) {
+    return rc;
+  }
+
+  // the same operators as metadata constraints in KNN queries
+  vec0_metadata_column_kind kind = p->metadata_columns[metadata_idx].kind;
+  int isText = kind == VEC0_METADATA_COLUMN_KIND_TEXT ||
+               kind == VEC0_METADATA_COLUMN_KIND_DICTIONARY;
+  if (kind == VEC0_METADATA_COLUMN_KIND_BOOLEAN &&
+      !(operator == VEC0_METADATA_OPERATOR_EQ ||
+        operator == VEC0_METADATA_OPERATOR_NE ||
+        operator == VEC0_METADATA_OPERATOR_IS ||
+        operator == VEC0_METADATA_OPERATOR_ISNOT ||
+        operator == VEC0_METADATA_OPERATOR_ISNULL ||
+        operator == VEC0_METADATA_OPERATOR_ISNOTNULL)) {
+    return vec0_filter_error(parser, "operator not allowed on a boolean metadata column");
+  }
+  if ((operator == VEC0_METADATA_OPERATOR_LIKE ||
+       operator == VEC0_METADATA_OPERATOR_GLOB) && !isText) {
+    return vec0_filter_error(parser, "LIKE and GLOB are only allowed on TEXT metadata columns");
+  }
+  if (operator == VEC0_METADATA_OPERATOR_IN &&
+      kind != VEC0_METADATA_COLUMN_KIND_INTEGER && !isText) {
+    return vec0_filter_error(parser, "IN is only allowed on INTEGER or TEXT metadata columns");
+  }
+
+  rc = vec0_filter_leaf(parser, metadata_idx, operator);
+  if (rc != SQLITE_OK) {
+    return rc;
+  }
 
+  // leaves without a value of their own get a NULL one
+  if (operator == VEC0_METADATA_OPERATOR_IN ||
+      operator == VEC0_METADATA_OPERATOR_ISNULL ||
+      operator == VEC0_METADATA_OPERATOR_ISNOTNULL) {
+    rc = vec0_filter_add_literal(parser, "NULL", 4, -1);
     if (rc != SQLITE_OK) {
-      vtab_set_error(&p->base, "vectors blob read error for %lld", chunk_id);
-      rc = SQLITE_ERROR;
-      goto cleanup;
+      return rc;
     }
+  }
 
-    bitmap_copy(b, chunkValidity, p->chunk_size);
-    if (arrayRowidsIn) {
-      bitmap_clear(bmRowids, p->chunk_size);
-
-      for (int i = 0; i < p->chunk_size; i++) {
-        if (!bitmap_get(chunkValidity, i)) {
-          continue;
-        }
-        i64 rowid = chunkRowids[i];
-        void *in = bsearch(&rowid, arrayRowidsIn->z, arrayRowidsIn->length,
-                           sizeof(i64), _cmp);
-        bitmap_set(bmRowids, i, in ? 1 : 0);
+  if (operator == VEC0_METADATA_OPERATOR_IN) {
+    int leafIn = (int)parser->program->leavesIn.length - 1;
+    if (parser->type != VEC0_FILTER_TOKEN_LPAREN) {
+      return vec0_filter_error(parser, "expected (");
+    }
+    do {
+      rc = vec0_filter_next(parser);
+      if (rc != SQLITE_OK) {
+        return rc;
+      }
+      rc = vec0_filter_literal(parser, leafIn);
+      if (rc != SQLITE_OK) {
+        return rc;
       }
-      bitmap_and_inplace(b, bmRowids, p->chunk_size);
+    } while (parser->type == VEC0_FILTER_TOKEN_COMMA);
+    if (parser->type != VEC0_FILTER_TOKEN_RPAREN) {
+      return vec0_filter_error(parser, "expected )");
     }
+    rc = vec0_filter_next(parser);
+  } else if (operator != VEC0_METADATA_OPERATOR_ISNULL &&
+             operator != VEC0_METADATA_OPERATOR_ISNOTNULL) {
+    rc = vec0_filter_literal(parser, -1);
+  }
+  if (rc != SQLITE_OK) {
+    return rc;
+  }
+  if (between) {
+    if (!vec0_filter_is_keyword(parser, "and")) {
+      return vec0_filter_error(parser, "expected AND");
+    }
+    rc = vec0_filter_next(parser);
+    if (rc == SQLITE_OK) {
+      rc = vec0_filter_leaf(parser, metadata_idx, VEC0_METADATA_OPERATOR_LE);
+    }
+    if (rc == SQLITE_OK) {
+      rc = vec0_filter_literal(parser, -1);
+    }
+    if (rc == SQLITE_OK) {
+      rc = vec0_filter_emit(parser, VEC0_FILTER_OP_AND);
+    }
+    if (rc != SQLITE_OK) {
+      return rc;
+    }
+  }
+  if (negate) {
+    rc = vec0_filter_emit(parser, VEC0_FILTER_OP_NOT);
+  }
+  return rc;
+}
 
-    if(hasMetadataFilters) {
-      for(int i = 0; i < argc; i++) {
-        int idx = 1 + (i * 4);
-        char kind = idxStr[idx + 0];
-        if(kind != VEC0_IDXSTR_KIND_METADATA_CONSTRAINT) {
-          continue;
-        }
-        int metadata_idx = idxStr[idx + 1] - 'A';
-        int operator = idxStr[idx + 2];
-
-        if(!metadataBlobs[metadata_idx]) {
-          rc = sqlite3_blob_open(p->db, p->schemaName, p->shadowMetadataChunksNames[metadata_idx], "data", chunk_id, 0, &metadataBlobs[metadata_idx]);
-          vtab_set_error(&p->base, "Could not open metadata blob");
-          if(rc != SQLITE_OK) {
-            goto cleanup;
-          }
-        }
+static int vec0_filter_parse_or(struct Vec0FilterParser *parser);
 
-        bitmap_clear(bmMetadata, p->chunk_size);
-        rc = vec0_set_metadata_filter_bitmap(p, metadata_idx, operator, argv[i], metadataBlobs[metadata_idx], chunk_id, bmMetadata, p->chunk_size, aMetadataIn, i);
-        if(rc != SQLITE_OK) {
-          vtab_set_error(&p->base, "Could not filter metadata fields");
-          if(rc != SQLITE_OK) {
-            goto cleanup;
-          }
-        }
-        bitmap_and_inplace(b, bmMetadata, p->chunk_size);
-      }
+static int vec0_filter_parse_not(struct Vec0FilterParser *parser) {
+  int rc;
+  if (++parser->nestingDepth > VEC0_FILTER_MAX_DEPTH) {
+    return vec0_filter_error(parser, "filter expression is nested too deeply");
+  }
+  if (vec0_filter_is_keyword(parser, "not")) {
+    rc = vec0_filter_next(parser);
+    if (rc == SQLITE_OK) {
+      rc = vec0_filter_parse_not(parser);
+    }
+    if (rc == SQLITE_OK) {
+      rc = vec0_filter_emit(parser, VEC0_FILTER_OP_NOT);
+    }
+  } else if (parser->type == VEC0_FILTER_TOKEN_LPAREN) {
+    rc = vec0_filter_next(parser);
+    if (rc == SQLITE_OK) {
+      rc = vec0_filter_parse_or(parser);
+    }
+    if (rc == SQLITE_OK && parser->type != VEC0_FILTER_TOKEN_RPAREN) {
+      rc = vec0_filter_error(parser, "expected )");
+    }
+    if (rc == SQLITE_OK) {
+      rc = vec0_filter_next(parser);
     }
+  } else {
+    rc = vec0_filter_parse_predicate(parser);
+  }
+  parser->nestingDepth--;
+  return rc;
+}
 
+static int vec0_filter_parse_and(struct Vec0FilterParser *parser) {
+  int rc = vec0_filter_parse_not(parser);
+  while (rc == SQLITE_OK && vec0_filter_is_keyword(parser, "and")) {
+    rc = vec0_filter_next(parser);
+    if (rc == SQLITE_OK) {
+      rc = vec0_filter_parse_not(parser);
+    }
+    if (rc == SQLITE_OK) {
+      rc = vec0_filter_emit(parser, VEC0_FILTER_OP_AND);
+    }
+  }
+  return rc;
+}
 
-    for (int i = 0; i < p->chunk_size; i++) {
-      if (!bitmap_get(b, i)) {
-        continue;
-      };
+static int vec0_filter_parse_or(struct Vec0FilterParser *parser) {
+  int rc = vec0_filter_parse_and(parser);
+  while (rc == SQLITE_OK && vec0_filter_is_keyword(parser, "or")) {
+    rc = vec0_filter_next(parser);
+    if (rc == SQLITE_OK) {
+      rc = vec0_filter_parse_and(parser);
+    }
+    if (rc == SQLITE_OK) {
+      rc = vec0_filter_emit(parser, VEC0_FILTER_OP_OR);
+    }
+  }
+  return rc;
+}
 
-      f32 result = 0.0f;
-      switch (vector_column->element_type) {
-      case SQLITE_VEC_ELEMENT_TYPE_FLOAT32: {
-        const f32 *base_i =
-            ((f32 *)baseVectors) + (i * vector_column->dimensions);
-        switch (vector_column->distance_metric) {
-        case VEC0_DISTANCE_METRIC_L2: {
-          result = distance_l2_sqr_float(base_i, (f32 *)queryVector,
-                                         &vector_column->dimensions);
-          break;
-        }
-        case VEC0_DISTANCE_METRIC_L1: {
-          result = distance_l1_f32(base_i, (f32 *)queryVector,
-                                   &vector_column->dimensions);
-          break;
-        }
-        case VEC0_DISTANCE_METRIC_COSINE: {
-          result = distance_cosine_float(base_i, (f32 *)queryVector,
-                                         &vector_column->dimensions);
-          break;
-        }
-        }
-        break;
+/**
+ * @brief Gives the leaves their literal values: SQLite evaluates all of them
+ * with one SELECT, then `in (...)` values are copied to their leavesIn
+ * arrays and constraints on dictionary columns are resolved to codes.
+ */
+static int vec0_filter_resolve_literals(struct Vec0FilterParser *parser) {
+  vec0_vtab *p = parser->p;
+  struct Vec0FilterProgram *program = parser->program;
+  sqlite3_stmt *stmt = NULL;
+  int rc = sqlite3_str_errcode(parser->literals);
+  if (rc != SQLITE_OK || !parser->nLiterals) {
+    return rc;
+  }
+  rc = sqlite3_prepare_v2(p->db, sqlite3_str_value(parser->literals), -1,
+                          &stmt, NULL);
+  if (rc != SQLITE_OK) {
+    parser->zErr = sqlite3_mprintf("invalid literal in filter: %s",
+                                   sqlite3_errmsg(p->db));
+    return rc;
+  }
+  rc = sqlite3_step(stmt);
+  if (rc != SQLITE_ROW) {
+    rc = SQLITE_ERROR;
+    goto done;
+  }
+  for (int i = 0; i < parser->nLiterals; i++) {
+    int *target = &((int *)parser->literalLeaves.z)[i * 2];
+    struct Vec0FilterInstr *leaf =
+        &((struct Vec0FilterInstr *)program->instrs.z)[target[0]];
+    sqlite3_value *value = sqlite3_column_value(stmt, i);
+    vec0_metadata_column_kind kind = p->metadata_columns[leaf->metadata_idx].kind;
+    if (target[1] < 0) {
+      leaf->value = sqlite3_value_dup(value);
+      if (!leaf->value) {
+        rc = SQLITE_NOMEM;
+        goto done;
       }
-      case SQLITE_VEC_ELEMENT_TYPE_INT8: {
-        const i8 *base_i =
-            ((i8 *)baseVectors) + (i * vector_column->dimensions);
-        switch (vector_column->distance_metric) {
-        case VEC0_DISTANCE_METRIC_L2: {
-          result = distance_l2_sqr_int8(base_i, (i8 *)queryVector,
-                                        &vector_column->dimensions);
-          break;
-        }
-        case VEC0_DISTANCE_METRIC_L1: {
-          result = distance_l1_int8(base_i, (i8 *)queryVector,
-                                    &vector_column->dimensions);
-          break;
-        }
-        case VEC0_DISTANCE_METRIC_COSINE: {
-          result = distance_cosine_int8(base_i, (i8 *)queryVector,
-                                        &vector_column->dimensions);
-          break;
+      // the codes of IN leaves come from their `(...)` values
+      if (kind == VEC0_METADATA_COLUMN_KIND_DICTIONARY &&
+          leaf->operator != VEC0_METADATA_OPERATOR_IN) {
+        struct Vec0MetadataIn *item = NULL;
+        for (size_t j = 0; j < program->leavesIn.length; j++) {
+          item = &((struct Vec0MetadataIn *)program->leavesIn.z)[j];
+          if (item->argv_idx == target[0]) {
+            break;
+          }
         }
+        rc = vec0_metadata_dictionary_codes(p, leaf->metadata_idx, leaf->operator,
+                                            leaf->value, &item->array);
+        if (rc != SQLITE_OK) {
+          goto done;
         }
-
-        break;
       }
-      case SQLITE_VEC_ELEMENT_TYPE_BIT: {
-        const u8 *base_i =
-            ((u8 *)baseVectors) + (i * (vector_column->dimensions / CHAR_BIT));
-        result = distance_hamming(base_i, (u8 *)queryVector,
-                                  &vector_column->dimensions);
+      continue;
+    }
+    struct Vec0MetadataIn *item =
+        &((struct Vec0MetadataIn *)program->leavesIn.z)[target[1]];
+    switch (kind) {
+    case VEC0_METADATA_COLUMN_KIND_DICTIONARY: {
+      // sorts the codes of all the values so far
+      rc = vec0_metadata_dictionary_codes(p, leaf->metadata_idx,
+                                          VEC0_METADATA_OPERATOR_EQ, value,
+                                          &item->array);
+      break;
+    }
+    case VEC0_METADATA_COLUMN_KIND_TEXT: {
+      struct Vec0MetadataInTextEntry entry;
+      entry.n = sqlite3_value_bytes(value);
+      entry.zString = sqlite3_mprintf("%.*s", entry.n,
+                                      (const char *)sqlite3_value_text(value));
+      if (!entry.zString) {
+        rc = SQLITE_NOMEM;
         break;
       }
+      rc = array_append(&item->array, &entry);
+      if (rc != SQLITE_OK) {
+        sqlite3_free(entry.zString);
       }
-
-      chunk_distances[i] = result;
+      break;
+    }
+    default: {
+      i64 v = sqlite3_value_int64(value);
+      rc = array_append(&item->array, &v);
+      // sorted for vec0_metadata_in_i64()
+      qsort(item->array.z, item->array.length, sizeof(i64), vec0_cmp_i64);
+      break;
+    }
+    }
+    if (rc != SQLITE_OK) {
+      goto done;
     }
+  }
+  rc = SQLITE_OK;
 
-    if(hasDistanceConstraints) {
-      for(int i = 0; i < argc; i++) {
-        int idx = 1 + (i * 4);
-        char kind = idxStr[idx + 0];
-        // Note: SQLite provides distance constraint values as f64 (double), but we
-        // cast to f32 (float) for comparison. This matches the precision of our
-        // internal distance calculations (which use f32) and avoids precision
-        // mismatches. May result in minor precision loss for very small differences.
-        f32 target = (f32) sqlite3_value_double(argv[i]);
+done:
+  sqlite3_finalize(stmt);
+  return rc;
+}
 
-        if(kind != VEC0_IDXSTR_KIND_KNN_DISTANCE_CONSTRAINT)  {
-          continue;
-        }
-        vec0_distance_constraint_operator op = idxStr[idx + 1];
+/**
+ * @brief Compiles a `filter = '...'` expression of a KNN query: comparisons on
+ * metadata columns, with the same operators as metadata constraints, combined
+ * with AND, OR, NOT and parentheses.
+ *
+ * @param zFilter the expression
+ * @param out_program output, free with vec0_filter_program_free()
+ * @param pzErr output, a description of a syntax error, free with
+ * sqlite3_free()
+ * @return int SQLITE_OK on success, error code otherwise
+ */
+static int vec0_filter_compile(vec0_vtab *p, const char *zFilter, int nFilter,
+                               struct Vec0FilterProgram **out_program,
+                               char **pzErr) {
+  int rc;
+  struct Vec0FilterParser parser;
+  memset(&parser, 0, sizeof(parser));
+  parser.p = p;
+  parser.z = zFilter;
+  parser.n = nFilter;
+  parser.program = sqlite3_malloc(sizeof(*parser.program));
+  if (!parser.program) {
+    return SQLITE_NOMEM;
+  }
+  memset(parser.program, 0, sizeof(*parser.program));
+  parser.literals = sqlite3_str_new(NULL);
+  sqlite3_str_appendall(parser.literals, "SELECT ");
+  rc = array_init(&parser.program->instrs, sizeof(struct Vec0FilterInstr), 8);
+  if (rc == SQLITE_OK) {
+    rc = array_init(&parser.program->leavesIn, sizeof(struct Vec0MetadataIn), 4);
+  }
+  if (rc == SQLITE_OK) {
+    rc = array_init(&parser.literalLeaves, sizeof(int) * 2, 8);
+  }
+  if (rc == SQLITE_OK) {
+    rc = vec0_filter_next(&parser);
+  }
+  if (rc == SQLITE_OK) {
+    rc = vec0_filter_parse_or(&parser);
+  }
+  if (rc == SQLITE_OK && parser.type != VEC0_FILTER_TOKEN_EOF) {
+    rc = vec0_filter_error(&parser, "unexpected token");
+  }
+  if (rc == SQLITE_OK) {
+    rc = vec0_filter_resolve_literals(&parser);
+  }
+  if (rc == SQLITE_OK) {
+    parser.program->stack = sqlite3_malloc64(
+        (i64)parser.program->nStack * (p->chunk_size / CHAR_BIT));
+    if (!parser.program->stack) {
+      rc = SQLITE_NOMEM;
+    }
+  }
+  sqlite3_free(sqlite3_str_finish(parser.literals));
+  array_cleanup(&parser.literalLeaves);
+  if (rc != SQLITE_OK) {
+    vec0_filter_program_free(p, parser.program);
+    *pzErr = parser.zErr;
+    return rc;
+  }
+  *out_program = parser.program;
+  return SQLITE_OK;
+}
 
-        switch(op) {
-          case VEC0_DISTANCE_CONSTRAINT_GE: {
-            for(int j = 0; j < p->chunk_size; j++) {
-              if(bitmap_get(b, j) && !(chunk_distances[j] >= target)) {
-                bitmap_set(b, j, 0);
-              }
-            }
-            break;
-          }
-          case VEC0_DISTANCE_CONSTRAINT_GT: {
-            for(int j = 0; j < p->chunk_size; j++) {
-              if(bitmap_get(b, j) && !(chunk_distances[j] > target)) {
-                bitmap_set(b, j, 0);
-              }
-            }
-            break;
-          }
-          case VEC0_DISTANCE_CONSTRAINT_LE: {
-            for(int j = 0; j < p->chunk_size; j++) {
-              if(bitmap_get(b, j) && !(chunk_distances[j] <= target)) {
-                bitmap_set(b, j, 0);
-              }
-            }
-            break;
-          }
-          case VEC0_DISTANCE_CONSTRAINT_LT: {
-            for(int j = 0; j < p->chunk_size; j++) {
-              if(bitmap_get(b, j) && !(chunk_distances[j] < target)) {
-                bitmap_set(b, j, 0);
-              }
-            }
-            break;
-          }
+/**
+ * @brief Runs a compiled filter on a chunk, clearing the rows of b that don't
+ * pass it. Leaves are only evaluated over the rows set in b.
+ *
+ * @param metadataBlobs, metadataData like vec0_chunk_filter_bitmap()
+ */
+static int vec0_filter_eval(vec0_vtab *p, struct Vec0FilterProgram *program,
+                            i64 chunk_id, i64 *chunkRowids,
+                            sqlite3_blob **metadataBlobs, u8 **metadataData,
+                            u8 *b) {
+  int rc;
+  int nBytes = p->chunk_size / CHAR_BIT;
+  int sp = 0;
+  for (size_t i = 0; i < program->instrs.length; i++) {
+    struct Vec0FilterInstr *instr =
+        &((struct Vec0FilterInstr *)program->instrs.z)[i];
+    u8 *top;
+    switch (instr->op) {
+    case VEC0_FILTER_OP_LEAF: {
+      top = &program->stack[sp * nBytes];
+      sp++;
+      bitmap_clear(top, p->chunk_size);
+      u8 *data = metadataData ? metadataData[instr->metadata_idx] : NULL;
+      if (!data && !metadataBlobs[instr->metadata_idx]) {
+        rc = sqlite3_blob_open(p->db, p->schemaName,
+                               p->shadowMetadataChunksNames[instr->metadata_idx],
+                               "data", chunk_id, 0,
+                               &metadataBlobs[instr->metadata_idx]);
+        if (rc != SQLITE_OK) {
+          vtab_set_error(&p->base, "Could not open metadata blob");
+          return rc;
         }
       }
+      rc = vec0_set_metadata_filter_bitmap(
+          p, instr->metadata_idx, instr->operator, instr->value,
+          metadataBlobs[instr->metadata_idx], data, chunk_id, chunkRowids, b,
+          top,
+          p->chunk_size, &program->leavesIn, (int)i);
+      if (rc != SQLITE_OK) {
+        vtab_set_error(&p->base, "Could not filter metadata fields");
+        return rc;
+      }
+      break;
+    }
+    case VEC0_FILTER_OP_AND: {
+      sp--;
+      top = &program->stack[sp * nBytes];
+      bitmap_and_inplace(top - nBytes, top, p->chunk_size);
+      break;
+    }
+    case VEC0_FILTER_OP_OR: {
+      sp--;
+      top = &program->stack[sp * nBytes];
+      for (int j = 0; j < nBytes; j++) {
+        top[j - nBytes] |= top[j];
+      }
+      break;
+    }
+    case VEC0_FILTER_OP_NOT: {
+      top = &program->stack[(sp - 1) * nBytes];
+      // rows outside of b are wrong after this, b masks them below
+      for (int j = 0; j < nBytes; j++) {
+        top[j] = ~top[j];
+      }
+      break;
     }
-
-    int used1;
-    min_idx(chunk_distances, p->chunk_size, b, chunk_topk_idxs,
-            min(k, p->chunk_size), bTaken, &used1);
-
-    i64 used;
-    merge_sorted_lists(topk_distances, topk_rowids, k_used, chunk_distances,
-                       chunkRowids, chunk_topk_idxs,
-                       min(min(k, p->chunk_size), used1), tmp_topk_distances,
-                       tmp_topk_rowids, k, &used);
-
-    for (int i = 0; i < used; i++) {
-      topk_rowids[i] = tmp_topk_rowids[i];
-      topk_distances[i] = tmp_topk_distances[i];
     }
-    k_used = used;
-    // blobVectors is always opened with read-only permissions, so this never
-    // fails.
-    sqlite3_blob_close(blobVectors);
-    blobVectors = NULL;
   }
+  assert(sp == 1);
+  bitmap_and_inplace(b, program->stack, p->chunk_size);
+  return SQLITE_OK;
+}
 
-  *out_topk_rowids = topk_rowids;
-  *out_topk_distances = topk_distances;
-  *out_used = k_used;
-  rc = SQLITE_OK;
+/**
+ * Chunk positions selected by an approximate index for a KNN query.
+ * vec0Filter_knn_chunks_iter() skips every chunk that isn't in chunkIds, and
+ * only computes distances for the vectors set in the chunk's bitmap.
+ */
+struct Vec0ChunkCandidates {
+  // sorted ids of the chunks with at least one candidate
+  i64 *chunkIds;
+  // one chunk_size bitmap per chunkIds entry, in the same order
+  u8 *bitmaps;
+  i64 length;
+};
 
-cleanup:
-  if (rc != SQLITE_OK) {
-    sqlite3_free(topk_rowids);
-    sqlite3_free(topk_distances);
+void vec0_chunk_candidates_free(struct Vec0ChunkCandidates *candidates) {
+  if (!candidates) {
+    return;
   }
-  sqlite3_free(chunk_topk_idxs);
-  sqlite3_free(tmp_topk_rowids);
-  sqlite3_free(tmp_topk_distances);
-  sqlite3_free(b);
-  sqlite3_free(bTaken);
-  sqlite3_free(bmRowids);
-  sqlite3_free(baseVectors);
-  sqlite3_free(chunk_distances);
-  sqlite3_free(bmMetadata);
-  for(int i = 0; i < VEC0_MAX_METADATA_COLUMNS; i++) {
-    sqlite3_blob_close(metadataBlobs[i]);
+  sqlite3_free(candidates->chunkIds);
+  sqlite3_free(candidates->bitmaps);
+  sqlite3_free(candidates);
+}
+
+static int vec0_cmp_chunk_position(const void *a, const void *b) {
+  const i64 *pa = (const i64 *)a;
+  const i64 *pb = (const i64 *)b;
+  if (pa[0] != pb[0]) {
+    return pa[0] < pb[0] ? -1 : 1;
   }
-  // blobVectors is always opened with read-only permissions, so this never
-  // fails.
-  sqlite3_blob_close(blobVectors);
-  return rc;
+  return (pa[1] > pb[1]) - (pa[1] < pb[1]);
 }
 
 /**
- * Compute pairwise distance between two vectors stored in the vec0 table's
- * native format.  Handles float32, int8, and bit element types with the
- * appropriate metric (L2, cosine, L1, hamming).
+ * @brief Build a candidate set out of (chunk_id, chunk_offset) pairs.
+ *
+ * @param p vec0 table
+ * @param positions array of i64[2] (chunk_id, chunk_offset) entries, sorted
+ * in place
+ * @param out output candidate set, must be freed with
+ * vec0_chunk_candidates_free()
+ * @return int SQLITE_OK on success, SQLITE_NOMEM on allocation failure
  */
-static f32 vec0_compute_distance(struct VectorColumnDefinition *vector_column,
-                                 const void *a, const void *b) {
-  size_t dims = vector_column->dimensions;
-  switch (vector_column->element_type) {
-  case SQLITE_VEC_ELEMENT_TYPE_FLOAT32:
-    switch (vector_column->distance_metric) {
-    case VEC0_DISTANCE_METRIC_L2:
-      return distance_l2_sqr_float(a, b, &dims);
-    case VEC0_DISTANCE_METRIC_L1:
-      return (f32)distance_l1_f32(a, b, &dims);
-    case VEC0_DISTANCE_METRIC_COSINE:
-      return distance_cosine_float(a, b, &dims);
+int vec0_chunk_candidates_build(vec0_vtab *p, struct Array *positions,
+                                struct Vec0ChunkCandidates **out) {
+  struct Vec0ChunkCandidates *candidates;
+  i64 *items = (i64 *)positions->z;
+  i64 numChunks = 0;
+  i32 bitmapSize = p->chunk_size / CHAR_BIT;
+
+  qsort(positions->z, positions->length, positions->element_size,
+        vec0_cmp_chunk_position);
+  for (size_t i = 0; i < positions->length; i++) {
+    if (i == 0 || items[i * 2] != items[(i - 1) * 2]) {
+      numChunks++;
     }
-    break;
-  case SQLITE_VEC_ELEMENT_TYPE_INT8:
-    switch (vector_column->distance_metric) {
-    case VEC0_DISTANCE_METRIC_L2:
-      return distance_l2_sqr_int8(a, b, &dims);
-    case VEC0_DISTANCE_METRIC_L1:
-      return (f32)distance_l1_int8(a, b, &dims);
-    case VEC0_DISTANCE_METRIC_COSINE:
-      return distance_cosine_int8(a, b, &dims);
+  }
+
+  candidates = sqlite3_malloc(sizeof(*candidates));
+  if (!candidates) {
+    return SQLITE_NOMEM;
+  }
+  memset(candidates, 0, sizeof(*candidates));
+  if (numChunks > 0) {
+    candidates->chunkIds = sqlite3_malloc64(numChunks * sizeof(i64));
+    candidates->bitmaps = sqlite3_malloc64(numChunks * bitmapSize);
+    if (!candidates->chunkIds || !candidates->bitmaps) {
+      vec0_chunk_candidates_free(candidates);
+      return SQLITE_NOMEM;
     }
-    break;
-  case SQLITE_VEC_ELEMENT_TYPE_BIT:
-    return distance_hamming(a, b, &dims);
+    memset(candidates->bitmaps, 0, numChunks * bitmapSize);
   }
-  return 0.0f;
+
+  i64 current = -1;
+  for (size_t i = 0; i < positions->length; i++) {
+    i64 chunk_id = items[i * 2];
+    i64 chunk_offset = items[i * 2 + 1];
+    if (current < 0 || candidates->chunkIds[current] != chunk_id) {
+      current++;
+      candidates->chunkIds[current] = chunk_id;
+    }
+    if (chunk_offset >= 0 && chunk_offset < p->chunk_size) {
+      bitmap_set(&candidates->bitmaps[current * bitmapSize], chunk_offset, 1);
+    }
+  }
+  candidates->length = numChunks;
+  *out = candidates;
+  return SQLITE_OK;
 }
 
 /**
- * MMR greedy reranking of KNN results.
- *
- * Loads vectors for top-k candidates, then iteratively selects the
- * candidate with the best MMR score:
- *   MMR(d) = lambda * relevance(d) - (1-lambda) * max_sim(d, S)
- *
- * where relevance = 1 - normalized_distance, and max_sim is the maximum
- * cosine similarity between d and any already-selected result.
- *
- * Reorders topk_rowids and topk_distances in place.
- * After return, the first *out_n_selected entries are the MMR-selected results.
+ * @brief Returns the candidate bitmap of the given chunk, or NULL if the chunk
+ * has no candidates.
  */
-static int vec0_mmr_rerank(
-    vec0_vtab *p,
-    int vectorColumnIdx,
-    struct VectorColumnDefinition *vector_column,
-    i64 *topk_rowids,
-    f32 *topk_distances,
-    i64 k_used,
-    i64 k_target,
-    f32 mmr_lambda,
-    i64 *out_n_selected
-) {
-    int rc = SQLITE_OK;
+u8 *vec0_chunk_candidates_find(vec0_vtab *p,
+                               struct Vec0ChunkCandidates *candidates,
+                               i64 chunk_id) {
+  i64 lo = 0, hi = candidates->length - 1;
+  while (lo <= hi) {
+    i64 mid = lo + (hi - lo) / 2;
+    if (candidates->chunkIds[mid] == chunk_id) {
+      return &candidates->bitmaps[mid * (p->chunk_size / CHAR_BIT)];
+    }
+    if (candidates->chunkIds[mid] < chunk_id) {
+      lo = mid + 1;
+    } else {
+      hi = mid - 1;
+    }
+  }
+  return NULL;
+}
 
-    // 1. Allocate vector storage for all candidates
-    void **vectors = sqlite3_malloc64(k_used * sizeof(void *));
-    if (!vectors) return SQLITE_NOMEM;
-    memset(vectors, 0, k_used * sizeof(void *));
+typedef int (*vec0_vector_visitor)(void *pCtx, i64 rowid, const void *vector);
 
-    f32 *relevance = NULL;
-    i64 *out_rowids = NULL;
-    f32 *out_distances = NULL;
-    void **out_vectors = NULL;
-    u8 *selected = NULL;
+/**
+ * @brief Call visit() on every stored vector of a vector column, in chunk
+ * order. Stops at the first visit() call that doesn't return SQLITE_OK.
+ *
+ * @param p vec0 table
+ * @param vector_column_idx vector column to scan
+ * @param visit callback, called with the rowid and a pointer to the vector
+ * that's only valid during the call
+ * @param pCtx passed through to visit()
+ * @return int SQLITE_OK on success, error code otherwise
+ */
+int vec0_scan_vectors(vec0_vtab *p, int vector_column_idx,
+                      vec0_vector_visitor visit, void *pCtx) {
+  int rc;
+  sqlite3_stmt *stmt = NULL;
+  size_t vectorSize =
+      vector_column_byte_size(p->vector_columns[vector_column_idx]);
+  char *zSql = sqlite3_mprintf(
+      "SELECT c.validity, c.rowids, v.vectors FROM " VEC0_SHADOW_CHUNKS_NAME
+      " AS c JOIN " VEC0_SHADOW_VECTOR_N_NAME
+      " AS v ON v.rowid = c.chunk_id ORDER BY c.chunk_id",
+      p->schemaName, p->tableName, p->schemaName, p->tableName,
+      vector_column_idx);
+  if (!zSql) {
+    return SQLITE_NOMEM;
+  }
+  rc = sqlite3_prepare_v2(p->db, zSql, -1, &stmt, NULL);
+  sqlite3_free(zSql);
+  if (rc != SQLITE_OK) {
+    return rc;
+  }
 
-    // 2. Load vectors from shadow tables
-    for (i64 i = 0; i < k_used; i++) {
-        rc = vec0_get_vector_data(p, topk_rowids[i], vectorColumnIdx,
-                                  &vectors[i], NULL);
-        if (rc != SQLITE_OK) goto cleanup;
+  while ((rc = sqlite3_step(stmt)) == SQLITE_ROW) {
+    u8 *validity = (u8 *)sqlite3_column_blob(stmt, 0);
+    const i64 *rowids = (const i64 *)sqlite3_column_blob(stmt, 1);
+    const u8 *vectors = (const u8 *)sqlite3_column_blob(stmt, 2);
+    if (sqlite3_column_bytes(stmt, 0) != p->chunk_size / CHAR_BIT ||
+        sqlite3_column_bytes(stmt, 1) !=
+            (int)(p->chunk_size * sizeof(i64)) ||
+        sqlite3_column_bytes(stmt, 2) != (int)(p->chunk_size * vectorSize)) {
+      vtab_set_error(&p->base, VEC_INTERAL_ERROR "corrupted chunk found while "
+                               "scanning vectors");
+      rc = SQLITE_CORRUPT_VTAB;
+      goto done;
     }
-
-    // 3. Normalize distances to [0, 1] for relevance scoring
-    f32 max_dist = 0.0f;
-    for (i64 i = 0; i < k_used; i++) {
-        if (topk_distances[i] > max_dist) max_dist = topk_distances[i];
+    for (int i = 0; i < p->chunk_size; i++) {
+      if (!bitmap_get(validity, i)) {
+        continue;
+      }
+      rc = visit(pCtx, rowids[i], vectors + i * vectorSize);
+      if (rc != SQLITE_OK) {
+        goto done;
+      }
     }
-    if (max_dist < 1e-9f) max_dist = 1.0f;
+  }
+  if (rc == SQLITE_DONE) {
+    rc = SQLITE_OK;
+  }
 
-    relevance = sqlite3_malloc64(k_used * sizeof(f32));
-    if (!relevance) { rc = SQLITE_NOMEM; goto cleanup; }
-    for (i64 i = 0; i < k_used; i++) {
-        relevance[i] = 1.0f - (topk_distances[i] / max_dist);
-    }
+done:
+  sqlite3_finalize(stmt);
+  return rc;
+}
 
-    // 4. Greedy MMR selection
-    out_rowids = sqlite3_malloc64(k_target * sizeof(i64));
-    out_distances = sqlite3_malloc64(k_target * sizeof(f32));
-    out_vectors = sqlite3_malloc64(k_target * sizeof(void *));
-    selected = sqlite3_malloc64(k_used);
-    if (!out_rowids || !out_distances || !out_vectors || !selected) {
-        rc = SQLITE_NOMEM; goto cleanup;
-    }
-    memset(selected, 0, k_used);
+// Upper bound of vectors sampled to train an IVF index, unless nlist is larger
+#ifndef SQLITE_VEC_IVF_MAX_TRAINING_SAMPLES
+#define SQLITE_VEC_IVF_MAX_TRAINING_SAMPLES 16384
+#endif
 
-    i64 n_selected = 0;
-    for (i64 step = 0; step < k_target && step < k_used; step++) {
-        f32 best_mmr = -FLT_MAX;
-        i64 best_idx = -1;
+// Vectors sampled per list to train an IVF index
+#define VEC0_IVF_TRAINING_SAMPLES_PER_LIST 64
 
-        for (i64 i = 0; i < k_used; i++) {
-            if (selected[i]) continue;
-
-            // max similarity to already-selected results
-            f32 max_sim = 0.0f;
-            for (i64 j = 0; j < step; j++) {
-                f32 d = vec0_compute_distance(vector_column,
-                                              vectors[i], out_vectors[j]);
-                f32 sim = 1.0f - (d / max_dist);
-                if (sim > max_sim) max_sim = sim;
-            }
-
-            f32 mmr_score = mmr_lambda * relevance[i]
-                          - (1.0f - mmr_lambda) * max_sim;
-            if (mmr_score > best_mmr) {
-                best_mmr = mmr_score;
-                best_idx = i;
-            }
-        }
+// Number of k-means (Lloyd) iterations when training an IVF index
+#ifndef SQLITE_VEC_IVF_TRAINING_ITERATIONS
+#define SQLITE_VEC_IVF_TRAINING_ITERATIONS 10
+#endif
 
-        if (best_idx < 0) break;
-        selected[best_idx] = 1;
-        out_rowids[step] = topk_rowids[best_idx];
-        out_distances[step] = topk_distances[best_idx];
-        out_vectors[step] = vectors[best_idx];
-        n_selected++;
-    }
+static int vec0_has_ivf_index(vec0_vtab *p, int vector_column_idx) {
+  return p->vector_columns[vector_column_idx].index_type ==
+         VEC0_INDEX_TYPE_IVF;
+}
 
-    // 5. Copy results back to input arrays
-    for (i64 i = 0; i < n_selected; i++) {
-        topk_rowids[i] = out_rowids[i];
-        topk_distances[i] = out_distances[i];
-    }
-    *out_n_selected = n_selected;
+/**
+ * @brief splitmix64, used for deterministic IVF training samples.
+ */
+static u64 vec0_rand_next(u64 *state) {
+  u64 z = (*state += 0x9E3779B97F4A7C15ULL);
+  z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+  z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+  return z ^ (z >> 31);
+}
 
-cleanup:
-    if (vectors) {
-        for (i64 i = 0; i < k_used; i++) {
-            sqlite3_free(vectors[i]);
-        }
-        sqlite3_free(vectors);
+/**
+ * @brief Convert a float32 or int8 vector to the float32 space the IVF
+ * centroids live in. Cosine vectors are normalized, so k-means over L2 groups
+ * them by angle.
+ */
+static void vec0_ivf_prepare_vector(struct VectorColumnDefinition *column,
+                                    const void *vector, f32 *out) {
+  double norm = 0.0;
+  for (size_t i = 0; i < column->dimensions; i++) {
+    out[i] = (f32)vec0_vector_element_as_double(vector, column->element_type, i);
+    norm += (double)out[i] * out[i];
+  }
+  if (column->distance_metric == VEC0_DISTANCE_METRIC_COSINE && norm > 0.0) {
+    f32 scale = (f32)(1.0 / sqrt(norm));
+    for (size_t i = 0; i < column->dimensions; i++) {
+      out[i] *= scale;
     }
-    sqlite3_free(relevance);
-    sqlite3_free(out_rowids);
-    sqlite3_free(out_distances);
-    sqlite3_free(out_vectors);
-    sqlite3_free(selected);
-    return rc;
+  }
 }
 
-int vec0Filter_knn(vec0_cursor *pCur, vec0_vtab *p, int idxNum,
-                   const char *idxStr, int argc, sqlite3_value **argv) {
-  assert(argc == (int)((strlen(idxStr)-1) / 4));
-  int rc;
-  struct vec0_query_knn_data *knn_data;
+/**
+ * @brief Returns the list id of the centroid closest to v.
+ */
+static int vec0_ivf_nearest_list(const f32 *centroids, int nlist, size_t dims,
+                                 const f32 *v) {
+  int best = 0;
+  f32 bestDistance = FLT_MAX;
+  for (int i = 0; i < nlist; i++) {
+    f32 d = distance_l2_sqr_float(v, centroids + i * dims, &dims);
+    if (d < bestDistance) {
+      bestDistance = d;
+      best = i;
+    }
+  }
+  return best;
+}
 
-  int vectorColumnIdx = idxNum;
-  struct VectorColumnDefinition *vector_column =
-      &p->vector_columns[vectorColumnIdx];
+struct Vec0IvfListDistance {
+  f32 distance;
+  int list_id;
+};
 
-  struct Array *arrayRowidsIn = NULL;
-  sqlite3_stmt *stmtChunks = NULL;
-  void *queryVector;
-  size_t dimensions;
-  enum VectorElementType elementType;
-  vector_cleanup queryVectorCleanup = vector_cleanup_noop;
-  char *pzError;
-  knn_data = sqlite3_malloc(sizeof(*knn_data));
-  if (!knn_data) {
-    return SQLITE_NOMEM;
+static int vec0_cmp_ivf_list_distance(const void *a, const void *b) {
+  const struct Vec0IvfListDistance *pa = a;
+  const struct Vec0IvfListDistance *pb = b;
+  if (pa->distance != pb->distance) {
+    return pa->distance < pb->distance ? -1 : 1;
   }
-  memset(knn_data, 0, sizeof(*knn_data));
-  // array of `struct Vec0MetadataIn`, IF there are any `xxx in (...)` metadata constraints
-  struct Array * aMetadataIn = NULL;
+  return pa->list_id - pb->list_id;
+}
 
-  int query_idx =-1;
-  int k_idx = -1;
-  int rowid_in_idx = -1;
-  int mmr_lambda_idx = -1;
-  for(int i = 0; i < argc; i++) {
-    if(idxStr[1 + (i*4)] == VEC0_IDXSTR_KIND_KNN_MATCH) {
-      query_idx = i;
-    }
-    if(idxStr[1 + (i*4)] == VEC0_IDXSTR_KIND_KNN_K) {
-      k_idx = i;
-    }
-    if(idxStr[1 + (i*4)] == VEC0_IDXSTR_KIND_KNN_ROWID_IN) {
-      rowid_in_idx = i;
-    }
-    if(idxStr[1 + (i*4)] == VEC0_IDXSTR_KIND_KNN_MMR_LAMBDA) {
-      mmr_lambda_idx = i;
-    }
+/**
+ * @brief Load the trained centroids of an IVF vector column into p's cache,
+ * if they aren't already loaded at the latest generation.
+ *
+ * @param p vec0 table
+ * @param vector_column_idx IVF vector column
+ * @param out set to the cached centroids. nlist is 0 if the index hasn't been
+ * trained yet.
+ * @return int SQLITE_OK on success, error code otherwise
+ */
+int vec0_ivf_load_centroids(vec0_vtab *p, int vector_column_idx,
+                            struct Vec0IvfCentroids **out) {
+  int rc;
+  sqlite3_stmt *stmt = NULL;
+  struct Vec0IvfCentroids *cache = &p->ivfCentroids[vector_column_idx];
+  size_t dimensions = p->vector_columns[vector_column_idx].dimensions;
+  i64 generation = 0;
+  i64 nlist = 0;
+  f32 *centroids = NULL;
+
+  char *zSql = sqlite3_mprintf("SELECT value FROM " VEC0_SHADOW_INFO_NAME
+                               " WHERE key = 'IVF_GENERATION_%02d'",
+                               p->schemaName, p->tableName, vector_column_idx);
+  if (!zSql) {
+    return SQLITE_NOMEM;
   }
-  assert(query_idx >= 0);
-  assert(k_idx >= 0);
-
-  // make sure the query vector matches the vector column (type dimensions etc.)
-  rc = vector_from_value(argv[query_idx], &queryVector, &dimensions, &elementType,
-                         &queryVectorCleanup, &pzError);
-
+  rc = sqlite3_prepare_v2(p->db, zSql, -1, &stmt, NULL);
+  sqlite3_free(zSql);
   if (rc != SQLITE_OK) {
-    vtab_set_error(&p->base,
-                   "Query vector on the \"%.*s\" column is invalid: %z",
-                   vector_column->name_length, vector_column->name, pzError);
-    rc = SQLITE_ERROR;
-    goto cleanup;
+    goto done;
   }
-  if (elementType != vector_column->element_type) {
-    vtab_set_error(
-        &p->base,
-        "Query vector for the \"%.*s\" column is expected to be of type "
-        "%s, but a %s vector was provided.",
-        vector_column->name_length, vector_column->name,
-        vector_subtype_name(vector_column->element_type),
-        vector_subtype_name(elementType));
-    rc = SQLITE_ERROR;
-    goto cleanup;
+  rc = sqlite3_step(stmt);
+  if (rc == SQLITE_ROW) {
+    generation = sqlite3_column_int64(stmt, 0);
+  } else if (rc != SQLITE_DONE) {
+    goto done;
   }
-  if (dimensions != vector_column->dimensions) {
-    vtab_set_error(
-        &p->base,
-        "Dimension mismatch for query vector for the \"%.*s\" column. "
-        "Expected %d dimensions but received %d.",
-        vector_column->name_length, vector_column->name,
-        vector_column->dimensions, dimensions);
-    rc = SQLITE_ERROR;
-    goto cleanup;
+  sqlite3_finalize(stmt);
+  stmt = NULL;
+
+  if (cache->loaded && cache->generation == generation) {
+    *out = cache;
+    rc = SQLITE_OK;
+    goto done;
   }
 
-  i64 k = sqlite3_value_int64(argv[k_idx]);
-  if (k < 0) {
-    vtab_set_error(
-        &p->base, "k value in knn queries must be greater than or equal to 0.");
-    rc = SQLITE_ERROR;
-    goto cleanup;
+  zSql = sqlite3_mprintf("SELECT count(*) FROM " VEC0_SHADOW_IVF_CENTROIDS_N_NAME,
+                         p->schemaName, p->tableName, vector_column_idx);
+  if (!zSql) {
+    rc = SQLITE_NOMEM;
+    goto done;
   }
-#define SQLITE_VEC_VEC0_K_MAX 4096
-  if (k > SQLITE_VEC_VEC0_K_MAX) {
-    vtab_set_error(
-        &p->base,
-        "k value in knn query too large, provided %lld and the limit is %lld",
-        k, SQLITE_VEC_VEC0_K_MAX);
-    rc = SQLITE_ERROR;
-    goto cleanup;
+  rc = sqlite3_prepare_v2(p->db, zSql, -1, &stmt, NULL);
+  sqlite3_free(zSql);
+  if (rc != SQLITE_OK) {
+    goto done;
   }
-
-  if (k == 0) {
-    knn_data->k = 0;
-    pCur->knn_data = knn_data;
-    pCur->query_plan = VEC0_QUERY_PLAN_KNN;
-    rc = SQLITE_OK;
-    goto cleanup;
+  if (sqlite3_step(stmt) != SQLITE_ROW) {
+    rc = SQLITE_ERROR;
+    goto done;
   }
+  nlist = sqlite3_column_int64(stmt, 0);
+  sqlite3_finalize(stmt);
+  stmt = NULL;
 
-  // MMR: validate lambda and over-fetch candidates
-#define SQLITE_VEC_MMR_OVERFETCH_FACTOR 5
-  f32 mmr_lambda = -1.0f;
-  i64 k_original = k;
-  if (mmr_lambda_idx >= 0) {
-    mmr_lambda = (f32)sqlite3_value_double(argv[mmr_lambda_idx]);
-    if (mmr_lambda < 0.0f || mmr_lambda > 1.0f) {
-      vtab_set_error(
-          &p->base,
-          "mmr_lambda value in knn query must be between 0.0 and 1.0, "
-          "provided %f",
-          (double)mmr_lambda);
-      rc = SQLITE_ERROR;
-      goto cleanup;
-    }
-    if (mmr_lambda < 1.0f) {
-      i64 k_internal = k * SQLITE_VEC_MMR_OVERFETCH_FACTOR;
-      if (k_internal > SQLITE_VEC_VEC0_K_MAX) k_internal = SQLITE_VEC_VEC0_K_MAX;
-      if (k_internal < k) k_internal = k;  // overflow guard
-      k = k_internal;
+  if (nlist > 0) {
+    centroids = sqlite3_malloc64(nlist * dimensions * sizeof(f32));
+    if (!centroids) {
+      rc = SQLITE_NOMEM;
+      goto done;
     }
-  }
-
-// handle when a `rowid in (...)` operation was provided
-// Array of all the rowids that appear in any `rowid in (...)` constraint.
-// NULL if none were provided, which means a "full" scan.
-#if COMPILER_SUPPORTS_VTAB_IN
-  if (rowid_in_idx >= 0) {
-    sqlite3_value *item;
-    int rc;
-    arrayRowidsIn = sqlite3_malloc(sizeof(*arrayRowidsIn));
-    if (!arrayRowidsIn) {
+    zSql = sqlite3_mprintf("SELECT rowid, centroid FROM "
+                           VEC0_SHADOW_IVF_CENTROIDS_N_NAME " ORDER BY rowid",
+                           p->schemaName, p->tableName, vector_column_idx);
+    if (!zSql) {
       rc = SQLITE_NOMEM;
-      goto cleanup;
+      goto done;
     }
-    memset(arrayRowidsIn, 0, sizeof(*arrayRowidsIn));
-
-    rc = array_init(arrayRowidsIn, sizeof(i64), 32);
+    rc = sqlite3_prepare_v2(p->db, zSql, -1, &stmt, NULL);
+    sqlite3_free(zSql);
     if (rc != SQLITE_OK) {
-      goto cleanup;
+      goto done;
     }
-    for (rc = sqlite3_vtab_in_first(argv[rowid_in_idx], &item); rc == SQLITE_OK && item;
-         rc = sqlite3_vtab_in_next(argv[rowid_in_idx], &item)) {
-      i64 rowid;
-      if (p->pkIsText) {
-        rc = vec0_rowid_from_id(p, item, &rowid);
-        if (rc != SQLITE_OK) {
-          goto cleanup;
-        }
-      } else {
-        rowid = sqlite3_value_int64(item);
-      }
-      rc = array_append(arrayRowidsIn, &rowid);
-      if (rc != SQLITE_OK) {
-        goto cleanup;
+    i64 i = 0;
+    while ((rc = sqlite3_step(stmt)) == SQLITE_ROW) {
+      if (i >= nlist || sqlite3_column_int64(stmt, 0) != i ||
+          sqlite3_column_bytes(stmt, 1) != (int)(dimensions * sizeof(f32))) {
+        vtab_set_error(&p->base,
+                       VEC_INTERAL_ERROR "invalid IVF centroid %lld", i);
+        rc = SQLITE_CORRUPT_VTAB;
+        goto done;
       }
+      memcpy(centroids + i * dimensions, sqlite3_column_blob(stmt, 1),
+             dimensions * sizeof(f32));
+      i++;
     }
     if (rc != SQLITE_DONE) {
-      vtab_set_error(&p->base, "error processing rowid in (...) array");
-      goto cleanup;
+      goto done;
     }
-    qsort(arrayRowidsIn->z, arrayRowidsIn->length, arrayRowidsIn->element_size,
-          _cmp);
   }
-#endif
 
-  #if COMPILER_SUPPORTS_VTAB_IN
-  for(int i = 0; i < argc; i++) {
-    if(!(idxStr[1 + (i*4)] == VEC0_IDXSTR_KIND_METADATA_CONSTRAINT && idxStr[1 + (i*4) + 2] == VEC0_METADATA_OPERATOR_IN)) {
-      continue;
-    }
-    int metadata_idx = idxStr[1 + (i*4) + 1]  - 'A';
-    if(!aMetadataIn) {
-      aMetadataIn = sqlite3_malloc(sizeof(*aMetadataIn));
-      if(!aMetadataIn) {
-        rc = SQLITE_NOMEM;
-        goto cleanup;
-      }
-      memset(aMetadataIn, 0, sizeof(*aMetadataIn));
-      rc = array_init(aMetadataIn, sizeof(struct Vec0MetadataIn), 8);
-      if(rc != SQLITE_OK) {
-        goto cleanup;
-      }
-    }
+  sqlite3_free(cache->centroids);
+  cache->centroids = centroids;
+  centroids = NULL;
+  cache->nlist = (int)nlist;
+  cache->generation = generation;
+  cache->loaded = 1;
+  *out = cache;
+  rc = SQLITE_OK;
 
-    struct Vec0MetadataIn item;
-    memset(&item, 0, sizeof(item));
-    item.metadata_idx=metadata_idx;
-    item.argv_idx = i;
+done:
+  sqlite3_free(centroids);
+  sqlite3_finalize(stmt);
+  return rc;
+}
 
-    switch(p->metadata_columns[metadata_idx].kind) {
-      case VEC0_METADATA_COLUMN_KIND_INTEGER: {
-        rc = array_init(&item.array, sizeof(i64), 16);
-        if(rc != SQLITE_OK) {
-          goto cleanup;
-        }
-        sqlite3_value *entry;
-        for (rc = sqlite3_vtab_in_first(argv[i], &entry); rc == SQLITE_OK && entry; rc = sqlite3_vtab_in_next(argv[i], &entry)) {
-          i64 v = sqlite3_value_int64(entry);
-          rc = array_append(&item.array, &v);
-          if (rc != SQLITE_OK) {
-            array_cleanup(&item.array);
-            goto cleanup;
-          }
-        }
-
-        if (rc != SQLITE_DONE) {
-          vtab_set_error(&p->base, "Error fetching next value in `x in (...)` integer expression");
-          array_cleanup(&item.array);
-          goto cleanup;
-        }
-
-        break;
-      }
-      case VEC0_METADATA_COLUMN_KIND_TEXT: {
-        rc = array_init(&item.array, sizeof(struct Vec0MetadataInTextEntry), 16);
-        if(rc != SQLITE_OK) {
-          goto cleanup;
-        }
-        sqlite3_value *entry;
-        for (rc = sqlite3_vtab_in_first(argv[i], &entry); rc == SQLITE_OK && entry; rc = sqlite3_vtab_in_next(argv[i], &entry)) {
-          const char * s = (const char *) sqlite3_value_text(entry);
-          int n = sqlite3_value_bytes(entry);
-
-          struct Vec0MetadataInTextEntry textEntry;
-          textEntry.zString = sqlite3_mprintf("%.*s", n, s);
-          if(!textEntry.zString) {
-            rc = SQLITE_NOMEM;
-            goto item_text_cleanup;
-          }
-          textEntry.n = n;
-          rc = array_append(&item.array, &textEntry);
-          if (rc != SQLITE_OK) {
-            sqlite3_free(textEntry.zString);
-            goto item_text_cleanup;
-          }
-        }
-
-        if (rc != SQLITE_DONE) {
-          vtab_set_error(&p->base, "Error fetching next value in `x in (...)` text expression");
-          goto item_text_cleanup;
-        }
-
-        break;
-
-      // Error cleanup label for TEXT case only. Unlike INTEGER entries (which are
-      // plain i64 values), TEXT entries contain heap-allocated zString pointers
-      // that must be freed before array_cleanup(). This label is only reachable
-      // via goto from error paths within this case block.
-      item_text_cleanup:
-        vec0_metadata_in_text_cleanup(&item.array);
-        goto cleanup;
-      }
-      default: {
-        vtab_set_error(&p->base, "Internal sqlite-vec error");
-        goto cleanup;
-      }
-    }
+/**
+ * @brief Assign a row to the list of its nearest centroid. A no-op while the
+ * IVF index hasn't been trained yet.
+ *
+ * @param p vec0 table
+ * @param vector_column_idx IVF vector column
+ * @param rowid rowid of the row
+ * @param vector the row's vector, float32 or int8
+ * @return int SQLITE_OK on success, error code otherwise
+ */
+int vec0_ivf_assign(vec0_vtab *p, int vector_column_idx, i64 rowid,
+                    const void *vector) {
+  int rc;
+  struct Vec0IvfCentroids *centroids;
+  struct VectorColumnDefinition *column = &p->vector_columns[vector_column_idx];
+  sqlite3_stmt *stmt = NULL;
+  f32 *v;
 
-    rc = array_append(aMetadataIn, &item);
-    if(rc != SQLITE_OK) {
-      // Clean up item that couldn't be appended
-      if(p->metadata_columns[metadata_idx].kind == VEC0_METADATA_COLUMN_KIND_TEXT) {
-        vec0_metadata_in_text_cleanup(&item.array);
-      } else {
-        array_cleanup(&item.array);
-      }
-      goto cleanup;
-    }
+  rc = vec0_ivf_load_centroids(p, vector_column_idx, &centroids);
+  if (rc != SQLITE_OK || centroids->nlist == 0) {
+    return rc;
   }
-  #endif
-
-  rc = vec0_chunks_iter(p, idxStr, argc, argv, &stmtChunks);
-  if (rc != SQLITE_OK) {
-    // IMP: V06942_23781
-    vtab_set_error(&p->base, "Error preparing stmtChunk: %s",
-                   sqlite3_errmsg(p->db));
-    goto cleanup;
+  v = sqlite3_malloc64(column->dimensions * sizeof(f32));
+  if (!v) {
+    return SQLITE_NOMEM;
   }
+  vec0_ivf_prepare_vector(column, vector, v);
+  int list_id = vec0_ivf_nearest_list(centroids->centroids, centroids->nlist,
+                                      column->dimensions, v);
+  sqlite3_free(v);
 
-  i64 *topk_rowids = NULL;
-  f32 *topk_distances = NULL;
-  i64 k_used = 0;
-  rc = vec0Filter_knn_chunks_iter(p, stmtChunks, vector_column, vectorColumnIdx,
-                                  arrayRowidsIn, aMetadataIn, idxStr, argc, argv, queryVector, k, &topk_rowids,
-                                  &topk_distances, &k_used);
+  char *zSql = sqlite3_mprintf("INSERT OR REPLACE INTO "
+                               VEC0_SHADOW_IVF_LISTS_N_NAME
+                               "(rowid, list_id) VALUES (?, ?)",
+                               p->schemaName, p->tableName, vector_column_idx);
+  if (!zSql) {
+    return SQLITE_NOMEM;
+  }
+  rc = sqlite3_prepare_v2(p->db, zSql, -1, &stmt, NULL);
+  sqlite3_free(zSql);
   if (rc != SQLITE_OK) {
-    goto cleanup;
+    return rc;
   }
-
-  // MMR reranking: select diverse subset from over-fetched candidates
-  if (mmr_lambda >= 0.0f && mmr_lambda < 1.0f && k_used > k_original) {
-    i64 n_selected = 0;
-    rc = vec0_mmr_rerank(p, vectorColumnIdx, vector_column,
-                         topk_rowids, topk_distances, k_used, k_original,
-                         mmr_lambda, &n_selected);
-    if (rc != SQLITE_OK) goto cleanup;
-    k_used = n_selected;
-    k = k_original;
+  sqlite3_bind_int64(stmt, 1, rowid);
+  sqlite3_bind_int(stmt, 2, list_id);
+  rc = sqlite3_step(stmt);
+  sqlite3_finalize(stmt);
+  if (rc != SQLITE_DONE) {
+    vtab_set_error(&p->base, "could not assign row %lld to an IVF list", rowid);
+    return SQLITE_ERROR;
   }
+  return SQLITE_OK;
+}
 
-  knn_data->current_idx = 0;
-  knn_data->k = k;
-  knn_data->rowids = topk_rowids;
-  knn_data->distances = topk_distances;
-  knn_data->k_used = k_used;
-
-  pCur->knn_data = knn_data;
-  pCur->query_plan = VEC0_QUERY_PLAN_KNN;
-  rc = SQLITE_OK;
-
-cleanup:
-  sqlite3_finalize(stmtChunks);
-  array_cleanup(arrayRowidsIn);
-  sqlite3_free(arrayRowidsIn);
-  queryVectorCleanup(queryVector);
-  if(aMetadataIn) {
-    for(size_t i = 0; i < aMetadataIn->length; i++) {
-      struct Vec0MetadataIn* item = &((struct Vec0MetadataIn *) aMetadataIn->z)[i];
-      if(p->metadata_columns[item->metadata_idx].kind == VEC0_METADATA_COLUMN_KIND_TEXT) {
-        vec0_metadata_in_text_cleanup(&item->array);
-      } else {
-        array_cleanup(&item->array);
-      }
+/**
+ * @brief Remove a row from the IVF lists of every IVF vector column.
+ */
+int vec0_ivf_unassign(vec0_vtab *p, i64 rowid) {
+  int rc;
+  sqlite3_stmt *stmt;
+  for (int i = 0; i < p->numVectorColumns; i++) {
+    if (!vec0_has_ivf_index(p, i)) {
+      continue;
+    }
+    char *zSql = sqlite3_mprintf("DELETE FROM " VEC0_SHADOW_IVF_LISTS_N_NAME
+                                 " WHERE rowid = ?",
+                                 p->schemaName, p->tableName, i);
+    if (!zSql) {
+      return SQLITE_NOMEM;
+    }
+    rc = sqlite3_prepare_v2(p->db, zSql, -1, &stmt, NULL);
+    sqlite3_free(zSql);
+    if (rc != SQLITE_OK) {
+      return rc;
+    }
+    sqlite3_bind_int64(stmt, 1, rowid);
+    rc = sqlite3_step(stmt);
+    sqlite3_finalize(stmt);
+    if (rc != SQLITE_DONE) {
+      return SQLITE_ERROR;
     }
-    array_cleanup(aMetadataIn);
   }
+  return SQLITE_OK;
+}
 
-  sqlite3_free(aMetadataIn);
+struct Vec0IvfTrainingSample {
+  struct VectorColumnDefinition *column;
+  // capacity * dimensions float32 values
+  f32 *data;
+  i64 capacity;
+  i64 length;
+  // number of vectors visited so far
+  i64 seen;
+  u64 seed;
+};
 
-  // On error, knn_data was never assigned to the cursor, so free it here.
-  // On success, it's owned by pCur->knn_data and will be freed by vec0_cursor_clear.
-  if (rc != SQLITE_OK) {
-    vec0_query_knn_data_clear(knn_data);
-    sqlite3_free(knn_data);
+static int vec0_ivf_sample_visit(void *pCtx, i64 rowid, const void *vector) {
+  UNUSED_PARAMETER(rowid);
+  struct Vec0IvfTrainingSample *s = pCtx;
+  size_t dims = s->column->dimensions;
+  // reservoir sampling, so every vector has the same chance to be picked
+  i64 slot = s->seen < s->capacity
+                 ? s->seen
+                 : (i64)(vec0_rand_next(&s->seed) % (u64)(s->seen + 1));
+  s->seen++;
+  if (slot < s->capacity) {
+    vec0_ivf_prepare_vector(s->column, vector, s->data + slot * dims);
+    if (slot == s->length) {
+      s->length++;
+    }
   }
-
-  return rc;
+  return SQLITE_OK;
 }
 
-int vec0Filter_fullscan(vec0_vtab *p, vec0_cursor *pCur) {
-  int rc;
-  char *zSql;
-  struct vec0_query_fullscan_data *fullscan_data;
-
-  fullscan_data = sqlite3_malloc(sizeof(*fullscan_data));
-  if (!fullscan_data) {
+/**
+ * @brief k-means over n float32 vectors, with k-means++ initialization.
+ * Centroids of lists that end up empty are re-seeded with a random vector.
+ */
+static int vec0_ivf_kmeans(const f32 *data, i64 n, size_t dims, int k,
+                           int normalize, u64 *seed, f32 *centroids) {
+  // squared distance of every vector to its nearest initial centroid
+  double *nearest = sqlite3_malloc64(n * sizeof(double));
+  double *sums = sqlite3_malloc64(k * dims * sizeof(double));
+  i64 *counts = sqlite3_malloc64(k * sizeof(i64));
+  if (!nearest || !sums || !counts) {
+    sqlite3_free(nearest);
+    sqlite3_free(sums);
+    sqlite3_free(counts);
     return SQLITE_NOMEM;
   }
-  memset(fullscan_data, 0, sizeof(*fullscan_data));
 
-  zSql = sqlite3_mprintf(" SELECT rowid "
-                         " FROM " VEC0_SHADOW_ROWIDS_NAME
-                         " ORDER by chunk_id, chunk_offset ",
-                         p->schemaName, p->tableName);
-  if (!zSql) {
-    rc = SQLITE_NOMEM;
-    goto error;
-  }
-  rc = sqlite3_prepare_v2(p->db, zSql, -1, &fullscan_data->rowids_stmt, NULL);
-  sqlite3_free(zSql);
-  if (rc != SQLITE_OK) {
-    // IMP: V09901_26739
-    vtab_set_error(&p->base, "Error preparing rowid scan: %s",
-                   sqlite3_errmsg(p->db));
-    goto error;
+  // k-means++: each next centroid is picked with probability proportional to
+  // its squared distance to the already picked ones
+  i64 picked = (i64)(vec0_rand_next(seed) % (u64)n);
+  for (int c = 0; c < k; c++) {
+    const f32 *centroid = data + picked * dims;
+    memcpy(centroids + c * dims, centroid, dims * sizeof(f32));
+    double total = 0.0;
+    for (i64 i = 0; i < n; i++) {
+      double d = distance_l2_sqr_float(data + i * dims, centroid, &dims);
+      d = d * d;
+      if (c == 0 || d < nearest[i]) {
+        nearest[i] = d;
+      }
+      total += nearest[i];
+    }
+    double target =
+        (double)(vec0_rand_next(seed) >> 11) / 9007199254740992.0 * total;
+    picked = (i64)(vec0_rand_next(seed) % (u64)n);
+    if (total > 0.0) {
+      for (i64 i = 0; i < n; i++) {
+        target -= nearest[i];
+        if (target < 0.0 && nearest[i] > 0.0) {
+          picked = i;
+          break;
+        }
+      }
+    }
   }
 
-  rc = sqlite3_step(fullscan_data->rowids_stmt);
-
-  // DONE when there's no rowids, ROW when there are, both "success"
-  if (!(rc == SQLITE_ROW || rc == SQLITE_DONE)) {
-    goto error;
+  for (int iteration = 0; iteration < SQLITE_VEC_IVF_TRAINING_ITERATIONS;
+       iteration++) {
+    memset(sums, 0, k * dims * sizeof(double));
+    memset(counts, 0, k * sizeof(i64));
+    for (i64 i = 0; i < n; i++) {
+      const f32 *v = data + i * dims;
+      int list_id = vec0_ivf_nearest_list(centroids, k, dims, v);
+      counts[list_id]++;
+      for (size_t d = 0; d < dims; d++) {
+        sums[list_id * dims + d] += v[d];
+      }
+    }
+    for (int c = 0; c < k; c++) {
+      f32 *centroid = centroids + c * dims;
+      if (counts[c] == 0) {
+        i64 j = (i64)(vec0_rand_next(seed) % (u64)n);
+        memcpy(centroid, data + j * dims, dims * sizeof(f32));
+        continue;
+      }
+      double norm = 0.0;
+      for (size_t d = 0; d < dims; d++) {
+        centroid[d] = (f32)(sums[c * dims + d] / counts[c]);
+        norm += (double)centroid[d] * centroid[d];
+      }
+      if (normalize && norm > 0.0) {
+        for (size_t d = 0; d < dims; d++) {
+          centroid[d] = (f32)(centroid[d] / sqrt(norm));
+        }
+      }
+    }
   }
 
-  fullscan_data->done = rc == SQLITE_DONE;
-  pCur->query_plan = VEC0_QUERY_PLAN_FULLSCAN;
-  pCur->fullscan_data = fullscan_data;
+  sqlite3_free(nearest);
+  sqlite3_free(sums);
+  sqlite3_free(counts);
   return SQLITE_OK;
+}
 
-error:
-  vec0_query_fullscan_data_clear(fullscan_data);
-  sqlite3_free(fullscan_data);
-  return rc;
+struct Vec0IvfAssignment {
+  struct VectorColumnDefinition *column;
+  struct Vec0IvfCentroids *centroids;
+  sqlite3_stmt *stmtInsert;
+  f32 *buffer;
+};
+
+static int vec0_ivf_assign_visit(void *pCtx, i64 rowid, const void *vector) {
+  struct Vec0IvfAssignment *a = pCtx;
+  vec0_ivf_prepare_vector(a->column, vector, a->buffer);
+  int list_id = vec0_ivf_nearest_list(a->centroids->centroids,
+                                      a->centroids->nlist,
+                                      a->column->dimensions, a->buffer);
+  sqlite3_reset(a->stmtInsert);
+  sqlite3_bind_int64(a->stmtInsert, 1, rowid);
+  sqlite3_bind_int(a->stmtInsert, 2, list_id);
+  if (sqlite3_step(a->stmtInsert) != SQLITE_DONE) {
+    return SQLITE_ERROR;
+  }
+  return SQLITE_OK;
 }
 
-int vec0Filter_point(vec0_cursor *pCur, vec0_vtab *p, int argc,
-                     sqlite3_value **argv) {
+/**
+ * @brief (Re-)train the IVF index of a vector column: k-means over a sample
+ * of the stored vectors, then re-assign every row to its nearest centroid.
+ * Called from the 'optimize' command.
+ *
+ * @param p vec0 table
+ * @param vector_column_idx IVF vector column
+ * @return int SQLITE_OK on success, error code otherwise
+ */
+int vec0_ivf_train(vec0_vtab *p, int vector_column_idx) {
   int rc;
-  assert(argc == 1);
-  i64 rowid;
-  struct vec0_query_point_data *point_data = NULL;
+  struct VectorColumnDefinition *column = &p->vector_columns[vector_column_idx];
+  size_t dims = column->dimensions;
+  struct Vec0IvfTrainingSample sample;
+  struct Vec0IvfAssignment assignment;
+  struct Vec0IvfCentroids *centroids;
+  f32 *trained = NULL;
+  sqlite3_stmt *stmt = NULL;
+  char *zSql;
+  memset(&sample, 0, sizeof(sample));
+  memset(&assignment, 0, sizeof(assignment));
 
-  point_data = sqlite3_malloc(sizeof(*point_data));
-  if (!point_data) {
+  sample.column = column;
+  sample.seed = 0x5EED0000ULL + vector_column_idx;
+  sample.capacity = (i64)column->ivf.nlist * VEC0_IVF_TRAINING_SAMPLES_PER_LIST;
+  if (sample.capacity > SQLITE_VEC_IVF_MAX_TRAINING_SAMPLES) {
+    sample.capacity = SQLITE_VEC_IVF_MAX_TRAINING_SAMPLES;
+  }
+  if (sample.capacity < column->ivf.nlist) {
+    sample.capacity = column->ivf.nlist;
+  }
+  sample.data = sqlite3_malloc64(sample.capacity * dims * sizeof(f32));
+  if (!sample.data) {
     rc = SQLITE_NOMEM;
-    goto error;
+    goto done;
+  }
+  rc = vec0_scan_vectors(p, vector_column_idx, vec0_ivf_sample_visit, &sample);
+  if (rc != SQLITE_OK) {
+    goto done;
   }
-  memset(point_data, 0, sizeof(*point_data));
 
-  if (p->pkIsText) {
-    rc = vec0_rowid_from_id(p, argv[0], &rowid);
-    if (rc == SQLITE_EMPTY) {
-      goto eof;
+  // small tables get one list per vector at most
+  int nlist = column->ivf.nlist;
+  if (sample.length < nlist) {
+    nlist = (int)sample.length;
+  }
+  if (nlist > 0) {
+    trained = sqlite3_malloc64(nlist * dims * sizeof(f32));
+    if (!trained) {
+      rc = SQLITE_NOMEM;
+      goto done;
     }
+    rc = vec0_ivf_kmeans(sample.data, sample.length, dims, nlist,
+                         column->distance_metric == VEC0_DISTANCE_METRIC_COSINE,
+                         &sample.seed, trained);
     if (rc != SQLITE_OK) {
-      goto error;
+      goto done;
     }
-  } else {
-    rowid = sqlite3_value_int64(argv[0]);
   }
 
-  for (int i = 0; i < p->numVectorColumns; i++) {
-    rc = vec0_get_vector_data(p, rowid, i, &point_data->vectors[i], NULL);
-    if (rc == SQLITE_EMPTY) {
-      goto eof;
+  const char *azReset[] = {
+      "DELETE FROM " VEC0_SHADOW_IVF_CENTROIDS_N_NAME,
+      "DELETE FROM " VEC0_SHADOW_IVF_LISTS_N_NAME,
+  };
+  for (size_t i = 0; i < sizeof(azReset) / sizeof(azReset[0]); i++) {
+    zSql = sqlite3_mprintf(azReset[i], p->schemaName, p->tableName,
+                           vector_column_idx);
+    if (!zSql) {
+      rc = SQLITE_NOMEM;
+      goto done;
     }
+    rc = sqlite3_prepare_v2(p->db, zSql, -1, &stmt, NULL);
+    sqlite3_free(zSql);
     if (rc != SQLITE_OK) {
-      goto error;
+      goto done;
     }
-  }
-
-  point_data->rowid = rowid;
-  point_data->done = 0;
-  pCur->point_data = point_data;
-  pCur->query_plan = VEC0_QUERY_PLAN_POINT;
-  return SQLITE_OK;
+    if (sqlite3_step(stmt) != SQLITE_DONE) {
+      rc = SQLITE_ERROR;
+      goto done;
+    }
+    sqlite3_finalize(stmt);
+    stmt = NULL;
+  }
 
-eof:
-  point_data->rowid = rowid;
-  point_data->done = 1;
-  pCur->point_data = point_data;
-  pCur->query_plan = VEC0_QUERY_PLAN_POINT;
-  return SQLITE_OK;
+  zSql = sqlite3_mprintf("INSERT INTO " VEC0_SHADOW_IVF_CENTROIDS_N_NAME
+                         "(rowid, centroid) VALUES (?, ?)",
+                         p->schemaName, p->tableName, vector_column_idx);
+  if (!zSql) {
+    rc = SQLITE_NOMEM;
+    goto done;
+  }
+  rc = sqlite3_prepare_v2(p->db, zSql, -1, &stmt, NULL);
+  sqlite3_free(zSql);
+  if (rc != SQLITE_OK) {
+    goto done;
+  }
+  for (int i = 0; i < nlist; i++) {
+    sqlite3_reset(stmt);
+    sqlite3_bind_int(stmt, 1, i);
+    sqlite3_bind_blob(stmt, 2, trained + i * dims, dims * sizeof(f32),
+                      SQLITE_STATIC);
+    if (sqlite3_step(stmt) != SQLITE_DONE) {
+      rc = SQLITE_ERROR;
+      goto done;
+    }
+  }
+  sqlite3_finalize(stmt);
+  stmt = NULL;
 
-error:
-  vec0_query_point_data_clear(point_data);
-  sqlite3_free(point_data);
-  return rc;
-}
+  // bump the generation, so cached centroids of any connection are reloaded
+  zSql = sqlite3_mprintf(
+      "INSERT OR REPLACE INTO " VEC0_SHADOW_INFO_NAME "(key, value) "
+      "SELECT 'IVF_GENERATION_%02d', coalesce(max(value), 0) + 1 FROM "
+      VEC0_SHADOW_INFO_NAME " WHERE key = 'IVF_GENERATION_%02d'",
+      p->schemaName, p->tableName, vector_column_idx, p->schemaName,
+      p->tableName, vector_column_idx);
+  if (!zSql) {
+    rc = SQLITE_NOMEM;
+    goto done;
+  }
+  rc = sqlite3_prepare_v2(p->db, zSql, -1, &stmt, NULL);
+  sqlite3_free(zSql);
+  if (rc != SQLITE_OK) {
+    goto done;
+  }
+  if (sqlite3_step(stmt) != SQLITE_DONE) {
+    rc = SQLITE_ERROR;
+    goto done;
+  }
+  sqlite3_finalize(stmt);
+  stmt = NULL;
 
-static int vec0Filter(sqlite3_vtab_cursor *pVtabCursor, int idxNum,
-                      const char *idxStr, int argc, sqlite3_value **argv) {
-  vec0_vtab *p = (vec0_vtab *)pVtabCursor->pVtab;
-  vec0_cursor *pCur = (vec0_cursor *)pVtabCursor;
-  vec0_cursor_clear(pCur);
+  rc = vec0_ivf_load_centroids(p, vector_column_idx, &centroids);
+  if (rc != SQLITE_OK || centroids->nlist == 0) {
+    goto done;
+  }
 
-  int idxStrLength = strlen(idxStr);
-  if(idxStrLength <= 0) {
-    return SQLITE_ERROR;
+  zSql = sqlite3_mprintf("INSERT INTO " VEC0_SHADOW_IVF_LISTS_N_NAME
+                         "(rowid, list_id) VALUES (?, ?)",
+                         p->schemaName, p->tableName, vector_column_idx);
+  if (!zSql) {
+    rc = SQLITE_NOMEM;
+    goto done;
   }
-  if((idxStrLength-1) % 4 != 0) {
-    return SQLITE_ERROR;
+  rc = sqlite3_prepare_v2(p->db, zSql, -1, &assignment.stmtInsert, NULL);
+  sqlite3_free(zSql);
+  if (rc != SQLITE_OK) {
+    goto done;
   }
-  int numValueEntries = (idxStrLength-1) / 4;
-  if(numValueEntries != argc) {
-    return SQLITE_ERROR;
+  assignment.column = column;
+  assignment.centroids = centroids;
+  assignment.buffer = sqlite3_malloc64(dims * sizeof(f32));
+  if (!assignment.buffer) {
+    rc = SQLITE_NOMEM;
+    goto done;
   }
+  rc = vec0_scan_vectors(p, vector_column_idx, vec0_ivf_assign_visit,
+                         &assignment);
 
-  char query_plan = idxStr[0];
-  switch(query_plan) {
-    case VEC0_QUERY_PLAN_FULLSCAN:
-      return vec0Filter_fullscan(p, pCur);
-    case VEC0_QUERY_PLAN_KNN:
-      return vec0Filter_knn(pCur, p, idxNum, idxStr, argc, argv);
-    case VEC0_QUERY_PLAN_POINT:
-      return vec0Filter_point(pCur, p, argc, argv);
-    default:
-      vtab_set_error(pVtabCursor->pVtab, "unknown idxStr '%s'", idxStr);
-      return SQLITE_ERROR;
+done:
+  if (rc != SQLITE_OK && rc != SQLITE_NOMEM) {
+    vtab_set_error(&p->base, "could not train IVF index of the \"%.*s\" column",
+                   column->name_length, column->name);
   }
+  sqlite3_finalize(stmt);
+  sqlite3_finalize(assignment.stmtInsert);
+  sqlite3_free(assignment.buffer);
+  sqlite3_free(sample.data);
+  sqlite3_free(trained);
+  return rc;
 }
 
-static int vec0Rowid(sqlite3_vtab_cursor *cur, sqlite_int64 *pRowid) {
-  vec0_cursor *pCur = (vec0_cursor *)cur;
-  switch (pCur->query_plan) {
-  case VEC0_QUERY_PLAN_FULLSCAN: {
-    *pRowid = sqlite3_column_int64(pCur->fullscan_data->rowids_stmt, 0);
-    return SQLITE_OK;
-  }
-  case VEC0_QUERY_PLAN_POINT: {
-    *pRowid = pCur->point_data->rowid;
-    return SQLITE_OK;
+/**
+ * @brief Select the KNN candidates of an IVF vector column: every row in the
+ * nprobe lists nearest to the query vector.
+ *
+ * @param p vec0 table
+ * @param vector_column_idx IVF vector column
+ * @param queryVector query vector, float32 or int8
+ * @param nprobe number of lists to probe
+ * @param out candidate set, or NULL when every row has to be scanned instead
+ * (untrained index, or nprobe covers every list)
+ * @return int SQLITE_OK on success, error code otherwise
+ */
+int vec0_ivf_candidates(vec0_vtab *p, int vector_column_idx,
+                        const void *queryVector, int nprobe,
+                        struct Vec0ChunkCandidates **out) {
+  int rc;
+  struct VectorColumnDefinition *column = &p->vector_columns[vector_column_idx];
+  struct Vec0IvfCentroids *centroids;
+  struct Vec0IvfListDistance *lists = NULL;
+  struct Array positions;
+  sqlite3_stmt *stmt = NULL;
+  f32 *q = NULL;
+  memset(&positions, 0, sizeof(positions));
+  *out = NULL;
+
+  rc = vec0_ivf_load_centroids(p, vector_column_idx, &centroids);
+  if (rc != SQLITE_OK || centroids->nlist == 0 || nprobe >= centroids->nlist) {
+    return rc;
   }
-  case VEC0_QUERY_PLAN_KNN: {
-    vtab_set_error(cur->pVtab,
-                   "Internal sqlite-vec error: expected point query plan in "
-                   "vec0Rowid, found %d",
-                   pCur->query_plan);
-    return SQLITE_ERROR;
+
+  q = sqlite3_malloc64(column->dimensions * sizeof(f32));
+  lists = sqlite3_malloc64(centroids->nlist * sizeof(*lists));
+  if (!q || !lists) {
+    rc = SQLITE_NOMEM;
+    goto done;
   }
+  vec0_ivf_prepare_vector(column, queryVector, q);
+  for (int i = 0; i < centroids->nlist; i++) {
+    lists[i].list_id = i;
+    lists[i].distance = distance_l2_sqr_float(
+        q, centroids->centroids + i * column->dimensions, &column->dimensions);
   }
-  return SQLITE_ERROR;
-}
+  qsort(lists, centroids->nlist, sizeof(*lists), vec0_cmp_ivf_list_distance);
 
-static int vec0Next(sqlite3_vtab_cursor *cur) {
-  vec0_cursor *pCur = (vec0_cursor *)cur;
-  switch (pCur->query_plan) {
-  case VEC0_QUERY_PLAN_FULLSCAN: {
-    if (!pCur->fullscan_data) {
-      return SQLITE_ERROR;
-    }
-    int rc = sqlite3_step(pCur->fullscan_data->rowids_stmt);
-    if (rc == SQLITE_DONE) {
-      pCur->fullscan_data->done = 1;
-      return SQLITE_OK;
+  char *zSql = sqlite3_mprintf(
+      "SELECT r.chunk_id, r.chunk_offset FROM " VEC0_SHADOW_IVF_LISTS_N_NAME
+      " AS l JOIN " VEC0_SHADOW_ROWIDS_NAME " AS r ON r.rowid = l.rowid"
+      " WHERE l.list_id = ?",
+      p->schemaName, p->tableName, vector_column_idx, p->schemaName,
+      p->tableName);
+  if (!zSql) {
+    rc = SQLITE_NOMEM;
+    goto done;
+  }
+  rc = sqlite3_prepare_v2(p->db, zSql, -1, &stmt, NULL);
+  sqlite3_free(zSql);
+  if (rc != SQLITE_OK) {
+    goto done;
+  }
+  rc = array_init(&positions, sizeof(i64) * 2, 256);
+  if (rc != SQLITE_OK) {
+    goto done;
+  }
+  for (int i = 0; i < nprobe; i++) {
+    sqlite3_reset(stmt);
+    sqlite3_bind_int(stmt, 1, lists[i].list_id);
+    while ((rc = sqlite3_step(stmt)) == SQLITE_ROW) {
+      i64 position[2] = {sqlite3_column_int64(stmt, 0),
+                         sqlite3_column_int64(stmt, 1)};
+      rc = array_append(&positions, position);
+      if (rc != SQLITE_OK) {
+        goto done;
+      }
     }
-    if (rc == SQLITE_ROW) {
-      return SQLITE_OK;
+    if (rc != SQLITE_DONE) {
+      goto done;
     }
-    return SQLITE_ERROR;
   }
-  case VEC0_QUERY_PLAN_KNN: {
-    if (!pCur->knn_data) {
-      return SQLITE_ERROR;
-    }
+  rc = vec0_chunk_candidates_build(p, &positions, out);
 
-    pCur->knn_data->current_idx++;
-    return SQLITE_OK;
-  }
-  case VEC0_QUERY_PLAN_POINT: {
-    if (!pCur->point_data) {
-      return SQLITE_ERROR;
-    }
-    pCur->point_data->done = 1;
-    return SQLITE_OK;
+done:
+  sqlite3_finalize(stmt);
+  array_cleanup(&positions);
+  sqlite3_free(lists);
+  sqlite3_free(q);
+  return rc;
+}
+
+// Number of vec0_metadata_constraint_rank() values
+#define VEC0_METADATA_CONSTRAINT_RANKS 12
+
+/**
+ * @brief Estimated cost of a metadata constraint, for the order in which
+ * vec0_chunk_filter_bitmap() evaluates them: equality and IN lists usually
+ * keep the fewest rows, then LIKE/GLOB and ranges, then != and IS NOT NULL.
+ * Within each, BOOLEAN chunks are the smallest reads, TEXT the largest.
+ *
+ * @return int a rank in [0, VEC0_METADATA_CONSTRAINT_RANKS), lowest first
+ */
+static int vec0_metadata_constraint_rank(vec0_vtab *p, int metadata_idx,
+                                         vec0_metadata_operator op) {
+  int selectivity;
+  switch (op) {
+  case VEC0_METADATA_OPERATOR_EQ:
+  case VEC0_METADATA_OPERATOR_IS:
+  case VEC0_METADATA_OPERATOR_IN:
+  case VEC0_METADATA_OPERATOR_ISNULL:
+    selectivity = 0;
+    break;
+  case VEC0_METADATA_OPERATOR_LIKE:
+  case VEC0_METADATA_OPERATOR_GLOB:
+    selectivity = 1;
+    break;
+  case VEC0_METADATA_OPERATOR_GT:
+  case VEC0_METADATA_OPERATOR_GE:
+  case VEC0_METADATA_OPERATOR_LT:
+  case VEC0_METADATA_OPERATOR_LE:
+    selectivity = 2;
+    break;
+  default:
+    selectivity = 3;
+    break;
   }
+  int cost;
+  switch (p->metadata_columns[metadata_idx].kind) {
+  case VEC0_METADATA_COLUMN_KIND_BOOLEAN:
+    cost = 0;
+    break;
+  case VEC0_METADATA_COLUMN_KIND_TEXT:
+    cost = 2;
+    break;
+  default:
+    cost = 1;
+    break;
   }
-  return SQLITE_ERROR;
+  return selectivity * 3 + cost;
 }
 
-static int vec0Eof(sqlite3_vtab_cursor *cur) {
-  vec0_cursor *pCur = (vec0_cursor *)cur;
-  switch (pCur->query_plan) {
-  case VEC0_QUERY_PLAN_FULLSCAN: {
-    if (!pCur->fullscan_data) {
-      return 1;
+/**
+ * @brief Compute which rows of a chunk pass the non-distance filters of a KNN
+ * query: the chunk's validity bitmap, `rowid in (...)` and metadata column
+ * constraints. Partition key constraints are applied by vec0_chunks_iter().
+ *
+ * Metadata constraints run in vec0_metadata_constraint_rank() order, each one
+ * only over the bytes of b that still have rows, and none once b is empty.
+ *
+ * @param p vec0 table
+ * @param chunk_id chunk to filter
+ * @param chunkValidity validity bitmap of the chunk
+ * @param chunkRowids rowids of the chunk
+ * @param arrayRowidsIn sorted `rowid in (...)` values, NULL if none
+ * @param aMetadataIn `xxx in (...)` metadata values, NULL if none
+ * @param metadataBlobs one handle per metadata column, opened on first use and
+ * re-used across calls. The caller must close them.
+ * @param metadataData the metadata values of a chunk kept in memory, one per
+ * metadata column in the layout of its chunks, used instead of metadataBlobs.
+ * NULL for chunks of the shadow tables.
+ * @param bmScratch chunk_size bitmap used as scratch space
+ * @param b output chunk_size bitmap of the rows passing every filter
+ * @return int SQLITE_OK on success, error code otherwise
+ */
+int vec0_chunk_filter_bitmap(vec0_vtab *p, i64 chunk_id, u8 *chunkValidity,
+                             i64 *chunkRowids, struct Array *arrayRowidsIn,
+                             struct Array *aMetadataIn, const char *idxStr,
+                             int argc, sqlite3_value **argv,
+                             sqlite3_blob **metadataBlobs, u8 **metadataData,
+                             u8 *bmScratch, u8 *b) {
+  int rc;
+  bitmap_copy(b, chunkValidity, p->chunk_size);
+  if (arrayRowidsIn) {
+    bitmap_clear(bmScratch, p->chunk_size);
+
+    for (int i = 0; i < p->chunk_size; i++) {
+      if (!bitmap_get(chunkValidity, i)) {
+        continue;
+      }
+      i64 rowid = chunkRowids[i];
+      void *in = bsearch(&rowid, arrayRowidsIn->z, arrayRowidsIn->length,
+                         sizeof(i64), _cmp);
+      bitmap_set(bmScratch, i, in ? 1 : 0);
     }
-    return pCur->fullscan_data->done;
+    bitmap_and_inplace(b, bmScratch, p->chunk_size);
   }
-  case VEC0_QUERY_PLAN_KNN: {
-    if (!pCur->knn_data) {
-      return 1;
+
+  // cheapest and most selective constraints first, so the later ones only
+  // read the parts of their chunks that still have rows, in argv order
+  // within a rank
+  for(int pass = 0; pass < VEC0_METADATA_CONSTRAINT_RANKS * argc; pass++) {
+    int rank = pass / argc;
+    int i = pass % argc;
+    int idx = 1 + (i * 4);
+    if(idxStr[idx + 0] != VEC0_IDXSTR_KIND_METADATA_CONSTRAINT) {
+      continue;
     }
-    // return (pCur->knn_data->current_idx >= pCur->knn_data->k) ||
-    // (pCur->knn_data->distances[pCur->knn_data->current_idx] == FLT_MAX);
-    return (pCur->knn_data->current_idx >= pCur->knn_data->k_used);
-  }
-  case VEC0_QUERY_PLAN_POINT: {
-    if (!pCur->point_data) {
-      return 1;
+    int metadata_idx = idxStr[idx + 1] - 'A';
+    int operator = idxStr[idx + 2];
+    if(vec0_metadata_constraint_rank(p, metadata_idx, operator) != rank) {
+      continue;
     }
-    return pCur->point_data->done;
+    int lo, hi;
+    if(!bitmap_span(b, p->chunk_size, &lo, &hi)) {
+      // no row left, the other constraints don't need to be read
+      break;
+    }
+
+    u8 *data = metadataData ? metadataData[metadata_idx] : NULL;
+    if(!data && !metadataBlobs[metadata_idx]) {
+      rc = sqlite3_blob_open(p->db, p->schemaName, p->shadowMetadataChunksNames[metadata_idx], "data", chunk_id, 0, &metadataBlobs[metadata_idx]);
+      if(rc != SQLITE_OK) {
+        vtab_set_error(&p->base, "Could not open metadata blob");
+        return rc;
+      }
+    }
+
+    bitmap_clear(bmScratch, p->chunk_size);
+    rc = vec0_set_metadata_filter_bitmap(p, metadata_idx, operator, argv[i], metadataBlobs[metadata_idx], data, chunk_id, chunkRowids, b, bmScratch, p->chunk_size, aMetadataIn, i);
+    if(rc != SQLITE_OK) {
+      vtab_set_error(&p->base, "Could not filter metadata fields");
+      return rc;
+    }
+    bitmap_and_inplace(b, bmScratch, p->chunk_size);
   }
+
+  // `filter = '...'` expressions, compiled in aMetadataIn
+  for(int i = 0; i < argc && aMetadataIn; i++) {
+    if(idxStr[1 + (i * 4)] != VEC0_IDXSTR_KIND_KNN_FILTER) {
+      continue;
+    }
+    int lo, hi;
+    if(!bitmap_span(b, p->chunk_size, &lo, &hi)) {
+      break;
+    }
+    for(size_t j = 0; j < aMetadataIn->length; j++) {
+      struct Vec0MetadataIn *item = &((struct Vec0MetadataIn *) aMetadataIn->z)[j];
+      if(item->argv_idx != i) {
+        continue;
+      }
+      rc = vec0_filter_eval(p, item->program, chunk_id, chunkRowids, metadataBlobs, metadataData, b);
+      if(rc != SQLITE_OK) {
+        return rc;
+      }
+    }
   }
-  return 1;
+  return SQLITE_OK;
 }
 
-static int vec0Column_fullscan(vec0_vtab *pVtab, vec0_cursor *pCur,
-                               sqlite3_context *context, int i) {
-  if (!pCur->fullscan_data) {
-    sqlite3_result_error(
-        context, "Internal sqlite-vec error: fullscan_data is NULL.", -1);
-    return SQLITE_ERROR;
+// -1, 0 or 1 as a zone map bound is below, equal to or above a target value
+static int vec0_zone_cmp_i64(sqlite3_stmt *stmt, int iCol, i64 target) {
+  i64 x = sqlite3_column_int64(stmt, iCol);
+  return (x > target) - (x < target);
+}
+
+static int vec0_zone_cmp_f64(sqlite3_stmt *stmt, int iCol, double target) {
+  double x = sqlite3_column_double(stmt, iCol);
+  return (x > target) - (x < target);
+}
+
+static int vec0_zone_cmp_text(sqlite3_stmt *stmt, int iCol, const char *target,
+                              int nTarget) {
+  const char *x = (const char *)sqlite3_column_text(stmt, iCol);
+  int n = sqlite3_column_bytes(stmt, iCol);
+  int cmp = memcmp(x, target, min(n, nTarget));
+  if (cmp == 0) {
+    cmp = n - nTarget;
   }
-  i64 rowid = sqlite3_column_int64(pCur->fullscan_data->rowids_stmt, 0);
-  if (i == VEC0_COLUMN_ID) {
-    return vec0_result_id(pVtab, context, rowid);
+  return (cmp > 0) - (cmp < 0);
+}
+
+/**
+ * @brief Whether no value in a zone can pass a comparison, given how its lo
+ * and hi bounds compare to the target.
+ */
+static int vec0_zone_excludes(vec0_metadata_operator op, int cmpLo, int cmpHi) {
+  switch (op) {
+  case VEC0_METADATA_OPERATOR_EQ:
+  case VEC0_METADATA_OPERATOR_IS:
+    return cmpLo > 0 || cmpHi < 0;
+  case VEC0_METADATA_OPERATOR_NE:
+  case VEC0_METADATA_OPERATOR_ISNOT:
+    return cmpLo == 0 && cmpHi == 0;
+  case VEC0_METADATA_OPERATOR_GT:
+    return cmpHi <= 0;
+  case VEC0_METADATA_OPERATOR_GE:
+    return cmpHi < 0;
+  case VEC0_METADATA_OPERATOR_LT:
+    return cmpLo >= 0;
+  case VEC0_METADATA_OPERATOR_LE:
+    return cmpLo > 0;
+  default:
+    return 0;
   }
-  else if (vec0_column_idx_is_vector(pVtab, i)) {
-    void *v;
-    int sz;
-    int vector_idx = vec0_column_idx_to_vector_idx(pVtab, i);
-    int rc = vec0_get_vector_data(pVtab, rowid, vector_idx, &v, &sz);
-    if (rc != SQLITE_OK) {
-      return rc;
+}
+
+/**
+ * @brief Check the metadata constraints of a query against the zone maps of a
+ * chunk, to skip chunks where no row can pass before any of their blobs are
+ * read. Only tables with `chunk_summaries=true` keep zone maps.
+ *
+ * @param p vec0 table
+ * @param chunk_id chunk to check
+ * @param aMetadataIn `xxx in (...)` metadata values, NULL if none
+ * @param stmtZones one statement per metadata column, prepared on first use
+ * and re-used across calls. The caller must finalize them.
+ * @param skip set to 1 if the chunk can be skipped, 0 otherwise
+ * @return int SQLITE_OK on success, error code otherwise
+ */
+int vec0_chunk_zones_skip(vec0_vtab *p, i64 chunk_id, const char *idxStr,
+                          int argc, sqlite3_value **argv,
+                          struct Array *aMetadataIn, sqlite3_stmt **stmtZones,
+                          int *skip) {
+  int rc;
+  *skip = 0;
+  for (int i = 0; i < argc && !*skip; i++) {
+    int idx = 1 + (i * 4);
+    if (idxStr[idx + 0] != VEC0_IDXSTR_KIND_METADATA_CONSTRAINT) {
+      continue;
+    }
+    int metadata_idx = idxStr[idx + 1] - 'A';
+    vec0_metadata_operator op = idxStr[idx + 2];
+    if (op == VEC0_METADATA_OPERATOR_ISNULL) {
+      // metadata columns don't support NULL
+      *skip = 1;
+      break;
+    }
+    if (op == VEC0_METADATA_OPERATOR_LIKE ||
+        op == VEC0_METADATA_OPERATOR_GLOB ||
+        op == VEC0_METADATA_OPERATOR_ISNOTNULL) {
+      continue;
     }
-    sqlite3_result_blob(context, v, sz, sqlite3_free);
-    sqlite3_result_subtype(context,
-                           pVtab->vector_columns[vector_idx].element_type);
 
-  }
-  else if (i == vec0_column_distance_idx(pVtab)) {
-    sqlite3_result_null(context);
-  }
-  else if(vec0_column_idx_is_partition(pVtab, i)) {
-    int partition_idx = vec0_column_idx_to_partition_idx(pVtab, i);
-    sqlite3_value * v;
-    int rc = vec0_get_partition_value_for_rowid(pVtab, rowid, partition_idx, &v);
-    if(rc == SQLITE_OK) {
-      sqlite3_result_value(context, v);
-      sqlite3_value_free(v);
-    }else {
-      sqlite3_result_error_code(context, rc);
+    sqlite3_stmt *stmt = stmtZones[metadata_idx];
+    if (!stmt) {
+      char *zSql = sqlite3_mprintf("SELECT lo, hi FROM "
+                                   VEC0_SHADOW_METADATA_ZONES_N_NAME
+                                   " WHERE rowid = ?",
+                                   p->schemaName, p->tableName, metadata_idx);
+      if (!zSql) {
+        return SQLITE_NOMEM;
+      }
+      rc = sqlite3_prepare_v2(p->db, zSql, -1, &stmtZones[metadata_idx], NULL);
+      sqlite3_free(zSql);
+      if (rc != SQLITE_OK) {
+        vtab_set_error(&p->base, "could not prepare zone map query");
+        return rc;
+      }
+      stmt = stmtZones[metadata_idx];
     }
-  }
-  else if(vec0_column_idx_is_auxiliary(pVtab, i)) {
-    int auxiliary_idx = vec0_column_idx_to_auxiliary_idx(pVtab, i);
-    sqlite3_value * v;
-    int rc = vec0_get_auxiliary_value_for_rowid(pVtab, rowid, auxiliary_idx, &v);
-    if(rc == SQLITE_OK) {
-      sqlite3_result_value(context, v);
-      sqlite3_value_free(v);
-    }else {
-      sqlite3_result_error_code(context, rc);
+    sqlite3_reset(stmt);
+    sqlite3_bind_int64(stmt, 1, chunk_id);
+    rc = sqlite3_step(stmt);
+    if (rc == SQLITE_DONE) {
+      continue;
+    }
+    if (rc != SQLITE_ROW) {
+      vtab_set_error(&p->base, "could not read zone map of chunk %lld",
+                     chunk_id);
+      return SQLITE_ERROR;
+    }
+    // NULL bounds can't rule anything out
+    if (sqlite3_column_type(stmt, 0) == SQLITE_NULL ||
+        sqlite3_column_type(stmt, 1) == SQLITE_NULL) {
+      continue;
     }
-  }
 
-  else if(vec0_column_idx_is_metadata(pVtab, i)) {
-    if(sqlite3_vtab_nochange(context)) {
-      return SQLITE_OK;
+    struct Array *aTarget = NULL;
+    if (op == VEC0_METADATA_OPERATOR_IN ||
+        p->metadata_columns[metadata_idx].kind ==
+            VEC0_METADATA_COLUMN_KIND_DICTIONARY) {
+      for (size_t j = 0; aMetadataIn && j < aMetadataIn->length; j++) {
+        struct Vec0MetadataIn *metadataIn =
+            &((struct Vec0MetadataIn *)aMetadataIn->z)[j];
+        if (metadataIn->argv_idx == i) {
+          aTarget = &metadataIn->array;
+          break;
+        }
+      }
+      if (!aTarget) {
+        continue;
+      }
     }
-    int metadata_idx = vec0_column_idx_to_metadata_idx(pVtab, i);
-    int rc = vec0_result_metadata_value_for_rowid(pVtab, rowid, metadata_idx, context);
-    if(rc != SQLITE_OK) {
-      // IMP: V15466_32305
-      const char * zErr = sqlite3_mprintf(
-        "Could not extract metadata value for column %.*s at rowid %lld",
-        pVtab->metadata_columns[metadata_idx].name_length,
-        pVtab->metadata_columns[metadata_idx].name, rowid
-      );
-      if(zErr) {
-        sqlite3_result_error(context, zErr, -1);
-        sqlite3_free((void *) zErr);
-      }else {
-        sqlite3_result_error_nomem(context);
+
+    switch (p->metadata_columns[metadata_idx].kind) {
+    case VEC0_METADATA_COLUMN_KIND_BOOLEAN: {
+      i64 target = sqlite3_value_int(argv[i]) != 0;
+      *skip = vec0_zone_excludes(op, vec0_zone_cmp_i64(stmt, 0, target),
+                                 vec0_zone_cmp_i64(stmt, 1, target));
+      break;
+    }
+    case VEC0_METADATA_COLUMN_KIND_INTEGER:
+    case VEC0_METADATA_COLUMN_KIND_DICTIONARY: {
+      if (aTarget) {
+        *skip = 1;
+        for (size_t j = 0; j < aTarget->length && *skip; j++) {
+          i64 target = ((i64 *)aTarget->z)[j];
+          *skip = vec0_zone_excludes(VEC0_METADATA_OPERATOR_EQ,
+                                     vec0_zone_cmp_i64(stmt, 0, target),
+                                     vec0_zone_cmp_i64(stmt, 1, target));
+        }
+        break;
+      }
+      i64 target = sqlite3_value_int64(argv[i]);
+      *skip = vec0_zone_excludes(op, vec0_zone_cmp_i64(stmt, 0, target),
+                                 vec0_zone_cmp_i64(stmt, 1, target));
+      break;
+    }
+    case VEC0_METADATA_COLUMN_KIND_FLOAT: {
+      double target = sqlite3_value_double(argv[i]);
+      if (isnan(target)) {
+        break;
+      }
+      *skip = vec0_zone_excludes(op, vec0_zone_cmp_f64(stmt, 0, target),
+                                 vec0_zone_cmp_f64(stmt, 1, target));
+      break;
+    }
+    case VEC0_METADATA_COLUMN_KIND_TEXT: {
+      if (aTarget) {
+        *skip = 1;
+        for (size_t j = 0; j < aTarget->length && *skip; j++) {
+          struct Vec0MetadataInTextEntry *e =
+              &((struct Vec0MetadataInTextEntry *)aTarget->z)[j];
+          *skip = vec0_zone_excludes(VEC0_METADATA_OPERATOR_EQ,
+                                     vec0_zone_cmp_text(stmt, 0, e->zString, e->n),
+                                     vec0_zone_cmp_text(stmt, 1, e->zString, e->n));
+        }
+        break;
+      }
+      const char *target = (const char *)sqlite3_value_text(argv[i]);
+      int nTarget = sqlite3_value_bytes(argv[i]);
+      if (!target) {
+        break;
       }
+      *skip = vec0_zone_excludes(op, vec0_zone_cmp_text(stmt, 0, target, nTarget),
+                                 vec0_zone_cmp_text(stmt, 1, target, nTarget));
+      break;
+    }
     }
   }
-
   return SQLITE_OK;
 }
 
-static int vec0Column_point(vec0_vtab *pVtab, vec0_cursor *pCur,
-                            sqlite3_context *context, int i) {
-  if (!pCur->point_data) {
-    sqlite3_result_error(context,
-                         "Internal sqlite-vec error: point_data is NULL.", -1);
-    return SQLITE_ERROR;
-  }
-  if (i == VEC0_COLUMN_ID) {
-    return vec0_result_id(pVtab, context, pCur->point_data->rowid);
-  }
-  else if (i == vec0_column_distance_idx(pVtab)) {
-    sqlite3_result_null(context);
-    return SQLITE_OK;
-  }
-  else if (vec0_column_idx_is_vector(pVtab, i)) {
-    if (sqlite3_vtab_nochange(context)) {
-      sqlite3_result_null(context);
-      return SQLITE_OK;
-    }
-    int vector_idx = vec0_column_idx_to_vector_idx(pVtab, i);
-    sqlite3_result_blob(
-        context, pCur->point_data->vectors[vector_idx],
-        vector_column_byte_size(pVtab->vector_columns[vector_idx]),
-        SQLITE_TRANSIENT);
-    sqlite3_result_subtype(context,
-                           pVtab->vector_columns[vector_idx].element_type);
-    return SQLITE_OK;
-  }
-  else if(vec0_column_idx_is_partition(pVtab, i)) {
-    if(sqlite3_vtab_nochange(context)) {
-      return SQLITE_OK;
+/**
+ * Compute pairwise distance between two vectors stored in the vec0 table's
+ * native format.  Handles float32, int8, and bit element types with the
+ * appropriate metric (L2, cosine, L1, hamming).
+ */
+static f32 vec0_compute_distance(struct VectorColumnDefinition *vector_column,
+                                 const void *a, const void *b) {
+  size_t dims = vector_column->dimensions;
+  switch (vector_column->element_type) {
+  case SQLITE_VEC_ELEMENT_TYPE_FLOAT32:
+    switch (vector_column->distance_metric) {
+    case VEC0_DISTANCE_METRIC_L2:
+      return distance_l2_sqr_float(a, b, &dims);
+    case VEC0_DISTANCE_METRIC_L1:
+      return (f32)distance_l1_f32(a, b, &dims);
+    case VEC0_DISTANCE_METRIC_COSINE:
+      return distance_cosine_float(a, b, &dims);
     }
-    int partition_idx = vec0_column_idx_to_partition_idx(pVtab, i);
-    i64 rowid = pCur->point_data->rowid;
-    sqlite3_value * v;
-    int rc = vec0_get_partition_value_for_rowid(pVtab, rowid, partition_idx, &v);
-    if(rc == SQLITE_OK) {
-      sqlite3_result_value(context, v);
-      sqlite3_value_free(v);
-    }else {
-      sqlite3_result_error_code(context, rc);
+    break;
+  case SQLITE_VEC_ELEMENT_TYPE_INT8:
+    switch (vector_column->distance_metric) {
+    case VEC0_DISTANCE_METRIC_L2:
+      return distance_l2_sqr_int8(a, b, &dims);
+    case VEC0_DISTANCE_METRIC_L1:
+      return (f32)distance_l1_int8(a, b, &dims);
+    case VEC0_DISTANCE_METRIC_COSINE:
+      return distance_cosine_int8(a, b, &dims);
     }
+    break;
+  case SQLITE_VEC_ELEMENT_TYPE_BIT:
+    return distance_hamming(a, b, &dims);
   }
-  else if(vec0_column_idx_is_auxiliary(pVtab, i)) {
-    if(sqlite3_vtab_nochange(context)) {
-      return SQLITE_OK;
-    }
-    i64 rowid = pCur->point_data->rowid;
-    int auxiliary_idx = vec0_column_idx_to_auxiliary_idx(pVtab, i);
-    sqlite3_value * v;
-    int rc = vec0_get_auxiliary_value_for_rowid(pVtab, rowid, auxiliary_idx, &v);
-    if(rc == SQLITE_OK) {
-      sqlite3_result_value(context, v);
-      sqlite3_value_free(v);
-    }else {
-      sqlite3_result_error_code(context, rc);
+  return 0.0f;
+}
+
+/**
+ * @brief Turns the distances of a chunk's rows on the vector column of a fused
+ * KNN query into their fused distances: scales them by the column's weight,
+ * then adds the weighted distances on every other matched vector column.
+ *
+ * @param b rows of the chunk to compute, the others are left as they are
+ * @param vectors the vectors of a chunk kept in memory, one per vector column,
+ * or NULL to read them from the chunk's blobs
+ * @param buffer scratch space for the chunk_size vectors of any fused column
+ * @param distances chunk_size distances, updated in place
+ */
+static int vec0_knn_fuse_chunk(vec0_vtab *p,
+                               const struct Vec0KnnFusion *fusion,
+                               i64 chunk_id, u8 *b, void **vectors,
+                               void *buffer, f32 *distances) {
+  int rc;
+  for (int i = 0; i < p->chunk_size; i++) {
+    if (bitmap_get(b, i)) {
+      distances[i] *= fusion->weight;
     }
   }
-
-  else if(vec0_column_idx_is_metadata(pVtab, i)) {
-    if(sqlite3_vtab_nochange(context)) {
-      return SQLITE_OK;
+  for (int c = 0; c < fusion->n; c++) {
+    int vectorColumnIdx = fusion->vectorColumnIdxs[c];
+    struct VectorColumnDefinition *column = &p->vector_columns[vectorColumnIdx];
+    i64 vectorSize = vector_column_byte_size(*column);
+    u8 *columnVectors = buffer;
+    if (vectors) {
+      columnVectors = vectors[vectorColumnIdx];
+    } else {
+      sqlite3_blob *blobVectors = NULL;
+      rc = sqlite3_blob_open(p->db, p->schemaName,
+                             p->shadowVectorChunksNames[vectorColumnIdx],
+                             "vectors", chunk_id, 0, &blobVectors);
+      if (rc != SQLITE_OK) {
+        vtab_set_error(&p->base, "could not open vectors blob for chunk %lld",
+                       chunk_id);
+        return SQLITE_ERROR;
+      }
+      i64 size = sqlite3_blob_bytes(blobVectors);
+      if (size != p->chunk_size * vectorSize) {
+        vtab_set_error(
+            &p->base,
+            "vectors blob size doesn't match - expected %lld, found %lld",
+            p->chunk_size * vectorSize, size);
+        sqlite3_blob_close(blobVectors);
+        return SQLITE_ERROR;
+      }
+      rc = sqlite3_blob_read(blobVectors, buffer, size, 0);
+      // blobVectors is always opened with read-only permissions, so this never
+      // fails.
+      sqlite3_blob_close(blobVectors);
+      if (rc != SQLITE_OK) {
+        vtab_set_error(&p->base, "vectors blob read error for %lld", chunk_id);
+        return SQLITE_ERROR;
+      }
     }
-    i64 rowid = pCur->point_data->rowid;
-    int metadata_idx = vec0_column_idx_to_metadata_idx(pVtab, i);
-    int rc = vec0_result_metadata_value_for_rowid(pVtab, rowid, metadata_idx, context);
-    if(rc != SQLITE_OK) {
-      const char * zErr = sqlite3_mprintf(
-        "Could not extract metadata value for column %.*s at rowid %lld",
-        pVtab->metadata_columns[metadata_idx].name_length,
-        pVtab->metadata_columns[metadata_idx].name, rowid
-      );
-      if(zErr) {
-        sqlite3_result_error(context, zErr, -1);
-        sqlite3_free((void *) zErr);
-      }else {
-        sqlite3_result_error_nomem(context);
+    for (int i = 0; i < p->chunk_size; i++) {
+      if (!bitmap_get(b, i)) {
+        continue;
       }
+      distances[i] +=
+          fusion->weights[c] *
+          vec0_compute_distance(column, columnVectors + i * vectorSize,
+                                fusion->queryVectors[c]);
     }
   }
-
   return SQLITE_OK;
 }
 
-static int vec0Column_knn(vec0_vtab *pVtab, vec0_cursor *pCur,
-                          sqlite3_context *context, int i) {
-  if (!pCur->knn_data) {
-    sqlite3_result_error(context,
-                         "Internal sqlite-vec error: knn_data is NULL.", -1);
-    return SQLITE_ERROR;
+/**
+ * Milliseconds from the clock of the default VFS, for KNN time budgets.
+ */
+static sqlite3_int64 vec0_now_ms(void) {
+  sqlite3_vfs *vfs = sqlite3_vfs_find(NULL);
+  sqlite3_int64 now = 0;
+  if (vfs && vfs->iVersion >= 2 && vfs->xCurrentTimeInt64) {
+    vfs->xCurrentTimeInt64(vfs, &now);
+  } else if (vfs && vfs->xCurrentTime) {
+    double julianDay = 0;
+    vfs->xCurrentTime(vfs, &julianDay);
+    now = (sqlite3_int64)(julianDay * 86400000.0);
+  }
+  return now;
+}
+
+/**
+ * Whether two partition key values are the same, NULLs included.
+ */
+static int vec0_value_equals(sqlite3_value *a, sqlite3_value *b) {
+  int type = sqlite3_value_type(a);
+  if (type != sqlite3_value_type(b)) {
+    return 0;
   }
-  if (i == VEC0_COLUMN_ID) {
-    i64 rowid = pCur->knn_data->rowids[pCur->knn_data->current_idx];
-    return vec0_result_id(pVtab, context, rowid);
+  switch (type) {
+  case SQLITE_NULL:
+    return 1;
+  case SQLITE_INTEGER:
+    return sqlite3_value_int64(a) == sqlite3_value_int64(b);
+  case SQLITE_FLOAT:
+    return sqlite3_value_double(a) == sqlite3_value_double(b);
+  default: {
+    int n = sqlite3_value_bytes(a);
+    if (n != sqlite3_value_bytes(b)) {
+      return 0;
+    }
+    const void *za = type == SQLITE_TEXT ? (const void *)sqlite3_value_text(a)
+                                         : sqlite3_value_blob(a);
+    const void *zb = type == SQLITE_TEXT ? (const void *)sqlite3_value_text(b)
+                                         : sqlite3_value_blob(b);
+    return n == 0 || memcmp(za, zb, n) == 0;
   }
-  else if (i == vec0_column_distance_idx(pVtab)) {
-    sqlite3_result_double(
-        context, pCur->knn_data->distances[pCur->knn_data->current_idx]);
-    return SQLITE_OK;
   }
-  else if (vec0_column_idx_is_vector(pVtab, i)) {
-    void *out;
-    int sz;
-    int vector_idx = vec0_column_idx_to_vector_idx(pVtab, i);
-    int rc = vec0_get_vector_data(
-        pVtab, pCur->knn_data->rowids[pCur->knn_data->current_idx], vector_idx,
-        &out, &sz);
+}
+
+/**
+ * Appends the n top k rows of a finished partition to the rows of a
+ * k_per_partition query.
+ */
+static int vec0_knn_group_flush(struct Array *rowids, struct Array *distances,
+                                const i64 *topk_rowids,
+                                const f32 *topk_distances, i64 n) {
+  for (i64 i = 0; i < n; i++) {
+    int rc = array_append(rowids, &topk_rowids[i]);
+    if (rc != SQLITE_OK) {
+      return rc;
+    }
+    rc = array_append(distances, &topk_distances[i]);
     if (rc != SQLITE_OK) {
       return rc;
     }
-    sqlite3_result_blob(context, out, sz, sqlite3_free);
-    sqlite3_result_subtype(context,
-                           pVtab->vector_columns[vector_idx].element_type);
-    return SQLITE_OK;
   }
-  else if(vec0_column_idx_is_partition(pVtab, i)) {
-    int partition_idx = vec0_column_idx_to_partition_idx(pVtab, i);
-    i64 rowid = pCur->knn_data->rowids[pCur->knn_data->current_idx];
-    sqlite3_value * v;
-    int rc = vec0_get_partition_value_for_rowid(pVtab, rowid, partition_idx, &v);
-    if(rc == SQLITE_OK) {
-      sqlite3_result_value(context, v);
-      sqlite3_value_free(v);
-    }else {
-      sqlite3_result_error_code(context, rc);
+  return SQLITE_OK;
+}
+
+// The rows of the _delta table that a KNN query scans as one more chunk, in
+// the layout of a chunk's blobs, see vec0_delta_chunk_load(). Allocated on
+// first use, chunk_size rows each.
+struct Vec0DeltaChunk {
+  u8 *validity;
+  i64 *rowids;
+  void *vectors[VEC0_MAX_VECTOR_COLUMNS];
+  u8 *metadata[VEC0_MAX_METADATA_COLUMNS];
+};
+
+static void vec0_delta_chunk_free(struct Vec0DeltaChunk *delta) {
+  sqlite3_free(delta->validity);
+  sqlite3_free(delta->rowids);
+  for (int i = 0; i < VEC0_MAX_VECTOR_COLUMNS; i++) {
+    sqlite3_free(delta->vectors[i]);
+  }
+  for (int i = 0; i < VEC0_MAX_METADATA_COLUMNS; i++) {
+    sqlite3_free(delta->metadata[i]);
+  }
+  memset(delta, 0, sizeof(*delta));
+}
+
+/**
+ * @brief Read the rows of the _delta table that pass the partition key
+ * constraints of a KNN query into delta, at offsets 0 to n, so they are
+ * filtered and compared like the rows of a chunk. Metadata values are encoded
+ * like vec0_write_metadata_value() does, with their codes for DICTIONARY
+ * columns.
+ *
+ * @param partitionKeyValues only the rows of this partition, for
+ * k_per_partition queries. NULL for the rows of every partition that passes the
+ * constraints.
+ */
+static int vec0_delta_chunk_load(vec0_vtab *p, struct Vec0DeltaChunk *delta,
+                                 sqlite3_value **partitionKeyValues,
+                                 const char *idxStr, int argc,
+                                 sqlite3_value **argv) {
+  int rc;
+  sqlite3_stmt *stmt = NULL;
+
+  if (!delta->validity) {
+    int failed = 0;
+    delta->validity = sqlite3_malloc(p->chunk_size / CHAR_BIT);
+    delta->rowids = sqlite3_malloc64(p->chunk_size * sizeof(i64));
+    failed = !delta->validity || !delta->rowids;
+    for (int i = 0; i < p->numVectorColumns; i++) {
+      i64 size = p->chunk_size * vector_column_byte_size(p->vector_columns[i]);
+      delta->vectors[i] = sqlite3_malloc64(size);
+      failed = failed || !delta->vectors[i];
+      if (delta->vectors[i]) {
+        memset(delta->vectors[i], 0, size);
+      }
+    }
+    for (int i = 0; i < p->numMetadataColumns; i++) {
+      delta->metadata[i] = sqlite3_malloc(vec0_metadata_chunk_size(
+          p->metadata_columns[i].kind, p->chunk_size));
+      failed = failed || !delta->metadata[i];
+    }
+    if (failed) {
+      return SQLITE_NOMEM;
     }
   }
-  else if(vec0_column_idx_is_auxiliary(pVtab, i)) {
-    int auxiliary_idx = vec0_column_idx_to_auxiliary_idx(pVtab, i);
-    i64 rowid = pCur->knn_data->rowids[pCur->knn_data->current_idx];
-    sqlite3_value * v;
-    int rc = vec0_get_auxiliary_value_for_rowid(pVtab, rowid, auxiliary_idx, &v);
-    if(rc == SQLITE_OK) {
-      sqlite3_result_value(context, v);
-      sqlite3_value_free(v);
-    }else {
-      sqlite3_result_error_code(context, rc);
+  memset(delta->validity, 0, p->chunk_size / CHAR_BIT);
+  for (int i = 0; i < p->numMetadataColumns; i++) {
+    memset(delta->metadata[i], 0,
+           vec0_metadata_chunk_size(p->metadata_columns[i].kind,
+                                    p->chunk_size));
+  }
+
+  sqlite3_str *s = sqlite3_str_new(NULL);
+  sqlite3_str_appendall(s, "SELECT rowid");
+  for (int i = 0; i < p->numVectorColumns; i++) {
+    sqlite3_str_appendf(s, ", vector%02d", i);
+  }
+  for (int i = 0; i < p->numMetadataColumns; i++) {
+    if (p->metadata_columns[i].kind == VEC0_METADATA_COLUMN_KIND_DICTIONARY) {
+      sqlite3_str_appendf(s,
+                          ", (SELECT code FROM " VEC0_SHADOW_METADATA_DICT_N_NAME
+                          " WHERE value = metadata%02d)",
+                          p->schemaName, p->tableName, i, i);
+    } else {
+      sqlite3_str_appendf(s, ", metadata%02d", i);
+    }
+  }
+  sqlite3_str_appendf(s, " FROM " VEC0_SHADOW_DELTA_NAME, p->schemaName,
+                      p->tableName);
+  if (partitionKeyValues) {
+    for (int i = 0; i < p->numPartitionColumns; i++) {
+      sqlite3_str_appendf(s, "%s partition%02d IS ?", i ? " AND" : " WHERE",
+                          i);
+    }
+  } else {
+    int appendedWhere = 0;
+    rc = vec0_partition_constraints_append(s, idxStr, argc, argv,
+                                           &appendedWhere);
+    if (rc != SQLITE_OK) {
+      sqlite3_free(sqlite3_str_finish(s));
+      return rc;
+    }
+  }
+  sqlite3_str_appendall(s, " ORDER BY rowid");
+  char *zSql = sqlite3_str_finish(s);
+  if (!zSql) {
+    return SQLITE_NOMEM;
+  }
+  rc = sqlite3_prepare_v2(p->db, zSql, -1, &stmt, NULL);
+  sqlite3_free(zSql);
+  if (rc != SQLITE_OK) {
+    return rc;
+  }
+  int n = 1;
+  if (partitionKeyValues) {
+    for (int i = 0; i < p->numPartitionColumns; i++) {
+      sqlite3_bind_value(stmt, n++, partitionKeyValues[i]);
+    }
+  } else {
+    rc = vec0_partition_constraints_bind(stmt, idxStr, argc, argv, &n);
+    if (rc != SQLITE_OK) {
+      goto done;
+    }
+  }
+
+  int metadataStart = 1 + p->numVectorColumns;
+  i64 i = 0;
+  while ((rc = sqlite3_step(stmt)) == SQLITE_ROW) {
+    i64 rowid = sqlite3_column_int64(stmt, 0);
+    // vec0_delta_insert() merges the delta before it grows past delta_size
+    if (i >= p->chunk_size) {
+      vtab_set_error(&p->base,
+                     VEC_INTERAL_ERROR "delta has more than %d rows",
+                     p->chunk_size);
+      rc = SQLITE_ERROR;
+      goto done;
+    }
+    bitmap_set(delta->validity, i, 1);
+    delta->rowids[i] = rowid;
+    for (int j = 0; j < p->numVectorColumns; j++) {
+      i64 size = vector_column_byte_size(p->vector_columns[j]);
+      if (sqlite3_column_bytes(stmt, 1 + j) != size) {
+        vtab_set_error(&p->base,
+                       VEC_INTERAL_ERROR
+                       "vector of row %lld has the wrong size in the delta",
+                       rowid);
+        rc = SQLITE_ERROR;
+        goto done;
+      }
+      memcpy((u8 *)delta->vectors[j] + i * size,
+             sqlite3_column_blob(stmt, 1 + j), size);
+    }
+    for (int j = 0; j < p->numMetadataColumns; j++) {
+      int iCol = metadataStart + j;
+      u8 *data = delta->metadata[j];
+      switch (p->metadata_columns[j].kind) {
+      case VEC0_METADATA_COLUMN_KIND_BOOLEAN: {
+        if (sqlite3_column_int(stmt, iCol)) {
+          data[i / CHAR_BIT] |= 1 << (i % CHAR_BIT);
+        }
+        break;
+      }
+      case VEC0_METADATA_COLUMN_KIND_INTEGER:
+      case VEC0_METADATA_COLUMN_KIND_DICTIONARY: {
+        i64 value = sqlite3_column_int64(stmt, iCol);
+        memcpy(data + i * sizeof(i64), &value, sizeof(value));
+        break;
+      }
+      case VEC0_METADATA_COLUMN_KIND_FLOAT: {
+        double value = sqlite3_column_double(stmt, iCol);
+        memcpy(data + i * sizeof(double), &value, sizeof(value));
+        break;
+      }
+      case VEC0_METADATA_COLUMN_KIND_TEXT: {
+        const char *z = (const char *)sqlite3_column_text(stmt, iCol);
+        int nz = sqlite3_column_bytes(stmt, iCol);
+        u8 *view = data + i * VEC0_METADATA_TEXT_VIEW_BUFFER_LENGTH;
+        memcpy(view, &nz, sizeof(int));
+        memcpy(view + 4, z, min(nz, VEC0_METADATA_TEXT_VIEW_BUFFER_LENGTH - 4));
+        break;
+      }
+      }
+    }
+    i++;
+  }
+  if (rc == SQLITE_DONE) {
+    rc = SQLITE_OK;
+  }
+
+done:
+  sqlite3_finalize(stmt);
+  return rc;
+}
+
+int vec0Filter_knn_chunks_iter(vec0_vtab *p, sqlite3_stmt *stmtChunks,
+                               struct VectorColumnDefinition *vector_column,
+                               int vectorColumnIdx, struct Array *arrayRowidsIn,
+                               struct Array * aMetadataIn,
+                               struct Vec0ChunkCandidates *candidates,
+                               const char * idxStr, int argc, sqlite3_value ** argv,
+                               void *queryVector, i64 k,
+                               const struct Vec0KnnPageBound *after,
+                               const struct Vec0KnnFusion *fusion,
+                               int perPartition,
+                               struct Vec0KnnBudget *budget,
+                               i64 **out_topk_rowids,
+                               f32 **out_topk_distances,
+                               void **out_topk_vectors, i64 *out_used) {
+  // for each chunk, get top min(k, chunk_size) rowid + distances to query vec.
+  // then reconcile all topk_chunks for a true top k.
+  // output rowids + distances, and the vectors of the top k rows if
+  // out_topk_vectors isn't NULL. With fusion, the distances are the weighted
+  // sums over every matched vector column. With perPartition, stmtChunks is
+  // ordered by partition key, and the output is the top k of every partition,
+  // one partition after the other. With budget, the scan stops early when it
+  // runs out. The rows of the _delta table, in chunk VEC0_DELTA_CHUNK_ID, are
+  // neither in the approximate index nor in chunk summaries, and don't count
+  // against the budget.
+
+  int rc = SQLITE_OK;
+  sqlite3_blob *blobVectors = NULL;
+
+  void *baseVectors = NULL; // memory: chunk_size * dimensions * element_size
+
+  // OWNED BY CALLER ON SUCCESS
+  i64 *topk_rowids = NULL; // memory: k * 4
+  // OWNED BY CALLER ON SUCCESS
+  f32 *topk_distances = NULL; // memory: k * 4
+
+  i64 *tmp_topk_rowids = NULL;    // memory: k * 4
+  f32 *tmp_topk_distances = NULL; // memory: k * 4
+  f32 *chunk_distances = NULL;    // memory: chunk_size * 4
+  u8 *b = NULL;                   // memory: chunk_size / 8
+  u8 *bTaken = NULL;              // memory: chunk_size / 8
+  i32 *chunk_topk_idxs = NULL;    // memory: k * 4
+  u8 *bmMetadata = NULL;            // memory: chunk_size / 8
+  sqlite3_stmt *stmtSummary = NULL;
+
+  // Only with out_topk_vectors: one slot per top k row, a row's vector is
+  // copied into a free slot when it enters the top k, and stays there until
+  // it's pushed out.
+  i64 vectorSize = vector_column_byte_size(*vector_column);
+  u8 *slotVectors = NULL;         // memory: k * vectorSize
+  i64 *topk_slots = NULL;         // memory: k * 8
+  i64 *tmp_topk_slots = NULL;     // memory: k * 8
+  i64 *merge_sources = NULL;      // memory: k * 8
+  u8 *slotsUsed = NULL;           // memory: k
+  // Only with fusion: the vectors of one of the other matched columns
+  void *fusionVectors = NULL;     // memory: chunk_size * vectorSize
+  // Only with perPartition: the top k of the partitions done so far, and the
+  // partition key values of the current one
+  struct Array groupRowids;
+  struct Array groupDistances;
+  sqlite3_value *groupKey[VEC0_MAX_PARTITION_COLUMNS];
+  int hasGroup = 0;
+  i64 chunksRead = 0;
+  struct Vec0DeltaChunk delta;
+  memset(&delta, 0, sizeof(delta));
+  memset(&groupRowids, 0, sizeof(groupRowids));
+  memset(&groupDistances, 0, sizeof(groupDistances));
+  memset(groupKey, 0, sizeof(groupKey));
+  assert(!perPartition || !out_topk_vectors);
+  //                        // total: a lot???
+
+  // 6 * (k * 4) + (k * 2) + (chunk_size / 8) + (chunk_size * dimensions * 4)
+
+  topk_rowids = sqlite3_malloc(k * sizeof(i64));
+  if (!topk_rowids) {
+    rc = SQLITE_NOMEM;
+    goto cleanup;
+  }
+  memset(topk_rowids, 0, k * sizeof(i64));
+
+  topk_distances = sqlite3_malloc(k * sizeof(f32));
+  if (!topk_distances) {
+    rc = SQLITE_NOMEM;
+    goto cleanup;
+  }
+  memset(topk_distances, 0, k * sizeof(f32));
+
+  tmp_topk_rowids = sqlite3_malloc(k * sizeof(i64));
+  if (!tmp_topk_rowids) {
+    rc = SQLITE_NOMEM;
+    goto cleanup;
+  }
+  memset(tmp_topk_rowids, 0, k * sizeof(i64));
+
+  tmp_topk_distances = sqlite3_malloc(k * sizeof(f32));
+  if (!tmp_topk_distances) {
+    rc = SQLITE_NOMEM;
+    goto cleanup;
+  }
+  memset(tmp_topk_distances, 0, k * sizeof(f32));
+
+  i64 k_used = 0;
+  i64 baseVectorsSize = p->chunk_size * vector_column_byte_size(*vector_column);
+  baseVectors = sqlite3_malloc(baseVectorsSize);
+  if (!baseVectors) {
+    rc = SQLITE_NOMEM;
+    goto cleanup;
+  }
+
+  chunk_distances = sqlite3_malloc(p->chunk_size * sizeof(f32));
+  if (!chunk_distances) {
+    rc = SQLITE_NOMEM;
+    goto cleanup;
+  }
+
+  b = bitmap_new(p->chunk_size);
+  if (!b) {
+    rc = SQLITE_NOMEM;
+    goto cleanup;
+  }
+
+  bTaken = bitmap_new(p->chunk_size);
+  if (!bTaken) {
+    rc = SQLITE_NOMEM;
+    goto cleanup;
+  }
+
+  chunk_topk_idxs = sqlite3_malloc(k * sizeof(i32));
+  if (!chunk_topk_idxs) {
+    rc = SQLITE_NOMEM;
+    goto cleanup;
+  }
+
+  sqlite3_blob * metadataBlobs[VEC0_MAX_METADATA_COLUMNS];
+  memset(metadataBlobs, 0, sizeof(sqlite3_blob*) * VEC0_MAX_METADATA_COLUMNS);
+  sqlite3_stmt *stmtZones[VEC0_MAX_METADATA_COLUMNS];
+  memset(stmtZones, 0, sizeof(stmtZones));
+
+  bmMetadata = bitmap_new(p->chunk_size);
+  if(!bmMetadata) {
+    rc = SQLITE_NOMEM;
+    goto cleanup;
+  }
+
+  if (out_topk_vectors) {
+    slotVectors = sqlite3_malloc64(k * vectorSize);
+    topk_slots = sqlite3_malloc64(k * sizeof(i64));
+    tmp_topk_slots = sqlite3_malloc64(k * sizeof(i64));
+    merge_sources = sqlite3_malloc64(k * sizeof(i64));
+    slotsUsed = sqlite3_malloc64(k);
+    if (!slotVectors || !topk_slots || !tmp_topk_slots || !merge_sources ||
+        !slotsUsed) {
+      rc = SQLITE_NOMEM;
+      goto cleanup;
+    }
+  }
+
+  if (perPartition) {
+    rc = array_init(&groupRowids, sizeof(i64), k);
+    if (rc != SQLITE_OK) {
+      goto cleanup;
+    }
+    rc = array_init(&groupDistances, sizeof(f32), k);
+    if (rc != SQLITE_OK) {
+      goto cleanup;
+    }
+  }
+
+  if (fusion) {
+    i64 fusionVectorsSize = 0;
+    for (int c = 0; c < fusion->n; c++) {
+      i64 size = p->chunk_size * vector_column_byte_size(
+                                     p->vector_columns[fusion->vectorColumnIdxs[c]]);
+      if (size > fusionVectorsSize) {
+        fusionVectorsSize = size;
+      }
+    }
+    fusionVectors = sqlite3_malloc64(fusionVectorsSize + 1);
+    if (!fusionVectors) {
+      rc = SQLITE_NOMEM;
+      goto cleanup;
+    }
+  }
+
+  // With chunk summaries, L2/L1 queries can skip any chunk whose distance
+  // lower bound is already worse than the current k-th best distance. The
+  // bounds of a single column say nothing about fused distances.
+  if (!fusion && vec0_has_chunk_summary(p, vectorColumnIdx) &&
+      vector_column->distance_metric != VEC0_DISTANCE_METRIC_COSINE) {
+    char *zSql = sqlite3_mprintf("SELECT count, radius, centroid, lo, hi FROM "
+                                 VEC0_SHADOW_VECTOR_SUMMARY_N_NAME
+                                 " WHERE rowid = ?",
+                                 p->schemaName, p->tableName, vectorColumnIdx);
+    if (!zSql) {
+      rc = SQLITE_NOMEM;
+      goto cleanup;
+    }
+    rc = sqlite3_prepare_v2(p->db, zSql, -1, &stmtSummary, NULL);
+    sqlite3_free(zSql);
+    if (rc != SQLITE_OK) {
+      vtab_set_error(&p->base, "could not prepare chunk summary query");
+      goto cleanup;
+    }
+  }
+
+  int idxStrLength = strlen(idxStr);
+  int numValueEntries = (idxStrLength-1) / 4;
+  assert(numValueEntries == argc);
+  int hasDistanceConstraints = 0;
+  for(int i = 0; i < argc; i++) {
+    int idx = 1 + (i * 4);
+    char kind = idxStr[idx + 0];
+    if(kind == VEC0_IDXSTR_KIND_KNN_DISTANCE_CONSTRAINT) {
+      hasDistanceConstraints = 1;
+    }
+  }
+
+  while (true) {
+    rc = sqlite3_step(stmtChunks);
+    if (rc == SQLITE_DONE) {
+      break;
+    }
+    if (rc != SQLITE_ROW) {
+      vtab_set_error(&p->base, "chunks iter error");
+      rc = SQLITE_ERROR;
+      goto cleanup;
+    }
+    memset(chunk_distances, 0, p->chunk_size * sizeof(f32));
+    memset(chunk_topk_idxs, 0, k * sizeof(i32));
+    bitmap_clear(b, p->chunk_size);
+
+    i64 chunk_id = sqlite3_column_int64(stmtChunks, 0);
+    int isDelta = chunk_id == VEC0_DELTA_CHUNK_ID;
+    unsigned char *chunkValidity =
+        (unsigned char *)sqlite3_column_blob(stmtChunks, 1);
+    i64 validitySize = sqlite3_column_bytes(stmtChunks, 1);
+    i64 *chunkRowids = (i64 *)sqlite3_column_blob(stmtChunks, 2);
+    i64 rowidsSize = sqlite3_column_bytes(stmtChunks, 2);
+    if (isDelta) {
+      sqlite3_value *deltaKey[VEC0_MAX_PARTITION_COLUMNS];
+      for (int j = 0; perPartition && j < p->numPartitionColumns; j++) {
+        deltaKey[j] = sqlite3_column_value(stmtChunks, 3 + j);
+      }
+      rc = vec0_delta_chunk_load(p, &delta, perPartition ? deltaKey : NULL,
+                                 idxStr, argc, argv);
+      if (rc != SQLITE_OK) {
+        goto cleanup;
+      }
+      chunkValidity = delta.validity;
+      validitySize = p->chunk_size / CHAR_BIT;
+      chunkRowids = delta.rowids;
+      rowidsSize = p->chunk_size * sizeof(i64);
+    }
+    if (validitySize != p->chunk_size / CHAR_BIT) {
+      // IMP: V05271_22109
+      vtab_set_error(
+          &p->base,
+          "chunk validity size doesn't match - expected %lld, found %lld",
+          p->chunk_size / CHAR_BIT, validitySize);
+      rc = SQLITE_ERROR;
+      goto cleanup;
+    }
+
+    if (rowidsSize != (i64)(p->chunk_size * sizeof(i64))) {
+      // IMP: V02796_19635
+      vtab_set_error(&p->base, "rowids size doesn't match");
+      vtab_set_error(
+          &p->base,
+          "chunk rowids size doesn't match - expected %lld, found %lld",
+          p->chunk_size * sizeof(i64), rowidsSize);
+      rc = SQLITE_ERROR;
+      goto cleanup;
+    }
+
+    // the first chunk of a new partition starts its top k over, after the top
+    // k of the previous partition is kept
+    if (perPartition) {
+      int samePartition = hasGroup;
+      for (int j = 0; samePartition && j < p->numPartitionColumns; j++) {
+        samePartition = vec0_value_equals(
+            groupKey[j], sqlite3_column_value(stmtChunks, 3 + j));
+      }
+      if (!samePartition) {
+        rc = vec0_knn_group_flush(&groupRowids, &groupDistances, topk_rowids,
+                                  topk_distances, k_used);
+        if (rc != SQLITE_OK) {
+          goto cleanup;
+        }
+        k_used = 0;
+        for (int j = 0; j < p->numPartitionColumns; j++) {
+          sqlite3_value_free(groupKey[j]);
+          groupKey[j] = sqlite3_value_dup(sqlite3_column_value(stmtChunks, 3 + j));
+          if (!groupKey[j]) {
+            rc = SQLITE_NOMEM;
+            goto cleanup;
+          }
+        }
+        hasGroup = 1;
+      }
+    }
+
+    // chunks without any candidate of the approximate index are skipped
+    u8 *bmCandidates = NULL;
+    if (candidates && !isDelta) {
+      bmCandidates = vec0_chunk_candidates_find(p, candidates, chunk_id);
+      if (!bmCandidates) {
+        continue;
+      }
+    }
+
+    // chunks whose metadata zones rule out every row are skipped
+    if (p->chunkSummaries && !isDelta) {
+      int skip;
+      rc = vec0_chunk_zones_skip(p, chunk_id, idxStr, argc, argv, aMetadataIn,
+                                 stmtZones, &skip);
+      if (rc != SQLITE_OK) {
+        goto cleanup;
+      }
+      if (skip) {
+        continue;
+      }
+    }
+
+    if (stmtSummary && !isDelta) {
+      sqlite3_reset(stmtSummary);
+      sqlite3_bind_int64(stmtSummary, 1, chunk_id);
+      rc = sqlite3_step(stmtSummary);
+      if (rc == SQLITE_ROW) {
+        i64 summaryCount = sqlite3_column_int64(stmtSummary, 0);
+        i64 expectedBytes = vector_column->dimensions * sizeof(f32);
+        if (summaryCount == 0) {
+          continue;
+        }
+        // Allow for float32 rounding in the distance functions before pruning
+        if (k_used == k &&
+            sqlite3_column_bytes(stmtSummary, 2) == expectedBytes &&
+            sqlite3_column_bytes(stmtSummary, 3) == expectedBytes &&
+            sqlite3_column_bytes(stmtSummary, 4) == expectedBytes) {
+          double bound = vec0_chunk_summary_lower_bound(
+              vector_column, queryVector, sqlite3_column_double(stmtSummary, 1),
+              (const f32 *)sqlite3_column_blob(stmtSummary, 2),
+              (const f32 *)sqlite3_column_blob(stmtSummary, 3),
+              (const f32 *)sqlite3_column_blob(stmtSummary, 4));
+          if (bound * (1.0 - 1e-3) > topk_distances[k_used - 1]) {
+            continue;
+          }
+        }
+      } else if (rc != SQLITE_DONE) {
+        vtab_set_error(&p->base, "could not read summary for chunk %lld",
+                       chunk_id);
+        rc = SQLITE_ERROR;
+        goto cleanup;
+      }
+      rc = SQLITE_OK;
+    }
+
+    // rows passing the other constraints, chunks without any aren't read
+    rc = vec0_chunk_filter_bitmap(p, chunk_id, chunkValidity, chunkRowids,
+                                  arrayRowidsIn, aMetadataIn, idxStr, argc,
+                                  argv, metadataBlobs,
+                                  isDelta ? delta.metadata : NULL, bmMetadata,
+                                  b);
+    if (rc != SQLITE_OK) {
+      goto cleanup;
+    }
+    if (bmCandidates) {
+      bitmap_and_inplace(b, bmCandidates, p->chunk_size);
+    }
+    int bLo, bHi;
+    if (!bitmap_span(b, p->chunk_size, &bLo, &bHi)) {
+      continue;
+    }
+
+    // only chunks that are read count against the budget, and the first one
+    // always is, so an expired budget still gives rows
+    if (budget && !isDelta && chunksRead > 0 &&
+        ((budget->maxChunks >= 0 && chunksRead >= budget->maxChunks) ||
+         (budget->deadline && vec0_now_ms() >= budget->deadline))) {
+      budget->exhausted = 1;
+      break;
+    }
+
+    if (isDelta) {
+      memcpy(baseVectors, delta.vectors[vectorColumnIdx], baseVectorsSize);
+    } else {
+      // open the vector chunk blob for the current chunk
+      chunksRead++;
+      rc = sqlite3_blob_open(p->db, p->schemaName,
+                             p->shadowVectorChunksNames[vectorColumnIdx],
+                             "vectors", chunk_id, 0, &blobVectors);
+      if (rc != SQLITE_OK) {
+        vtab_set_error(&p->base, "could not open vectors blob for chunk %lld",
+                       chunk_id);
+        rc = SQLITE_ERROR;
+        goto cleanup;
+      }
+
+      i64 currentBaseVectorsSize = sqlite3_blob_bytes(blobVectors);
+      i64 expectedBaseVectorsSize =
+          p->chunk_size * vector_column_byte_size(*vector_column);
+      if (currentBaseVectorsSize != expectedBaseVectorsSize) {
+        // IMP: V16465_00535
+        vtab_set_error(
+            &p->base,
+            "vectors blob size doesn't match - expected %lld, found %lld",
+            expectedBaseVectorsSize, currentBaseVectorsSize);
+        rc = SQLITE_ERROR;
+        goto cleanup;
+      }
+      rc = sqlite3_blob_read(blobVectors, baseVectors, currentBaseVectorsSize,
+                             0);
+
+      if (rc != SQLITE_OK) {
+        vtab_set_error(&p->base, "vectors blob read error for %lld", chunk_id);
+        rc = SQLITE_ERROR;
+        goto cleanup;
+      }
+    }
+
+    for (int i = bLo * CHAR_BIT; i < (bHi + 1) * CHAR_BIT; i++) {
+      if (!b[i / CHAR_BIT]) {
+        i += CHAR_BIT - 1;
+        continue;
+      }
+      if (!bitmap_get(b, i)) {
+        continue;
+      };
+
+      f32 result = 0.0f;
+      switch (vector_column->element_type) {
+      case SQLITE_VEC_ELEMENT_TYPE_FLOAT32: {
+        const f32 *base_i =
+            ((f32 *)baseVectors) + (i * vector_column->dimensions);
+        switch (vector_column->distance_metric) {
+        case VEC0_DISTANCE_METRIC_L2: {
+          result = distance_l2_sqr_float(base_i, (f32 *)queryVector,
+                                         &vector_column->dimensions);
+          break;
+        }
+        case VEC0_DISTANCE_METRIC_L1: {
+          result = distance_l1_f32(base_i, (f32 *)queryVector,
+                                   &vector_column->dimensions);
+          break;
+        }
+        case VEC0_DISTANCE_METRIC_COSINE: {
+          result = distance_cosine_float(base_i, (f32 *)queryVector,
+                                         &vector_column->dimensions);
+          break;
+        }
+        }
+        break;
+      }
+      case SQLITE_VEC_ELEMENT_TYPE_INT8: {
+        const i8 *base_i =
+            ((i8 *)baseVectors) + (i * vector_column->dimensions);
+        switch (vector_column->distance_metric) {
+        case VEC0_DISTANCE_METRIC_L2: {
+          result = distance_l2_sqr_int8(base_i, (i8 *)queryVector,
+                                        &vector_column->dimensions);
+          break;
+        }
+        case VEC0_DISTANCE_METRIC_L1: {
+          result = distance_l1_int8(base_i, (i8 *)queryVector,
+                                    &vector_column->dimensions);
+          break;
+        }
+        case VEC0_DISTANCE_METRIC_COSINE: {
+          result = distance_cosine_int8(base_i, (i8 *)queryVector,
+                                        &vector_column->dimensions);
+          break;
+        }
+        }
+
+        break;
+      }
+      case SQLITE_VEC_ELEMENT_TYPE_BIT: {
+        const u8 *base_i =
+            ((u8 *)baseVectors) + (i * (vector_column->dimensions / CHAR_BIT));
+        result = distance_hamming(base_i, (u8 *)queryVector,
+                                  &vector_column->dimensions);
+        break;
+      }
+      }
+
+      chunk_distances[i] = result;
+    }
+
+    if (fusion) {
+      rc = vec0_knn_fuse_chunk(p, fusion, chunk_id, b,
+                               isDelta ? delta.vectors : NULL, fusionVectors,
+                               chunk_distances);
+      if (rc != SQLITE_OK) {
+        goto cleanup;
+      }
+    }
+
+    if(hasDistanceConstraints) {
+      for(int i = 0; i < argc; i++) {
+        int idx = 1 + (i * 4);
+        char kind = idxStr[idx + 0];
+        // Note: SQLite provides distance constraint values as f64 (double), but we
+        // cast to f32 (float) for comparison. This matches the precision of our
+        // internal distance calculations (which use f32) and avoids precision
+        // mismatches. May result in minor precision loss for very small differences.
+        f32 target = (f32) sqlite3_value_double(argv[i]);
+
+        if(kind != VEC0_IDXSTR_KIND_KNN_DISTANCE_CONSTRAINT)  {
+          continue;
+        }
+        vec0_distance_constraint_operator op = idxStr[idx + 1];
+
+        switch(op) {
+          case VEC0_DISTANCE_CONSTRAINT_GE: {
+            for(int j = bLo * CHAR_BIT; j < (bHi + 1) * CHAR_BIT; j++) {
+              if(bitmap_get(b, j) && !(chunk_distances[j] >= target)) {
+                bitmap_set(b, j, 0);
+              }
+            }
+            break;
+          }
+          case VEC0_DISTANCE_CONSTRAINT_GT: {
+            for(int j = bLo * CHAR_BIT; j < (bHi + 1) * CHAR_BIT; j++) {
+              if(bitmap_get(b, j) && !(chunk_distances[j] > target)) {
+                bitmap_set(b, j, 0);
+              }
+            }
+            break;
+          }
+          case VEC0_DISTANCE_CONSTRAINT_LE: {
+            for(int j = bLo * CHAR_BIT; j < (bHi + 1) * CHAR_BIT; j++) {
+              if(bitmap_get(b, j) && !(chunk_distances[j] <= target)) {
+                bitmap_set(b, j, 0);
+              }
+            }
+            break;
+          }
+          case VEC0_DISTANCE_CONSTRAINT_LT: {
+            for(int j = bLo * CHAR_BIT; j < (bHi + 1) * CHAR_BIT; j++) {
+              if(bitmap_get(b, j) && !(chunk_distances[j] < target)) {
+                bitmap_set(b, j, 0);
+              }
+            }
+            break;
+          }
+        }
+      }
+    }
+
+    // a paged query resumes after the last row of the previous page
+    if (after) {
+      for (int j = 0; j < p->chunk_size; j++) {
+        if (bitmap_get(b, j) &&
+            (chunk_distances[j] < after->distance ||
+             (chunk_distances[j] == after->distance &&
+              chunkRowids[j] <= after->rowid))) {
+          bitmap_set(b, j, 0);
+        }
+      }
+    }
+
+    int used1;
+    min_idx(chunk_distances, p->chunk_size, b, chunk_topk_idxs,
+            min(k, p->chunk_size), bTaken, &used1);
+
+    i64 used;
+    merge_sorted_lists_sources(topk_distances, topk_rowids, k_used,
+                               chunk_distances, chunkRowids, chunk_topk_idxs,
+                               min(min(k, p->chunk_size), used1),
+                               tmp_topk_distances, tmp_topk_rowids,
+                               merge_sources, k, &used);
+
+    for (int i = 0; i < used; i++) {
+      topk_rowids[i] = tmp_topk_rowids[i];
+      topk_distances[i] = tmp_topk_distances[i];
+    }
+
+    if (slotVectors) {
+      // rows that stay keep their slot, new rows take the slots of the rows
+      // they pushed out
+      memset(slotsUsed, 0, k);
+      for (i64 i = 0; i < used; i++) {
+        if (merge_sources[i] >= 0) {
+          tmp_topk_slots[i] = topk_slots[merge_sources[i]];
+          slotsUsed[tmp_topk_slots[i]] = 1;
+        }
+      }
+      i64 nextFree = 0;
+      for (i64 i = 0; i < used; i++) {
+        if (merge_sources[i] < 0) {
+          while (slotsUsed[nextFree]) {
+            nextFree++;
+          }
+          slotsUsed[nextFree] = 1;
+          tmp_topk_slots[i] = nextFree;
+          memcpy(slotVectors + nextFree * vectorSize,
+                 (u8 *)baseVectors + (-1 - merge_sources[i]) * vectorSize,
+                 vectorSize);
+        }
+      }
+      i64 *swap = topk_slots;
+      topk_slots = tmp_topk_slots;
+      tmp_topk_slots = swap;
+    }
+    k_used = used;
+    // blobVectors is always opened with read-only permissions, so this never
+    // fails.
+    sqlite3_blob_close(blobVectors);
+    blobVectors = NULL;
+  }
+
+  if (perPartition) {
+    rc = vec0_knn_group_flush(&groupRowids, &groupDistances, topk_rowids,
+                              topk_distances, k_used);
+    if (rc != SQLITE_OK) {
+      goto cleanup;
+    }
+    sqlite3_free(topk_rowids);
+    sqlite3_free(topk_distances);
+    topk_rowids = groupRowids.z;
+    topk_distances = groupDistances.z;
+    k_used = groupRowids.length;
+    groupRowids.z = NULL;
+    groupDistances.z = NULL;
+  }
+
+  if (out_topk_vectors) {
+    u8 *topk_vectors = sqlite3_malloc64(k_used * vectorSize + 1);
+    if (!topk_vectors) {
+      rc = SQLITE_NOMEM;
+      goto cleanup;
+    }
+    for (i64 i = 0; i < k_used; i++) {
+      memcpy(topk_vectors + i * vectorSize,
+             slotVectors + topk_slots[i] * vectorSize, vectorSize);
+    }
+    *out_topk_vectors = topk_vectors;
+  }
+  *out_topk_rowids = topk_rowids;
+  *out_topk_distances = topk_distances;
+  *out_used = k_used;
+  rc = SQLITE_OK;
+
+cleanup:
+  if (rc != SQLITE_OK) {
+    sqlite3_free(topk_rowids);
+    sqlite3_free(topk_distances);
+  }
+  sqlite3_free(slotVectors);
+  sqlite3_free(topk_slots);
+  sqlite3_free(tmp_topk_slots);
+  sqlite3_free(merge_sources);
+  sqlite3_free(slotsUsed);
+  sqlite3_free(fusionVectors);
+  vec0_delta_chunk_free(&delta);
+  array_cleanup(&groupRowids);
+  array_cleanup(&groupDistances);
+  for (int i = 0; i < VEC0_MAX_PARTITION_COLUMNS; i++) {
+    sqlite3_value_free(groupKey[i]);
+  }
+  sqlite3_free(chunk_topk_idxs);
+  sqlite3_free(tmp_topk_rowids);
+  sqlite3_free(tmp_topk_distances);
+  sqlite3_free(b);
+  sqlite3_free(bTaken);
+  sqlite3_free(baseVectors);
+  sqlite3_free(chunk_distances);
+  sqlite3_free(bmMetadata);
+  sqlite3_finalize(stmtSummary);
+  for(int i = 0; i < VEC0_MAX_METADATA_COLUMNS; i++) {
+    sqlite3_blob_close(metadataBlobs[i]);
+    sqlite3_finalize(stmtZones[i]);
+  }
+  // blobVectors is always opened with read-only permissions, so this never
+  // fails.
+  sqlite3_blob_close(blobVectors);
+  return rc;
+}
+
+/**
+ * Distances from vector a to n vectors stored back to back in base, skipping
+ * those with skip[i] set. The distance kernels are the same SIMD ones KNN
+ * scans use.
+ */
+static void vec0_compute_distances(struct VectorColumnDefinition *vector_column,
+                                   const void *a, const void *base, i64 n,
+                                   const u8 *skip, f32 *out) {
+  size_t vectorSize = vector_column_byte_size(*vector_column);
+  for (i64 i = 0; i < n; i++) {
+    if (skip && skip[i]) continue;
+    out[i] = vec0_compute_distance(vector_column,
+                                   (const u8 *)base + i * vectorSize, a);
+  }
+}
+
+/**
+ * MMR greedy reranking of KNN results.
+ *
+ * Iteratively selects the candidate with the best MMR score:
+ *   MMR(d) = lambda * relevance(d) - (1-lambda) * max_sim(d, S)
+ *
+ * where relevance = 1 - normalized_distance, and max_sim is the maximum
+ * similarity (1 - normalized distance) between d and any already-selected
+ * result. max_sim is kept per candidate and only updated against the newly
+ * selected result at each step, so a step costs k_used distances.
+ *
+ * candidate_vectors holds the vectors of the candidates back to back, in
+ * topk order. If NULL (graph indexes), they're read from the shadow tables.
+ *
+ * Reorders topk_rowids and topk_distances in place.
+ * After return, the first *out_n_selected entries are the MMR-selected results.
+ */
+static int vec0_mmr_rerank(
+    vec0_vtab *p,
+    int vectorColumnIdx,
+    struct VectorColumnDefinition *vector_column,
+    i64 *topk_rowids,
+    f32 *topk_distances,
+    const void *candidate_vectors,
+    i64 k_used,
+    i64 k_target,
+    f32 mmr_lambda,
+    i64 *out_n_selected
+) {
+    int rc = SQLITE_OK;
+    size_t vectorSize = vector_column_byte_size(*vector_column);
+
+    u8 *loaded = NULL;
+    f32 *relevance = NULL;
+    f32 *max_sim = NULL;
+    f32 *step_distances = NULL;
+    i64 *out_rowids = NULL;
+    f32 *out_distances = NULL;
+    u8 *selected = NULL;
+
+    // 1. Load vectors from shadow tables, unless the scan kept them
+    if (!candidate_vectors) {
+        loaded = sqlite3_malloc64(k_used * vectorSize + 1);
+        if (!loaded) return SQLITE_NOMEM;
+        for (i64 i = 0; i < k_used; i++) {
+            void *vector;
+            rc = vec0_get_vector_data(p, topk_rowids[i], vectorColumnIdx,
+                                      &vector, NULL);
+            if (rc != SQLITE_OK) goto cleanup;
+            memcpy(loaded + i * vectorSize, vector, vectorSize);
+            sqlite3_free(vector);
+        }
+        candidate_vectors = loaded;
+    }
+
+    // 2. Normalize distances to [0, 1] for relevance scoring
+    f32 max_dist = 0.0f;
+    for (i64 i = 0; i < k_used; i++) {
+        if (topk_distances[i] > max_dist) max_dist = topk_distances[i];
+    }
+    if (max_dist < 1e-9f) max_dist = 1.0f;
+
+    relevance = sqlite3_malloc64(k_used * sizeof(f32));
+    max_sim = sqlite3_malloc64(k_used * sizeof(f32));
+    step_distances = sqlite3_malloc64(k_used * sizeof(f32));
+    if (!relevance || !max_sim || !step_distances) {
+        rc = SQLITE_NOMEM; goto cleanup;
+    }
+    for (i64 i = 0; i < k_used; i++) {
+        relevance[i] = 1.0f - (topk_distances[i] / max_dist);
+        max_sim[i] = 0.0f;
+    }
+
+    // 3. Greedy MMR selection
+    out_rowids = sqlite3_malloc64(k_target * sizeof(i64));
+    out_distances = sqlite3_malloc64(k_target * sizeof(f32));
+    selected = sqlite3_malloc64(k_used);
+    if (!out_rowids || !out_distances || !selected) {
+        rc = SQLITE_NOMEM; goto cleanup;
+    }
+    memset(selected, 0, k_used);
+
+    i64 n_selected = 0;
+    for (i64 step = 0; step < k_target && step < k_used; step++) {
+        f32 best_mmr = -FLT_MAX;
+        i64 best_idx = -1;
+
+        for (i64 i = 0; i < k_used; i++) {
+            if (selected[i]) continue;
+            f32 mmr_score = mmr_lambda * relevance[i]
+                          - (1.0f - mmr_lambda) * max_sim[i];
+            if (mmr_score > best_mmr) {
+                best_mmr = mmr_score;
+                best_idx = i;
+            }
+        }
+
+        if (best_idx < 0) break;
+        selected[best_idx] = 1;
+        out_rowids[step] = topk_rowids[best_idx];
+        out_distances[step] = topk_distances[best_idx];
+        n_selected++;
+
+        // only the new result can raise a candidate's max similarity
+        if (step + 1 < k_target) {
+            vec0_compute_distances(
+                vector_column,
+                (const u8 *)candidate_vectors + best_idx * vectorSize,
+                candidate_vectors, k_used, selected, step_distances);
+            for (i64 i = 0; i < k_used; i++) {
+                if (selected[i]) continue;
+                f32 sim = 1.0f - (step_distances[i] / max_dist);
+                if (sim > max_sim[i]) max_sim[i] = sim;
+            }
+        }
+    }
+
+    // 4. Copy results back to input arrays
+    for (i64 i = 0; i < n_selected; i++) {
+        topk_rowids[i] = out_rowids[i];
+        topk_distances[i] = out_distances[i];
+    }
+    *out_n_selected = n_selected;
+
+cleanup:
+    sqlite3_free(loaded);
+    sqlite3_free(relevance);
+    sqlite3_free(max_sim);
+    sqlite3_free(step_distances);
+    sqlite3_free(out_rowids);
+    sqlite3_free(out_distances);
+    sqlite3_free(selected);
+    return rc;
+}
+
+/**
+ * A row reached by the search of an approximate index. id is what the index
+ * addresses rows by, node an optional index-specific pointer.
+ */
+struct Vec0AnnCandidate {
+  f32 distance;
+  i64 id;
+  void *node;
+};
+
+static int vec0_cmp_ann_candidate(const void *a, const void *b) {
+  const struct Vec0AnnCandidate *pa = a;
+  const struct Vec0AnnCandidate *pb = b;
+  if (pa->distance != pb->distance) {
+    return pa->distance < pb->distance ? -1 : 1;
+  }
+  return pa->id < pb->id ? -1 : pa->id > pb->id ? 1 : 0;
+}
+
+/**
+ * A binary heap of candidates, ordered by distance. The top is the nearest
+ * candidate of a min-heap, the farthest of a max-heap.
+ */
+struct Vec0AnnHeap {
+  struct Vec0AnnCandidate *items;
+  int length;
+  int capacity;
+  int isMax;
+};
+
+static int vec0_ann_heap_before(struct Vec0AnnHeap *heap, int a, int b) {
+  int cmp = vec0_cmp_ann_candidate(&heap->items[a], &heap->items[b]);
+  return heap->isMax ? cmp > 0 : cmp < 0;
+}
+
+static void vec0_ann_heap_swap(struct Vec0AnnHeap *heap, int a, int b) {
+  struct Vec0AnnCandidate tmp = heap->items[a];
+  heap->items[a] = heap->items[b];
+  heap->items[b] = tmp;
+}
+
+static int vec0_ann_heap_push(struct Vec0AnnHeap *heap, f32 distance, i64 id,
+                              void *node) {
+  if (heap->length == heap->capacity) {
+    int capacity = heap->capacity ? heap->capacity * 2 : 64;
+    struct Vec0AnnCandidate *items =
+        sqlite3_realloc64(heap->items, capacity * sizeof(*items));
+    if (!items) {
+      return SQLITE_NOMEM;
+    }
+    heap->items = items;
+    heap->capacity = capacity;
+  }
+  int i = heap->length++;
+  heap->items[i].distance = distance;
+  heap->items[i].id = id;
+  heap->items[i].node = node;
+  while (i > 0 && vec0_ann_heap_before(heap, i, (i - 1) / 2)) {
+    vec0_ann_heap_swap(heap, i, (i - 1) / 2);
+    i = (i - 1) / 2;
+  }
+  return SQLITE_OK;
+}
+
+static struct Vec0AnnCandidate vec0_ann_heap_pop(struct Vec0AnnHeap *heap) {
+  struct Vec0AnnCandidate top = heap->items[0];
+  heap->items[0] = heap->items[--heap->length];
+  int i = 0;
+  while (1) {
+    int best = i;
+    int l = 2 * i + 1;
+    int r = 2 * i + 2;
+    if (l < heap->length && vec0_ann_heap_before(heap, l, best)) {
+      best = l;
+    }
+    if (r < heap->length && vec0_ann_heap_before(heap, r, best)) {
+      best = r;
+    }
+    if (best == i) {
+      break;
+    }
+    vec0_ann_heap_swap(heap, i, best);
+    i = best;
+  }
+  return top;
+}
+
+static int vec0_distance_constraints_match(const char *idxStr, int argc,
+                                           sqlite3_value **argv,
+                                           f32 distance) {
+  for (int i = 0; i < argc; i++) {
+    int idx = 1 + (i * 4);
+    if (idxStr[idx + 0] != VEC0_IDXSTR_KIND_KNN_DISTANCE_CONSTRAINT) {
+      continue;
+    }
+    // compared as f32, like vec0Filter_knn_chunks_iter()
+    f32 target = (f32)sqlite3_value_double(argv[i]);
+    switch ((vec0_distance_constraint_operator)idxStr[idx + 1]) {
+    case VEC0_DISTANCE_CONSTRAINT_GE:
+      if (!(distance >= target))
+        return 0;
+      break;
+    case VEC0_DISTANCE_CONSTRAINT_GT:
+      if (!(distance > target))
+        return 0;
+      break;
+    case VEC0_DISTANCE_CONSTRAINT_LE:
+      if (!(distance <= target))
+        return 0;
+      break;
+    case VEC0_DISTANCE_CONSTRAINT_LT:
+      if (!(distance < target))
+        return 0;
+      break;
+    }
+  }
+  return 1;
+}
+
+/**
+ * The rows of a chunk that match the constraints of a KNN query, and the
+ * chunk's rowids. Allocated as a single block.
+ */
+struct Vec0KnnChunk {
+  u8 *bitmap;
+  i64 *rowids;
+};
+
+// Marks a chunk that doesn't match the partition key constraints of a query
+static struct Vec0KnnChunk vec0_knn_excluded_chunk;
+
+static void vec0_knn_chunk_free(void *chunk) {
+  if (chunk != &vec0_knn_excluded_chunk) {
+    sqlite3_free(chunk);
+  }
+}
+
+/**
+ * Constraints of a KNN query besides k, for approximate indexes that reach
+ * rows in no particular chunk order. Rather than filtering every chunk up
+ * front, a chunk is filtered the first time the search reaches one of its
+ * rows.
+ */
+struct Vec0KnnChunkFilter {
+  const char *idxStr;
+  int argc;
+  sqlite3_value **argv;
+  struct Array *arrayRowidsIn;
+  struct Array *aMetadataIn;
+  // 1 if there are rowid in, partition key or metadata constraints
+  int hasChunkFilters;
+  // vec0_chunks_iter() with partition key constraints, by chunk_id
+  sqlite3_stmt *stmtChunk;
+  sqlite3_blob *metadataBlobs[VEC0_MAX_METADATA_COLUMNS];
+  u8 *bmScratch;
+  // chunk_id -> struct Vec0KnnChunk *, or &vec0_knn_excluded_chunk
+  struct Vec0I64Map chunks;
+};
+
+static int vec0_knn_chunk_filter_init(vec0_vtab *p,
+                                      struct Vec0KnnChunkFilter *filter,
+                                      struct Array *arrayRowidsIn,
+                                      struct Array *aMetadataIn,
+                                      const char *idxStr, int argc,
+                                      sqlite3_value **argv) {
+  int rc;
+  memset(filter, 0, sizeof(*filter));
+  filter->idxStr = idxStr;
+  filter->argc = argc;
+  filter->argv = argv;
+  filter->arrayRowidsIn = arrayRowidsIn;
+  filter->aMetadataIn = aMetadataIn;
+  filter->hasChunkFilters = arrayRowidsIn != NULL;
+  for (int i = 0; i < argc; i++) {
+    char kind = idxStr[1 + (i * 4)];
+    if (kind == VEC0_IDXSTR_KIND_KNN_PARTITON_CONSTRAINT ||
+        kind == VEC0_IDXSTR_KIND_METADATA_CONSTRAINT ||
+        kind == VEC0_IDXSTR_KIND_KNN_FILTER) {
+      filter->hasChunkFilters = 1;
+    }
+  }
+  rc = vec0_chunks_iter(p, idxStr, argc, argv, 1, VEC0_CHUNKS_ORDER_NONE,
+                        &filter->stmtChunk);
+  if (rc != SQLITE_OK) {
+    vtab_set_error(&p->base, "Error preparing stmtChunk: %s",
+                   sqlite3_errmsg(p->db));
+    return rc;
+  }
+  filter->bmScratch = bitmap_new(p->chunk_size);
+  if (!filter->bmScratch) {
+    return SQLITE_NOMEM;
+  }
+  return SQLITE_OK;
+}
+
+static void vec0_knn_chunk_filter_clear(struct Vec0KnnChunkFilter *filter) {
+  sqlite3_finalize(filter->stmtChunk);
+  filter->stmtChunk = NULL;
+  for (int i = 0; i < VEC0_MAX_METADATA_COLUMNS; i++) {
+    sqlite3_blob_close(filter->metadataBlobs[i]);
+    filter->metadataBlobs[i] = NULL;
+  }
+  sqlite3_free(filter->bmScratch);
+  filter->bmScratch = NULL;
+  vec0_i64_map_clear(&filter->chunks, vec0_knn_chunk_free);
+}
+
+/**
+ * @brief Get the rows of a chunk that match the query's constraints, reading
+ * and filtering the chunk if it wasn't reached before.
+ *
+ * @param out set to the chunk, or NULL if the chunk doesn't match the
+ * partition key constraints.
+ */
+static int vec0_knn_chunk_filter_get(vec0_vtab *p,
+                                     struct Vec0KnnChunkFilter *filter,
+                                     i64 chunk_id, struct Vec0KnnChunk **out) {
+  int rc;
+  struct Vec0KnnChunk *chunk = vec0_i64_map_get(&filter->chunks, chunk_id);
+  if (chunk) {
+    *out = chunk == &vec0_knn_excluded_chunk ? NULL : chunk;
+    return SQLITE_OK;
+  }
+  *out = NULL;
+
+  sqlite3_stmt *stmt = filter->stmtChunk;
+  sqlite3_reset(stmt);
+  sqlite3_bind_int64(stmt, sqlite3_bind_parameter_count(stmt), chunk_id);
+  rc = sqlite3_step(stmt);
+  if (rc == SQLITE_DONE) {
+    sqlite3_reset(stmt);
+    return vec0_i64_map_put(&filter->chunks, chunk_id,
+                            &vec0_knn_excluded_chunk);
+  }
+  if (rc != SQLITE_ROW) {
+    sqlite3_reset(stmt);
+    vtab_set_error(&p->base, "Could not read chunk %lld", chunk_id);
+    return SQLITE_ERROR;
+  }
+  if (sqlite3_column_bytes(stmt, 1) != p->chunk_size / CHAR_BIT ||
+      sqlite3_column_bytes(stmt, 2) != (int)(p->chunk_size * sizeof(i64))) {
+    sqlite3_reset(stmt);
+    vtab_set_error(&p->base, VEC_INTERAL_ERROR "invalid chunk %lld", chunk_id);
+    return SQLITE_CORRUPT_VTAB;
+  }
+  chunk = sqlite3_malloc64(sizeof(*chunk) + p->chunk_size * sizeof(i64) +
+                           p->chunk_size / CHAR_BIT);
+  if (!chunk) {
+    sqlite3_reset(stmt);
+    return SQLITE_NOMEM;
+  }
+  chunk->rowids = (i64 *)(chunk + 1);
+  chunk->bitmap = (u8 *)(chunk->rowids + p->chunk_size);
+  memcpy(chunk->rowids, sqlite3_column_blob(stmt, 2),
+         p->chunk_size * sizeof(i64));
+  rc = vec0_chunk_filter_bitmap(
+      p, chunk_id, (u8 *)sqlite3_column_blob(stmt, 1), chunk->rowids,
+      filter->arrayRowidsIn, filter->aMetadataIn, filter->idxStr, filter->argc,
+      filter->argv, filter->metadataBlobs, NULL, filter->bmScratch,
+      chunk->bitmap);
+  sqlite3_reset(stmt);
+  if (rc == SQLITE_OK) {
+    rc = vec0_i64_map_put(&filter->chunks, chunk_id, chunk);
+  }
+  if (rc != SQLITE_OK) {
+    sqlite3_free(chunk);
+    return rc;
+  }
+  *out = chunk;
+  return SQLITE_OK;
+}
+
+/**
+ * @brief Determine if the row at the given chunk position, at the given
+ * distance from the query vector, is a valid result of the query.
+ */
+static int vec0_knn_chunk_filter_admits(vec0_vtab *p,
+                                        struct Vec0KnnChunkFilter *filter,
+                                        i64 chunk_id, i64 chunk_offset,
+                                        f32 distance, int *admits) {
+  *admits = 0;
+  if (!vec0_distance_constraints_match(filter->idxStr, filter->argc,
+                                       filter->argv, distance)) {
+    return SQLITE_OK;
+  }
+  if (!filter->hasChunkFilters) {
+    *admits = 1;
+    return SQLITE_OK;
+  }
+  struct Vec0KnnChunk *chunk;
+  int rc = vec0_knn_chunk_filter_get(p, filter, chunk_id, &chunk);
+  if (rc != SQLITE_OK) {
+    return rc;
+  }
+  *admits = chunk && bitmap_get(chunk->bitmap, chunk_offset);
+  return SQLITE_OK;
+}
+
+// Upper bound of HNSW nodes cached per vector column. A cache that grew
+// larger is emptied before the next search or write.
+#ifndef SQLITE_VEC_HNSW_MAX_CACHED_NODES
+#define SQLITE_VEC_HNSW_MAX_CACHED_NODES 262144
+#endif
+
+// Highest layer a node of an HNSW graph can be on
+#define VEC0_HNSW_MAX_LEVEL 16
+
+static int vec0_has_hnsw_index(vec0_vtab *p, int vector_column_idx) {
+  return p->vector_columns[vector_column_idx].index_type ==
+         VEC0_INDEX_TYPE_HNSW;
+}
+
+/**
+ * @brief Maximum number of neighbors of a node on the given layer: 2*m on
+ * layer 0, m above.
+ */
+static int vec0_hnsw_max_neighbors(struct VectorColumnDefinition *column,
+                                   int level) {
+  return level == 0 ? column->hnsw.m * 2 : column->hnsw.m;
+}
+
+/**
+ * @brief Top layer of a new node, drawn from an exponential distribution with
+ * mL = 1/ln(m). Seeded by the rowid, so a re-inserted row lands on the same
+ * layers.
+ */
+static int vec0_hnsw_random_level(i64 rowid, int m) {
+  u64 state = (u64)rowid;
+  // uniform in (0, 1]
+  double u = ((double)(vec0_rand_next(&state) >> 11) + 1.0) /
+             9007199254740992.0;
+  int level = (int)(-log(u) / log((double)m));
+  return level > VEC0_HNSW_MAX_LEVEL ? VEC0_HNSW_MAX_LEVEL : level;
+}
+
+/**
+ * @brief Allocate a node with empty neighbor lists, as a single block.
+ */
+static struct Vec0HnswNode *
+vec0_hnsw_node_new(struct VectorColumnDefinition *column, i64 rowid,
+                   int level) {
+  size_t slots = 0;
+  for (int l = 0; l <= level; l++) {
+    slots += vec0_hnsw_max_neighbors(column, l);
+  }
+  size_t size = sizeof(struct Vec0HnswNode) + (level + 1) * sizeof(i64 *) +
+                slots * sizeof(i64) + (level + 1) * sizeof(int) +
+                vector_column_byte_size(*column);
+  struct Vec0HnswNode *node = sqlite3_malloc64(size);
+  if (!node) {
+    return NULL;
+  }
+  memset(node, 0, size);
+  node->rowid = rowid;
+  node->level = level;
+  node->neighbors = (i64 **)(node + 1);
+  i64 *slot = (i64 *)(node->neighbors + level + 1);
+  for (int l = 0; l <= level; l++) {
+    node->neighbors[l] = slot;
+    slot += vec0_hnsw_max_neighbors(column, l);
+  }
+  node->counts = (int *)slot;
+  node->vector = node->counts + level + 1;
+  return node;
+}
+
+/**
+ * @brief Bring the cached graph of an HNSW vector column up to date with the
+ * _info shadow table, dropping cached nodes if another connection (or a
+ * rollback) changed the graph since they were read.
+ */
+int vec0_hnsw_load(vec0_vtab *p, int vector_column_idx,
+                   struct Vec0HnswGraph **out) {
+  int rc;
+  sqlite3_stmt *stmt = NULL;
+  struct Vec0HnswGraph *graph = &p->hnswGraphs[vector_column_idx];
+  i64 generation = 0;
+  i64 entrypoint = 0;
+  int maxLevel = -1;
+
+  char *zSql = sqlite3_mprintf(
+      "SELECT key, value FROM " VEC0_SHADOW_INFO_NAME
+      " WHERE key IN ('HNSW_GENERATION_%02d', 'HNSW_ENTRYPOINT_%02d', "
+      "'HNSW_MAX_LEVEL_%02d')",
+      p->schemaName, p->tableName, vector_column_idx, vector_column_idx,
+      vector_column_idx);
+  if (!zSql) {
+    return SQLITE_NOMEM;
+  }
+  rc = sqlite3_prepare_v2(p->db, zSql, -1, &stmt, NULL);
+  sqlite3_free(zSql);
+  if (rc != SQLITE_OK) {
+    return rc;
+  }
+  while ((rc = sqlite3_step(stmt)) == SQLITE_ROW) {
+    const char *key = (const char *)sqlite3_column_text(stmt, 0);
+    if (sqlite3_strnicmp(key, "HNSW_GENERATION_", 16) == 0) {
+      generation = sqlite3_column_int64(stmt, 1);
+    } else if (sqlite3_strnicmp(key, "HNSW_ENTRYPOINT_", 16) == 0) {
+      entrypoint = sqlite3_column_int64(stmt, 1);
+    } else {
+      maxLevel = sqlite3_column_int(stmt, 1);
+    }
+  }
+  sqlite3_finalize(stmt);
+  if (rc != SQLITE_DONE) {
+    return rc;
+  }
+
+  if (!graph->loaded || graph->generation != generation ||
+      graph->nodes.size > SQLITE_VEC_HNSW_MAX_CACHED_NODES) {
+    vec0_i64_map_clear(&graph->nodes, sqlite3_free);
+  }
+  graph->generation = generation;
+  graph->entrypoint = entrypoint;
+  graph->maxLevel = maxLevel;
+  graph->loaded = 1;
+  *out = graph;
+  return SQLITE_OK;
+}
+
+/**
+ * @brief Get a node of the graph, reading it from the shadow tables if it
+ * isn't cached yet.
+ *
+ * @param out set to the node, or NULL if the graph has no node for rowid.
+ * Neighbor lists can reference deleted rows, which are skipped.
+ * @return int SQLITE_OK on success, error code otherwise
+ */
+static int vec0_hnsw_node_get(vec0_vtab *p, int vector_column_idx, i64 rowid,
+                              struct Vec0HnswNode **out) {
+  int rc;
+  struct Vec0HnswGraph *graph = &p->hnswGraphs[vector_column_idx];
+  struct VectorColumnDefinition *column = &p->vector_columns[vector_column_idx];
+  struct Vec0HnswNode *node = vec0_i64_map_get(&graph->nodes, rowid);
+  sqlite3_blob *vectorBlob = NULL;
+  if (node) {
+    *out = node;
+    return SQLITE_OK;
+  }
+  *out = NULL;
+
+  if (!graph->stmtNodeRead) {
+    char *zSql = sqlite3_mprintf("SELECT level, neighbors FROM "
+                                 VEC0_SHADOW_HNSW_NODES_N_NAME
+                                 " WHERE rowid = ?",
+                                 p->schemaName, p->tableName,
+                                 vector_column_idx);
+    if (!zSql) {
+      return SQLITE_NOMEM;
+    }
+    rc = sqlite3_prepare_v3(p->db, zSql, -1, SQLITE_PREPARE_PERSISTENT,
+                            &graph->stmtNodeRead, NULL);
+    sqlite3_free(zSql);
+    if (rc != SQLITE_OK) {
+      return rc;
+    }
+  }
+  sqlite3_reset(graph->stmtNodeRead);
+  sqlite3_bind_int64(graph->stmtNodeRead, 1, rowid);
+  rc = sqlite3_step(graph->stmtNodeRead);
+  if (rc == SQLITE_DONE) {
+    sqlite3_reset(graph->stmtNodeRead);
+    return SQLITE_OK;
+  }
+  if (rc != SQLITE_ROW) {
+    sqlite3_reset(graph->stmtNodeRead);
+    return rc;
+  }
+
+  int level = sqlite3_column_int(graph->stmtNodeRead, 0);
+  const u8 *blob = sqlite3_column_blob(graph->stmtNodeRead, 1);
+  i64 blobSize = sqlite3_column_bytes(graph->stmtNodeRead, 1);
+  if (level < 0 || level > VEC0_HNSW_MAX_LEVEL) {
+    goto corrupt;
+  }
+  node = vec0_hnsw_node_new(column, rowid, level);
+  if (!node) {
+    sqlite3_reset(graph->stmtNodeRead);
+    return SQLITE_NOMEM;
+  }
+  i64 offset = 0;
+  for (int l = 0; l <= level; l++) {
+    i32 count;
+    if (offset + (i64)sizeof(i32) > blobSize) {
+      goto corrupt;
+    }
+    memcpy(&count, blob + offset, sizeof(i32));
+    offset += sizeof(i32);
+    if (count < 0 || count > vec0_hnsw_max_neighbors(column, l) ||
+        offset + count * (i64)sizeof(i64) > blobSize) {
+      goto corrupt;
+    }
+    memcpy(node->neighbors[l], blob + offset, count * sizeof(i64));
+    node->counts[l] = count;
+    offset += count * sizeof(i64);
+  }
+  sqlite3_reset(graph->stmtNodeRead);
+
+  rc = vec0_get_chunk_position(p, rowid, NULL, &node->chunk_id,
+                               &node->chunk_offset);
+  if (rc == SQLITE_EMPTY) {
+    vtab_set_error(&p->base,
+                   VEC_INTERAL_ERROR "HNSW node %lld has no matching row",
+                   rowid);
+    rc = SQLITE_CORRUPT_VTAB;
+  }
+  if (rc != SQLITE_OK) {
+    sqlite3_free(node);
+    return rc;
+  }
+
+  size_t vectorSize = vector_column_byte_size(*column);
+  rc = sqlite3_blob_open(p->db, p->schemaName,
+                         p->shadowVectorChunksNames[vector_column_idx],
+                         "vectors", node->chunk_id, 0, &vectorBlob);
+  if (rc == SQLITE_OK) {
+    rc = sqlite3_blob_read(vectorBlob, node->vector, vectorSize,
+                           node->chunk_offset * vectorSize);
+  }
+  sqlite3_blob_close(vectorBlob);
+  if (rc != SQLITE_OK) {
+    vtab_set_error(&p->base, "Could not read vector of HNSW node %lld",
+                   rowid);
+    sqlite3_free(node);
+    return rc;
+  }
+
+  rc = vec0_i64_map_put(&graph->nodes, rowid, node);
+  if (rc != SQLITE_OK) {
+    sqlite3_free(node);
+    return rc;
+  }
+  *out = node;
+  return SQLITE_OK;
+
+corrupt:
+  sqlite3_reset(graph->stmtNodeRead);
+  sqlite3_free(node);
+  vtab_set_error(&p->base, VEC_INTERAL_ERROR "invalid HNSW node %lld", rowid);
+  return SQLITE_CORRUPT_VTAB;
+}
+
+/**
+ * @brief Write a node's level and neighbor lists to the _hnsw_nodesNN shadow
+ * table.
+ */
+static int vec0_hnsw_node_write(vec0_vtab *p, int vector_column_idx,
+                                struct Vec0HnswNode *node) {
+  int rc;
+  struct Vec0HnswGraph *graph = &p->hnswGraphs[vector_column_idx];
+  if (!graph->stmtNodeWrite) {
+    char *zSql = sqlite3_mprintf("INSERT OR REPLACE INTO "
+                                 VEC0_SHADOW_HNSW_NODES_N_NAME
+                                 "(rowid, level, neighbors) VALUES (?, ?, ?)",
+                                 p->schemaName, p->tableName,
+                                 vector_column_idx);
+    if (!zSql) {
+      return SQLITE_NOMEM;
+    }
+    rc = sqlite3_prepare_v3(p->db, zSql, -1, SQLITE_PREPARE_PERSISTENT,
+                            &graph->stmtNodeWrite, NULL);
+    sqlite3_free(zSql);
+    if (rc != SQLITE_OK) {
+      return rc;
+    }
+  }
+
+  i64 size = 0;
+  for (int l = 0; l <= node->level; l++) {
+    size += sizeof(i32) + node->counts[l] * sizeof(i64);
+  }
+  u8 *buf = sqlite3_malloc64(size);
+  if (!buf) {
+    return SQLITE_NOMEM;
+  }
+  u8 *cursor = buf;
+  for (int l = 0; l <= node->level; l++) {
+    i32 count = node->counts[l];
+    memcpy(cursor, &count, sizeof(i32));
+    cursor += sizeof(i32);
+    memcpy(cursor, node->neighbors[l], count * sizeof(i64));
+    cursor += count * sizeof(i64);
+  }
+
+  sqlite3_reset(graph->stmtNodeWrite);
+  sqlite3_bind_int64(graph->stmtNodeWrite, 1, node->rowid);
+  sqlite3_bind_int(graph->stmtNodeWrite, 2, node->level);
+  sqlite3_bind_blob64(graph->stmtNodeWrite, 3, buf, size, sqlite3_free);
+  rc = sqlite3_step(graph->stmtNodeWrite);
+  sqlite3_reset(graph->stmtNodeWrite);
+  if (rc != SQLITE_DONE) {
+    vtab_set_error(&p->base, "Could not write HNSW node %lld", node->rowid);
+    return SQLITE_ERROR;
+  }
+  node->dirty = 0;
+  return SQLITE_OK;
+}
+
+/**
+ * @brief Write the entry point and top layer of a graph to the _info shadow
+ * table, and bump its generation.
+ */
+static int vec0_hnsw_write_info(vec0_vtab *p, int vector_column_idx) {
+  int rc;
+  sqlite3_stmt *stmt = NULL;
+  struct Vec0HnswGraph *graph = &p->hnswGraphs[vector_column_idx];
+  char *zSql = sqlite3_mprintf(
+      "INSERT OR REPLACE INTO " VEC0_SHADOW_INFO_NAME "(key, value) VALUES "
+      "('HNSW_GENERATION_%02d', ?), ('HNSW_ENTRYPOINT_%02d', ?), "
+      "('HNSW_MAX_LEVEL_%02d', ?)",
+      p->schemaName, p->tableName, vector_column_idx, vector_column_idx,
+      vector_column_idx);
+  if (!zSql) {
+    return SQLITE_NOMEM;
+  }
+  rc = sqlite3_prepare_v2(p->db, zSql, -1, &stmt, NULL);
+  sqlite3_free(zSql);
+  if (rc != SQLITE_OK) {
+    return rc;
+  }
+  sqlite3_bind_int64(stmt, 1, graph->generation + 1);
+  sqlite3_bind_int64(stmt, 2, graph->entrypoint);
+  sqlite3_bind_int(stmt, 3, graph->maxLevel);
+  rc = sqlite3_step(stmt);
+  sqlite3_finalize(stmt);
+  if (rc != SQLITE_DONE) {
+    vtab_set_error(&p->base, "Could not update HNSW graph info");
+    return SQLITE_ERROR;
+  }
+  graph->generation++;
+  return SQLITE_OK;
+}
+
+/**
+ * @brief Drop the cached graph of an HNSW vector column and bump its
+ * generation, for when rows moved to other chunk positions.
+ */
+int vec0_hnsw_invalidate(vec0_vtab *p, int vector_column_idx) {
+  int rc;
+  struct Vec0HnswGraph *graph;
+  rc = vec0_hnsw_load(p, vector_column_idx, &graph);
+  if (rc != SQLITE_OK) {
+    return rc;
+  }
+  vec0_hnsw_clear_graph(p, vector_column_idx);
+  rc = vec0_hnsw_write_info(p, vector_column_idx);
+  // reloaded at the new generation on next use
+  graph->loaded = 0;
+  return rc;
+}
+
+/**
+ * @brief Greedy best-first search of a single layer of the graph, starting
+ * from the given entries (which must be on that layer).
+ *
+ * @param results an empty max-heap, set to the ef nearest nodes to query that
+ * pass filter. Nodes that don't pass are still traversed.
+ * @param filter constraints of a KNN query, NULL while building the graph
+ */
+static int vec0_hnsw_search_layer(vec0_vtab *p, int vector_column_idx,
+                                  const void *query,
+                                  struct Vec0AnnCandidate *entries,
+                                  int nEntries, int ef, int level,
+                                  struct Vec0KnnChunkFilter *filter,
+                                  struct Vec0AnnHeap *results) {
+  int rc = SQLITE_OK;
+  struct Vec0HnswGraph *graph = &p->hnswGraphs[vector_column_idx];
+  struct VectorColumnDefinition *column = &p->vector_columns[vector_column_idx];
+  struct Vec0AnnHeap candidates;
+  memset(&candidates, 0, sizeof(candidates));
+  int admits = 1;
+
+  if (++graph->searchTag == 0) {
+    // the tag wrapped around, so older tags could collide
+    for (size_t i = 0; i < graph->nodes.capacity; i++) {
+      if (graph->nodes.values[i]) {
+        ((struct Vec0HnswNode *)graph->nodes.values[i])->visited = 0;
+      }
+    }
+    graph->searchTag = 1;
+  }
+  u32 tag = graph->searchTag;
+
+  for (int i = 0; i < nEntries; i++) {
+    struct Vec0AnnCandidate *e = &entries[i];
+    struct Vec0HnswNode *node = e->node;
+    if (node->visited == tag) {
+      continue;
+    }
+    node->visited = tag;
+    rc = vec0_ann_heap_push(&candidates, e->distance, e->id, node);
+    if (rc != SQLITE_OK) {
+      goto done;
+    }
+    if (filter) {
+      rc = vec0_knn_chunk_filter_admits(p, filter, node->chunk_id,
+                                        node->chunk_offset, e->distance,
+                                        &admits);
+      if (rc != SQLITE_OK) {
+        goto done;
+      }
+    }
+    if (admits) {
+      rc = vec0_ann_heap_push(results, e->distance, e->id, node);
+      if (rc != SQLITE_OK) {
+        goto done;
+      }
+      if (results->length > ef) {
+        vec0_ann_heap_pop(results);
+      }
+    }
+  }
+
+  while (candidates.length > 0) {
+    struct Vec0AnnCandidate c = vec0_ann_heap_pop(&candidates);
+    struct Vec0HnswNode *node = c.node;
+    if (results->length >= ef && c.distance > results->items[0].distance) {
+      break;
+    }
+    for (int i = 0; i < node->counts[level]; i++) {
+      struct Vec0HnswNode *neighbor;
+      rc = vec0_hnsw_node_get(p, vector_column_idx, node->neighbors[level][i],
+                              &neighbor);
+      if (rc != SQLITE_OK) {
+        goto done;
+      }
+      if (!neighbor || neighbor->visited == tag || neighbor->level < level) {
+        continue;
+      }
+      neighbor->visited = tag;
+      f32 d = vec0_compute_distance(column, query, neighbor->vector);
+      if (results->length >= ef && d >= results->items[0].distance) {
+        continue;
+      }
+      rc = vec0_ann_heap_push(&candidates, d, neighbor->rowid, neighbor);
+      if (rc != SQLITE_OK) {
+        goto done;
+      }
+      if (filter) {
+        rc = vec0_knn_chunk_filter_admits(p, filter, neighbor->chunk_id,
+                                          neighbor->chunk_offset, d, &admits);
+        if (rc != SQLITE_OK) {
+          goto done;
+        }
+      }
+      if (admits) {
+        rc = vec0_ann_heap_push(results, d, neighbor->rowid, neighbor);
+        if (rc != SQLITE_OK) {
+          goto done;
+        }
+        if (results->length > ef) {
+          vec0_ann_heap_pop(results);
+        }
+      }
+    }
+  }
+
+done:
+  sqlite3_free(candidates.items);
+  return rc;
+}
+
+/**
+ * @brief Pick at most m neighbors out of candidates sorted by distance, with
+ * the heuristic of the HNSW paper: a candidate is skipped when it's closer to
+ * an already picked neighbor than to the base node, so links spread out in
+ * every direction. Skipped candidates fill up the remaining slots.
+ *
+ * @param selected set to the indexes of the picked candidates
+ */
+static int vec0_hnsw_select_neighbors(struct VectorColumnDefinition *column,
+                                      struct Vec0AnnCandidate *candidates,
+                                      int n, int m, int *selected,
+                                      int *nSelected) {
+  int count = 0;
+  u8 *skipped = sqlite3_malloc(n > 0 ? n : 1);
+  if (!skipped) {
+    return SQLITE_NOMEM;
+  }
+  memset(skipped, 0, n);
+  for (int i = 0; i < n && count < m; i++) {
+    for (int j = 0; j < count; j++) {
+      f32 d = vec0_compute_distance(
+          column, ((struct Vec0HnswNode *)candidates[i].node)->vector,
+          ((struct Vec0HnswNode *)candidates[selected[j]].node)->vector);
+      if (d < candidates[i].distance) {
+        skipped[i] = 1;
+        break;
+      }
+    }
+    if (!skipped[i]) {
+      selected[count++] = i;
+    }
+  }
+  for (int i = 0; i < n && count < m; i++) {
+    if (skipped[i]) {
+      selected[count++] = i;
+    }
+  }
+  sqlite3_free(skipped);
+  *nSelected = count;
+  return SQLITE_OK;
+}
+
+/**
+ * @brief Replace the neighbors of node on a layer with the best of the given
+ * nodes, as picked by vec0_hnsw_select_neighbors().
+ */
+static int vec0_hnsw_relink(vec0_vtab *p, int vector_column_idx,
+                            struct Vec0HnswNode *node, int level,
+                            struct Vec0HnswNode **nodes, int n) {
+  struct VectorColumnDefinition *column = &p->vector_columns[vector_column_idx];
+  int m = vec0_hnsw_max_neighbors(column, level);
+  struct Vec0AnnCandidate *candidates =
+      sqlite3_malloc64((n > 0 ? n : 1) * sizeof(*candidates));
+  int *selected = sqlite3_malloc64((n > 0 ? n : 1) * sizeof(int));
+  int nSelected = 0;
+  int rc = SQLITE_NOMEM;
+  if (!candidates || !selected) {
+    goto done;
+  }
+  for (int i = 0; i < n; i++) {
+    candidates[i].id = nodes[i]->rowid;
+    candidates[i].node = nodes[i];
+    candidates[i].distance =
+        vec0_compute_distance(column, node->vector, nodes[i]->vector);
+  }
+  qsort(candidates, n, sizeof(*candidates), vec0_cmp_ann_candidate);
+  rc = vec0_hnsw_select_neighbors(column, candidates, n, m, selected,
+                                  &nSelected);
+  if (rc != SQLITE_OK) {
+    goto done;
+  }
+  for (int i = 0; i < nSelected; i++) {
+    node->neighbors[level][i] = candidates[selected[i]].id;
+  }
+  node->counts[level] = nSelected;
+  node->dirty = 1;
+
+done:
+  sqlite3_free(candidates);
+  sqlite3_free(selected);
+  return rc;
+}
+
+/**
+ * @brief Collect the cached nodes of a neighbor list, skipping deleted rows
+ * and the node with rowid `except`.
+ *
+ * @param nodes must have room for the whole list plus `extra` entries
+ */
+static int vec0_hnsw_neighbor_nodes(vec0_vtab *p, int vector_column_idx,
+                                    struct Vec0HnswNode *node, int level,
+                                    i64 except, struct Vec0HnswNode **nodes,
+                                    int *n) {
+  *n = 0;
+  for (int i = 0; i < node->counts[level]; i++) {
+    struct Vec0HnswNode *neighbor;
+    if (node->neighbors[level][i] == except) {
+      continue;
+    }
+    int rc = vec0_hnsw_node_get(p, vector_column_idx, node->neighbors[level][i],
+                                &neighbor);
+    if (rc != SQLITE_OK) {
+      return rc;
+    }
+    if (neighbor && neighbor->level >= level) {
+      nodes[(*n)++] = neighbor;
+    }
+  }
+  return SQLITE_OK;
+}
+
+/**
+ * @brief Add a link from one node to another on a layer. When the list is
+ * full, the best neighbors out of the old ones and `to` are kept.
+ */
+static int vec0_hnsw_link(vec0_vtab *p, int vector_column_idx,
+                          struct Vec0HnswNode *from, struct Vec0HnswNode *to,
+                          int level) {
+  struct VectorColumnDefinition *column = &p->vector_columns[vector_column_idx];
+  int m = vec0_hnsw_max_neighbors(column, level);
+  for (int i = 0; i < from->counts[level]; i++) {
+    if (from->neighbors[level][i] == to->rowid) {
+      return SQLITE_OK;
+    }
+  }
+  from->dirty = 1;
+  if (from->counts[level] < m) {
+    from->neighbors[level][from->counts[level]++] = to->rowid;
+    return SQLITE_OK;
+  }
+
+  struct Vec0HnswNode **nodes = sqlite3_malloc64((m + 1) * sizeof(*nodes));
+  int n;
+  if (!nodes) {
+    return SQLITE_NOMEM;
+  }
+  int rc = vec0_hnsw_neighbor_nodes(p, vector_column_idx, from, level,
+                                    to->rowid, nodes, &n);
+  if (rc == SQLITE_OK) {
+    nodes[n++] = to;
+    rc = vec0_hnsw_relink(p, vector_column_idx, from, level, nodes, n);
+  }
+  sqlite3_free(nodes);
+  return rc;
+}
+
+/**
+ * @brief Write every dirty node of the cached graph and the graph's _info keys.
+ */
+static int vec0_hnsw_flush(vec0_vtab *p, int vector_column_idx) {
+  struct Vec0HnswGraph *graph = &p->hnswGraphs[vector_column_idx];
+  for (size_t i = 0; i < graph->nodes.capacity; i++) {
+    struct Vec0HnswNode *node = graph->nodes.values[i];
+    if (node && node->dirty) {
+      int rc = vec0_hnsw_node_write(p, vector_column_idx, node);
+      if (rc != SQLITE_OK) {
+        return rc;
+      }
+    }
+  }
+  return vec0_hnsw_write_info(p, vector_column_idx);
+}
+
+/**
+ * @brief Greedy descent from the entry point through the layers above
+ * `level`, to the node nearest to query on the layer `level + 1`.
+ */
+static int vec0_hnsw_descend(vec0_vtab *p, int vector_column_idx,
+                             const void *query, int level,
+                             struct Vec0AnnCandidate *out) {
+  int rc;
+  struct Vec0HnswGraph *graph = &p->hnswGraphs[vector_column_idx];
+  struct Vec0HnswNode *entry;
+  struct Vec0AnnHeap results;
+  memset(&results, 0, sizeof(results));
+  results.isMax = 1;
+
+  rc = vec0_hnsw_node_get(p, vector_column_idx, graph->entrypoint, &entry);
+  if (rc != SQLITE_OK) {
+    return rc;
+  }
+  if (!entry) {
+    vtab_set_error(&p->base, VEC_INTERAL_ERROR "HNSW entry point %lld missing",
+                   graph->entrypoint);
+    return SQLITE_CORRUPT_VTAB;
+  }
+  out->id = entry->rowid;
+  out->node = entry;
+  out->distance = vec0_compute_distance(&p->vector_columns[vector_column_idx],
+                                        query, entry->vector);
+  for (int l = graph->maxLevel; l > level; l--) {
+    results.length = 0;
+    rc = vec0_hnsw_search_layer(p, vector_column_idx, query, out, 1, 1, l,
+                                NULL, &results);
+    if (rc != SQLITE_OK) {
+      break;
+    }
+    *out = results.items[0];
+  }
+  sqlite3_free(results.items);
+  return rc;
+}
+
+/**
+ * @brief Add a row to the HNSW graph of a vector column. The row must already
+ * be written to its chunk.
+ *
+ * @param p vec0 table
+ * @param vector_column_idx HNSW vector column
+ * @param rowid rowid of the new row
+ * @param vector the row's vector
+ * @return int SQLITE_OK on success, error code otherwise
+ */
+int vec0_hnsw_insert(vec0_vtab *p, int vector_column_idx, i64 rowid,
+                     const void *vector) {
+  int rc;
+  struct Vec0HnswGraph *graph;
+  struct VectorColumnDefinition *column = &p->vector_columns[vector_column_idx];
+  struct Vec0AnnHeap results;
+  memset(&results, 0, sizeof(results));
+  results.isMax = 1;
+  struct Vec0AnnCandidate *entries = NULL;
+  int *selected = NULL;
+
+  rc = vec0_hnsw_load(p, vector_column_idx, &graph);
+  if (rc != SQLITE_OK) {
+    return rc;
+  }
+
+  int level = vec0_hnsw_random_level(rowid, column->hnsw.m);
+  struct Vec0HnswNode *node = vec0_hnsw_node_new(column, rowid, level);
+  if (!node) {
+    return SQLITE_NOMEM;
+  }
+  memcpy(node->vector, vector, vector_column_byte_size(*column));
+  rc = vec0_get_chunk_position(p, rowid, NULL, &node->chunk_id,
+                               &node->chunk_offset);
+  if (rc != SQLITE_OK) {
+    sqlite3_free(node);
+    return rc;
+  }
+  sqlite3_free(vec0_i64_map_remove(&graph->nodes, rowid));
+  rc = vec0_i64_map_put(&graph->nodes, rowid, node);
+  if (rc != SQLITE_OK) {
+    sqlite3_free(node);
+    return rc;
+  }
+  node->dirty = 1;
+
+  if (graph->maxLevel < 0) {
+    graph->entrypoint = rowid;
+    graph->maxLevel = level;
+    return vec0_hnsw_flush(p, vector_column_idx);
+  }
+
+  struct Vec0AnnCandidate entry;
+  int top = level < graph->maxLevel ? level : graph->maxLevel;
+  rc = vec0_hnsw_descend(p, vector_column_idx, vector, top, &entry);
+  if (rc != SQLITE_OK) {
+    goto done;
+  }
+  // the new node isn't linked yet, so searches won't reach it
+  int nEntries = 1;
+  entries = sqlite3_malloc(sizeof(*entries));
+  selected = sqlite3_malloc64(column->hnsw.ef_construction * sizeof(int) +
+                              sizeof(int));
+  if (!entries || !selected) {
+    rc = SQLITE_NOMEM;
+    goto done;
+  }
+  entries[0] = entry;
+
+  for (int l = top; l >= 0; l--) {
+    results.length = 0;
+    rc = vec0_hnsw_search_layer(p, vector_column_idx, vector, entries,
+                                nEntries, column->hnsw.ef_construction, l,
+                                NULL, &results);
+    if (rc != SQLITE_OK) {
+      goto done;
+    }
+    qsort(results.items, results.length, sizeof(*results.items),
+          vec0_cmp_ann_candidate);
+
+    int nSelected;
+    rc = vec0_hnsw_select_neighbors(column, results.items, results.length,
+                                    column->hnsw.m, selected, &nSelected);
+    if (rc != SQLITE_OK) {
+      goto done;
+    }
+    for (int i = 0; i < nSelected; i++) {
+      struct Vec0HnswNode *neighbor = results.items[selected[i]].node;
+      node->neighbors[l][node->counts[l]++] = neighbor->rowid;
+      rc = vec0_hnsw_link(p, vector_column_idx, neighbor, node, l);
+      if (rc != SQLITE_OK) {
+        goto done;
+      }
+    }
+
+    // the candidates of this layer are the entries of the next one
+    sqlite3_free(entries);
+    entries = results.items;
+    nEntries = results.length;
+    memset(&results, 0, sizeof(results));
+    results.isMax = 1;
+  }
+
+  if (level > graph->maxLevel) {
+    graph->entrypoint = rowid;
+    graph->maxLevel = level;
+  }
+  rc = vec0_hnsw_flush(p, vector_column_idx);
+
+done:
+  sqlite3_free(results.items);
+  sqlite3_free(entries);
+  sqlite3_free(selected);
+  if (rc != SQLITE_OK) {
+    // half-linked nodes must not outlive the failed statement
+    vec0_hnsw_clear_graph(p, vector_column_idx);
+  }
+  return rc;
+}
+
+/**
+ * @brief Remove a row from the HNSW graph of a vector column. Every neighbor
+ * that linked to the row is re-linked to the best of its remaining neighbors
+ * and the row's neighbors. Links from other nodes are left dangling and
+ * skipped by searches.
+ *
+ * @param p vec0 table
+ * @param vector_column_idx HNSW vector column
+ * @param rowid rowid of the deleted row, which must still be in its chunk
+ * @return int SQLITE_OK on success, error code otherwise
+ */
+int vec0_hnsw_delete(vec0_vtab *p, int vector_column_idx, i64 rowid) {
+  int rc;
+  struct Vec0HnswGraph *graph;
+  struct VectorColumnDefinition *column = &p->vector_columns[vector_column_idx];
+  struct Vec0HnswNode *deleted;
+  struct Vec0HnswNode **nodes = NULL;
+  sqlite3_stmt *stmt = NULL;
+
+  rc = vec0_hnsw_load(p, vector_column_idx, &graph);
+  if (rc != SQLITE_OK) {
+    return rc;
+  }
+  rc = vec0_hnsw_node_get(p, vector_column_idx, rowid, &deleted);
+  if (rc != SQLITE_OK || !deleted) {
+    return rc;
+  }
+  vec0_i64_map_remove(&graph->nodes, rowid);
+
+  char *zSql = sqlite3_mprintf("DELETE FROM " VEC0_SHADOW_HNSW_NODES_N_NAME
+                               " WHERE rowid = ?",
+                               p->schemaName, p->tableName, vector_column_idx);
+  if (!zSql) {
+    rc = SQLITE_NOMEM;
+    goto done;
+  }
+  rc = sqlite3_prepare_v2(p->db, zSql, -1, &stmt, NULL);
+  sqlite3_free(zSql);
+  if (rc != SQLITE_OK) {
+    goto done;
+  }
+  sqlite3_bind_int64(stmt, 1, rowid);
+  if (sqlite3_step(stmt) != SQLITE_DONE) {
+    rc = SQLITE_ERROR;
+    goto done;
+  }
+  sqlite3_finalize(stmt);
+  stmt = NULL;
+
+  nodes = sqlite3_malloc64(vec0_hnsw_max_neighbors(column, 0) * 2 *
+                           sizeof(*nodes));
+  if (!nodes) {
+    rc = SQLITE_NOMEM;
+    goto done;
+  }
+  for (int l = 0; l <= deleted->level; l++) {
+    for (int i = 0; i < deleted->counts[l]; i++) {
+      struct Vec0HnswNode *neighbor;
+      rc = vec0_hnsw_node_get(p, vector_column_idx, deleted->neighbors[l][i],
+                              &neighbor);
+      if (rc != SQLITE_OK) {
+        goto done;
+      }
+      if (!neighbor || neighbor->level < l) {
+        continue;
+      }
+      int linked = 0;
+      for (int j = 0; j < neighbor->counts[l]; j++) {
+        if (neighbor->neighbors[l][j] == rowid) {
+          linked = 1;
+          break;
+        }
+      }
+      if (!linked) {
+        continue;
+      }
+
+      int n;
+      rc = vec0_hnsw_neighbor_nodes(p, vector_column_idx, neighbor, l, rowid,
+                                    nodes, &n);
+      if (rc != SQLITE_OK) {
+        goto done;
+      }
+      int nOwn = n;
+      for (int j = 0; j < deleted->counts[l]; j++) {
+        struct Vec0HnswNode *other;
+        if (deleted->neighbors[l][j] == neighbor->rowid) {
+          continue;
+        }
+        rc = vec0_hnsw_node_get(p, vector_column_idx, deleted->neighbors[l][j],
+                                &other);
+        if (rc != SQLITE_OK) {
+          goto done;
+        }
+        if (!other || other->level < l) {
+          continue;
+        }
+        int seen = 0;
+        for (int x = 0; x < nOwn; x++) {
+          if (nodes[x] == other) {
+            seen = 1;
+            break;
+          }
+        }
+        if (!seen) {
+          nodes[n++] = other;
+        }
+      }
+      rc = vec0_hnsw_relink(p, vector_column_idx, neighbor, l, nodes, n);
+      if (rc != SQLITE_OK) {
+        goto done;
+      }
+    }
+  }
+
+  if (graph->entrypoint == rowid) {
+    zSql = sqlite3_mprintf("SELECT rowid, level FROM "
+                           VEC0_SHADOW_HNSW_NODES_N_NAME
+                           " ORDER BY level DESC LIMIT 1",
+                           p->schemaName, p->tableName, vector_column_idx);
+    if (!zSql) {
+      rc = SQLITE_NOMEM;
+      goto done;
+    }
+    rc = sqlite3_prepare_v2(p->db, zSql, -1, &stmt, NULL);
+    sqlite3_free(zSql);
+    if (rc != SQLITE_OK) {
+      goto done;
+    }
+    rc = sqlite3_step(stmt);
+    if (rc == SQLITE_ROW) {
+      graph->entrypoint = sqlite3_column_int64(stmt, 0);
+      graph->maxLevel = sqlite3_column_int(stmt, 1);
+    } else if (rc == SQLITE_DONE) {
+      graph->entrypoint = 0;
+      graph->maxLevel = -1;
+    } else {
+      goto done;
+    }
+  }
+  rc = vec0_hnsw_flush(p, vector_column_idx);
+
+done:
+  sqlite3_finalize(stmt);
+  sqlite3_free(nodes);
+  sqlite3_free(deleted);
+  if (rc != SQLITE_OK) {
+    vec0_hnsw_clear_graph(p, vector_column_idx);
+  }
+  return rc;
+}
+
+/**
+ * @brief KNN query on the HNSW graph of a vector column. Outputs the same as
+ * vec0Filter_knn_chunks_iter(), but only reads the vectors of the nodes the
+ * graph search visits.
+ *
+ * @param ef size of the dynamic candidate list on layer 0, at least k
+ * @param idxStr xFilter idxStr, for partition key, metadata and distance
+ * constraints
+ */
+int vec0_hnsw_knn(vec0_vtab *p, int vector_column_idx, const void *query,
+                  i64 k, i64 ef, struct Array *arrayRowidsIn,
+                  struct Array *aMetadataIn, const char *idxStr, int argc,
+                  sqlite3_value **argv, i64 **out_topk_rowids,
+                  f32 **out_topk_distances, i64 *out_used) {
+  int rc;
+  struct Vec0HnswGraph *graph;
+  struct Vec0KnnChunkFilter filter;
+  memset(&filter, 0, sizeof(filter));
+  struct Vec0AnnHeap results;
+  memset(&results, 0, sizeof(results));
+  results.isMax = 1;
+  i64 *topk_rowids = NULL;
+  f32 *topk_distances = NULL;
+  i64 k_used = 0;
+
+  rc = vec0_knn_chunk_filter_init(p, &filter, arrayRowidsIn, aMetadataIn,
+                                  idxStr, argc, argv);
+  if (rc != SQLITE_OK) {
+    goto cleanup;
+  }
+
+  topk_rowids = sqlite3_malloc64(k * sizeof(i64));
+  topk_distances = sqlite3_malloc64(k * sizeof(f32));
+  if (!topk_rowids || !topk_distances) {
+    rc = SQLITE_NOMEM;
+    goto cleanup;
+  }
+
+  rc = vec0_hnsw_load(p, vector_column_idx, &graph);
+  if (rc != SQLITE_OK || graph->maxLevel < 0) {
+    goto cleanup;
+  }
+  struct Vec0AnnCandidate entry;
+  rc = vec0_hnsw_descend(p, vector_column_idx, query, 0, &entry);
+  if (rc != SQLITE_OK) {
+    goto cleanup;
+  }
+  rc = vec0_hnsw_search_layer(p, vector_column_idx, query, &entry, 1,
+                              (int)(ef > k ? ef : k), 0, &filter, &results);
+  if (rc != SQLITE_OK) {
+    goto cleanup;
+  }
+  qsort(results.items, results.length, sizeof(*results.items),
+        vec0_cmp_ann_candidate);
+  for (int i = 0; i < results.length && k_used < k; i++) {
+    topk_rowids[k_used] = results.items[i].id;
+    topk_distances[k_used] = results.items[i].distance;
+    k_used++;
+  }
+
+cleanup:
+  sqlite3_free(results.items);
+  vec0_knn_chunk_filter_clear(&filter);
+  if (rc != SQLITE_OK) {
+    sqlite3_free(topk_rowids);
+    sqlite3_free(topk_distances);
+    return rc;
+  }
+  *out_topk_rowids = topk_rowids;
+  *out_topk_distances = topk_distances;
+  *out_used = k_used;
+  return SQLITE_OK;
+}
+
+static int vec0_has_diskann_index(vec0_vtab *p, int vector_column_idx) {
+  return p->vector_columns[vector_column_idx].index_type ==
+         VEC0_INDEX_TYPE_DISKANN;
+}
+
+// RobustPrune distance threshold: a candidate is pruned when an already
+// picked neighbor is alpha times closer to it than the node being linked
+#define VEC0_DISKANN_ALPHA 1.2f
+
+// Centroids per PQ subspace, so that a code fits in a byte
+#define VEC0_DISKANN_MAX_KSUB 256
+
+// Marks a slot visited by a DiskANN search
+static u8 vec0_diskann_visited;
+
+/**
+ * @brief First dimension of a PQ subspace. Subspace i covers the dimensions
+ * [start(i), start(i + 1)), which are uneven when pq doesn't divide the
+ * dimensions.
+ */
+static size_t vec0_diskann_subspace_start(struct VectorColumnDefinition *column,
+                                          int i) {
+  return (size_t)i * column->dimensions / column->diskann.pq;
+}
+
+/**
+ * @brief Distance between two float32 vectors of the space PQ codes
+ * approximate: squared L2 (over normalized vectors for cosine), L1 for L1.
+ */
+static f32 vec0_diskann_pq_distance(struct VectorColumnDefinition *column,
+                                    const f32 *a, const f32 *b, size_t from,
+                                    size_t to) {
+  f32 d = 0.0f;
+  for (size_t i = from; i < to; i++) {
+    f32 diff = a[i] - b[i];
+    d += column->distance_metric == VEC0_DISTANCE_METRIC_L1 ? fabsf(diff)
+                                                            : diff * diff;
+  }
+  return d;
+}
+
+/**
+ * @brief PQ code of a vector: the nearest centroid of every subspace.
+ *
+ * @param v vector, as prepared by vec0_ivf_prepare_vector()
+ */
+static void vec0_diskann_encode(struct VectorColumnDefinition *column,
+                                struct Vec0DiskannIndex *index, const f32 *v,
+                                u8 *code) {
+  size_t dims = column->dimensions;
+  for (int i = 0; i < column->diskann.pq; i++) {
+    size_t from = vec0_diskann_subspace_start(column, i);
+    size_t to = vec0_diskann_subspace_start(column, i + 1);
+    f32 best = FLT_MAX;
+    for (int c = 0; c < index->ksub; c++) {
+      f32 d = vec0_diskann_pq_distance(column, v, index->codebook + c * dims,
+                                       from, to);
+      if (d < best) {
+        best = d;
+        code[i] = (u8)c;
+      }
+    }
+  }
+}
+
+/**
+ * @brief Bring the cached PQ state of a DiskANN vector column up to date with
+ * the _info shadow table, re-reading the codebook and dropping cached codes
+ * if another connection (or a rollback) changed the graph since.
+ */
+int vec0_diskann_load(vec0_vtab *p, int vector_column_idx,
+                      struct Vec0DiskannIndex **out) {
+  int rc;
+  sqlite3_stmt *stmt = NULL;
+  struct VectorColumnDefinition *column = &p->vector_columns[vector_column_idx];
+  struct Vec0DiskannIndex *index = &p->diskannIndexes[vector_column_idx];
+  i64 generation = 0;
+  i64 medoid = -1;
+
+  char *zSql = sqlite3_mprintf(
+      "SELECT key, value FROM " VEC0_SHADOW_INFO_NAME
+      " WHERE key IN ('DISKANN_GENERATION_%02d', 'DISKANN_MEDOID_%02d')",
+      p->schemaName, p->tableName, vector_column_idx, vector_column_idx);
+  if (!zSql) {
+    return SQLITE_NOMEM;
+  }
+  rc = sqlite3_prepare_v2(p->db, zSql, -1, &stmt, NULL);
+  sqlite3_free(zSql);
+  if (rc != SQLITE_OK) {
+    return rc;
+  }
+  while ((rc = sqlite3_step(stmt)) == SQLITE_ROW) {
+    const char *key = (const char *)sqlite3_column_text(stmt, 0);
+    if (sqlite3_strnicmp(key, "DISKANN_GENERATION_", 19) == 0) {
+      generation = sqlite3_column_int64(stmt, 1);
+    } else {
+      medoid = sqlite3_column_int64(stmt, 1);
+    }
+  }
+  sqlite3_finalize(stmt);
+  stmt = NULL;
+  if (rc != SQLITE_DONE) {
+    return rc;
+  }
+
+  if (!index->loaded || index->generation != generation) {
+    vec0_diskann_clear_index(p, vector_column_idx);
+    zSql = sqlite3_mprintf("SELECT value FROM " VEC0_SHADOW_INFO_NAME
+                           " WHERE key = 'DISKANN_CODEBOOK_%02d'",
+                           p->schemaName, p->tableName, vector_column_idx);
+    if (!zSql) {
+      return SQLITE_NOMEM;
+    }
+    rc = sqlite3_prepare_v2(p->db, zSql, -1, &stmt, NULL);
+    sqlite3_free(zSql);
+    if (rc != SQLITE_OK) {
+      return rc;
+    }
+    rc = sqlite3_step(stmt);
+    if (rc == SQLITE_ROW) {
+      i64 centroidSize = column->dimensions * sizeof(f32);
+      i64 n = sqlite3_column_bytes(stmt, 0);
+      if (n == 0 || n % centroidSize != 0 ||
+          n / centroidSize > VEC0_DISKANN_MAX_KSUB) {
+        sqlite3_finalize(stmt);
+        vtab_set_error(&p->base,
+                       VEC_INTERAL_ERROR "invalid DiskANN codebook for %s",
+                       column->name);
+        return SQLITE_CORRUPT_VTAB;
+      }
+      index->codebook = sqlite3_malloc64(n);
+      if (!index->codebook) {
+        sqlite3_finalize(stmt);
+        return SQLITE_NOMEM;
+      }
+      memcpy(index->codebook, sqlite3_column_blob(stmt, 0), n);
+      index->ksub = (int)(n / centroidSize);
+    } else if (rc != SQLITE_DONE) {
+      sqlite3_finalize(stmt);
+      return rc;
+    }
+    sqlite3_finalize(stmt);
+  }
+  index->generation = generation;
+  index->medoid = medoid;
+  index->loaded = 1;
+  *out = index;
+  return SQLITE_OK;
+}
+
+/**
+ * @brief Write the medoid of a graph to the _info shadow table, and bump its
+ * generation.
+ */
+static int vec0_diskann_write_info(vec0_vtab *p, int vector_column_idx) {
+  int rc;
+  sqlite3_stmt *stmt = NULL;
+  struct Vec0DiskannIndex *index = &p->diskannIndexes[vector_column_idx];
+  char *zSql = sqlite3_mprintf(
+      "INSERT OR REPLACE INTO " VEC0_SHADOW_INFO_NAME "(key, value) VALUES "
+      "('DISKANN_GENERATION_%02d', ?), ('DISKANN_MEDOID_%02d', ?)",
+      p->schemaName, p->tableName, vector_column_idx, vector_column_idx);
+  if (!zSql) {
+    return SQLITE_NOMEM;
+  }
+  rc = sqlite3_prepare_v2(p->db, zSql, -1, &stmt, NULL);
+  sqlite3_free(zSql);
+  if (rc != SQLITE_OK) {
+    return rc;
+  }
+  sqlite3_bind_int64(stmt, 1, index->generation + 1);
+  sqlite3_bind_int64(stmt, 2, index->medoid);
+  rc = sqlite3_step(stmt);
+  sqlite3_finalize(stmt);
+  if (rc != SQLITE_DONE) {
+    vtab_set_error(&p->base, "Could not update DiskANN graph info");
+    return SQLITE_ERROR;
+  }
+  index->generation++;
+  return SQLITE_OK;
+}
+
+/**
+ * Reads the adjacency, vectors and PQ codes of a DiskANN vector column for a
+ * single search or write. Blob handles stay open and are only moved to
+ * another row when a read crosses to another chunk.
+ */
+struct Vec0DiskannReader {
+  vec0_vtab *p;
+  int vector_column_idx;
+  char *zNeighborsTable;
+  sqlite3_blob *neighbors;
+  i64 neighborsChunk;
+  sqlite3_blob *vectors;
+  i64 vectorsChunk;
+  sqlite3_blob *validity;
+  i64 validityChunk;
+  sqlite3_stmt *stmtCodes;
+};
+
+static int vec0_diskann_reader_init(vec0_vtab *p, int vector_column_idx,
+                                    struct Vec0DiskannReader *reader) {
+  memset(reader, 0, sizeof(*reader));
+  reader->p = p;
+  reader->vector_column_idx = vector_column_idx;
+  reader->zNeighborsTable = sqlite3_mprintf("%s_diskann_neighbors%02d",
+                                            p->tableName, vector_column_idx);
+  if (!reader->zNeighborsTable) {
+    return SQLITE_NOMEM;
+  }
+  return SQLITE_OK;
+}
+
+/**
+ * @brief Close the reader's blob handles, which must happen before the
+ * shadow tables they read are written to.
+ */
+static void vec0_diskann_reader_close(struct Vec0DiskannReader *reader) {
+  sqlite3_blob_close(reader->neighbors);
+  reader->neighbors = NULL;
+  sqlite3_blob_close(reader->vectors);
+  reader->vectors = NULL;
+  sqlite3_blob_close(reader->validity);
+  reader->validity = NULL;
+}
+
+static void vec0_diskann_reader_clear(struct Vec0DiskannReader *reader) {
+  vec0_diskann_reader_close(reader);
+  sqlite3_finalize(reader->stmtCodes);
+  reader->stmtCodes = NULL;
+  sqlite3_free(reader->zNeighborsTable);
+  reader->zNeighborsTable = NULL;
+}
+
+/**
+ * @brief Point a read-only blob handle at the given row, re-using the handle
+ * when it's already open.
+ */
+static int vec0_diskann_blob_seek(vec0_vtab *p, const char *zTable,
+                                  const char *zColumn, i64 rowid,
+                                  sqlite3_blob **blob, i64 *current) {
+  int rc;
+  if (*blob && *current == rowid) {
+    return SQLITE_OK;
+  }
+  if (*blob) {
+    rc = sqlite3_blob_reopen(*blob, rowid);
+    if (rc != SQLITE_OK) {
+      sqlite3_blob_close(*blob);
+      *blob = NULL;
+    }
+  } else {
+    rc = sqlite3_blob_open(p->db, p->schemaName, zTable, zColumn, rowid, 0,
+                           blob);
+  }
+  *current = rc == SQLITE_OK ? rowid : -1;
+  return rc;
+}
+
+/**
+ * @brief Read the neighbor list of a slot.
+ *
+ * @param adjacency must have room for r + 1 values: the neighbor count,
+ * followed by the neighbors. A chunk without any linked node reads as empty.
+ */
+static int vec0_diskann_read_neighbors(struct Vec0DiskannReader *reader,
+                                       i64 slot, i64 *adjacency) {
+  vec0_vtab *p = reader->p;
+  int r = p->vector_columns[reader->vector_column_idx].diskann.r;
+  i64 chunk_id = slot / p->chunk_size;
+  i64 chunk_offset = slot % p->chunk_size;
+  int rc = vec0_diskann_blob_seek(p, reader->zNeighborsTable, "neighbors",
+                                  chunk_id, &reader->neighbors,
+                                  &reader->neighborsChunk);
+  if (rc != SQLITE_OK) {
+    adjacency[0] = 0;
+    return SQLITE_OK;
+  }
+  int size = (r + 1) * sizeof(i64);
+  if (sqlite3_blob_bytes(reader->neighbors) != p->chunk_size * size) {
+    vtab_set_error(&p->base,
+                   VEC_INTERAL_ERROR "invalid DiskANN neighbors of chunk %lld",
+                   chunk_id);
+    return SQLITE_CORRUPT_VTAB;
+  }
+  rc = sqlite3_blob_read(reader->neighbors, adjacency, size,
+                         chunk_offset * size);
+  if (rc != SQLITE_OK) {
+    return rc;
+  }
+  if (adjacency[0] < 0 || adjacency[0] > r) {
+    vtab_set_error(&p->base,
+                   VEC_INTERAL_ERROR "invalid DiskANN neighbors of slot %lld",
+                   slot);
+    return SQLITE_CORRUPT_VTAB;
+  }
+  return SQLITE_OK;
+}
+
+/**
+ * @brief Read the full-precision vector of a slot from _vector_chunksNN.
+ */
+static int vec0_diskann_read_vector(struct Vec0DiskannReader *reader, i64 slot,
+                                    void *out) {
+  vec0_vtab *p = reader->p;
+  int idx = reader->vector_column_idx;
+  size_t size = vector_column_byte_size(p->vector_columns[idx]);
+  int rc = vec0_diskann_blob_seek(p, p->shadowVectorChunksNames[idx],
+                                  "vectors", slot / p->chunk_size,
+                                  &reader->vectors, &reader->vectorsChunk);
+  if (rc != SQLITE_OK) {
+    vtab_set_error(&p->base, "Could not read vectors of chunk %lld",
+                   slot / p->chunk_size);
+    return rc;
+  }
+  return sqlite3_blob_read(reader->vectors, out, size,
+                           (slot % p->chunk_size) * size);
+}
+
+/**
+ * @brief Determine if a slot holds a row, from the chunk's validity bitmap.
+ */
+static int vec0_diskann_read_valid(struct Vec0DiskannReader *reader, i64 slot,
+                                   int *valid) {
+  vec0_vtab *p = reader->p;
+  i64 chunk_offset = slot % p->chunk_size;
+  u8 byte;
+  int rc = vec0_diskann_blob_seek(p, p->shadowChunksName, "validity",
+                                  slot / p->chunk_size, &reader->validity,
+                                  &reader->validityChunk);
+  if (rc != SQLITE_OK) {
+    // the chunk was deleted by 'optimize'
+    *valid = 0;
+    return SQLITE_OK;
+  }
+  rc = sqlite3_blob_read(reader->validity, &byte, 1,
+                         chunk_offset / CHAR_BIT);
+  *valid = (byte >> (chunk_offset % CHAR_BIT)) & 1;
+  return rc;
+}
+
+/**
+ * @brief Get the PQ codes of a chunk, reading them into the resident cache if
+ * they weren't read before.
+ *
+ * @param out set to chunk_size codes of pq bytes, or NULL if the chunk has no
+ * codes.
+ */
+static int vec0_diskann_chunk_codes(struct Vec0DiskannReader *reader,
+                                    i64 chunk_id, const u8 **out) {
+  int rc;
+  vec0_vtab *p = reader->p;
+  int idx = reader->vector_column_idx;
+  struct Vec0DiskannIndex *index = &p->diskannIndexes[idx];
+  int pq = p->vector_columns[idx].diskann.pq;
+  u8 *codes = vec0_i64_map_get(&index->codes, chunk_id);
+  if (codes) {
+    *out = codes;
+    return SQLITE_OK;
+  }
+  *out = NULL;
+  if (!reader->stmtCodes) {
+    char *zSql = sqlite3_mprintf("SELECT codes FROM "
+                                 VEC0_SHADOW_DISKANN_CODES_N_NAME
+                                 " WHERE rowid = ?",
+                                 p->schemaName, p->tableName, idx);
+    if (!zSql) {
+      return SQLITE_NOMEM;
+    }
+    rc = sqlite3_prepare_v2(p->db, zSql, -1, &reader->stmtCodes, NULL);
+    sqlite3_free(zSql);
+    if (rc != SQLITE_OK) {
+      return rc;
+    }
+  }
+  sqlite3_reset(reader->stmtCodes);
+  sqlite3_bind_int64(reader->stmtCodes, 1, chunk_id);
+  rc = sqlite3_step(reader->stmtCodes);
+  if (rc == SQLITE_DONE) {
+    sqlite3_reset(reader->stmtCodes);
+    return SQLITE_OK;
+  }
+  if (rc != SQLITE_ROW) {
+    sqlite3_reset(reader->stmtCodes);
+    return rc;
+  }
+  i64 size = (i64)p->chunk_size * pq;
+  if (sqlite3_column_bytes(reader->stmtCodes, 0) != size) {
+    sqlite3_reset(reader->stmtCodes);
+    vtab_set_error(&p->base,
+                   VEC_INTERAL_ERROR "invalid DiskANN codes of chunk %lld",
+                   chunk_id);
+    return SQLITE_CORRUPT_VTAB;
+  }
+  codes = sqlite3_malloc64(size);
+  if (!codes) {
+    sqlite3_reset(reader->stmtCodes);
+    return SQLITE_NOMEM;
+  }
+  memcpy(codes, sqlite3_column_blob(reader->stmtCodes, 0), size);
+  sqlite3_reset(reader->stmtCodes);
+  rc = vec0_i64_map_put(&index->codes, chunk_id, codes);
+  if (rc != SQLITE_OK) {
+    sqlite3_free(codes);
+    return rc;
+  }
+  *out = codes;
+  return SQLITE_OK;
+}
+
+/**
+ * @brief Write the PQ code of a row to _diskann_codesNN and to the resident
+ * codes, if the codes of its chunk are cached.
+ */
+static int vec0_diskann_write_code(vec0_vtab *p, int vector_column_idx,
+                                   i64 chunk_id, i64 chunk_offset,
+                                   const void *vector) {
+  int rc;
+  struct VectorColumnDefinition *column = &p->vector_columns[vector_column_idx];
+  struct Vec0DiskannIndex *index = &p->diskannIndexes[vector_column_idx];
+  int pq = column->diskann.pq;
+  sqlite3_stmt *stmt = NULL;
+  sqlite3_blob *blob = NULL;
+  u8 code[VEC0_DISKANN_MAX_PQ];
+  f32 *v = sqlite3_malloc64(column->dimensions * sizeof(f32));
+  if (!v) {
+    return SQLITE_NOMEM;
+  }
+  vec0_ivf_prepare_vector(column, vector, v);
+  vec0_diskann_encode(column, index, v, code);
+  sqlite3_free(v);
+
+  char *zSql = sqlite3_mprintf("INSERT OR IGNORE INTO "
+                               VEC0_SHADOW_DISKANN_CODES_N_NAME
+                               "(rowid, codes) VALUES (?, zeroblob(?))",
+                               p->schemaName, p->tableName, vector_column_idx);
+  if (!zSql) {
+    return SQLITE_NOMEM;
+  }
+  rc = sqlite3_prepare_v2(p->db, zSql, -1, &stmt, NULL);
+  sqlite3_free(zSql);
+  if (rc != SQLITE_OK) {
+    return rc;
+  }
+  sqlite3_bind_int64(stmt, 1, chunk_id);
+  sqlite3_bind_int64(stmt, 2, (i64)p->chunk_size * pq);
+  rc = sqlite3_step(stmt);
+  sqlite3_finalize(stmt);
+  if (rc != SQLITE_DONE) {
+    return SQLITE_ERROR;
+  }
+
+  zSql = sqlite3_mprintf("%s_diskann_codes%02d", p->tableName,
+                         vector_column_idx);
+  if (!zSql) {
+    return SQLITE_NOMEM;
+  }
+  rc = sqlite3_blob_open(p->db, p->schemaName, zSql, "codes", chunk_id, 1,
+                         &blob);
+  sqlite3_free(zSql);
+  if (rc == SQLITE_OK) {
+    rc = sqlite3_blob_write(blob, code, pq, chunk_offset * pq);
+  }
+  sqlite3_blob_close(blob);
+  if (rc != SQLITE_OK) {
+    vtab_set_error(&p->base, "Could not write DiskANN code of chunk %lld",
+                   chunk_id);
+    return rc;
+  }
+
+  u8 *codes = vec0_i64_map_get(&index->codes, chunk_id);
+  if (codes) {
+    memcpy(codes + chunk_offset * pq, code, pq);
+  }
+  return SQLITE_OK;
+}
+
+/**
+ * A node of a DiskANN graph, as read by an insert or delete. Allocated as a
+ * single block, and only cached for the duration of that write.
+ */
+struct Vec0DiskannNode {
+  i64 slot;
+  // 0 if the slot holds no row. Stale links can still point to it.
+  int valid;
+  // 1 if the neighbors changed and weren't written to _diskann_neighborsNN yet
+  int dirty;
+  int count;
+  // room for r neighbor slots
+  i64 *neighbors;
+  // copy of the vector, in the column's element type
+  void *vector;
+};
+
+/**
+ * The nodes read or changed by a single insert or delete on a DiskANN graph.
+ */
+struct Vec0DiskannBuild {
+  vec0_vtab *p;
+  int vector_column_idx;
+  struct Vec0DiskannReader reader;
+  // slot -> struct Vec0DiskannNode *
+  struct Vec0I64Map nodes;
+  // r + 1 values, see vec0_diskann_read_neighbors()
+  i64 *adjacency;
+};
+
+static int vec0_diskann_build_init(vec0_vtab *p, int vector_column_idx,
+                                   struct Vec0DiskannBuild *build) {
+  memset(build, 0, sizeof(*build));
+  build->p = p;
+  build->vector_column_idx = vector_column_idx;
+  build->adjacency = sqlite3_malloc64(
+      (p->vector_columns[vector_column_idx].diskann.r + 1) * sizeof(i64));
+  if (!build->adjacency) {
+    return SQLITE_NOMEM;
+  }
+  return vec0_diskann_reader_init(p, vector_column_idx, &build->reader);
+}
+
+static void vec0_diskann_build_clear(struct Vec0DiskannBuild *build) {
+  vec0_diskann_reader_clear(&build->reader);
+  vec0_i64_map_clear(&build->nodes, sqlite3_free);
+  sqlite3_free(build->adjacency);
+  build->adjacency = NULL;
+}
+
+/**
+ * @brief Allocate a node with an empty neighbor list, as a single block.
+ */
+static struct Vec0DiskannNode *
+vec0_diskann_node_new(struct VectorColumnDefinition *column, i64 slot) {
+  size_t size = sizeof(struct Vec0DiskannNode) +
+                column->diskann.r * sizeof(i64) +
+                vector_column_byte_size(*column);
+  struct Vec0DiskannNode *node = sqlite3_malloc64(size);
+  if (!node) {
+    return NULL;
+  }
+  memset(node, 0, size);
+  node->slot = slot;
+  node->neighbors = (i64 *)(node + 1);
+  node->vector = node->neighbors + column->diskann.r;
+  return node;
+}
+
+/**
+ * @brief Get a node of the graph, reading its neighbors, vector and validity
+ * if it wasn't read by this write yet.
+ */
+static int vec0_diskann_node_get(struct Vec0DiskannBuild *build, i64 slot,
+                                 struct Vec0DiskannNode **out) {
+  int rc;
+  vec0_vtab *p = build->p;
+  struct VectorColumnDefinition *column =
+      &p->vector_columns[build->vector_column_idx];
+  struct Vec0DiskannNode *node = vec0_i64_map_get(&build->nodes, slot);
+  if (node) {
+    *out = node;
+    return SQLITE_OK;
+  }
+  node = vec0_diskann_node_new(column, slot);
+  if (!node) {
+    return SQLITE_NOMEM;
+  }
+  rc = vec0_diskann_read_valid(&build->reader, slot, &node->valid);
+  if (rc == SQLITE_OK && node->valid) {
+    rc = vec0_diskann_read_neighbors(&build->reader, slot, build->adjacency);
+    if (rc == SQLITE_OK) {
+      node->count = (int)build->adjacency[0];
+      memcpy(node->neighbors, build->adjacency + 1,
+             node->count * sizeof(i64));
+      rc = vec0_diskann_read_vector(&build->reader, slot, node->vector);
+    }
+  }
+  if (rc == SQLITE_OK) {
+    rc = vec0_i64_map_put(&build->nodes, slot, node);
+  }
+  if (rc != SQLITE_OK) {
+    sqlite3_free(node);
+    return rc;
+  }
+  *out = node;
+  return SQLITE_OK;
+}
+
+/**
+ * @brief Greedy search for the nearest nodes of a vector, with a search list
+ * of size l.
+ *
+ * @param except slot of the node being inserted, which is never visited
+ * @param expanded an empty array, set to every node whose neighbors were
+ * read: the candidate neighbors of the new node
+ */
+static int vec0_diskann_build_search(struct Vec0DiskannBuild *build,
+                                     const void *vector, i64 except,
+                                     struct Vec0AnnHeap *expanded) {
+  int rc = SQLITE_OK;
+  vec0_vtab *p = build->p;
+  struct VectorColumnDefinition *column =
+      &p->vector_columns[build->vector_column_idx];
+  struct Vec0DiskannIndex *index = &p->diskannIndexes[build->vector_column_idx];
+  int l = column->diskann.l;
+  struct Vec0AnnHeap candidates;
+  struct Vec0AnnHeap results;
+  struct Vec0I64Map visited;
+  memset(&candidates, 0, sizeof(candidates));
+  memset(&results, 0, sizeof(results));
+  memset(&visited, 0, sizeof(visited));
+  results.isMax = 1;
+
+  struct Vec0DiskannNode *entry;
+  rc = vec0_diskann_node_get(build, index->medoid, &entry);
+  if (rc != SQLITE_OK || !entry->valid) {
+    goto done;
+  }
+  f32 d = vec0_compute_distance(column, vector, entry->vector);
+  rc = vec0_i64_map_put(&visited, entry->slot, &vec0_diskann_visited);
+  if (rc == SQLITE_OK) {
+    rc = vec0_ann_heap_push(&candidates, d, entry->slot, entry);
+  }
+  if (rc == SQLITE_OK) {
+    rc = vec0_ann_heap_push(&results, d, entry->slot, entry);
+  }
+  if (rc != SQLITE_OK) {
+    goto done;
+  }
+
+  while (candidates.length > 0) {
+    struct Vec0AnnCandidate c = vec0_ann_heap_pop(&candidates);
+    struct Vec0DiskannNode *node = c.node;
+    if (results.length >= l && c.distance > results.items[0].distance) {
+      break;
+    }
+    rc = vec0_ann_heap_push(expanded, c.distance, c.id, c.node);
+    if (rc != SQLITE_OK) {
+      goto done;
+    }
+    for (int i = 0; i < node->count; i++) {
+      i64 slot = node->neighbors[i];
+      struct Vec0DiskannNode *neighbor;
+      if (slot == except || vec0_i64_map_get(&visited, slot)) {
+        continue;
+      }
+      rc = vec0_i64_map_put(&visited, slot, &vec0_diskann_visited);
+      if (rc != SQLITE_OK) {
+        goto done;
+      }
+      rc = vec0_diskann_node_get(build, slot, &neighbor);
+      if (rc != SQLITE_OK) {
+        goto done;
+      }
+      if (!neighbor->valid) {
+        continue;
+      }
+      d = vec0_compute_distance(column, vector, neighbor->vector);
+      if (results.length >= l && d >= results.items[0].distance) {
+        continue;
+      }
+      rc = vec0_ann_heap_push(&candidates, d, slot, neighbor);
+      if (rc == SQLITE_OK) {
+        rc = vec0_ann_heap_push(&results, d, slot, neighbor);
+      }
+      if (rc != SQLITE_OK) {
+        goto done;
+      }
+      if (results.length > l) {
+        vec0_ann_heap_pop(&results);
+      }
+    }
+  }
+
+done:
+  sqlite3_free(candidates.items);
+  sqlite3_free(results.items);
+  vec0_i64_map_clear(&visited, NULL);
+  return rc;
+}
+
+/**
+ * @brief RobustPrune of the Vamana paper: replace the neighbors of node with
+ * at most r of the given candidates, nearest first, skipping candidates
+ * that a picked neighbor is alpha times closer to than node is. Candidates
+ * may repeat, invalid ones and node itself are skipped.
+ */
+static int vec0_diskann_robust_prune(struct Vec0DiskannBuild *build,
+                                     struct Vec0DiskannNode *node,
+                                     struct Vec0DiskannNode **nodes, int n) {
+  struct VectorColumnDefinition *column =
+      &build->p->vector_columns[build->vector_column_idx];
+  struct Vec0AnnCandidate *candidates =
+      sqlite3_malloc64((n > 0 ? n : 1) * sizeof(*candidates));
+  u8 *pruned = sqlite3_malloc(n > 0 ? n : 1);
+  if (!candidates || !pruned) {
+    sqlite3_free(candidates);
+    sqlite3_free(pruned);
+    return SQLITE_NOMEM;
+  }
+  int nCandidates = 0;
+  for (int i = 0; i < n; i++) {
+    if (!nodes[i]->valid || nodes[i]->slot == node->slot) {
+      continue;
+    }
+    candidates[nCandidates].id = nodes[i]->slot;
+    candidates[nCandidates].node = nodes[i];
+    candidates[nCandidates].distance =
+        vec0_compute_distance(column, node->vector, nodes[i]->vector);
+    nCandidates++;
+  }
+  qsort(candidates, nCandidates, sizeof(*candidates), vec0_cmp_ann_candidate);
+  memset(pruned, 0, n > 0 ? n : 1);
+
+  int count = 0;
+  for (int i = 0; i < nCandidates && count < column->diskann.r; i++) {
+    // duplicates sort next to each other
+    if (pruned[i] || (i > 0 && candidates[i].id == candidates[i - 1].id)) {
+      continue;
+    }
+    node->neighbors[count++] = candidates[i].id;
+    struct Vec0DiskannNode *picked = candidates[i].node;
+    for (int j = i + 1; j < nCandidates; j++) {
+      if (pruned[j]) {
+        continue;
+      }
+      f32 d = vec0_compute_distance(
+          column, picked->vector,
+          ((struct Vec0DiskannNode *)candidates[j].node)->vector);
+      if (VEC0_DISKANN_ALPHA * d <= candidates[j].distance) {
+        pruned[j] = 1;
+      }
+    }
+  }
+  node->count = count;
+  node->dirty = 1;
+  sqlite3_free(candidates);
+  sqlite3_free(pruned);
+  return SQLITE_OK;
+}
+
+/**
+ * @brief Collect the nodes of a neighbor list, plus up to `extra` more.
+ *
+ * @param nodes set to an array of node->count + extra entries, filled with the
+ * node's neighbors
+ */
+static int vec0_diskann_neighbor_nodes(struct Vec0DiskannBuild *build,
+                                       struct Vec0DiskannNode *node, int extra,
+                                       struct Vec0DiskannNode ***nodes,
+                                       int *n) {
+  *n = 0;
+  *nodes = sqlite3_malloc64((node->count + extra + 1) * sizeof(**nodes));
+  if (!*nodes) {
+    return SQLITE_NOMEM;
+  }
+  for (int i = 0; i < node->count; i++) {
+    int rc = vec0_diskann_node_get(build, node->neighbors[i], &(*nodes)[*n]);
+    if (rc != SQLITE_OK) {
+      sqlite3_free(*nodes);
+      *nodes = NULL;
+      return rc;
+    }
+    (*n)++;
+  }
+  return SQLITE_OK;
+}
+
+/**
+ * @brief Write every dirty node's neighbors and the graph's _info keys. The
+ * reader's blob handles are closed first.
+ */
+static int vec0_diskann_flush(struct Vec0DiskannBuild *build) {
+  int rc = SQLITE_OK;
+  vec0_vtab *p = build->p;
+  int idx = build->vector_column_idx;
+  int r = p->vector_columns[idx].diskann.r;
+  int size = (r + 1) * sizeof(i64);
+  sqlite3_stmt *stmt = NULL;
+  sqlite3_blob *blob = NULL;
+  i64 blobChunk = -1;
+
+  vec0_diskann_reader_close(&build->reader);
+  char *zSql = sqlite3_mprintf("INSERT OR IGNORE INTO "
+                               VEC0_SHADOW_DISKANN_NEIGHBORS_N_NAME
+                               "(rowid, neighbors) VALUES (?, zeroblob(?))",
+                               p->schemaName, p->tableName, idx);
+  if (!zSql) {
+    return SQLITE_NOMEM;
+  }
+  rc = sqlite3_prepare_v2(p->db, zSql, -1, &stmt, NULL);
+  sqlite3_free(zSql);
+  if (rc != SQLITE_OK) {
+    return rc;
+  }
+
+  for (size_t i = 0; i < build->nodes.capacity; i++) {
+    struct Vec0DiskannNode *node = build->nodes.values[i];
+    if (!node || !node->dirty) {
+      continue;
+    }
+    i64 chunk_id = node->slot / p->chunk_size;
+    if (chunk_id != blobChunk) {
+      sqlite3_blob_close(blob);
+      blob = NULL;
+      blobChunk = -1;
+      sqlite3_reset(stmt);
+      sqlite3_bind_int64(stmt, 1, chunk_id);
+      sqlite3_bind_int64(stmt, 2, (i64)p->chunk_size * size);
+      if (sqlite3_step(stmt) != SQLITE_DONE) {
+        rc = SQLITE_ERROR;
+        goto done;
+      }
+      rc = sqlite3_blob_open(p->db, p->schemaName,
+                             build->reader.zNeighborsTable, "neighbors",
+                             chunk_id, 1, &blob);
+      if (rc != SQLITE_OK) {
+        goto done;
+      }
+      blobChunk = chunk_id;
+    }
+    build->adjacency[0] = node->count;
+    memcpy(build->adjacency + 1, node->neighbors, node->count * sizeof(i64));
+    memset(build->adjacency + 1 + node->count, 0,
+           (r - node->count) * sizeof(i64));
+    rc = sqlite3_blob_write(blob, build->adjacency, size,
+                            (node->slot % p->chunk_size) * size);
+    if (rc != SQLITE_OK) {
+      goto done;
+    }
+    node->dirty = 0;
+  }
+  sqlite3_blob_close(blob);
+  blob = NULL;
+  rc = vec0_diskann_write_info(p, idx);
+
+done:
+  if (rc != SQLITE_OK) {
+    vtab_set_error(&p->base, "Could not write DiskANN graph of %s",
+                   p->vector_columns[idx].name);
+  }
+  sqlite3_blob_close(blob);
+  sqlite3_finalize(stmt);
+  return rc;
+}
+
+/**
+ * @brief Add a row to the DiskANN graph of a vector column: link it to the
+ * pruned set of nodes a greedy search for it expands, then add the reverse
+ * links, pruning neighbor lists that overflow. The row must already be
+ * written to its chunk.
+ *
+ * @param p vec0 table
+ * @param vector_column_idx DiskANN vector column
+ * @param chunk_id chunk of the new row
+ * @param chunk_offset position of the new row in its chunk
+ * @param vector the row's vector
+ * @return int SQLITE_OK on success, error code otherwise
+ */
+int vec0_diskann_insert(vec0_vtab *p, int vector_column_idx, i64 chunk_id,
+                        i64 chunk_offset, const void *vector) {
+  int rc;
+  struct VectorColumnDefinition *column = &p->vector_columns[vector_column_idx];
+  struct Vec0DiskannIndex *index;
+  struct Vec0DiskannBuild build;
+  struct Vec0AnnHeap expanded;
+  struct Vec0DiskannNode **nodes = NULL;
+  memset(&build, 0, sizeof(build));
+  memset(&expanded, 0, sizeof(expanded));
+  i64 slot = chunk_id * p->chunk_size + chunk_offset;
+
+  rc = vec0_diskann_load(p, vector_column_idx, &index);
+  if (rc != SQLITE_OK) {
+    return rc;
+  }
+  if (index->ksub > 0) {
+    rc = vec0_diskann_write_code(p, vector_column_idx, chunk_id, chunk_offset,
+                                 vector);
+    if (rc != SQLITE_OK) {
+      return rc;
+    }
+  }
+  rc = vec0_diskann_build_init(p, vector_column_idx, &build);
+  if (rc != SQLITE_OK) {
+    goto done;
+  }
+  struct Vec0DiskannNode *node = vec0_diskann_node_new(column, slot);
+  if (!node) {
+    rc = SQLITE_NOMEM;
+    goto done;
+  }
+  memcpy(node->vector, vector, vector_column_byte_size(*column));
+  node->valid = 1;
+  node->dirty = 1;
+  rc = vec0_i64_map_put(&build.nodes, slot, node);
+  if (rc != SQLITE_OK) {
+    sqlite3_free(node);
+    goto done;
+  }
+
+  if (index->medoid < 0 || index->medoid == slot) {
+    index->medoid = slot;
+    rc = vec0_diskann_flush(&build);
+    goto done;
+  }
+
+  rc = vec0_diskann_build_search(&build, vector, slot, &expanded);
+  if (rc != SQLITE_OK) {
+    goto done;
+  }
+  nodes = sqlite3_malloc64((expanded.length + 1) * sizeof(*nodes));
+  if (!nodes) {
+    rc = SQLITE_NOMEM;
+    goto done;
+  }
+  for (int i = 0; i < expanded.length; i++) {
+    nodes[i] = expanded.items[i].node;
+  }
+  rc = vec0_diskann_robust_prune(&build, node, nodes, expanded.length);
+  if (rc != SQLITE_OK) {
+    goto done;
+  }
+
+  for (int i = 0; i < node->count; i++) {
+    struct Vec0DiskannNode *neighbor;
+    rc = vec0_diskann_node_get(&build, node->neighbors[i], &neighbor);
+    if (rc != SQLITE_OK) {
+      goto done;
+    }
+    int linked = 0;
+    for (int j = 0; j < neighbor->count; j++) {
+      if (neighbor->neighbors[j] == slot) {
+        linked = 1;
+        break;
+      }
+    }
+    if (linked) {
+      continue;
+    }
+    if (neighbor->count < column->diskann.r) {
+      neighbor->neighbors[neighbor->count++] = slot;
+      neighbor->dirty = 1;
+      continue;
+    }
+    struct Vec0DiskannNode **others;
+    int n;
+    rc = vec0_diskann_neighbor_nodes(&build, neighbor, 1, &others, &n);
+    if (rc != SQLITE_OK) {
+      goto done;
+    }
+    others[n++] = node;
+    rc = vec0_diskann_robust_prune(&build, neighbor, others, n);
+    sqlite3_free(others);
+    if (rc != SQLITE_OK) {
+      goto done;
+    }
+  }
+  rc = vec0_diskann_flush(&build);
+
+done:
+  sqlite3_free(nodes);
+  sqlite3_free(expanded.items);
+  vec0_diskann_build_clear(&build);
+  if (rc != SQLITE_OK) {
+    vec0_diskann_clear_index(p, vector_column_idx);
+  }
+  return rc;
+}
+
+/**
+ * @brief Remove a row from the DiskANN graph of a vector column. Every
+ * neighbor that linked to the row is re-pruned over its remaining neighbors
+ * and the row's neighbors. Links from other nodes are left dangling: they
+ * point to an empty slot, or to whichever row later takes the slot over.
+ *
+ * @param p vec0 table
+ * @param vector_column_idx DiskANN vector column
+ * @param chunk_id chunk of the deleted row
+ * @param chunk_offset position of the deleted row in its chunk
+ * @return int SQLITE_OK on success, error code otherwise
+ */
+int vec0_diskann_delete(vec0_vtab *p, int vector_column_idx, i64 chunk_id,
+                        i64 chunk_offset) {
+  int rc;
+  struct Vec0DiskannIndex *index;
+  struct Vec0DiskannBuild build;
+  struct Vec0DiskannNode *deleted;
+  struct Vec0DiskannNode **nodes = NULL;
+  sqlite3_stmt *stmt = NULL;
+  i64 slot = chunk_id * p->chunk_size + chunk_offset;
+
+  rc = vec0_diskann_load(p, vector_column_idx, &index);
+  if (rc != SQLITE_OK || index->medoid < 0) {
+    return rc;
+  }
+  rc = vec0_diskann_build_init(p, vector_column_idx, &build);
+  if (rc != SQLITE_OK) {
+    goto done;
+  }
+  // the row's validity bit may already be cleared, but its links are needed
+  deleted = vec0_diskann_node_new(&p->vector_columns[vector_column_idx], slot);
+  if (!deleted) {
+    rc = SQLITE_NOMEM;
+    goto done;
+  }
+  rc = vec0_i64_map_put(&build.nodes, slot, deleted);
+  if (rc != SQLITE_OK) {
+    sqlite3_free(deleted);
+    goto done;
+  }
+  rc = vec0_diskann_read_neighbors(&build.reader, slot, build.adjacency);
+  if (rc != SQLITE_OK) {
+    goto done;
+  }
+  deleted->count = (int)build.adjacency[0];
+  memcpy(deleted->neighbors, build.adjacency + 1,
+         deleted->count * sizeof(i64));
+
+  for (int i = 0; i < deleted->count; i++) {
+    struct Vec0DiskannNode *neighbor;
+    rc = vec0_diskann_node_get(&build, deleted->neighbors[i], &neighbor);
+    if (rc != SQLITE_OK) {
+      goto done;
+    }
+    int linked = 0;
+    for (int j = 0; j < neighbor->count; j++) {
+      if (neighbor->neighbors[j] == slot) {
+        linked = 1;
+        break;
+      }
+    }
+    if (!neighbor->valid || !linked) {
+      continue;
+    }
+    int n;
+    rc = vec0_diskann_neighbor_nodes(&build, neighbor, deleted->count, &nodes,
+                                     &n);
+    if (rc != SQLITE_OK) {
+      goto done;
+    }
+    for (int j = 0; j < deleted->count; j++) {
+      rc = vec0_diskann_node_get(&build, deleted->neighbors[j], &nodes[n]);
+      if (rc != SQLITE_OK) {
+        goto done;
+      }
+      n++;
+    }
+    // deleted is never valid to robust_prune(), as it's skipped by slot
+    rc = vec0_diskann_robust_prune(&build, neighbor, nodes, n);
+    sqlite3_free(nodes);
+    nodes = NULL;
+    if (rc != SQLITE_OK) {
+      goto done;
+    }
+  }
+  int nDeleted = deleted->count;
+  deleted->count = 0;
+  deleted->dirty = 1;
+
+  if (index->medoid == slot) {
+    index->medoid = -1;
+    for (int i = 0; i < nDeleted && index->medoid < 0; i++) {
+      struct Vec0DiskannNode *neighbor;
+      rc = vec0_diskann_node_get(&build, deleted->neighbors[i], &neighbor);
+      if (rc != SQLITE_OK) {
+        goto done;
+      }
+      if (neighbor->valid && neighbor->slot != slot) {
+        index->medoid = neighbor->slot;
+      }
+    }
+    if (index->medoid < 0) {
+      // no neighbors left, start searches from any other row
+      char *zSql = sqlite3_mprintf(
+          "SELECT chunk_id * %d + chunk_offset FROM " VEC0_SHADOW_ROWIDS_NAME
+          " WHERE chunk_id IS NOT NULL AND (chunk_id != ? OR "
+          "chunk_offset != ?) LIMIT 1",
+          p->chunk_size, p->schemaName, p->tableName);
+      if (!zSql) {
+        rc = SQLITE_NOMEM;
+        goto done;
+      }
+      rc = sqlite3_prepare_v2(p->db, zSql, -1, &stmt, NULL);
+      sqlite3_free(zSql);
+      if (rc != SQLITE_OK) {
+        goto done;
+      }
+      sqlite3_bind_int64(stmt, 1, chunk_id);
+      sqlite3_bind_int64(stmt, 2, chunk_offset);
+      rc = sqlite3_step(stmt);
+      if (rc == SQLITE_ROW) {
+        index->medoid = sqlite3_column_int64(stmt, 0);
+      } else if (rc != SQLITE_DONE) {
+        goto done;
+      }
+    }
+  }
+  rc = vec0_diskann_flush(&build);
+
+done:
+  sqlite3_finalize(stmt);
+  sqlite3_free(nodes);
+  vec0_diskann_build_clear(&build);
+  if (rc != SQLITE_OK) {
+    vec0_diskann_clear_index(p, vector_column_idx);
+  }
+  return rc;
+}
+
+struct Vec0DiskannMedoid {
+  struct VectorColumnDefinition *column;
+  // mean of the training sample
+  const f32 *mean;
+  f32 *buffer;
+  i64 rowid;
+  f32 distance;
+};
+
+static int vec0_diskann_medoid_visit(void *pCtx, i64 rowid,
+                                     const void *vector) {
+  struct Vec0DiskannMedoid *m = pCtx;
+  vec0_ivf_prepare_vector(m->column, vector, m->buffer);
+  f32 d = vec0_diskann_pq_distance(m->column, m->buffer, m->mean, 0,
+                                   m->column->dimensions);
+  if (d < m->distance) {
+    m->distance = d;
+    m->rowid = rowid;
+  }
+  return SQLITE_OK;
+}
+
+/**
+ * @brief (Re-)build the DiskANN index of a vector column: train the PQ
+ * codebook on a sample of the stored vectors, then insert every row again,
+ * starting with the row nearest to the sample's mean. Called from the
+ * 'optimize' command, after rows moved to their final chunk positions.
+ *
+ * @param p vec0 table
+ * @param vector_column_idx DiskANN vector column
+ * @return int SQLITE_OK on success, error code otherwise
+ */
+int vec0_diskann_rebuild(vec0_vtab *p, int vector_column_idx) {
+  int rc;
+  struct VectorColumnDefinition *column = &p->vector_columns[vector_column_idx];
+  struct Vec0DiskannIndex *index;
+  size_t dims = column->dimensions;
+  struct Vec0IvfTrainingSample sample;
+  struct Vec0DiskannMedoid medoid;
+  f32 *codebook = NULL;
+  f32 *subspace = NULL;
+  f32 *centroids = NULL;
+  f32 *mean = NULL;
+  sqlite3_stmt *stmt = NULL;
+  void *vector = NULL;
+  char *zSql;
+  memset(&sample, 0, sizeof(sample));
+  memset(&medoid, 0, sizeof(medoid));
+
+  rc = vec0_diskann_load(p, vector_column_idx, &index);
+  if (rc != SQLITE_OK) {
+    return rc;
+  }
+
+  sample.column = column;
+  sample.seed = 0xD15CA000ULL + vector_column_idx;
+  sample.capacity = SQLITE_VEC_IVF_MAX_TRAINING_SAMPLES;
+  sample.data = sqlite3_malloc64(sample.capacity * dims * sizeof(f32));
+  mean = sqlite3_malloc64(dims * sizeof(f32) * 2);
+  if (!sample.data || !mean) {
+    rc = SQLITE_NOMEM;
+    goto done;
+  }
+  rc = vec0_scan_vectors(p, vector_column_idx, vec0_ivf_sample_visit, &sample);
+  if (rc != SQLITE_OK) {
+    goto done;
+  }
+
+  const char *azReset[] = {
+      "DELETE FROM " VEC0_SHADOW_DISKANN_NEIGHBORS_N_NAME,
+      "DELETE FROM " VEC0_SHADOW_DISKANN_CODES_N_NAME,
+      "DELETE FROM " VEC0_SHADOW_INFO_NAME
+      " WHERE key = 'DISKANN_CODEBOOK_%02d'",
+  };
+  for (size_t i = 0; i < sizeof(azReset) / sizeof(azReset[0]); i++) {
+    zSql = sqlite3_mprintf(azReset[i], p->schemaName, p->tableName,
+                           vector_column_idx);
+    if (!zSql) {
+      rc = SQLITE_NOMEM;
+      goto done;
+    }
+    rc = sqlite3_prepare_v2(p->db, zSql, -1, &stmt, NULL);
+    sqlite3_free(zSql);
+    if (rc != SQLITE_OK) {
+      goto done;
+    }
+    if (sqlite3_step(stmt) != SQLITE_DONE) {
+      rc = SQLITE_ERROR;
+      goto done;
+    }
+    sqlite3_finalize(stmt);
+    stmt = NULL;
+  }
+
+  vec0_diskann_clear_index(p, vector_column_idx);
+  index->loaded = 1;
+  index->medoid = -1;
+  rc = vec0_diskann_write_info(p, vector_column_idx);
+  if (rc != SQLITE_OK || sample.length == 0) {
+    goto done;
+  }
+
+  // k-means on every subspace of the sample
+  int ksub = sample.length < VEC0_DISKANN_MAX_KSUB ? (int)sample.length
+                                                   : VEC0_DISKANN_MAX_KSUB;
+  codebook = sqlite3_malloc64(ksub * dims * sizeof(f32));
+  subspace = sqlite3_malloc64(sample.length * dims * sizeof(f32));
+  centroids = sqlite3_malloc64(ksub * dims * sizeof(f32));
+  if (!codebook || !subspace || !centroids) {
+    rc = SQLITE_NOMEM;
+    goto done;
+  }
+  for (int i = 0; i < column->diskann.pq; i++) {
+    size_t from = vec0_diskann_subspace_start(column, i);
+    size_t width = vec0_diskann_subspace_start(column, i + 1) - from;
+    for (i64 j = 0; j < sample.length; j++) {
+      memcpy(subspace + j * width, sample.data + j * dims + from,
+             width * sizeof(f32));
+    }
+    rc = vec0_ivf_kmeans(subspace, sample.length, width, ksub, 0,
+                         &sample.seed, centroids);
+    if (rc != SQLITE_OK) {
+      goto done;
+    }
+    for (int c = 0; c < ksub; c++) {
+      memcpy(codebook + c * dims + from, centroids + c * width,
+             width * sizeof(f32));
+    }
+  }
+
+  zSql = sqlite3_mprintf("INSERT OR REPLACE INTO " VEC0_SHADOW_INFO_NAME
+                         "(key, value) VALUES ('DISKANN_CODEBOOK_%02d', ?)",
+                         p->schemaName, p->tableName, vector_column_idx);
+  if (!zSql) {
+    rc = SQLITE_NOMEM;
+    goto done;
+  }
+  rc = sqlite3_prepare_v2(p->db, zSql, -1, &stmt, NULL);
+  sqlite3_free(zSql);
+  if (rc != SQLITE_OK) {
+    goto done;
+  }
+  sqlite3_bind_blob64(stmt, 1, codebook, ksub * dims * sizeof(f32),
+                      SQLITE_STATIC);
+  if (sqlite3_step(stmt) != SQLITE_DONE) {
+    rc = SQLITE_ERROR;
+    goto done;
+  }
+  sqlite3_finalize(stmt);
+  stmt = NULL;
+  index->codebook = codebook;
+  index->ksub = ksub;
+  codebook = NULL;
+
+  // the medoid is approximated by the row nearest to the sample's mean
+  for (size_t d = 0; d < dims; d++) {
+    double sum = 0.0;
+    for (i64 j = 0; j < sample.length; j++) {
+      sum += sample.data[j * dims + d];
+    }
+    mean[d] = (f32)(sum / sample.length);
+  }
+  medoid.column = column;
+  medoid.mean = mean;
+  medoid.buffer = mean + dims;
+  medoid.distance = FLT_MAX;
+  rc = vec0_scan_vectors(p, vector_column_idx, vec0_diskann_medoid_visit,
+                         &medoid);
+  if (rc != SQLITE_OK) {
+    goto done;
+  }
+
+  zSql = sqlite3_mprintf("SELECT rowid, chunk_id, chunk_offset FROM "
+                         VEC0_SHADOW_ROWIDS_NAME
+                         " WHERE chunk_id IS NOT NULL"
+                         " ORDER BY rowid != ?, rowid",
+                         p->schemaName, p->tableName);
+  if (!zSql) {
+    rc = SQLITE_NOMEM;
+    goto done;
+  }
+  rc = sqlite3_prepare_v2(p->db, zSql, -1, &stmt, NULL);
+  sqlite3_free(zSql);
+  if (rc != SQLITE_OK) {
+    goto done;
+  }
+  sqlite3_bind_int64(stmt, 1, medoid.rowid);
+  while ((rc = sqlite3_step(stmt)) == SQLITE_ROW) {
+    i64 rowid = sqlite3_column_int64(stmt, 0);
+    rc = vec0_get_vector_data(p, rowid, vector_column_idx, &vector, NULL);
+    if (rc != SQLITE_OK) {
+      goto done;
+    }
+    rc = vec0_diskann_insert(p, vector_column_idx,
+                             sqlite3_column_int64(stmt, 1),
+                             sqlite3_column_int64(stmt, 2), vector);
+    sqlite3_free(vector);
+    vector = NULL;
+    if (rc != SQLITE_OK) {
+      goto done;
+    }
+  }
+  if (rc != SQLITE_DONE) {
+    goto done;
+  }
+  rc = SQLITE_OK;
+
+done:
+  sqlite3_finalize(stmt);
+  sqlite3_free(vector);
+  sqlite3_free(sample.data);
+  sqlite3_free(mean);
+  sqlite3_free(codebook);
+  sqlite3_free(subspace);
+  sqlite3_free(centroids);
+  if (rc != SQLITE_OK) {
+    vec0_diskann_clear_index(p, vector_column_idx);
+  }
+  return rc;
+}
+
+static int vec0_cmp_ann_candidate_id(const void *a, const void *b) {
+  i64 ia = ((const struct Vec0AnnCandidate *)a)->id;
+  i64 ib = ((const struct Vec0AnnCandidate *)b)->id;
+  return ia < ib ? -1 : ia > ib ? 1 : 0;
+}
+
+/**
+ * @brief KNN query on the DiskANN graph of a vector column. Outputs the same
+ * as vec0Filter_knn_chunks_iter(). The search navigates by PQ distances, only
+ * reading the neighbor lists of the nodes it expands, then re-ranks the
+ * search list with full-precision vectors read chunk by chunk. Before the
+ * codebook is trained, navigation reads full-precision vectors instead.
+ *
+ * @param l size of the search list, at least k
+ * @param idxStr xFilter idxStr, for partition key, metadata and distance
+ * constraints
+ */
+int vec0_diskann_knn(vec0_vtab *p, int vector_column_idx, const void *query,
+                     i64 k, i64 l, struct Array *arrayRowidsIn,
+                     struct Array *aMetadataIn, const char *idxStr, int argc,
+                     sqlite3_value **argv, i64 **out_topk_rowids,
+                     f32 **out_topk_distances, i64 *out_used) {
+  int rc;
+  struct VectorColumnDefinition *column = &p->vector_columns[vector_column_idx];
+  size_t dims = column->dimensions;
+  int pq = column->diskann.pq;
+  struct Vec0DiskannIndex *index;
+  struct Vec0KnnChunkFilter filter;
+  struct Vec0DiskannReader reader;
+  struct Vec0AnnHeap candidates;
+  struct Vec0AnnHeap results;
+  struct Vec0I64Map visited;
+  memset(&filter, 0, sizeof(filter));
+  memset(&reader, 0, sizeof(reader));
+  memset(&candidates, 0, sizeof(candidates));
+  memset(&results, 0, sizeof(results));
+  memset(&visited, 0, sizeof(visited));
+  results.isMax = 1;
+  i64 *topk_rowids = NULL;
+  f32 *topk_distances = NULL;
+  i64 k_used = 0;
+  f32 *q = NULL;
+  f32 *table = NULL;
+  i64 *adjacency = NULL;
+  void *vector = NULL;
+  if (l < k) {
+    l = k;
+  }
+
+  topk_rowids = sqlite3_malloc64(k * sizeof(i64));
+  topk_distances = sqlite3_malloc64(k * sizeof(f32));
+  if (!topk_rowids || !topk_distances) {
+    rc = SQLITE_NOMEM;
+    goto cleanup;
+  }
+  rc = vec0_knn_chunk_filter_init(p, &filter, arrayRowidsIn, aMetadataIn,
+                                  idxStr, argc, argv);
+  if (rc != SQLITE_OK) {
+    goto cleanup;
+  }
+  rc = vec0_diskann_reader_init(p, vector_column_idx, &reader);
+  if (rc != SQLITE_OK) {
+    goto cleanup;
+  }
+  rc = vec0_diskann_load(p, vector_column_idx, &index);
+  if (rc != SQLITE_OK || index->medoid < 0) {
+    goto cleanup;
+  }
+
+  // q, then a prepared copy of a stored vector when navigating without codes
+  q = sqlite3_malloc64(dims * sizeof(f32) * 2);
+  adjacency = sqlite3_malloc64((column->diskann.r + 1) * sizeof(i64));
+  vector = sqlite3_malloc64(vector_column_byte_size(*column));
+  if (!q || !adjacency || !vector) {
+    rc = SQLITE_NOMEM;
+    goto cleanup;
+  }
+  vec0_ivf_prepare_vector(column, query, q);
+  if (index->ksub > 0) {
+    // distance of the query to every centroid of every subspace
+    table = sqlite3_malloc64(pq * index->ksub * sizeof(f32));
+    if (!table) {
+      rc = SQLITE_NOMEM;
+      goto cleanup;
+    }
+    for (int i = 0; i < pq; i++) {
+      size_t from = vec0_diskann_subspace_start(column, i);
+      size_t to = vec0_diskann_subspace_start(column, i + 1);
+      for (int c = 0; c < index->ksub; c++) {
+        table[i * index->ksub + c] = vec0_diskann_pq_distance(
+            column, q, index->codebook + c * dims, from, to);
+      }
+    }
+  }
+
+  i64 slot = index->medoid;
+  i64 nextNeighbor = 0;
+  i64 nNeighbors = 0;
+  rc = vec0_i64_map_put(&visited, slot, &vec0_diskann_visited);
+  if (rc != SQLITE_OK) {
+    goto cleanup;
+  }
+  while (1) {
+    // compute the PQ distance of slot, and queue it
+    const u8 *codes = NULL;
+    i64 chunk_id = slot / p->chunk_size;
+    i64 chunk_offset = slot % p->chunk_size;
+    f32 d = 0.0f;
+    if (table) {
+      rc = vec0_diskann_chunk_codes(&reader, chunk_id, &codes);
+      if (rc != SQLITE_OK) {
+        goto cleanup;
+      }
+    }
+    if (codes) {
+      const u8 *code = codes + chunk_offset * pq;
+      for (int i = 0; i < pq; i++) {
+        d += table[i * index->ksub + code[i]];
+      }
+    } else {
+      rc = vec0_diskann_read_vector(&reader, slot, vector);
+      if (rc != SQLITE_OK) {
+        goto cleanup;
+      }
+      vec0_ivf_prepare_vector(column, vector, q + dims);
+      d = vec0_diskann_pq_distance(column, q, q + dims, 0, dims);
+    }
+    if (!(results.length >= l && d >= results.items[0].distance)) {
+      struct Vec0KnnChunk *chunk;
+      rc = vec0_ann_heap_push(&candidates, d, slot, NULL);
+      if (rc != SQLITE_OK) {
+        goto cleanup;
+      }
+      // every reached chunk is filtered, if only for its validity bitmap
+      rc = vec0_knn_chunk_filter_get(p, &filter, chunk_id, &chunk);
+      if (rc != SQLITE_OK) {
+        goto cleanup;
+      }
+      if (chunk && bitmap_get(chunk->bitmap, chunk_offset)) {
+        rc = vec0_ann_heap_push(&results, d, slot, chunk);
+        if (rc != SQLITE_OK) {
+          goto cleanup;
+        }
+        if (results.length > l) {
+          vec0_ann_heap_pop(&results);
+        }
+      }
+    }
+
+    // move to the next unvisited neighbor of the expanded node, or expand
+    // the nearest candidate
+    slot = -1;
+    while (slot < 0) {
+      while (nextNeighbor < nNeighbors && slot < 0) {
+        i64 neighbor = adjacency[1 + nextNeighbor++];
+        if (!vec0_i64_map_get(&visited, neighbor)) {
+          slot = neighbor;
+        }
+      }
+      if (slot >= 0) {
+        break;
+      }
+      if (candidates.length == 0) {
+        break;
+      }
+      struct Vec0AnnCandidate c = vec0_ann_heap_pop(&candidates);
+      if (results.length >= l && c.distance > results.items[0].distance) {
+        break;
+      }
+      rc = vec0_diskann_read_neighbors(&reader, c.id, adjacency);
+      if (rc != SQLITE_OK) {
+        goto cleanup;
+      }
+      nextNeighbor = 0;
+      nNeighbors = adjacency[0];
+    }
+    if (slot < 0) {
+      break;
+    }
+    rc = vec0_i64_map_put(&visited, slot, &vec0_diskann_visited);
+    if (rc != SQLITE_OK) {
+      goto cleanup;
+    }
+  }
+
+  // re-rank with full-precision distances, reading the vectors chunk by
+  // chunk. Rows are sorted by slot, so each chunk's blob is opened once.
+  qsort(results.items, results.length, sizeof(*results.items),
+        vec0_cmp_ann_candidate_id);
+  int n = 0;
+  for (int i = 0; i < results.length; i++) {
+    struct Vec0AnnCandidate *c = &results.items[i];
+    struct Vec0KnnChunk *chunk = c->node;
+    rc = vec0_diskann_read_vector(&reader, c->id, vector);
+    if (rc != SQLITE_OK) {
+      goto cleanup;
+    }
+    f32 d = vec0_compute_distance(column, query, vector);
+    if (!vec0_distance_constraints_match(idxStr, argc, argv, d)) {
+      continue;
+    }
+    results.items[n].distance = d;
+    results.items[n].id = chunk->rowids[c->id % p->chunk_size];
+    n++;
+  }
+  qsort(results.items, n, sizeof(*results.items), vec0_cmp_ann_candidate);
+  for (int i = 0; i < n && k_used < k; i++) {
+    topk_rowids[k_used] = results.items[i].id;
+    topk_distances[k_used] = results.items[i].distance;
+    k_used++;
+  }
+
+cleanup:
+  sqlite3_free(candidates.items);
+  sqlite3_free(results.items);
+  vec0_i64_map_clear(&visited, NULL);
+  vec0_diskann_reader_clear(&reader);
+  vec0_knn_chunk_filter_clear(&filter);
+  sqlite3_free(q);
+  sqlite3_free(table);
+  sqlite3_free(adjacency);
+  sqlite3_free(vector);
+  if (rc != SQLITE_OK) {
+    sqlite3_free(topk_rowids);
+    sqlite3_free(topk_distances);
+    return rc;
+  }
+  *out_topk_rowids = topk_rowids;
+  *out_topk_distances = topk_distances;
+  *out_used = k_used;
+  return SQLITE_OK;
+}
+
+// Rows a paged KNN query fetches per page requested, so the following pages
+// are served from the page cache
+#define VEC0_KNN_PAGE_OVERFETCH_FACTOR 8
+// Most rows a paged KNN query fetches to find a page, when many rows tie
+#define VEC0_KNN_PAGE_MAX_ROWS 65536
+
+#define VEC0_PAGE_TOKEN_MAGIC 0x31545056
+#define VEC0_PAGE_TOKEN_SIZE 36
+
+/**
+ * Decoded value of the page_token column: the position of a row in the
+ * results of a paged KNN query, and the state of the table it was read from.
+ */
+struct Vec0PageToken {
+  u32 dataVersion;
+  i64 writeGeneration;
+  u64 fingerprint;
+  struct Vec0KnnPageBound bound;
+};
+
+static void vec0_page_token_encode(const struct Vec0PageToken *token,
+                                   u8 out[VEC0_PAGE_TOKEN_SIZE]) {
+  u32 magic = VEC0_PAGE_TOKEN_MAGIC;
+  memcpy(out, &magic, 4);
+  memcpy(out + 4, &token->dataVersion, 4);
+  memcpy(out + 8, &token->writeGeneration, 8);
+  memcpy(out + 16, &token->fingerprint, 8);
+  memcpy(out + 24, &token->bound.rowid, 8);
+  memcpy(out + 32, &token->bound.distance, 4);
+}
+
+static int vec0_page_token_decode(sqlite3_value *value,
+                                  struct Vec0PageToken *token) {
+  u32 magic;
+  const u8 *in = sqlite3_value_blob(value);
+  if (sqlite3_value_type(value) != SQLITE_BLOB ||
+      sqlite3_value_bytes(value) != VEC0_PAGE_TOKEN_SIZE) {
+    return SQLITE_ERROR;
+  }
+  memcpy(&magic, in, 4);
+  if (magic != VEC0_PAGE_TOKEN_MAGIC) {
+    return SQLITE_ERROR;
+  }
+  memcpy(&token->dataVersion, in + 4, 4);
+  memcpy(&token->writeGeneration, in + 8, 8);
+  memcpy(&token->fingerprint, in + 16, 8);
+  memcpy(&token->bound.rowid, in + 24, 8);
+  memcpy(&token->bound.distance, in + 32, 4);
+  return SQLITE_OK;
+}
+
+/**
+ * @brief Returns 1 if a row comes strictly after the bound in the
+ * (distance, rowid) order of paged KNN results.
+ */
+static int vec0_knn_page_is_after(const struct Vec0KnnPageBound *bound,
+                                  f32 distance, i64 rowid) {
+  return distance > bound->distance ||
+         (distance == bound->distance && rowid > bound->rowid);
+}
+
+static u64 vec0_fnv1a(u64 h, const void *data, size_t n) {
+  const u8 *bytes = data;
+  for (size_t i = 0; i < n; i++) {
+    h ^= bytes[i];
+    h *= 0x100000001b3ULL;
+  }
+  return h;
+}
+
+// Appends the type and contents of a constraint value to a KNN query key
+static void vec0_knn_query_key_value(sqlite3_str *key, sqlite3_value *value) {
+  int type = sqlite3_value_type(value);
+  sqlite3_str_append(key, (const char *)&type, sizeof(type));
+  switch (type) {
+  case SQLITE_INTEGER: {
+    i64 v = sqlite3_value_int64(value);
+    sqlite3_str_append(key, (const char *)&v, sizeof(v));
+    break;
+  }
+  case SQLITE_FLOAT: {
+    double v = sqlite3_value_double(value);
+    sqlite3_str_append(key, (const char *)&v, sizeof(v));
+    break;
+  }
+  case SQLITE_TEXT:
+  case SQLITE_BLOB: {
+    const void *v = sqlite3_value_blob(value);
+    int n = sqlite3_value_bytes(value);
+    sqlite3_str_append(key, (const char *)&n, sizeof(n));
+    if (n > 0) {
+      sqlite3_str_append(key, v, n);
+    }
+    break;
+  }
+  }
+}
+
+/**
+ * @brief Serializes everything that decides the rows of a KNN query: the
+ * vector column, query vector, and every constraint except k and page_token.
+ * Pages of the same query share it, see vec0Filter_knn_paged().
+ *
+ * @param key output, the bytes are appended to it
+ */
+static void vec0_knn_query_key(vec0_vtab *p, int vectorColumnIdx,
+                               const void *queryVector,
+                               struct Array *arrayRowidsIn,
+                               struct Array *aMetadataIn, const char *idxStr,
+                               int argc, sqlite3_value **argv,
+                               sqlite3_str *key) {
+  sqlite3_str_append(key, (const char *)&vectorColumnIdx,
+                     sizeof(vectorColumnIdx));
+  sqlite3_str_append(
+      key, queryVector,
+      (int)vector_column_byte_size(p->vector_columns[vectorColumnIdx]));
+  for (int i = 0; i < argc; i++) {
+    const char *block = &idxStr[1 + (i * 4)];
+    // query vectors of the other columns of a fused query are kept as values
+    if ((block[0] == VEC0_IDXSTR_KIND_KNN_MATCH && block[1] == '_') ||
+        block[0] == VEC0_IDXSTR_KIND_KNN_K ||
+        block[0] == VEC0_IDXSTR_KIND_KNN_PAGE_TOKEN) {
+      continue;
+    }
+    sqlite3_str_append(key, block, 4);
+    // `in (...)` values are serialized below, from their parsed arrays
+    if (block[0] == VEC0_IDXSTR_KIND_KNN_ROWID_IN ||
+        (block[0] == VEC0_IDXSTR_KIND_METADATA_CONSTRAINT &&
+         block[2] == VEC0_METADATA_OPERATOR_IN)) {
+      continue;
+    }
+#if COMPILER_SUPPORTS_VTAB_IN
+    if (block[0] == VEC0_IDXSTR_KIND_KNN_PARTITON_CONSTRAINT &&
+        block[2] == VEC0_PARTITION_OPERATOR_IN) {
+      sqlite3_value *item;
+      int rc;
+      for (rc = sqlite3_vtab_in_first(argv[i], &item); rc == SQLITE_OK && item;
+           rc = sqlite3_vtab_in_next(argv[i], &item)) {
+        vec0_knn_query_key_value(key, item);
+      }
+      continue;
+    }
+#endif
+    vec0_knn_query_key_value(key, argv[i]);
+  }
+  if (arrayRowidsIn) {
+    sqlite3_str_append(
+        key, arrayRowidsIn->z,
+        (int)(arrayRowidsIn->length * arrayRowidsIn->element_size));
+  }
+  for (size_t i = 0; aMetadataIn && i < aMetadataIn->length; i++) {
+    struct Vec0MetadataIn *item = &((struct Vec0MetadataIn *)aMetadataIn->z)[i];
+    // the text of a filter expression is its key, in argv
+    if (item->program) {
+      continue;
+    }
+    sqlite3_str_append(key, (const char *)&item->argv_idx,
+                       sizeof(item->argv_idx));
+    if (p->metadata_columns[item->metadata_idx].kind ==
+        VEC0_METADATA_COLUMN_KIND_TEXT) {
+      for (size_t j = 0; j < item->array.length; j++) {
+        struct Vec0MetadataInTextEntry *entry =
+            &((struct Vec0MetadataInTextEntry *)item->array.z)[j];
+        sqlite3_str_append(key, (const char *)&entry->n, sizeof(entry->n));
+        sqlite3_str_append(key, entry->zString, entry->n);
+      }
+    } else {
+      sqlite3_str_append(
+          key, item->array.z,
+          (int)(item->array.length * item->array.element_size));
+    }
+  }
+}
+
+/**
+ * @brief Finds cached results of a paged KNN query that can serve the page
+ * after the bound: the rows must be current, start at or before the bound,
+ * and either hold k rows after it or reach the end of the results.
+ *
+ * @param after bound of the page, NULL for the first page
+ * @param offset output: index of the first cached row of the page
+ * @return the cache entry, NULL if none can serve the page
+ */
+static struct Vec0KnnPageCacheEntry *
+vec0_knn_page_cache_find(vec0_vtab *p, u64 fingerprint, u32 dataVersion,
+                         const struct Vec0KnnPageBound *after, i64 k,
+                         i64 *offset) {
+  for (int i = 0; i < VEC0_KNN_PAGE_CACHE_SIZE; i++) {
+    struct Vec0KnnPageCacheEntry *entry = &p->pageCache[i];
+    if (!entry->used || entry->fingerprint != fingerprint ||
+        entry->dataVersion != dataVersion ||
+        entry->writeGeneration != p->writeGeneration) {
+      continue;
+    }
+    if (entry->hasStart) {
+      struct Vec0KnnPageBound start = {entry->startDistance, entry->startRowid};
+      if (!after || vec0_knn_page_is_after(after, start.distance, start.rowid)) {
+        continue;
+      }
+    }
+    i64 lo = 0;
+    i64 hi = entry->n;
+    while (after && lo < hi) {
+      i64 mid = lo + (hi - lo) / 2;
+      if (vec0_knn_page_is_after(after, entry->distances[mid],
+                                 entry->rowids[mid])) {
+        hi = mid;
+      } else {
+        lo = mid + 1;
+      }
+    }
+    if (entry->n - lo >= k || entry->complete) {
+      *offset = lo;
+      return entry;
+    }
+  }
+  return NULL;
+}
+
+/**
+ * @brief Caches the results of a paged KNN query, evicting the least
+ * recently used entry. Takes ownership of rowids and distances.
+ */
+static void vec0_knn_page_cache_put(vec0_vtab *p, u64 fingerprint,
+                                    u32 dataVersion,
+                                    const struct Vec0KnnPageBound *start,
+                                    i64 *rowids, f32 *distances, i64 n,
+                                    int complete) {
+  struct Vec0KnnPageCacheEntry *entry = &p->pageCache[0];
+  for (int i = 1; i < VEC0_KNN_PAGE_CACHE_SIZE && entry->used; i++) {
+    if (!p->pageCache[i].used ||
+        p->pageCache[i].lastUsed < entry->lastUsed) {
+      entry = &p->pageCache[i];
+    }
+  }
+  sqlite3_free(entry->rowids);
+  sqlite3_free(entry->distances);
+  memset(entry, 0, sizeof(*entry));
+  entry->used = 1;
+  entry->fingerprint = fingerprint;
+  entry->dataVersion = dataVersion;
+  entry->writeGeneration = p->writeGeneration;
+  if (start) {
+    entry->hasStart = 1;
+    entry->startDistance = start->distance;
+    entry->startRowid = start->rowid;
+  }
+  entry->rowids = rowids;
+  entry->distances = distances;
+  entry->n = n;
+  entry->complete = complete;
+  entry->lastUsed = ++p->pageCacheClock;
+}
+
+/**
+ * @brief Finds the k nearest rows of a KNN query with the index of the vector
+ * column, see vec0Filter_knn_chunks_iter() for the outputs.
+ *
+ * @param after only return rows after this bound, NULL for all rows. Graph
+ * indexes ignore it, their callers filter the results instead.
+ * @param fusion the other matched columns of a fused query, NULL if none.
+ * Fused queries always scan chunks.
+ * @param perPartition find the k nearest rows of every partition instead, with
+ * a chunk scan
+ * @param budget limits of the chunk scan, NULL if none. Graph indexes don't
+ * take one, vec0Filter_knn() rejects budgets on them.
+ * @param out_topk_vectors if not NULL, set to the vectors of the rows found
+ * by a chunk scan, or to NULL for graph indexes.
+ */
+static int vec0Filter_knn_fetch(vec0_vtab *p,
+                                struct VectorColumnDefinition *vector_column,
+                                int vectorColumnIdx, struct Array *arrayRowidsIn,
+                                struct Array *aMetadataIn,
+                                struct Vec0ChunkCandidates *candidates,
+                                const char *idxStr, int argc,
+                                sqlite3_value **argv, void *queryVector, i64 k,
+                                i64 ef_search,
+                                const struct Vec0KnnPageBound *after,
+                                const struct Vec0KnnFusion *fusion,
+                                int perPartition,
+                                struct Vec0KnnBudget *budget,
+                                i64 **out_topk_rowids,
+                                f32 **out_topk_distances,
+                                void **out_topk_vectors, i64 *out_used) {
+  int rc;
+  sqlite3_stmt *stmtChunks = NULL;
+  if (out_topk_vectors) {
+    *out_topk_vectors = NULL;
+  }
+  // fused and per-partition queries always scan chunks, the graphs only know
+  // their own column and one top k
+  if (!fusion && !perPartition &&
+      vector_column->index_type == VEC0_INDEX_TYPE_HNSW) {
+    return vec0_hnsw_knn(p, vectorColumnIdx, queryVector, k, ef_search,
+                         arrayRowidsIn, aMetadataIn, idxStr, argc, argv,
+                         out_topk_rowids, out_topk_distances, out_used);
+  }
+  if (!fusion && !perPartition &&
+      vector_column->index_type == VEC0_INDEX_TYPE_DISKANN) {
+    return vec0_diskann_knn(p, vectorColumnIdx, queryVector, k, ef_search,
+                            arrayRowidsIn, aMetadataIn, idxStr, argc, argv,
+                            out_topk_rowids, out_topk_distances, out_used);
+  }
+  // with a budget, the newest chunks are the ones scanned
+  enum vec0_chunks_order order = VEC0_CHUNKS_ORDER_NONE;
+  if (perPartition) {
+    order = VEC0_CHUNKS_ORDER_PARTITION;
+  } else if (budget) {
+    order = VEC0_CHUNKS_ORDER_NEWEST;
+  }
+  rc = vec0_chunks_iter(p, idxStr, argc, argv, 0, order, &stmtChunks);
+  if (rc != SQLITE_OK) {
+    // IMP: V06942_23781
+    vtab_set_error(&p->base, "Error preparing stmtChunk: %s",
+                   sqlite3_errmsg(p->db));
+    return rc;
+  }
+  rc = vec0Filter_knn_chunks_iter(p, stmtChunks, vector_column, vectorColumnIdx,
+                                  arrayRowidsIn, aMetadataIn, candidates,
+                                  idxStr, argc, argv, queryVector, k, after,
+                                  fusion, perPartition, budget,
+                                  out_topk_rowids, out_topk_distances,
+                                  out_topk_vectors, out_used);
+  sqlite3_finalize(stmtChunks);
+  return rc;
+}
+
+/**
+ * @brief Finds one page of a paged KNN query: the k rows after the page
+ * token, in (distance, rowid) order. Pages are served from the page cache
+ * while the table is unchanged. Otherwise k * VEC0_KNN_PAGE_OVERFETCH_FACTOR
+ * rows after the token are fetched, and only the rows strictly nearer than
+ * the farthest fetched one are kept, since rows tied with it may have been
+ * left out. The fetch grows until that prefix holds k rows.
+ *
+ * @param pageToken value of the page_token constraint, NULL for the first
+ * page
+ * @param knn_data output: paging fields of the cursor
+ */
+static int vec0Filter_knn_paged(
+    vec0_vtab *p, struct VectorColumnDefinition *vector_column,
+    int vectorColumnIdx, struct Array *arrayRowidsIn, struct Array *aMetadataIn,
+    struct Vec0ChunkCandidates *candidates, const char *idxStr, int argc,
+    sqlite3_value **argv, void *queryVector, i64 k, i64 ef_search,
+    const struct Vec0KnnFusion *fusion, sqlite3_value *pageToken,
+    struct vec0_query_knn_data *knn_data, i64 **out_topk_rowids,
+    f32 **out_topk_distances, i64 *out_used) {
+  int rc = SQLITE_OK;
+  struct Vec0KnnPageBound after;
+  int hasAfter = 0;
+  int tokenCurrent = 1;
+  struct Vec0AnnCandidate *rows = NULL;
+  i64 nRows = 0;
+  i64 nSafe = 0;
+  int complete = 0;
+  i64 *fetch_rowids = NULL;
+  f32 *fetch_distances = NULL;
+  i64 *cache_rowids = NULL;
+  f32 *cache_distances = NULL;
+  i64 *topk_rowids = NULL;
+  f32 *topk_distances = NULL;
+  i64 k_used = 0;
+
+  sqlite3_str *key = sqlite3_str_new(NULL);
+  vec0_knn_query_key(p, vectorColumnIdx, queryVector, arrayRowidsIn,
+                     aMetadataIn, idxStr, argc, argv, key);
+  if (sqlite3_str_errcode(key) != SQLITE_OK) {
+    sqlite3_free(sqlite3_str_finish(key));
+    return SQLITE_NOMEM;
+  }
+  u64 fingerprint = vec0_fnv1a(0xcbf29ce484222325ULL, sqlite3_str_value(key),
+                               sqlite3_str_length(key));
+  sqlite3_free(sqlite3_str_finish(key));
+  u32 dataVersion = vec0_data_version(p);
+  knn_data->paging = 1;
+  knn_data->fingerprint = fingerprint;
+  knn_data->dataVersion = dataVersion;
+  knn_data->writeGeneration = p->writeGeneration;
+
+  if (pageToken && sqlite3_value_type(pageToken) != SQLITE_NULL) {
+    struct Vec0PageToken token;
+    if (vec0_page_token_decode(pageToken, &token) != SQLITE_OK) {
+      vtab_set_error(&p->base, "Invalid page_token value, expected a "
+                               "page_token returned by a KNN query.");
+      return SQLITE_ERROR;
+    }
+    if (token.fingerprint != fingerprint) {
+      vtab_set_error(&p->base,
+                     "page_token was returned by a different KNN query, the "
+                     "query vector and constraints must match.");
+      return SQLITE_ERROR;
+    }
+    after = token.bound;
+    hasAfter = 1;
+    tokenCurrent = token.dataVersion == dataVersion &&
+                   token.writeGeneration == p->writeGeneration;
+  }
+
+  i64 offset;
+  struct Vec0KnnPageCacheEntry *entry =
+      tokenCurrent ? vec0_knn_page_cache_find(p, fingerprint, dataVersion,
+                                              hasAfter ? &after : NULL, k,
+                                              &offset)
+                   : NULL;
+  if (entry) {
+    k_used = min(k, entry->n - offset);
+    topk_rowids = sqlite3_malloc64((k_used ? k_used : 1) * sizeof(i64));
+    topk_distances = sqlite3_malloc64((k_used ? k_used : 1) * sizeof(f32));
+    if (!topk_rowids || !topk_distances) {
+      rc = SQLITE_NOMEM;
+      goto cleanup;
+    }
+    memcpy(topk_rowids, entry->rowids + offset, k_used * sizeof(i64));
+    memcpy(topk_distances, entry->distances + offset, k_used * sizeof(f32));
+    entry->lastUsed = ++p->pageCacheClock;
+    goto done;
+  }
+
+  i64 n = k * VEC0_KNN_PAGE_OVERFETCH_FACTOR;
+  if (n > VEC0_KNN_PAGE_MAX_ROWS) {
+    n = VEC0_KNN_PAGE_MAX_ROWS;
+  }
+  if (n < k) {
+    n = k;
+  }
+  while (1) {
+    i64 used = 0;
+    rc = vec0Filter_knn_fetch(p, vector_column, vectorColumnIdx, arrayRowidsIn,
+                              aMetadataIn, candidates, idxStr, argc, argv,
+                              queryVector, n, ef_search,
+                              hasAfter ? &after : NULL, fusion, 0, NULL,
+                              &fetch_rowids, &fetch_distances, NULL, &used);
+    if (rc != SQLITE_OK) {
+      goto cleanup;
+    }
+    complete = used < n;
+    rows = sqlite3_malloc64((used ? used : 1) * sizeof(*rows));
+    if (!rows) {
+      rc = SQLITE_NOMEM;
+      goto cleanup;
+    }
+    f32 farthest = 0.0f;
+    nRows = 0;
+    for (i64 i = 0; i < used; i++) {
+      if (i == 0 || fetch_distances[i] > farthest) {
+        farthest = fetch_distances[i];
+      }
+      if (hasAfter && !vec0_knn_page_is_after(&after, fetch_distances[i],
+                                              fetch_rowids[i])) {
+        continue;
+      }
+      rows[nRows].distance = fetch_distances[i];
+      rows[nRows].id = fetch_rowids[i];
+      rows[nRows].node = NULL;
+      nRows++;
+    }
+    sqlite3_free(fetch_rowids);
+    sqlite3_free(fetch_distances);
+    fetch_rowids = NULL;
+    fetch_distances = NULL;
+    qsort(rows, nRows, sizeof(*rows), vec0_cmp_ann_candidate);
+
+    nSafe = nRows;
+    if (!complete) {
+      nSafe = 0;
+      while (nSafe < nRows && rows[nSafe].distance < farthest) {
+        nSafe++;
+      }
+    }
+    if (nSafe >= k || complete || n >= VEC0_KNN_PAGE_MAX_ROWS) {
+      break;
+    }
+    sqlite3_free(rows);
+    rows = NULL;
+    n = n * 2 > VEC0_KNN_PAGE_MAX_ROWS ? VEC0_KNN_PAGE_MAX_ROWS : n * 2;
+  }
+  // more than VEC0_KNN_PAGE_MAX_ROWS rows tie: page through the fetched ones
+  if (nSafe == 0) {
+    nSafe = nRows;
+  }
+
+  cache_rowids = sqlite3_malloc64((nSafe ? nSafe : 1) * sizeof(i64));
+  cache_distances = sqlite3_malloc64((nSafe ? nSafe : 1) * sizeof(f32));
+  k_used = min(k, nSafe);
+  topk_rowids = sqlite3_malloc64((k_used ? k_used : 1) * sizeof(i64));
+  topk_distances = sqlite3_malloc64((k_used ? k_used : 1) * sizeof(f32));
+  if (!cache_rowids || !cache_distances || !topk_rowids || !topk_distances) {
+    rc = SQLITE_NOMEM;
+    goto cleanup;
+  }
+  for (i64 i = 0; i < nSafe; i++) {
+    cache_rowids[i] = rows[i].id;
+    cache_distances[i] = rows[i].distance;
+  }
+  memcpy(topk_rowids, cache_rowids, k_used * sizeof(i64));
+  memcpy(topk_distances, cache_distances, k_used * sizeof(f32));
+  vec0_knn_page_cache_put(p, fingerprint, dataVersion,
+                          hasAfter ? &after : NULL, cache_rowids,
+                          cache_distances, nSafe, complete && nSafe == nRows);
+  cache_rowids = NULL;
+  cache_distances = NULL;
+
+done:
+  *out_topk_rowids = topk_rowids;
+  *out_topk_distances = topk_distances;
+  *out_used = k_used;
+  topk_rowids = NULL;
+  topk_distances = NULL;
+
+cleanup:
+  sqlite3_free(rows);
+  sqlite3_free(fetch_rowids);
+  sqlite3_free(fetch_distances);
+  sqlite3_free(cache_rowids);
+  sqlite3_free(cache_distances);
+  sqlite3_free(topk_rowids);
+  sqlite3_free(topk_distances);
+  return rc;
+}
+
+/**
+ * @brief Key of a KNN query in the result cache: k, then everything
+ * vec0_knn_query_key() serializes.
+ *
+ * @param out_key output, must be freed with sqlite3_free()
+ */
+static int vec0_result_cache_key(vec0_vtab *p, int vectorColumnIdx,
+                                 const void *queryVector, i64 k,
+                                 struct Array *arrayRowidsIn,
+                                 struct Array *aMetadataIn, const char *idxStr,
+                                 int argc, sqlite3_value **argv,
+                                 char **out_key, int *out_nKey) {
+  sqlite3_str *key = sqlite3_str_new(NULL);
+  sqlite3_str_append(key, (const char *)&k, sizeof(k));
+  vec0_knn_query_key(p, vectorColumnIdx, queryVector, arrayRowidsIn,
+                     aMetadataIn, idxStr, argc, argv, key);
+  int rc = sqlite3_str_errcode(key);
+  int nKey = sqlite3_str_length(key);
+  char *zKey = sqlite3_str_finish(key);
+  if (rc != SQLITE_OK || !zKey) {
+    sqlite3_free(zKey);
+    return SQLITE_NOMEM;
+  }
+  *out_key = zKey;
+  *out_nKey = nKey;
+  return SQLITE_OK;
+}
+
+/**
+ * @brief Drops the result cache when the table changed since it was filled,
+ * through this connection or another one.
+ */
+static void vec0_result_cache_sync(vec0_vtab *p) {
+  u32 dataVersion = vec0_data_version(p);
+  if (p->resultCacheWriteGeneration != p->writeGeneration ||
+      p->resultCacheDataVersion != dataVersion) {
+    vec0_result_cache_clear(p);
+    p->resultCacheWriteGeneration = p->writeGeneration;
+    p->resultCacheDataVersion = dataVersion;
+  }
+}
+
+/**
+ * @brief Looks up the rows of a KNN query in the result cache.
+ *
+ * @param found output: 1 on a hit, then the outputs are set like
+ * vec0Filter_knn_chunks_iter() does
+ */
+static int vec0_result_cache_get(vec0_vtab *p, const char *key, int nKey,
+                                 int *found, i64 **out_rowids,
+                                 f32 **out_distances, i64 *out_used,
+                                 int *out_exact) {
+  vec0_result_cache_sync(p);
+  u64 hash = vec0_fnv1a(0xcbf29ce484222325ULL, key, nKey);
+  for (int i = 0; i < p->resultCacheSize; i++) {
+    struct Vec0KnnResultCacheEntry *entry = &p->resultCache[i];
+    if (!entry->key || entry->hash != hash || entry->nKey != nKey ||
+        memcmp(entry->key, key, nKey) != 0) {
+      continue;
+    }
+    i64 *rowids = sqlite3_malloc64((entry->n ? entry->n : 1) * sizeof(i64));
+    f32 *distances = sqlite3_malloc64((entry->n ? entry->n : 1) * sizeof(f32));
+    if (!rowids || !distances) {
+      sqlite3_free(rowids);
+      sqlite3_free(distances);
+      return SQLITE_NOMEM;
+    }
+    memcpy(rowids, entry->rowids, entry->n * sizeof(i64));
+    memcpy(distances, entry->distances, entry->n * sizeof(f32));
+    entry->lastUsed = ++p->resultCacheClock;
+    p->resultCacheHits++;
+    *out_rowids = rowids;
+    *out_distances = distances;
+    *out_used = entry->n;
+    *out_exact = entry->exact;
+    *found = 1;
+    return SQLITE_OK;
+  }
+  p->resultCacheMisses++;
+  *found = 0;
+  return SQLITE_OK;
+}
+
+/**
+ * @brief Adds the rows of a KNN query to the result cache, evicting the
+ * least recently used entries until it fits the entry and byte budgets.
+ * Takes ownership of key, the rows are copied.
+ */
+static int vec0_result_cache_put(vec0_vtab *p, char *key, int nKey,
+                                 const i64 *rowids, const f32 *distances,
+                                 i64 n, int exact) {
+  i64 bytes = nKey + n * (i64)(sizeof(i64) + sizeof(f32));
+  if (bytes > p->resultCacheMaxBytes) {
+    sqlite3_free(key);
+    return SQLITE_OK;
+  }
+  struct Vec0KnnResultCacheEntry *slot;
+  while (1) {
+    struct Vec0KnnResultCacheEntry *oldest = NULL;
+    slot = NULL;
+    for (int i = 0; i < p->resultCacheSize; i++) {
+      struct Vec0KnnResultCacheEntry *entry = &p->resultCache[i];
+      if (!entry->key) {
+        slot = entry;
+      } else if (!oldest || entry->lastUsed < oldest->lastUsed) {
+        oldest = entry;
+      }
+    }
+    if (slot && p->resultCacheBytes + bytes <= p->resultCacheMaxBytes) {
+      break;
+    }
+    vec0_result_cache_entry_free(p, oldest);
+  }
+  slot->rowids = sqlite3_malloc64((n ? n : 1) * sizeof(i64));
+  slot->distances = sqlite3_malloc64((n ? n : 1) * sizeof(f32));
+  if (!slot->rowids || !slot->distances) {
+    sqlite3_free(key);
+    vec0_result_cache_entry_free(p, slot);
+    return SQLITE_NOMEM;
+  }
+  memcpy(slot->rowids, rowids, n * sizeof(i64));
+  memcpy(slot->distances, distances, n * sizeof(f32));
+  slot->key = key;
+  slot->nKey = nKey;
+  slot->hash = vec0_fnv1a(0xcbf29ce484222325ULL, key, nKey);
+  slot->n = n;
+  slot->exact = exact;
+  slot->lastUsed = ++p->resultCacheClock;
+  p->resultCacheBytes += bytes;
+  return SQLITE_OK;
+}
+
+/**
+ * @brief `vec_result_cache_stats(table_name)`: the result cache of a vec0
+ * table open on this connection, as JSON with the live entries, their
+ * bytes, and the hit/miss counters. NULL if the table isn't open or has no
+ * result cache.
+ */
+static void vec_result_cache_stats(sqlite3_context *context, int argc,
+                                   sqlite3_value **argv) {
+  assert(argc == 1);
+  struct Vec0Connection *connection = sqlite3_user_data(context);
+  const char *zTable = (const char *)sqlite3_value_text(argv[0]);
+  if (!zTable) {
+    return;
+  }
+  for (vec0_vtab *p = connection->tables; p; p = p->nextOpen) {
+    if (sqlite3_stricmp(p->tableName, zTable) != 0 || !p->resultCacheSize) {
+      continue;
+    }
+    vec0_result_cache_sync(p);
+    int entries = 0;
+    for (int i = 0; i < p->resultCacheSize; i++) {
+      entries += p->resultCache[i].key != NULL;
+    }
+    char *zJson = sqlite3_mprintf(
+        "{\"entries\":%d,\"bytes\":%lld,\"hits\":%lld,\"misses\":%lld}",
+        entries, p->resultCacheBytes, p->resultCacheHits,
+        p->resultCacheMisses);
+    if (!zJson) {
+      sqlite3_result_error_nomem(context);
+      return;
+    }
+    sqlite3_result_text(context, zJson, -1, sqlite3_free);
+    return;
+  }
+}
+
+/**
+ * @brief Reads the query vector of a KNN query, which must match the type and
+ * dimensions of the vector column. On success, the caller must free *out with
+ * *outCleanup.
+ */
+static int vec0_knn_query_vector(vec0_vtab *p,
+                                 struct VectorColumnDefinition *vector_column,
+                                 sqlite3_value *value, void **out,
+                                 vector_cleanup *outCleanup) {
+  int rc;
+  void *vector;
+  size_t dimensions;
+  enum VectorElementType elementType;
+  vector_cleanup cleanup = vector_cleanup_noop;
+  char *pzError;
+  rc = vector_from_value(value, &vector, &dimensions, &elementType, &cleanup,
+                         &pzError);
+  if (rc != SQLITE_OK) {
+    vtab_set_error(&p->base,
+                   "Query vector on the \"%.*s\" column is invalid: %z",
+                   vector_column->name_length, vector_column->name, pzError);
+    return SQLITE_ERROR;
+  }
+  if (elementType != vector_column->element_type) {
+    vtab_set_error(
+        &p->base,
+        "Query vector for the \"%.*s\" column is expected to be of type "
+        "%s, but a %s vector was provided.",
+        vector_column->name_length, vector_column->name,
+        vector_subtype_name(vector_column->element_type),
+        vector_subtype_name(elementType));
+    cleanup(vector);
+    return SQLITE_ERROR;
+  }
+  if (dimensions != vector_column->dimensions) {
+    vtab_set_error(
+        &p->base,
+        "Dimension mismatch for query vector for the \"%.*s\" column. "
+        "Expected %d dimensions but received %d.",
+        vector_column->name_length, vector_column->name,
+        vector_column->dimensions, dimensions);
+    cleanup(vector);
+    return SQLITE_ERROR;
+  }
+  *out = vector;
+  *outCleanup = cleanup;
+  return SQLITE_OK;
+}
+
+int vec0Filter_knn(vec0_cursor *pCur, vec0_vtab *p, int idxNum,
+                   const char *idxStr, int argc, sqlite3_value **argv) {
+  assert(argc == (int)((strlen(idxStr)-1) / 4));
+  int rc;
+  struct vec0_query_knn_data *knn_data;
+
+  int vectorColumnIdx = idxNum & VEC0_KNN_IDXNUM_VECTOR_MASK;
+  int paging = (idxNum & VEC0_KNN_IDXNUM_PAGING) != 0;
+  struct VectorColumnDefinition *vector_column =
+      &p->vector_columns[vectorColumnIdx];
+
+  struct Array *arrayRowidsIn = NULL;
+  // only set when an approximate index narrows down the scanned vectors
+  struct Vec0ChunkCandidates *candidates = NULL;
+  // only set on tables declared with result_cache=N, see
+  // vec0_result_cache_key()
+  char *resultCacheKey = NULL;
+  int nResultCacheKey = 0;
+  // only set for MMR queries over a chunk scan, see vec0_mmr_rerank()
+  void *topk_vectors = NULL;
+  void *queryVector = NULL;
+  vector_cleanup queryVectorCleanup = vector_cleanup_noop;
+  // only set for fused queries, with a weights constraint
+  struct Vec0KnnFusion fusion;
+  struct Vec0KnnFusion *pFusion = NULL;
+  memset(&fusion, 0, sizeof(fusion));
+  knn_data = sqlite3_malloc(sizeof(*knn_data));
+  if (!knn_data) {
+    return SQLITE_NOMEM;
+  }
+  memset(knn_data, 0, sizeof(*knn_data));
+  // array of `struct Vec0MetadataIn`, IF there are any `xxx in (...)` metadata constraints
+  struct Array * aMetadataIn = NULL;
+
+  int query_idx =-1;
+  int k_idx = -1;
+  int rowid_in_idx = -1;
+  int mmr_lambda_idx = -1;
+  int nprobe_idx = -1;
+  int ef_search_idx = -1;
+  int page_token_idx = -1;
+  int weights_idx = -1;
+  int k_per_partition_idx = -1;
+  int max_chunks_idx = -1;
+  int time_budget_idx = -1;
+  for(int i = 0; i < argc; i++) {
+    if(idxStr[1 + (i*4)] == VEC0_IDXSTR_KIND_KNN_MATCH && idxStr[2 + (i*4)] == '_') {
+      query_idx = i;
+    }
+    if(idxStr[1 + (i*4)] == VEC0_IDXSTR_KIND_KNN_K) {
+      k_idx = i;
+    }
+    if(idxStr[1 + (i*4)] == VEC0_IDXSTR_KIND_KNN_ROWID_IN) {
+      rowid_in_idx = i;
+    }
+    if(idxStr[1 + (i*4)] == VEC0_IDXSTR_KIND_KNN_MMR_LAMBDA) {
+      mmr_lambda_idx = i;
+    }
+    if(idxStr[1 + (i*4)] == VEC0_IDXSTR_KIND_KNN_NPROBE) {
+      nprobe_idx = i;
+    }
+    if(idxStr[1 + (i*4)] == VEC0_IDXSTR_KIND_KNN_EF_SEARCH) {
+      ef_search_idx = i;
+    }
+    if(idxStr[1 + (i*4)] == VEC0_IDXSTR_KIND_KNN_PAGE_TOKEN) {
+      page_token_idx = i;
+    }
+    if(idxStr[1 + (i*4)] == VEC0_IDXSTR_KIND_KNN_WEIGHTS) {
+      weights_idx = i;
+    }
+    if(idxStr[1 + (i*4)] == VEC0_IDXSTR_KIND_KNN_K_PER_PARTITION) {
+      k_per_partition_idx = i;
+    }
+    if(idxStr[1 + (i*4)] == VEC0_IDXSTR_KIND_KNN_MAX_CHUNKS) {
+      max_chunks_idx = i;
+    }
+    if(idxStr[1 + (i*4)] == VEC0_IDXSTR_KIND_KNN_TIME_BUDGET) {
+      time_budget_idx = i;
+    }
+  }
+  assert(query_idx >= 0);
+  assert(k_idx >= 0 || k_per_partition_idx >= 0);
+  // k_per_partition queries keep the top k of every selected partition
+  int perPartition = k_per_partition_idx >= 0;
+
+  // make sure the query vector matches the vector column (type dimensions etc.)
+  rc = vec0_knn_query_vector(p, vector_column, argv[query_idx], &queryVector,
+                             &queryVectorCleanup);
+  if (rc != SQLITE_OK) {
+    goto cleanup;
+  }
+
+  // fused queries: the query vectors of the other matched columns, in
+  // declaration order, and one weight per matched column
+  if (weights_idx >= 0) {
+    pFusion = &fusion;
+    for (int i = 0; i < argc; i++) {
+      if (!(idxStr[1 + (i * 4)] == VEC0_IDXSTR_KIND_KNN_MATCH &&
+            idxStr[2 + (i * 4)] != '_')) {
+        continue;
+      }
+      int idx = idxStr[2 + (i * 4)] - 'A';
+      rc = vec0_knn_query_vector(p, &p->vector_columns[idx], argv[i],
+                                 &fusion.queryVectors[fusion.n],
+                                 &fusion.queryVectorCleanups[fusion.n]);
+      if (rc != SQLITE_OK) {
+        goto cleanup;
+      }
+      fusion.vectorColumnIdxs[fusion.n++] = idx;
+    }
+
+    void *weights;
+    size_t nWeights;
+    enum VectorElementType weightsType;
+    vector_cleanup weightsCleanup = vector_cleanup_noop;
+    char *pzError;
+    rc = vector_from_value(argv[weights_idx], &weights, &nWeights,
+                           &weightsType, &weightsCleanup, &pzError);
+    if (rc != SQLITE_OK) {
+      vtab_set_error(&p->base, "weights value in knn query is invalid: %z",
+                     pzError);
+      rc = SQLITE_ERROR;
+      goto cleanup;
+    }
+    if (weightsType != SQLITE_VEC_ELEMENT_TYPE_FLOAT32 ||
+        nWeights != (size_t)fusion.n + 1) {
+      vtab_set_error(&p->base,
+                     "weights value in knn query must be a float32 vector with "
+                     "one weight per MATCH constraint, %d expected.",
+                     fusion.n + 1);
+      weightsCleanup(weights);
+      rc = SQLITE_ERROR;
+      goto cleanup;
+    }
+    for (size_t i = 0; i < nWeights; i++) {
+      f32 w = ((f32 *)weights)[i];
+      if (!isfinite(w)) {
+        vtab_set_error(&p->base,
+                       "weights value in knn query must only hold finite "
+                       "numbers.");
+        weightsCleanup(weights);
+        rc = SQLITE_ERROR;
+        goto cleanup;
+      }
+      if (i == 0) {
+        fusion.weight = w;
+      } else {
+        fusion.weights[i - 1] = w;
+      }
+    }
+    weightsCleanup(weights);
+  }
+
+  const char *kName = perPartition ? "k_per_partition" : "k";
+  i64 k = sqlite3_value_int64(argv[perPartition ? k_per_partition_idx : k_idx]);
+  if (k < 0) {
+    vtab_set_error(
+        &p->base, "%s value in knn queries must be greater than or equal to 0.",
+        kName);
+    rc = SQLITE_ERROR;
+    goto cleanup;
+  }
+#define SQLITE_VEC_VEC0_K_MAX 4096
+  if (k > SQLITE_VEC_VEC0_K_MAX) {
+    vtab_set_error(
+        &p->base,
+        "%s value in knn query too large, provided %lld and the limit is %lld",
+        kName, k, SQLITE_VEC_VEC0_K_MAX);
+    rc = SQLITE_ERROR;
+    goto cleanup;
+  }
+
+  if (k == 0) {
+    knn_data->k = 0;
+    pCur->knn_data = knn_data;
+    pCur->query_plan = VEC0_QUERY_PLAN_KNN;
+    rc = SQLITE_OK;
+    goto cleanup;
+  }
+
+  if (paging && mmr_lambda_idx >= 0) {
+    vtab_set_error(&p->base,
+                   "page_token cannot be used with mmr_lambda in knn queries.");
+    rc = SQLITE_ERROR;
+    goto cleanup;
+  }
+  if (pFusion && mmr_lambda_idx >= 0) {
+    vtab_set_error(&p->base,
+                   "weights cannot be used with mmr_lambda in knn queries.");
+    rc = SQLITE_ERROR;
+    goto cleanup;
+  }
+  if (perPartition && (paging || mmr_lambda_idx >= 0)) {
+    vtab_set_error(&p->base,
+                   "k_per_partition cannot be used with %s in knn queries.",
+                   paging ? "page_token" : "mmr_lambda");
+    rc = SQLITE_ERROR;
+    goto cleanup;
+  }
+
+  // graph searches read the chunks of the nodes they reach, they aren't
+  // chunk scans
+  int graphSearch = !pFusion && !perPartition &&
+                    (vector_column->index_type == VEC0_INDEX_TYPE_HNSW ||
+                     vector_column->index_type == VEC0_INDEX_TYPE_DISKANN);
+
+  // max_chunks/time_budget_ms: stop the chunk scan early
+  struct Vec0KnnBudget budget;
+  struct Vec0KnnBudget *pBudget = NULL;
+  memset(&budget, 0, sizeof(budget));
+  budget.maxChunks = -1;
+  if (max_chunks_idx >= 0 || time_budget_idx >= 0) {
+    const char *zBudget = max_chunks_idx >= 0 ? "max_chunks" : "time_budget_ms";
+    if (paging) {
+      vtab_set_error(&p->base,
+                     "%s cannot be used with page_token in knn queries.",
+                     zBudget);
+      rc = SQLITE_ERROR;
+      goto cleanup;
+    }
+    if (graphSearch) {
+      vtab_set_error(&p->base,
+                     "%s is not supported on vector columns declared with "
+                     "indexed_by=hnsw or indexed_by=diskann, \"%.*s\" is",
+                     zBudget, vector_column->name_length, vector_column->name);
+      rc = SQLITE_ERROR;
+      goto cleanup;
+    }
+    if (max_chunks_idx >= 0) {
+      budget.maxChunks = sqlite3_value_int64(argv[max_chunks_idx]);
+      if (budget.maxChunks < 1) {
+        vtab_set_error(&p->base,
+                       "max_chunks value in knn query must be greater than 0.");
+        rc = SQLITE_ERROR;
+        goto cleanup;
+      }
+    }
+    if (time_budget_idx >= 0) {
+      double ms = sqlite3_value_double(argv[time_budget_idx]);
+      if (!(ms > 0)) {
+        vtab_set_error(
+            &p->base,
+            "time_budget_ms value in knn query must be greater than 0.");
+        rc = SQLITE_ERROR;
+        goto cleanup;
+      }
+      budget.deadline = vec0_now_ms() + (sqlite3_int64)ms;
+    }
+    pBudget = &budget;
+  }
+
+  // MMR: validate lambda and over-fetch candidates
+#define SQLITE_VEC_MMR_OVERFETCH_FACTOR 5
+  f32 mmr_lambda = -1.0f;
+  i64 k_original = k;
+  if (mmr_lambda_idx >= 0) {
+    mmr_lambda = (f32)sqlite3_value_double(argv[mmr_lambda_idx]);
+    if (mmr_lambda < 0.0f || mmr_lambda > 1.0f) {
+      vtab_set_error(
+          &p->base,
+          "mmr_lambda value in knn query must be between 0.0 and 1.0, "
+          "provided %f",
+          (double)mmr_lambda);
+      rc = SQLITE_ERROR;
+      goto cleanup;
+    }
+    if (mmr_lambda < 1.0f) {
+      i64 k_internal = k * SQLITE_VEC_MMR_OVERFETCH_FACTOR;
+      if (k_internal > SQLITE_VEC_VEC0_K_MAX) k_internal = SQLITE_VEC_VEC0_K_MAX;
+      if (k_internal < k) k_internal = k;  // overflow guard
+      k = k_internal;
+    }
+  }
+
+  if (nprobe_idx >= 0 && vector_column->index_type != VEC0_INDEX_TYPE_IVF) {
+    vtab_set_error(&p->base,
+                   "nprobe is only supported on vector columns declared with "
+                   "indexed_by=ivf, \"%.*s\" is not",
+                   vector_column->name_length, vector_column->name);
+    rc = SQLITE_ERROR;
+    goto cleanup;
+  }
+  i64 nprobe = vector_column->ivf.nprobe;
+  if (nprobe_idx >= 0) {
+    nprobe = sqlite3_value_int64(argv[nprobe_idx]);
+    if (nprobe < 1) {
+      vtab_set_error(&p->base,
+                     "nprobe value in knn query must be greater than 0.");
+      rc = SQLITE_ERROR;
+      goto cleanup;
+    }
+    if (nprobe > VEC0_IVF_MAX_NLIST) {
+      nprobe = VEC0_IVF_MAX_NLIST;
+    }
+  }
+
+  if (ef_search_idx >= 0 &&
+      vector_column->index_type != VEC0_INDEX_TYPE_HNSW &&
+      vector_column->index_type != VEC0_INDEX_TYPE_DISKANN) {
+    vtab_set_error(&p->base,
+                   "ef_search is only supported on vector columns declared "
+                   "with indexed_by=hnsw or indexed_by=diskann, \"%.*s\" is "
+                   "not",
+                   vector_column->name_length, vector_column->name);
+    rc = SQLITE_ERROR;
+    goto cleanup;
+  }
+  // the search list size of DiskANN columns
+  i64 ef_search = vector_column->index_type == VEC0_INDEX_TYPE_DISKANN
+                      ? vector_column->diskann.l_search
+                      : vector_column->hnsw.ef_search;
+  if (ef_search_idx >= 0) {
+    ef_search = sqlite3_value_int64(argv[ef_search_idx]);
+    if (ef_search < 1) {
+      vtab_set_error(&p->base,
+                     "ef_search value in knn query must be greater than 0.");
+      rc = SQLITE_ERROR;
+      goto cleanup;
+    }
+    if (ef_search > VEC0_HNSW_MAX_EF) {
+      ef_search = VEC0_HNSW_MAX_EF;
+    }
+  }
+
+// handle when a `rowid in (...)` operation was provided
+// Array of all the rowids that appear in any `rowid in (...)` constraint.
+// NULL if none were provided, which means a "full" scan.
+#if COMPILER_SUPPORTS_VTAB_IN
+  if (rowid_in_idx >= 0) {
+    sqlite3_value *item;
+    int rc;
+    arrayRowidsIn = sqlite3_malloc(sizeof(*arrayRowidsIn));
+    if (!arrayRowidsIn) {
+      rc = SQLITE_NOMEM;
+      goto cleanup;
+    }
+    memset(arrayRowidsIn, 0, sizeof(*arrayRowidsIn));
+
+    rc = array_init(arrayRowidsIn, sizeof(i64), 32);
+    if (rc != SQLITE_OK) {
+      goto cleanup;
+    }
+    for (rc = sqlite3_vtab_in_first(argv[rowid_in_idx], &item); rc == SQLITE_OK && item;
+         rc = sqlite3_vtab_in_next(argv[rowid_in_idx], &item)) {
+      i64 rowid;
+      if (p->pkIsText) {
+        rc = vec0_rowid_from_id(p, item, &rowid);
+        if (rc != SQLITE_OK) {
+          goto cleanup;
+        }
+      } else {
+        rowid = sqlite3_value_int64(item);
+      }
+      rc = array_append(arrayRowidsIn, &rowid);
+      if (rc != SQLITE_OK) {
+        goto cleanup;
+      }
+    }
+    if (rc != SQLITE_DONE) {
+      vtab_set_error(&p->base, "error processing rowid in (...) array");
+      goto cleanup;
+    }
+    qsort(arrayRowidsIn->z, arrayRowidsIn->length, arrayRowidsIn->element_size,
+          _cmp);
+  }
+#endif
+
+  for(int i = 0; i < argc; i++) {
+    if(idxStr[1 + (i*4)] != VEC0_IDXSTR_KIND_METADATA_CONSTRAINT) {
+      continue;
+    }
+    int metadata_idx = idxStr[1 + (i*4) + 1]  - 'A';
+    vec0_metadata_operator op = idxStr[1 + (i*4) + 2];
+    // every constraint on a dictionary column becomes a set of codes
+    if(op != VEC0_METADATA_OPERATOR_IN &&
+       p->metadata_columns[metadata_idx].kind != VEC0_METADATA_COLUMN_KIND_DICTIONARY) {
+      continue;
+    }
+    if(!aMetadataIn) {
+      aMetadataIn = sqlite3_malloc(sizeof(*aMetadataIn));
+      if(!aMetadataIn) {
+        rc = SQLITE_NOMEM;
+        goto cleanup;
+      }
+      memset(aMetadataIn, 0, sizeof(*aMetadataIn));
+      rc = array_init(aMetadataIn, sizeof(struct Vec0MetadataIn), 8);
+      if(rc != SQLITE_OK) {
+        goto cleanup;
+      }
+    }
+
+    struct Vec0MetadataIn item;
+    memset(&item, 0, sizeof(item));
+    item.metadata_idx=metadata_idx;
+    item.argv_idx = i;
+
+    switch(p->metadata_columns[metadata_idx].kind) {
+      case VEC0_METADATA_COLUMN_KIND_DICTIONARY: {
+        rc = array_init(&item.array, sizeof(i64), 16);
+        if(rc != SQLITE_OK) {
+          goto cleanup;
+        }
+        rc = vec0_metadata_dictionary_codes(p, metadata_idx, op, argv[i], &item.array);
+        if(rc != SQLITE_OK) {
+          vtab_set_error(&p->base, "Error resolving a constraint on dictionary metadata column %.*s",
+                         p->metadata_columns[metadata_idx].name_length,
+                         p->metadata_columns[metadata_idx].name);
+          array_cleanup(&item.array);
+          goto cleanup;
+        }
+        break;
+      }
+      #if COMPILER_SUPPORTS_VTAB_IN
+      case VEC0_METADATA_COLUMN_KIND_INTEGER: {
+        rc = array_init(&item.array, sizeof(i64), 16);
+        if(rc != SQLITE_OK) {
+          goto cleanup;
+        }
+        sqlite3_value *entry;
+        for (rc = sqlite3_vtab_in_first(argv[i], &entry); rc == SQLITE_OK && entry; rc = sqlite3_vtab_in_next(argv[i], &entry)) {
+          i64 v = sqlite3_value_int64(entry);
+          rc = array_append(&item.array, &v);
+          if (rc != SQLITE_OK) {
+            array_cleanup(&item.array);
+            goto cleanup;
+          }
+        }
+
+        if (rc != SQLITE_DONE) {
+          vtab_set_error(&p->base, "Error fetching next value in `x in (...)` integer expression");
+          array_cleanup(&item.array);
+          goto cleanup;
+        }
+        // sorted for vec0_metadata_in_i64()
+        qsort(item.array.z, item.array.length, sizeof(i64), vec0_cmp_i64);
+
+        break;
+      }
+      case VEC0_METADATA_COLUMN_KIND_TEXT: {
+        rc = array_init(&item.array, sizeof(struct Vec0MetadataInTextEntry), 16);
+        if(rc != SQLITE_OK) {
+          goto cleanup;
+        }
+        sqlite3_value *entry;
+        for (rc = sqlite3_vtab_in_first(argv[i], &entry); rc == SQLITE_OK && entry; rc = sqlite3_vtab_in_next(argv[i], &entry)) {
+          const char * s = (const char *) sqlite3_value_text(entry);
+          int n = sqlite3_value_bytes(entry);
+
+          struct Vec0MetadataInTextEntry textEntry;
+          textEntry.zString = sqlite3_mprintf("%.*s", n, s);
+          if(!textEntry.zString) {
+            rc = SQLITE_NOMEM;
+            goto item_text_cleanup;
+          }
+          textEntry.n = n;
+          rc = array_append(&item.array, &textEntry);
+          if (rc != SQLITE_OK) {
+            sqlite3_free(textEntry.zString);
+            goto item_text_cleanup;
+          }
+        }
+
+        if (rc != SQLITE_DONE) {
+          vtab_set_error(&p->base, "Error fetching next value in `x in (...)` text expression");
+          goto item_text_cleanup;
+        }
+
+        break;
+
+      // Error cleanup label for TEXT case only. Unlike INTEGER entries (which are
+      // plain i64 values), TEXT entries contain heap-allocated zString pointers
+      // that must be freed before array_cleanup(). This label is only reachable
+      // via goto from error paths within this case block.
+      item_text_cleanup:
+        vec0_metadata_in_text_cleanup(&item.array);
+        goto cleanup;
+      }
+      #endif
+      default: {
+        vtab_set_error(&p->base, "Internal sqlite-vec error");
+        goto cleanup;
+      }
+    }
+
+    rc = array_append(aMetadataIn, &item);
+    if(rc != SQLITE_OK) {
+      // Clean up item that couldn't be appended
+      if(p->metadata_columns[metadata_idx].kind == VEC0_METADATA_COLUMN_KIND_TEXT) {
+        vec0_metadata_in_text_cleanup(&item.array);
+      } else {
+        array_cleanup(&item.array);
+      }
+      goto cleanup;
+    }
+  }
+
+  // filter expressions are compiled once, and run on every chunk
+  for(int i = 0; i < argc; i++) {
+    if(idxStr[1 + (i*4)] != VEC0_IDXSTR_KIND_KNN_FILTER) {
+      continue;
+    }
+    if(sqlite3_value_type(argv[i]) != SQLITE_TEXT) {
+      vtab_set_error(&p->base, "filter value in knn query must be a string.");
+      rc = SQLITE_ERROR;
+      goto cleanup;
+    }
+    if(!aMetadataIn) {
+      aMetadataIn = sqlite3_malloc(sizeof(*aMetadataIn));
+      if(!aMetadataIn) {
+        rc = SQLITE_NOMEM;
+        goto cleanup;
+      }
+      memset(aMetadataIn, 0, sizeof(*aMetadataIn));
+      rc = array_init(aMetadataIn, sizeof(struct Vec0MetadataIn), 8);
+      if(rc != SQLITE_OK) {
+        goto cleanup;
+      }
+    }
+    struct Vec0MetadataIn item;
+    memset(&item, 0, sizeof(item));
+    item.argv_idx = i;
+    item.metadata_idx = -1;
+    char *zErr = NULL;
+    rc = vec0_filter_compile(p, (const char *) sqlite3_value_text(argv[i]),
+                             sqlite3_value_bytes(argv[i]), &item.program, &zErr);
+    if(rc != SQLITE_OK) {
+      if(zErr) {
+        vtab_set_error(&p->base, "Invalid filter: %s", zErr);
+        sqlite3_free(zErr);
+      } else {
+        vtab_set_error(&p->base, "Error compiling filter: %s", sqlite3_errmsg(p->db));
+      }
+      goto cleanup;
+    }
+    rc = array_append(aMetadataIn, &item);
+    if(rc != SQLITE_OK) {
+      vec0_filter_program_free(p, item.program);
+      goto cleanup;
+    }
+  }
+
+  i64 *topk_rowids = NULL;
+  f32 *topk_distances = NULL;
+  int mmr = mmr_lambda >= 0.0f && mmr_lambda < 1.0f;
+  i64 k_used = 0;
+  int cached = 0;
+  int exact = 1;
+  // budgeted results depend on the clock or the scan order, they're not cached
+  if (p->resultCacheSize > 0 && !paging && !pBudget) {
+    rc = vec0_result_cache_key(p, vectorColumnIdx, queryVector, k_original,
+                               arrayRowidsIn, aMetadataIn, idxStr, argc, argv,
+                               &resultCacheKey, &nResultCacheKey);
+    if (rc != SQLITE_OK) {
+      goto cleanup;
+    }
+    rc = vec0_result_cache_get(p, resultCacheKey, nResultCacheKey, &cached,
+                               &topk_rowids, &topk_distances, &k_used, &exact);
+    if (rc != SQLITE_OK) {
+      goto cleanup;
+    }
+  }
+
+  if (cached) {
+    k = k_original;
+  } else {
+    if (vector_column->index_type == VEC0_INDEX_TYPE_IVF && !pFusion) {
+      rc = vec0_ivf_candidates(p, vectorColumnIdx, queryVector, (int)nprobe,
+                               &candidates);
+      if (rc != SQLITE_OK) {
+        goto cleanup;
+      }
+    }
+    if (paging) {
+      rc = vec0Filter_knn_paged(
+          p, vector_column, vectorColumnIdx, arrayRowidsIn, aMetadataIn,
+          candidates, idxStr, argc, argv, queryVector, k, ef_search, pFusion,
+          page_token_idx >= 0 ? argv[page_token_idx] : NULL, knn_data,
+          &topk_rowids, &topk_distances, &k_used);
+    } else {
+      // MMR reranks with the candidates' vectors, keep them from the scan
+      rc = vec0Filter_knn_fetch(p, vector_column, vectorColumnIdx,
+                                arrayRowidsIn, aMetadataIn, candidates, idxStr,
+                                argc, argv, queryVector, k, ef_search, NULL,
+                                pFusion, perPartition, pBudget, &topk_rowids,
+                                &topk_distances, mmr ? &topk_vectors : NULL,
+                                &k_used);
+    }
+    if (rc != SQLITE_OK) {
+      goto cleanup;
+    }
+    exact = !graphSearch && !candidates && !budget.exhausted;
+
+    // MMR reranking: select diverse subset from over-fetched candidates
+    if (mmr && k_used > k_original) {
+      i64 n_selected = 0;
+      rc = vec0_mmr_rerank(p, vectorColumnIdx, vector_column,
+                           topk_rowids, topk_distances, topk_vectors, k_used,
+                           k_original, mmr_lambda, &n_selected);
+      if (rc != SQLITE_OK) goto cleanup;
+      k_used = n_selected;
+      k = k_original;
+    }
+
+    if (resultCacheKey) {
+      rc = vec0_result_cache_put(p, resultCacheKey, nResultCacheKey,
+                                 topk_rowids, topk_distances, k_used, exact);
+      if (rc != SQLITE_OK) {
+        goto cleanup;
+      }
+      // owned by the cache now
+      resultCacheKey = NULL;
+    }
+  }
+
+  knn_data->current_idx = 0;
+  // every row of a k_per_partition query is returned
+  knn_data->k = perPartition ? k_used : k;
+  knn_data->rowids = topk_rowids;
+  knn_data->distances = topk_distances;
+  knn_data->k_used = k_used;
+  knn_data->exact = exact;
+
+  pCur->knn_data = knn_data;
+  pCur->query_plan = VEC0_QUERY_PLAN_KNN;
+  rc = SQLITE_OK;
+
+cleanup:
+  sqlite3_free(resultCacheKey);
+  sqlite3_free(topk_vectors);
+  array_cleanup(arrayRowidsIn);
+  sqlite3_free(arrayRowidsIn);
+  vec0_chunk_candidates_free(candidates);
+  queryVectorCleanup(queryVector);
+  for (int i = 0; i < fusion.n; i++) {
+    fusion.queryVectorCleanups[i](fusion.queryVectors[i]);
+  }
+  vec0_metadata_in_cleanup(p, aMetadataIn);
+  sqlite3_free(aMetadataIn);
+
+  // On error, knn_data was never assigned to the cursor, so free it here.
+  // On success, it's owned by pCur->knn_data and will be freed by vec0_cursor_clear.
+  if (rc != SQLITE_OK) {
+    vec0_query_knn_data_clear(knn_data);
+    sqlite3_free(knn_data);
+  }
+
+  return rc;
+}
+
+int vec0Filter_fullscan(vec0_vtab *p, vec0_cursor *pCur) {
+  int rc;
+  char *zSql;
+  struct vec0_query_fullscan_data *fullscan_data;
+
+  fullscan_data = sqlite3_malloc(sizeof(*fullscan_data));
+  if (!fullscan_data) {
+    return SQLITE_NOMEM;
+  }
+  memset(fullscan_data, 0, sizeof(*fullscan_data));
+
+  zSql = sqlite3_mprintf(" SELECT rowid "
+                         " FROM " VEC0_SHADOW_ROWIDS_NAME
+                         " ORDER by chunk_id, chunk_offset ",
+                         p->schemaName, p->tableName);
+  if (!zSql) {
+    rc = SQLITE_NOMEM;
+    goto error;
+  }
+  rc = sqlite3_prepare_v2(p->db, zSql, -1, &fullscan_data->rowids_stmt, NULL);
+  sqlite3_free(zSql);
+  if (rc != SQLITE_OK) {
+    // IMP: V09901_26739
+    vtab_set_error(&p->base, "Error preparing rowid scan: %s",
+                   sqlite3_errmsg(p->db));
+    goto error;
+  }
+
+  rc = sqlite3_step(fullscan_data->rowids_stmt);
+
+  // DONE when there's no rowids, ROW when there are, both "success"
+  if (!(rc == SQLITE_ROW || rc == SQLITE_DONE)) {
+    goto error;
+  }
+
+  fullscan_data->done = rc == SQLITE_DONE;
+  pCur->query_plan = VEC0_QUERY_PLAN_FULLSCAN;
+  pCur->fullscan_data = fullscan_data;
+  return SQLITE_OK;
+
+error:
+  vec0_query_fullscan_data_clear(fullscan_data);
+  sqlite3_free(fullscan_data);
+  return rc;
+}
+
+int vec0Filter_point(vec0_cursor *pCur, vec0_vtab *p, int argc,
+                     sqlite3_value **argv) {
+  int rc;
+  assert(argc == 1);
+  i64 rowid;
+  struct vec0_query_point_data *point_data = NULL;
+
+  point_data = sqlite3_malloc(sizeof(*point_data));
+  if (!point_data) {
+    rc = SQLITE_NOMEM;
+    goto error;
+  }
+  memset(point_data, 0, sizeof(*point_data));
+
+  if (p->pkIsText) {
+    rc = vec0_rowid_from_id(p, argv[0], &rowid);
+    if (rc == SQLITE_EMPTY) {
+      goto eof;
+    }
+    if (rc != SQLITE_OK) {
+      goto error;
+    }
+  } else {
+    rowid = sqlite3_value_int64(argv[0]);
+  }
+
+  for (int i = 0; i < p->numVectorColumns; i++) {
+    rc = vec0_get_vector_data(p, rowid, i, &point_data->vectors[i], NULL);
+    if (rc == SQLITE_EMPTY) {
+      goto eof;
+    }
+    if (rc != SQLITE_OK) {
+      goto error;
+    }
+  }
+
+  point_data->rowid = rowid;
+  point_data->done = 0;
+  pCur->point_data = point_data;
+  pCur->query_plan = VEC0_QUERY_PLAN_POINT;
+  return SQLITE_OK;
+
+eof:
+  point_data->rowid = rowid;
+  point_data->done = 1;
+  pCur->point_data = point_data;
+  pCur->query_plan = VEC0_QUERY_PLAN_POINT;
+  return SQLITE_OK;
+
+error:
+  vec0_query_point_data_clear(point_data);
+  sqlite3_free(point_data);
+  return rc;
+}
+
+static int vec0_bulk_flush(vec0_vtab *p);
+
+static int vec0Filter(sqlite3_vtab_cursor *pVtabCursor, int idxNum,
+                      const char *idxStr, int argc, sqlite3_value **argv) {
+  vec0_vtab *p = (vec0_vtab *)pVtabCursor->pVtab;
+  vec0_cursor *pCur = (vec0_cursor *)pVtabCursor;
+  vec0_cursor_clear(pCur);
+
+  // rows buffered by a bulk load are written before they're read
+  int rc = vec0_bulk_flush(p);
+  if (rc != SQLITE_OK) {
+    return rc;
+  }
+
+  int idxStrLength = strlen(idxStr);
+  if(idxStrLength <= 0) {
+    return SQLITE_ERROR;
+  }
+  if((idxStrLength-1) % 4 != 0) {
+    return SQLITE_ERROR;
+  }
+  int numValueEntries = (idxStrLength-1) / 4;
+  if(numValueEntries != argc) {
+    return SQLITE_ERROR;
+  }
+
+  char query_plan = idxStr[0];
+  switch(query_plan) {
+    case VEC0_QUERY_PLAN_FULLSCAN:
+      return vec0Filter_fullscan(p, pCur);
+    case VEC0_QUERY_PLAN_KNN:
+      return vec0Filter_knn(pCur, p, idxNum, idxStr, argc, argv);
+    case VEC0_QUERY_PLAN_POINT:
+      return vec0Filter_point(pCur, p, argc, argv);
+    default:
+      vtab_set_error(pVtabCursor->pVtab, "unknown idxStr '%s'", idxStr);
+      return SQLITE_ERROR;
+  }
+}
+
+static int vec0Rowid(sqlite3_vtab_cursor *cur, sqlite_int64 *pRowid) {
+  vec0_cursor *pCur = (vec0_cursor *)cur;
+  switch (pCur->query_plan) {
+  case VEC0_QUERY_PLAN_FULLSCAN: {
+    *pRowid = sqlite3_column_int64(pCur->fullscan_data->rowids_stmt, 0);
+    return SQLITE_OK;
+  }
+  case VEC0_QUERY_PLAN_POINT: {
+    *pRowid = pCur->point_data->rowid;
+    return SQLITE_OK;
+  }
+  case VEC0_QUERY_PLAN_KNN: {
+    vtab_set_error(cur->pVtab,
+                   "Internal sqlite-vec error: expected point query plan in "
+                   "vec0Rowid, found %d",
+                   pCur->query_plan);
+    return SQLITE_ERROR;
+  }
+  }
+  return SQLITE_ERROR;
+}
+
+static int vec0Next(sqlite3_vtab_cursor *cur) {
+  vec0_cursor *pCur = (vec0_cursor *)cur;
+  switch (pCur->query_plan) {
+  case VEC0_QUERY_PLAN_FULLSCAN: {
+    if (!pCur->fullscan_data) {
+      return SQLITE_ERROR;
+    }
+    int rc = sqlite3_step(pCur->fullscan_data->rowids_stmt);
+    if (rc == SQLITE_DONE) {
+      pCur->fullscan_data->done = 1;
+      return SQLITE_OK;
+    }
+    if (rc == SQLITE_ROW) {
+      return SQLITE_OK;
+    }
+    return SQLITE_ERROR;
+  }
+  case VEC0_QUERY_PLAN_KNN: {
+    if (!pCur->knn_data) {
+      return SQLITE_ERROR;
+    }
+
+    pCur->knn_data->current_idx++;
+    return SQLITE_OK;
+  }
+  case VEC0_QUERY_PLAN_POINT: {
+    if (!pCur->point_data) {
+      return SQLITE_ERROR;
+    }
+    pCur->point_data->done = 1;
+    return SQLITE_OK;
+  }
+  }
+  return SQLITE_ERROR;
+}
+
+static int vec0Eof(sqlite3_vtab_cursor *cur) {
+  vec0_cursor *pCur = (vec0_cursor *)cur;
+  switch (pCur->query_plan) {
+  case VEC0_QUERY_PLAN_FULLSCAN: {
+    if (!pCur->fullscan_data) {
+      return 1;
+    }
+    return pCur->fullscan_data->done;
+  }
+  case VEC0_QUERY_PLAN_KNN: {
+    if (!pCur->knn_data) {
+      return 1;
+    }
+    // return (pCur->knn_data->current_idx >= pCur->knn_data->k) ||
+    // (pCur->knn_data->distances[pCur->knn_data->current_idx] == FLT_MAX);
+    return (pCur->knn_data->current_idx >= pCur->knn_data->k_used);
+  }
+  case VEC0_QUERY_PLAN_POINT: {
+    if (!pCur->point_data) {
+      return 1;
+    }
+    return pCur->point_data->done;
+  }
+  }
+  return 1;
+}
+
+static int vec0Column_fullscan(vec0_vtab *pVtab, vec0_cursor *pCur,
+                               sqlite3_context *context, int i) {
+  if (!pCur->fullscan_data) {
+    sqlite3_result_error(
+        context, "Internal sqlite-vec error: fullscan_data is NULL.", -1);
+    return SQLITE_ERROR;
+  }
+  i64 rowid = sqlite3_column_int64(pCur->fullscan_data->rowids_stmt, 0);
+  if (i == VEC0_COLUMN_ID) {
+    return vec0_result_id(pVtab, context, rowid);
+  }
+  else if (vec0_column_idx_is_vector(pVtab, i)) {
+    void *v;
+    int sz;
+    int vector_idx = vec0_column_idx_to_vector_idx(pVtab, i);
+    int rc = vec0_get_vector_data(pVtab, rowid, vector_idx, &v, &sz);
+    if (rc != SQLITE_OK) {
+      return rc;
+    }
+    sqlite3_result_blob(context, v, sz, sqlite3_free);
+    sqlite3_result_subtype(context,
+                           pVtab->vector_columns[vector_idx].element_type);
+
+  }
+  else if (i == vec0_column_distance_idx(pVtab)) {
+    sqlite3_result_null(context);
+  }
+  else if(vec0_column_idx_is_partition(pVtab, i)) {
+    int partition_idx = vec0_column_idx_to_partition_idx(pVtab, i);
+    sqlite3_value * v;
+    int rc = vec0_get_partition_value_for_rowid(pVtab, rowid, partition_idx, &v);
+    if(rc == SQLITE_OK) {
+      sqlite3_result_value(context, v);
+      sqlite3_value_free(v);
+    }else {
+      sqlite3_result_error_code(context, rc);
+    }
+  }
+  else if(vec0_column_idx_is_auxiliary(pVtab, i)) {
+    int auxiliary_idx = vec0_column_idx_to_auxiliary_idx(pVtab, i);
+    sqlite3_value * v;
+    int rc = vec0_get_auxiliary_value_for_rowid(pVtab, rowid, auxiliary_idx, &v);
+    if(rc == SQLITE_OK) {
+      sqlite3_result_value(context, v);
+      sqlite3_value_free(v);
+    }else {
+      sqlite3_result_error_code(context, rc);
+    }
+  }
+
+  else if(vec0_column_idx_is_metadata(pVtab, i)) {
+    if(sqlite3_vtab_nochange(context)) {
+      return SQLITE_OK;
+    }
+    int metadata_idx = vec0_column_idx_to_metadata_idx(pVtab, i);
+    int rc = vec0_result_metadata_value_for_rowid(pVtab, rowid, metadata_idx, context);
+    if(rc != SQLITE_OK) {
+      // IMP: V15466_32305
+      const char * zErr = sqlite3_mprintf(
+        "Could not extract metadata value for column %.*s at rowid %lld",
+        pVtab->metadata_columns[metadata_idx].name_length,
+        pVtab->metadata_columns[metadata_idx].name, rowid
+      );
+      if(zErr) {
+        sqlite3_result_error(context, zErr, -1);
+        sqlite3_free((void *) zErr);
+      }else {
+        sqlite3_result_error_nomem(context);
+      }
+    }
+  }
+
+  return SQLITE_OK;
+}
+
+static int vec0Column_point(vec0_vtab *pVtab, vec0_cursor *pCur,
+                            sqlite3_context *context, int i) {
+  if (!pCur->point_data) {
+    sqlite3_result_error(context,
+                         "Internal sqlite-vec error: point_data is NULL.", -1);
+    return SQLITE_ERROR;
+  }
+  if (i == VEC0_COLUMN_ID) {
+    return vec0_result_id(pVtab, context, pCur->point_data->rowid);
+  }
+  else if (i == vec0_column_distance_idx(pVtab)) {
+    sqlite3_result_null(context);
+    return SQLITE_OK;
+  }
+  else if (vec0_column_idx_is_vector(pVtab, i)) {
+    if (sqlite3_vtab_nochange(context)) {
+      sqlite3_result_null(context);
+      return SQLITE_OK;
+    }
+    int vector_idx = vec0_column_idx_to_vector_idx(pVtab, i);
+    sqlite3_result_blob(
+        context, pCur->point_data->vectors[vector_idx],
+        vector_column_byte_size(pVtab->vector_columns[vector_idx]),
+        SQLITE_TRANSIENT);
+    sqlite3_result_subtype(context,
+                           pVtab->vector_columns[vector_idx].element_type);
+    return SQLITE_OK;
+  }
+  else if(vec0_column_idx_is_partition(pVtab, i)) {
+    if(sqlite3_vtab_nochange(context)) {
+      return SQLITE_OK;
+    }
+    int partition_idx = vec0_column_idx_to_partition_idx(pVtab, i);
+    i64 rowid = pCur->point_data->rowid;
+    sqlite3_value * v;
+    int rc = vec0_get_partition_value_for_rowid(pVtab, rowid, partition_idx, &v);
+    if(rc == SQLITE_OK) {
+      sqlite3_result_value(context, v);
+      sqlite3_value_free(v);
+    }else {
+      sqlite3_result_error_code(context, rc);
+    }
+  }
+  else if(vec0_column_idx_is_auxiliary(pVtab, i)) {
+    if(sqlite3_vtab_nochange(context)) {
+      return SQLITE_OK;
+    }
+    i64 rowid = pCur->point_data->rowid;
+    int auxiliary_idx = vec0_column_idx_to_auxiliary_idx(pVtab, i);
+    sqlite3_value * v;
+    int rc = vec0_get_auxiliary_value_for_rowid(pVtab, rowid, auxiliary_idx, &v);
+    if(rc == SQLITE_OK) {
+      sqlite3_result_value(context, v);
+      sqlite3_value_free(v);
+    }else {
+      sqlite3_result_error_code(context, rc);
+    }
+  }
+
+  else if(vec0_column_idx_is_metadata(pVtab, i)) {
+    if(sqlite3_vtab_nochange(context)) {
+      return SQLITE_OK;
+    }
+    i64 rowid = pCur->point_data->rowid;
+    int metadata_idx = vec0_column_idx_to_metadata_idx(pVtab, i);
+    int rc = vec0_result_metadata_value_for_rowid(pVtab, rowid, metadata_idx, context);
+    if(rc != SQLITE_OK) {
+      const char * zErr = sqlite3_mprintf(
+        "Could not extract metadata value for column %.*s at rowid %lld",
+        pVtab->metadata_columns[metadata_idx].name_length,
+        pVtab->metadata_columns[metadata_idx].name, rowid
+      );
+      if(zErr) {
+        sqlite3_result_error(context, zErr, -1);
+        sqlite3_free((void *) zErr);
+      }else {
+        sqlite3_result_error_nomem(context);
+      }
+    }
+  }
+
+  return SQLITE_OK;
+}
+
+static int vec0Column_knn(vec0_vtab *pVtab, vec0_cursor *pCur,
+                          sqlite3_context *context, int i) {
+  if (!pCur->knn_data) {
+    sqlite3_result_error(context,
+                         "Internal sqlite-vec error: knn_data is NULL.", -1);
+    return SQLITE_ERROR;
+  }
+  if (i == VEC0_COLUMN_ID) {
+    i64 rowid = pCur->knn_data->rowids[pCur->knn_data->current_idx];
+    return vec0_result_id(pVtab, context, rowid);
+  }
+  else if (i == vec0_column_distance_idx(pVtab)) {
+    sqlite3_result_double(
+        context, pCur->knn_data->distances[pCur->knn_data->current_idx]);
+    return SQLITE_OK;
+  }
+  else if (i == vec0_column_exact_idx(pVtab)) {
+    sqlite3_result_int(context, pCur->knn_data->exact);
+    return SQLITE_OK;
+  }
+  else if (i == vec0_column_page_token_idx(pVtab)) {
+    // NULL unless the query was planned as a paged KNN query
+    if (pCur->knn_data->paging) {
+      struct Vec0PageToken token;
+      u8 blob[VEC0_PAGE_TOKEN_SIZE];
+      token.dataVersion = pCur->knn_data->dataVersion;
+      token.writeGeneration = pCur->knn_data->writeGeneration;
+      token.fingerprint = pCur->knn_data->fingerprint;
+      token.bound.rowid = pCur->knn_data->rowids[pCur->knn_data->current_idx];
+      token.bound.distance =
+          pCur->knn_data->distances[pCur->knn_data->current_idx];
+      vec0_page_token_encode(&token, blob);
+      sqlite3_result_blob(context, blob, VEC0_PAGE_TOKEN_SIZE,
+                          SQLITE_TRANSIENT);
+    }
+    return SQLITE_OK;
+  }
+  else if (vec0_column_idx_is_vector(pVtab, i)) {
+    void *out;
+    int sz;
+    int vector_idx = vec0_column_idx_to_vector_idx(pVtab, i);
+    int rc = vec0_get_vector_data(
+        pVtab, pCur->knn_data->rowids[pCur->knn_data->current_idx], vector_idx,
+        &out, &sz);
+    if (rc != SQLITE_OK) {
+      return rc;
+    }
+    sqlite3_result_blob(context, out, sz, sqlite3_free);
+    sqlite3_result_subtype(context,
+                           pVtab->vector_columns[vector_idx].element_type);
+    return SQLITE_OK;
+  }
+  else if(vec0_column_idx_is_partition(pVtab, i)) {
+    int partition_idx = vec0_column_idx_to_partition_idx(pVtab, i);
+    i64 rowid = pCur->knn_data->rowids[pCur->knn_data->current_idx];
+    sqlite3_value * v;
+    int rc = vec0_get_partition_value_for_rowid(pVtab, rowid, partition_idx, &v);
+    if(rc == SQLITE_OK) {
+      sqlite3_result_value(context, v);
+      sqlite3_value_free(v);
+    }else {
+      sqlite3_result_error_code(context, rc);
+    }
+  }
+  else if(vec0_column_idx_is_auxiliary(pVtab, i)) {
+    int auxiliary_idx = vec0_column_idx_to_auxiliary_idx(pVtab, i);
+    i64 rowid = pCur->knn_data->rowids[pCur->knn_data->current_idx];
+    sqlite3_value * v;
+    int rc = vec0_get_auxiliary_value_for_rowid(pVtab, rowid, auxiliary_idx, &v);
+    if(rc == SQLITE_OK) {
+      sqlite3_result_value(context, v);
+      sqlite3_value_free(v);
+    }else {
+      sqlite3_result_error_code(context, rc);
+    }
+  }
+
+  else if(vec0_column_idx_is_metadata(pVtab, i)) {
+    int metadata_idx = vec0_column_idx_to_metadata_idx(pVtab, i);
+    i64 rowid = pCur->knn_data->rowids[pCur->knn_data->current_idx];
+    int rc = vec0_result_metadata_value_for_rowid(pVtab, rowid, metadata_idx, context);
+    if(rc != SQLITE_OK) {
+      const char * zErr = sqlite3_mprintf(
+        "Could not extract metadata value for column %.*s at rowid %lld",
+        pVtab->metadata_columns[metadata_idx].name_length,
+        pVtab->metadata_columns[metadata_idx].name, rowid
+      );
+      if(zErr) {
+        sqlite3_result_error(context, zErr, -1);
+        sqlite3_free((void *) zErr);
+      }else {
+        sqlite3_result_error_nomem(context);
+      }
+    }
+  }
+
+  return SQLITE_OK;
+}
+
+static int vec0Column(sqlite3_vtab_cursor *cur, sqlite3_context *context,
+                      int i) {
+  vec0_cursor *pCur = (vec0_cursor *)cur;
+  vec0_vtab *pVtab = (vec0_vtab *)cur->pVtab;
+  switch (pCur->query_plan) {
+  case VEC0_QUERY_PLAN_FULLSCAN: {
+    return vec0Column_fullscan(pVtab, pCur, context, i);
+  }
+  case VEC0_QUERY_PLAN_KNN: {
+    return vec0Column_knn(pVtab, pCur, context, i);
+  }
+  case VEC0_QUERY_PLAN_POINT: {
+    return vec0Column_point(pVtab, pCur, context, i);
+  }
+  }
+  return SQLITE_OK;
+}
+
+/**
+ * @brief Handles the "insert rowid" step of a row insert operation of a vec0
+ * table.
+ *
+ * This function will insert a new row into the _rowids vec0 shadow table.
+ *
+ * @param p: virtual table
+ * @param idValue: Value containing the inserted rowid/id value.
+ * @param rowid: Output rowid, will point to the "real" i64 rowid
+ * value that was inserted
+ * @return int SQLITE_OK on success, error code on failure
+ */
+int vec0Update_InsertRowidStep(vec0_vtab *p, sqlite3_value *idValue,
+                               i64 *rowid) {
+
+  /**
+   * An insert into a vec0 table can happen a few different ways:
+   *  1) With default INTEGER primary key: With a supplied i64 rowid
+   *  2) With default INTEGER primary key: WITHOUT a supplied rowid
+   *  3) With TEXT primary key: supplied text rowid
+   */
+
+  int rc;
+
+  // Option 3: vtab has a user-defined TEXT primary key, so ensure a text value
+  // is provided.
+  if (p->pkIsText) {
+    if (sqlite3_value_type(idValue) != SQLITE_TEXT) {
+      // IMP: V04200_21039
+      vtab_set_error(&p->base,
+                     "The %s virtual table was declared with a TEXT primary "
+                     "key, but a non-TEXT value was provided in an INSERT.",
+                     p->tableName);
+      return SQLITE_ERROR;
+    }
+
+    return vec0_rowids_insert_id(p, idValue, rowid);
+  }
+
+  // Option 1: User supplied a i64 rowid
+  if (sqlite3_value_type(idValue) == SQLITE_INTEGER) {
+    i64 suppliedRowid = sqlite3_value_int64(idValue);
+    rc = vec0_rowids_insert_rowid(p, suppliedRowid);
+    if (rc == SQLITE_OK) {
+      *rowid = suppliedRowid;
+    }
+    return rc;
+  }
+
+  // Option 2: User did not suppled a rowid
+
+  if (sqlite3_value_type(idValue) != SQLITE_NULL) {
+    // IMP: V30855_14925
+    vtab_set_error(&p->base,
+                   "Only integers are allows for primary key values on %s",
+                   p->tableName);
+    return SQLITE_ERROR;
+  }
+  // NULL to get next auto-incremented value
+  return vec0_rowids_insert_id(p, NULL, rowid);
+}
+
+/**
+ * @brief Determines the "next available" chunk position for a newly inserted
+ * vec0 row.
+ *
+ * This operation may insert a new "blank" chunk the _chunks table, if there is
+ * no more space in previous chunks. The fullest chunk with free offsets in
+ * _free_chunks is tried first, so holes left by deletes are filled.
+ *
+ * @param p: virtual table
+ * @param partitionKeyValues: array of partition key column values, to constrain
+ * against any partition key columns.
+ * @param chunk_rowid: Output rowid of the chunk in the _chunks virtual table
+ * that has the avialabiity.
+ * @param chunk_offset: Output the index of the available space insert the
+ * chunk, based on the index of the first available validity bit.
+ * @param pBlobValidity: Output blob of the validity column of the available
+ * chunk. Will be opened with read/write permissions.
+ * @param pValidity: Output buffer of the original chunk's validity column.
+ *    Needs to be cleaned up with sqlite3_free().
+ * @return int SQLITE_OK on success, error code on failure
+ */
+int vec0Update_InsertNextAvailableStep(
+    vec0_vtab *p,
+    sqlite3_value ** partitionKeyValues,
+    i64 *chunk_rowid, i64 *chunk_offset,
+    sqlite3_blob **blobChunksValidity,
+    const unsigned char **bufferChunksValidity) {
+
+  int rc;
+  i64 validitySize;
+  int newPartition = 0;
+  // the fullest chunk with free offsets, or else the latest chunk
+  int fromFreeChunks = vec0_has_free_chunks(p);
+  *chunk_offset = -1;
+
+next_chunk:
+  if (fromFreeChunks) {
+    rc = vec0_free_chunks_fullest(p, partitionKeyValues, chunk_rowid);
+    if (rc == SQLITE_EMPTY) {
+      fromFreeChunks = 0;
+    } else if (rc != SQLITE_OK) {
+      goto cleanup;
+    }
+  }
+  if (!fromFreeChunks) {
+    rc = vec0_get_latest_chunk_rowid(p, chunk_rowid, partitionKeyValues);
+    if(rc == SQLITE_EMPTY) {
+      // no chunks yet for these partition key values
+      newPartition = 1;
+      goto done;
+    }
+    if (rc != SQLITE_OK) {
+      goto cleanup;
+    }
+  }
+
+  rc = sqlite3_blob_open(p->db, p->schemaName, p->shadowChunksName, "validity",
+                         *chunk_rowid, 1, blobChunksValidity);
+  if (rc != SQLITE_OK) {
+    // IMP: V22053_06123
+    vtab_set_error(&p->base,
+                   VEC_INTERAL_ERROR
+                   "could not open validity blob on %s.%s.%lld",
+                   p->schemaName, p->shadowChunksName, *chunk_rowid);
+    goto cleanup;
+  }
+
+  validitySize = sqlite3_blob_bytes(*blobChunksValidity);
+  if (validitySize != p->chunk_size / CHAR_BIT) {
+    // IMP: V29362_13432
+    vtab_set_error(&p->base,
+                   VEC_INTERAL_ERROR
+                   "validity blob size mismatch on "
+                   "%s.%s.%lld, expected %lld but received %lld.",
+                   p->schemaName, p->shadowChunksName, *chunk_rowid,
+                   (i64)(p->chunk_size / CHAR_BIT), validitySize);
+    rc = SQLITE_ERROR;
+    goto cleanup;
+  }
+
+  *bufferChunksValidity = sqlite3_malloc(validitySize);
+  if (!(*bufferChunksValidity)) {
+    vtab_set_error(&p->base, VEC_INTERAL_ERROR
+                   "Could not allocate memory for validity bitmap");
+    rc = SQLITE_NOMEM;
+    goto cleanup;
+  }
+
+  rc = sqlite3_blob_read(*blobChunksValidity, (void *)*bufferChunksValidity,
+                         validitySize, 0);
+
+  if (rc != SQLITE_OK) {
+    vtab_set_error(&p->base,
+                   VEC_INTERAL_ERROR
+                   "Could not read validity bitmap for %s.%s.%lld",
+                   p->schemaName, p->shadowChunksName, *chunk_rowid);
+    goto cleanup;
+  }
+
+  // find the next available offset, ie first `0` in the bitmap.
+  for (int i = 0; i < validitySize; i++) {
+    if ((*bufferChunksValidity)[i] == 0b11111111)
+      continue;
+    for (int j = 0; j < CHAR_BIT; j++) {
+      if (((((*bufferChunksValidity)[i] >> j) & 1) == 0)) {
+        *chunk_offset = (i * CHAR_BIT) + j;
+        goto done;
+      }
+    }
+  }
+
+  if (fromFreeChunks) {
+    // the chunk filled up since its count was written
+    rc = vec0_free_chunks_set(p, *chunk_rowid, 0, 0);
+    sqlite3_blob_close(*blobChunksValidity);
+    sqlite3_free((void *)*bufferChunksValidity);
+    *blobChunksValidity = NULL;
+    *bufferChunksValidity = NULL;
+    if (rc != SQLITE_OK) {
+      goto cleanup;
+    }
+    goto next_chunk;
+  }
+
+done:
+  // latest chunk was full, so need to create a new one
+  if (*chunk_offset == -1) {
+    rc = vec0_new_chunk(p, partitionKeyValues, chunk_rowid);
+    if (rc != SQLITE_OK) {
+      // IMP: V08441_25279
+      vtab_set_error(&p->base,
+                     VEC_INTERAL_ERROR "Could not insert a new vector chunk");
+      rc = SQLITE_ERROR; // otherwise raises a DatabaseError and not operational
+                         // error?
+      goto cleanup;
+    }
+    *chunk_offset = 0;
+    if (newPartition) {
+      vec0_stats_add(p, 0, 0, 1);
+    }
+
+    // blobChunksValidity and pValidity are stale, pointing to the previous
+    // (full) chunk. to re-assign them
+    rc = sqlite3_blob_close(*blobChunksValidity);
+    sqlite3_free((void *)*bufferChunksValidity);
+    *blobChunksValidity = NULL;
+    *bufferChunksValidity = NULL;
+    if (rc != SQLITE_OK) {
+      vtab_set_error(&p->base, VEC_INTERAL_ERROR
+                     "unknown error, blobChunksValidity could not be closed, "
+                     "please file an issue.");
+      rc = SQLITE_ERROR;
+      goto cleanup;
+    }
+
+    rc = sqlite3_blob_open(p->db, p->schemaName, p->shadowChunksName,
+                           "validity", *chunk_rowid, 1, blobChunksValidity);
+    if (rc != SQLITE_OK) {
+      vtab_set_error(
+          &p->base,
+          VEC_INTERAL_ERROR
+          "Could not open validity blob for newly created chunk %s.%s.%lld",
+          p->schemaName, p->shadowChunksName, *chunk_rowid);
+      goto cleanup;
+    }
+    validitySize = sqlite3_blob_bytes(*blobChunksValidity);
+    if (validitySize != p->chunk_size / CHAR_BIT) {
+      vtab_set_error(&p->base,
+                     VEC_INTERAL_ERROR
+                     "validity blob size mismatch for newly created chunk "
+                     "%s.%s.%lld. Exepcted %lld, got %lld",
+                     p->schemaName, p->shadowChunksName, *chunk_rowid,
+                     p->chunk_size / CHAR_BIT, validitySize);
+      goto cleanup;
+    }
+    *bufferChunksValidity = sqlite3_malloc(validitySize);
+    if (!*bufferChunksValidity) {
+      rc = SQLITE_NOMEM;
+      goto cleanup;
+    }
+    rc = sqlite3_blob_read(*blobChunksValidity, (void *)*bufferChunksValidity,
+                           validitySize, 0);
+    if (rc != SQLITE_OK) {
+      vtab_set_error(&p->base,
+                     VEC_INTERAL_ERROR
+                     "could not read validity blob newly created chunk "
+                     "%s.%s.%lld",
+                     p->schemaName, p->shadowChunksName, *chunk_rowid);
+      goto cleanup;
+    }
+  }
+
+  rc = SQLITE_OK;
+
+cleanup:
+  return rc;
+}
+
+/**
+ * @brief Write the free offsets count of a chunk inserts went to back to
+ * _free_chunks, if deletes freed some or the chunk is full. Otherwise inserts
+ * leave the count too high.
+ */
+static int vec0_write_chunk_writeback(vec0_vtab *p,
+                                      struct Vec0WriteChunk *entry) {
+  i64 nFree = vec0_validity_free_count(p, entry->validity);
+  if (!entry->freed && nFree > 0) {
+    return SQLITE_OK;
+  }
+  return vec0_free_chunks_set(p, entry->chunk_id, nFree, 0);
+}
+
+/**
+ * @brief Write the free offsets counts deletes changed back, and forget the
+ * chunks inserts went to.
+ */
+static int vec0_write_chunks_flush(vec0_vtab *p) {
+  int rc = vec0_free_chunks_pending_flush(p);
+  for (int i = 0; i < VEC0_WRITE_CHUNK_CACHE_SIZE; i++) {
+    struct Vec0WriteChunk *entry = &p->writeChunks[i];
+    if (entry->validity && rc == SQLITE_OK) {
+      rc = vec0_write_chunk_writeback(p, entry);
+    }
+    vec0_write_chunk_clear(entry);
+  }
+  return rc;
+}
+
+/**
+ * @brief Position of an inserted row: the first free offset of the chunk the
+ * partition's inserts go to in this transaction. The chunk and its validity
+ * bitmap are looked up on the partition's first insert, and again once the
+ * chunk is full.
+ *
+ * @param pValidity: Output validity bitmap of the chunk, to mark the row in
+ * with vec0Update_InsertWriteFinalStep(). Owned by the table.
+ */
+static int vec0_write_chunk_position(vec0_vtab *p,
+                                     sqlite3_value **partitionKeyValues,
+                                     i64 *chunk_rowid, i64 *chunk_offset,
+                                     unsigned char **pValidity) {
+  struct Vec0WriteChunk *entry = NULL;
+  struct Vec0WriteChunk *victim = &p->writeChunks[0];
+  int rc;
+
+  for (int i = 0; i < VEC0_WRITE_CHUNK_CACHE_SIZE && !entry; i++) {
+    struct Vec0WriteChunk *e = &p->writeChunks[i];
+    if (!e->validity) {
+      victim = e;
+      continue;
+    }
+    int same = 1;
+    for (int j = 0; j < p->numPartitionColumns && same; j++) {
+      same = vec0_value_equals(e->partitionKeyValues[j], partitionKeyValues[j]);
+    }
+    if (same) {
+      entry = e;
+    } else if (victim->validity && e->lastUsed < victim->lastUsed) {
+      victim = e;
+    }
+  }
+
+  i64 offset = entry ? entry->nextFree : 0;
+  while (entry && offset < p->chunk_size &&
+         ((entry->validity[offset / CHAR_BIT] >> (offset % CHAR_BIT)) & 1)) {
+    offset++;
+  }
+  if (entry && offset == p->chunk_size) {
+    // full, the next chunk is looked up like on the first insert
+    rc = vec0_free_chunks_set(p, entry->chunk_id, 0, 0);
+    vec0_write_chunk_clear(entry);
+    if (rc != SQLITE_OK) {
+      return rc;
+    }
+    victim = entry;
+    entry = NULL;
+  }
+
+  if (!entry) {
+    sqlite3_blob *blobChunksValidity = NULL;
+    const unsigned char *bufferChunksValidity = NULL;
+    entry = victim;
+    if (entry->validity) {
+      rc = vec0_write_chunk_writeback(p, entry);
+      vec0_write_chunk_clear(entry);
+      if (rc != SQLITE_OK) {
+        return rc;
+      }
+    }
+    rc = vec0Update_InsertNextAvailableStep(
+        p, partitionKeyValues, &entry->chunk_id, &entry->nextFree,
+        &blobChunksValidity, &bufferChunksValidity);
+    sqlite3_blob_close(blobChunksValidity);
+    if (rc != SQLITE_OK) {
+      sqlite3_free((void *)bufferChunksValidity);
+      return rc;
+    }
+    entry->validity = (u8 *)bufferChunksValidity;
+    for (int i = 0; i < p->numPartitionColumns; i++) {
+      entry->partitionKeyValues[i] = sqlite3_value_dup(partitionKeyValues[i]);
+      if (!entry->partitionKeyValues[i]) {
+        vec0_write_chunk_clear(entry);
+        return SQLITE_NOMEM;
+      }
+    }
+    offset = entry->nextFree;
+  }
+  entry->lastUsed = ++p->writeChunksClock;
+  entry->nextFree = offset;
+  *chunk_rowid = entry->chunk_id;
+  *chunk_offset = offset;
+  *pValidity = entry->validity;
+  return SQLITE_OK;
+}
+
+/**
+ * @brief Mark a deleted row's offset as free in the chunk inserts go to, if
+ * it's that chunk.
+ *
+ * @return 1 if the chunk is one inserts go to, 0 if not
+ */
+static int vec0_write_chunk_free_slot(vec0_vtab *p, i64 chunk_id,
+                                      i64 chunk_offset) {
+  for (int i = 0; i < VEC0_WRITE_CHUNK_CACHE_SIZE; i++) {
+    struct Vec0WriteChunk *entry = &p->writeChunks[i];
+    if (entry->validity && entry->chunk_id == chunk_id) {
+      entry->validity[chunk_offset / CHAR_BIT] &=
+          ~(1 << (chunk_offset % CHAR_BIT));
+      entry->nextFree = min(entry->nextFree, chunk_offset);
+      entry->freed = 1;
+      return 1;
+    }
+  }
+  return 0;
+}
+
+/**
+ * @brief Write the vector data into the provided vector blob at the given
+ * offset
+ *
+ * @param blobVectors SQLite BLOB to write to
+ * @param chunk_offset the "offset" (ie validity bitmap position) to write the
+ * vector to
+ * @param bVector pointer to the vector containing data
+ * @param dimensions how many dimensions the vector has
+ * @param element_type the vector type
+ * @return result of sqlite3_blob_write, SQLITE_OK on success, otherwise failure
+ */
+static int
+vec0_write_vector_to_vector_blob(sqlite3_blob *blobVectors, i64 chunk_offset,
+                                 const void *bVector, size_t dimensions,
+                                 enum VectorElementType element_type) {
+  int n = 0;
+  int offset = 0;
+
+  switch (element_type) {
+  case SQLITE_VEC_ELEMENT_TYPE_FLOAT32:
+    n = dimensions * sizeof(f32);
+    offset = chunk_offset * dimensions * sizeof(f32);
+    break;
+  case SQLITE_VEC_ELEMENT_TYPE_INT8:
+    n = dimensions * sizeof(i8);
+    offset = chunk_offset * dimensions * sizeof(i8);
+    break;
+  case SQLITE_VEC_ELEMENT_TYPE_BIT:
+    n = dimensions / CHAR_BIT;
+    offset = chunk_offset * dimensions / CHAR_BIT;
+    break;
+  default:
+    return SQLITE_ERROR;
+  }
+
+  return sqlite3_blob_write(blobVectors, bVector, n, offset);
+}
+
+/**
+ * @brief
+ *
+ * @param p vec0 virtual table
+ * @param chunk_rowid: which chunk to write to
+ * @param chunk_offset: the offset inside the chunk to write the vector to.
+ * @param rowid: the rowid of the inserting row
+ * @param vectorDatas: array of the vector data to insert
+ * @param bufferChunksValidity: the valdity column of the row's assigned
+ * chunk, where the row's bit is set once written.
+ * @return int SQLITE_OK on success, error code on failure
+ */
+int vec0Update_InsertWriteFinalStep(vec0_vtab *p, i64 chunk_rowid,
+                                    i64 chunk_offset, i64 rowid,
+                                    void *vectorDatas[],
+                                    unsigned char *bufferChunksValidity) {
+  int rc, brc;
+  sqlite3_blob *blobChunksValidity = NULL;
+  sqlite3_blob *blobChunksRowids = NULL;
+
+  rc = sqlite3_blob_open(p->db, p->schemaName, p->shadowChunksName, "validity",
+                         chunk_rowid, 1, &blobChunksValidity);
+  if (rc != SQLITE_OK) {
+    vtab_set_error(&p->base,
+                   VEC_INTERAL_ERROR
+                   "could not open validity blob on %s.%s.%lld",
+                   p->schemaName, p->shadowChunksName, chunk_rowid);
+    return rc;
+  }
+  // mark the validity bit for this row in the chunk's validity bitmap
+  // Get the byte offset of the bitmap
+  char unsigned bx = bufferChunksValidity[chunk_offset / CHAR_BIT];
+  // set the bit at the chunk_offset position inside that byte
+  bx = bx | (1 << (chunk_offset % CHAR_BIT));
+  // write that 1 byte
+  rc = sqlite3_blob_write(blobChunksValidity, &bx, 1, chunk_offset / CHAR_BIT);
+  sqlite3_blob_close(blobChunksValidity);
+  if (rc != SQLITE_OK) {
+    vtab_set_error(&p->base, VEC_INTERAL_ERROR "could not mark validity bit ");
+    return rc;
+  }
+  bufferChunksValidity[chunk_offset / CHAR_BIT] = bx;
+
+  // Go insert the vector data into the vector chunk shadow tables
+  for (int i = 0; i < p->numVectorColumns; i++) {
+    sqlite3_blob *blobVectors;
+    rc = sqlite3_blob_open(p->db, p->schemaName, p->shadowVectorChunksNames[i],
+                           "vectors", chunk_rowid, 1, &blobVectors);
+    if (rc != SQLITE_OK) {
+      vtab_set_error(&p->base, "Error opening vector blob at %s.%s.%lld",
+                     p->schemaName, p->shadowVectorChunksNames[i], chunk_rowid);
+      goto cleanup;
+    }
+
+    i64 expected =
+        p->chunk_size * vector_column_byte_size(p->vector_columns[i]);
+    i64 actual = sqlite3_blob_bytes(blobVectors);
+
+    if (actual != expected) {
+      // IMP: V16386_00456
+      vtab_set_error(
+          &p->base,
+          VEC_INTERAL_ERROR
+          "vector blob size mismatch on %s.%s.%lld. Expected %lld, actual %lld",
+          p->schemaName, p->shadowVectorChunksNames[i], chunk_rowid, expected,
+          actual);
+      rc = SQLITE_ERROR;
+      // already error, can ignore result code
+      sqlite3_blob_close(blobVectors);
+      goto cleanup;
+    };
+
+    rc = vec0_write_vector_to_vector_blob(
+        blobVectors, chunk_offset, vectorDatas[i],
+        p->vector_columns[i].dimensions, p->vector_columns[i].element_type);
+    if (rc != SQLITE_OK) {
+      vtab_set_error(&p->base,
+                     VEC_INTERAL_ERROR
+                     "could not write vector blob on %s.%s.%lld",
+                     p->schemaName, p->shadowVectorChunksNames[i], chunk_rowid);
+      rc = SQLITE_ERROR;
+      // already error, can ignore result code
+      sqlite3_blob_close(blobVectors);
+      goto cleanup;
+    }
+    rc = sqlite3_blob_close(blobVectors);
+    if (rc != SQLITE_OK) {
+      vtab_set_error(&p->base,
+                     VEC_INTERAL_ERROR
+                     "could not close vector blob on %s.%s.%lld",
+                     p->schemaName, p->shadowVectorChunksNames[i], chunk_rowid);
+      rc = SQLITE_ERROR;
+      goto cleanup;
+    }
+
+    if (vec0_has_chunk_summary(p, i)) {
+      rc = vec0_chunk_summary_add(p, i, chunk_rowid, vectorDatas[i], 0);
+      if (rc != SQLITE_OK) {
+        goto cleanup;
+      }
+    }
+  }
+
+  // write the new rowid to the rowids column of the _chunks table
+  rc = sqlite3_blob_open(p->db, p->schemaName, p->shadowChunksName, "rowids",
+                         chunk_rowid, 1, &blobChunksRowids);
+  if (rc != SQLITE_OK) {
+    // IMP: V09221_26060
+    vtab_set_error(&p->base,
+                   VEC_INTERAL_ERROR "could not open rowids blob on %s.%s.%lld",
+                   p->schemaName, p->shadowChunksName, chunk_rowid);
+    goto cleanup;
+  }
+  i64 expected = p->chunk_size * sizeof(i64);
+  i64 actual = sqlite3_blob_bytes(blobChunksRowids);
+  if (expected != actual) {
+    // IMP: V12779_29618
+    vtab_set_error(
+        &p->base,
+        VEC_INTERAL_ERROR
+        "rowids blob size mismatch on %s.%s.%lld. Expected %lld, actual %lld",
+        p->schemaName, p->shadowChunksName, chunk_rowid, expected, actual);
+    rc = SQLITE_ERROR;
+    goto cleanup;
+  }
+  rc = sqlite3_blob_write(blobChunksRowids, &rowid, sizeof(i64),
+                          chunk_offset * sizeof(i64));
+  if (rc != SQLITE_OK) {
+    vtab_set_error(
+        &p->base, VEC_INTERAL_ERROR "could not write rowids blob on %s.%s.%lld",
+        p->schemaName, p->shadowChunksName, chunk_rowid);
+    rc = SQLITE_ERROR;
+    goto cleanup;
+  }
+
+  // Now with all the vectors inserted, go back and update the _rowids table
+  // with the new chunk_rowid/chunk_offset values
+  rc = vec0_rowids_update_position(p, rowid, chunk_rowid, chunk_offset);
+
+cleanup:
+  brc = sqlite3_blob_close(blobChunksRowids);
+  if ((rc == SQLITE_OK) && (brc != SQLITE_OK)) {
+    vtab_set_error(
+        &p->base, VEC_INTERAL_ERROR "could not close rowids blob on %s.%s.%lld",
+        p->schemaName, p->shadowChunksName, chunk_rowid);
+    return brc;
+  }
+  return rc;
+}
+
+/**
+ * @brief Start a bulk load on the table, see 'bulk-begin'. Rows inserted
+ * until 'bulk-end' are kept in memory per chunk and written by
+ * vec0_bulk_flush() once the chunk is full, before any other read or write of
+ * the table, and when the transaction or a savepoint commits.
+ */
+static int vec0_bulk_begin(vec0_vtab *p) {
+  struct Vec0BulkChunk *bulk;
+  if (p->bulk) {
+    return SQLITE_OK;
+  }
+  bulk = sqlite3_malloc(sizeof(*bulk));
+  if (!bulk) {
+    return SQLITE_NOMEM;
+  }
+  memset(bulk, 0, sizeof(*bulk));
+  bulk->chunk_id = -1;
+  bulk->validity = sqlite3_malloc(p->chunk_size / CHAR_BIT);
+  bulk->offsets = sqlite3_malloc64(p->chunk_size * sizeof(i64));
+  bulk->rowids = sqlite3_malloc64(p->chunk_size * sizeof(i64));
+  int failed = !bulk->validity || !bulk->offsets || !bulk->rowids;
+  for (int i = 0; i < p->numVectorColumns; i++) {
+    bulk->vectors[i] = sqlite3_malloc64(
+        p->chunk_size * vector_column_byte_size(p->vector_columns[i]));
+    failed = failed || !bulk->vectors[i];
+  }
+  if (failed) {
+    vec0_bulk_free(bulk);
+    return SQLITE_NOMEM;
+  }
+  p->bulk = bulk;
+  return SQLITE_OK;
+}
+
+/**
+ * @brief Write n bytes of data for every buffered row of a bulk load to a
+ * column of the chunk, with one blob write per run of consecutive offsets.
+ * data holds n bytes per chunk offset.
+ */
+static int vec0_bulk_write_runs(vec0_vtab *p, const char *zTable,
+                                const char *zColumn, i64 chunk_id,
+                                const u8 *data, i64 n) {
+  struct Vec0BulkChunk *bulk = p->bulk;
+  sqlite3_blob *blob = NULL;
+  int rc = sqlite3_blob_open(p->db, p->schemaName, zTable, zColumn, chunk_id,
+                             1, &blob);
+  for (i64 i = 0; rc == SQLITE_OK && i < bulk->n;) {
+    i64 j = i + 1;
+    while (j < bulk->n && bulk->offsets[j] == bulk->offsets[j - 1] + 1) {
+      j++;
+    }
+    rc = sqlite3_blob_write(blob, data + bulk->offsets[i] * n,
+                            (int)((j - i) * n), (int)(bulk->offsets[i] * n));
+    i = j;
+  }
+  int brc = sqlite3_blob_close(blob);
+  if (rc == SQLITE_OK) {
+    rc = brc;
+  }
+  if (rc != SQLITE_OK) {
+    vtab_set_error(&p->base,
+                   VEC_INTERAL_ERROR "could not write %s blob on %s.%s.%lld",
+                   zColumn, p->schemaName, zTable, chunk_id);
+  }
+  return rc;
+}
+
+static int vec0_bulk_write_whole(vec0_vtab *p, const char *zTable,
+                                 const char *zColumn, i64 chunk_id,
+                                 const u8 *data, int n) {
+  sqlite3_blob *blob = NULL;
+  int rc = sqlite3_blob_open(p->db, p->schemaName, zTable, zColumn, chunk_id,
+                             1, &blob);
+  if (rc == SQLITE_OK) {
+    rc = sqlite3_blob_write(blob, data, n, 0);
+  }
+  int brc = sqlite3_blob_close(blob);
+  if (rc == SQLITE_OK) {
+    rc = brc;
+  }
+  if (rc != SQLITE_OK) {
+    vtab_set_error(&p->base,
+                   VEC_INTERAL_ERROR "could not write %s blob on %s.%s.%lld",
+                   zColumn, p->schemaName, zTable, chunk_id);
+  }
+  return rc;
+}
+
+/**
+ * @brief Write the rows buffered by a bulk load to their chunk: the validity
+ * and metadata chunks whole, rowids and vectors by runs of offsets. Their
+ * _rowids positions, chunk summaries and vector indexes are then updated row
+ * by row. The buffer is emptied, even on error.
+ */
+static int vec0_bulk_flush(vec0_vtab *p) {
+  struct Vec0BulkChunk *bulk = p->bulk;
+  int rc = SQLITE_OK;
+  if (!bulk || bulk->chunk_id < 0) {
+    return SQLITE_OK;
+  }
+  i64 chunk_id = bulk->chunk_id;
+  int busy = bulk->busy;
+  bulk->busy = 1;
+  // metadata writes made while flushing go to the blobs
+  bulk->chunk_id = -1;
+  if (bulk->n == 0) {
+    goto done;
+  }
+
+  rc = vec0_bulk_write_whole(p, p->shadowChunksName, "validity", chunk_id,
+                             bulk->validity, p->chunk_size / CHAR_BIT);
+  if (rc != SQLITE_OK) {
+    goto done;
+  }
+  rc = vec0_free_chunks_set(p, chunk_id,
+                            vec0_validity_free_count(p, bulk->validity), 0);
+  if (rc != SQLITE_OK) {
+    goto done;
+  }
+  rc = vec0_bulk_write_runs(p, p->shadowChunksName, "rowids", chunk_id,
+                            (const u8 *)bulk->rowids, sizeof(i64));
+  if (rc != SQLITE_OK) {
+    goto done;
+  }
+  for (int i = 0; i < p->numVectorColumns; i++) {
+    rc = vec0_bulk_write_runs(p, p->shadowVectorChunksNames[i], "vectors",
+                              chunk_id, bulk->vectors[i],
+                              vector_column_byte_size(p->vector_columns[i]));
+    if (rc != SQLITE_OK) {
+      goto done;
+    }
+  }
+  for (int i = 0; i < p->numMetadataColumns; i++) {
+    rc = vec0_bulk_write_whole(p, p->shadowMetadataChunksNames[i], "data",
+                               chunk_id, bulk->metadata[i],
+                               bulk->metadataSizes[i]);
+    if (rc != SQLITE_OK) {
+      goto done;
+    }
+  }
+
+  for (i64 k = 0; k < bulk->n; k++) {
+    i64 chunk_offset = bulk->offsets[k];
+    i64 rowid = bulk->rowids[chunk_offset];
+    rc = vec0_rowids_update_position(p, rowid, chunk_id, chunk_offset);
+    if (rc != SQLITE_OK) {
+      goto done;
+    }
+    for (int i = 0; i < p->numVectorColumns; i++) {
+      const void *vector =
+          (const u8 *)bulk->vectors[i] +
+          chunk_offset * vector_column_byte_size(p->vector_columns[i]);
+      if (vec0_has_chunk_summary(p, i)) {
+        rc = vec0_chunk_summary_add(p, i, chunk_id, vector, 0);
+        if (rc != SQLITE_OK) {
+          goto done;
+        }
+      }
+      if (vec0_has_ivf_index(p, i)) {
+        rc = vec0_ivf_assign(p, i, rowid, vector);
+        if (rc != SQLITE_OK) {
+          goto done;
+        }
+      }
+      if (vec0_has_hnsw_index(p, i)) {
+        rc = vec0_hnsw_insert(p, i, rowid, vector);
+        if (rc != SQLITE_OK) {
+          goto done;
+        }
+      }
+      if (vec0_has_diskann_index(p, i)) {
+        rc = vec0_diskann_insert(p, i, chunk_id, chunk_offset, vector);
+        if (rc != SQLITE_OK) {
+          goto done;
+        }
+      }
+    }
+  }
+
+done:
+  vec0_bulk_discard(bulk);
+  bulk->busy = busy;
+  return rc;
+}
+
+/**
+ * @brief Start filling the next available chunk of the given partition in a
+ * bulk load, copying its validity bitmap and metadata chunks.
+ */
+static int vec0_bulk_start_chunk(vec0_vtab *p,
+                                 sqlite3_value **partitionKeyValues) {
+  struct Vec0BulkChunk *bulk = p->bulk;
+  sqlite3_blob *blobChunksValidity = NULL;
+  const unsigned char *bufferChunksValidity = NULL;
+  i64 chunk_id, chunk_offset;
+  int rc = vec0Update_InsertNextAvailableStep(p, partitionKeyValues, &chunk_id,
+                                              &chunk_offset, &blobChunksValidity,
+                                              &bufferChunksValidity);
+  if (rc == SQLITE_OK) {
+    memcpy(bulk->validity, bufferChunksValidity, p->chunk_size / CHAR_BIT);
+  }
+  sqlite3_free((void *)bufferChunksValidity);
+  sqlite3_blob_close(blobChunksValidity);
+  if (rc != SQLITE_OK) {
+    return rc;
+  }
+
+  for (int i = 0; i < p->numMetadataColumns; i++) {
+    sqlite3_blob *blob = NULL;
+    rc = sqlite3_blob_open(p->db, p->schemaName,
+                           p->shadowMetadataChunksNames[i], "data", chunk_id,
+                           0, &blob);
+    if (rc == SQLITE_OK) {
+      int n = sqlite3_blob_bytes(blob);
+      if (n > bulk->metadataSizes[i]) {
+        u8 *data = sqlite3_realloc(bulk->metadata[i], n);
+        if (!data) {
+          sqlite3_blob_close(blob);
+          return SQLITE_NOMEM;
+        }
+        bulk->metadata[i] = data;
+      }
+      bulk->metadataSizes[i] = n;
+      rc = sqlite3_blob_read(blob, bulk->metadata[i], n, 0);
+    }
+    sqlite3_blob_close(blob);
+    if (rc != SQLITE_OK) {
+      vtab_set_error(&p->base,
+                     VEC_INTERAL_ERROR "could not read metadata chunk %s.%s.%lld",
+                     p->schemaName, p->shadowMetadataChunksNames[i], chunk_id);
+      return rc;
+    }
+  }
+
+  for (int i = 0; i < p->numPartitionColumns; i++) {
+    bulk->partitionKeyValues[i] = sqlite3_value_dup(partitionKeyValues[i]);
+    if (!bulk->partitionKeyValues[i]) {
+      vec0_bulk_discard(bulk);
+      return SQLITE_NOMEM;
+    }
+  }
+  bulk->chunk_id = chunk_id;
+  bulk->n = 0;
+  return SQLITE_OK;
+}
+
+/**
+ * @brief Position of the next row of a bulk load: the first free offset of the
+ * chunk being filled, after flushing it if it's full or of another partition.
+ */
+static int vec0_bulk_next_position(vec0_vtab *p,
+                                   sqlite3_value **partitionKeyValues,
+                                   i64 *chunk_id, i64 *chunk_offset) {
+  struct Vec0BulkChunk *bulk = p->bulk;
+  int rc;
+  for (int attempt = 0; attempt < 2; attempt++) {
+    if (bulk->chunk_id >= 0) {
+      int samePartition = 1;
+      for (int i = 0; i < p->numPartitionColumns; i++) {
+        if (!vec0_value_equals(bulk->partitionKeyValues[i],
+                               partitionKeyValues[i])) {
+          samePartition = 0;
+          break;
+        }
+      }
+      // offsets are handed out in increasing order
+      i64 start = bulk->n > 0 ? bulk->offsets[bulk->n - 1] + 1 : 0;
+      for (i64 i = start; samePartition && i < p->chunk_size; i++) {
+        if (((bulk->validity[i / CHAR_BIT] >> (i % CHAR_BIT)) & 1) == 0) {
+          *chunk_id = bulk->chunk_id;
+          *chunk_offset = i;
+          return SQLITE_OK;
+        }
+      }
+      rc = vec0_bulk_flush(p);
+      if (rc != SQLITE_OK) {
+        return rc;
+      }
+    }
+    rc = vec0_bulk_start_chunk(p, partitionKeyValues);
+    if (rc != SQLITE_OK) {
+      return rc;
+    }
+  }
+  // a started chunk always has a free offset
+  vtab_set_error(&p->base, VEC_INTERAL_ERROR "no free offset in new chunk");
+  return SQLITE_ERROR;
+}
+
+/**
+ * @brief Add an inserted row to the chunk a bulk load is filling, at the
+ * offset from vec0_bulk_next_position().
+ */
+static void vec0_bulk_add(vec0_vtab *p, i64 chunk_offset, i64 rowid,
+                          void *vectorDatas[]) {
+  struct Vec0BulkChunk *bulk = p->bulk;
+  bulk->validity[chunk_offset / CHAR_BIT] |= 1 << (chunk_offset % CHAR_BIT);
+  bulk->rowids[chunk_offset] = rowid;
+  for (int i = 0; i < p->numVectorColumns; i++) {
+    size_t n = vector_column_byte_size(p->vector_columns[i]);
+    memcpy((u8 *)bulk->vectors[i] + chunk_offset * n, vectorDatas[i], n);
+  }
+  bulk->offsets[bulk->n++] = chunk_offset;
+}
+
+/**
+ * @brief Execute a metadata text SQL statement (INSERT/UPDATE/DELETE).
+ *
+ * This helper handles the prepare→bind→step→finalize→free pattern for
+ * metadata text data operations. Takes ownership of zSql and frees it.
+ *
+ * @param db SQLite database connection
+ * @param zSql SQL string allocated by sqlite3_mprintf (will be freed)
+ * @param rowid Row ID to bind to parameter 1
+ * @param text Text data to bind to parameter 2, or NULL for DELETE
+ * @param text_len Length of text data (ignored if text is NULL)
+ * @return SQLITE_OK on success, error code on failure
+ */
+static int vec0_exec_metadata_text_sql(sqlite3 *db, char *zSql, i64 rowid,
+                                       const char *text, int text_len) {
+  sqlite3_stmt *stmt;
+  int rc = sqlite3_prepare_v2(db, zSql, -1, &stmt, NULL);
+  if (rc != SQLITE_OK) {
+    sqlite3_free(zSql);
+    return rc;
+  }
+  sqlite3_bind_int64(stmt, 1, rowid);
+  if (text) {
+    sqlite3_bind_text(stmt, 2, text, text_len, SQLITE_STATIC);
+  }
+  rc = sqlite3_step(stmt);
+  sqlite3_finalize(stmt);
+  sqlite3_free(zSql);
+
+  return (rc == SQLITE_DONE) ? SQLITE_OK : SQLITE_ERROR;
+}
+
+/**
+ * @brief Check that a value matches the type of a metadata column.
+ */
+int vec0_metadata_value_validate(vec0_vtab *p, int metadata_column_idx, sqlite3_value * v) {
+  int rc = SQLITE_OK;
+  struct Vec0MetadataColumnDefinition * metadata_column = &p->metadata_columns[metadata_column_idx];
+  vec0_metadata_column_kind kind = metadata_column->kind;
+
+  switch(kind) {
+    case VEC0_METADATA_COLUMN_KIND_BOOLEAN: {
+      if(sqlite3_value_type(v) != SQLITE_INTEGER || ((sqlite3_value_int(v) != 0) && (sqlite3_value_int(v) != 1))) {
+        rc = SQLITE_ERROR;
+        vtab_set_error(&p->base, "Expected 0 or 1 for BOOLEAN metadata column %.*s", metadata_column->name_length, metadata_column->name);
+        goto done;
+      }
+      break;
+    }
+    case VEC0_METADATA_COLUMN_KIND_INTEGER: {
+      if(sqlite3_value_type(v) != SQLITE_INTEGER) {
+        rc = SQLITE_ERROR;
+        vtab_set_error(&p->base, "Expected integer for INTEGER metadata column %.*s, received %s", metadata_column->name_length, metadata_column->name, type_name(sqlite3_value_type(v)));
+        goto done;
+      }
+      break;
+    }
+    case VEC0_METADATA_COLUMN_KIND_FLOAT: {
+      if(sqlite3_value_type(v) != SQLITE_FLOAT) {
+        rc = SQLITE_ERROR;
+        vtab_set_error(&p->base, "Expected float for FLOAT metadata column %.*s, received %s", metadata_column->name_length, metadata_column->name, type_name(sqlite3_value_type(v)));
+        goto done;
+      }
+      break;
+    }
+    case VEC0_METADATA_COLUMN_KIND_TEXT:
+    case VEC0_METADATA_COLUMN_KIND_DICTIONARY: {
+      if(sqlite3_value_type(v) != SQLITE_TEXT) {
+        rc = SQLITE_ERROR;
+        vtab_set_error(&p->base, "Expected text for TEXT metadata column %.*s, received %s", metadata_column->name_length, metadata_column->name, type_name(sqlite3_value_type(v)));
+        goto done;
+      }
+      break;
+    }
+  }
+
+done:
+  return rc;
+}
+
+/**
+ * @brief Widen the zone map of a metadata column to cover a value written to
+ * one of its chunks. Zones are never narrowed on delete or overwrite, only
+ * rebuilt on 'optimize', see vec0_metadata_zones_rebuild().
+ *
+ * @param p vec0 table, declared with `chunk_summaries=true`
+ * @param metadata_column_idx which metadata column the value was written to
+ * @param chunk_id chunk the value was written to
+ * @param v the written value, already validated for the column's kind
+ * @param code dictionary code of v, only for dictionary-encoded columns
+ * @return int SQLITE_OK on success, error code otherwise
+ */
+static int vec0_metadata_zone_add(vec0_vtab *p, int metadata_column_idx,
+                                  i64 chunk_id, sqlite3_value *v, i64 code) {
+  int rc;
+  sqlite3_stmt *stmt = NULL;
+  // min()/max() return NULL with any NULL argument, so a NULL bound sticks
+  char *zSql = sqlite3_mprintf(
+      "INSERT INTO " VEC0_SHADOW_METADATA_ZONES_N_NAME "(rowid, lo, hi) "
+      "VALUES (?1, ?2, ?2) ON CONFLICT(rowid) DO UPDATE SET "
+      "lo = min(lo, excluded.lo), hi = max(hi, excluded.hi)",
+      p->schemaName, p->tableName, metadata_column_idx);
+  if (!zSql) {
+    return SQLITE_NOMEM;
+  }
+  rc = sqlite3_prepare_v2(p->db, zSql, -1, &stmt, NULL);
+  sqlite3_free(zSql);
+  if (rc != SQLITE_OK) {
+    goto done;
+  }
+  sqlite3_bind_int64(stmt, 1, chunk_id);
+  switch (p->metadata_columns[metadata_column_idx].kind) {
+  case VEC0_METADATA_COLUMN_KIND_BOOLEAN:
+    sqlite3_bind_int(stmt, 2, sqlite3_value_int(v) != 0);
+    break;
+  case VEC0_METADATA_COLUMN_KIND_INTEGER:
+    sqlite3_bind_int64(stmt, 2, sqlite3_value_int64(v));
+    break;
+  case VEC0_METADATA_COLUMN_KIND_FLOAT:
+    // NaN is bound as NULL
+    sqlite3_bind_double(stmt, 2, sqlite3_value_double(v));
+    break;
+  case VEC0_METADATA_COLUMN_KIND_TEXT:
+    // long values aren't kept inline, so they can't be bounded
+    if (sqlite3_value_bytes(v) <= VEC0_METADATA_TEXT_VIEW_DATA_LENGTH) {
+      sqlite3_bind_value(stmt, 2, v);
+    }
+    break;
+  case VEC0_METADATA_COLUMN_KIND_DICTIONARY:
+    sqlite3_bind_int64(stmt, 2, code);
+    break;
+  }
+  rc = sqlite3_step(stmt);
+  if (rc != SQLITE_DONE) {
+    vtab_set_error(&p->base, "could not update zone map of chunk %lld",
+                   chunk_id);
+    rc = SQLITE_ERROR;
+    goto done;
+  }
+  rc = SQLITE_OK;
+
+done:
+  sqlite3_finalize(stmt);
+  return rc;
+}
+
+/**
+ * @brief Recompute the zone map of a metadata column from the values of the
+ * valid rows of every chunk, dropping the bounds of deleted rows.
+ *
+ * @param p vec0 table, declared with `chunk_summaries=true`
+ * @param metadata_column_idx which metadata column to rebuild
+ * @return int SQLITE_OK on success, error code otherwise
+ */
+static int vec0_metadata_zones_rebuild(vec0_vtab *p, int metadata_column_idx) {
+  int rc;
+  sqlite3_stmt *stmtChunks = NULL;
+  sqlite3_stmt *stmtInsert = NULL;
+  vec0_metadata_column_kind kind = p->metadata_columns[metadata_column_idx].kind;
+  i64 expectedSize = vec0_metadata_chunk_size(kind, p->chunk_size);
+
+  char *zSql = sqlite3_mprintf("DELETE FROM " VEC0_SHADOW_METADATA_ZONES_N_NAME,
+                               p->schemaName, p->tableName,
+                               metadata_column_idx);
+  if (!zSql) {
+    return SQLITE_NOMEM;
+  }
+  rc = sqlite3_exec(p->db, zSql, NULL, NULL, NULL);
+  sqlite3_free(zSql);
+  if (rc != SQLITE_OK) {
+    return rc;
+  }
+
+  zSql = sqlite3_mprintf("SELECT c.chunk_id, c.validity, m.data FROM "
+                         VEC0_SHADOW_CHUNKS_NAME " AS c JOIN "
+                         VEC0_SHADOW_METADATA_N_NAME
+                         " AS m ON m.rowid = c.chunk_id",
+                         p->schemaName, p->tableName, p->schemaName,
+                         p->tableName, metadata_column_idx);
+  if (!zSql) {
+    return SQLITE_NOMEM;
+  }
+  rc = sqlite3_prepare_v2(p->db, zSql, -1, &stmtChunks, NULL);
+  sqlite3_free(zSql);
+  if (rc != SQLITE_OK) {
+    goto done;
+  }
+  zSql = sqlite3_mprintf("INSERT INTO " VEC0_SHADOW_METADATA_ZONES_N_NAME
+                         "(rowid, lo, hi) VALUES (?, ?, ?)",
+                         p->schemaName, p->tableName, metadata_column_idx);
+  if (!zSql) {
+    rc = SQLITE_NOMEM;
+    goto done;
+  }
+  rc = sqlite3_prepare_v2(p->db, zSql, -1, &stmtInsert, NULL);
+  sqlite3_free(zSql);
+  if (rc != SQLITE_OK) {
+    goto done;
+  }
+
+  while ((rc = sqlite3_step(stmtChunks)) == SQLITE_ROW) {
+    i64 chunk_id = sqlite3_column_int64(stmtChunks, 0);
+    const u8 *validity = sqlite3_column_blob(stmtChunks, 1);
+    const u8 *data = sqlite3_column_blob(stmtChunks, 2);
+    if (sqlite3_column_bytes(stmtChunks, 1) != p->chunk_size / CHAR_BIT ||
+        sqlite3_column_bytes(stmtChunks, 2) != expectedSize) {
+      vtab_set_error(&p->base,
+                     VEC_INTERAL_ERROR "malformed metadata chunk %lld",
+                     chunk_id);
+      rc = SQLITE_ERROR;
+      goto done;
+    }
+    // index of the smallest and largest valid value, -1 if there's none.
+    // unbounded is set by NaN and long TEXT values.
+    int lo = -1, hi = -1;
+    int unbounded = 0;
+    for (int i = 0; i < p->chunk_size && !unbounded; i++) {
+      if (!bitmap_get((u8 *)validity, i)) {
+        continue;
+      }
+      int below = 0, above = 0;
+      switch (kind) {
+      case VEC0_METADATA_COLUMN_KIND_BOOLEAN: {
+        int x = bitmap_get((u8 *)data, i);
+        below = lo >= 0 && x < bitmap_get((u8 *)data, lo);
+        above = hi >= 0 && x > bitmap_get((u8 *)data, hi);
+        break;
+      }
+      case VEC0_METADATA_COLUMN_KIND_INTEGER:
+      case VEC0_METADATA_COLUMN_KIND_DICTIONARY: {
+        const i64 *values = (const i64 *)data;
+        below = lo >= 0 && values[i] < values[lo];
+        above = hi >= 0 && values[i] > values[hi];
+        break;
+      }
+      case VEC0_METADATA_COLUMN_KIND_FLOAT: {
+        const double *values = (const double *)data;
+        if (isnan(values[i])) {
+          unbounded = 1;
+          continue;
+        }
+        below = lo >= 0 && values[i] < values[lo];
+        above = hi >= 0 && values[i] > values[hi];
+        break;
+      }
+      case VEC0_METADATA_COLUMN_KIND_TEXT: {
+        const u8 *view = &data[i * VEC0_METADATA_TEXT_VIEW_BUFFER_LENGTH];
+        int n = ((const int *)view)[0];
+        if (n > VEC0_METADATA_TEXT_VIEW_DATA_LENGTH) {
+          unbounded = 1;
+          continue;
+        }
+        for (int j = 0; j < 2; j++) {
+          int other = j ? hi : lo;
+          if (other < 0) {
+            continue;
+          }
+          const u8 *otherView =
+              &data[other * VEC0_METADATA_TEXT_VIEW_BUFFER_LENGTH];
+          int otherN = ((const int *)otherView)[0];
+          int cmp = memcmp(view + 4, otherView + 4, min(n, otherN));
+          if (cmp == 0) {
+            cmp = n - otherN;
+          }
+          if (j) {
+            above = cmp > 0;
+          } else {
+            below = cmp < 0;
+          }
+        }
+        break;
+      }
+      }
+      if (lo < 0 || below) {
+        lo = i;
+      }
+      if (hi < 0 || above) {
+        hi = i;
+      }
+    }
+    if (lo < 0 && !unbounded) {
+      continue;
+    }
+
+    sqlite3_reset(stmtInsert);
+    sqlite3_clear_bindings(stmtInsert);
+    sqlite3_bind_int64(stmtInsert, 1, chunk_id);
+    for (int j = 0; j < 2 && !unbounded; j++) {
+      int i = j ? hi : lo;
+      switch (kind) {
+      case VEC0_METADATA_COLUMN_KIND_BOOLEAN:
+        sqlite3_bind_int(stmtInsert, 2 + j, bitmap_get((u8 *)data, i));
+        break;
+      case VEC0_METADATA_COLUMN_KIND_INTEGER:
+      case VEC0_METADATA_COLUMN_KIND_DICTIONARY:
+        sqlite3_bind_int64(stmtInsert, 2 + j, ((const i64 *)data)[i]);
+        break;
+      case VEC0_METADATA_COLUMN_KIND_FLOAT:
+        sqlite3_bind_double(stmtInsert, 2 + j, ((const double *)data)[i]);
+        break;
+      case VEC0_METADATA_COLUMN_KIND_TEXT: {
+        const u8 *view = &data[i * VEC0_METADATA_TEXT_VIEW_BUFFER_LENGTH];
+        sqlite3_bind_text(stmtInsert, 2 + j, (const char *)view + 4,
+                          ((const int *)view)[0], SQLITE_TRANSIENT);
+        break;
+      }
+      }
+    }
+    if (sqlite3_step(stmtInsert) != SQLITE_DONE) {
+      rc = SQLITE_ERROR;
+      goto done;
+    }
+  }
+  if (rc != SQLITE_DONE) {
+    goto done;
+  }
+  rc = SQLITE_OK;
+
+done:
+  sqlite3_finalize(stmtChunks);
+  sqlite3_finalize(stmtInsert);
+  return rc;
+}
+
+static void vec0_metadata_index_bind(sqlite3_stmt *stmt, int iParam,
+                                     i64 iValue, const char *zText,
+                                     int nText) {
+  if (zText) {
+    sqlite3_bind_text(stmt, iParam, zText, nText, SQLITE_TRANSIENT);
+  } else {
+    sqlite3_bind_int64(stmt, iParam, iValue);
+  }
+}
+
+/**
+ * @brief Set or clear the bit of a chunk position in the bitmap index of an
+ * `indexed` metadata column. The row of a value and chunk is deleted once its
+ * last bit is cleared.
+ *
+ * @param p vec0 table
+ * @param metadata_column_idx which metadata column, declared `indexed`
+ * @param chunk_id chunk of the position
+ * @param chunk_offset offset of the position in the chunk
+ * @param iValue INTEGER value or dictionary code, when zText is NULL
+ * @param zText TEXT value, NULL for INTEGER and dictionary-encoded columns
+ * @param nText length of zText in bytes
+ * @param set 1 to set the bit, 0 to clear it
+ * @return int SQLITE_OK on success, error code otherwise
+ */
+static int vec0_metadata_index_set(vec0_vtab *p, int metadata_column_idx,
+                                   i64 chunk_id, i64 chunk_offset, i64 iValue,
+                                   const char *zText, int nText, int set) {
+  int rc;
+  sqlite3_stmt *stmt = NULL;
+  i32 lo, hi;
+  u8 *slots = bitmap_new(p->chunk_size);
+  if (!slots) {
+    return SQLITE_NOMEM;
+  }
+
+  char *zSql = sqlite3_mprintf("SELECT slots FROM " VEC0_SHADOW_METADATA_INDEX_N_NAME
+                               " WHERE value = ?1 AND chunk_id = ?2",
+                               p->schemaName, p->tableName, metadata_column_idx);
+  if (!zSql) {
+    rc = SQLITE_NOMEM;
+    goto done;
+  }
+  rc = sqlite3_prepare_v2(p->db, zSql, -1, &stmt, NULL);
+  sqlite3_free(zSql);
+  if (rc != SQLITE_OK) {
+    goto done;
+  }
+  vec0_metadata_index_bind(stmt, 1, iValue, zText, nText);
+  sqlite3_bind_int64(stmt, 2, chunk_id);
+  rc = sqlite3_step(stmt);
+  if (rc == SQLITE_ROW &&
+      sqlite3_column_bytes(stmt, 0) == p->chunk_size / CHAR_BIT) {
+    memcpy(slots, sqlite3_column_blob(stmt, 0), p->chunk_size / CHAR_BIT);
+  } else if (rc != SQLITE_ROW && rc != SQLITE_DONE) {
+    goto done;
+  }
+  sqlite3_finalize(stmt);
+  stmt = NULL;
+
+  bitmap_set(slots, chunk_offset, set);
+  if (bitmap_span(slots, p->chunk_size, &lo, &hi)) {
+    zSql = sqlite3_mprintf("INSERT OR REPLACE INTO " VEC0_SHADOW_METADATA_INDEX_N_NAME
+                           "(value, chunk_id, slots) VALUES (?1, ?2, ?3)",
+                           p->schemaName, p->tableName, metadata_column_idx);
+  } else {
+    zSql = sqlite3_mprintf("DELETE FROM " VEC0_SHADOW_METADATA_INDEX_N_NAME
+                           " WHERE value = ?1 AND chunk_id = ?2",
+                           p->schemaName, p->tableName, metadata_column_idx);
+  }
+  if (!zSql) {
+    rc = SQLITE_NOMEM;
+    goto done;
+  }
+  rc = sqlite3_prepare_v2(p->db, zSql, -1, &stmt, NULL);
+  sqlite3_free(zSql);
+  if (rc != SQLITE_OK) {
+    goto done;
+  }
+  vec0_metadata_index_bind(stmt, 1, iValue, zText, nText);
+  sqlite3_bind_int64(stmt, 2, chunk_id);
+  if (sqlite3_bind_parameter_count(stmt) == 3) {
+    sqlite3_bind_blob(stmt, 3, slots, p->chunk_size / CHAR_BIT, SQLITE_STATIC);
+  }
+  rc = sqlite3_step(stmt);
+  if (rc != SQLITE_DONE) {
+    goto done;
+  }
+  rc = SQLITE_OK;
+
+done:
+  if (rc != SQLITE_OK) {
+    vtab_set_error(&p->base, "could not update index of metadata column %.*s",
+                   p->metadata_columns[metadata_column_idx].name_length,
+                   p->metadata_columns[metadata_column_idx].name);
+  }
+  sqlite3_finalize(stmt);
+  sqlite3_free(slots);
+  return rc;
+}
+
+/**
+ * @brief Move a row's chunk position in the bitmap index of an `indexed`
+ * metadata column, under the value the row holds now in its chunk: its bit is
+ * cleared, and set at dst_chunk_id/dst_chunk_offset unless dst_chunk_id is
+ * negative.
+ *
+ * @param p vec0 table
+ * @param metadata_column_idx which metadata column, declared `indexed`
+ * @param rowid rowid of the row, to find long TEXT values
+ * @param chunk_id chunk of the row
+ * @param chunk_offset offset of the row in the chunk
+ * @param dst_chunk_id chunk the row moves to, or -1
+ * @param dst_chunk_offset offset the row moves to
+ * @return int SQLITE_OK on success, error code otherwise
+ */
+static int vec0_metadata_index_move(vec0_vtab *p, int metadata_column_idx,
+                                    i64 rowid, i64 chunk_id, i64 chunk_offset,
+                                    i64 dst_chunk_id, i64 dst_chunk_offset) {
+  int rc;
+  sqlite3_blob *blobValue = NULL;
+  sqlite3_stmt *stmt = NULL;
+  i64 iValue = 0;
+  u8 view[VEC0_METADATA_TEXT_VIEW_BUFFER_LENGTH];
+  const char *zText = NULL;
+  int nText = 0;
+
+  rc = sqlite3_blob_open(p->db, p->schemaName,
+                         p->shadowMetadataChunksNames[metadata_column_idx],
+                         "data", chunk_id, 0, &blobValue);
+  if (rc != SQLITE_OK) {
+    return rc;
+  }
+  if (p->metadata_columns[metadata_column_idx].kind !=
+      VEC0_METADATA_COLUMN_KIND_TEXT) {
+    rc = sqlite3_blob_read(blobValue, &iValue, sizeof(i64),
+                           chunk_offset * sizeof(i64));
+    goto set;
+  }
+
+  rc = sqlite3_blob_read(blobValue, view, sizeof(view),
+                         chunk_offset * VEC0_METADATA_TEXT_VIEW_BUFFER_LENGTH);
+  if (rc != SQLITE_OK) {
+    goto done;
+  }
+  nText = ((const int *)view)[0];
+  zText = (const char *)view + 4;
+  if (nText > VEC0_METADATA_TEXT_VIEW_DATA_LENGTH) {
+    char *zSql = sqlite3_mprintf("SELECT data FROM " VEC0_SHADOW_METADATA_TEXT_DATA_NAME
+                                 " WHERE rowid = ?",
+                                 p->schemaName, p->tableName, metadata_column_idx);
+    if (!zSql) {
+      rc = SQLITE_NOMEM;
+      goto done;
+    }
+    rc = sqlite3_prepare_v2(p->db, zSql, -1, &stmt, NULL);
+    sqlite3_free(zSql);
+    if (rc != SQLITE_OK) {
+      goto done;
+    }
+    sqlite3_bind_int64(stmt, 1, rowid);
+    if (sqlite3_step(stmt) != SQLITE_ROW) {
+      rc = SQLITE_ERROR;
+      goto done;
+    }
+    zText = (const char *)sqlite3_column_text(stmt, 0);
+    nText = sqlite3_column_bytes(stmt, 0);
+  }
+
+set:
+  if (rc == SQLITE_OK) {
+    rc = vec0_metadata_index_set(p, metadata_column_idx, chunk_id, chunk_offset,
+                                 iValue, zText, nText, 0);
+  }
+  if (rc == SQLITE_OK && dst_chunk_id >= 0) {
+    rc = vec0_metadata_index_set(p, metadata_column_idx, dst_chunk_id,
+                                 dst_chunk_offset, iValue, zText, nText, 1);
+  }
+
+done:
+  sqlite3_finalize(stmt);
+  sqlite3_blob_close(blobValue);
+  return rc;
+}
+
+/**
+ * @brief Clear a row's chunk position from the bitmap index of an `indexed`
+ * metadata column, under the value the row holds now. Called before that value
+ * is overwritten or cleared.
+ */
+static int vec0_metadata_index_remove(vec0_vtab *p, int metadata_column_idx,
+                                      i64 rowid, i64 chunk_id,
+                                      i64 chunk_offset) {
+  return vec0_metadata_index_move(p, metadata_column_idx, rowid, chunk_id,
+                                  chunk_offset, -1, 0);
+}
+
+// A valid row of a chunk in vec0_metadata_index_rebuild()
+struct Vec0MetadataIndexEntry {
+  i64 value;
+  // owned copy of the TEXT value, NULL for other columns
+  char *zText;
+  int nText;
+  int chunk_offset;
+};
+
+static int vec0_metadata_index_entry_cmp(const void *a, const void *b) {
+  const struct Vec0MetadataIndexEntry *ea = a;
+  const struct Vec0MetadataIndexEntry *eb = b;
+  if (ea->zText) {
+    return vec0_text_cmp(ea->zText, ea->nText, eb->zText, eb->nText);
+  }
+  return (ea->value > eb->value) - (ea->value < eb->value);
+}
+
+/**
+ * @brief Recompute the bitmap index of an `indexed` metadata column from the
+ * values of the valid rows of every chunk.
+ *
+ * @param p vec0 table
+ * @param metadata_column_idx which metadata column to rebuild, declared
+ * `indexed`
+ * @return int SQLITE_OK on success, error code otherwise
+ */
+static int vec0_metadata_index_rebuild(vec0_vtab *p, int metadata_column_idx) {
+  int rc;
+  sqlite3_stmt *stmtChunks = NULL;
+  sqlite3_stmt *stmtText = NULL;
+  sqlite3_stmt *stmtInsert = NULL;
+  vec0_metadata_column_kind kind = p->metadata_columns[metadata_column_idx].kind;
+  i64 expectedSize = vec0_metadata_chunk_size(kind, p->chunk_size);
+  struct Vec0MetadataIndexEntry *entries = NULL;
+  int nEntries = 0;
+  u8 *slots = NULL;
+
+  char *zSql = sqlite3_mprintf("DELETE FROM " VEC0_SHADOW_METADATA_INDEX_N_NAME,
+                               p->schemaName, p->tableName,
+                               metadata_column_idx);
+  if (!zSql) {
+    return SQLITE_NOMEM;
+  }
+  rc = sqlite3_exec(p->db, zSql, NULL, NULL, NULL);
+  sqlite3_free(zSql);
+  if (rc != SQLITE_OK) {
+    return rc;
+  }
+
+  entries = sqlite3_malloc64(p->chunk_size * sizeof(*entries));
+  slots = bitmap_new(p->chunk_size);
+  if (!entries || !slots) {
+    rc = SQLITE_NOMEM;
+    goto done;
+  }
+
+  zSql = sqlite3_mprintf("SELECT c.chunk_id, c.validity, c.rowids, m.data FROM "
+                         VEC0_SHADOW_CHUNKS_NAME " AS c JOIN "
+                         VEC0_SHADOW_METADATA_N_NAME
+                         " AS m ON m.rowid = c.chunk_id",
+                         p->schemaName, p->tableName, p->schemaName,
+                         p->tableName, metadata_column_idx);
+  if (!zSql) {
+    rc = SQLITE_NOMEM;
+    goto done;
+  }
+  rc = sqlite3_prepare_v2(p->db, zSql, -1, &stmtChunks, NULL);
+  sqlite3_free(zSql);
+  if (rc != SQLITE_OK) {
+    goto done;
+  }
+  if (kind == VEC0_METADATA_COLUMN_KIND_TEXT) {
+    zSql = sqlite3_mprintf("SELECT data FROM " VEC0_SHADOW_METADATA_TEXT_DATA_NAME
+                           " WHERE rowid = ?",
+                           p->schemaName, p->tableName, metadata_column_idx);
+    if (!zSql) {
+      rc = SQLITE_NOMEM;
+      goto done;
+    }
+    rc = sqlite3_prepare_v2(p->db, zSql, -1, &stmtText, NULL);
+    sqlite3_free(zSql);
+    if (rc != SQLITE_OK) {
+      goto done;
+    }
+  }
+  zSql = sqlite3_mprintf("INSERT INTO " VEC0_SHADOW_METADATA_INDEX_N_NAME
+                         "(value, chunk_id, slots) VALUES (?, ?, ?)",
+                         p->schemaName, p->tableName, metadata_column_idx);
+  if (!zSql) {
+    rc = SQLITE_NOMEM;
+    goto done;
+  }
+  rc = sqlite3_prepare_v2(p->db, zSql, -1, &stmtInsert, NULL);
+  sqlite3_free(zSql);
+  if (rc != SQLITE_OK) {
+    goto done;
+  }
+
+  while ((rc = sqlite3_step(stmtChunks)) == SQLITE_ROW) {
+    i64 chunk_id = sqlite3_column_int64(stmtChunks, 0);
+    const u8 *validity = sqlite3_column_blob(stmtChunks, 1);
+    const i64 *rowids = sqlite3_column_blob(stmtChunks, 2);
+    const u8 *data = sqlite3_column_blob(stmtChunks, 3);
+    if (sqlite3_column_bytes(stmtChunks, 1) != p->chunk_size / CHAR_BIT ||
+        sqlite3_column_bytes(stmtChunks, 2) !=
+            (int)(p->chunk_size * sizeof(i64)) ||
+        sqlite3_column_bytes(stmtChunks, 3) != expectedSize) {
+      vtab_set_error(&p->base,
+                     VEC_INTERAL_ERROR "malformed metadata chunk %lld",
+                     chunk_id);
+      rc = SQLITE_ERROR;
+      goto done;
+    }
+
+    for (int i = 0; i < p->chunk_size; i++) {
+      if (!bitmap_get((u8 *)validity, i)) {
+        continue;
+      }
+      struct Vec0MetadataIndexEntry *e = &entries[nEntries];
+      memset(e, 0, sizeof(*e));
+      e->chunk_offset = i;
+      if (kind != VEC0_METADATA_COLUMN_KIND_TEXT) {
+        e->value = ((const i64 *)data)[i];
+        nEntries++;
+        continue;
+      }
+      const u8 *view = &data[i * VEC0_METADATA_TEXT_VIEW_BUFFER_LENGTH];
+      int n = ((const int *)view)[0];
+      if (n > VEC0_METADATA_TEXT_VIEW_DATA_LENGTH) {
+        sqlite3_reset(stmtText);
+        sqlite3_bind_int64(stmtText, 1, rowids[i]);
+        if (sqlite3_step(stmtText) != SQLITE_ROW) {
+          vtab_set_error(&p->base,
+                         VEC_INTERAL_ERROR "missing TEXT value of row %lld",
+                         rowids[i]);
+          rc = SQLITE_ERROR;
+          goto done;
+        }
+        n = sqlite3_column_bytes(stmtText, 0);
+        e->zText = sqlite3_mprintf("%.*s", n,
+                                   (const char *)sqlite3_column_text(stmtText, 0));
+      } else {
+        e->zText = sqlite3_mprintf("%.*s", n, (const char *)view + 4);
+      }
+      if (!e->zText) {
+        rc = SQLITE_NOMEM;
+        goto done;
+      }
+      e->nText = n;
+      nEntries++;
+    }
+
+    // one row per distinct value of the chunk
+    qsort(entries, nEntries, sizeof(*entries), vec0_metadata_index_entry_cmp);
+    for (int i = 0; i < nEntries;) {
+      int j = i;
+      bitmap_clear(slots, p->chunk_size);
+      while (j < nEntries &&
+             vec0_metadata_index_entry_cmp(&entries[i], &entries[j]) == 0) {
+        bitmap_set(slots, entries[j].chunk_offset, 1);
+        j++;
+      }
+      sqlite3_reset(stmtInsert);
+      vec0_metadata_index_bind(stmtInsert, 1, entries[i].value,
+                               entries[i].zText, entries[i].nText);
+      sqlite3_bind_int64(stmtInsert, 2, chunk_id);
+      sqlite3_bind_blob(stmtInsert, 3, slots, p->chunk_size / CHAR_BIT,
+                        SQLITE_STATIC);
+      if (sqlite3_step(stmtInsert) != SQLITE_DONE) {
+        rc = SQLITE_ERROR;
+        goto done;
+      }
+      i = j;
+    }
+    for (int i = 0; i < nEntries; i++) {
+      sqlite3_free(entries[i].zText);
+    }
+    nEntries = 0;
+  }
+  if (rc != SQLITE_DONE) {
+    goto done;
+  }
+  rc = SQLITE_OK;
+
+done:
+  for (int i = 0; i < nEntries; i++) {
+    sqlite3_free(entries[i].zText);
+  }
+  sqlite3_free(entries);
+  sqlite3_free(slots);
+  sqlite3_finalize(stmtChunks);
+  sqlite3_finalize(stmtText);
+  sqlite3_finalize(stmtInsert);
+  return rc;
+}
+
+/**
+ * @brief Find the code of a value in the dictionary of a `text dictionary`
+ * metadata column, adding the value if it's new. Values stay in the dictionary
+ * after their last row is deleted.
+ *
+ * @param p vec0 table
+ * @param metadata_column_idx which metadata column the value belongs to
+ * @param v TEXT value
+ * @param code output code of the value
+ * @return int SQLITE_OK on success, error code otherwise
+ */
+static int vec0_metadata_dictionary_code(vec0_vtab *p, int metadata_column_idx,
+                                         sqlite3_value *v, i64 *code) {
+  int rc;
+  sqlite3_stmt *stmt = NULL;
+  char *zSql = sqlite3_mprintf("SELECT code FROM " VEC0_SHADOW_METADATA_DICT_N_NAME
+                               " WHERE value = ?",
+                               p->schemaName, p->tableName, metadata_column_idx);
+  if (!zSql) {
+    return SQLITE_NOMEM;
+  }
+  rc = sqlite3_prepare_v2(p->db, zSql, -1, &stmt, NULL);
+  sqlite3_free(zSql);
+  if (rc != SQLITE_OK) {
+    goto done;
+  }
+  sqlite3_bind_value(stmt, 1, v);
+  rc = sqlite3_step(stmt);
+  if (rc == SQLITE_ROW) {
+    *code = sqlite3_column_int64(stmt, 0);
+    rc = SQLITE_OK;
+    goto done;
+  }
+  if (rc != SQLITE_DONE) {
+    goto done;
+  }
+  sqlite3_finalize(stmt);
+  stmt = NULL;
+
+  zSql = sqlite3_mprintf("INSERT INTO " VEC0_SHADOW_METADATA_DICT_N_NAME
+                         "(value) VALUES (?)",
+                         p->schemaName, p->tableName, metadata_column_idx);
+  if (!zSql) {
+    return SQLITE_NOMEM;
+  }
+  rc = sqlite3_prepare_v2(p->db, zSql, -1, &stmt, NULL);
+  sqlite3_free(zSql);
+  if (rc != SQLITE_OK) {
+    goto done;
+  }
+  sqlite3_bind_value(stmt, 1, v);
+  if (sqlite3_step(stmt) != SQLITE_DONE) {
+    vtab_set_error(&p->base, "could not add value to the dictionary of %.*s",
+                   p->metadata_columns[metadata_column_idx].name_length,
+                   p->metadata_columns[metadata_column_idx].name);
+    rc = SQLITE_ERROR;
+    goto done;
+  }
+  *code = sqlite3_last_insert_rowid(p->db);
+  rc = SQLITE_OK;
+
+done:
+  sqlite3_finalize(stmt);
+  return rc;
+}
+
+// Reads from a metadata chunk through its blob, or from data when it's in
+// memory, see vec0_write_metadata_value().
+static int vec0_metadata_data_read(sqlite3_blob *blob, u8 *data, void *z, int n, int offset) {
+  if(data) {
+    memcpy(z, data + offset, n);
+    return SQLITE_OK;
+  }
+  return sqlite3_blob_read(blob, z, n, offset);
+}
+
+static int vec0_metadata_data_write(sqlite3_blob *blob, u8 *data, const void *z, int n, int offset) {
+  if(data) {
+    memcpy(data + offset, z, n);
+    return SQLITE_OK;
+  }
+  return sqlite3_blob_write(blob, z, n, offset);
+}
+
+int vec0_write_metadata_value(vec0_vtab *p, int metadata_column_idx, i64 rowid, i64 chunk_id, i64 chunk_offset, sqlite3_value * v, int isupdate) {
+  int rc;
+  struct Vec0MetadataColumnDefinition * metadata_column = &p->metadata_columns[metadata_column_idx];
+  vec0_metadata_column_kind kind = metadata_column->kind;
+  i64 code = 0;
+
+  // verify input value matches column type
+  rc = vec0_metadata_value_validate(p, metadata_column_idx, v);
+  if(rc != SQLITE_OK) {
+    goto done;
+  }
+
+  if(kind == VEC0_METADATA_COLUMN_KIND_DICTIONARY) {
+    rc = vec0_metadata_dictionary_code(p, metadata_column_idx, v, &code);
+    if(rc != SQLITE_OK) {
+      goto done;
+    }
+  }
+
+  // the index drops the position under the old value before it's overwritten
+  if(isupdate && metadata_column->indexed) {
+    rc = vec0_metadata_index_remove(p, metadata_column_idx, rowid, chunk_id, chunk_offset);
+    if(rc != SQLITE_OK) {
+      goto done;
+    }
+  }
+
+  // the chunk a bulk load is filling is written in memory
+  u8 * bulkData = NULL;
+  if(p->bulk && p->bulk->chunk_id == chunk_id) {
+    bulkData = p->bulk->metadata[metadata_column_idx];
+  }
+  sqlite3_blob * blobValue = NULL;
+  if(!bulkData) {
+    rc = sqlite3_blob_open(p->db, p->schemaName, p->shadowMetadataChunksNames[metadata_column_idx], "data", chunk_id, 1, &blobValue);
+    if(rc != SQLITE_OK) {
+      goto done;
+    }
+  }
+
+  switch(kind) {
+    case VEC0_METADATA_COLUMN_KIND_BOOLEAN: {
+      u8 block;
+      int value = sqlite3_value_int(v);
+      rc = vec0_metadata_data_read(blobValue, bulkData, &block, sizeof(u8), (int) (chunk_offset / CHAR_BIT));
+      if(rc != SQLITE_OK) {
+        goto done;
+      }
+
+      if (value) {
+        block |= 1 << (chunk_offset % CHAR_BIT);
+      } else {
+        block &= ~(1 << (chunk_offset % CHAR_BIT));
+      }
+
+      rc = vec0_metadata_data_write(blobValue, bulkData, &block, sizeof(u8), chunk_offset / CHAR_BIT);
+      break;
+    }
+    case VEC0_METADATA_COLUMN_KIND_INTEGER: {
+      i64 value = sqlite3_value_int64(v);
+      rc = vec0_metadata_data_write(blobValue, bulkData, &value, sizeof(value), chunk_offset * sizeof(i64));
+      break;
+    }
+    case VEC0_METADATA_COLUMN_KIND_DICTIONARY: {
+      rc = vec0_metadata_data_write(blobValue, bulkData, &code, sizeof(code), chunk_offset * sizeof(i64));
+      break;
+    }
+    case VEC0_METADATA_COLUMN_KIND_FLOAT: {
+      double value = sqlite3_value_double(v);
+      rc = vec0_metadata_data_write(blobValue, bulkData, &value, sizeof(value), chunk_offset * sizeof(double));
+      break;
+    }
+    case VEC0_METADATA_COLUMN_KIND_TEXT: {
+      int prev_n;
+      rc = vec0_metadata_data_read(blobValue, bulkData, &prev_n, sizeof(int), chunk_offset * VEC0_METADATA_TEXT_VIEW_BUFFER_LENGTH);
+      if(rc != SQLITE_OK) {
+        goto done;
+      }
+
+      const char * s = (const char *) sqlite3_value_text(v);
+      int n = sqlite3_value_bytes(v);
+      u8 view[VEC0_METADATA_TEXT_VIEW_BUFFER_LENGTH];
+      memset(view, 0, VEC0_METADATA_TEXT_VIEW_BUFFER_LENGTH);
+      memcpy(view, &n, sizeof(int));
+      memcpy(view+4, s, min(n, VEC0_METADATA_TEXT_VIEW_BUFFER_LENGTH-4));
+
+      rc = vec0_metadata_data_write(blobValue, bulkData, &view, VEC0_METADATA_TEXT_VIEW_BUFFER_LENGTH, chunk_offset * VEC0_METADATA_TEXT_VIEW_BUFFER_LENGTH);
+      if(n > VEC0_METADATA_TEXT_VIEW_DATA_LENGTH) {
+        char *zSql;
+        if(isupdate && (prev_n > VEC0_METADATA_TEXT_VIEW_DATA_LENGTH)) {
+          zSql = sqlite3_mprintf("UPDATE " VEC0_SHADOW_METADATA_TEXT_DATA_NAME " SET data = ?2 WHERE rowid = ?1", p->schemaName, p->tableName, metadata_column_idx);
+        }else {
+          zSql = sqlite3_mprintf("INSERT INTO " VEC0_SHADOW_METADATA_TEXT_DATA_NAME " (rowid, data) VALUES (?1, ?2)", p->schemaName, p->tableName, metadata_column_idx);
+        }
+        if(!zSql) {
+          rc = SQLITE_NOMEM;
+          goto done;
+        }
+        rc = vec0_exec_metadata_text_sql(p->db, zSql, rowid, s, n);
+        if(rc != SQLITE_OK) {
+          goto done;
+        }
+      }
+      else if(prev_n > VEC0_METADATA_TEXT_VIEW_DATA_LENGTH) {
+        char *zSql = sqlite3_mprintf("DELETE FROM " VEC0_SHADOW_METADATA_TEXT_DATA_NAME " WHERE rowid = ?", p->schemaName, p->tableName, metadata_column_idx);
+        if(!zSql) {
+          rc = SQLITE_NOMEM;
+          goto done;
+        }
+        rc = vec0_exec_metadata_text_sql(p->db, zSql, rowid, NULL, 0);
+        if(rc != SQLITE_OK) {
+          goto done;
+        }
+      }
+      break;
+    }
+  }
+
+  if(rc != SQLITE_OK) {
+
+  }
+  rc = sqlite3_blob_close(blobValue);
+  if(rc != SQLITE_OK) {
+    goto done;
+  }
+
+  if (p->chunkSummaries) {
+    rc = vec0_metadata_zone_add(p, metadata_column_idx, chunk_id, v, code);
+    if(rc != SQLITE_OK) {
+      goto done;
+    }
+  }
+
+  if (metadata_column->indexed) {
+    if (kind == VEC0_METADATA_COLUMN_KIND_TEXT) {
+      rc = vec0_metadata_index_set(p, metadata_column_idx, chunk_id, chunk_offset, 0,
+                                   (const char *)sqlite3_value_text(v),
+                                   sqlite3_value_bytes(v), 1);
+    } else {
+      rc = vec0_metadata_index_set(p, metadata_column_idx, chunk_id, chunk_offset,
+                                   kind == VEC0_METADATA_COLUMN_KIND_DICTIONARY ? code : sqlite3_value_int64(v),
+                                   NULL, 0, 1);
+    }
+  }
+
+  done:
+    return rc;
+}
+
+
+/**
+ * @brief Append the partition key, vector and metadata columns of the _delta
+ * shadow table to s, each after a comma, in the order vec0_create_delta()
+ * declares them.
+ */
+static void vec0_delta_append_columns(vec0_vtab *p, sqlite3_str *s) {
+  for (int i = 0; i < p->numPartitionColumns; i++) {
+    sqlite3_str_appendf(s, ", partition%02d", i);
+  }
+  for (int i = 0; i < p->numVectorColumns; i++) {
+    sqlite3_str_appendf(s, ", vector%02d", i);
+  }
+  for (int i = 0; i < p->numMetadataColumns; i++) {
+    sqlite3_str_appendf(s, ", metadata%02d", i);
+  }
+}
+
+/**
+ * @brief Move every row of the _delta shadow table into chunks, see
+ * vec0_delta_insert(). The rows are placed through a bulk load, the one
+ * already on or one started for the merge, so each chunk they fill has its
+ * blobs written once. The 'flush' command, 'optimize' and UPDATEs of rows still
+ * in the delta run it.
+ */
+static int vec0_delta_merge(vec0_vtab *p) {
+  int rc = SQLITE_OK;
+  sqlite3_stmt *stmt = NULL;
+  char *zSql;
+  int ownBulk = 0;
+  int busy = 0;
+
+  // vec0_write_metadata_value() writes the long TEXT values of the rows again
+  for (int i = 0; i < p->numMetadataColumns; i++) {
+    if (p->metadata_columns[i].kind != VEC0_METADATA_COLUMN_KIND_TEXT) {
+      continue;
+    }
+    zSql = sqlite3_mprintf("DELETE FROM " VEC0_SHADOW_METADATA_TEXT_DATA_NAME
+                           " WHERE rowid IN (SELECT rowid FROM "
+                           VEC0_SHADOW_DELTA_NAME ")",
+                           p->schemaName, p->tableName, i, p->schemaName,
+                           p->tableName);
+    if (!zSql) {
+      return SQLITE_NOMEM;
+    }
+    rc = sqlite3_exec(p->db, zSql, NULL, NULL, NULL);
+    sqlite3_free(zSql);
+    if (rc != SQLITE_OK) {
+      return rc;
+    }
+  }
+
+  if (!p->bulk) {
+    rc = vec0_write_chunks_flush(p);
+    if (rc != SQLITE_OK) {
+      return rc;
+    }
+    rc = vec0_bulk_begin(p);
+    if (rc != SQLITE_OK) {
+      return rc;
+    }
+    ownBulk = 1;
+  }
+  busy = p->bulk->busy;
+  p->bulk->busy = 1;
+
+  // rows of a partition together, to fill its chunks one after the other
+  sqlite3_str *s = sqlite3_str_new(NULL);
+  sqlite3_str_appendall(s, "SELECT rowid");
+  vec0_delta_append_columns(p, s);
+  sqlite3_str_appendf(s, " FROM " VEC0_SHADOW_DELTA_NAME " ORDER BY ",
+                      p->schemaName, p->tableName);
+  for (int i = 0; i < p->numPartitionColumns; i++) {
+    sqlite3_str_appendf(s, "partition%02d, ", i);
+  }
+  sqlite3_str_appendall(s, "rowid");
+  zSql = sqlite3_str_finish(s);
+  if (!zSql) {
+    rc = SQLITE_NOMEM;
+    goto done;
+  }
+  rc = sqlite3_prepare_v2(p->db, zSql, -1, &stmt, NULL);
+  sqlite3_free(zSql);
+  if (rc != SQLITE_OK) {
+    goto done;
+  }
+
+  int vectorsStart = 1 + p->numPartitionColumns;
+  int metadataStart = vectorsStart + p->numVectorColumns;
+  while ((rc = sqlite3_step(stmt)) == SQLITE_ROW) {
+    i64 rowid = sqlite3_column_int64(stmt, 0);
+    sqlite3_value *partitionKeyValues[VEC0_MAX_PARTITION_COLUMNS];
+    void *vectorDatas[VEC0_MAX_VECTOR_COLUMNS];
+    i64 chunk_id, chunk_offset;
+    for (int i = 0; i < p->numPartitionColumns; i++) {
+      partitionKeyValues[i] = sqlite3_column_value(stmt, 1 + i);
+    }
+    for (int i = 0; i < p->numVectorColumns; i++) {
+      vectorDatas[i] = (void *)sqlite3_column_blob(stmt, vectorsStart + i);
+      if (sqlite3_column_bytes(stmt, vectorsStart + i) !=
+          (int)vector_column_byte_size(p->vector_columns[i])) {
+        vtab_set_error(&p->base,
+                       VEC_INTERAL_ERROR
+                       "vector of row %lld has the wrong size in the delta",
+                       rowid);
+        rc = SQLITE_ERROR;
+        goto done;
+      }
+    }
+    rc = vec0_bulk_next_position(p, partitionKeyValues, &chunk_id,
+                                 &chunk_offset);
+    if (rc != SQLITE_OK) {
+      goto done;
+    }
+    for (int i = 0; i < p->numMetadataColumns; i++) {
+      rc = vec0_write_metadata_value(p, i, rowid, chunk_id, chunk_offset,
+                                     sqlite3_column_value(stmt, metadataStart + i),
+                                     0);
+      if (rc != SQLITE_OK) {
+        goto done;
+      }
+    }
+    vec0_bulk_add(p, chunk_offset, rowid, vectorDatas);
+  }
+  if (rc != SQLITE_DONE) {
+    goto done;
+  }
+  sqlite3_finalize(stmt);
+  stmt = NULL;
+
+  zSql = sqlite3_mprintf("DELETE FROM " VEC0_SHADOW_DELTA_NAME, p->schemaName,
+                         p->tableName);
+  if (!zSql) {
+    rc = SQLITE_NOMEM;
+    goto done;
+  }
+  rc = sqlite3_exec(p->db, zSql, NULL, NULL, NULL);
+  sqlite3_free(zSql);
+
+done:
+  sqlite3_finalize(stmt);
+  // _rowids gets the positions of the merged rows as their chunk is written
+  if (rc == SQLITE_OK) {
+    rc = vec0_bulk_flush(p);
+  }
+  if (ownBulk) {
+    vec0_bulk_free(p->bulk);
+    p->bulk = NULL;
+  } else {
+    p->bulk->busy = busy;
+  }
+  return rc;
+}
+
+/**
+ * @brief Write an inserted row to the _delta shadow table of a table declared
+ * with `delta_size=N`, instead of to a chunk: one small row is appended rather
+ * than pieces of the chunk's blobs rewritten, and journaled page by page.
+ * The delta is merged into chunks first when it already holds N rows, so KNN
+ * queries scan at most that many rows more.
+ *
+ * Metadata values are checked, dictionary codes assigned and long TEXT values
+ * written to _metadatatextNN here, as KNN queries filter the rows of the delta
+ * with the code filtering chunks.
+ */
+static int vec0_delta_insert(vec0_vtab *p, i64 rowid,
+                             sqlite3_value **partitionKeyValues,
+                             void **vectorDatas, sqlite3_value **argv) {
+  int rc;
+  sqlite3_stmt *stmt = NULL;
+  char *zSql;
+  i64 n = 0;
+
+  zSql = sqlite3_mprintf("SELECT count(*) FROM " VEC0_SHADOW_DELTA_NAME,
+                         p->schemaName, p->tableName);
+  if (!zSql) {
+    return SQLITE_NOMEM;
+  }
+  rc = sqlite3_prepare_v2(p->db, zSql, -1, &stmt, NULL);
+  sqlite3_free(zSql);
+  if (rc != SQLITE_OK) {
+    return rc;
+  }
+  if (sqlite3_step(stmt) == SQLITE_ROW) {
+    n = sqlite3_column_int64(stmt, 0);
+  }
+  rc = sqlite3_finalize(stmt);
+  stmt = NULL;
+  if (rc != SQLITE_OK) {
+    return rc;
+  }
+  if (n >= p->deltaSize) {
+    rc = vec0_delta_merge(p);
+    if (rc != SQLITE_OK) {
+      return rc;
+    }
+  }
+
+  sqlite3_value *metadataValues[VEC0_MAX_METADATA_COLUMNS];
+  for (int i = 0; i < vec0_num_defined_user_columns(p); i++) {
+    if (p->user_column_kinds[i] != SQLITE_VEC0_USER_COLUMN_KIND_METADATA) {
+      continue;
+    }
+    int metadata_idx = p->user_column_idxs[i];
+    metadataValues[metadata_idx] = argv[2 + VEC0_COLUMN_USERN_START + i];
+    rc = vec0_metadata_value_validate(p, metadata_idx,
+                                      metadataValues[metadata_idx]);
+    if (rc != SQLITE_OK) {
+      return rc;
+    }
+  }
+
+  for (int i = 0; i < p->numMetadataColumns; i++) {
+    sqlite3_value *v = metadataValues[i];
+    if (p->metadata_columns[i].kind == VEC0_METADATA_COLUMN_KIND_DICTIONARY) {
+      i64 code;
+      rc = vec0_metadata_dictionary_code(p, i, v, &code);
+      if (rc != SQLITE_OK) {
+        return rc;
+      }
+    } else if (p->metadata_columns[i].kind == VEC0_METADATA_COLUMN_KIND_TEXT &&
+               sqlite3_value_bytes(v) > VEC0_METADATA_TEXT_VIEW_DATA_LENGTH) {
+      zSql = sqlite3_mprintf("INSERT INTO " VEC0_SHADOW_METADATA_TEXT_DATA_NAME
+                             " (rowid, data) VALUES (?1, ?2)",
+                             p->schemaName, p->tableName, i);
+      if (!zSql) {
+        return SQLITE_NOMEM;
+      }
+      rc = vec0_exec_metadata_text_sql(p->db, zSql, rowid,
+                                       (const char *)sqlite3_value_text(v),
+                                       sqlite3_value_bytes(v));
+      if (rc != SQLITE_OK) {
+        return rc;
+      }
+    }
+  }
+
+  sqlite3_str *s = sqlite3_str_new(NULL);
+  sqlite3_str_appendf(s, "INSERT INTO " VEC0_SHADOW_DELTA_NAME "(rowid",
+                      p->schemaName, p->tableName);
+  vec0_delta_append_columns(p, s);
+  sqlite3_str_appendall(s, ") VALUES (?");
+  for (int i = 0; i < p->numPartitionColumns + p->numVectorColumns +
+                          p->numMetadataColumns;
+       i++) {
+    sqlite3_str_appendall(s, ", ?");
+  }
+  sqlite3_str_appendall(s, ")");
+  zSql = sqlite3_str_finish(s);
+  if (!zSql) {
+    return SQLITE_NOMEM;
+  }
+  rc = sqlite3_prepare_v2(p->db, zSql, -1, &stmt, NULL);
+  sqlite3_free(zSql);
+  if (rc != SQLITE_OK) {
+    return rc;
+  }
+  int param = 1;
+  sqlite3_bind_int64(stmt, param++, rowid);
+  for (int i = 0; i < p->numPartitionColumns; i++) {
+    sqlite3_bind_value(stmt, param++, partitionKeyValues[i]);
+  }
+  for (int i = 0; i < p->numVectorColumns; i++) {
+    sqlite3_bind_blob64(stmt, param++, vectorDatas[i],
+                        vector_column_byte_size(p->vector_columns[i]),
+                        SQLITE_STATIC);
+  }
+  for (int i = 0; i < p->numMetadataColumns; i++) {
+    sqlite3_bind_value(stmt, param++, metadataValues[i]);
+  }
+  rc = sqlite3_step(stmt);
+  sqlite3_finalize(stmt);
+  return rc == SQLITE_DONE ? SQLITE_OK : SQLITE_ERROR;
+}
+
+/**
+ * @brief Handles INSERT INTO operations on a vec0 table.
+ *
+ * @return int SQLITE_OK on success, otherwise error code on failure
+ */
+/**
+ * @brief Insert a row from the xUpdate arguments of an INSERT, see
+ * vec0Update_Insert(). An 'import' inserts every vector of a file through it,
+ * with the same argv: the vector of importColumn is then importVector instead,
+ * and the rowid *importRowid unless it's NULL.
+ */
+static int vec0_insert_row(vec0_vtab *p, sqlite3_value **argv,
+                           int importColumn, void *importVector,
+                           const i64 *importRowid, sqlite_int64 *pRowid) {
+  sqlite3_vtab *pVTab = &p->base;
+  int rc;
+  // Rowid for the inserted row, deterimined by the inserted ID + _rowids shadow
+  // table
+  i64 rowid;
+
+  // Array to hold the vector data of the inserted row. Individual elements will
+  // have a lifetime bound to the argv[..] values.
+  void *vectorDatas[VEC0_MAX_VECTOR_COLUMNS];
+  // Array to hold cleanup functions for vectorDatas[]
+  vector_cleanup cleanups[VEC0_MAX_VECTOR_COLUMNS];
+  memset(cleanups, 0, sizeof(cleanups)); // NOLINT(bugprone-multi-level-implicit-pointer-conversion)
+
+  sqlite3_value * partitionKeyValues[VEC0_MAX_PARTITION_COLUMNS];
+
+  // Rowid of the chunk in the _chunks shadow table that the row will be a part
+  // of.
+  i64 chunk_rowid = 0;
+  // offset within the chunk where the rowid belongs
+  i64 chunk_offset = 0;
+
+  // the validity column of the given chunk, cached by
+  // vec0_write_chunk_position()
+  unsigned char *bufferChunksValidity = NULL;
+  int numReadVectors = 0;
+
+  // Read all provided partition key values into partitionKeyValues
+  for (int i = 0; i < vec0_num_defined_user_columns(p); i++) {
+    if(p->user_column_kinds[i] != SQLITE_VEC0_USER_COLUMN_KIND_PARTITION) {
+      continue;
+    }
+    int partition_key_idx = p->user_column_idxs[i];
+    partitionKeyValues[partition_key_idx] = argv[2+VEC0_COLUMN_USERN_START + i];
+
+    int new_value_type = sqlite3_value_type(partitionKeyValues[partition_key_idx]);
+    if((new_value_type != SQLITE_NULL) && (new_value_type != p->paritition_columns[partition_key_idx].type)) {
+      // IMP: V11454_28292
+      vtab_set_error(
+        pVTab,
+        "Parition key type mismatch: The partition key column %.*s has type %s, but %s was provided.",
+        p->paritition_columns[partition_key_idx].name_length,
+        p->paritition_columns[partition_key_idx].name,
+        type_name(p->paritition_columns[partition_key_idx].type),
+        type_name(new_value_type)
+      );
+      rc = SQLITE_ERROR;
+      goto cleanup;
+    }
+  }
+
+  // read all the inserted vectors  into vectorDatas, validate their lengths.
+  for (int i = 0; i < vec0_num_defined_user_columns(p); i++) {
+    if(p->user_column_kinds[i] != SQLITE_VEC0_USER_COLUMN_KIND_VECTOR) {
+      continue;
+    }
+    int vector_column_idx = p->user_column_idxs[i];
+    sqlite3_value *valueVector = argv[2 + VEC0_COLUMN_USERN_START + i];
+    size_t dimensions;
+
+    if (vector_column_idx == importColumn) {
+      // read from the file in the column's type and dimensions
+      vectorDatas[vector_column_idx] = importVector;
+      numReadVectors++;
+      continue;
+    }
+
+    char *pzError;
+    enum VectorElementType elementType;
+    rc = vector_from_value(valueVector, &vectorDatas[vector_column_idx], &dimensions,
+                           &elementType, &cleanups[vector_column_idx], &pzError);
+    if (rc != SQLITE_OK) {
+      // IMP: V06519_23358
+      vtab_set_error(
+          pVTab, "Inserted vector for the \"%.*s\" column is invalid: %z",
+          p->vector_columns[vector_column_idx].name_length, p->vector_columns[vector_column_idx].name, pzError);
+      rc = SQLITE_ERROR;
+      goto cleanup;
+    }
+
+    numReadVectors++;
+    if (elementType != p->vector_columns[vector_column_idx].element_type) {
+      // IMP: V08221_25059
+      vtab_set_error(
+          pVTab,
+          "Inserted vector for the \"%.*s\" column is expected to be of type "
+          "%s, but a %s vector was provided.",
+          p->vector_columns[i].name_length, p->vector_columns[i].name,
+          vector_subtype_name(p->vector_columns[i].element_type),
+          vector_subtype_name(elementType));
+      rc = SQLITE_ERROR;
+      goto cleanup;
+    }
+
+    if (dimensions != p->vector_columns[vector_column_idx].dimensions) {
+      // IMP: V01145_17984
+      vtab_set_error(
+          pVTab,
+          "Dimension mismatch for inserted vector for the \"%.*s\" column. "
+          "Expected %d dimensions but received %d.",
+          p->vector_columns[vector_column_idx].name_length, p->vector_columns[vector_column_idx].name,
+          p->vector_columns[vector_column_idx].dimensions, dimensions);
+      rc = SQLITE_ERROR;
+      goto cleanup;
+    }
+  }
+
+  // Cannot insert a value in the hidden "distance" column
+  if (sqlite3_value_type(argv[2 + vec0_column_distance_idx(p)]) !=
+      SQLITE_NULL) {
+    // IMP: V24228_08298
+    vtab_set_error(pVTab,
+                   "A value was provided for the hidden \"distance\" column.");
+    rc = SQLITE_ERROR;
+    goto cleanup;
+  }
+  // Cannot insert a value in the hidden "k" column
+  if (sqlite3_value_type(argv[2 + vec0_column_k_idx(p)]) != SQLITE_NULL) {
+    // IMP: V11875_28713
+    vtab_set_error(pVTab, "A value was provided for the hidden \"k\" column.");
+    rc = SQLITE_ERROR;
+    goto cleanup;
+  }
+  // Cannot insert a value in the hidden "mmr_lambda" column
+  if (sqlite3_value_type(argv[2 + vec0_column_mmr_lambda_idx(p)]) != SQLITE_NULL) {
+    vtab_set_error(pVTab, "A value was provided for the hidden \"mmr_lambda\" column.");
+    rc = SQLITE_ERROR;
+    goto cleanup;
+  }
+  // Cannot insert a value in the hidden "nprobe" column
+  if (sqlite3_value_type(argv[2 + vec0_column_nprobe_idx(p)]) != SQLITE_NULL) {
+    vtab_set_error(pVTab, "A value was provided for the hidden \"nprobe\" column.");
+    rc = SQLITE_ERROR;
+    goto cleanup;
+  }
+  // Cannot insert a value in the hidden "ef_search" column
+  if (sqlite3_value_type(argv[2 + vec0_column_ef_search_idx(p)]) != SQLITE_NULL) {
+    vtab_set_error(pVTab, "A value was provided for the hidden \"ef_search\" column.");
+    rc = SQLITE_ERROR;
+    goto cleanup;
+  }
+
+  // Cannot insert a value in the hidden "page_token" column
+  if (sqlite3_value_type(argv[2 + vec0_column_page_token_idx(p)]) != SQLITE_NULL) {
+    vtab_set_error(pVTab, "A value was provided for the hidden \"page_token\" column.");
+    rc = SQLITE_ERROR;
+    goto cleanup;
+  }
+
+  // Cannot insert a value in the hidden "weights" column
+  if (sqlite3_value_type(argv[2 + vec0_column_weights_idx(p)]) != SQLITE_NULL) {
+    vtab_set_error(pVTab, "A value was provided for the hidden \"weights\" column.");
+    rc = SQLITE_ERROR;
+    goto cleanup;
+  }
+
+  // Cannot insert a value in the hidden "k_per_partition" column
+  if (sqlite3_value_type(argv[2 + vec0_column_k_per_partition_idx(p)]) != SQLITE_NULL) {
+    vtab_set_error(pVTab, "A value was provided for the hidden \"k_per_partition\" column.");
+    rc = SQLITE_ERROR;
+    goto cleanup;
+  }
+
+  // Cannot insert a value in the hidden "max_chunks" column
+  if (sqlite3_value_type(argv[2 + vec0_column_max_chunks_idx(p)]) != SQLITE_NULL) {
+    vtab_set_error(pVTab, "A value was provided for the hidden \"max_chunks\" column.");
+    rc = SQLITE_ERROR;
+    goto cleanup;
+  }
+
+  // Cannot insert a value in the hidden "time_budget_ms" column
+  if (sqlite3_value_type(argv[2 + vec0_column_time_budget_ms_idx(p)]) != SQLITE_NULL) {
+    vtab_set_error(pVTab, "A value was provided for the hidden \"time_budget_ms\" column.");
+    rc = SQLITE_ERROR;
+    goto cleanup;
+  }
+
+  // Cannot insert a value in the hidden "exact" column
+  if (sqlite3_value_type(argv[2 + vec0_column_exact_idx(p)]) != SQLITE_NULL) {
+    vtab_set_error(pVTab, "A value was provided for the hidden \"exact\" column.");
+    rc = SQLITE_ERROR;
+    goto cleanup;
+  }
+
+  // Cannot insert a value in the hidden "filter" column
+  if (sqlite3_value_type(argv[2 + vec0_column_filter_idx(p)]) != SQLITE_NULL) {
+    vtab_set_error(pVTab, "A value was provided for the hidden \"filter\" column.");
+    rc = SQLITE_ERROR;
+    goto cleanup;
+  }
+
+  // Cannot insert a value in the hidden "table_name" column, except the
+  // 'import' command itself
+  if (importColumn < 0 &&
+      sqlite3_value_type(argv[2 + vec0_column_table_name_idx(p)]) != SQLITE_NULL) {
+    vtab_set_error(pVTab, "A value was provided for the hidden \"table_name\" column.");
+    rc = SQLITE_ERROR;
+    goto cleanup;
+  }
+
+  // shadow table statements below may open savepoints, which must leave the
+  // rows buffered by a bulk load alone
+  if (p->bulk) {
+    p->bulk->busy = 1;
+  }
+
+  // Step #1: Insert/get a rowid for this row, from the _rowids table.
+  if (importRowid) {
+    rowid = *importRowid;
+    rc = vec0_rowids_insert_rowid(p, rowid);
+  } else {
+    rc = vec0Update_InsertRowidStep(p, argv[2 + VEC0_COLUMN_ID], &rowid);
+  }
+  if (rc != SQLITE_OK) {
+    goto cleanup;
+  }
+
+  // In a bulk load, steps #2 and #3 take the next offset of the chunk kept in
+  // memory, and the row is added to it once all its writes succeeded.
+  if (p->bulk) {
+    rc = vec0_bulk_next_position(p, partitionKeyValues, &chunk_rowid,
+                                 &chunk_offset);
+    if (rc != SQLITE_OK) {
+      goto cleanup;
+    }
+    goto auxiliary;
+  }
+
+  // With `delta_size=N`, the row is appended to the _delta table instead, and
+  // merged into a chunk later.
+  if (p->deltaSize > 0) {
+    rc = vec0_delta_insert(p, rowid, partitionKeyValues, vectorDatas, argv);
+    if (rc != SQLITE_OK) {
+      goto cleanup;
+    }
+    chunk_rowid = VEC0_DELTA_CHUNK_ID;
+    goto auxiliary;
+  }
+
+  // Step #2: Find the next "available" position in the _chunks table for this
+  // row.
+  rc = vec0_write_chunk_position(p, partitionKeyValues, &chunk_rowid,
+                                 &chunk_offset, &bufferChunksValidity);
+  if (rc != SQLITE_OK) {
+    goto cleanup;
+  }
+
+  // Step #3: With the next available chunk position, write out all the vectors
+  //          to their specified location.
+  rc = vec0Update_InsertWriteFinalStep(p, chunk_rowid, chunk_offset, rowid,
+                                       vectorDatas, bufferChunksValidity);
+  if (rc != SQLITE_OK) {
+    goto cleanup;
+  }
+
+  for (int i = 0; i < p->numVectorColumns; i++) {
+    if (vec0_has_ivf_index(p, i)) {
+      rc = vec0_ivf_assign(p, i, rowid, vectorDatas[i]);
+      if (rc != SQLITE_OK) {
+        goto cleanup;
+      }
+    }
+    if (vec0_has_hnsw_index(p, i)) {
+      rc = vec0_hnsw_insert(p, i, rowid, vectorDatas[i]);
+      if (rc != SQLITE_OK) {
+        goto cleanup;
+      }
+    }
+    if (vec0_has_diskann_index(p, i)) {
+      rc = vec0_diskann_insert(p, i, chunk_rowid, chunk_offset,
+                               vectorDatas[i]);
+      if (rc != SQLITE_OK) {
+        goto cleanup;
+      }
+    }
+  }
+
+auxiliary:
+  if(p->numAuxiliaryColumns > 0) {
+    sqlite3_stmt *stmt;
+    sqlite3_str * s = sqlite3_str_new(NULL);
+    sqlite3_str_appendf(s, "INSERT INTO " VEC0_SHADOW_AUXILIARY_NAME "(rowid ", p->schemaName, p->tableName);
+    for(int i = 0; i < p->numAuxiliaryColumns; i++) {
+      sqlite3_str_appendf(s, ", value%02d", i);
+    }
+    sqlite3_str_appendall(s, ") VALUES (? ");
+    for(int i = 0; i < p->numAuxiliaryColumns; i++) {
+      sqlite3_str_appendall(s, ", ?");
+    }
+    sqlite3_str_appendall(s, ")");
+    char * zSql = sqlite3_str_finish(s);
+    if(!zSql) {
+      rc = SQLITE_NOMEM;
+      goto cleanup;
+    }
+    rc = sqlite3_prepare_v2(p->db, zSql, -1, &stmt, NULL);
+    sqlite3_free(zSql);
+    if(rc != SQLITE_OK) {
+      goto cleanup;
+    }
+    sqlite3_bind_int64(stmt, 1, rowid);
+
+    for (int i = 0; i < vec0_num_defined_user_columns(p); i++) {
+      if(p->user_column_kinds[i] != SQLITE_VEC0_USER_COLUMN_KIND_AUXILIARY) {
+        continue;
+      }
+      int auxiliary_key_idx = p->user_column_idxs[i];
+      sqlite3_value * v = argv[2+VEC0_COLUMN_USERN_START + i];
+      int v_type = sqlite3_value_type(v);
+      if(v_type != SQLITE_NULL && (v_type != p->auxiliary_columns[auxiliary_key_idx].type)) {
+        sqlite3_finalize(stmt);
+        rc = SQLITE_CONSTRAINT;
+        vtab_set_error(
+          pVTab,
+          "Auxiliary column type mismatch: The auxiliary column %.*s has type %s, but %s was provided.",
+          p->auxiliary_columns[auxiliary_key_idx].name_length,
+          p->auxiliary_columns[auxiliary_key_idx].name,
+          type_name(p->auxiliary_columns[auxiliary_key_idx].type),
+          type_name(v_type)
+        );
+        goto cleanup;
+      }
+      // first 1 is for 1-based indexing on sqlite3_bind_*, second 1 is to account for initial rowid parameter
+      sqlite3_bind_value(stmt, 1 + 1 + auxiliary_key_idx, v);
+    }
+
+    rc = sqlite3_step(stmt);
+    if(rc != SQLITE_DONE) {
+      sqlite3_finalize(stmt);
+      rc = SQLITE_ERROR;
+      goto cleanup;
+    }
+    sqlite3_finalize(stmt);
+  }
+
+
+  for(int i = 0; i < vec0_num_defined_user_columns(p); i++) {
+    // rows of the delta have their metadata values there
+    if(p->user_column_kinds[i] != SQLITE_VEC0_USER_COLUMN_KIND_METADATA || chunk_rowid == VEC0_DELTA_CHUNK_ID) {
+      continue;
+    }
+    int metadata_idx = p->user_column_idxs[i];
+    sqlite3_value *v = argv[2 + VEC0_COLUMN_USERN_START + i];
+    rc = vec0_write_metadata_value(p, metadata_idx, rowid, chunk_rowid, chunk_offset, v, 0);
+    if(rc != SQLITE_OK) {
+      goto cleanup;
     }
   }
 
-  else if(vec0_column_idx_is_metadata(pVtab, i)) {
-    int metadata_idx = vec0_column_idx_to_metadata_idx(pVtab, i);
-    i64 rowid = pCur->knn_data->rowids[pCur->knn_data->current_idx];
-    int rc = vec0_result_metadata_value_for_rowid(pVtab, rowid, metadata_idx, context);
-    if(rc != SQLITE_OK) {
-      const char * zErr = sqlite3_mprintf(
-        "Could not extract metadata value for column %.*s at rowid %lld",
-        pVtab->metadata_columns[metadata_idx].name_length,
-        pVtab->metadata_columns[metadata_idx].name, rowid
-      );
-      if(zErr) {
-        sqlite3_result_error(context, zErr, -1);
-        sqlite3_free((void *) zErr);
-      }else {
-        sqlite3_result_error_nomem(context);
-      }
+  if (p->bulk) {
+    vec0_bulk_add(p, chunk_offset, rowid, vectorDatas);
+  }
+
+  *pRowid = rowid;
+  rc = SQLITE_OK;
+
+cleanup:
+  if (p->bulk) {
+    p->bulk->busy = 0;
+  }
+  for (int i = 0; i < numReadVectors; i++) {
+    if (cleanups[i]) {
+      cleanups[i](vectorDatas[i]);
     }
   }
+  return rc;
+}
 
-  return SQLITE_OK;
+int vec0Update_Insert(sqlite3_vtab *pVTab, int argc, sqlite3_value **argv,
+                      sqlite_int64 *pRowid) {
+  UNUSED_PARAMETER(argc);
+  return vec0_insert_row((vec0_vtab *)pVTab, argv, -1, NULL, NULL, pRowid);
 }
 
-static int vec0Column(sqlite3_vtab_cursor *cur, sqlite3_context *context,
-                      int i) {
-  vec0_cursor *pCur = (vec0_cursor *)cur;
-  vec0_vtab *pVtab = (vec0_vtab *)cur->pVtab;
-  switch (pCur->query_plan) {
-  case VEC0_QUERY_PLAN_FULLSCAN: {
-    return vec0Column_fullscan(pVtab, pCur, context, i);
+int vec0Update_Delete_ClearValidity(vec0_vtab *p, i64 chunk_id,
+                                    u64 chunk_offset) {
+  int rc, brc;
+  sqlite3_blob *blobChunksValidity = NULL;
+  char unsigned bx;
+  int validityOffset = chunk_offset / CHAR_BIT;
+
+  // 2. ensure chunks.validity bit is 1, then set to 0
+  rc = sqlite3_blob_open(p->db, p->schemaName, p->shadowChunksName, "validity",
+                         chunk_id, 1, &blobChunksValidity);
+  if (rc != SQLITE_OK) {
+    // IMP: V26002_10073
+    vtab_set_error(&p->base, "could not open validity blob for %s.%s.%lld",
+                   p->schemaName, p->shadowChunksName, chunk_id);
+    return SQLITE_ERROR;
   }
-  case VEC0_QUERY_PLAN_KNN: {
-    return vec0Column_knn(pVtab, pCur, context, i);
+  // will skip the sqlite3_blob_bytes(blobChunksValidity) check for now,
+  // the read below would catch it
+
+  rc = sqlite3_blob_read(blobChunksValidity, &bx, sizeof(bx), validityOffset);
+  if (rc != SQLITE_OK) {
+    // IMP: V21193_05263
+    vtab_set_error(
+        &p->base, "could not read validity blob for %s.%s.%lld at %d",
+        p->schemaName, p->shadowChunksName, chunk_id, validityOffset);
+    goto cleanup;
   }
-  case VEC0_QUERY_PLAN_POINT: {
-    return vec0Column_point(pVtab, pCur, context, i);
+  if (!(bx >> (chunk_offset % CHAR_BIT))) {
+    // IMP: V21193_05263
+    rc = SQLITE_ERROR;
+    vtab_set_error(
+        &p->base,
+        "vec0 deletion error: validity bit is not set for %s.%s.%lld at %d",
+        p->schemaName, p->shadowChunksName, chunk_id, validityOffset);
+    goto cleanup;
+  }
+  char unsigned mask = ~(1 << (chunk_offset % CHAR_BIT));
+  char result = bx & mask;
+  rc = sqlite3_blob_write(blobChunksValidity, &result, sizeof(bx),
+                          validityOffset);
+  if (rc != SQLITE_OK) {
+    vtab_set_error(
+        &p->base, "could not write to validity blob for %s.%s.%lld at %d",
+        p->schemaName, p->shadowChunksName, chunk_id, validityOffset);
+    goto cleanup;
   }
+
+cleanup:
+
+  brc = sqlite3_blob_close(blobChunksValidity);
+  if (rc != SQLITE_OK)
+    return rc;
+  if (brc != SQLITE_OK) {
+    vtab_set_error(&p->base,
+                   "vec0 deletion error: Error commiting validity blob "
+                   "transaction on %s.%s.%lld at %d",
+                   p->schemaName, p->shadowChunksName, chunk_id,
+                   validityOffset);
+    return brc;
   }
   return SQLITE_OK;
 }
 
-/**
- * @brief Handles the "insert rowid" step of a row insert operation of a vec0
- * table.
- *
- * This function will insert a new row into the _rowids vec0 shadow table.
- *
- * @param p: virtual table
- * @param idValue: Value containing the inserted rowid/id value.
- * @param rowid: Output rowid, will point to the "real" i64 rowid
- * value that was inserted
- * @return int SQLITE_OK on success, error code on failure
- */
-int vec0Update_InsertRowidStep(vec0_vtab *p, sqlite3_value *idValue,
-                               i64 *rowid) {
+int vec0Update_Delete_DeleteRowids(vec0_vtab *p, i64 rowid) {
+  int rc;
+  sqlite3_stmt *stmt = NULL;
 
-  /**
-   * An insert into a vec0 table can happen a few different ways:
-   *  1) With default INTEGER primary key: With a supplied i64 rowid
-   *  2) With default INTEGER primary key: WITHOUT a supplied rowid
-   *  3) With TEXT primary key: supplied text rowid
-   */
+  char *zSql =
+      sqlite3_mprintf("DELETE FROM " VEC0_SHADOW_ROWIDS_NAME " WHERE rowid = ?",
+                      p->schemaName, p->tableName);
+  if (!zSql) {
+    return SQLITE_NOMEM;
+  }
+
+  rc = sqlite3_prepare_v2(p->db, zSql, -1, &stmt, NULL);
+  sqlite3_free(zSql);
+  if (rc != SQLITE_OK) {
+    goto cleanup;
+  }
+  sqlite3_bind_int64(stmt, 1, rowid);
+  rc = sqlite3_step(stmt);
+  if (rc != SQLITE_DONE) {
+    goto cleanup;
+  }
+  rc = SQLITE_OK;
+
+cleanup:
+  sqlite3_finalize(stmt);
+  return rc;
+}
 
+// Clear the rowid slot in v_chunks.rowids for the given chunk/offset
+int vec0Update_Delete_ClearRowid(vec0_vtab *p, i64 chunk_id, i64 chunk_offset) {
   int rc;
+  sqlite3_blob *blobChunksRowids = NULL;
 
-  // Option 3: vtab has a user-defined TEXT primary key, so ensure a text value
-  // is provided.
-  if (p->pkIsText) {
-    if (sqlite3_value_type(idValue) != SQLITE_TEXT) {
-      // IMP: V04200_21039
-      vtab_set_error(&p->base,
-                     "The %s virtual table was declared with a TEXT primary "
-                     "key, but a non-TEXT value was provided in an INSERT.",
-                     p->tableName);
-      return SQLITE_ERROR;
-    }
+  rc = sqlite3_blob_open(p->db, p->schemaName, p->shadowChunksName, "rowids",
+                         chunk_id, 1, &blobChunksRowids);
+  if (rc != SQLITE_OK) {
+    vtab_set_error(&p->base, "could not open rowids blob for %s.%s.%lld",
+                   p->schemaName, p->shadowChunksName, chunk_id);
+    return SQLITE_ERROR;
+  }
 
-    return vec0_rowids_insert_id(p, idValue, rowid);
+  i64 expected = p->chunk_size * sizeof(i64);
+  i64 actual = sqlite3_blob_bytes(blobChunksRowids);
+  if (expected != actual) {
+    vtab_set_error(&p->base,
+                   VEC_INTERAL_ERROR
+                   "rowids blob size mismatch on %s.%s.%lld. Expected %lld, actual %lld",
+                   p->schemaName, p->shadowChunksName, chunk_id, expected, actual);
+    sqlite3_blob_close(blobChunksRowids);
+    return SQLITE_ERROR;
   }
 
-  // Option 1: User supplied a i64 rowid
-  if (sqlite3_value_type(idValue) == SQLITE_INTEGER) {
-    i64 suppliedRowid = sqlite3_value_int64(idValue);
-    rc = vec0_rowids_insert_rowid(p, suppliedRowid);
-    if (rc == SQLITE_OK) {
-      *rowid = suppliedRowid;
-    }
+  i64 zero = 0;
+  rc = sqlite3_blob_write(blobChunksRowids, &zero, sizeof(i64),
+                          chunk_offset * sizeof(i64));
+  int brc = sqlite3_blob_close(blobChunksRowids);
+  if (rc != SQLITE_OK) {
+    vtab_set_error(&p->base, "could not write rowids blob on %s.%s.%lld",
+                   p->schemaName, p->shadowChunksName, chunk_id);
     return rc;
   }
+  if (brc != SQLITE_OK) {
+    vtab_set_error(&p->base,
+                   "could not close rowids blob on %s.%s.%lld",
+                   p->schemaName, p->shadowChunksName, chunk_id);
+    return brc;
+  }
+  return SQLITE_OK;
+}
 
-  // Option 2: User did not suppled a rowid
+// Clear the vector bytes for each vector column at the given chunk/offset
+int vec0Update_Delete_ClearVectors(vec0_vtab *p, i64 chunk_id, i64 chunk_offset) {
+  for (int i = 0; i < p->numVectorColumns; i++) {
+    int rc;
+    sqlite3_blob *blobVectors = NULL;
 
-  if (sqlite3_value_type(idValue) != SQLITE_NULL) {
-    // IMP: V30855_14925
-    vtab_set_error(&p->base,
-                   "Only integers are allows for primary key values on %s",
-                   p->tableName);
-    return SQLITE_ERROR;
+    rc = sqlite3_blob_open(p->db, p->schemaName, p->shadowVectorChunksNames[i],
+                           "vectors", chunk_id, 1, &blobVectors);
+    if (rc != SQLITE_OK) {
+      vtab_set_error(&p->base, "Could not open vectors blob for %s.%s.%lld",
+                     p->schemaName, p->shadowVectorChunksNames[i], chunk_id);
+      return rc;
+    }
+
+    i64 expected = p->chunk_size * vector_column_byte_size(p->vector_columns[i]);
+    i64 actual = sqlite3_blob_bytes(blobVectors);
+    if (expected != actual) {
+      vtab_set_error(&p->base,
+                     VEC_INTERAL_ERROR
+                     "vector blob size mismatch on %s.%s.%lld. Expected %lld, actual %lld",
+                     p->schemaName, p->shadowVectorChunksNames[i], chunk_id, expected, actual);
+      sqlite3_blob_close(blobVectors);
+      return SQLITE_ERROR;
+    }
+
+    size_t nbytes = vector_column_byte_size(p->vector_columns[i]);
+    void *zeros = sqlite3_malloc(nbytes);
+    if (!zeros) {
+      sqlite3_blob_close(blobVectors);
+      return SQLITE_NOMEM;
+    }
+    memset(zeros, 0, nbytes);
+    rc = vec0_write_vector_to_vector_blob(blobVectors, chunk_offset, zeros,
+                                          p->vector_columns[i].dimensions,
+                                          p->vector_columns[i].element_type);
+    sqlite3_free(zeros);
+
+    int brc = sqlite3_blob_close(blobVectors);
+    if (rc != SQLITE_OK) {
+      vtab_set_error(&p->base, "Could not write to vectors blob for %s.%s.%lld",
+                     p->schemaName, p->shadowVectorChunksNames[i], chunk_id);
+      return rc;
+    }
+    if (brc != SQLITE_OK) {
+      vtab_set_error(&p->base,
+                     "Could not commit blob transaction for vectors blob for %s.%s.%lld",
+                     p->schemaName, p->shadowVectorChunksNames[i], chunk_id);
+      return brc;
+    }
   }
-  // NULL to get next auto-incremented value
-  return vec0_rowids_insert_id(p, NULL, rowid);
+  return SQLITE_OK;
 }
 
-/**
- * @brief Determines the "next available" chunk position for a newly inserted
- * vec0 row.
- *
- * This operation may insert a new "blank" chunk the _chunks table, if there is
- * no more space in previous chunks.
- *
- * @param p: virtual table
- * @param partitionKeyValues: array of partition key column values, to constrain
- * against any partition key columns.
- * @param chunk_rowid: Output rowid of the chunk in the _chunks virtual table
- * that has the avialabiity.
- * @param chunk_offset: Output the index of the available space insert the
- * chunk, based on the index of the first available validity bit.
- * @param pBlobValidity: Output blob of the validity column of the available
- * chunk. Will be opened with read/write permissions.
- * @param pValidity: Output buffer of the original chunk's validity column.
- *    Needs to be cleaned up with sqlite3_free().
- * @return int SQLITE_OK on success, error code on failure
- */
-int vec0Update_InsertNextAvailableStep(
-    vec0_vtab *p,
-    sqlite3_value ** partitionKeyValues,
-    i64 *chunk_rowid, i64 *chunk_offset,
-    sqlite3_blob **blobChunksValidity,
-    const unsigned char **bufferChunksValidity) {
-
+int vec0Update_Delete_DeleteAux(vec0_vtab *p, i64 rowid) {
   int rc;
-  i64 validitySize;
-  *chunk_offset = -1;
+  sqlite3_stmt *stmt = NULL;
 
-  rc = vec0_get_latest_chunk_rowid(p, chunk_rowid, partitionKeyValues);
-  if(rc == SQLITE_EMPTY) {
-    goto done;
-  }
-  if (rc != SQLITE_OK) {
-    goto cleanup;
+  char *zSql =
+      sqlite3_mprintf("DELETE FROM " VEC0_SHADOW_AUXILIARY_NAME " WHERE rowid = ?",
+                      p->schemaName, p->tableName);
+  if (!zSql) {
+    return SQLITE_NOMEM;
   }
 
-  rc = sqlite3_blob_open(p->db, p->schemaName, p->shadowChunksName, "validity",
-                         *chunk_rowid, 1, blobChunksValidity);
+  rc = sqlite3_prepare_v2(p->db, zSql, -1, &stmt, NULL);
+  sqlite3_free(zSql);
   if (rc != SQLITE_OK) {
-    // IMP: V22053_06123
-    vtab_set_error(&p->base,
-                   VEC_INTERAL_ERROR
-                   "could not open validity blob on %s.%s.%lld",
-                   p->schemaName, p->shadowChunksName, *chunk_rowid);
-    goto cleanup;
-  }
-
-  validitySize = sqlite3_blob_bytes(*blobChunksValidity);
-  if (validitySize != p->chunk_size / CHAR_BIT) {
-    // IMP: V29362_13432
-    vtab_set_error(&p->base,
-                   VEC_INTERAL_ERROR
-                   "validity blob size mismatch on "
-                   "%s.%s.%lld, expected %lld but received %lld.",
-                   p->schemaName, p->shadowChunksName, *chunk_rowid,
-                   (i64)(p->chunk_size / CHAR_BIT), validitySize);
-    rc = SQLITE_ERROR;
     goto cleanup;
   }
-
-  *bufferChunksValidity = sqlite3_malloc(validitySize);
-  if (!(*bufferChunksValidity)) {
-    vtab_set_error(&p->base, VEC_INTERAL_ERROR
-                   "Could not allocate memory for validity bitmap");
-    rc = SQLITE_NOMEM;
+  sqlite3_bind_int64(stmt, 1, rowid);
+  rc = sqlite3_step(stmt);
+  if (rc != SQLITE_DONE) {
     goto cleanup;
   }
+  rc = SQLITE_OK;
 
-  rc = sqlite3_blob_read(*blobChunksValidity, (void *)*bufferChunksValidity,
-                         validitySize, 0);
+cleanup:
+  sqlite3_finalize(stmt);
+  return rc;
+}
 
-  if (rc != SQLITE_OK) {
-    vtab_set_error(&p->base,
-                   VEC_INTERAL_ERROR
-                   "Could not read validity bitmap for %s.%s.%lld",
-                   p->schemaName, p->shadowChunksName, *chunk_rowid);
-    goto cleanup;
+int vec0Update_Delete_ClearMetadata(vec0_vtab *p, int metadata_idx, i64 rowid, i64 chunk_id,
+                                    u64 chunk_offset) {
+  int rc;
+  sqlite3_blob * blobValue;
+  vec0_metadata_column_kind kind = p->metadata_columns[metadata_idx].kind;
+  if(p->metadata_columns[metadata_idx].indexed) {
+    rc = vec0_metadata_index_remove(p, metadata_idx, rowid, chunk_id, chunk_offset);
+    if(rc != SQLITE_OK) {
+      return rc;
+    }
+  }
+  rc = sqlite3_blob_open(p->db, p->schemaName, p->shadowMetadataChunksNames[metadata_idx], "data", chunk_id, 1, &blobValue);
+  if(rc != SQLITE_OK) {
+    return rc;
   }
 
-  // find the next available offset, ie first `0` in the bitmap.
-  for (int i = 0; i < validitySize; i++) {
-    if ((*bufferChunksValidity)[i] == 0b11111111)
-      continue;
-    for (int j = 0; j < CHAR_BIT; j++) {
-      if (((((*bufferChunksValidity)[i] >> j) & 1) == 0)) {
-        *chunk_offset = (i * CHAR_BIT) + j;
+  switch(kind) {
+    case VEC0_METADATA_COLUMN_KIND_BOOLEAN: {
+      u8 block;
+      rc = sqlite3_blob_read(blobValue, &block, sizeof(u8), (int) (chunk_offset / CHAR_BIT));
+      if(rc != SQLITE_OK) {
         goto done;
       }
-    }
-  }
 
-done:
-  // latest chunk was full, so need to create a new one
-  if (*chunk_offset == -1) {
-    rc = vec0_new_chunk(p, partitionKeyValues, chunk_rowid);
-    if (rc != SQLITE_OK) {
-      // IMP: V08441_25279
-      vtab_set_error(&p->base,
-                     VEC_INTERAL_ERROR "Could not insert a new vector chunk");
-      rc = SQLITE_ERROR; // otherwise raises a DatabaseError and not operational
-                         // error?
-      goto cleanup;
+      block &= ~(1 << (chunk_offset % CHAR_BIT));
+      rc = sqlite3_blob_write(blobValue, &block, sizeof(u8), chunk_offset / CHAR_BIT);
+      break;
     }
-    *chunk_offset = 0;
-
-    // blobChunksValidity and pValidity are stale, pointing to the previous
-    // (full) chunk. to re-assign them
-    rc = sqlite3_blob_close(*blobChunksValidity);
-    sqlite3_free((void *)*bufferChunksValidity);
-    *blobChunksValidity = NULL;
-    *bufferChunksValidity = NULL;
-    if (rc != SQLITE_OK) {
-      vtab_set_error(&p->base, VEC_INTERAL_ERROR
-                     "unknown error, blobChunksValidity could not be closed, "
-                     "please file an issue.");
-      rc = SQLITE_ERROR;
-      goto cleanup;
+    case VEC0_METADATA_COLUMN_KIND_INTEGER:
+    case VEC0_METADATA_COLUMN_KIND_DICTIONARY: {
+      i64 v = 0;
+      rc = sqlite3_blob_write(blobValue, &v, sizeof(v), chunk_offset * sizeof(i64));
+      break;
+    }
+    case VEC0_METADATA_COLUMN_KIND_FLOAT: {
+      double v = 0;
+      rc = sqlite3_blob_write(blobValue, &v, sizeof(v), chunk_offset * sizeof(double));
+      break;
     }
+    case VEC0_METADATA_COLUMN_KIND_TEXT: {
+      int n;
+      rc = sqlite3_blob_read(blobValue, &n, sizeof(int), chunk_offset * VEC0_METADATA_TEXT_VIEW_BUFFER_LENGTH);
+      if(rc != SQLITE_OK) {
+        goto done;
+      }
 
-    rc = sqlite3_blob_open(p->db, p->schemaName, p->shadowChunksName,
-                           "validity", *chunk_rowid, 1, blobChunksValidity);
-    if (rc != SQLITE_OK) {
-      vtab_set_error(
-          &p->base,
-          VEC_INTERAL_ERROR
-          "Could not open validity blob for newly created chunk %s.%s.%lld",
-          p->schemaName, p->shadowChunksName, *chunk_rowid);
-      goto cleanup;
+      u8 view[VEC0_METADATA_TEXT_VIEW_BUFFER_LENGTH];
+      memset(view, 0, VEC0_METADATA_TEXT_VIEW_BUFFER_LENGTH);
+      rc = sqlite3_blob_write(blobValue, &view, sizeof(view), chunk_offset * VEC0_METADATA_TEXT_VIEW_BUFFER_LENGTH);
+      if(rc != SQLITE_OK) {
+        goto done;
+      }
+
+      if(n > VEC0_METADATA_TEXT_VIEW_DATA_LENGTH) {
+        char *zSql = sqlite3_mprintf("DELETE FROM " VEC0_SHADOW_METADATA_TEXT_DATA_NAME " WHERE rowid = ?", p->schemaName, p->tableName, metadata_idx);
+        if(!zSql) {
+          rc = SQLITE_NOMEM;
+          goto done;
+        }
+        rc = vec0_exec_metadata_text_sql(p->db, zSql, rowid, NULL, 0);
+        if(rc != SQLITE_OK) {
+          goto done;
+        }
+      }
+      break;
     }
-    validitySize = sqlite3_blob_bytes(*blobChunksValidity);
-    if (validitySize != p->chunk_size / CHAR_BIT) {
-      vtab_set_error(&p->base,
-                     VEC_INTERAL_ERROR
-                     "validity blob size mismatch for newly created chunk "
-                     "%s.%s.%lld. Exepcted %lld, got %lld",
-                     p->schemaName, p->shadowChunksName, *chunk_rowid,
-                     p->chunk_size / CHAR_BIT, validitySize);
-      goto cleanup;
+  }
+  int rc2;
+  done:
+  rc2 = sqlite3_blob_close(blobValue);
+  if(rc == SQLITE_OK) {
+    return rc2;
+  }
+  return rc;
+}
+
+/**
+ * @brief Delete a row that's still in the _delta shadow table, see
+ * vec0_delta_insert(): besides its _rowids and auxiliary rows, it only has its
+ * delta row and long TEXT values.
+ */
+static int vec0_delta_delete(vec0_vtab *p, i64 rowid) {
+  int rc;
+  char *zSql = sqlite3_mprintf(
+      "DELETE FROM " VEC0_SHADOW_DELTA_NAME " WHERE rowid = ?", p->schemaName,
+      p->tableName);
+  if (!zSql) {
+    return SQLITE_NOMEM;
+  }
+  rc = vec0_exec_metadata_text_sql(p->db, zSql, rowid, NULL, 0);
+  if (rc != SQLITE_OK) {
+    return rc;
+  }
+  for (int i = 0; i < p->numMetadataColumns; i++) {
+    if (p->metadata_columns[i].kind != VEC0_METADATA_COLUMN_KIND_TEXT) {
+      continue;
     }
-    *bufferChunksValidity = sqlite3_malloc(validitySize);
-    if (!*bufferChunksValidity) {
-      rc = SQLITE_NOMEM;
-      goto cleanup;
+    zSql = sqlite3_mprintf("DELETE FROM " VEC0_SHADOW_METADATA_TEXT_DATA_NAME
+                           " WHERE rowid = ?",
+                           p->schemaName, p->tableName, i);
+    if (!zSql) {
+      return SQLITE_NOMEM;
     }
-    rc = sqlite3_blob_read(*blobChunksValidity, (void *)*bufferChunksValidity,
-                           validitySize, 0);
+    rc = vec0_exec_metadata_text_sql(p->db, zSql, rowid, NULL, 0);
     if (rc != SQLITE_OK) {
-      vtab_set_error(&p->base,
-                     VEC_INTERAL_ERROR
-                     "could not read validity blob newly created chunk "
-                     "%s.%s.%lld",
-                     p->schemaName, p->shadowChunksName, *chunk_rowid);
-      goto cleanup;
+      return rc;
     }
   }
-
-  rc = SQLITE_OK;
-
-cleanup:
+  rc = vec0Update_Delete_DeleteRowids(p, rowid);
+  if (rc != SQLITE_OK) {
+    return rc;
+  }
+  if (p->numAuxiliaryColumns > 0) {
+    rc = vec0Update_Delete_DeleteAux(p, rowid);
+  }
   return rc;
 }
 
-/**
- * @brief Write the vector data into the provided vector blob at the given
- * offset
- *
- * @param blobVectors SQLite BLOB to write to
- * @param chunk_offset the "offset" (ie validity bitmap position) to write the
- * vector to
- * @param bVector pointer to the vector containing data
- * @param dimensions how many dimensions the vector has
- * @param element_type the vector type
- * @return result of sqlite3_blob_write, SQLITE_OK on success, otherwise failure
- */
-static int
-vec0_write_vector_to_vector_blob(sqlite3_blob *blobVectors, i64 chunk_offset,
-                                 const void *bVector, size_t dimensions,
-                                 enum VectorElementType element_type) {
-  int n = 0;
-  int offset = 0;
+int vec0Update_Delete(sqlite3_vtab *pVTab, sqlite3_value *idValue) {
+  vec0_vtab *p = (vec0_vtab *)pVTab;
+  int rc;
+  i64 rowid;
+  i64 chunk_id;
+  i64 chunk_offset;
 
-  switch (element_type) {
-  case SQLITE_VEC_ELEMENT_TYPE_FLOAT32:
-    n = dimensions * sizeof(f32);
-    offset = chunk_offset * dimensions * sizeof(f32);
-    break;
-  case SQLITE_VEC_ELEMENT_TYPE_INT8:
-    n = dimensions * sizeof(i8);
-    offset = chunk_offset * dimensions * sizeof(i8);
-    break;
-  case SQLITE_VEC_ELEMENT_TYPE_BIT:
-    n = dimensions / CHAR_BIT;
-    offset = chunk_offset * dimensions / CHAR_BIT;
-    break;
-  default:
-    return SQLITE_ERROR;
+  if (p->pkIsText) {
+    rc = vec0_rowid_from_id(p, idValue, &rowid);
+    if (rc != SQLITE_OK) {
+      return rc;
+    }
+  } else {
+    rowid = sqlite3_value_int64(idValue);
   }
 
-  return sqlite3_blob_write(blobVectors, bVector, n, offset);
-}
+  // 1. Find chunk position for given rowid
+  // 2. Ensure that validity bit for position is 1, then set to 0
+  // 3. Zero out rowid in chunks.rowid
+  // 4. Zero out vector data in all vector column chunks
+  // 5. Delete value in _rowids table
 
-/**
- * @brief
- *
- * @param p vec0 virtual table
- * @param chunk_rowid: which chunk to write to
- * @param chunk_offset: the offset inside the chunk to write the vector to.
- * @param rowid: the rowid of the inserting row
- * @param vectorDatas: array of the vector data to insert
- * @param blobValidity: writeable validity blob of the row's assigned chunk.
- * @param validity: snapshot buffer of the valdity column from the row's
- * assigned chunk.
- * @return int SQLITE_OK on success, error code on failure
- */
-int vec0Update_InsertWriteFinalStep(vec0_vtab *p, i64 chunk_rowid,
-                                    i64 chunk_offset, i64 rowid,
-                                    void *vectorDatas[],
-                                    sqlite3_blob *blobChunksValidity,
-                                    const unsigned char *bufferChunksValidity) {
-  int rc, brc;
-  sqlite3_blob *blobChunksRowids = NULL;
+  // 1. get chunk_id and chunk_offset from _rowids
+  rc = vec0_get_chunk_position(p, rowid, NULL, &chunk_id, &chunk_offset);
+  if (rc != SQLITE_OK) {
+    return rc;
+  }
+  if (chunk_id == VEC0_DELTA_CHUNK_ID) {
+    return vec0_delta_delete(p, rowid);
+  }
 
-  // mark the validity bit for this row in the chunk's validity bitmap
-  // Get the byte offset of the bitmap
-  char unsigned bx = bufferChunksValidity[chunk_offset / CHAR_BIT];
-  // set the bit at the chunk_offset position inside that byte
-  bx = bx | (1 << (chunk_offset % CHAR_BIT));
-  // write that 1 byte
-  rc = sqlite3_blob_write(blobChunksValidity, &bx, 1, chunk_offset / CHAR_BIT);
+  rc = vec0Update_Delete_ClearValidity(p, chunk_id, chunk_offset);
+  if (rc != SQLITE_OK) {
+    return rc;
+  }
+  // _free_chunks is written on xSync, or before inserts look for a chunk
+  if (!vec0_write_chunk_free_slot(p, chunk_id, chunk_offset)) {
+    rc = vec0_free_chunks_pending_add(p, chunk_id);
+    if (rc != SQLITE_OK) {
+      return rc;
+    }
+  }
+
+  if (p->chunkSummaries) {
+    rc = vec0_chunk_summary_remove(p, chunk_id);
+    if (rc != SQLITE_OK) {
+      return rc;
+    }
+  }
+
+  rc = vec0_ivf_unassign(p, rowid);
   if (rc != SQLITE_OK) {
-    vtab_set_error(&p->base, VEC_INTERAL_ERROR "could not mark validity bit ");
     return rc;
   }
 
-  // Go insert the vector data into the vector chunk shadow tables
   for (int i = 0; i < p->numVectorColumns; i++) {
-    sqlite3_blob *blobVectors;
-    rc = sqlite3_blob_open(p->db, p->schemaName, p->shadowVectorChunksNames[i],
-                           "vectors", chunk_rowid, 1, &blobVectors);
-    if (rc != SQLITE_OK) {
-      vtab_set_error(&p->base, "Error opening vector blob at %s.%s.%lld",
-                     p->schemaName, p->shadowVectorChunksNames[i], chunk_rowid);
-      goto cleanup;
+    if (vec0_has_hnsw_index(p, i)) {
+      rc = vec0_hnsw_delete(p, i, rowid);
+      if (rc != SQLITE_OK) {
+        return rc;
+      }
+    }
+    if (vec0_has_diskann_index(p, i)) {
+      rc = vec0_diskann_delete(p, i, chunk_id, chunk_offset);
+      if (rc != SQLITE_OK) {
+        return rc;
+      }
     }
+  }
 
-    i64 expected =
-        p->chunk_size * vector_column_byte_size(p->vector_columns[i]);
-    i64 actual = sqlite3_blob_bytes(blobVectors);
+  // 3. zero out rowid in chunks.rowids
+  // https://github.com/asg017/sqlite-vec/issues/54
+  rc = vec0Update_Delete_ClearRowid(p, chunk_id, chunk_offset);
+  if (rc != SQLITE_OK) {
+    return rc;
+  }
 
-    if (actual != expected) {
-      // IMP: V16386_00456
-      vtab_set_error(
-          &p->base,
-          VEC_INTERAL_ERROR
-          "vector blob size mismatch on %s.%s.%lld. Expected %lld, actual %lld",
-          p->schemaName, p->shadowVectorChunksNames[i], chunk_rowid, expected,
-          actual);
-      rc = SQLITE_ERROR;
-      // already error, can ignore result code
-      sqlite3_blob_close(blobVectors);
-      goto cleanup;
-    };
+  // 4. zero out any data in vector chunks tables
+  // https://github.com/asg017/sqlite-vec/issues/54
+  rc = vec0Update_Delete_ClearVectors(p, chunk_id, chunk_offset);
+  if (rc != SQLITE_OK) {
+    return rc;
+  }
 
-    rc = vec0_write_vector_to_vector_blob(
-        blobVectors, chunk_offset, vectorDatas[i],
-        p->vector_columns[i].dimensions, p->vector_columns[i].element_type);
+  // 5. delete from _rowids table
+  rc = vec0Update_Delete_DeleteRowids(p, rowid);
+  if (rc != SQLITE_OK) {
+    return rc;
+  }
+
+  // 6. delete any auxiliary rows
+  if(p->numAuxiliaryColumns > 0) {
+    rc = vec0Update_Delete_DeleteAux(p, rowid);
     if (rc != SQLITE_OK) {
-      vtab_set_error(&p->base,
-                     VEC_INTERAL_ERROR
-                     "could not write vector blob on %s.%s.%lld",
-                     p->schemaName, p->shadowVectorChunksNames[i], chunk_rowid);
-      rc = SQLITE_ERROR;
-      // already error, can ignore result code
-      sqlite3_blob_close(blobVectors);
-      goto cleanup;
+      return rc;
     }
-    rc = sqlite3_blob_close(blobVectors);
+  }
+
+  // 6. delete metadata
+  for(int i = 0; i < p->numMetadataColumns; i++) {
+    rc = vec0Update_Delete_ClearMetadata(p, i, rowid, chunk_id, chunk_offset);
     if (rc != SQLITE_OK) {
-      vtab_set_error(&p->base,
-                     VEC_INTERAL_ERROR
-                     "could not close vector blob on %s.%s.%lld",
-                     p->schemaName, p->shadowVectorChunksNames[i], chunk_rowid);
-      rc = SQLITE_ERROR;
-      goto cleanup;
+      return rc;
     }
   }
 
-  // write the new rowid to the rowids column of the _chunks table
-  rc = sqlite3_blob_open(p->db, p->schemaName, p->shadowChunksName, "rowids",
-                         chunk_rowid, 1, &blobChunksRowids);
+  return SQLITE_OK;
+}
+
+int vec0Update_UpdateAuxColumn(vec0_vtab *p, int auxiliary_column_idx, sqlite3_value * value, i64 rowid) {
+  int rc;
+  sqlite3_stmt *stmt;
+  const char * zSql = sqlite3_mprintf("UPDATE " VEC0_SHADOW_AUXILIARY_NAME " SET value%02d = ? WHERE rowid = ?", p->schemaName, p->tableName, auxiliary_column_idx);
+  if(!zSql) {
+    return SQLITE_NOMEM;
+  }
+  rc = sqlite3_prepare_v2(p->db, zSql, -1, &stmt, NULL);
+  if(rc != SQLITE_OK) {
+    return rc;
+  }
+  sqlite3_bind_value(stmt, 1, value);
+  sqlite3_bind_int64(stmt, 2, rowid);
+  rc = sqlite3_step(stmt);
+  if(rc != SQLITE_DONE) {
+    sqlite3_finalize(stmt);
+    return SQLITE_ERROR;
+  }
+  sqlite3_finalize(stmt);
+  return SQLITE_OK;
+}
+
+/**
+ * @brief Parse the new value of vector column i in an UPDATE, checking its
+ * type and dimensions.
+ *
+ * @param vector Output vector, must be released with *cleanup
+ */
+static int vec0Update_VectorFromValue(vec0_vtab *p, int i,
+                                      sqlite3_value *valueVector,
+                                      void **vector, vector_cleanup *cleanup) {
+  int rc;
+  char *pzError;
+  size_t dimensions;
+  enum VectorElementType elementType;
+  *vector = NULL;
+  *cleanup = vector_cleanup_noop;
+  // https://github.com/asg017/sqlite-vec/issues/53
+  rc = vector_from_value(valueVector, vector, &dimensions, &elementType,
+                         cleanup, &pzError);
   if (rc != SQLITE_OK) {
-    // IMP: V09221_26060
-    vtab_set_error(&p->base,
-                   VEC_INTERAL_ERROR "could not open rowids blob on %s.%s.%lld",
-                   p->schemaName, p->shadowChunksName, chunk_rowid);
+    // IMP: V15203_32042
+    vtab_set_error(
+        &p->base, "Updated vector for the \"%.*s\" column is invalid: %z",
+        p->vector_columns[i].name_length, p->vector_columns[i].name, pzError);
+    rc = SQLITE_ERROR;
     goto cleanup;
   }
-  i64 expected = p->chunk_size * sizeof(i64);
-  i64 actual = sqlite3_blob_bytes(blobChunksRowids);
-  if (expected != actual) {
-    // IMP: V12779_29618
+  if (elementType != p->vector_columns[i].element_type) {
+    // IMP: V03643_20481
     vtab_set_error(
         &p->base,
-        VEC_INTERAL_ERROR
-        "rowids blob size mismatch on %s.%s.%lld. Expected %lld, actual %lld",
-        p->schemaName, p->shadowChunksName, chunk_rowid, expected, actual);
+        "Updated vector for the \"%.*s\" column is expected to be of type "
+        "%s, but a %s vector was provided.",
+        p->vector_columns[i].name_length, p->vector_columns[i].name,
+        vector_subtype_name(p->vector_columns[i].element_type),
+        vector_subtype_name(elementType));
     rc = SQLITE_ERROR;
     goto cleanup;
   }
-  rc = sqlite3_blob_write(blobChunksRowids, &rowid, sizeof(i64),
-                          chunk_offset * sizeof(i64));
-  if (rc != SQLITE_OK) {
+  if (dimensions != p->vector_columns[i].dimensions) {
+    // IMP: V25739_09810
     vtab_set_error(
-        &p->base, VEC_INTERAL_ERROR "could not write rowids blob on %s.%s.%lld",
-        p->schemaName, p->shadowChunksName, chunk_rowid);
+        &p->base,
+        "Dimension mismatch for new updated vector for the \"%.*s\" column. "
+        "Expected %d dimensions but received %d.",
+        p->vector_columns[i].name_length, p->vector_columns[i].name,
+        p->vector_columns[i].dimensions, dimensions);
     rc = SQLITE_ERROR;
     goto cleanup;
   }
+  return SQLITE_OK;
+
+cleanup:
+  (*cleanup)(*vector);
+  *vector = NULL;
+  *cleanup = vector_cleanup_noop;
+  return rc;
+}
+
+int vec0Update_UpdateVectorColumn(vec0_vtab *p, i64 chunk_id, i64 chunk_offset,
+                                  int i, sqlite3_value *valueVector) {
+  int rc;
+
+  sqlite3_blob *blobVectors = NULL;
+
+  void *vector = NULL;
+  vector_cleanup cleanup = vector_cleanup_noop;
+  rc = vec0Update_VectorFromValue(p, i, valueVector, &vector, &cleanup);
+  if (rc != SQLITE_OK) {
+    goto cleanup;
+  }
+
+  rc = sqlite3_blob_open(p->db, p->schemaName, p->shadowVectorChunksNames[i],
+                         "vectors", chunk_id, 1, &blobVectors);
+  if (rc != SQLITE_OK) {
+    vtab_set_error(&p->base, "Could not open vectors blob for %s.%s.%lld",
+                   p->schemaName, p->shadowVectorChunksNames[i], chunk_id);
+    goto cleanup;
+  }
+  rc = vec0_write_vector_to_vector_blob(blobVectors, chunk_offset, vector,
+                                        p->vector_columns[i].dimensions,
+                                        p->vector_columns[i].element_type);
+  if (rc != SQLITE_OK) {
+    vtab_set_error(&p->base, "Could not write to vectors blob for %s.%s.%lld",
+                   p->schemaName, p->shadowVectorChunksNames[i], chunk_id);
+    goto cleanup;
+  }
 
-  // Now with all the vectors inserted, go back and update the _rowids table
-  // with the new chunk_rowid/chunk_offset values
-  rc = vec0_rowids_update_position(p, rowid, chunk_rowid, chunk_offset);
-
-cleanup:
-  brc = sqlite3_blob_close(blobChunksRowids);
-  if ((rc == SQLITE_OK) && (brc != SQLITE_OK)) {
-    vtab_set_error(
-        &p->base, VEC_INTERAL_ERROR "could not close rowids blob on %s.%s.%lld",
-        p->schemaName, p->shadowChunksName, chunk_rowid);
-    return brc;
+  // the old vector stays covered by the summary, only grow it for the new one
+  if (vec0_has_chunk_summary(p, i)) {
+    rc = vec0_chunk_summary_add(p, i, chunk_id, vector, 1);
+    if (rc != SQLITE_OK) {
+      goto cleanup;
+    }
   }
-  return rc;
-}
 
-/**
- * @brief Execute a metadata text SQL statement (INSERT/UPDATE/DELETE).
- *
- * This helper handles the prepare→bind→step→finalize→free pattern for
- * metadata text data operations. Takes ownership of zSql and frees it.
- *
- * @param db SQLite database connection
- * @param zSql SQL string allocated by sqlite3_mprintf (will be freed)
- * @param rowid Row ID to bind to parameter 1
- * @param text Text data to bind to parameter 2, or NULL for DELETE
- * @param text_len Length of text data (ignored if text is NULL)
- * @return SQLITE_OK on success, error code on failure
- */
-static int vec0_exec_metadata_text_sql(sqlite3 *db, char *zSql, i64 rowid,
-                                       const char *text, int text_len) {
-  sqlite3_stmt *stmt;
-  int rc = sqlite3_prepare_v2(db, zSql, -1, &stmt, NULL);
+cleanup:
+  cleanup(vector);
+  int brc = sqlite3_blob_close(blobVectors);
   if (rc != SQLITE_OK) {
-    sqlite3_free(zSql);
     return rc;
   }
-  sqlite3_bind_int64(stmt, 1, rowid);
-  if (text) {
-    sqlite3_bind_text(stmt, 2, text, text_len, SQLITE_STATIC);
+  if (brc != SQLITE_OK) {
+    vtab_set_error(
+        &p->base,
+        "Could not commit blob transaction for vectors blob for %s.%s.%lld",
+        p->schemaName, p->shadowVectorChunksNames[i], chunk_id);
+    return brc;
   }
-  rc = sqlite3_step(stmt);
-  sqlite3_finalize(stmt);
-  sqlite3_free(zSql);
-
-  return (rc == SQLITE_DONE) ? SQLITE_OK : SQLITE_ERROR;
+  return SQLITE_OK;
 }
 
-int vec0_write_metadata_value(vec0_vtab *p, int metadata_column_idx, i64 rowid, i64 chunk_id, i64 chunk_offset, sqlite3_value * v, int isupdate) {
+int vec0Update_Update(sqlite3_vtab *pVTab, int argc, sqlite3_value **argv) {
+  UNUSED_PARAMETER(argc);
+  vec0_vtab *p = (vec0_vtab *)pVTab;
   int rc;
-  struct Vec0MetadataColumnDefinition * metadata_column = &p->metadata_columns[metadata_column_idx];
-  vec0_metadata_column_kind kind = metadata_column->kind;
+  i64 chunk_id;
+  i64 chunk_offset;
 
-  // verify input value matches column type
-  switch(kind) {
-    case VEC0_METADATA_COLUMN_KIND_BOOLEAN: {
-      if(sqlite3_value_type(v) != SQLITE_INTEGER || ((sqlite3_value_int(v) != 0) && (sqlite3_value_int(v) != 1))) {
-        rc = SQLITE_ERROR;
-        vtab_set_error(&p->base, "Expected 0 or 1 for BOOLEAN metadata column %.*s", metadata_column->name_length, metadata_column->name);
-        goto done;
-      }
-      break;
+  i64 rowid = 0;
+  if (p->pkIsText) {
+    const char *a = (const char *)sqlite3_value_text(argv[0]);
+    const char *b = (const char *)sqlite3_value_text(argv[1]);
+    // IMP: V08886_25725
+    if ((sqlite3_value_bytes(argv[0]) != sqlite3_value_bytes(argv[1])) ||
+        strncmp(a, b, sqlite3_value_bytes(argv[0])) != 0) {
+      vtab_set_error(pVTab,
+                     "UPDATEs on vec0 primary key values are not allowed.");
+      return SQLITE_ERROR;
     }
-    case VEC0_METADATA_COLUMN_KIND_INTEGER: {
-      if(sqlite3_value_type(v) != SQLITE_INTEGER) {
-        rc = SQLITE_ERROR;
-        vtab_set_error(&p->base, "Expected integer for INTEGER metadata column %.*s, received %s", metadata_column->name_length, metadata_column->name, type_name(sqlite3_value_type(v)));
-        goto done;
-      }
-      break;
+    rc = vec0_rowid_from_id(p, argv[0], &rowid);
+    if (rc != SQLITE_OK) {
+      return rc;
     }
-    case VEC0_METADATA_COLUMN_KIND_FLOAT: {
-      if(sqlite3_value_type(v) != SQLITE_FLOAT) {
-        rc = SQLITE_ERROR;
-        vtab_set_error(&p->base, "Expected float for FLOAT metadata column %.*s, received %s", metadata_column->name_length, metadata_column->name, type_name(sqlite3_value_type(v)));
-        goto done;
-      }
-      break;
+  } else {
+    rowid = sqlite3_value_int64(argv[0]);
+  }
+
+  // 1) get chunk_id and chunk_offset from _rowids
+  rc = vec0_get_chunk_position(p, rowid, NULL, &chunk_id, &chunk_offset);
+  if (rc != SQLITE_OK) {
+    return rc;
+  }
+  // a row still in the delta is updated in the chunk it's merged into
+  if (chunk_id == VEC0_DELTA_CHUNK_ID) {
+    rc = vec0_delta_merge(p);
+    if (rc != SQLITE_OK) {
+      return rc;
     }
-    case VEC0_METADATA_COLUMN_KIND_TEXT: {
-      if(sqlite3_value_type(v) != SQLITE_TEXT) {
-        rc = SQLITE_ERROR;
-        vtab_set_error(&p->base, "Expected text for TEXT metadata column %.*s, received %s", metadata_column->name_length, metadata_column->name, type_name(sqlite3_value_type(v)));
-        goto done;
-      }
-      break;
+    rc = vec0_get_chunk_position(p, rowid, NULL, &chunk_id, &chunk_offset);
+    if (rc != SQLITE_OK) {
+      return rc;
     }
   }
 
-  sqlite3_blob * blobValue = NULL;
-  rc = sqlite3_blob_open(p->db, p->schemaName, p->shadowMetadataChunksNames[metadata_column_idx], "data", chunk_id, 1, &blobValue);
-  if(rc != SQLITE_OK) {
-    goto done;
+  // 2) update any partition key values
+  for (int i = 0; i < vec0_num_defined_user_columns(p); i++) {
+    if(p->user_column_kinds[i] != SQLITE_VEC0_USER_COLUMN_KIND_PARTITION) {
+      continue;
+    }
+    sqlite3_value * value = argv[2+VEC0_COLUMN_USERN_START + i];
+    if(sqlite3_value_nochange(value)) {
+      continue;
+    }
+    vtab_set_error(pVTab, "UPDATE on partition key columns are not supported yet. ");
+    return SQLITE_ERROR;
   }
 
-  switch(kind) {
-    case VEC0_METADATA_COLUMN_KIND_BOOLEAN: {
-      u8 block;
-      int value = sqlite3_value_int(v);
-      rc = sqlite3_blob_read(blobValue, &block, sizeof(u8), (int) (chunk_offset / CHAR_BIT));
-      if(rc != SQLITE_OK) {
-        goto done;
-      }
-
-      if (value) {
-        block |= 1 << (chunk_offset % CHAR_BIT);
-      } else {
-        block &= ~(1 << (chunk_offset % CHAR_BIT));
+  // validate every new value before writing any of them: single row UPDATEs
+  // run without a statement journal, so a later error wouldn't undo the
+  // columns written before it
+  for (int i = 0; i < vec0_num_defined_user_columns(p); i++) {
+    sqlite3_value * value = argv[2+VEC0_COLUMN_USERN_START + i];
+    if(p->user_column_kinds[i] == SQLITE_VEC0_USER_COLUMN_KIND_METADATA) {
+      if(sqlite3_value_nochange(value)) {
+        continue;
       }
-
-      rc = sqlite3_blob_write(blobValue, &block, sizeof(u8), chunk_offset / CHAR_BIT);
-      break;
-    }
-    case VEC0_METADATA_COLUMN_KIND_INTEGER: {
-      i64 value = sqlite3_value_int64(v);
-      rc = sqlite3_blob_write(blobValue, &value, sizeof(value), chunk_offset * sizeof(i64));
-      break;
-    }
-    case VEC0_METADATA_COLUMN_KIND_FLOAT: {
-      double value = sqlite3_value_double(v);
-      rc = sqlite3_blob_write(blobValue, &value, sizeof(value), chunk_offset * sizeof(double));
-      break;
-    }
-    case VEC0_METADATA_COLUMN_KIND_TEXT: {
-      int prev_n;
-      rc = sqlite3_blob_read(blobValue, &prev_n, sizeof(int), chunk_offset * VEC0_METADATA_TEXT_VIEW_BUFFER_LENGTH);
+      rc = vec0_metadata_value_validate(p, p->user_column_idxs[i], value);
       if(rc != SQLITE_OK) {
-        goto done;
+        return rc;
       }
-
-      const char * s = (const char *) sqlite3_value_text(v);
-      int n = sqlite3_value_bytes(v);
-      u8 view[VEC0_METADATA_TEXT_VIEW_BUFFER_LENGTH];
-      memset(view, 0, VEC0_METADATA_TEXT_VIEW_BUFFER_LENGTH);
-      memcpy(view, &n, sizeof(int));
-      memcpy(view+4, s, min(n, VEC0_METADATA_TEXT_VIEW_BUFFER_LENGTH-4));
-
-      rc = sqlite3_blob_write(blobValue, &view, VEC0_METADATA_TEXT_VIEW_BUFFER_LENGTH, chunk_offset * VEC0_METADATA_TEXT_VIEW_BUFFER_LENGTH);
-      if(n > VEC0_METADATA_TEXT_VIEW_DATA_LENGTH) {
-        char *zSql;
-        if(isupdate && (prev_n > VEC0_METADATA_TEXT_VIEW_DATA_LENGTH)) {
-          zSql = sqlite3_mprintf("UPDATE " VEC0_SHADOW_METADATA_TEXT_DATA_NAME " SET data = ?2 WHERE rowid = ?1", p->schemaName, p->tableName, metadata_column_idx);
-        }else {
-          zSql = sqlite3_mprintf("INSERT INTO " VEC0_SHADOW_METADATA_TEXT_DATA_NAME " (rowid, data) VALUES (?1, ?2)", p->schemaName, p->tableName, metadata_column_idx);
-        }
-        if(!zSql) {
-          rc = SQLITE_NOMEM;
-          goto done;
-        }
-        rc = vec0_exec_metadata_text_sql(p->db, zSql, rowid, s, n);
-        if(rc != SQLITE_OK) {
-          goto done;
-        }
+    }
+    else if(p->user_column_kinds[i] == SQLITE_VEC0_USER_COLUMN_KIND_VECTOR) {
+      void *vector;
+      vector_cleanup cleanup;
+      if (sqlite3_value_type(value) == SQLITE_NULL) {
+        continue;
       }
-      else if(prev_n > VEC0_METADATA_TEXT_VIEW_DATA_LENGTH) {
-        char *zSql = sqlite3_mprintf("DELETE FROM " VEC0_SHADOW_METADATA_TEXT_DATA_NAME " WHERE rowid = ?", p->schemaName, p->tableName, metadata_column_idx);
-        if(!zSql) {
-          rc = SQLITE_NOMEM;
-          goto done;
-        }
-        rc = vec0_exec_metadata_text_sql(p->db, zSql, rowid, NULL, 0);
-        if(rc != SQLITE_OK) {
-          goto done;
-        }
+      rc = vec0Update_VectorFromValue(p, p->user_column_idxs[i], value, &vector, &cleanup);
+      if(rc != SQLITE_OK) {
+        return SQLITE_ERROR;
       }
-      break;
+      cleanup(vector);
     }
   }
 
-  if(rc != SQLITE_OK) {
-
-  }
-  rc = sqlite3_blob_close(blobValue);
-  if(rc != SQLITE_OK) {
-    goto done;
-  }
-
-  done:
-    return rc;
-}
-
-
-/**
- * @brief Handles INSERT INTO operations on a vec0 table.
- *
- * @return int SQLITE_OK on success, otherwise error code on failure
- */
-int vec0Update_Insert(sqlite3_vtab *pVTab, int argc, sqlite3_value **argv,
-                      sqlite_int64 *pRowid) {
-  UNUSED_PARAMETER(argc);
-  vec0_vtab *p = (vec0_vtab *)pVTab;
-  int rc;
-  // Rowid for the inserted row, deterimined by the inserted ID + _rowids shadow
-  // table
-  i64 rowid;
-
-  // Array to hold the vector data of the inserted row. Individual elements will
-  // have a lifetime bound to the argv[..] values.
-  void *vectorDatas[VEC0_MAX_VECTOR_COLUMNS];
-  // Array to hold cleanup functions for vectorDatas[]
-  vector_cleanup cleanups[VEC0_MAX_VECTOR_COLUMNS];
-  memset(cleanups, 0, sizeof(cleanups)); // NOLINT(bugprone-multi-level-implicit-pointer-conversion)
-
-  sqlite3_value * partitionKeyValues[VEC0_MAX_PARTITION_COLUMNS];
-
-  // Rowid of the chunk in the _chunks shadow table that the row will be a part
-  // of.
-  i64 chunk_rowid;
-  // offset within the chunk where the rowid belongs
-  i64 chunk_offset;
-
-  // a write-able blob of the validity column for the given chunk. Used to mark
-  // validity bit
-  sqlite3_blob *blobChunksValidity = NULL;
-  // buffer for the valididty column for the given chunk. Maybe not needed here?
-  const unsigned char *bufferChunksValidity = NULL;
-  int numReadVectors = 0;
+  // 3) handle auxiliary column updates
+  for (int i = 0; i < vec0_num_defined_user_columns(p); i++) {
+    if(p->user_column_kinds[i] != SQLITE_VEC0_USER_COLUMN_KIND_AUXILIARY) {
+      continue;
+    }
+    int auxiliary_column_idx = p->user_column_idxs[i];
+    sqlite3_value * value = argv[2+VEC0_COLUMN_USERN_START + i];
+    if(sqlite3_value_nochange(value)) {
+      continue;
+    }
+    rc = vec0Update_UpdateAuxColumn(p, auxiliary_column_idx, value, rowid);
+    if(rc != SQLITE_OK) {
+      return SQLITE_ERROR;
+    }
+  }
 
-  // Read all provided partition key values into partitionKeyValues
+  // 4) handle metadata column updates
   for (int i = 0; i < vec0_num_defined_user_columns(p); i++) {
-    if(p->user_column_kinds[i] != SQLITE_VEC0_USER_COLUMN_KIND_PARTITION) {
+    if(p->user_column_kinds[i] != SQLITE_VEC0_USER_COLUMN_KIND_METADATA) {
       continue;
     }
-    int partition_key_idx = p->user_column_idxs[i];
-    partitionKeyValues[partition_key_idx] = argv[2+VEC0_COLUMN_USERN_START + i];
-
-    int new_value_type = sqlite3_value_type(partitionKeyValues[partition_key_idx]);
-    if((new_value_type != SQLITE_NULL) && (new_value_type != p->paritition_columns[partition_key_idx].type)) {
-      // IMP: V11454_28292
-      vtab_set_error(
-        pVTab,
-        "Parition key type mismatch: The partition key column %.*s has type %s, but %s was provided.",
-        p->paritition_columns[partition_key_idx].name_length,
-        p->paritition_columns[partition_key_idx].name,
-        type_name(p->paritition_columns[partition_key_idx].type),
-        type_name(new_value_type)
-      );
-      rc = SQLITE_ERROR;
-      goto cleanup;
+    int metadata_column_idx = p->user_column_idxs[i];
+    sqlite3_value * value = argv[2+VEC0_COLUMN_USERN_START + i];
+    if(sqlite3_value_nochange(value)) {
+      continue;
+    }
+    rc = vec0_write_metadata_value(p, metadata_column_idx, rowid, chunk_id, chunk_offset, value, 1);
+    if(rc != SQLITE_OK) {
+      return rc;
     }
   }
 
-  // read all the inserted vectors  into vectorDatas, validate their lengths.
+  // 5) iterate over all new vectors, update the vectors
   for (int i = 0; i < vec0_num_defined_user_columns(p); i++) {
     if(p->user_column_kinds[i] != SQLITE_VEC0_USER_COLUMN_KIND_VECTOR) {
       continue;
     }
-    int vector_column_idx = p->user_column_idxs[i];
+    int vector_idx = p->user_column_idxs[i];
     sqlite3_value *valueVector = argv[2 + VEC0_COLUMN_USERN_START + i];
-    size_t dimensions;
+    // in vec0Column, we check sqlite3_vtab_nochange() on vector columns.
+    // If the vector column isn't being changed, we return NULL;
+    // That's not great, that means vector columns can never be NULLABLE
+    // (bc we cant distinguish if an updated vector is truly NULL or nochange).
+    // Also it means that if someone tries to run `UPDATE v SET X = NULL`,
+    // we can't effectively detect and raise an error.
+    // A better solution would be to use a custom result_type for "empty",
+    // but subtypes don't appear to survive xColumn -> xUpdate, it's always 0.
+    // So for now, we'll just use NULL and warn people to not SET X = NULL
+    // in the docs.
+    if (sqlite3_value_type(valueVector) == SQLITE_NULL) {
+      continue;
+    }
 
-    char *pzError;
-    enum VectorElementType elementType;
-    rc = vector_from_value(valueVector, &vectorDatas[vector_column_idx], &dimensions,
-                           &elementType, &cleanups[vector_column_idx], &pzError);
+    rc = vec0Update_UpdateVectorColumn(p, chunk_id, chunk_offset, vector_idx,
+                                       valueVector);
     if (rc != SQLITE_OK) {
-      // IMP: V06519_23358
-      vtab_set_error(
-          pVTab, "Inserted vector for the \"%.*s\" column is invalid: %z",
-          p->vector_columns[vector_column_idx].name_length, p->vector_columns[vector_column_idx].name, pzError);
-      rc = SQLITE_ERROR;
-      goto cleanup;
+      return SQLITE_ERROR;
     }
 
-    numReadVectors++;
-    if (elementType != p->vector_columns[vector_column_idx].element_type) {
-      // IMP: V08221_25059
-      vtab_set_error(
-          pVTab,
-          "Inserted vector for the \"%.*s\" column is expected to be of type "
-          "%s, but a %s vector was provided.",
-          p->vector_columns[i].name_length, p->vector_columns[i].name,
-          vector_subtype_name(p->vector_columns[i].element_type),
-          vector_subtype_name(elementType));
-      rc = SQLITE_ERROR;
-      goto cleanup;
+    // the new vector may be closer to another IVF list
+    if (vec0_has_ivf_index(p, vector_idx)) {
+      void *vector;
+      rc = vec0_get_vector_data(p, rowid, vector_idx, &vector, NULL);
+      if (rc != SQLITE_OK) {
+        return rc;
+      }
+      rc = vec0_ivf_assign(p, vector_idx, rowid, vector);
+      sqlite3_free(vector);
+      if (rc != SQLITE_OK) {
+        return rc;
+      }
     }
 
-    if (dimensions != p->vector_columns[vector_column_idx].dimensions) {
-      // IMP: V01145_17984
-      vtab_set_error(
-          pVTab,
-          "Dimension mismatch for inserted vector for the \"%.*s\" column. "
-          "Expected %d dimensions but received %d.",
-          p->vector_columns[vector_column_idx].name_length, p->vector_columns[vector_column_idx].name,
-          p->vector_columns[vector_column_idx].dimensions, dimensions);
-      rc = SQLITE_ERROR;
-      goto cleanup;
+    // re-link the node from scratch, its old neighbors may be far away now
+    if (vec0_has_hnsw_index(p, vector_idx)) {
+      void *vector;
+      rc = vec0_hnsw_delete(p, vector_idx, rowid);
+      if (rc != SQLITE_OK) {
+        return rc;
+      }
+      rc = vec0_get_vector_data(p, rowid, vector_idx, &vector, NULL);
+      if (rc != SQLITE_OK) {
+        return rc;
+      }
+      rc = vec0_hnsw_insert(p, vector_idx, rowid, vector);
+      sqlite3_free(vector);
+      if (rc != SQLITE_OK) {
+        return rc;
+      }
     }
-  }
 
-  // Cannot insert a value in the hidden "distance" column
-  if (sqlite3_value_type(argv[2 + vec0_column_distance_idx(p)]) !=
-      SQLITE_NULL) {
-    // IMP: V24228_08298
-    vtab_set_error(pVTab,
-                   "A value was provided for the hidden \"distance\" column.");
-    rc = SQLITE_ERROR;
-    goto cleanup;
-  }
-  // Cannot insert a value in the hidden "k" column
-  if (sqlite3_value_type(argv[2 + vec0_column_k_idx(p)]) != SQLITE_NULL) {
-    // IMP: V11875_28713
-    vtab_set_error(pVTab, "A value was provided for the hidden \"k\" column.");
-    rc = SQLITE_ERROR;
-    goto cleanup;
-  }
-  // Cannot insert a value in the hidden "mmr_lambda" column
-  if (sqlite3_value_type(argv[2 + vec0_column_mmr_lambda_idx(p)]) != SQLITE_NULL) {
-    vtab_set_error(pVTab, "A value was provided for the hidden \"mmr_lambda\" column.");
-    rc = SQLITE_ERROR;
-    goto cleanup;
+    if (vec0_has_diskann_index(p, vector_idx)) {
+      void *vector;
+      rc = vec0_diskann_delete(p, vector_idx, chunk_id, chunk_offset);
+      if (rc != SQLITE_OK) {
+        return rc;
+      }
+      rc = vec0_get_vector_data(p, rowid, vector_idx, &vector, NULL);
+      if (rc != SQLITE_OK) {
+        return rc;
+      }
+      rc = vec0_diskann_insert(p, vector_idx, chunk_id, chunk_offset, vector);
+      sqlite3_free(vector);
+      if (rc != SQLITE_OK) {
+        return rc;
+      }
+    }
   }
 
-  // Cannot insert a value in the hidden "table_name" column
-  if (sqlite3_value_type(argv[2 + vec0_column_table_name_idx(p)]) != SQLITE_NULL) {
-    vtab_set_error(pVTab, "A value was provided for the hidden \"table_name\" column.");
-    rc = SQLITE_ERROR;
-    goto cleanup;
-  }
+  return SQLITE_OK;
+}
 
-  // Step #1: Insert/get a rowid for this row, from the _rowids table.
-  rc = vec0Update_InsertRowidStep(p, argv[2 + VEC0_COLUMN_ID], &rowid);
+int vec0Update_SpecialInsert_OptimizeCopyMetadata(vec0_vtab *p, int metadata_column_idx, i64 src_chunk_id, i64 src_chunk_offset, i64 dst_chunk_id, i64 dst_chunk_offset) {
+  int rc;
+  struct Vec0MetadataColumnDefinition * metadata_column = &p->metadata_columns[metadata_column_idx];
+  vec0_metadata_column_kind kind = metadata_column->kind;
+
+  sqlite3_blob *srcBlob, *dstBlob;
+  rc = sqlite3_blob_open(p->db, p->schemaName, p->shadowMetadataChunksNames[metadata_column_idx], "data", src_chunk_id, 0, &srcBlob);
   if (rc != SQLITE_OK) {
-    goto cleanup;
+    vtab_set_error(&p->base, "Failed to open %s blob", p->shadowMetadataChunksNames[metadata_column_idx]);
+    return rc;
   }
-
-  // Step #2: Find the next "available" position in the _chunks table for this
-  // row.
-  rc = vec0Update_InsertNextAvailableStep(p, partitionKeyValues,
-  &chunk_rowid, &chunk_offset,
-                                          &blobChunksValidity,
-                                          &bufferChunksValidity);
+  rc = sqlite3_blob_open(p->db, p->schemaName, p->shadowMetadataChunksNames[metadata_column_idx], "data", dst_chunk_id, 1, &dstBlob);
   if (rc != SQLITE_OK) {
-    goto cleanup;
+    vtab_set_error(&p->base, "Failed to open %s blob", p->shadowMetadataChunksNames[metadata_column_idx]);
+    sqlite3_blob_close(srcBlob);
+    return rc;
   }
 
-  // Step #3: With the next available chunk position, write out all the vectors
-  //          to their specified location.
-  rc = vec0Update_InsertWriteFinalStep(p, chunk_rowid, chunk_offset, rowid,
-                                       vectorDatas, blobChunksValidity,
-                                       bufferChunksValidity);
-  if (rc != SQLITE_OK) {
-    goto cleanup;
+  // Defensive: both metadata chunk blobs must be exactly the size this column's
+  // kind implies, and both offsets must be valid slots in [0, chunk_size). On
+  // any mismatch, return SQLITE_ERROR instead of issuing a blob read/write
+  // against malformed state -- a recoverable error the caller can catch is
+  // always preferable to corrupting memory or aborting the host process.
+  i64 expectedSize = vec0_metadata_chunk_size(kind, p->chunk_size);
+  if (sqlite3_blob_bytes(srcBlob) != expectedSize ||
+      sqlite3_blob_bytes(dstBlob) != expectedSize) {
+    vtab_set_error(&p->base,
+                   "Internal error: metadata chunk blob size mismatch during "
+                   "optimize on %s, expected %lld",
+                   p->shadowMetadataChunksNames[metadata_column_idx],
+                   (i64)expectedSize);
+    rc = SQLITE_ERROR;
+    goto done;
+  }
+  if (src_chunk_offset < 0 || src_chunk_offset >= p->chunk_size ||
+      dst_chunk_offset < 0 || dst_chunk_offset >= p->chunk_size) {
+    vtab_set_error(&p->base,
+                   "Internal error: metadata chunk offset out of range during "
+                   "optimize on %s",
+                   p->shadowMetadataChunksNames[metadata_column_idx]);
+    rc = SQLITE_ERROR;
+    goto done;
   }
 
-  if(p->numAuxiliaryColumns > 0) {
-    sqlite3_stmt *stmt;
-    sqlite3_str * s = sqlite3_str_new(NULL);
-    sqlite3_str_appendf(s, "INSERT INTO " VEC0_SHADOW_AUXILIARY_NAME "(rowid ", p->schemaName, p->tableName);
-    for(int i = 0; i < p->numAuxiliaryColumns; i++) {
-      sqlite3_str_appendf(s, ", value%02d", i);
-    }
-    sqlite3_str_appendall(s, ") VALUES (? ");
-    for(int i = 0; i < p->numAuxiliaryColumns; i++) {
-      sqlite3_str_appendall(s, ", ?");
-    }
-    sqlite3_str_appendall(s, ")");
-    char * zSql = sqlite3_str_finish(s);
-    if(!zSql) {
-      rc = SQLITE_NOMEM;
-      goto cleanup;
-    }
-    rc = sqlite3_prepare_v2(p->db, zSql, -1, &stmt, NULL);
-    sqlite3_free(zSql);
-    if(rc != SQLITE_OK) {
-      goto cleanup;
-    }
-    sqlite3_bind_int64(stmt, 1, rowid);
+  switch (kind) {
+    case VEC0_METADATA_COLUMN_KIND_BOOLEAN: {
+      u8 srcBlock, dstBlock;
+      rc = sqlite3_blob_read(srcBlob, &srcBlock, sizeof(u8), (int) (src_chunk_offset / CHAR_BIT));
+      if (rc != SQLITE_OK) {
+        goto done;
+      }
+      int value = (srcBlock >> (src_chunk_offset % CHAR_BIT)) & 1;
 
-    for (int i = 0; i < vec0_num_defined_user_columns(p); i++) {
-      if(p->user_column_kinds[i] != SQLITE_VEC0_USER_COLUMN_KIND_AUXILIARY) {
-        continue;
+      rc = sqlite3_blob_read(dstBlob, &dstBlock, sizeof(u8), (int) (dst_chunk_offset / CHAR_BIT));
+      if (rc != SQLITE_OK) {
+        goto done;
       }
-      int auxiliary_key_idx = p->user_column_idxs[i];
-      sqlite3_value * v = argv[2+VEC0_COLUMN_USERN_START + i];
-      int v_type = sqlite3_value_type(v);
-      if(v_type != SQLITE_NULL && (v_type != p->auxiliary_columns[auxiliary_key_idx].type)) {
-        sqlite3_finalize(stmt);
-        rc = SQLITE_CONSTRAINT;
-        vtab_set_error(
-          pVTab,
-          "Auxiliary column type mismatch: The auxiliary column %.*s has type %s, but %s was provided.",
-          p->auxiliary_columns[auxiliary_key_idx].name_length,
-          p->auxiliary_columns[auxiliary_key_idx].name,
-          type_name(p->auxiliary_columns[auxiliary_key_idx].type),
-          type_name(v_type)
-        );
-        goto cleanup;
+      if (value) {
+        dstBlock |= 1 << (dst_chunk_offset % CHAR_BIT);
+      } else {
+        dstBlock &= ~(1 << (dst_chunk_offset % CHAR_BIT));
       }
-      // first 1 is for 1-based indexing on sqlite3_bind_*, second 1 is to account for initial rowid parameter
-      sqlite3_bind_value(stmt, 1 + 1 + auxiliary_key_idx, v);
+      rc = sqlite3_blob_write(dstBlob, &dstBlock, sizeof(u8), dst_chunk_offset / CHAR_BIT);
+      if (rc != SQLITE_OK) {
+        goto done;
+      }
+      break;
     }
-
-    rc = sqlite3_step(stmt);
-    if(rc != SQLITE_DONE) {
-      sqlite3_finalize(stmt);
-      rc = SQLITE_ERROR;
-      goto cleanup;
+    case VEC0_METADATA_COLUMN_KIND_INTEGER:
+    case VEC0_METADATA_COLUMN_KIND_DICTIONARY: {
+      i64 value;
+      rc = sqlite3_blob_read(srcBlob, &value, sizeof(i64), src_chunk_offset * sizeof(i64));
+      if (rc != SQLITE_OK) {
+        goto done;
+      }
+      rc = sqlite3_blob_write(dstBlob, &value, sizeof(i64), dst_chunk_offset * sizeof(i64));
+      if (rc != SQLITE_OK) {
+        goto done;
+      }
+      break;
     }
-    sqlite3_finalize(stmt);
-  }
-
-
-  for(int i = 0; i < vec0_num_defined_user_columns(p); i++) {
-    if(p->user_column_kinds[i] != SQLITE_VEC0_USER_COLUMN_KIND_METADATA) {
-      continue;
+    case VEC0_METADATA_COLUMN_KIND_FLOAT: {
+      double value;
+      rc = sqlite3_blob_read(srcBlob, &value, sizeof(double), src_chunk_offset * sizeof(double));
+      if (rc != SQLITE_OK) {
+        goto done;
+      }
+      rc = sqlite3_blob_write(dstBlob, &value, sizeof(double), dst_chunk_offset * sizeof(double));
+      if (rc != SQLITE_OK) {
+        goto done;
+      }
+      break;
     }
-    int metadata_idx = p->user_column_idxs[i];
-    sqlite3_value *v = argv[2 + VEC0_COLUMN_USERN_START + i];
-    rc = vec0_write_metadata_value(p, metadata_idx, rowid, chunk_rowid, chunk_offset, v, 0);
-    if(rc != SQLITE_OK) {
-      goto cleanup;
+    case VEC0_METADATA_COLUMN_KIND_TEXT: {
+      u8 view[VEC0_METADATA_TEXT_VIEW_BUFFER_LENGTH];
+      rc = sqlite3_blob_read(srcBlob, view, VEC0_METADATA_TEXT_VIEW_BUFFER_LENGTH, src_chunk_offset * VEC0_METADATA_TEXT_VIEW_BUFFER_LENGTH);
+      if (rc != SQLITE_OK) {
+        goto done;
+      }
+      rc = sqlite3_blob_write(dstBlob, view, VEC0_METADATA_TEXT_VIEW_BUFFER_LENGTH, dst_chunk_offset * VEC0_METADATA_TEXT_VIEW_BUFFER_LENGTH);
+      if (rc != SQLITE_OK) {
+        goto done;
+      }
+      break;
     }
   }
-
-  *pRowid = rowid;
-  rc = SQLITE_OK;
-
-cleanup:
-  for (int i = 0; i < numReadVectors; i++) {
-    if (cleanups[i]) {
-      cleanups[i](vectorDatas[i]);
-    }
+done: {
+  // Always close both blobs, but do not let a successful close overwrite a
+  // real read/write/validation error (the previous code masked the error with
+  // the srcBlob close result, and leaked dstBlob when the srcBlob close failed).
+  int rcSrcClose = sqlite3_blob_close(srcBlob);
+  int rcDstClose = sqlite3_blob_close(dstBlob);
+  if (rc == SQLITE_OK) {
+    rc = rcSrcClose;
   }
-  sqlite3_free((void *)bufferChunksValidity);
-  int brc = sqlite3_blob_close(blobChunksValidity);
-  if ((rc == SQLITE_OK) && (brc != SQLITE_OK)) {
-    vtab_set_error(&p->base,
-                   VEC_INTERAL_ERROR "unknown error, blobChunksValidity could "
-                                     "not be closed, please file an issue");
-    return brc;
+  if (rc == SQLITE_OK) {
+    rc = rcDstClose;
   }
   return rc;
 }
+}
 
-int vec0Update_Delete_ClearValidity(vec0_vtab *p, i64 chunk_id,
-                                    u64 chunk_offset) {
-  int rc, brc;
+int vec0Update_SpecialInsert_Optimize(vec0_vtab *p) {
+  sqlite3_stmt *stmt = NULL, *partition_key_stmt = NULL;
+  int rc;
+  const char *zSql;
+  i64 prev_max_chunk_rowid = -1;
+  sqlite3_value *partitionKeyValues[VEC0_MAX_PARTITION_COLUMNS];
+  // Declared here (not inside the loop) and zero-initialized so the cleanup
+  // label -- reached by gotos from before and inside the loop -- can safely
+  // free whatever an error path still owns, without leaking or double-freeing.
   sqlite3_blob *blobChunksValidity = NULL;
-  char unsigned bx;
-  int validityOffset = chunk_offset / CHAR_BIT;
-
-  // 2. ensure chunks.validity bit is 1, then set to 0
-  rc = sqlite3_blob_open(p->db, p->schemaName, p->shadowChunksName, "validity",
-                         chunk_id, 1, &blobChunksValidity);
-  if (rc != SQLITE_OK) {
-    // IMP: V26002_10073
-    vtab_set_error(&p->base, "could not open validity blob for %s.%s.%lld",
-                   p->schemaName, p->shadowChunksName, chunk_id);
-    return SQLITE_ERROR;
-  }
-  // will skip the sqlite3_blob_bytes(blobChunksValidity) check for now,
-  // the read below would catch it
+  const unsigned char *bufferChunksValidity = NULL;
+  void *vectorDatas[VEC0_MAX_VECTOR_COLUMNS] = {0};
 
-  rc = sqlite3_blob_read(blobChunksValidity, &bx, sizeof(bx), validityOffset);
-  if (rc != SQLITE_OK) {
-    // IMP: V21193_05263
-    vtab_set_error(
-        &p->base, "could not read validity blob for %s.%s.%lld at %d",
-        p->schemaName, p->shadowChunksName, chunk_id, validityOffset);
-    goto cleanup;
+  // 1) get the current maximum chunk_id
+  zSql = sqlite3_mprintf("SELECT max(rowid) FROM " VEC0_SHADOW_CHUNKS_NAME, p->schemaName, p->tableName);
+  if (!zSql) {
+    rc = SQLITE_NOMEM;
+    goto done;
   }
-  if (!(bx >> (chunk_offset % CHAR_BIT))) {
-    // IMP: V21193_05263
+  rc = sqlite3_prepare_v2(p->db, zSql, -1, &stmt, 0);
+  sqlite3_free((void *)zSql);
+  if ((rc != SQLITE_OK)) {
     rc = SQLITE_ERROR;
-    vtab_set_error(
-        &p->base,
-        "vec0 deletion error: validity bit is not set for %s.%s.%lld at %d",
-        p->schemaName, p->shadowChunksName, chunk_id, validityOffset);
+    goto done;
+  }
+  rc = sqlite3_step(stmt);
+  if (rc != SQLITE_ROW || sqlite3_column_type(stmt, 0) == SQLITE_NULL) {
+    if (rc == SQLITE_ROW) {
+      // no chunks to clear
+      rc = SQLITE_OK;
+    } else {
+      rc = SQLITE_ERROR;
+    }
     goto cleanup;
   }
-  char unsigned mask = ~(1 << (chunk_offset % CHAR_BIT));
-  char result = bx & mask;
-  rc = sqlite3_blob_write(blobChunksValidity, &result, sizeof(bx),
-                          validityOffset);
-  if (rc != SQLITE_OK) {
-    vtab_set_error(
-        &p->base, "could not write to validity blob for %s.%s.%lld at %d",
-        p->schemaName, p->shadowChunksName, chunk_id, validityOffset);
+  prev_max_chunk_rowid = sqlite3_column_int64(stmt, 0);
+  if (sqlite3_step(stmt) != SQLITE_DONE) {
+    rc = SQLITE_ERROR;
     goto cleanup;
   }
+  sqlite3_finalize(stmt);
+  stmt = NULL;
 
-cleanup:
-
-  brc = sqlite3_blob_close(blobChunksValidity);
-  if (rc != SQLITE_OK)
-    return rc;
-  if (brc != SQLITE_OK) {
-    vtab_set_error(&p->base,
-                   "vec0 deletion error: Error commiting validity blob "
-                   "transaction on %s.%s.%lld at %d",
-                   p->schemaName, p->shadowChunksName, chunk_id,
-                   validityOffset);
-    return brc;
+  // 1b) re-train IVF indexes on the current vectors
+  int ivf_column_idx = -1;
+  for (int i = 0; i < p->numVectorColumns; i++) {
+    if (vec0_has_ivf_index(p, i)) {
+      rc = vec0_ivf_train(p, i);
+      if (rc != SQLITE_OK) {
+        goto cleanup;
+      }
+      if (ivf_column_idx < 0) {
+        ivf_column_idx = i;
+      }
+    }
   }
-  return SQLITE_OK;
-}
-
-int vec0Update_Delete_DeleteRowids(vec0_vtab *p, i64 rowid) {
-  int rc;
-  sqlite3_stmt *stmt = NULL;
 
-  char *zSql =
-      sqlite3_mprintf("DELETE FROM " VEC0_SHADOW_ROWIDS_NAME " WHERE rowid = ?",
-                      p->schemaName, p->tableName);
+  // 2) for each row get the chunk_id for its partition key (if any), if the chunk_id is less than
+  // the previous maximum chunk_id, a new chunk needs to be created.
+  // Rows are moved list by list of the first IVF index, so each list is
+  // stored in as few chunks as possible.
+  if (ivf_column_idx >= 0) {
+    zSql = sqlite3_mprintf("SELECT r.rowid, r.chunk_id, r.chunk_offset FROM " VEC0_SHADOW_ROWIDS_NAME
+                           " AS r LEFT JOIN " VEC0_SHADOW_IVF_LISTS_N_NAME " AS l ON l.rowid = r.rowid"
+                           " ORDER BY l.list_id, r.rowid",
+                           p->schemaName, p->tableName, p->schemaName, p->tableName, ivf_column_idx);
+  } else {
+    zSql = sqlite3_mprintf("SELECT rowid, chunk_id, chunk_offset FROM " VEC0_SHADOW_ROWIDS_NAME,
+                           p->schemaName, p->tableName);
+  }
   if (!zSql) {
-    return SQLITE_NOMEM;
+    rc = SQLITE_NOMEM;
+    goto done;
   }
-
   rc = sqlite3_prepare_v2(p->db, zSql, -1, &stmt, NULL);
-  sqlite3_free(zSql);
+  sqlite3_free((void *)zSql);
   if (rc != SQLITE_OK) {
-    goto cleanup;
-  }
-  sqlite3_bind_int64(stmt, 1, rowid);
-  rc = sqlite3_step(stmt);
-  if (rc != SQLITE_DONE) {
-    goto cleanup;
+    goto done;
   }
-  rc = SQLITE_OK;
-
-cleanup:
-  sqlite3_finalize(stmt);
-  return rc;
-}
-
-// Clear the rowid slot in v_chunks.rowids for the given chunk/offset
-int vec0Update_Delete_ClearRowid(vec0_vtab *p, i64 chunk_id, i64 chunk_offset) {
-  int rc;
-  sqlite3_blob *blobChunksRowids = NULL;
 
-  rc = sqlite3_blob_open(p->db, p->schemaName, p->shadowChunksName, "rowids",
-                         chunk_id, 1, &blobChunksRowids);
-  if (rc != SQLITE_OK) {
-    vtab_set_error(&p->base, "could not open rowids blob for %s.%s.%lld",
-                   p->schemaName, p->shadowChunksName, chunk_id);
-    return SQLITE_ERROR;
+  if (p->numPartitionColumns > 0) {
+    sqlite3_str * s = sqlite3_str_new(NULL);
+    sqlite3_str_appendall(s, "SELECT ");
+    for (int i = 0; i < p->numPartitionColumns; i++) {
+      if (i == 0) sqlite3_str_appendf(s, "partition%02d", i);
+      else sqlite3_str_appendf(s, ", partition%02d", i);
+    }
+    sqlite3_str_appendf(s, " FROM " VEC0_SHADOW_CHUNKS_NAME, p->schemaName, p->tableName);
+    sqlite3_str_appendall(s, " WHERE chunk_id = ?");
+    zSql = sqlite3_str_finish(s);
+    if (!zSql) {
+      rc = SQLITE_NOMEM;
+      goto cleanup;
+    }
+    rc = sqlite3_prepare_v2(p->db, zSql, -1, &partition_key_stmt, NULL);
+    sqlite3_free((void *)zSql);
+    if (rc != SQLITE_OK) {
+      goto cleanup;
+    }
   }
 
-  i64 expected = p->chunk_size * sizeof(i64);
-  i64 actual = sqlite3_blob_bytes(blobChunksRowids);
-  if (expected != actual) {
-    vtab_set_error(&p->base,
-                   VEC_INTERAL_ERROR
-                   "rowids blob size mismatch on %s.%s.%lld. Expected %lld, actual %lld",
-                   p->schemaName, p->shadowChunksName, chunk_id, expected, actual);
-    sqlite3_blob_close(blobChunksRowids);
-    return SQLITE_ERROR;
-  }
+  i64 rowid, chunk_id, chunk_offset;
+  i64 new_chunk_id, new_chunk_offset;
+  while ((rc = sqlite3_step(stmt)) == SQLITE_ROW) {
+    rowid = sqlite3_column_int64(stmt, 0);
+    chunk_id = sqlite3_column_int64(stmt, 1);
+    chunk_offset = sqlite3_column_int64(stmt, 2);
 
-  i64 zero = 0;
-  rc = sqlite3_blob_write(blobChunksRowids, &zero, sizeof(i64),
-                          chunk_offset * sizeof(i64));
-  int brc = sqlite3_blob_close(blobChunksRowids);
-  if (rc != SQLITE_OK) {
-    vtab_set_error(&p->base, "could not write rowids blob on %s.%s.%lld",
-                   p->schemaName, p->shadowChunksName, chunk_id);
-    return rc;
-  }
-  if (brc != SQLITE_OK) {
-    vtab_set_error(&p->base,
-                   "could not close rowids blob on %s.%s.%lld",
-                   p->schemaName, p->shadowChunksName, chunk_id);
-    return brc;
-  }
-  return SQLITE_OK;
-}
+    // get the partition key for a row
+    if (p->numPartitionColumns > 0) {
+      sqlite3_reset(partition_key_stmt);
+      sqlite3_clear_bindings(partition_key_stmt);
+      sqlite3_bind_int64(partition_key_stmt, 1, chunk_id);
+      if (sqlite3_step(partition_key_stmt) != SQLITE_ROW) {
+        goto cleanup;
+      }
 
-// Clear the vector bytes for each vector column at the given chunk/offset
-int vec0Update_Delete_ClearVectors(vec0_vtab *p, i64 chunk_id, i64 chunk_offset) {
-  for (int i = 0; i < p->numVectorColumns; i++) {
-    int rc;
-    sqlite3_blob *blobVectors = NULL;
+      for (int i = 0; i < p->numPartitionColumns; i++) {
+        partitionKeyValues[i] = sqlite3_column_value(partition_key_stmt, i);
+      }
+    }
 
-    rc = sqlite3_blob_open(p->db, p->schemaName, p->shadowVectorChunksNames[i],
-                           "vectors", chunk_id, 1, &blobVectors);
+    // get the latest chunk_id for a partition key
+    rc = vec0_get_latest_chunk_rowid(p, &new_chunk_id, partitionKeyValues);
     if (rc != SQLITE_OK) {
-      vtab_set_error(&p->base, "Could not open vectors blob for %s.%s.%lld",
-                     p->schemaName, p->shadowVectorChunksNames[i], chunk_id);
-      return rc;
+      goto cleanup;
     }
 
-    i64 expected = p->chunk_size * vector_column_byte_size(p->vector_columns[i]);
-    i64 actual = sqlite3_blob_bytes(blobVectors);
-    if (expected != actual) {
-      vtab_set_error(&p->base,
-                     VEC_INTERAL_ERROR
-                     "vector blob size mismatch on %s.%s.%lld. Expected %lld, actual %lld",
-                     p->schemaName, p->shadowVectorChunksNames[i], chunk_id, expected, actual);
-      sqlite3_blob_close(blobVectors);
-      return SQLITE_ERROR;
+    // create a new chunk if the latest chunk_id for a partition key is less than the previous maximum chunk_id
+    if (new_chunk_id <= prev_max_chunk_rowid) {
+      rc = vec0_new_chunk(p, partitionKeyValues, NULL);
+      if (rc != SQLITE_OK) {
+        goto cleanup;
+      }
+    }
+    // get the vector data from all vector columns of a row
+    for (int i = 0; i < p->numVectorColumns; i++) {
+      rc = vec0_get_vector_data(p, rowid, i, &vectorDatas[i], NULL);
+      if (rc != SQLITE_OK) {
+        goto cleanup;
+      }
     }
 
-    size_t nbytes = vector_column_byte_size(p->vector_columns[i]);
-    void *zeros = sqlite3_malloc(nbytes);
-    if (!zeros) {
-      sqlite3_blob_close(blobVectors);
-      return SQLITE_NOMEM;
+    // find a valid slot in the new chunk
+    rc = vec0Update_InsertNextAvailableStep(p, partitionKeyValues, &new_chunk_id, &new_chunk_offset, &blobChunksValidity, &bufferChunksValidity);
+    if (rc != SQLITE_OK) {
+      goto cleanup;
     }
-    memset(zeros, 0, nbytes);
-    rc = vec0_write_vector_to_vector_blob(blobVectors, chunk_offset, zeros,
-                                          p->vector_columns[i].dimensions,
-                                          p->vector_columns[i].element_type);
-    sqlite3_free(zeros);
 
-    int brc = sqlite3_blob_close(blobVectors);
+    // write vector datas to the valid slot
+    rc = vec0Update_InsertWriteFinalStep(p, new_chunk_id, new_chunk_offset, rowid, vectorDatas, (unsigned char *)bufferChunksValidity);
     if (rc != SQLITE_OK) {
-      vtab_set_error(&p->base, "Could not write to vectors blob for %s.%s.%lld",
-                     p->schemaName, p->shadowVectorChunksNames[i], chunk_id);
-      return rc;
+      goto cleanup;
     }
-    if (brc != SQLITE_OK) {
+    sqlite3_free((void *)bufferChunksValidity);
+    bufferChunksValidity = NULL;
+    if (sqlite3_blob_close(blobChunksValidity) != SQLITE_OK) {
+      // the handle is closed even on error; null it so cleanup won't re-close
+      blobChunksValidity = NULL;
+      rc = SQLITE_ERROR;
       vtab_set_error(&p->base,
-                     "Could not commit blob transaction for vectors blob for %s.%s.%lld",
-                     p->schemaName, p->shadowVectorChunksNames[i], chunk_id);
-      return brc;
+        VEC_INTERAL_ERROR "unknown error, blobChunksValidity could "
+        "not be closed, please file an issue");
+        goto cleanup;
     }
-  }
-  return SQLITE_OK;
-}
+    blobChunksValidity = NULL;
 
-int vec0Update_Delete_DeleteAux(vec0_vtab *p, i64 rowid) {
-  int rc;
-  sqlite3_stmt *stmt = NULL;
+    // the per-row vector buffers were copied into the new chunk by
+    // vec0Update_InsertWriteFinalStep and are no longer needed; free them so
+    // they don't accumulate across a large optimize.
+    for (int i = 0; i < p->numVectorColumns; i++) {
+      sqlite3_free(vectorDatas[i]);
+      vectorDatas[i] = NULL;
+    }
 
-  char *zSql =
-      sqlite3_mprintf("DELETE FROM " VEC0_SHADOW_AUXILIARY_NAME " WHERE rowid = ?",
-                      p->schemaName, p->tableName);
-  if (!zSql) {
-    return SQLITE_NOMEM;
+    // copy metadata from previous chunk to new chunk
+    for (int i = 0; i < p->numMetadataColumns; i++) {
+      rc = vec0Update_SpecialInsert_OptimizeCopyMetadata(p, i, chunk_id, chunk_offset, new_chunk_id, new_chunk_offset);
+      if (rc != SQLITE_OK) {
+        goto cleanup;
+      }
+    }
+
+    if (p->numPartitionColumns > 0 && sqlite3_step(partition_key_stmt) != SQLITE_DONE) {
+      rc = SQLITE_ERROR;
+      goto cleanup;
+    }
+  }
+  if (rc != SQLITE_DONE) {
+    goto cleanup;
   }
+  sqlite3_finalize(partition_key_stmt);
+  sqlite3_finalize(stmt);
+  partition_key_stmt = NULL;
+  stmt = NULL;
 
-  rc = sqlite3_prepare_v2(p->db, zSql, -1, &stmt, NULL);
-  sqlite3_free(zSql);
+  // 3) clean up old chunks
+  zSql = sqlite3_mprintf("DELETE FROM " VEC0_SHADOW_CHUNKS_NAME " WHERE chunk_id <= ?",
+                          p->schemaName, p->tableName);
+  rc = sqlite3_prepare_v2(p->db, zSql, -1, &stmt, 0);
+  sqlite3_free((void *)zSql);
   if (rc != SQLITE_OK) {
     goto cleanup;
   }
-  sqlite3_bind_int64(stmt, 1, rowid);
-  rc = sqlite3_step(stmt);
-  if (rc != SQLITE_DONE) {
+  sqlite3_bind_int64(stmt, 1, prev_max_chunk_rowid);
+  if ((rc != SQLITE_OK) || (sqlite3_step(stmt) != SQLITE_DONE)) {
+    rc = SQLITE_ERROR;
     goto cleanup;
   }
-  rc = SQLITE_OK;
-
-cleanup:
   sqlite3_finalize(stmt);
-  return rc;
-}
 
-int vec0Update_Delete_ClearMetadata(vec0_vtab *p, int metadata_idx, i64 rowid, i64 chunk_id,
-                                    u64 chunk_offset) {
-  int rc;
-  sqlite3_blob * blobValue;
-  vec0_metadata_column_kind kind = p->metadata_columns[metadata_idx].kind;
-  rc = sqlite3_blob_open(p->db, p->schemaName, p->shadowMetadataChunksNames[metadata_idx], "data", chunk_id, 1, &blobValue);
-  if(rc != SQLITE_OK) {
-    return rc;
-  }
+  // 4) clean up old vector chunks
+  for (int i = 0; i < p->numVectorColumns; i++) {
+    zSql = sqlite3_mprintf("DELETE FROM " VEC0_SHADOW_VECTOR_N_NAME " WHERE rowid <= ?",
+                            p->schemaName, p->tableName, i);
+    rc = sqlite3_prepare_v2(p->db, zSql, -1, &stmt, 0);
+    sqlite3_free((void *)zSql);
+    if (rc != SQLITE_OK) {
+      goto cleanup;
+    }
+    sqlite3_bind_int64(stmt, 1, prev_max_chunk_rowid);
+    if ((rc != SQLITE_OK) || (sqlite3_step(stmt) != SQLITE_DONE)) {
+      rc = SQLITE_ERROR;
+      goto cleanup;
+    }
+    sqlite3_finalize(stmt);
 
-  switch(kind) {
-    case VEC0_METADATA_COLUMN_KIND_BOOLEAN: {
-      u8 block;
-      rc = sqlite3_blob_read(blobValue, &block, sizeof(u8), (int) (chunk_offset / CHAR_BIT));
-      if(rc != SQLITE_OK) {
-        goto done;
+    // HNSW nodes cache the chunk positions of their rows
+    if (vec0_has_hnsw_index(p, i)) {
+      rc = vec0_hnsw_invalidate(p, i);
+      if (rc != SQLITE_OK) {
+        goto cleanup;
       }
+    }
 
-      block &= ~(1 << (chunk_offset % CHAR_BIT));
-      rc = sqlite3_blob_write(blobValue, &block, sizeof(u8), chunk_offset / CHAR_BIT);
-      break;
+    // summaries of the new chunks were rebuilt as rows were moved over
+    if (vec0_has_chunk_summary(p, i)) {
+      zSql = sqlite3_mprintf("DELETE FROM " VEC0_SHADOW_VECTOR_SUMMARY_N_NAME " WHERE rowid <= ?",
+                              p->schemaName, p->tableName, i);
+      rc = sqlite3_prepare_v2(p->db, zSql, -1, &stmt, 0);
+      sqlite3_free((void *)zSql);
+      if (rc != SQLITE_OK) {
+        goto cleanup;
+      }
+      sqlite3_bind_int64(stmt, 1, prev_max_chunk_rowid);
+      if (sqlite3_step(stmt) != SQLITE_DONE) {
+        rc = SQLITE_ERROR;
+        goto cleanup;
+      }
+      sqlite3_finalize(stmt);
     }
-    case VEC0_METADATA_COLUMN_KIND_INTEGER: {
-      i64 v = 0;
-      rc = sqlite3_blob_write(blobValue, &v, sizeof(v), chunk_offset * sizeof(i64));
-      break;
+  }
+
+  // 5) clean up old metadata chunks
+  for (int i = 0; i < p->numMetadataColumns; i++) {
+    zSql = sqlite3_mprintf("DELETE FROM " VEC0_SHADOW_METADATA_N_NAME " WHERE rowid <= ?",
+                            p->schemaName, p->tableName, i);
+    rc = sqlite3_prepare_v2(p->db, zSql, -1, &stmt, 0);
+    sqlite3_free((void *)zSql);
+    if (rc != SQLITE_OK) {
+      goto cleanup;
     }
-    case VEC0_METADATA_COLUMN_KIND_FLOAT: {
-      double v = 0;
-      rc = sqlite3_blob_write(blobValue, &v, sizeof(v), chunk_offset * sizeof(double));
-      break;
+    sqlite3_bind_int64(stmt, 1, prev_max_chunk_rowid);
+    if ((rc != SQLITE_OK) || (sqlite3_step(stmt) != SQLITE_DONE)) {
+      rc = SQLITE_ERROR;
+      goto cleanup;
     }
-    case VEC0_METADATA_COLUMN_KIND_TEXT: {
-      int n;
-      rc = sqlite3_blob_read(blobValue, &n, sizeof(int), chunk_offset * VEC0_METADATA_TEXT_VIEW_BUFFER_LENGTH);
-      if(rc != SQLITE_OK) {
-        goto done;
-      }
+    sqlite3_finalize(stmt);
+    stmt = NULL;
 
-      u8 view[VEC0_METADATA_TEXT_VIEW_BUFFER_LENGTH];
-      memset(view, 0, VEC0_METADATA_TEXT_VIEW_BUFFER_LENGTH);
-      rc = sqlite3_blob_write(blobValue, &view, sizeof(view), chunk_offset * VEC0_METADATA_TEXT_VIEW_BUFFER_LENGTH);
-      if(rc != SQLITE_OK) {
-        goto done;
+    // rows were copied into the new chunks without their zones, so these are
+    // recomputed from the rows that are left
+    if (p->chunkSummaries) {
+      rc = vec0_metadata_zones_rebuild(p, i);
+      if (rc != SQLITE_OK) {
+        goto cleanup;
       }
-
-      if(n > VEC0_METADATA_TEXT_VIEW_DATA_LENGTH) {
-        char *zSql = sqlite3_mprintf("DELETE FROM " VEC0_SHADOW_METADATA_TEXT_DATA_NAME " WHERE rowid = ?", p->schemaName, p->tableName, metadata_idx);
-        if(!zSql) {
-          rc = SQLITE_NOMEM;
-          goto done;
-        }
-        rc = vec0_exec_metadata_text_sql(p->db, zSql, rowid, NULL, 0);
-        if(rc != SQLITE_OK) {
-          goto done;
-        }
+    }
+    // same for the bitmap indexes, over the new chunk positions
+    if (p->metadata_columns[i].indexed) {
+      rc = vec0_metadata_index_rebuild(p, i);
+      if (rc != SQLITE_OK) {
+        goto cleanup;
       }
-      break;
     }
   }
-  int rc2;
-  done:
-  rc2 = sqlite3_blob_close(blobValue);
-  if(rc == SQLITE_OK) {
-    return rc2;
+  stmt = NULL;
+
+  // 6) DiskANN graphs link chunk positions, so they're rebuilt over the new
+  // ones, with a freshly trained PQ codebook
+  for (int i = 0; i < p->numVectorColumns; i++) {
+    if (vec0_has_diskann_index(p, i)) {
+      rc = vec0_diskann_rebuild(p, i);
+      if (rc != SQLITE_OK) {
+        goto cleanup;
+      }
+    }
   }
-  return rc;
-}
 
-int vec0Update_Delete(sqlite3_vtab *pVTab, sqlite3_value *idValue) {
-  vec0_vtab *p = (vec0_vtab *)pVTab;
-  int rc;
-  i64 rowid;
-  i64 chunk_id;
-  i64 chunk_offset;
+  rc = SQLITE_OK;
 
-  if (p->pkIsText) {
-    rc = vec0_rowid_from_id(p, idValue, &rowid);
-    if (rc != SQLITE_OK) {
-      return rc;
-    }
-  } else {
-    rowid = sqlite3_value_int64(idValue);
+cleanup:
+  sqlite3_finalize(partition_key_stmt);
+  sqlite3_finalize(stmt);
+  // Free anything an error path left owned. All of these are NULL on the normal
+  // completion path (freed + nulled inside the loop), so this is a no-op then
+  // and safe (sqlite3_free(NULL) / sqlite3_blob_close(NULL) are no-ops).
+  sqlite3_free((void *)bufferChunksValidity);
+  sqlite3_blob_close(blobChunksValidity);
+  for (int i = 0; i < VEC0_MAX_VECTOR_COLUMNS; i++) {
+    sqlite3_free(vectorDatas[i]);
   }
+done:
+  return rc;
+}
 
-  // 1. Find chunk position for given rowid
-  // 2. Ensure that validity bit for position is 1, then set to 0
-  // 3. Zero out rowid in chunks.rowid
-  // 4. Zero out vector data in all vector column chunks
-  // 5. Delete value in _rowids table
-
-  // 1. get chunk_id and chunk_offset from _rowids
-  rc = vec0_get_chunk_position(p, rowid, NULL, &chunk_id, &chunk_offset);
+/**
+ * @brief Recount the free offsets of every chunk into _free_chunks, after
+ * creating it on tables that predate it.
+ */
+static int vec0_free_chunks_rebuild(vec0_vtab *p) {
+  sqlite3_stmt *stmt = NULL;
+  char *zSql;
+  int rc = vec0_create_free_chunks(p->db, p->schemaName, p->tableName,
+                                   p->numPartitionColumns);
   if (rc != SQLITE_OK) {
     return rc;
   }
+  p->freeChunks = 1;
 
-  rc = vec0Update_Delete_ClearValidity(p, chunk_id, chunk_offset);
-  if (rc != SQLITE_OK) {
-    return rc;
+  zSql = sqlite3_mprintf("DELETE FROM " VEC0_SHADOW_FREE_CHUNKS_NAME,
+                         p->schemaName, p->tableName);
+  if (!zSql) {
+    return SQLITE_NOMEM;
   }
-
-  // 3. zero out rowid in chunks.rowids
-  // https://github.com/asg017/sqlite-vec/issues/54
-  rc = vec0Update_Delete_ClearRowid(p, chunk_id, chunk_offset);
+  rc = sqlite3_exec(p->db, zSql, NULL, NULL, NULL);
+  sqlite3_free(zSql);
   if (rc != SQLITE_OK) {
     return rc;
   }
 
-  // 4. zero out any data in vector chunks tables
-  // https://github.com/asg017/sqlite-vec/issues/54
-  rc = vec0Update_Delete_ClearVectors(p, chunk_id, chunk_offset);
-  if (rc != SQLITE_OK) {
-    return rc;
+  zSql = sqlite3_mprintf("SELECT chunk_id, validity FROM " VEC0_SHADOW_CHUNKS_NAME,
+                         p->schemaName, p->tableName);
+  if (!zSql) {
+    return SQLITE_NOMEM;
   }
-
-  // 5. delete from _rowids table
-  rc = vec0Update_Delete_DeleteRowids(p, rowid);
+  rc = sqlite3_prepare_v2(p->db, zSql, -1, &stmt, NULL);
+  sqlite3_free(zSql);
   if (rc != SQLITE_OK) {
     return rc;
   }
-
-  // 6. delete any auxiliary rows
-  if(p->numAuxiliaryColumns > 0) {
-    rc = vec0Update_Delete_DeleteAux(p, rowid);
-    if (rc != SQLITE_OK) {
-      return rc;
+  while ((rc = sqlite3_step(stmt)) == SQLITE_ROW) {
+    i64 chunk_id = sqlite3_column_int64(stmt, 0);
+    const u8 *validity = sqlite3_column_blob(stmt, 1);
+    if (sqlite3_column_bytes(stmt, 1) != p->chunk_size / CHAR_BIT) {
+      continue;
     }
-  }
-
-  // 6. delete metadata
-  for(int i = 0; i < p->numMetadataColumns; i++) {
-    rc = vec0Update_Delete_ClearMetadata(p, i, rowid, chunk_id, chunk_offset);
-    if (rc != SQLITE_OK) {
-      return rc;
+    i64 nFree = vec0_validity_free_count(p, validity);
+    if (nFree > 0) {
+      rc = vec0_free_chunks_set(p, chunk_id, nFree, 0);
+      if (rc != SQLITE_OK) {
+        break;
+      }
     }
   }
-
-  return SQLITE_OK;
-}
-
-int vec0Update_UpdateAuxColumn(vec0_vtab *p, int auxiliary_column_idx, sqlite3_value * value, i64 rowid) {
-  int rc;
-  sqlite3_stmt *stmt;
-  const char * zSql = sqlite3_mprintf("UPDATE " VEC0_SHADOW_AUXILIARY_NAME " SET value%02d = ? WHERE rowid = ?", p->schemaName, p->tableName, auxiliary_column_idx);
-  if(!zSql) {
-    return SQLITE_NOMEM;
-  }
-  rc = sqlite3_prepare_v2(p->db, zSql, -1, &stmt, NULL);
-  if(rc != SQLITE_OK) {
-    return rc;
-  }
-  sqlite3_bind_value(stmt, 1, value);
-  sqlite3_bind_int64(stmt, 2, rowid);
-  rc = sqlite3_step(stmt);
-  if(rc != SQLITE_DONE) {
-    sqlite3_finalize(stmt);
-    return SQLITE_ERROR;
+  if (rc == SQLITE_DONE) {
+    rc = SQLITE_OK;
   }
   sqlite3_finalize(stmt);
-  return SQLITE_OK;
+  return rc;
 }
 
-int vec0Update_UpdateVectorColumn(vec0_vtab *p, i64 chunk_id, i64 chunk_offset,
-                                  int i, sqlite3_value *valueVector) {
-  int rc;
-
-  sqlite3_blob *blobVectors = NULL;
+/**
+ * @brief A chunk read whole into memory by an incremental 'optimize', see
+ * vec0_optimize_sparse_chunks().
+ */
+struct Vec0OptimizeChunk {
+  i64 chunk_id;
+  u8 *validity;
+  i64 *rowids;
+  u8 *vectors[VEC0_MAX_VECTOR_COLUMNS];
+  u8 *metadata[VEC0_MAX_METADATA_COLUMNS];
+};
 
-  char *pzError;
-  size_t dimensions;
-  enum VectorElementType elementType;
-  void *vector = NULL;
-  vector_cleanup cleanup = vector_cleanup_noop;
-  // https://github.com/asg017/sqlite-vec/issues/53
-  rc = vector_from_value(valueVector, &vector, &dimensions, &elementType,
-                         &cleanup, &pzError);
-  if (rc != SQLITE_OK) {
-    // IMP: V15203_32042
-    vtab_set_error(
-        &p->base, "Updated vector for the \"%.*s\" column is invalid: %z",
-        p->vector_columns[i].name_length, p->vector_columns[i].name, pzError);
-    rc = SQLITE_ERROR;
-    goto cleanup;
-  }
-  if (elementType != p->vector_columns[i].element_type) {
-    // IMP: V03643_20481
-    vtab_set_error(
-        &p->base,
-        "Updated vector for the \"%.*s\" column is expected to be of type "
-        "%s, but a %s vector was provided.",
-        p->vector_columns[i].name_length, p->vector_columns[i].name,
-        vector_subtype_name(p->vector_columns[i].element_type),
-        vector_subtype_name(elementType));
-    rc = SQLITE_ERROR;
-    goto cleanup;
+static void vec0_optimize_chunk_free(struct Vec0OptimizeChunk *chunk) {
+  sqlite3_free(chunk->validity);
+  sqlite3_free(chunk->rowids);
+  for (int i = 0; i < VEC0_MAX_VECTOR_COLUMNS; i++) {
+    sqlite3_free(chunk->vectors[i]);
   }
-  if (dimensions != p->vector_columns[i].dimensions) {
-    // IMP: V25739_09810
-    vtab_set_error(
-        &p->base,
-        "Dimension mismatch for new updated vector for the \"%.*s\" column. "
-        "Expected %d dimensions but received %d.",
-        p->vector_columns[i].name_length, p->vector_columns[i].name,
-        p->vector_columns[i].dimensions, dimensions);
-    rc = SQLITE_ERROR;
-    goto cleanup;
+  for (int i = 0; i < VEC0_MAX_METADATA_COLUMNS; i++) {
+    sqlite3_free(chunk->metadata[i]);
   }
+  memset(chunk, 0, sizeof(*chunk));
+}
 
-  rc = sqlite3_blob_open(p->db, p->schemaName, p->shadowVectorChunksNames[i],
-                         "vectors", chunk_id, 1, &blobVectors);
-  if (rc != SQLITE_OK) {
-    vtab_set_error(&p->base, "Could not open vectors blob for %s.%s.%lld",
-                   p->schemaName, p->shadowVectorChunksNames[i], chunk_id);
-    goto cleanup;
+/**
+ * @brief Read the n bytes of a chunk's blob at once, into a new buffer.
+ */
+static int vec0_optimize_blob_read(vec0_vtab *p, const char *zTable,
+                                   const char *zColumn, i64 chunk_id, i64 n,
+                                   void **out) {
+  sqlite3_blob *blob = NULL;
+  void *data = NULL;
+  int rc = sqlite3_blob_open(p->db, p->schemaName, zTable, zColumn, chunk_id,
+                             0, &blob);
+  if (rc == SQLITE_OK && sqlite3_blob_bytes(blob) != n) {
+    rc = SQLITE_ERROR;
   }
-  rc = vec0_write_vector_to_vector_blob(blobVectors, chunk_offset, vector,
-                                        p->vector_columns[i].dimensions,
-                                        p->vector_columns[i].element_type);
-  if (rc != SQLITE_OK) {
-    vtab_set_error(&p->base, "Could not write to vectors blob for %s.%s.%lld",
-                   p->schemaName, p->shadowVectorChunksNames[i], chunk_id);
-    goto cleanup;
+  if (rc == SQLITE_OK) {
+    data = sqlite3_malloc64(n);
+    rc = data ? sqlite3_blob_read(blob, data, (int)n, 0) : SQLITE_NOMEM;
   }
-
-cleanup:
-  cleanup(vector);
-  int brc = sqlite3_blob_close(blobVectors);
+  sqlite3_blob_close(blob);
   if (rc != SQLITE_OK) {
+    sqlite3_free(data);
+    vtab_set_error(&p->base,
+                   VEC_INTERAL_ERROR "could not read %s blob on %s.%s.%lld",
+                   zColumn, p->schemaName, zTable, chunk_id);
     return rc;
   }
-  if (brc != SQLITE_OK) {
-    vtab_set_error(
-        &p->base,
-        "Could not commit blob transaction for vectors blob for %s.%s.%lld",
-        p->schemaName, p->shadowVectorChunksNames[i], chunk_id);
-    return brc;
-  }
+  *out = data;
   return SQLITE_OK;
 }
 
-int vec0Update_Update(sqlite3_vtab *pVTab, int argc, sqlite3_value **argv) {
-  UNUSED_PARAMETER(argc);
-  vec0_vtab *p = (vec0_vtab *)pVTab;
+static int vec0_optimize_chunk_read(vec0_vtab *p, i64 chunk_id,
+                                    struct Vec0OptimizeChunk *chunk) {
   int rc;
-  i64 chunk_id;
-  i64 chunk_offset;
-
-  i64 rowid = 0;
-  if (p->pkIsText) {
-    const char *a = (const char *)sqlite3_value_text(argv[0]);
-    const char *b = (const char *)sqlite3_value_text(argv[1]);
-    // IMP: V08886_25725
-    if ((sqlite3_value_bytes(argv[0]) != sqlite3_value_bytes(argv[1])) ||
-        strncmp(a, b, sqlite3_value_bytes(argv[0])) != 0) {
-      vtab_set_error(pVTab,
-                     "UPDATEs on vec0 primary key values are not allowed.");
-      return SQLITE_ERROR;
-    }
-    rc = vec0_rowid_from_id(p, argv[0], &rowid);
-    if (rc != SQLITE_OK) {
-      return rc;
-    }
-  } else {
-    rowid = sqlite3_value_int64(argv[0]);
+  memset(chunk, 0, sizeof(*chunk));
+  chunk->chunk_id = chunk_id;
+  rc = vec0_optimize_blob_read(p, p->shadowChunksName, "validity", chunk_id,
+                               p->chunk_size / CHAR_BIT,
+                               (void **)&chunk->validity);
+  if (rc == SQLITE_OK) {
+    rc = vec0_optimize_blob_read(p, p->shadowChunksName, "rowids", chunk_id,
+                                 p->chunk_size * sizeof(i64),
+                                 (void **)&chunk->rowids);
+  }
+  for (int i = 0; i < p->numVectorColumns && rc == SQLITE_OK; i++) {
+    rc = vec0_optimize_blob_read(
+        p, p->shadowVectorChunksNames[i], "vectors", chunk_id,
+        p->chunk_size * vector_column_byte_size(p->vector_columns[i]),
+        (void **)&chunk->vectors[i]);
+  }
+  for (int i = 0; i < p->numMetadataColumns && rc == SQLITE_OK; i++) {
+    rc = vec0_optimize_blob_read(
+        p, p->shadowMetadataChunksNames[i], "data", chunk_id,
+        vec0_metadata_chunk_size(p->metadata_columns[i].kind, p->chunk_size),
+        (void **)&chunk->metadata[i]);
   }
-
-  // 1) get chunk_id and chunk_offset from _rowids
-  rc = vec0_get_chunk_position(p, rowid, NULL, &chunk_id, &chunk_offset);
   if (rc != SQLITE_OK) {
-    return rc;
+    vec0_optimize_chunk_free(chunk);
   }
+  return rc;
+}
 
-  // 2) update any partition key values
-  for (int i = 0; i < vec0_num_defined_user_columns(p); i++) {
-    if(p->user_column_kinds[i] != SQLITE_VEC0_USER_COLUMN_KIND_PARTITION) {
-      continue;
-    }
-    sqlite3_value * value = argv[2+VEC0_COLUMN_USERN_START + i];
-    if(sqlite3_value_nochange(value)) {
-      continue;
-    }
-    vtab_set_error(pVTab, "UPDATE on partition key columns are not supported yet. ");
-    return SQLITE_ERROR;
+static int vec0_optimize_chunk_write(vec0_vtab *p,
+                                     struct Vec0OptimizeChunk *chunk) {
+  i64 chunk_id = chunk->chunk_id;
+  int rc = vec0_bulk_write_whole(p, p->shadowChunksName, "validity", chunk_id,
+                                 chunk->validity, p->chunk_size / CHAR_BIT);
+  if (rc == SQLITE_OK) {
+    rc = vec0_bulk_write_whole(p, p->shadowChunksName, "rowids", chunk_id,
+                               (const u8 *)chunk->rowids,
+                               p->chunk_size * sizeof(i64));
+  }
+  for (int i = 0; i < p->numVectorColumns && rc == SQLITE_OK; i++) {
+    rc = vec0_bulk_write_whole(
+        p, p->shadowVectorChunksNames[i], "vectors", chunk_id,
+        chunk->vectors[i],
+        p->chunk_size * vector_column_byte_size(p->vector_columns[i]));
+  }
+  for (int i = 0; i < p->numMetadataColumns && rc == SQLITE_OK; i++) {
+    rc = vec0_bulk_write_whole(
+        p, p->shadowMetadataChunksNames[i], "data", chunk_id,
+        chunk->metadata[i],
+        vec0_metadata_chunk_size(p->metadata_columns[i].kind, p->chunk_size));
   }
+  return rc;
+}
 
-  // 3) handle auxiliary column updates
-  for (int i = 0; i < vec0_num_defined_user_columns(p); i++) {
-    if(p->user_column_kinds[i] != SQLITE_VEC0_USER_COLUMN_KIND_AUXILIARY) {
-      continue;
-    }
-    int auxiliary_column_idx = p->user_column_idxs[i];
-    sqlite3_value * value = argv[2+VEC0_COLUMN_USERN_START + i];
-    if(sqlite3_value_nochange(value)) {
+/**
+ * @brief Move a row between two chunks read into memory. The source position
+ * is zeroed, like deletes do.
+ */
+static void vec0_optimize_chunk_move(vec0_vtab *p,
+                                     struct Vec0OptimizeChunk *dst,
+                                     i64 dst_offset,
+                                     struct Vec0OptimizeChunk *src,
+                                     i64 src_offset) {
+  bitmap_set(dst->validity, dst_offset, 1);
+  bitmap_set(src->validity, src_offset, 0);
+  dst->rowids[dst_offset] = src->rowids[src_offset];
+  src->rowids[src_offset] = 0;
+  for (int i = 0; i < p->numVectorColumns; i++) {
+    size_t n = vector_column_byte_size(p->vector_columns[i]);
+    memcpy(dst->vectors[i] + dst_offset * n, src->vectors[i] + src_offset * n,
+           n);
+    memset(src->vectors[i] + src_offset * n, 0, n);
+  }
+  for (int i = 0; i < p->numMetadataColumns; i++) {
+    size_t n;
+    switch (p->metadata_columns[i].kind) {
+    case VEC0_METADATA_COLUMN_KIND_BOOLEAN:
+      bitmap_set(dst->metadata[i], dst_offset,
+                 bitmap_get(src->metadata[i], src_offset));
+      bitmap_set(src->metadata[i], src_offset, 0);
       continue;
+    case VEC0_METADATA_COLUMN_KIND_TEXT:
+      // long values are kept in _metadatatextNN by rowid, and don't move
+      n = VEC0_METADATA_TEXT_VIEW_BUFFER_LENGTH;
+      break;
+    default:
+      n = sizeof(i64);
+      break;
     }
-    rc = vec0Update_UpdateAuxColumn(p, auxiliary_column_idx, value, rowid);
-    if(rc != SQLITE_OK) {
-      return SQLITE_ERROR;
-    }
+    memcpy(dst->metadata[i] + dst_offset * n,
+           src->metadata[i] + src_offset * n, n);
+    memset(src->metadata[i] + src_offset * n, 0, n);
   }
+}
 
-  // 4) handle metadata column updates
-  for (int i = 0; i < vec0_num_defined_user_columns(p); i++) {
-    if(p->user_column_kinds[i] != SQLITE_VEC0_USER_COLUMN_KIND_METADATA) {
-      continue;
+/**
+ * @brief Delete an emptied chunk from _chunks and the per-chunk shadow tables.
+ */
+static int vec0_optimize_chunk_delete(vec0_vtab *p, i64 chunk_id) {
+  int rc;
+  char *zSql = sqlite3_mprintf("DELETE FROM " VEC0_SHADOW_CHUNKS_NAME
+                               " WHERE chunk_id = %lld",
+                               p->schemaName, p->tableName, chunk_id);
+  if (!zSql) {
+    return SQLITE_NOMEM;
+  }
+  rc = sqlite3_exec(p->db, zSql, NULL, NULL, NULL);
+  sqlite3_free(zSql);
+  for (int i = 0; i < p->numVectorColumns && rc == SQLITE_OK; i++) {
+    zSql = sqlite3_mprintf("DELETE FROM " VEC0_SHADOW_VECTOR_N_NAME
+                           " WHERE rowid = %lld",
+                           p->schemaName, p->tableName, i, chunk_id);
+    if (!zSql) {
+      return SQLITE_NOMEM;
     }
-    int metadata_column_idx = p->user_column_idxs[i];
-    sqlite3_value * value = argv[2+VEC0_COLUMN_USERN_START + i];
-    if(sqlite3_value_nochange(value)) {
-      continue;
+    rc = sqlite3_exec(p->db, zSql, NULL, NULL, NULL);
+    sqlite3_free(zSql);
+    if (rc == SQLITE_OK && vec0_has_chunk_summary(p, i)) {
+      zSql = sqlite3_mprintf("DELETE FROM " VEC0_SHADOW_VECTOR_SUMMARY_N_NAME
+                             " WHERE rowid = %lld",
+                             p->schemaName, p->tableName, i, chunk_id);
+      if (!zSql) {
+        return SQLITE_NOMEM;
+      }
+      rc = sqlite3_exec(p->db, zSql, NULL, NULL, NULL);
+      sqlite3_free(zSql);
     }
-    rc = vec0_write_metadata_value(p, metadata_column_idx, rowid, chunk_id, chunk_offset, value, 1);
-    if(rc != SQLITE_OK) {
-      return rc;
+  }
+  // bitmap index rows of the chunk were deleted with their last bit
+  for (int i = 0; i < p->numMetadataColumns && rc == SQLITE_OK; i++) {
+    zSql = sqlite3_mprintf("DELETE FROM " VEC0_SHADOW_METADATA_N_NAME
+                           " WHERE rowid = %lld",
+                           p->schemaName, p->tableName, i, chunk_id);
+    if (!zSql) {
+      return SQLITE_NOMEM;
+    }
+    rc = sqlite3_exec(p->db, zSql, NULL, NULL, NULL);
+    sqlite3_free(zSql);
+    if (rc == SQLITE_OK && p->chunkSummaries) {
+      zSql = sqlite3_mprintf("DELETE FROM " VEC0_SHADOW_METADATA_ZONES_N_NAME
+                             " WHERE rowid = %lld",
+                             p->schemaName, p->tableName, i, chunk_id);
+      if (!zSql) {
+        return SQLITE_NOMEM;
+      }
+      rc = sqlite3_exec(p->db, zSql, NULL, NULL, NULL);
+      sqlite3_free(zSql);
     }
   }
+  if (rc != SQLITE_OK) {
+    vtab_set_error(&p->base, VEC_INTERAL_ERROR "could not delete chunk %lld",
+                   chunk_id);
+  }
+  return rc;
+}
 
-  // 5) iterate over all new vectors, update the vectors
-  for (int i = 0; i < vec0_num_defined_user_columns(p); i++) {
-    if(p->user_column_kinds[i] != SQLITE_VEC0_USER_COLUMN_KIND_VECTOR) {
-      continue;
-    }
-    int vector_idx = p->user_column_idxs[i];
-    sqlite3_value *valueVector = argv[2 + VEC0_COLUMN_USERN_START + i];
-    // in vec0Column, we check sqlite3_vtab_nochange() on vector columns.
-    // If the vector column isn't being changed, we return NULL;
-    // That's not great, that means vector columns can never be NULLABLE
-    // (bc we cant distinguish if an updated vector is truly NULL or nochange).
-    // Also it means that if someone tries to run `UPDATE v SET X = NULL`,
-    // we can't effectively detect and raise an error.
-    // A better solution would be to use a custom result_type for "empty",
-    // but subtypes don't appear to survive xColumn -> xUpdate, it's always 0.
-    // So for now, we'll just use NULL and warn people to not SET X = NULL
-    // in the docs.
-    if (sqlite3_value_type(valueVector) == SQLITE_NULL) {
-      continue;
+/**
+ * @brief Widen the zone maps of a chunk rows were moved to over the zone maps
+ * of the chunk they came from.
+ */
+static int vec0_optimize_zones_merge(vec0_vtab *p, i64 dst_chunk_id,
+                                     i64 src_chunk_id) {
+  for (int i = 0; i < p->numMetadataColumns; i++) {
+    // min()/max() return NULL with any NULL argument, so a NULL bound sticks
+    char *zSql = sqlite3_mprintf(
+        "INSERT INTO " VEC0_SHADOW_METADATA_ZONES_N_NAME "(rowid, lo, hi) "
+        "SELECT %lld, lo, hi FROM " VEC0_SHADOW_METADATA_ZONES_N_NAME
+        " WHERE rowid = %lld ON CONFLICT(rowid) DO UPDATE SET "
+        "lo = min(lo, excluded.lo), hi = max(hi, excluded.hi)",
+        p->schemaName, p->tableName, i, dst_chunk_id, p->schemaName,
+        p->tableName, i, src_chunk_id);
+    if (!zSql) {
+      return SQLITE_NOMEM;
     }
-
-    rc = vec0Update_UpdateVectorColumn(p, chunk_id, chunk_offset, vector_idx,
-                                       valueVector);
+    int rc = sqlite3_exec(p->db, zSql, NULL, NULL, NULL);
+    sqlite3_free(zSql);
     if (rc != SQLITE_OK) {
-      return SQLITE_ERROR;
+      vtab_set_error(&p->base, "could not update zone map of chunk %lld",
+                     dst_chunk_id);
+      return rc;
     }
   }
-
   return SQLITE_OK;
 }
 
-int vec0Update_SpecialInsert_OptimizeCopyMetadata(vec0_vtab *p, int metadata_column_idx, i64 src_chunk_id, i64 src_chunk_offset, i64 dst_chunk_id, i64 dst_chunk_offset) {
+/**
+ * @brief Move the rows of a chunk into the fullest chunks of its partition
+ * with free offsets, and delete it once empty. Each chunk rows go to is read
+ * and written whole, with the moved rows' _rowids positions, summaries and
+ * bitmap index bits updated row by row.
+ *
+ * @param p vec0 table, with _free_chunks
+ * @param chunk_id chunk to empty
+ * @param minFree skip the chunk if it has fewer free offsets than this
+ * @param nMoved incremented by the number of rows moved
+ * @return int SQLITE_OK on success, error code otherwise
+ */
+static int vec0_optimize_sparse_chunk(vec0_vtab *p, i64 chunk_id, i64 minFree,
+                                      i64 *nMoved) {
   int rc;
-  struct Vec0MetadataColumnDefinition * metadata_column = &p->metadata_columns[metadata_column_idx];
-  vec0_metadata_column_kind kind = metadata_column->kind;
+  struct Vec0OptimizeChunk src, dst;
+  sqlite3_value *partitionKeyValues[VEC0_MAX_PARTITION_COLUMNS] = {0};
+  i64 *srcOffsets = NULL, *dstOffsets = NULL;
+  i64 nLeft;
+  memset(&dst, 0, sizeof(dst));
 
-  sqlite3_blob *srcBlob, *dstBlob;
-  rc = sqlite3_blob_open(p->db, p->schemaName, p->shadowMetadataChunksNames[metadata_column_idx], "data", src_chunk_id, 0, &srcBlob);
+  rc = vec0_optimize_chunk_read(p, chunk_id, &src);
   if (rc != SQLITE_OK) {
-    vtab_set_error(&p->base, "Failed to open %s blob", p->shadowMetadataChunksNames[metadata_column_idx]);
     return rc;
   }
-  rc = sqlite3_blob_open(p->db, p->schemaName, p->shadowMetadataChunksNames[metadata_column_idx], "data", dst_chunk_id, 1, &dstBlob);
-  if (rc != SQLITE_OK) {
-    vtab_set_error(&p->base, "Failed to open %s blob", p->shadowMetadataChunksNames[metadata_column_idx]);
-    sqlite3_blob_close(srcBlob);
-    return rc;
+  i64 nFree = vec0_validity_free_count(p, src.validity);
+  if (nFree < minFree) {
+    // filled since it was picked by rows moved from another chunk, or by
+    // inserts that didn't write the count back
+    rc = vec0_free_chunks_set(p, chunk_id, nFree, 0);
+    goto done;
   }
+  nLeft = p->chunk_size - nFree;
 
-  // Defensive: both metadata chunk blobs must be exactly the size this column's
-  // kind implies, and both offsets must be valid slots in [0, chunk_size). On
-  // any mismatch, return SQLITE_ERROR instead of issuing a blob read/write
-  // against malformed state -- a recoverable error the caller can catch is
-  // always preferable to corrupting memory or aborting the host process.
-  i64 expectedSize = vec0_metadata_chunk_size(kind, p->chunk_size);
-  if (sqlite3_blob_bytes(srcBlob) != expectedSize ||
-      sqlite3_blob_bytes(dstBlob) != expectedSize) {
-    vtab_set_error(&p->base,
-                   "Internal error: metadata chunk blob size mismatch during "
-                   "optimize on %s, expected %lld",
-                   p->shadowMetadataChunksNames[metadata_column_idx],
-                   (i64)expectedSize);
-    rc = SQLITE_ERROR;
+  if (p->numPartitionColumns > 0) {
+    sqlite3_stmt *stmt = NULL;
+    sqlite3_str *s = sqlite3_str_new(NULL);
+    sqlite3_str_appendall(s, "SELECT ");
+    for (int i = 0; i < p->numPartitionColumns; i++) {
+      sqlite3_str_appendf(s, "%spartition%02d", i ? ", " : "", i);
+    }
+    sqlite3_str_appendf(s, " FROM " VEC0_SHADOW_CHUNKS_NAME " WHERE chunk_id = ?",
+                        p->schemaName, p->tableName);
+    char *zSql = sqlite3_str_finish(s);
+    if (!zSql) {
+      rc = SQLITE_NOMEM;
+      goto done;
+    }
+    rc = sqlite3_prepare_v2(p->db, zSql, -1, &stmt, NULL);
+    sqlite3_free(zSql);
+    if (rc != SQLITE_OK) {
+      goto done;
+    }
+    sqlite3_bind_int64(stmt, 1, chunk_id);
+    rc = sqlite3_step(stmt) == SQLITE_ROW ? SQLITE_OK : SQLITE_ERROR;
+    for (int i = 0; i < p->numPartitionColumns && rc == SQLITE_OK; i++) {
+      partitionKeyValues[i] = sqlite3_value_dup(sqlite3_column_value(stmt, i));
+      if (!partitionKeyValues[i]) {
+        rc = SQLITE_NOMEM;
+      }
+    }
+    sqlite3_finalize(stmt);
+    if (rc != SQLITE_OK) {
+      goto done;
+    }
+  }
+
+  srcOffsets = sqlite3_malloc64(p->chunk_size * sizeof(i64));
+  dstOffsets = sqlite3_malloc64(p->chunk_size * sizeof(i64));
+  if (!srcOffsets || !dstOffsets) {
+    rc = SQLITE_NOMEM;
     goto done;
   }
-  if (src_chunk_offset < 0 || src_chunk_offset >= p->chunk_size ||
-      dst_chunk_offset < 0 || dst_chunk_offset >= p->chunk_size) {
-    vtab_set_error(&p->base,
-                   "Internal error: metadata chunk offset out of range during "
-                   "optimize on %s",
-                   p->shadowMetadataChunksNames[metadata_column_idx]);
-    rc = SQLITE_ERROR;
+
+  // so the chunk isn't picked to move its own rows to
+  rc = vec0_free_chunks_set(p, chunk_id, 0, 0);
+  if (rc != SQLITE_OK) {
     goto done;
   }
 
-  switch (kind) {
-    case VEC0_METADATA_COLUMN_KIND_BOOLEAN: {
-      u8 srcBlock, dstBlock;
-      rc = sqlite3_blob_read(srcBlob, &srcBlock, sizeof(u8), (int) (src_chunk_offset / CHAR_BIT));
-      if (rc != SQLITE_OK) {
-        goto done;
-      }
-      int value = (srcBlock >> (src_chunk_offset % CHAR_BIT)) & 1;
+  i64 srcOffset = 0;
+  while (nLeft > 0) {
+    i64 dst_chunk_id;
+    rc = vec0_free_chunks_fullest(p, partitionKeyValues, &dst_chunk_id);
+    if (rc == SQLITE_EMPTY) {
+      // the other chunks of the partition are full
+      rc = SQLITE_OK;
+      break;
+    }
+    if (rc != SQLITE_OK) {
+      goto done;
+    }
+    rc = vec0_optimize_chunk_read(p, dst_chunk_id, &dst);
+    if (rc != SQLITE_OK) {
+      goto done;
+    }
 
-      rc = sqlite3_blob_read(dstBlob, &dstBlock, sizeof(u8), (int) (dst_chunk_offset / CHAR_BIT));
-      if (rc != SQLITE_OK) {
-        goto done;
-      }
-      if (value) {
-        dstBlock |= 1 << (dst_chunk_offset % CHAR_BIT);
-      } else {
-        dstBlock &= ~(1 << (dst_chunk_offset % CHAR_BIT));
+    // pair the source's rows with the destination's free offsets
+    i64 n = 0;
+    for (i64 dstOffset = 0; dstOffset < p->chunk_size && n < nLeft;
+         dstOffset++) {
+      if (bitmap_get(dst.validity, dstOffset)) {
+        continue;
       }
-      rc = sqlite3_blob_write(dstBlob, &dstBlock, sizeof(u8), dst_chunk_offset / CHAR_BIT);
-      if (rc != SQLITE_OK) {
-        goto done;
+      while (!bitmap_get(src.validity, srcOffset)) {
+        srcOffset++;
       }
-      break;
+      srcOffsets[n] = srcOffset++;
+      dstOffsets[n] = dstOffset;
+      n++;
     }
-    case VEC0_METADATA_COLUMN_KIND_INTEGER: {
-      i64 value;
-      rc = sqlite3_blob_read(srcBlob, &value, sizeof(i64), src_chunk_offset * sizeof(i64));
-      if (rc != SQLITE_OK) {
-        goto done;
-      }
-      rc = sqlite3_blob_write(dstBlob, &value, sizeof(i64), dst_chunk_offset * sizeof(i64));
-      if (rc != SQLITE_OK) {
-        goto done;
+
+    // the bitmap indexes read values from the source chunk, before it's
+    // written
+    for (i64 k = 0; k < n; k++) {
+      for (int i = 0; i < p->numMetadataColumns; i++) {
+        if (!p->metadata_columns[i].indexed) {
+          continue;
+        }
+        rc = vec0_metadata_index_move(p, i, src.rowids[srcOffsets[k]],
+                                      chunk_id, srcOffsets[k], dst_chunk_id,
+                                      dstOffsets[k]);
+        if (rc != SQLITE_OK) {
+          goto done;
+        }
       }
-      break;
     }
-    case VEC0_METADATA_COLUMN_KIND_FLOAT: {
-      double value;
-      rc = sqlite3_blob_read(srcBlob, &value, sizeof(double), src_chunk_offset * sizeof(double));
+    for (i64 k = 0; k < n; k++) {
+      vec0_optimize_chunk_move(p, &dst, dstOffsets[k], &src, srcOffsets[k]);
+    }
+    rc = vec0_optimize_chunk_write(p, &dst);
+    if (rc != SQLITE_OK) {
+      goto done;
+    }
+
+    for (i64 k = 0; k < n; k++) {
+      i64 rowid = dst.rowids[dstOffsets[k]];
+      rc = vec0_rowids_update_position(p, rowid, dst_chunk_id, dstOffsets[k]);
       if (rc != SQLITE_OK) {
         goto done;
       }
-      rc = sqlite3_blob_write(dstBlob, &value, sizeof(double), dst_chunk_offset * sizeof(double));
+      for (int i = 0; i < p->numVectorColumns; i++) {
+        if (!vec0_has_chunk_summary(p, i)) {
+          continue;
+        }
+        const void *vector = dst.vectors[i] + dstOffsets[k] *
+                             vector_column_byte_size(p->vector_columns[i]);
+        rc = vec0_chunk_summary_add(p, i, dst_chunk_id, vector, 0);
+        if (rc != SQLITE_OK) {
+          goto done;
+        }
+      }
+      rc = vec0_chunk_summary_remove(p, chunk_id);
       if (rc != SQLITE_OK) {
         goto done;
       }
-      break;
     }
-    case VEC0_METADATA_COLUMN_KIND_TEXT: {
-      u8 view[VEC0_METADATA_TEXT_VIEW_BUFFER_LENGTH];
-      rc = sqlite3_blob_read(srcBlob, view, VEC0_METADATA_TEXT_VIEW_BUFFER_LENGTH, src_chunk_offset * VEC0_METADATA_TEXT_VIEW_BUFFER_LENGTH);
+    if (p->chunkSummaries) {
+      rc = vec0_optimize_zones_merge(p, dst_chunk_id, chunk_id);
       if (rc != SQLITE_OK) {
         goto done;
       }
-      rc = sqlite3_blob_write(dstBlob, view, VEC0_METADATA_TEXT_VIEW_BUFFER_LENGTH, dst_chunk_offset * VEC0_METADATA_TEXT_VIEW_BUFFER_LENGTH);
+    }
+    rc = vec0_free_chunks_set(p, dst_chunk_id,
+                              vec0_validity_free_count(p, dst.validity), 0);
+    if (rc != SQLITE_OK) {
+      goto done;
+    }
+    vec0_optimize_chunk_free(&dst);
+    nLeft -= n;
+    *nMoved += n;
+  }
+
+  if (nLeft > 0) {
+    if (nLeft < p->chunk_size - nFree) {
+      rc = vec0_optimize_chunk_write(p, &src);
       if (rc != SQLITE_OK) {
         goto done;
       }
-      break;
     }
+    rc = vec0_free_chunks_set(p, chunk_id, p->chunk_size - nLeft, 0);
+    goto done;
   }
-done: {
-  // Always close both blobs, but do not let a successful close overwrite a
-  // real read/write/validation error (the previous code masked the error with
-  // the srcBlob close result, and leaked dstBlob when the srcBlob close failed).
-  int rcSrcClose = sqlite3_blob_close(srcBlob);
-  int rcDstClose = sqlite3_blob_close(dstBlob);
-  if (rc == SQLITE_OK) {
-    rc = rcSrcClose;
+
+  rc = vec0_optimize_chunk_delete(p, chunk_id);
+  if (rc != SQLITE_OK || !p->stats.loaded) {
+    goto done;
   }
-  if (rc == SQLITE_OK) {
-    rc = rcDstClose;
+  // the partition is gone with its last chunk
+  {
+    sqlite3_stmt *stmt = NULL;
+    sqlite3_str *s = sqlite3_str_new(NULL);
+    sqlite3_str_appendf(s, "SELECT EXISTS (SELECT 1 FROM " VEC0_SHADOW_CHUNKS_NAME,
+                        p->schemaName, p->tableName);
+    for (int i = 0; i < p->numPartitionColumns; i++) {
+      sqlite3_str_appendf(s, "%s partition%02d IS ?", i ? " AND" : " WHERE", i);
+    }
+    sqlite3_str_appendall(s, ")");
+    char *zSql = sqlite3_str_finish(s);
+    if (!zSql) {
+      rc = SQLITE_NOMEM;
+      goto done;
+    }
+    rc = sqlite3_prepare_v2(p->db, zSql, -1, &stmt, NULL);
+    sqlite3_free(zSql);
+    if (rc != SQLITE_OK) {
+      goto done;
+    }
+    for (int i = 0; i < p->numPartitionColumns; i++) {
+      sqlite3_bind_value(stmt, i + 1, partitionKeyValues[i]);
+    }
+    rc = sqlite3_step(stmt);
+    if (rc == SQLITE_ROW) {
+      vec0_stats_add(p, 0, -1, sqlite3_column_int(stmt, 0) ? 0 : -1);
+      rc = SQLITE_OK;
+    }
+    sqlite3_finalize(stmt);
+  }
+
+done:
+  vec0_optimize_chunk_free(&src);
+  vec0_optimize_chunk_free(&dst);
+  sqlite3_free(srcOffsets);
+  sqlite3_free(dstOffsets);
+  for (int i = 0; i < VEC0_MAX_PARTITION_COLUMNS; i++) {
+    sqlite3_value_free(partitionKeyValues[i]);
   }
   return rc;
 }
-}
 
-int vec0Update_SpecialInsert_Optimize(vec0_vtab *p) {
-  sqlite3_stmt *stmt = NULL, *partition_key_stmt = NULL;
+/**
+ * @brief Incremental 'optimize': empty the emptiest chunks that are at most
+ * maxFill percent full into the fullest chunks of their partition, and delete
+ * them. Only the chunks rows are moved between are read and written, so unlike
+ * a full 'optimize' the work depends on the budget, not the table size.
+ *
+ * @param p vec0 table
+ * @param maxChunks how many chunks to empty at most, negative for no limit
+ * @param timeBudgetMs no chunk is started after this many milliseconds,
+ * negative for no limit
+ * @param maxFill fill threshold of the chunks to empty, in percent
+ * @return int SQLITE_OK on success, error code otherwise
+ */
+static int vec0_optimize_sparse_chunks(vec0_vtab *p, i64 maxChunks,
+                                       i64 timeBudgetMs, int maxFill) {
   int rc;
-  const char *zSql;
-  i64 prev_max_chunk_rowid = -1;
-  sqlite3_value *partitionKeyValues[VEC0_MAX_PARTITION_COLUMNS];
-  // Declared here (not inside the loop) and zero-initialized so the cleanup
-  // label -- reached by gotos from before and inside the loop -- can safely
-  // free whatever an error path still owns, without leaking or double-freeing.
-  sqlite3_blob *blobChunksValidity = NULL;
-  const unsigned char *bufferChunksValidity = NULL;
-  void *vectorDatas[VEC0_MAX_VECTOR_COLUMNS] = {0};
+  sqlite3_stmt *stmt = NULL;
+  i64 *chunkIds = NULL;
+  i64 nChunks = 0, nMoved = 0;
+  i64 minFree = p->chunk_size - p->chunk_size * maxFill / 100;
+  sqlite3_int64 start = vec0_now_ms();
 
-  // 1) get the current maximum chunk_id
-  zSql = sqlite3_mprintf("SELECT max(rowid) FROM " VEC0_SHADOW_CHUNKS_NAME, p->schemaName, p->tableName);
-  if (!zSql) {
-    rc = SQLITE_NOMEM;
-    goto done;
-  }
-  rc = sqlite3_prepare_v2(p->db, zSql, -1, &stmt, 0);
-  sqlite3_free((void *)zSql);
-  if ((rc != SQLITE_OK)) {
-    rc = SQLITE_ERROR;
-    goto done;
-  }
-  rc = sqlite3_step(stmt);
-  if (rc != SQLITE_ROW || sqlite3_column_type(stmt, 0) == SQLITE_NULL) {
-    if (rc == SQLITE_ROW) {
-      // no chunks to clear
-      rc = SQLITE_OK;
-    } else {
-      rc = SQLITE_ERROR;
-    }
-    goto cleanup;
+  rc = vec0_write_chunks_flush(p);
+  if (rc != SQLITE_OK) {
+    return rc;
   }
-  prev_max_chunk_rowid = sqlite3_column_int64(stmt, 0);
-  if (sqlite3_step(stmt) != SQLITE_DONE) {
-    rc = SQLITE_ERROR;
-    goto cleanup;
+  if (!vec0_has_free_chunks(p)) {
+    // tables that predate _free_chunks
+    rc = vec0_free_chunks_rebuild(p);
+    if (rc != SQLITE_OK) {
+      return rc;
+    }
   }
-  sqlite3_finalize(stmt);
 
-  // 2) for each row get the chunk_id for its partition key (if any), if the chunk_id is less than
-  // the previous maximum chunk_id, a new chunk needs to be created
-  zSql = sqlite3_mprintf("SELECT rowid, chunk_id, chunk_offset FROM " VEC0_SHADOW_ROWIDS_NAME,
-                         p->schemaName, p->tableName);
+  // picked up front, as rows moved change the counts
+  char *zSql = sqlite3_mprintf(
+      "SELECT chunk_id FROM " VEC0_SHADOW_FREE_CHUNKS_NAME
+      " WHERE free >= ? ORDER BY free DESC, chunk_id LIMIT ?",
+      p->schemaName, p->tableName);
   if (!zSql) {
-    rc = SQLITE_NOMEM;
-    goto done;
+    return SQLITE_NOMEM;
   }
   rc = sqlite3_prepare_v2(p->db, zSql, -1, &stmt, NULL);
-  sqlite3_free((void *)zSql);
+  sqlite3_free(zSql);
   if (rc != SQLITE_OK) {
+    return rc;
+  }
+  sqlite3_bind_int64(stmt, 1, minFree);
+  sqlite3_bind_int64(stmt, 2, maxChunks);
+  while ((rc = sqlite3_step(stmt)) == SQLITE_ROW) {
+    if ((nChunks & (nChunks - 1)) == 0) {
+      i64 *grown = sqlite3_realloc64(chunkIds, (nChunks ? nChunks * 2 : 16) *
+                                                   sizeof(i64));
+      if (!grown) {
+        rc = SQLITE_NOMEM;
+        break;
+      }
+      chunkIds = grown;
+    }
+    chunkIds[nChunks++] = sqlite3_column_int64(stmt, 0);
+  }
+  sqlite3_finalize(stmt);
+  if (rc != SQLITE_DONE) {
     goto done;
   }
+  rc = SQLITE_OK;
 
-  if (p->numPartitionColumns > 0) {
-    sqlite3_str * s = sqlite3_str_new(NULL);
-    sqlite3_str_appendall(s, "SELECT ");
-    for (int i = 0; i < p->numPartitionColumns; i++) {
-      if (i == 0) sqlite3_str_appendf(s, "partition%02d", i);
-      else sqlite3_str_appendf(s, ", partition%02d", i);
-    }
-    sqlite3_str_appendf(s, " FROM " VEC0_SHADOW_CHUNKS_NAME, p->schemaName, p->tableName);
-    sqlite3_str_appendall(s, " WHERE chunk_id = ?");
-    zSql = sqlite3_str_finish(s);
-    if (!zSql) {
-      rc = SQLITE_NOMEM;
-      goto cleanup;
+  for (i64 i = 0; i < nChunks; i++) {
+    if (i > 0 && timeBudgetMs >= 0 && vec0_now_ms() - start >= timeBudgetMs) {
+      break;
     }
-    rc = sqlite3_prepare_v2(p->db, zSql, -1, &partition_key_stmt, NULL);
-    sqlite3_free((void *)zSql);
+    rc = vec0_optimize_sparse_chunk(p, chunkIds[i], minFree, &nMoved);
     if (rc != SQLITE_OK) {
-      goto cleanup;
+      goto done;
     }
   }
 
-  i64 rowid, chunk_id, chunk_offset;
-  i64 new_chunk_id, new_chunk_offset;
-  while ((rc = sqlite3_step(stmt)) == SQLITE_ROW) {
-    rowid = sqlite3_column_int64(stmt, 0);
-    chunk_id = sqlite3_column_int64(stmt, 1);
-    chunk_offset = sqlite3_column_int64(stmt, 2);
-
-    // get the partition key for a row
-    if (p->numPartitionColumns > 0) {
-      sqlite3_reset(partition_key_stmt);
-      sqlite3_clear_bindings(partition_key_stmt);
-      sqlite3_bind_int64(partition_key_stmt, 1, chunk_id);
-      if (sqlite3_step(partition_key_stmt) != SQLITE_ROW) {
-        goto cleanup;
+  for (int i = 0; i < p->numVectorColumns && nMoved > 0; i++) {
+    // HNSW nodes cache the chunk positions of their rows
+    if (vec0_has_hnsw_index(p, i)) {
+      rc = vec0_hnsw_invalidate(p, i);
+      if (rc != SQLITE_OK) {
+        goto done;
       }
-
-      for (int i = 0; i < p->numPartitionColumns; i++) {
-        partitionKeyValues[i] = sqlite3_column_value(partition_key_stmt, i);
+    }
+    // DiskANN graphs link chunk positions, including those of the deleted
+    // chunks
+    if (vec0_has_diskann_index(p, i)) {
+      rc = vec0_diskann_rebuild(p, i);
+      if (rc != SQLITE_OK) {
+        goto done;
       }
     }
+  }
 
-    // get the latest chunk_id for a partition key
-    rc = vec0_get_latest_chunk_rowid(p, &new_chunk_id, partitionKeyValues);
-    if (rc != SQLITE_OK) {
-      goto cleanup;
-    }
+done:
+  sqlite3_free(chunkIds);
+  return rc;
+}
 
-    // create a new chunk if the latest chunk_id for a partition key is less than the previous maximum chunk_id
-    if (new_chunk_id <= prev_max_chunk_rowid) {
-      rc = vec0_new_chunk(p, partitionKeyValues, NULL);
-      if (rc != SQLITE_OK) {
-        goto cleanup;
+/**
+ * @brief Parse the options of an incremental 'optimize' command, like
+ * "max_chunks=50,max_fill=25": a comma-separated list of non-negative integer
+ * options.
+ */
+static int vec0_optimize_options_parse(vec0_vtab *p, const char *z, int n,
+                                       i64 *maxChunks, i64 *timeBudgetMs,
+                                       int *maxFill) {
+  int i = 0;
+  while (i < n) {
+    int keyStart = i;
+    while (i < n && z[i] != '=' && z[i] != ',') {
+      i++;
+    }
+    int keyLength = i - keyStart;
+    if (i == n || z[i] != '=' || i + 1 == n || !is_digit(z[i + 1])) {
+      vtab_set_error(&p->base, "Invalid 'optimize' option '%.*s'",
+                     i - keyStart, z + keyStart);
+      return SQLITE_ERROR;
+    }
+    i++;
+    i64 value = 0;
+    while (i < n && is_digit(z[i])) {
+      if (value > (LLONG_MAX - 9) / 10) {
+        vtab_set_error(&p->base, "'optimize' option '%.*s' is too large",
+                       keyLength, z + keyStart);
+        return SQLITE_ERROR;
       }
+      value = value * 10 + (z[i++] - '0');
     }
-    // get the vector data from all vector columns of a row
-    for (int i = 0; i < p->numVectorColumns; i++) {
-      rc = vec0_get_vector_data(p, rowid, i, &vectorDatas[i], NULL);
-      if (rc != SQLITE_OK) {
-        goto cleanup;
+    if (i < n && z[i] != ',') {
+      vtab_set_error(&p->base, "Invalid value for 'optimize' option '%.*s'",
+                     keyLength, z + keyStart);
+      return SQLITE_ERROR;
+    }
+    i++;
+
+    if (keyLength == 10 && sqlite3_strnicmp(z + keyStart, "max_chunks", 10) == 0) {
+      *maxChunks = value;
+    } else if (keyLength == 14 &&
+               sqlite3_strnicmp(z + keyStart, "time_budget_ms", 14) == 0) {
+      *timeBudgetMs = value;
+    } else if (keyLength == 8 &&
+               sqlite3_strnicmp(z + keyStart, "max_fill", 8) == 0) {
+      if (value > 100) {
+        vtab_set_error(&p->base,
+                       "'optimize' option 'max_fill' must be a percentage "
+                       "between 0 and 100");
+        return SQLITE_ERROR;
       }
+      *maxFill = (int)value;
+    } else {
+      vtab_set_error(&p->base, "Unknown 'optimize' option '%.*s'", keyLength,
+                     z + keyStart);
+      return SQLITE_ERROR;
     }
+  }
+  return SQLITE_OK;
+}
 
-    // find a valid slot in the new chunk
-    rc = vec0Update_InsertNextAvailableStep(p, partitionKeyValues, &new_chunk_id, &new_chunk_offset, &blobChunksValidity, &bufferChunksValidity);
-    if (rc != SQLITE_OK) {
-      goto cleanup;
+#ifndef SQLITE_VEC_OMIT_FS
+typedef enum {
+  VEC0_IMPORT_FORMAT_NPY,
+  VEC0_IMPORT_FORMAT_FVECS,
+  VEC0_IMPORT_FORMAT_BVECS,
+  VEC0_IMPORT_FORMAT_IVECS,
+  VEC0_IMPORT_FORMAT_RAW,
+} vec0_import_format;
+
+static const char *vec0ImportFormatNames[] = {"npy", "fvecs", "bvecs",
+                                              "ivecs", "raw"};
+
+// Bytes of a file an 'import' reads at once
+#define VEC0_IMPORT_BUFFER_SIZE (4 * 1024 * 1024)
+
+/**
+ * @brief A file of vectors read by 'import', see vec0_import().
+ */
+struct Vec0ImportReader {
+  FILE *file;
+  vec0_import_format format;
+  struct VectorColumnDefinition *column;
+  // bytes of a vector in the file, with the dimensions prefix of .*vecs files
+  size_t recordSize;
+  // up to bufferRecords vectors read at once
+  u8 *buffer;
+  size_t bufferRecords;
+  size_t nRecords;
+  size_t iRecord;
+  // vectors left in a .npy file, -1 for the other formats
+  i64 remaining;
+  // vectors read so far
+  i64 count;
+  // whether the file ends after the buffered vectors, in the middle of one
+  int truncated;
+  // the current vector, in the column's element type
+  void *vector;
+};
+
+static void vec0_import_reader_close(struct Vec0ImportReader *reader) {
+  if (reader->file) {
+    fclose(reader->file);
+  }
+  sqlite3_free(reader->buffer);
+  sqlite3_free(reader->vector);
+  memset(reader, 0, sizeof(*reader));
+}
+
+/**
+ * @brief Read the header of a .npy file, leaving the file at its data.
+ */
+static int vec0_import_npy_header(vec0_vtab *p, struct Vec0ImportReader *reader,
+                                  const char *zPath) {
+  unsigned char header[12];
+  size_t headerLength;
+  size_t n = fread(header, 1, 10, reader->file);
+  if (n != 10 || memcmp(NPY_MAGIC, header, sizeof(NPY_MAGIC)) != 0) {
+    vtab_set_error(&p->base, "'%s' is not a numpy array file", zPath);
+    return SQLITE_ERROR;
+  }
+  // version 1 stores the header length in 2 bytes, later versions in 4
+  if (header[6] == 1) {
+    headerLength = header[8] | (header[9] << 8);
+  } else {
+    if (fread(header + 10, 1, 2, reader->file) != 2) {
+      vtab_set_error(&p->base, "'%s' is not a numpy array file", zPath);
+      return SQLITE_ERROR;
     }
+    headerLength = header[8] | (header[9] << 8) | (header[10] << 16) |
+                   ((size_t)header[11] << 24);
+  }
 
-    // write vector datas to the valid slot
-    rc = vec0Update_InsertWriteFinalStep(p, new_chunk_id, new_chunk_offset, rowid, vectorDatas, blobChunksValidity, bufferChunksValidity);
+  unsigned char *zHeader = sqlite3_malloc64(headerLength + 1);
+  if (!zHeader) {
+    return SQLITE_NOMEM;
+  }
+  if (fread(zHeader, 1, headerLength, reader->file) != headerLength) {
+    sqlite3_free(zHeader);
+    vtab_set_error(&p->base, "numpy array file header length is invalid");
+    return SQLITE_ERROR;
+  }
+  int fortranOrder;
+  enum VectorElementType elementType;
+  size_t numElements = 0, numDimensions = 0;
+  int rc = parse_npy_header(&p->base, zHeader, headerLength, &elementType,
+                            &fortranOrder, &numElements, &numDimensions);
+  sqlite3_free(zHeader);
+  if (rc != SQLITE_OK) {
+    return rc;
+  }
+  if (numElements > 0 && numDimensions != (size_t)reader->column->dimensions) {
+    vtab_set_error(&p->base,
+                   "Dimension mismatch for imported vectors of the \"%.*s\" "
+                   "column. Expected %d dimensions but '%s' has %lld.",
+                   reader->column->name_length, reader->column->name,
+                   reader->column->dimensions, zPath, (i64)numDimensions);
+    return SQLITE_ERROR;
+  }
+  reader->remaining = numElements;
+  return SQLITE_OK;
+}
+
+static int vec0_import_reader_open(vec0_vtab *p,
+                                   struct Vec0ImportReader *reader,
+                                   int vector_column_idx, const char *zPath,
+                                   vec0_import_format format) {
+  struct VectorColumnDefinition *column = &p->vector_columns[vector_column_idx];
+  memset(reader, 0, sizeof(*reader));
+  reader->format = format;
+  reader->column = column;
+  reader->remaining = -1;
+
+  if (format != VEC0_IMPORT_FORMAT_RAW &&
+      column->element_type != SQLITE_VEC_ELEMENT_TYPE_FLOAT32) {
+    vtab_set_error(&p->base,
+                   "Only float32 vector columns can be imported from %s "
+                   "files, \"%.*s\" is a %s column",
+                   vec0ImportFormatNames[format], column->name_length,
+                   column->name, vector_subtype_name(column->element_type));
+    return SQLITE_ERROR;
+  }
+  switch (format) {
+  case VEC0_IMPORT_FORMAT_NPY:
+  case VEC0_IMPORT_FORMAT_RAW:
+    reader->recordSize = vector_column_byte_size(*column);
+    break;
+  case VEC0_IMPORT_FORMAT_FVECS:
+  case VEC0_IMPORT_FORMAT_IVECS:
+    reader->recordSize = sizeof(i32) + column->dimensions * 4;
+    break;
+  case VEC0_IMPORT_FORMAT_BVECS:
+    reader->recordSize = sizeof(i32) + column->dimensions;
+    break;
+  }
+
+  reader->file = fopen(zPath, "rb");
+  if (!reader->file) {
+    vtab_set_error(&p->base, "Could not open '%s' for 'import'", zPath);
+    return SQLITE_ERROR;
+  }
+  if (format == VEC0_IMPORT_FORMAT_NPY) {
+    int rc = vec0_import_npy_header(p, reader, zPath);
     if (rc != SQLITE_OK) {
-      goto cleanup;
+      return rc;
     }
-    sqlite3_free((void *)bufferChunksValidity);
-    bufferChunksValidity = NULL;
-    if (sqlite3_blob_close(blobChunksValidity) != SQLITE_OK) {
-      // the handle is closed even on error; null it so cleanup won't re-close
-      blobChunksValidity = NULL;
-      rc = SQLITE_ERROR;
+  }
+
+  reader->bufferRecords = VEC0_IMPORT_BUFFER_SIZE / reader->recordSize;
+  if (reader->bufferRecords == 0) {
+    reader->bufferRecords = 1;
+  }
+  reader->buffer = sqlite3_malloc64(reader->bufferRecords * reader->recordSize);
+  reader->vector = sqlite3_malloc64(vector_column_byte_size(*column));
+  if (!reader->buffer || !reader->vector) {
+    return SQLITE_NOMEM;
+  }
+  return SQLITE_OK;
+}
+
+/**
+ * @brief Read the next vector of an 'import' into reader->vector.
+ *
+ * @return SQLITE_ROW with the next vector, SQLITE_DONE once the file is read,
+ * an error code otherwise
+ */
+static int vec0_import_reader_next(vec0_vtab *p,
+                                   struct Vec0ImportReader *reader) {
+  struct VectorColumnDefinition *column = reader->column;
+  if (reader->iRecord == reader->nRecords) {
+    if (reader->truncated) {
       vtab_set_error(&p->base,
-        VEC_INTERAL_ERROR "unknown error, blobChunksValidity could "
-        "not be closed, please file an issue");
-        goto cleanup;
+                     "The file of an 'import' ends in the middle of vector "
+                     "%lld",
+                     reader->count);
+      return SQLITE_ERROR;
     }
-    blobChunksValidity = NULL;
-
-    // the per-row vector buffers were copied into the new chunk by
-    // vec0Update_InsertWriteFinalStep and are no longer needed; free them so
-    // they don't accumulate across a large optimize.
-    for (int i = 0; i < p->numVectorColumns; i++) {
-      sqlite3_free(vectorDatas[i]);
-      vectorDatas[i] = NULL;
+    size_t n = reader->bufferRecords;
+    if (reader->remaining >= 0 && (i64)n > reader->remaining) {
+      n = (size_t)reader->remaining;
     }
-
-    // copy metadata from previous chunk to new chunk
-    for (int i = 0; i < p->numMetadataColumns; i++) {
-      rc = vec0Update_SpecialInsert_OptimizeCopyMetadata(p, i, chunk_id, chunk_offset, new_chunk_id, new_chunk_offset);
-      if (rc != SQLITE_OK) {
-        goto cleanup;
+    size_t nBytes = n ? fread(reader->buffer, 1, n * reader->recordSize,
+                              reader->file)
+                      : 0;
+    if (ferror(reader->file)) {
+      vtab_set_error(&p->base, "Could not read the file of an 'import'");
+      return SQLITE_ERROR;
+    }
+    // the whole vectors before a truncated one are still inserted, the error
+    // comes once they are
+    reader->truncated =
+        nBytes % reader->recordSize != 0 ||
+        (reader->remaining >= 0 && nBytes < n * reader->recordSize);
+    reader->nRecords = nBytes / reader->recordSize;
+    reader->iRecord = 0;
+    if (reader->remaining >= 0) {
+      reader->remaining -= reader->nRecords;
+    }
+    if (reader->nRecords == 0 && reader->truncated) {
+      return vec0_import_reader_next(p, reader);
+    }
+    if (reader->nRecords == 0) {
+      if (fgetc(reader->file) != EOF) {
+        vtab_set_error(&p->base,
+                       "numpy array file is longer than its shape");
+        return SQLITE_ERROR;
       }
+      return SQLITE_DONE;
     }
+  }
 
-    if (p->numPartitionColumns > 0 && sqlite3_step(partition_key_stmt) != SQLITE_DONE) {
-      rc = SQLITE_ERROR;
-      goto cleanup;
+  const u8 *record = reader->buffer + reader->iRecord * reader->recordSize;
+  if (reader->format == VEC0_IMPORT_FORMAT_FVECS ||
+      reader->format == VEC0_IMPORT_FORMAT_BVECS ||
+      reader->format == VEC0_IMPORT_FORMAT_IVECS) {
+    i32 dimensions;
+    memcpy(&dimensions, record, sizeof(i32));
+    if (dimensions != (i32)column->dimensions) {
+      vtab_set_error(&p->base,
+                     "Dimension mismatch for imported vector %lld of the "
+                     "\"%.*s\" column. Expected %d dimensions but received %d.",
+                     reader->count, column->name_length, column->name,
+                     column->dimensions, dimensions);
+      return SQLITE_ERROR;
     }
+    record += sizeof(i32);
   }
-  if (rc != SQLITE_DONE) {
-    goto cleanup;
+  f32 *v = reader->vector;
+  switch (reader->format) {
+  case VEC0_IMPORT_FORMAT_NPY:
+  case VEC0_IMPORT_FORMAT_FVECS:
+  case VEC0_IMPORT_FORMAT_RAW:
+    memcpy(reader->vector, record, vector_column_byte_size(*column));
+    break;
+  case VEC0_IMPORT_FORMAT_BVECS:
+    for (size_t i = 0; i < column->dimensions; i++) {
+      v[i] = (f32)record[i];
+    }
+    break;
+  case VEC0_IMPORT_FORMAT_IVECS:
+    for (size_t i = 0; i < column->dimensions; i++) {
+      i32 x;
+      memcpy(&x, record + i * sizeof(i32), sizeof(i32));
+      v[i] = (f32)x;
+    }
+    break;
   }
-  sqlite3_finalize(partition_key_stmt);
-  sqlite3_finalize(stmt);
-  partition_key_stmt = NULL;
-  stmt = NULL;
+  reader->iRecord++;
+  reader->count++;
+  return SQLITE_ROW;
+}
+#endif
 
-  // 3) clean up old chunks
-  zSql = sqlite3_mprintf("DELETE FROM " VEC0_SHADOW_CHUNKS_NAME " WHERE chunk_id <= ?",
-                          p->schemaName, p->tableName);
-  rc = sqlite3_prepare_v2(p->db, zSql, -1, &stmt, 0);
-  sqlite3_free((void *)zSql);
-  if (rc != SQLITE_OK) {
-    goto cleanup;
+/**
+ * @brief 'import': insert every vector of a file. The INSERT gives the file's
+ * path as the value of the vector column to read it into, and the vectors get
+ * the other values of the INSERT, and consecutive rowids from its rowid if
+ * there is one. Rows go through a bulk load, see vec0_bulk_begin(), unless one
+ * is already on.
+ *
+ * @param p vec0 table
+ * @param zFormat format of the file, NULL to tell from its extension
+ * @param nFormat length of zFormat in bytes
+ * @param argv xUpdate arguments of the INSERT
+ * @return int SQLITE_OK on success, error code otherwise
+ */
+static int vec0_import(vec0_vtab *p, const char *zFormat, int nFormat,
+                       sqlite3_value **argv) {
+#ifdef SQLITE_VEC_OMIT_FS
+  UNUSED_PARAMETER(zFormat);
+  UNUSED_PARAMETER(nFormat);
+  UNUSED_PARAMETER(argv);
+  vtab_set_error(&p->base,
+                 "'import' is not available, sqlite-vec was compiled with "
+                 "SQLITE_VEC_OMIT_FS");
+  return SQLITE_ERROR;
+#else
+  int rc;
+  int importColumn = -1;
+  const char *zPath = NULL;
+  vec0_import_format format = VEC0_IMPORT_FORMAT_RAW;
+  struct Vec0ImportReader reader;
+  i64 rowid = 0;
+  int hasRowid = 0;
+  int ownBulk = 0;
+  i64 nInserted = 0;
+  memset(&reader, 0, sizeof(reader));
+
+  for (int i = 0; i < vec0_num_defined_user_columns(p); i++) {
+    if (p->user_column_kinds[i] != SQLITE_VEC0_USER_COLUMN_KIND_VECTOR ||
+        sqlite3_value_type(argv[2 + VEC0_COLUMN_USERN_START + i]) !=
+            SQLITE_TEXT) {
+      continue;
+    }
+    if (importColumn >= 0) {
+      vtab_set_error(&p->base,
+                     "'import' reads a single vector column, but several "
+                     "were given a file path");
+      return SQLITE_ERROR;
+    }
+    importColumn = p->user_column_idxs[i];
+    zPath = (const char *)sqlite3_value_text(argv[2 + VEC0_COLUMN_USERN_START + i]);
   }
-  sqlite3_bind_int64(stmt, 1, prev_max_chunk_rowid);
-  if ((rc != SQLITE_OK) || (sqlite3_step(stmt) != SQLITE_DONE)) {
-    rc = SQLITE_ERROR;
-    goto cleanup;
+  if (importColumn < 0) {
+    vtab_set_error(&p->base,
+                   "'import' needs the path of the file to read, as the "
+                   "value of a vector column");
+    return SQLITE_ERROR;
+  }
+  if (!zPath) {
+    return SQLITE_NOMEM;
+  }
+
+  sqlite3_value *idValue = argv[2 + VEC0_COLUMN_ID];
+  if (p->pkIsText) {
+    vtab_set_error(&p->base,
+                   "'import' needs an integer primary key, but %s was "
+                   "declared with a TEXT primary key",
+                   p->tableName);
+    return SQLITE_ERROR;
+  }
+  if (sqlite3_value_type(idValue) == SQLITE_INTEGER) {
+    rowid = sqlite3_value_int64(idValue);
+    hasRowid = 1;
+  } else if (sqlite3_value_type(idValue) != SQLITE_NULL) {
+    vtab_set_error(&p->base,
+                   "The rowid of an 'import' is the rowid of the first "
+                   "vector, and must be an integer");
+    return SQLITE_ERROR;
+  }
+
+  if (zFormat) {
+    int found = 0;
+    for (size_t i = 0; i < countof(vec0ImportFormatNames) && !found; i++) {
+      if ((int)strlen(vec0ImportFormatNames[i]) == nFormat &&
+          sqlite3_strnicmp(zFormat, vec0ImportFormatNames[i], nFormat) == 0) {
+        format = (vec0_import_format)i;
+        found = 1;
+      }
+    }
+    if (!found) {
+      vtab_set_error(&p->base,
+                     "Unknown 'import' format '%.*s', expected npy, fvecs, "
+                     "bvecs, ivecs or raw",
+                     nFormat, zFormat);
+      return SQLITE_ERROR;
+    }
+  } else {
+    // by extension, anything else is read as raw vectors
+    size_t nPath = strlen(zPath);
+    for (size_t i = 0; i < countof(vec0ImportFormatNames) - 1; i++) {
+      size_t n = strlen(vec0ImportFormatNames[i]);
+      if (nPath > n + 1 && zPath[nPath - n - 1] == '.' &&
+          sqlite3_stricmp(zPath + nPath - n, vec0ImportFormatNames[i]) == 0) {
+        format = (vec0_import_format)i;
+        break;
+      }
+    }
   }
-  sqlite3_finalize(stmt);
 
-  // 4) clean up old vector chunks
-  for (int i = 0; i < p->numVectorColumns; i++) {
-    zSql = sqlite3_mprintf("DELETE FROM " VEC0_SHADOW_VECTOR_N_NAME " WHERE rowid <= ?",
-                            p->schemaName, p->tableName, i);
-    rc = sqlite3_prepare_v2(p->db, zSql, -1, &stmt, 0);
-    sqlite3_free((void *)zSql);
+  rc = vec0_import_reader_open(p, &reader, importColumn, zPath, format);
+  if (rc != SQLITE_OK) {
+    goto done;
+  }
+
+  if (!p->bulk) {
+    rc = vec0_write_chunks_flush(p);
     if (rc != SQLITE_OK) {
-      goto cleanup;
+      goto done;
     }
-    sqlite3_bind_int64(stmt, 1, prev_max_chunk_rowid);
-    if ((rc != SQLITE_OK) || (sqlite3_step(stmt) != SQLITE_DONE)) {
-      rc = SQLITE_ERROR;
-      goto cleanup;
+    rc = vec0_bulk_begin(p);
+    if (rc != SQLITE_OK) {
+      goto done;
     }
-    sqlite3_finalize(stmt);
+    ownBulk = 1;
   }
 
-  // 5) clean up old metadata chunks
-  for (int i = 0; i < p->numMetadataColumns; i++) {
-    zSql = sqlite3_mprintf("DELETE FROM " VEC0_SHADOW_METADATA_N_NAME " WHERE rowid <= ?",
-                            p->schemaName, p->tableName, i);
-    rc = sqlite3_prepare_v2(p->db, zSql, -1, &stmt, 0);
-    sqlite3_free((void *)zSql);
+  while ((rc = vec0_import_reader_next(p, &reader)) == SQLITE_ROW) {
+    sqlite_int64 inserted;
+    rc = vec0_insert_row(p, argv, importColumn, reader.vector,
+                         hasRowid ? &rowid : NULL, &inserted);
     if (rc != SQLITE_OK) {
-      goto cleanup;
-    }
-    sqlite3_bind_int64(stmt, 1, prev_max_chunk_rowid);
-    if ((rc != SQLITE_OK) || (sqlite3_step(stmt) != SQLITE_DONE)) {
-      rc = SQLITE_ERROR;
-      goto cleanup;
+      goto done;
     }
-    sqlite3_finalize(stmt);
+    nInserted++;
+    rowid++;
+  }
+  if (rc != SQLITE_DONE) {
+    goto done;
   }
-
-  stmt = NULL;
   rc = SQLITE_OK;
 
-cleanup:
-  sqlite3_finalize(partition_key_stmt);
-  sqlite3_finalize(stmt);
-  // Free anything an error path left owned. All of these are NULL on the normal
-  // completion path (freed + nulled inside the loop), so this is a no-op then
-  // and safe (sqlite3_free(NULL) / sqlite3_blob_close(NULL) are no-ops).
-  sqlite3_free((void *)bufferChunksValidity);
-  sqlite3_blob_close(blobChunksValidity);
-  for (int i = 0; i < VEC0_MAX_VECTOR_COLUMNS; i++) {
-    sqlite3_free(vectorDatas[i]);
-  }
 done:
+  // like a failed INSERT ... SELECT, rows inserted before an error are kept,
+  // so their buffered vectors are written either way
+  vec0_stats_add(p, nInserted, 0, 0);
+  if (ownBulk) {
+    int rc2 = vec0_bulk_flush(p);
+    if (rc == SQLITE_OK) {
+      rc = rc2;
+    }
+    vec0_bulk_free(p->bulk);
+    p->bulk = NULL;
+  }
+  vec0_import_reader_close(&reader);
   return rc;
+#endif
 }
 
-int vec0Update_SpecialInsert(sqlite3_vtab *pVTab, sqlite3_value *pVal) {
+int vec0Update_SpecialInsert(sqlite3_vtab *pVTab, sqlite3_value *pVal,
+                              sqlite3_value **argv) {
   vec0_vtab *p = (vec0_vtab *)pVTab;
 
   const char *cmd = (const char *)sqlite3_value_text(pVal);
@@ -10234,26 +22839,124 @@ int vec0Update_SpecialInsert(sqlite3_vtab *pVTab, sqlite3_value *pVal) {
   if (!cmd) {
     return SQLITE_NOMEM;
   }
+  if (n_bytes == 10 && sqlite3_strnicmp(cmd, "bulk-begin", 10) == 0) {
+    // the chunks bulk loads fill are copied and written back whole
+    int rc = vec0_write_chunks_flush(p);
+    if (rc != SQLITE_OK) {
+      return rc;
+    }
+    return vec0_bulk_begin(p);
+  }
+  if (n_bytes == 8 && sqlite3_strnicmp(cmd, "bulk-end", 8) == 0) {
+    int rc = vec0_bulk_flush(p);
+    vec0_bulk_free(p->bulk);
+    p->bulk = NULL;
+    return rc;
+  }
+  if (n_bytes == 5 && sqlite3_strnicmp(cmd, "flush", 5) == 0) {
+    // nothing to merge without `delta_size=N`
+    if (p->deltaSize <= 0) {
+      return SQLITE_OK;
+    }
+    return vec0_delta_merge(p);
+  }
   if (n_bytes == 8 && sqlite3_strnicmp(cmd, "optimize", 8) == 0) {
-    return vec0Update_SpecialInsert_Optimize(p);
+    int rc = vec0_bulk_flush(p);
+    if (rc == SQLITE_OK && p->deltaSize > 0) {
+      rc = vec0_delta_merge(p);
+    }
+    // optimize moves rows into new chunks and deletes old ones
+    vec0_write_chunks_clear(p);
+    if (rc == SQLITE_OK) {
+      // rows go to the latest chunks while moved, free offsets are recounted
+      // after
+      p->freeChunks = 0;
+      rc = vec0Update_SpecialInsert_Optimize(p);
+    }
+    if (rc == SQLITE_OK) {
+      // tables created before the partition index existed
+      rc = vec0_create_partition_index(p->db, p->schemaName, p->tableName,
+                                       p->numPartitionColumns);
+    }
+    if (rc == SQLITE_OK) {
+      rc = vec0_free_chunks_rebuild(p);
+    } else {
+      p->freeChunks = -1;
+    }
+    if (rc == SQLITE_OK && p->stats.loaded) {
+      // optimize moves rows and drops chunks, simpler to recount than track
+      rc = vec0_stats_recount(p, &p->stats);
+      p->stats.dirty = 1;
+    }
+    return rc;
+  }
+  if (n_bytes == 6 && sqlite3_strnicmp(cmd, "import", 6) == 0) {
+    return vec0_import(p, NULL, 0, argv);
+  }
+  if (n_bytes > 7 && sqlite3_strnicmp(cmd, "import:", 7) == 0) {
+    return vec0_import(p, cmd + 7, n_bytes - 7, argv);
+  }
+  // 'optimize:' without options moves rows of all sparse chunks
+  if (n_bytes >= 9 && sqlite3_strnicmp(cmd, "optimize:", 9) == 0) {
+    i64 maxChunks = -1, timeBudgetMs = -1;
+    int maxFill = 50;
+    int rc = vec0_optimize_options_parse(p, cmd + 9, n_bytes - 9, &maxChunks,
+                                         &timeBudgetMs, &maxFill);
+    if (rc == SQLITE_OK) {
+      rc = vec0_bulk_flush(p);
+    }
+    if (rc == SQLITE_OK && p->deltaSize > 0) {
+      rc = vec0_delta_merge(p);
+    }
+    if (rc == SQLITE_OK) {
+      rc = vec0_optimize_sparse_chunks(p, maxChunks, timeBudgetMs, maxFill);
+    }
+    if (rc != SQLITE_OK) {
+      // _free_chunks may have been created by the failed statement
+      p->freeChunks = -1;
+    }
+    return rc;
   }
+  vtab_set_error(pVTab, "Unknown vec0 command '%.*s'", n_bytes, cmd);
   return SQLITE_ERROR;
 }
 
 static int vec0Update(sqlite3_vtab *pVTab, int argc, sqlite3_value **argv,
                       sqlite_int64 *pRowid) {
+  vec0_vtab *p = (vec0_vtab *)pVTab;
+  int rc;
+  p->writeGeneration++;
+  // stats are advisory: if they can't be read, they stay unloaded and aren't
+  // tracked, and the write itself reports whatever is wrong
+  vec0_stats_load(p, 1);
   // Special insert
   if (argc > 1 && sqlite3_value_type(argv[0]) == SQLITE_NULL &&
     sqlite3_value_type(argv[2 + vec0_column_table_name_idx((vec0_vtab*) pVTab)]) != SQLITE_NULL) {
-    return vec0Update_SpecialInsert(pVTab, argv[2 + vec0_column_table_name_idx((vec0_vtab*) pVTab)]);
+    return vec0Update_SpecialInsert(pVTab, argv[2 + vec0_column_table_name_idx((vec0_vtab*) pVTab)], argv);
+  }
+  // deletes and updates find rows through _rowids and the chunks, where rows
+  // buffered by a bulk load aren't yet
+  if (sqlite3_value_type(argv[0]) != SQLITE_NULL) {
+    rc = vec0_bulk_flush(p);
+    if (rc != SQLITE_OK) {
+      return rc;
+    }
   }
   // DELETE operation
   if (argc == 1 && sqlite3_value_type(argv[0]) != SQLITE_NULL) {
-    return vec0Update_Delete(pVTab, argv[0]);
+    rc = vec0Update_Delete(pVTab, argv[0]);
+    if (rc == SQLITE_OK) {
+      vec0_stats_add(p, -1, 0, 0);
+    }
+    return rc;
   }
   // INSERT operation
   else if (argc > 1 && sqlite3_value_type(argv[0]) == SQLITE_NULL) {
-    return vec0Update_Insert(pVTab, argc, argv, pRowid);
+    rc = vec0Update_Insert(pVTab, argc, argv, pRowid);
+    if (rc == SQLITE_OK) {
+      vec0_stats_add(p, 1, 0, 0);
+    }
+    return rc;
   }
   // UPDATE operation
   else if (argc > 1 && sqlite3_value_type(argv[0]) != SQLITE_NULL) {
@@ -10266,50 +22969,42 @@ static int vec0Update(sqlite3_vtab *pVTab, int argc, sqlite3_value **argv,
 
 static int vec0ShadowName(const char *zName) {
   static const char *azName[] = {
-    "rowids", "chunks", "auxiliary", "info",
-
-  // Up to VEC0_MAX_METADATA_COLUMNS
-  // TODO be smarter about this man
-  "metadatachunks00",
-  "metadatachunks01",
-  "metadatachunks02",
-  "metadatachunks03",
-  "metadatachunks04",
-  "metadatachunks05",
-  "metadatachunks06",
-  "metadatachunks07",
-  "metadatachunks08",
-  "metadatachunks09",
-  "metadatachunks10",
-  "metadatachunks11",
-  "metadatachunks12",
-  "metadatachunks13",
-  "metadatachunks14",
-  "metadatachunks15",
-
-  // Up to
-  "metadatatext00",
-  "metadatatext01",
-  "metadatatext02",
-  "metadatatext03",
-  "metadatatext04",
-  "metadatatext05",
-  "metadatatext06",
-  "metadatatext07",
-  "metadatatext08",
-  "metadatatext09",
-  "metadatatext10",
-  "metadatatext11",
-  "metadatatext12",
-  "metadatatext13",
-  "metadatatext14",
-  "metadatatext15",
+    "rowids", "chunks", "auxiliary", "info", "free_chunks",
+    // only with delta_size=N
+    "delta",
+  };
+  // Shadow tables with one instance per column, suffixed with the 2-digit
+  // column index. Up to VEC0_MAX_METADATA_COLUMNS / VEC0_MAX_VECTOR_COLUMNS.
+  static const char *azNumberedName[] = {
+    "metadatachunks", "metadatatext",
+    // only on `text dictionary` metadata columns
+    "metadatadict",
+    // only on `indexed` metadata columns
+    "metadataindex",
+    // only with chunk_summaries=true
+    "vector_summaries", "metadatazones",
+    // only on indexed_by=ivf vector columns
+    "ivf_centroids", "ivf_lists",
+    // only on indexed_by=hnsw vector columns
+    "hnsw_nodes",
+    // only on indexed_by=diskann vector columns
+    "diskann_neighbors", "diskann_codes",
   };
 
   for (size_t i = 0; i < sizeof(azName) / sizeof(azName[0]); i++) {
     if (sqlite3_stricmp(zName, azName[i]) == 0)
       return 1;
   }
+  for (size_t i = 0; i < sizeof(azNumberedName) / sizeof(azNumberedName[0]);
+       i++) {
+    int n = (int)strlen(azNumberedName[i]);
+    if (sqlite3_strnicmp(zName, azNumberedName[i], n) == 0 &&
+        strlen(zName) == (size_t)(n + 2) && is_digit(zName[n]) &&
+        is_digit(zName[n + 1]) &&
+        (zName[n] - '0') * 10 + (zName[n + 1] - '0') < 16) {
+      return 1;
+    }
+  }
   //for(size_t i = 0; i < )"vector_chunks", "metadatachunks"
   return 0;
 }
@@ -10321,6 +23016,14 @@ static int vec0Begin(sqlite3_vtab *pVTab) {
 static int vec0Sync(sqlite3_vtab *pVTab) {
   UNUSED_PARAMETER(pVTab);
   vec0_vtab *p = (vec0_vtab *)pVTab;
+  int rc = vec0_bulk_flush(p);
+  if (rc != SQLITE_OK) {
+    return rc;
+  }
+  rc = vec0_write_chunks_flush(p);
+  if (rc != SQLITE_OK) {
+    return rc;
+  }
   if (p->stmtLatestChunk) {
     sqlite3_finalize(p->stmtLatestChunk);
     p->stmtLatestChunk = NULL;
@@ -10341,14 +23044,101 @@ static int vec0Sync(sqlite3_vtab *pVTab) {
     sqlite3_finalize(p->stmtRowidsGetChunkPosition);
     p->stmtRowidsGetChunkPosition = NULL;
   }
-  return SQLITE_OK;
+  for (int i = 0; i < p->numVectorColumns; i++) {
+    sqlite3_finalize(p->hnswGraphs[i].stmtNodeRead);
+    p->hnswGraphs[i].stmtNodeRead = NULL;
+    sqlite3_finalize(p->hnswGraphs[i].stmtNodeWrite);
+    p->hnswGraphs[i].stmtNodeWrite = NULL;
+  }
+  return vec0_stats_write(p);
 }
 static int vec0Commit(sqlite3_vtab *pVTab) {
-  UNUSED_PARAMETER(pVTab);
+  vec0_vtab *p = (vec0_vtab *)pVTab;
+  // the committed stats match _info as of the data version after the commit
+  if (p->stats.loaded && p->stats.dirty) {
+    p->stats.dirty = 0;
+    p->statsDataVersion = vec0_data_version(p);
+  }
+  p->nStatsSavepoints = 0;
   return SQLITE_OK;
 }
+
+/**
+ * @brief Drop everything cached from the shadow tables that a rollback may
+ * have changed.
+ */
+static void vec0_rollback_caches(vec0_vtab *p) {
+  p->writeGeneration++;
+  vec0_write_chunks_clear(p);
+  // rows buffered by a bulk load were all inserted after the savepoint, which
+  // flushed the buffer when it began. Not so for savepoints of the shadow
+  // table statements run by xUpdate.
+  if (p->bulk && !p->bulk->busy) {
+    vec0_bulk_discard(p->bulk);
+  }
+  vec0_ivf_clear_centroids(p);
+  for (int i = 0; i < p->numVectorColumns; i++) {
+    vec0_hnsw_clear_graph(p, i);
+    vec0_diskann_clear_index(p, i);
+  }
+}
+
 static int vec0Rollback(sqlite3_vtab *pVTab) {
-  UNUSED_PARAMETER(pVTab);
+  vec0_vtab *p = (vec0_vtab *)pVTab;
+  vec0_rollback_caches(p);
+  memset(&p->stats, 0, sizeof(p->stats));
+  memset(&p->statsStored, 0, sizeof(p->statsStored));
+  p->nStatsSavepoints = 0;
+  return SQLITE_OK;
+}
+
+static int vec0Savepoint(sqlite3_vtab *pVTab, int iSavepoint) {
+  vec0_vtab *p = (vec0_vtab *)pVTab;
+  if (p->bulk && !p->bulk->busy) {
+    int rc = vec0_bulk_flush(p);
+    if (rc != SQLITE_OK) {
+      return rc;
+    }
+  }
+  if (iSavepoint < p->nStatsSavepoints) {
+    return SQLITE_OK;
+  }
+  struct Vec0TableStats *savepoints = sqlite3_realloc64(
+      p->statsSavepoints, (iSavepoint + 1) * sizeof(*savepoints));
+  if (!savepoints) {
+    return SQLITE_NOMEM;
+  }
+  // savepoints opened before this table joined the transaction saw the same
+  // stats, it had no writes yet
+  for (int i = p->nStatsSavepoints; i <= iSavepoint; i++) {
+    savepoints[i] = p->stats;
+  }
+  p->statsSavepoints = savepoints;
+  p->nStatsSavepoints = iSavepoint + 1;
+  return SQLITE_OK;
+}
+
+static int vec0Release(sqlite3_vtab *pVTab, int iSavepoint) {
+  vec0_vtab *p = (vec0_vtab *)pVTab;
+  if (iSavepoint < p->nStatsSavepoints) {
+    p->nStatsSavepoints = iSavepoint < 0 ? 0 : iSavepoint;
+  }
+  return SQLITE_OK;
+}
+
+static int vec0RollbackTo(sqlite3_vtab *pVTab, int iSavepoint) {
+  vec0_vtab *p = (vec0_vtab *)pVTab;
+  vec0_rollback_caches(p);
+  // _info may have been written by vec0Rename() since the savepoint
+  memset(&p->statsStored, 0, sizeof(p->statsStored));
+  if (iSavepoint < 0) {
+    // the savepoint that began the transaction, stats are read again
+    memset(&p->stats, 0, sizeof(p->stats));
+    p->nStatsSavepoints = 0;
+  } else if (iSavepoint < p->nStatsSavepoints) {
+    p->stats = p->statsSavepoints[iSavepoint];
+    p->nStatsSavepoints = iSavepoint + 1;
+  }
   return SQLITE_OK;
 }
 
@@ -10358,6 +23148,21 @@ static int vec0Rename(sqlite3_vtab *pVTab, const char *zName) {
   int rc;
   const char *zSql;
 
+  rc = vec0_bulk_flush(p);
+  if (rc != SQLITE_OK) {
+    return rc;
+  }
+  // free offsets and stats are written back under the old names, xSync may
+  // run on this instance after the rename
+  rc = vec0_write_chunks_flush(p);
+  if (rc != SQLITE_OK) {
+    return rc;
+  }
+  rc = vec0_stats_write(p);
+  if (rc != SQLITE_OK) {
+    return rc;
+  }
+  p->stats.dirty = 0;
   vec0_free_resources(p);
 
   zSql = sqlite3_mprintf("ALTER TABLE " VEC0_SHADOW_CHUNKS_NAME " RENAME TO \"%w_chunks\"",
@@ -10371,6 +23176,34 @@ static int vec0Rename(sqlite3_vtab *pVTab, const char *zName) {
   }
   sqlite3_finalize(stmt);
 
+  if (vec0_has_free_chunks(p)) {
+    zSql = sqlite3_mprintf("ALTER TABLE " VEC0_SHADOW_FREE_CHUNKS_NAME
+                           " RENAME TO \"%w_free_chunks\"",
+                           p->schemaName, p->tableName, zName);
+    rc = sqlite3_prepare_v2(p->db, zSql, -1, &stmt, 0);
+    sqlite3_free((void *)zSql);
+    if ((rc != SQLITE_OK) || (sqlite3_step(stmt) != SQLITE_DONE)) {
+      rc = SQLITE_ERROR;
+      vtab_set_error(pVTab, "could not rename free_chunks shadow table");
+      goto done;
+    }
+    sqlite3_finalize(stmt);
+  }
+
+  if (p->deltaSize > 0) {
+    zSql = sqlite3_mprintf("ALTER TABLE " VEC0_SHADOW_DELTA_NAME
+                           " RENAME TO \"%w_delta\"",
+                           p->schemaName, p->tableName, zName);
+    rc = sqlite3_prepare_v2(p->db, zSql, -1, &stmt, 0);
+    sqlite3_free((void *)zSql);
+    if ((rc != SQLITE_OK) || (sqlite3_step(stmt) != SQLITE_DONE)) {
+      rc = SQLITE_ERROR;
+      vtab_set_error(pVTab, "could not rename delta shadow table");
+      goto done;
+    }
+    sqlite3_finalize(stmt);
+  }
+
   zSql = sqlite3_mprintf("ALTER TABLE " VEC0_SHADOW_INFO_NAME " RENAME TO \"%w_info\"", p->schemaName,
                          p->tableName, zName);
   rc = sqlite3_prepare_v2(p->db, zSql, -1, &stmt, 0);
@@ -10408,6 +23241,76 @@ static int vec0Rename(sqlite3_vtab *pVTab, const char *zName) {
       goto done;
     }
     sqlite3_finalize(stmt);
+
+    if (vec0_has_chunk_summary(p, i)) {
+      zSql = sqlite3_mprintf("ALTER TABLE " VEC0_SHADOW_VECTOR_SUMMARY_N_NAME
+                             " RENAME TO \"%w_vector_summaries%02d\"",
+                             p->schemaName, p->tableName, i, zName, i);
+      rc = sqlite3_prepare_v2(p->db, zSql, -1, &stmt, 0);
+      sqlite3_free((void *)zSql);
+      if ((rc != SQLITE_OK) || (sqlite3_step(stmt) != SQLITE_DONE)) {
+        rc = SQLITE_ERROR;
+        vtab_set_error(pVTab, "could not rename vector_summaries shadow table");
+        goto done;
+      }
+      sqlite3_finalize(stmt);
+    }
+
+    if (p->vector_columns[i].index_type == VEC0_INDEX_TYPE_HNSW) {
+      zSql = sqlite3_mprintf("ALTER TABLE " VEC0_SHADOW_HNSW_NODES_N_NAME
+                             " RENAME TO \"%w_hnsw_nodes%02d\"",
+                             p->schemaName, p->tableName, i, zName, i);
+      rc = sqlite3_prepare_v2(p->db, zSql, -1, &stmt, 0);
+      sqlite3_free((void *)zSql);
+      if ((rc != SQLITE_OK) || (sqlite3_step(stmt) != SQLITE_DONE)) {
+        rc = SQLITE_ERROR;
+        vtab_set_error(pVTab, "could not rename hnsw_nodes shadow table");
+        goto done;
+      }
+      sqlite3_finalize(stmt);
+    }
+
+    if (p->vector_columns[i].index_type == VEC0_INDEX_TYPE_IVF) {
+      const char *azRename[] = {
+          "ALTER TABLE " VEC0_SHADOW_IVF_CENTROIDS_N_NAME
+          " RENAME TO \"%w_ivf_centroids%02d\"",
+          "ALTER TABLE " VEC0_SHADOW_IVF_LISTS_N_NAME
+          " RENAME TO \"%w_ivf_lists%02d\"",
+      };
+      for (size_t j = 0; j < sizeof(azRename) / sizeof(azRename[0]); j++) {
+        zSql = sqlite3_mprintf(azRename[j], p->schemaName, p->tableName, i,
+                               zName, i);
+        rc = sqlite3_prepare_v2(p->db, zSql, -1, &stmt, 0);
+        sqlite3_free((void *)zSql);
+        if ((rc != SQLITE_OK) || (sqlite3_step(stmt) != SQLITE_DONE)) {
+          rc = SQLITE_ERROR;
+          vtab_set_error(pVTab, "could not rename IVF shadow tables");
+          goto done;
+        }
+        sqlite3_finalize(stmt);
+      }
+    }
+
+    if (p->vector_columns[i].index_type == VEC0_INDEX_TYPE_DISKANN) {
+      const char *azRename[] = {
+          "ALTER TABLE " VEC0_SHADOW_DISKANN_NEIGHBORS_N_NAME
+          " RENAME TO \"%w_diskann_neighbors%02d\"",
+          "ALTER TABLE " VEC0_SHADOW_DISKANN_CODES_N_NAME
+          " RENAME TO \"%w_diskann_codes%02d\"",
+      };
+      for (size_t j = 0; j < sizeof(azRename) / sizeof(azRename[0]); j++) {
+        zSql = sqlite3_mprintf(azRename[j], p->schemaName, p->tableName, i,
+                               zName, i);
+        rc = sqlite3_prepare_v2(p->db, zSql, -1, &stmt, 0);
+        sqlite3_free((void *)zSql);
+        if ((rc != SQLITE_OK) || (sqlite3_step(stmt) != SQLITE_DONE)) {
+          rc = SQLITE_ERROR;
+          vtab_set_error(pVTab, "could not rename DiskANN shadow tables");
+          goto done;
+        }
+        sqlite3_finalize(stmt);
+      }
+    }
   }
 
   if(p->numAuxiliaryColumns > 0) {
@@ -10447,6 +23350,48 @@ static int vec0Rename(sqlite3_vtab *pVTab, const char *zName) {
       }
       sqlite3_finalize(stmt);
     }
+
+    if (p->metadata_columns[i].kind == VEC0_METADATA_COLUMN_KIND_DICTIONARY) {
+      zSql = sqlite3_mprintf("ALTER TABLE " VEC0_SHADOW_METADATA_DICT_N_NAME
+                             " RENAME TO \"%w_metadatadict%02d\"",
+                             p->schemaName, p->tableName, i, zName, i);
+      rc = sqlite3_prepare_v2(p->db, zSql, -1, &stmt, 0);
+      sqlite3_free((void *)zSql);
+      if ((rc != SQLITE_OK) || (sqlite3_step(stmt) != SQLITE_DONE)) {
+        rc = SQLITE_ERROR;
+        vtab_set_error(pVTab, "could not rename metadatadict shadow table");
+        goto done;
+      }
+      sqlite3_finalize(stmt);
+    }
+
+    if (p->metadata_columns[i].indexed) {
+      zSql = sqlite3_mprintf("ALTER TABLE " VEC0_SHADOW_METADATA_INDEX_N_NAME
+                             " RENAME TO \"%w_metadataindex%02d\"",
+                             p->schemaName, p->tableName, i, zName, i);
+      rc = sqlite3_prepare_v2(p->db, zSql, -1, &stmt, 0);
+      sqlite3_free((void *)zSql);
+      if ((rc != SQLITE_OK) || (sqlite3_step(stmt) != SQLITE_DONE)) {
+        rc = SQLITE_ERROR;
+        vtab_set_error(pVTab, "could not rename metadataindex shadow table");
+        goto done;
+      }
+      sqlite3_finalize(stmt);
+    }
+
+    if (p->chunkSummaries) {
+      zSql = sqlite3_mprintf("ALTER TABLE " VEC0_SHADOW_METADATA_ZONES_N_NAME
+                             " RENAME TO \"%w_metadatazones%02d\"",
+                             p->schemaName, p->tableName, i, zName, i);
+      rc = sqlite3_prepare_v2(p->db, zSql, -1, &stmt, 0);
+      sqlite3_free((void *)zSql);
+      if ((rc != SQLITE_OK) || (sqlite3_step(stmt) != SQLITE_DONE)) {
+        rc = SQLITE_ERROR;
+        vtab_set_error(pVTab, "could not rename metadatazones shadow table");
+        goto done;
+      }
+      sqlite3_finalize(stmt);
+    }
   }
 
   stmt = NULL;
@@ -10478,9 +23423,9 @@ static sqlite3_module vec0Module = {
     /* xRollback     */ vec0Rollback,
     /* xFindFunction */ 0,
     /* xRename       */ vec0Rename,
-    /* xSavepoint    */ 0,
-    /* xRelease      */ 0,
-    /* xRollbackTo   */ 0,
+    /* xSavepoint    */ vec0Savepoint,
+    /* xRelease      */ vec0Release,
+    /* xRollbackTo   */ vec0RollbackTo,
     /* xShadowName   */ vec0ShadowName,
 #if SQLITE_VERSION_NUMBER >= 3044000
     /* xIntegrity    */ 0, // https://github.com/asg017/sqlite-vec/issues/44
@@ -11246,7 +24191,6 @@ SQLITE_VEC_API int sqlite3_vec_init(sqlite3 *db, char **pzErrMsg,
     void (*xDestroy)(void *);
   } aMod[] = {
       // clang-format off
-    {"vec0",          &vec0Module,          NULL, NULL},
     {"vec_each",      &vec_eachModule,      NULL, NULL},
       // clang-format on
   };
@@ -11271,6 +24215,28 @@ SQLITE_VEC_API int sqlite3_vec_init(sqlite3 *db, char **pzErrMsg,
     }
   }
 
+  // vec0 tables register on the connection, for vec_result_cache_stats()
+  struct Vec0Connection *connection = sqlite3_malloc(sizeof(*connection));
+  if (!connection) {
+    return SQLITE_NOMEM;
+  }
+  memset(connection, 0, sizeof(*connection));
+  rc = sqlite3_create_module_v2(db, "vec0", &vec0Module, connection,
+                                sqlite3_free);
+  if (rc != SQLITE_OK) {
+    *pzErrMsg = sqlite3_mprintf("Error creating module vec0: %s",
+                                sqlite3_errmsg(db));
+    return rc;
+  }
+  rc = sqlite3_create_function_v2(db, "vec_result_cache_stats", 1, SQLITE_UTF8,
+                                  connection, vec_result_cache_stats, NULL,
+                                  NULL, NULL);
+  if (rc != SQLITE_OK) {
+    *pzErrMsg = sqlite3_mprintf("Error creating function %s: %s",
+                                "vec_result_cache_stats", sqlite3_errmsg(db));
+    return rc;
+  }
+
   return SQLITE_OK;
 }
 
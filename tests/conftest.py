@@ -1,6 +1,8 @@
 import os
+import random
 import pytest
 import sqlite3
+import struct
 
 
 def get_extension_path():
@@ -25,3 +27,71 @@ def db():
     db.load_extension(get_extension_path())
     db.enable_load_extension(False)
     return db
+
+
+def f32(values):
+    """Pack a list of numbers as a float32 vector blob."""
+    return struct.pack("%sf" % len(values), *values)
+
+
+def fetch_all(db, sql, params=[]):
+    """Rows of a query as tuples, to compare with lists of tuples."""
+    return [tuple(row) for row in db.execute(sql, params).fetchall()]
+
+
+def table_names(db, pattern):
+    """Names of the tables matching a LIKE pattern, such as shadow tables."""
+    return [
+        row[0]
+        for row in db.execute(
+            "select name from sqlite_master where type = 'table' and name like ? order by 1",
+            [pattern],
+        )
+    ]
+
+
+def random_rows(n, dims, seed=0):
+    """(rowid, vector) pairs of n gaussian float32 vectors, rowids from 1."""
+    rnd = random.Random(seed)
+    return [(i + 1, f32([rnd.gauss(0, 1) for _ in range(dims)])) for i in range(n)]
+
+
+def knn_rowids(db, table, query, k, where="", params=[]):
+    """Rowids of a KNN query on the embedding column, nearest first."""
+    return [
+        row[0]
+        for row in db.execute(
+            f"SELECT rowid, distance FROM {table} WHERE embedding MATCH ? AND k = ? {where} ORDER BY distance",
+            [query, k, *params],
+        ).fetchall()
+    ]
+
+
+def recall(db, queries, k, where="", params=[], ef_search=None):
+    """Share of the exact neighbors in table "brute" that the same KNN queries
+    on table "v" find."""
+    found = 0
+    for query in queries:
+        expected = knn_rowids(db, "brute", query, k, where, params)
+        if ef_search is None:
+            actual = knn_rowids(db, "v", query, k, where, params)
+        else:
+            actual = knn_rowids(db, "v", query, k, where + " AND ef_search = ?", [*params, ef_search])
+        assert len(actual) == len(expected)
+        found += len(set(actual) & set(expected))
+    return found / (len(queries) * k)
+
+
+def check_chunk_layout(db, name="v"):
+    """Assert every row is at an offset set in its chunk's validity bitmap, at
+    the offset its chunk's rowids blob has it, and nothing else is."""
+    offsets = {}
+    for rowid, chunk_id, chunk_offset in db.execute(
+        f"SELECT rowid, chunk_id, chunk_offset FROM {name}_rowids"
+    ).fetchall():
+        offsets.setdefault(chunk_id, set()).add(chunk_offset)
+        rowids = db.execute(f"SELECT rowids FROM {name}_chunks WHERE chunk_id = ?", [chunk_id]).fetchone()[0]
+        assert int.from_bytes(rowids[chunk_offset * 8 : chunk_offset * 8 + 8], "little") == rowid
+    for chunk_id, validity in db.execute(f"SELECT chunk_id, validity FROM {name}_chunks").fetchall():
+        bits = int.from_bytes(validity, "little")
+        assert {i for i in range(len(validity) * 8) if bits >> i & 1} == offsets.get(chunk_id, set())
@@ -188,7 +188,7 @@ def vec0_shadow_table_contents(db, v):
     shadow_tables = [
         row[0]
         for row in db.execute(
-            "select name from sqlite_master where name like ? order by 1", [f"{v}_%"]
+            "select name from sqlite_master where type = 'table' and name like ? order by 1", [f"{v}_%"]
         ).fetchall()
     ]
     o = {}
@@ -0,0 +1,189 @@
+import random
+import sqlite3
+
+import pytest
+
+
+def _rows(n, seed=0):
+    rnd = random.Random(seed)
+    return [
+        (
+            i,
+            rnd.randint(0, 1),
+            f"[{rnd.uniform(-1, 1)}, {rnd.uniform(-1, 1)}]",
+            rnd.randint(0, 100),
+            rnd.choice(["en", "fr", "a_language_with_a_long_name"]),
+            rnd.randint(0, 1),
+            rnd.uniform(0, 1),
+            rnd.choice(["news", "blog"]),
+            f"aux {i}",
+        )
+        for i in range(1, n + 1)
+    ]
+
+
+def _create(db, name, index=""):
+    db.execute(
+        f"""create virtual table {name} using vec0(
+          p integer partition key,
+          a float[2]{index},
+          n integer indexed,
+          lang text,
+          b boolean,
+          f float,
+          category text dictionary,
+          +extra text,
+          chunk_size=8
+        )"""
+    )
+
+
+def _insert(db, name, rows):
+    db.executemany(
+        f"INSERT INTO {name}(rowid, p, a, n, lang, b, f, category, extra) VALUES (?, ?, ?, ?, ?, ?, ?, ?, ?)",
+        rows,
+    )
+
+
+def _shadow_tables(db, name):
+    rows = db.execute(
+        "SELECT name FROM sqlite_master WHERE type = 'table' AND name LIKE ? ORDER BY name",
+        [f"{name}\\_%"],
+    ).fetchall()
+    return [row[0][len(name) :] for row in rows if row[0] != f"{name}_info"]
+
+
+def _assert_same_shadow_tables(db, a, b):
+    assert _shadow_tables(db, a) == _shadow_tables(db, b)
+    for suffix in _shadow_tables(db, a):
+        assert [tuple(row) for row in db.execute(f"SELECT * FROM {a}{suffix} ORDER BY 1, 2").fetchall()] == [
+            tuple(row) for row in db.execute(f"SELECT * FROM {b}{suffix} ORDER BY 1, 2").fetchall()
+        ], suffix
+
+
+def test_bulk_same_as_inserts(db):
+    _create(db, "v")
+    _create(db, "w")
+    rows = _rows(100)
+    # partitions change from row to row, and the first chunks have holes
+    _insert(db, "v", rows[:20])
+    _insert(db, "w", rows[:20])
+    db.execute("DELETE FROM v WHERE rowid % 3 = 0")
+    db.execute("DELETE FROM w WHERE rowid % 3 = 0")
+    db.execute("INSERT INTO v(v) VALUES ('bulk-begin')")
+    _insert(db, "v", rows[20:])
+    db.execute("INSERT INTO v(v) VALUES ('bulk-end')")
+    _insert(db, "w", rows[20:])
+    db.commit()
+    _assert_same_shadow_tables(db, "v", "w")
+
+    # sorted by partition, whole chunks are filled at once
+    rows = sorted(_rows(100, seed=1), key=lambda row: row[1])
+    rows = [(1000 + i, *row[1:]) for i, row in enumerate(rows)]
+    db.execute("INSERT INTO v(v) VALUES ('bulk-begin')")
+    _insert(db, "v", rows)
+    db.execute("INSERT INTO v(v) VALUES ('bulk-end')")
+    _insert(db, "w", rows)
+    db.commit()
+    _assert_same_shadow_tables(db, "v", "w")
+
+
+def test_bulk_reads_and_writes(db):
+    _create(db, "v")
+    db.execute("INSERT INTO v(v) VALUES ('bulk-begin')")
+    _insert(db, "v", _rows(30))
+    # reads, deletes and updates see the buffered rows
+    assert db.execute("SELECT count(*) FROM v").fetchone()[0] == 30
+    assert db.execute("SELECT extra FROM v WHERE rowid = 5").fetchone()[0] == "aux 5"
+    _insert(db, "v", [(31, 0, "[0, 0]", 1, "en", 0, 0.5, "news", None)])
+    assert [
+        row[0]
+        for row in db.execute(
+            "SELECT rowid FROM v WHERE a MATCH '[0, 0]' AND k = 1 AND p = 0"
+        ).fetchall()
+    ] == [31]
+    _insert(db, "v", [(32, 1, "[0, 0]", 1, "en", 0, 0.5, "news", None)])
+    db.execute("DELETE FROM v WHERE rowid = 32")
+    _insert(db, "v", [(33, 1, "[0, 0]", 1, "en", 0, 0.5, "news", None)])
+    db.execute("UPDATE v SET lang = 'de' WHERE rowid = 33")
+    assert db.execute("SELECT lang FROM v WHERE rowid = 33").fetchone()[0] == "de"
+
+    # a failed insert leaves the buffered rows alone
+    _insert(db, "v", [(34, 1, "[1, 1]", 1, "en", 0, 0.5, "news", None)])
+    with pytest.raises(sqlite3.OperationalError, match="UNIQUE constraint failed"):
+        _insert(db, "v", [(34, 1, "[1, 1]", 1, "en", 0, 0.5, "news", None)])
+    with pytest.raises(sqlite3.OperationalError, match="Dimension mismatch"):
+        _insert(db, "v", [(35, 1, "[1, 1, 1]", 1, "en", 0, 0.5, "news", None)])
+    _insert(db, "v", [(36, 1, "[1, 1]", 1, "en", 0, 0.5, "news", None)])
+    db.execute("INSERT INTO v(v) VALUES ('optimize')")
+    db.commit()
+    assert [row[0] for row in db.execute("SELECT rowid FROM v WHERE rowid > 30 ORDER BY rowid").fetchall()] == [31, 33, 34, 36]
+
+
+def test_bulk_rollback(db):
+    _create(db, "v")
+    db.execute("INSERT INTO v(v) VALUES ('bulk-begin')")
+    _insert(db, "v", _rows(10))
+    db.commit()
+
+    # the buffered rows are dropped with the transaction, bulk mode stays on
+    _insert(db, "v", _rows(20)[10:])
+    db.rollback()
+    assert db.execute("SELECT count(*) FROM v").fetchone()[0] == 10
+    assert db.execute("SELECT count(*) FROM v_rowids").fetchone()[0] == 10
+
+    # rolling back to a savepoint keeps the rows inserted before it
+    _insert(db, "v", _rows(15)[10:])
+    db.execute("SAVEPOINT a")
+    _insert(db, "v", _rows(20)[15:])
+    db.execute("ROLLBACK TO a")
+    db.execute("RELEASE a")
+    _insert(db, "v", _rows(25)[20:])
+    db.execute("INSERT INTO v(v) VALUES ('bulk-end')")
+    db.commit()
+    assert [row[0] for row in db.execute("SELECT rowid FROM v ORDER BY rowid").fetchall()] == [
+        *range(1, 16),
+        *range(21, 26),
+    ]
+    assert db.execute(
+        "SELECT count(*) FROM v_rowids WHERE chunk_id IS NULL"
+    ).fetchone()[0] == 0
+
+    # a failed INSERT ... SELECT rolls back its own rows only
+    db.execute("CREATE TABLE src(id, a)")
+    db.executemany("INSERT INTO src VALUES (?, '[1, 1]')", [(100,), (101,), (1,)])
+    db.execute("INSERT INTO v(v) VALUES ('bulk-begin')")
+    _insert(db, "v", [(50, 0, "[0, 0]", 1, "en", 0, 0.5, "news", None)])
+    with pytest.raises(sqlite3.OperationalError, match="UNIQUE constraint failed"):
+        db.execute(
+            "INSERT INTO v(rowid, p, a, n, lang, b, f, category) SELECT id, 0, a, 1, 'en', 0, 0.5, 'news' FROM src"
+        )
+    db.commit()
+    assert [row[0] for row in db.execute("SELECT rowid FROM v WHERE rowid >= 50 ORDER BY rowid").fetchall()] == [50]
+
+
+@pytest.mark.parametrize(
+    "index",
+    ["", " indexed_by=hnsw", " indexed_by=ivf(nlist=4, nprobe=4)", " indexed_by=diskann"],
+)
+def test_bulk_indexes(db, index):
+    _create(db, "v", index)
+    _create(db, "w", index)
+    rows = _rows(200)
+    if "ivf" in index:
+        # trained before the load, so rows are assigned to lists
+        _insert(db, "v", rows[:50])
+        _insert(db, "w", rows[:50])
+        db.execute("INSERT INTO v(v) VALUES ('optimize')")
+        db.execute("INSERT INTO w(w) VALUES ('optimize')")
+        rows = rows[50:]
+    db.execute("INSERT INTO v(v) VALUES ('bulk-begin')")
+    _insert(db, "v", rows)
+    db.execute("INSERT INTO v(v) VALUES ('bulk-end')")
+    _insert(db, "w", rows)
+    db.commit()
+    for query in ["[0, 0]", "[0.5, -0.5]", "[1, 1]"]:
+        knn = f"SELECT rowid, distance FROM {{}} WHERE a MATCH '{query}' AND k = 10 AND p = 1"
+        assert [tuple(row) for row in db.execute(knn.format("v")).fetchall()] == [
+            tuple(row) for row in db.execute(knn.format("w")).fetchall()
+        ]
@@ -0,0 +1,304 @@
+import json
+import random
+import struct
+
+import pytest
+from conftest import f32
+
+
+def _knn(db, table, query, k, column="embedding"):
+    return [
+        (row["rowid"], row["distance"])
+        for row in db.execute(
+            f"SELECT rowid, distance FROM {table} WHERE {column} MATCH ? AND k = ? ORDER BY distance",
+            [query, k],
+        ).fetchall()
+    ]
+
+
+def _clustered_rows(n, dims, seed=0):
+    # rows are inserted cluster by cluster, so each chunk covers a tight region
+    rnd = random.Random(seed)
+    rows = []
+    for i in range(n):
+        center = (i // 8) * 10.0
+        rows.append(
+            (i + 1, json.dumps([center + rnd.uniform(-1, 1) for _ in range(dims)]))
+        )
+    return rows
+
+
+def test_chunk_summaries_option(db):
+    with pytest.raises(
+        Exception, match="chunk_summaries must be true or false"
+    ):
+        db.execute(
+            "CREATE VIRTUAL TABLE v USING vec0(embedding float[2], chunk_summaries=yes)"
+        )
+    # the whole option name, not a prefix of it
+    with pytest.raises(Exception, match="Unknown table option: chunk_sum"):
+        db.execute(
+            "CREATE VIRTUAL TABLE v USING vec0(embedding float[2], chunk_sum=true)"
+        )
+
+    db.execute(
+        "CREATE VIRTUAL TABLE v USING vec0(a float[2], b bit[8], c int8[2], chunk_summaries=true)"
+    )
+    tables = [
+        row[0]
+        for row in db.execute(
+            "select name from sqlite_master where name like 'v_vector_summaries%' order by 1"
+        )
+    ]
+    # bit vectors are not summarized
+    assert tables == ["v_vector_summaries00", "v_vector_summaries02"]
+
+    db.execute("CREATE VIRTUAL TABLE w USING vec0(a float[2])")
+    assert (
+        db.execute(
+            "select count(*) from sqlite_master where name like 'w_vector_summaries%'"
+        ).fetchone()[0]
+        == 0
+    )
+
+
+def test_chunk_summaries_maintained(db):
+    db.execute(
+        "CREATE VIRTUAL TABLE v USING vec0(embedding float[2], chunk_size=8, chunk_summaries=true)"
+    )
+    db.executemany(
+        "INSERT INTO v(rowid, embedding) VALUES (?, ?)",
+        [(1, "[0, 0]"), (2, "[2, 0]"), (3, "[1, 4]")],
+    )
+    row = db.execute(
+        "select count, radius, centroid, lo, hi from v_vector_summaries00"
+    ).fetchone()
+    assert row["count"] == 3
+    assert struct.unpack("2f", row["centroid"]) == pytest.approx((1.0, 4 / 3))
+    assert struct.unpack("2f", row["lo"]) == (0.0, 0.0)
+    assert struct.unpack("2f", row["hi"]) == (2.0, 4.0)
+    # the radius is conservative, but must cover every vector
+    centroid = (1.0, 4 / 3)
+    assert row["radius"] >= max(
+        ((x - centroid[0]) ** 2 + (y - centroid[1]) ** 2) ** 0.5
+        for x, y in [(0, 0), (2, 0), (1, 4)]
+    ) - 1e-6
+
+    # updates only grow the summary
+    db.execute("UPDATE v SET embedding = '[10, 10]' WHERE rowid = 1")
+    row = db.execute("select count, hi from v_vector_summaries00").fetchone()
+    assert row["count"] == 3
+    assert struct.unpack("2f", row["hi"]) == (10.0, 10.0)
+
+    db.execute("DELETE FROM v WHERE rowid = 2")
+    assert db.execute("select count from v_vector_summaries00").fetchone()[0] == 2
+
+    # an emptied chunk resets its summary
+    db.execute("DELETE FROM v")
+    row = db.execute(
+        "select count, radius, centroid from v_vector_summaries00"
+    ).fetchone()
+    assert tuple(row) == (0, None, None)
+    assert _knn(db, "v", "[0, 0]", 3) == []
+
+    db.execute("INSERT INTO v(rowid, embedding) VALUES (4, '[5, 5]')")
+    row = db.execute("select count, radius, lo, hi from v_vector_summaries00").fetchone()
+    assert row["count"] == 1
+    assert row["radius"] == 0.0
+    assert struct.unpack("2f", row["lo"]) == (5.0, 5.0)
+
+
+@pytest.mark.parametrize("metric", ["l2", "l1"])
+def test_chunk_summaries_knn_matches_brute_force(db, metric):
+    db.execute(
+        f"CREATE VIRTUAL TABLE v USING vec0(embedding float[4] distance_metric={metric}, chunk_size=8, chunk_summaries=true)"
+    )
+    db.execute(
+        f"CREATE VIRTUAL TABLE brute USING vec0(embedding float[4] distance_metric={metric}, chunk_size=8)"
+    )
+    rows = _clustered_rows(200, 4)
+    db.executemany("INSERT INTO v(rowid, embedding) VALUES (?, ?)", rows)
+    db.executemany("INSERT INTO brute(rowid, embedding) VALUES (?, ?)", rows)
+
+    db.execute("DELETE FROM v WHERE rowid % 3 = 0")
+    db.execute("DELETE FROM brute WHERE rowid % 3 = 0")
+
+    rnd = random.Random(1)
+    for _ in range(20):
+        query = json.dumps([rnd.uniform(-5, 250) for _ in range(4)])
+        for k in (1, 5, 20):
+            assert _knn(db, "v", query, k) == _knn(db, "brute", query, k)
+
+    db.execute("INSERT INTO v(v) VALUES ('optimize')")
+    assert db.execute(
+        "select count(*) from v_vector_summaries00"
+    ).fetchone()[0] == db.execute("select count(*) from v_chunks").fetchone()[0]
+    assert (
+        db.execute("select sum(count) from v_vector_summaries00").fetchone()[0]
+        == db.execute("select count(*) from v_rowids").fetchone()[0]
+    )
+    for _ in range(10):
+        query = json.dumps([rnd.uniform(-5, 250) for _ in range(4)])
+        assert _knn(db, "v", query, 10) == _knn(db, "brute", query, 10)
+
+
+def test_chunk_summaries_int8(db):
+    db.execute(
+        "CREATE VIRTUAL TABLE v USING vec0(embedding int8[2], chunk_size=8, chunk_summaries=true)"
+    )
+    db.executemany(
+        "INSERT INTO v(rowid, embedding) VALUES (?, vec_int8(?))",
+        [(i, json.dumps([i, -i])) for i in range(1, 60)],
+    )
+    result = db.execute(
+        "SELECT rowid FROM v WHERE embedding MATCH vec_int8('[50, -50]') AND k = 3 ORDER BY distance"
+    ).fetchall()
+    assert result[0][0] == 50
+    assert sorted(row[0] for row in result[1:]) == [49, 51]
+
+
+def test_chunk_summaries_rename_and_drop(db):
+    db.execute(
+        "CREATE VIRTUAL TABLE v USING vec0(embedding float[2], chunk_summaries=true)"
+    )
+    db.execute("INSERT INTO v(rowid, embedding) VALUES (1, '[1, 1]')")
+    db.execute("ALTER TABLE v RENAME TO v2")
+    assert db.execute("select count from v2_vector_summaries00").fetchone()[0] == 1
+    assert _knn(db, "v2", f32([1, 1]), 1) == [(1, 0.0)]
+    db.execute("DROP TABLE v2")
+    assert (
+        db.execute(
+            "select count(*) from sqlite_master where name like '%summaries%'"
+        ).fetchone()[0]
+        == 0
+    )
+
+
+def _zones(db, table="v", column=0):
+    return [
+        tuple(row)
+        for row in db.execute(
+            f"select rowid, lo, hi from {table}_metadatazones{column:02d} order by 1"
+        ).fetchall()
+    ]
+
+
+def test_metadata_zones_maintained(db):
+    db.execute(
+        "CREATE VIRTUAL TABLE v USING vec0(embedding float[1], n integer, x float, b boolean, t text, chunk_size=8, chunk_summaries=true)"
+    )
+    db.executemany(
+        "INSERT INTO v(rowid, embedding, n, x, b, t) VALUES (?, ?, ?, ?, ?, ?)",
+        [(i, f32([i]), i * 10, i / 2, i % 2 == 0, f"t{i:02d}") for i in range(1, 12)],
+    )
+    assert _zones(db, column=0) == [(1, 10, 80), (2, 90, 110)]
+    assert _zones(db, column=1) == [(1, 0.5, 4.0), (2, 4.5, 5.5)]
+    assert _zones(db, column=2) == [(1, 0, 1), (2, 0, 1)]
+    assert _zones(db, column=3) == [(1, "t01", "t08"), (2, "t09", "t11")]
+
+    # updates widen a zone, deletes leave it as is
+    db.execute("UPDATE v SET n = 500, t = 'a' WHERE rowid = 9")
+    db.execute("DELETE FROM v WHERE rowid IN (1, 2)")
+    assert _zones(db, column=0) == [(1, 10, 80), (2, 90, 500)]
+    assert _zones(db, column=3) == [(1, "t01", "t08"), (2, "a", "t11")]
+
+    # long text values aren't bounded
+    db.execute("UPDATE v SET t = 'a much longer value' WHERE rowid = 10")
+    assert _zones(db, column=3) == [(1, "t01", "t08"), (2, None, None)]
+
+    # optimize recomputes zones from the remaining rows
+    db.execute("DELETE FROM v WHERE rowid IN (9, 10)")
+    db.execute("INSERT INTO v(v) VALUES ('optimize')")
+    assert [zone[1:] for zone in _zones(db, column=0)] == [(30, 110)]
+    assert [zone[1:] for zone in _zones(db, column=1)] == [(1.5, 5.5)]
+    assert [zone[1:] for zone in _zones(db, column=3)] == [("t03", "t11")]
+    db.execute("DELETE FROM v WHERE rowid % 2 = 0")
+    db.execute("INSERT INTO v(v) VALUES ('optimize')")
+    assert [zone[1:] for zone in _zones(db, column=2)] == [(0, 0)]
+
+
+@pytest.mark.parametrize(
+    "where,params",
+    [
+        ("n = ?", [42]),
+        ("n != ?", [42]),
+        ("n > ?", [150]),
+        ("n >= ?", [150]),
+        ("n < ?", [17]),
+        ("n <= ?", [17]),
+        ("n in (3, 77, 140)", []),
+        ("x between ? and ?", [10.5, 12.0]),
+        ("b = ?", [True]),
+        ("t = ?", ["g07"]),
+        ("t > ?", ["g15"]),
+        ("t < ?", ["g02"]),
+        ("t in ('g03', 'g18', 'zz')", []),
+        ("t like 'g1%'", []),
+        ("n is null", []),
+    ],
+)
+def test_metadata_zones_knn_matches_brute_force(db, where, params):
+    for table, options in [("v", ", chunk_summaries=true"), ("w", "")]:
+        db.execute(
+            f"CREATE VIRTUAL TABLE {table} USING vec0(embedding float[2], n integer, x float, b boolean, t text, chunk_size=8{options})"
+        )
+        # metadata values follow insert order, so each chunk covers a narrow range
+        db.executemany(
+            f"INSERT INTO {table}(rowid, embedding, n, x, b, t) VALUES (?, ?, ?, ?, ?, ?)",
+            [
+                (
+                    i,
+                    f32([(i * 7919) % 100, (i * 104729) % 100]),
+                    i,
+                    i / 8,
+                    i < 40,
+                    f"g{i // 8:02d}",
+                )
+                for i in range(1, 161)
+            ],
+        )
+    query = f32([50, 50])
+    results = [
+        db.execute(
+            f"SELECT rowid, distance FROM {table} WHERE embedding MATCH ? AND k = 10 AND {where} ORDER BY distance",
+            [query, *params],
+        ).fetchall()
+        for table in ["v", "w"]
+    ]
+    assert [tuple(row) for row in results[0]] == [tuple(row) for row in results[1]]
+
+
+def test_metadata_zones_skip_chunks(db):
+    db.execute(
+        "CREATE VIRTUAL TABLE v USING vec0(embedding float[2], n integer, chunk_size=8, chunk_summaries=true)"
+    )
+    db.executemany(
+        "INSERT INTO v(rowid, embedding, n) VALUES (?, ?, ?)",
+        [(i, f32([i, i]), i) for i in range(1, 81)],
+    )
+    # every chunk but one is ruled out by its zone before it's read, so a one
+    # chunk budget is enough for an exact result
+    rows = db.execute(
+        "SELECT rowid, exact FROM v WHERE embedding MATCH ? AND k = 3 AND n > 72 AND n <= 78 AND max_chunks = 1",
+        [f32([0, 0])],
+    ).fetchall()
+    assert [row["rowid"] for row in rows] == [73, 74, 75]
+    assert {row["exact"] for row in rows} == {1}
+
+
+def test_metadata_zones_rename_and_drop(db):
+    db.execute(
+        "CREATE VIRTUAL TABLE v USING vec0(embedding float[2], n integer, t text, chunk_summaries=true)"
+    )
+    db.execute("INSERT INTO v(rowid, embedding, n, t) VALUES (1, '[1, 1]', 5, 'a')")
+    db.execute("ALTER TABLE v RENAME TO v2")
+    assert _zones(db, "v2", 1) == [(1, "a", "a")]
+    db.execute("INSERT INTO v2(rowid, embedding, n, t) VALUES (2, '[1, 1]', 7, 'b')")
+    assert _zones(db, "v2", 0) == [(1, 5, 7)]
+    db.execute("DROP TABLE v2")
+    assert (
+        db.execute(
+            "select count(*) from sqlite_master where name like '%zones%'"
+        ).fetchone()[0]
+        == 0
+    )
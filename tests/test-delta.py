@@ -0,0 +1,130 @@
+import sqlite3
+
+import pytest
+from conftest import f32, fetch_all
+
+
+def _rows(n):
+    # small coordinates, distinct distances to [0, 0]
+    return [
+        (i, "ab"[i % 2], f32([i % 7, i / 8]), i % 3, "a long text value %d" % (i % 4), "d%d" % (i % 2))
+        for i in range(1, n + 1)
+    ]
+
+
+def _tables(db, n):
+    columns = "p text partition key, a float[2], n integer, t text, d text dictionary, +x text"
+    db.execute(f"create virtual table base using vec0({columns}, chunk_size=8)")
+    db.execute(f"create virtual table v using vec0({columns}, chunk_size=8, delta_size=8)")
+    for table in ["base", "v"]:
+        db.executemany(f"INSERT INTO {table}(rowid, p, a, n, t, d, x) VALUES (?, ?, ?, ?, ?, ?, 'x')", _rows(n))
+    db.commit()
+
+
+def test_delta_inserts(db):
+    _tables(db, 20)
+    # rows 17 to 20 wait in the delta, without a position in the chunks
+    assert fetch_all(db, "SELECT rowid FROM v_delta") == [(17,), (18,), (19,), (20,)]
+    assert fetch_all(db, "SELECT count(*) FROM v_rowids WHERE chunk_id IS NULL") == [(4,)]
+
+    for sql in [
+        "SELECT rowid, p, vec_to_json(a), n, t, d, x FROM {} ORDER BY rowid",
+        "SELECT rowid, p, vec_to_json(a), n, t, d, x FROM {} WHERE rowid = 19",
+    ]:
+        assert fetch_all(db, sql.format("v")) == fetch_all(db, sql.format("base"))
+
+    # the insert after the delta is full merges it into chunks first
+    for rowid in range(100, 105):
+        db.execute("INSERT INTO v(rowid, p, a, n, t, d) VALUES (?, 'a', ?, 0, 'short', 'd0')", [rowid, f32([0, 0])])
+    assert fetch_all(db, "SELECT rowid FROM v_delta") == [(104,)]
+    assert fetch_all(db, "SELECT count(*) FROM v_rowids WHERE chunk_id IS NULL") == [(1,)]
+
+    # like 'optimize', which merges it before moving rows
+    db.execute("INSERT INTO v(v) VALUES ('flush')")
+    db.commit()
+    assert fetch_all(db, "SELECT count(*) FROM v_delta") == [(0,)]
+    assert fetch_all(db, "SELECT count(*) FROM v_rowids WHERE chunk_id IS NULL") == [(0,)]
+    db.execute("DELETE FROM v WHERE rowid >= 100")
+    assert fetch_all(db, "SELECT rowid, p, vec_to_json(a), n, t, d, x FROM v ORDER BY rowid") == fetch_all(
+        db, "SELECT rowid, p, vec_to_json(a), n, t, d, x FROM base ORDER BY rowid"
+    )
+
+
+def test_delta_knn(db):
+    _tables(db, 45)
+    assert fetch_all(db, "SELECT count(*) FROM v_delta") == [(5,)]
+    query = f32([0, 0])
+    for where in [
+        "k = 10",
+        "k = 10 AND p = 'b'",
+        "k = 10 AND p IN ('a', 'b') AND n = 1",
+        "k = 10 AND t = 'a long text value 1'",
+        "k = 10 AND t > 'a long text value 1'",
+        "k = 10 AND d = 'd1'",
+        "k = 10 AND rowid IN (1, 2, 43, 44, 45)",
+        "k = 10 AND distance < 5",
+        "k = 10 AND filter = 'n = 2 or d = ''d0'''",
+        "k_per_partition = 3",
+    ]:
+        sql = f"SELECT rowid, distance FROM {{}} WHERE a MATCH ? AND {where}"
+        expected = fetch_all(db, sql.format("base"), [query])
+        assert fetch_all(db, sql.format("v"), [query]) == expected, where
+    # the delta rows are closest
+    assert fetch_all(db, "SELECT rowid FROM v WHERE a MATCH ? AND k = 2", [f32([43 % 7, 43 / 8])]) == [(43,), (36,)]
+
+
+def test_delta_update_delete(db):
+    _tables(db, 20)
+    db.execute("DELETE FROM v WHERE rowid = 18")
+    db.execute("DELETE FROM base WHERE rowid = 18")
+    assert fetch_all(db, "SELECT rowid FROM v_delta") == [(17,), (19,), (20,)]
+    assert fetch_all(db, "SELECT count(*) FROM v_metadatatext01 WHERE rowid = 18") == [(0,)]
+
+    # rows of the delta are merged to be updated
+    for table in ["v", "base"]:
+        db.execute(f"UPDATE {table} SET n = 50, t = 'short', a = ? WHERE rowid = 19", [f32([9, 9])])
+    assert fetch_all(db, "SELECT count(*) FROM v_delta") == [(0,)]
+    db.commit()
+    assert fetch_all(db, "SELECT rowid, p, vec_to_json(a), n, t, d, x FROM v ORDER BY rowid") == fetch_all(
+        db, "SELECT rowid, p, vec_to_json(a), n, t, d, x FROM base ORDER BY rowid"
+    )
+    assert fetch_all(db, "SELECT rowid FROM v_metadatatext01 ORDER BY 1") == fetch_all(
+        db, "SELECT rowid FROM base_metadatatext01 ORDER BY 1"
+    )
+
+    # rolled back like any other write
+    db.execute("INSERT INTO v(rowid, p, a, n, t, d) VALUES (100, 'a', ?, 0, 'short', 'd0')", [f32([0, 0])])
+    db.rollback()
+    assert fetch_all(db, "SELECT count(*) FROM v_delta") == [(0,)]
+    assert fetch_all(db, "SELECT count(*) FROM v WHERE rowid = 100") == [(0,)]
+
+
+def test_delta_size_zero(db):
+    # delta_size=0 is the default, inserts go to chunks right away
+    db.execute("create virtual table v using vec0(a float[2], chunk_size=8, delta_size=0)")
+    assert fetch_all(db, "SELECT count(*) FROM sqlite_master WHERE name LIKE '%delta%'") == [(0,)]
+    db.execute("INSERT INTO v(rowid, a) VALUES (1, '[1, 1]')")
+    assert fetch_all(db, "SELECT rowid, chunk_id FROM v_rowids") == [(1, 1)]
+    # hnsw columns only reject a buffer that is used
+    db.execute("create virtual table w using vec0(a float[2] indexed_by=hnsw, delta_size=0)")
+
+
+def test_delta_errors(db):
+    for sql, message in [
+        ("create virtual table v using vec0(a float[2], delta_size=x)", "delta_size must be a non-negative integer"),
+        ("create virtual table v using vec0(a float[2], chunk_size=8, delta_size=16)", "delta_size can't be larger than chunk_size"),
+        ("create virtual table v using vec0(a float[2] indexed_by=hnsw, delta_size=8)", "delta_size"),
+    ]:
+        with pytest.raises(sqlite3.OperationalError, match=message):
+            db.execute(sql)
+
+    db.execute("create virtual table v using vec0(a float[2], n integer, delta_size=8)")
+    with pytest.raises(sqlite3.OperationalError, match="Expected integer for INTEGER metadata column n"):
+        db.execute("INSERT INTO v(rowid, a, n) VALUES (2, '[1, 1]', 'x')")
+    assert fetch_all(db, "SELECT count(*) FROM v_delta") == [(0,)]
+
+    db.execute("INSERT INTO v(rowid, a, n) VALUES (1, '[1, 1]', 1)")
+    db.execute("ALTER TABLE v RENAME TO w")
+    assert fetch_all(db, "SELECT rowid, metadata00 FROM w_delta") == [(1, 1)]
+    db.execute("DROP TABLE w")
+    assert fetch_all(db, "SELECT count(*) FROM sqlite_master WHERE name LIKE '%delta%'") == [(0,)]
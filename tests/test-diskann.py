@@ -0,0 +1,189 @@
+import random
+
+import pytest
+from conftest import f32, knn_rowids, random_rows, recall, table_names
+
+
+def _info(db, key):
+    row = db.execute("select value from v_info where key = ?", [key]).fetchone()
+    return row[0] if row else None
+
+
+def test_diskann_parse(db):
+    for definition in [
+        "embedding float[4] indexed_by=diskann(r=1)",
+        "embedding float[4] indexed_by=diskann(r=1000)",
+        "embedding float[4] indexed_by=diskann(l_search=0)",
+        "embedding float[4] indexed_by=diskann(l=100000)",
+        "embedding float[4] indexed_by=diskann(pq=5)",
+        "embedding float[4] indexed_by=diskann(m=8)",
+        "embedding bit[8] indexed_by=diskann",
+    ]:
+        with pytest.raises(Exception, match="could not parse vector column"):
+            db.execute(f"CREATE VIRTUAL TABLE v USING vec0({definition})")
+
+    db.execute(
+        "CREATE VIRTUAL TABLE v USING vec0(a float[4] indexed_by=diskann, b float[4], c int8[4] indexed_by=diskann(r=8, l=32, l_search=16, pq=2))"
+    )
+    assert table_names(db, "v_diskann%") == [
+        "v_diskann_codes00",
+        "v_diskann_codes02",
+        "v_diskann_neighbors00",
+        "v_diskann_neighbors02",
+    ]
+
+    db.execute(
+        "INSERT INTO v(rowid, a, b, c) VALUES (1, ?, ?, vec_int8('[1,2,3,4]'))",
+        [f32([0] * 4), f32([0] * 4)],
+    )
+    with pytest.raises(Exception, match="ef_search is only supported"):
+        db.execute(
+            "SELECT rowid FROM v WHERE b MATCH ? AND k = 1 AND ef_search = 8",
+            [f32([0] * 4)],
+        ).fetchall()
+    assert [
+        row[0]
+        for row in db.execute(
+            "SELECT rowid FROM v WHERE c MATCH vec_int8('[1,2,3,3]') AND k = 1 AND ef_search = 4"
+        )
+    ] == [1]
+
+
+@pytest.mark.parametrize("metric", ["l2", "cosine", "l1"])
+def test_diskann_recall(db, metric):
+    db.execute(
+        f"CREATE VIRTUAL TABLE v USING vec0(embedding float[16] distance_metric={metric} indexed_by=diskann(r=16, l=48, pq=8), chunk_size=64)"
+    )
+    db.execute(
+        f"CREATE VIRTUAL TABLE brute USING vec0(embedding float[16] distance_metric={metric}, chunk_size=64)"
+    )
+    rows = random_rows(1000, 16)
+    db.executemany("INSERT INTO v(rowid, embedding) VALUES (?, ?)", rows)
+    db.executemany("INSERT INTO brute(rowid, embedding) VALUES (?, ?)", rows)
+    queries = [row[1] for row in random_rows(20, 16, seed=1)]
+
+    # navigates with full-precision vectors until optimize trains PQ codes
+    assert db.execute("select count(*) from v_diskann_codes00").fetchone()[0] == 0
+    assert recall(db, queries, 10) >= 0.9
+
+    db.execute("INSERT INTO v(v) VALUES ('optimize')")
+    assert len(_info(db, "DISKANN_CODEBOOK_00")) == 256 * 16 * 4
+    assert db.execute("select count(*) from v_diskann_codes00").fetchone()[0] > 0
+    assert recall(db, queries, 10) >= 0.9
+
+    # distances are re-ranked with full-precision vectors
+    expected = db.execute(
+        "SELECT rowid, distance FROM brute WHERE embedding MATCH ? AND k = 3 ORDER BY distance",
+        [queries[0]],
+    ).fetchall()
+    actual = db.execute(
+        "SELECT rowid, distance FROM v WHERE embedding MATCH ? AND k = 3 AND ef_search = 1000 ORDER BY distance",
+        [queries[0]],
+    ).fetchall()
+    assert [tuple(r) for r in actual] == [tuple(r) for r in expected]
+
+    assert knn_rowids(db, "v", rows[500][1], 1) == [501]
+    assert recall(db, queries, 10, ef_search=256) >= 0.97
+
+
+def test_diskann_filters(db):
+    for table, index in [("v", "indexed_by=diskann(r=16, pq=4)"), ("brute", "")]:
+        db.execute(
+            f"CREATE VIRTUAL TABLE {table} USING vec0(user int partition key, embedding float[8] {index}, category int, chunk_size=32)"
+        )
+    rnd = random.Random(2)
+    rows = [
+        (rowid, rowid % 3, vector, rnd.randrange(10))
+        for rowid, vector in random_rows(600, 8)
+    ]
+    for table in ["v", "brute"]:
+        db.executemany(
+            f"INSERT INTO {table}(rowid, user, embedding, category) VALUES (?, ?, ?, ?)",
+            rows,
+        )
+    db.execute("INSERT INTO v(v) VALUES ('optimize')")
+
+    queries = [row[1] for row in random_rows(10, 8, seed=3)]
+    assert recall(db, queries, 5, "AND category = 4") >= 0.9
+    assert recall(db, queries, 5, "AND category IN (1, 2)") >= 0.9
+    assert recall(db, queries, 5, "AND user = 2 AND category < 3") >= 0.9
+    assert recall(db, queries, 5, "AND rowid IN (1, 7, 99, 250, 251, 400, 599)") == 1.0
+    for query in queries:
+        for rowid in knn_rowids(db, "v", query, 5, "AND category = 4"):
+            assert rows[rowid - 1][3] == 4
+
+
+def test_diskann_maintained(db):
+    db.execute(
+        "CREATE VIRTUAL TABLE v USING vec0(embedding float[8] indexed_by=diskann(r=8, l=32, pq=4), chunk_size=16)"
+    )
+    db.execute("CREATE VIRTUAL TABLE brute USING vec0(embedding float[8], chunk_size=16)")
+    rows = random_rows(300, 8)
+    db.executemany("INSERT INTO v(rowid, embedding) VALUES (?, ?)", rows[:200])
+    db.execute("INSERT INTO v(v) VALUES ('optimize')")
+    # rows inserted after training get PQ codes right away
+    db.executemany("INSERT INTO v(rowid, embedding) VALUES (?, ?)", rows[200:])
+    db.executemany("INSERT INTO brute(rowid, embedding) VALUES (?, ?)", rows)
+
+    db.execute("DELETE FROM v WHERE rowid % 3 = 0")
+    db.execute("DELETE FROM brute WHERE rowid % 3 = 0")
+    medoid = _info(db, "DISKANN_MEDOID_00")
+    chunk_id, chunk_offset = divmod(medoid, 16)
+    assert db.execute(
+        "select count(*) from v_rowids where chunk_id = ? and chunk_offset = ?",
+        [chunk_id, chunk_offset],
+    ).fetchone()[0] == 1
+
+    queries = [row[1] for row in random_rows(10, 8, seed=4)]
+    assert recall(db, queries, 5) >= 0.9
+    for query in queries:
+        assert all(rowid % 3 != 0 for rowid in knn_rowids(db, "v", query, 10))
+
+    # updated vectors are re-linked
+    db.execute("UPDATE v SET embedding = ? WHERE rowid = 1", [f32([50] * 8)])
+    db.execute("UPDATE brute SET embedding = ? WHERE rowid = 1", [f32([50] * 8)])
+    assert knn_rowids(db, "v", f32([49] * 8), 1) == [1]
+
+    # deleted slots are reused by new rows
+    db.execute("INSERT INTO v(rowid, embedding) VALUES (1000, ?)", [queries[0]])
+    assert knn_rowids(db, "v", queries[0], 1) == [1000]
+    db.execute("DELETE FROM v WHERE rowid = 1000")
+
+    db.execute("INSERT INTO v(v) VALUES ('optimize')")
+    assert recall(db, queries, 5) >= 0.9
+
+    db.execute("DELETE FROM v")
+    assert _info(db, "DISKANN_MEDOID_00") == -1
+    assert knn_rowids(db, "v", queries[0], 5) == []
+    db.execute("INSERT INTO v(rowid, embedding) VALUES (7, ?)", [queries[0]])
+    assert knn_rowids(db, "v", queries[0], 5) == [7]
+
+
+def test_diskann_rollback(db):
+    db.execute("CREATE VIRTUAL TABLE v USING vec0(embedding float[2] indexed_by=diskann)")
+    db.executemany(
+        "INSERT INTO v(rowid, embedding) VALUES (?, ?)",
+        [(1, "[0, 0]"), (2, "[10, 10]")],
+    )
+    db.commit()
+    db.execute("BEGIN")
+    db.execute("INSERT INTO v(rowid, embedding) VALUES (3, '[1, 1]')")
+    db.execute("INSERT INTO v(v) VALUES ('optimize')")
+    db.execute("DELETE FROM v WHERE rowid = 1")
+    assert knn_rowids(db, "v", "[0, 0]", 3) == [3, 2]
+    db.execute("ROLLBACK")
+    assert _info(db, "DISKANN_CODEBOOK_00") is None
+    assert knn_rowids(db, "v", "[0, 0]", 3) == [1, 2]
+
+
+def test_diskann_rename_and_drop(db):
+    db.execute("CREATE VIRTUAL TABLE v USING vec0(embedding float[2] indexed_by=diskann)")
+    db.executemany(
+        "INSERT INTO v(rowid, embedding) VALUES (?, ?)",
+        [(1, "[0, 0]"), (2, "[10, 10]")],
+    )
+    db.execute("ALTER TABLE v RENAME TO v2")
+    assert table_names(db, "%diskann%") == ["v2_diskann_codes00", "v2_diskann_neighbors00"]
+    assert knn_rowids(db, "v2", "[9, 9]", 1) == [2]
+    db.execute("DROP TABLE v2")
+    assert table_names(db, "%diskann%") == []
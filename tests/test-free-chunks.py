@@ -0,0 +1,151 @@
+import sqlite3
+
+
+def _position(db, rowid):
+    return tuple(
+        db.execute(
+            "SELECT chunk_id, chunk_offset FROM v_rowids WHERE rowid = ?", [rowid]
+        ).fetchone()
+    )
+
+
+def _free_chunks(db, name="v"):
+    return [tuple(row) for row in db.execute(f"SELECT * FROM {name}_free_chunks ORDER BY 1").fetchall()]
+
+
+def _insert(db, rowids, p=None):
+    if p is None:
+        db.executemany("INSERT INTO v(rowid, a) VALUES (?, '[1]')", [(i,) for i in rowids])
+    else:
+        db.executemany("INSERT INTO v(rowid, p, a) VALUES (?, ?, '[1]')", [(i, p) for i in rowids])
+
+
+def test_free_chunks_fullest_first(db):
+    db.execute("create virtual table v using vec0(a float[1], chunk_size=8)")
+    _insert(db, range(1, 25))
+    db.commit()
+    assert _free_chunks(db) == []
+
+    db.execute("DELETE FROM v WHERE rowid IN (1, 2, 3, 9)")
+    db.commit()
+    assert _free_chunks(db) == [(1, 3), (2, 1)]
+
+    # holes are filled in the fullest chunk first, then the next fullest
+    _insert(db, [100, 101])
+    db.commit()
+    assert _position(db, 100) == (2, 0)
+    assert _position(db, 101) == (1, 0)
+    # inserts only write the count back once the chunk is full
+    assert _free_chunks(db) == [(1, 3)]
+
+    # and a new chunk only once none is left
+    _insert(db, [102, 103, 104])
+    db.commit()
+    assert _position(db, 103) == (1, 2)
+    assert _position(db, 104) == (4, 0)
+    assert _free_chunks(db) == [(4, 8)]
+
+    def authorizer(action, arg1, *_):
+        if action in (sqlite3.SQLITE_INSERT, sqlite3.SQLITE_UPDATE) and arg1 == "v_free_chunks":
+            return sqlite3.SQLITE_DENY
+        return sqlite3.SQLITE_OK
+
+    db.set_authorizer(authorizer)
+    _insert(db, [105])
+    db.commit()
+    db.set_authorizer(None)
+    assert _position(db, 105) == (4, 1)
+
+
+def test_free_chunks_churn(db):
+    db.execute("create virtual table v using vec0(p int partition key, a float[1], chunk_size=8)")
+    for p in range(2):
+        _insert(db, range(1 + p * 1000, 41 + p * 1000), p)
+    db.commit()
+    chunks = db.execute("SELECT count(*) FROM v_chunks").fetchone()[0]
+
+    # expired rows are deleted and as many inserted, without an optimize
+    rowid = 100
+    for _ in range(30):
+        for p in range(2):
+            db.execute(
+                "DELETE FROM v WHERE rowid IN (SELECT rowid FROM v WHERE p = ? ORDER BY rowid LIMIT 5)",
+                [p],
+            )
+            _insert(db, range(rowid + p * 1000, rowid + p * 1000 + 5), p)
+        rowid += 5
+        db.commit()
+    assert db.execute("SELECT count(*) FROM v").fetchone()[0] == 80
+    assert db.execute("SELECT count(*) FROM v_chunks").fetchone()[0] == chunks
+
+    # partitions only fill their own chunks
+    assert (
+        db.execute(
+            "SELECT count(*) FROM v_rowids AS r JOIN v_chunks AS c USING (chunk_id) WHERE c.partition00 != (r.rowid >= 1000)"
+        ).fetchone()[0]
+        == 0
+    )
+
+
+def test_free_chunks_rollback(db):
+    db.execute("create virtual table v using vec0(a float[1], chunk_size=8)")
+    _insert(db, range(1, 17))
+    db.commit()
+    before = _free_chunks(db)
+    db.execute("SAVEPOINT a")
+    db.execute("DELETE FROM v WHERE rowid < 5")
+    db.execute("ROLLBACK TO a")
+    db.execute("RELEASE a")
+    db.commit()
+    assert _free_chunks(db) == before
+    _insert(db, [100])
+    db.commit()
+    assert _position(db, 100) == (3, 0)
+
+
+def test_free_chunks_old_tables(tmp_path):
+    path = str(tmp_path / "test.db")
+    db = sqlite3.connect(path)
+    db.enable_load_extension(True)
+    db.load_extension("dist/vec0")
+    db.execute("create virtual table v using vec0(a float[1], chunk_size=8)")
+    _insert(db, range(1, 17))
+    db.commit()
+    db.execute("DROP TABLE v_free_chunks")
+    db.commit()
+    db.close()
+
+    # tables created before _free_chunks fill their latest chunk, as before
+    db = sqlite3.connect(path)
+    db.enable_load_extension(True)
+    db.load_extension("dist/vec0")
+    db.execute("DELETE FROM v WHERE rowid < 5")
+    _insert(db, [100])
+    db.commit()
+    assert _position(db, 100) == (3, 0)
+
+    # until optimize creates it
+    db.execute("INSERT INTO v(v) VALUES ('optimize')")
+    db.commit()
+    assert _free_chunks(db) == [(5, 3)]
+    db.execute("DELETE FROM v WHERE rowid = 5")
+    _insert(db, [101])
+    db.commit()
+    assert _free_chunks(db) == [(5, 3)]
+    db.close()
+
+
+def test_free_chunks_rename(db):
+    db.execute("create virtual table v using vec0(p int partition key, a float[1], chunk_size=8)")
+    _insert(db, range(1, 9), 0)
+    db.execute("ALTER TABLE v RENAME TO w")
+    db.execute("DELETE FROM w WHERE rowid = 1")
+    db.commit()
+    assert _free_chunks(db, "w") == [(1, 1, 0)]
+    db.execute("DROP TABLE w")
+    assert (
+        db.execute(
+            "SELECT count(*) FROM sqlite_master WHERE name LIKE '%free_chunks%'"
+        ).fetchone()[0]
+        == 0
+    )
@@ -0,0 +1,176 @@
+import random
+
+import pytest
+from conftest import f32, knn_rowids, random_rows, recall, table_names
+
+
+def test_hnsw_parse(db):
+    for definition in [
+        "embedding float[4] indexed_by=hnsw(m=1)",
+        "embedding float[4] indexed_by=hnsw(m=1000)",
+        "embedding float[4] indexed_by=hnsw(ef_search=0)",
+        "embedding float[4] indexed_by=hnsw(ef_construction=100000)",
+        "embedding float[4] indexed_by=hnsw(nlist=8)",
+    ]:
+        with pytest.raises(Exception, match="could not parse vector column"):
+            db.execute(f"CREATE VIRTUAL TABLE v USING vec0({definition})")
+
+    db.execute(
+        "CREATE VIRTUAL TABLE v USING vec0(a float[4] indexed_by=hnsw, b float[4], c bit[8] indexed_by=hnsw(m=8, ef_construction=32, ef_search=16))"
+    )
+    assert table_names(db, "v_hnsw%") == ["v_hnsw_nodes00", "v_hnsw_nodes02"]
+
+    with pytest.raises(Exception, match='hidden "ef_search" column'):
+        db.execute(
+            "INSERT INTO v(rowid, a, b, c, ef_search) VALUES (1, ?, ?, vec_bit(X'ff'), 2)",
+            [f32([0] * 4), f32([0] * 4)],
+        )
+
+    db.execute(
+        "INSERT INTO v(rowid, a, b, c) VALUES (1, ?, ?, vec_bit(X'ff'))",
+        [f32([0] * 4), f32([0] * 4)],
+    )
+    with pytest.raises(Exception, match="ef_search is only supported"):
+        db.execute(
+            "SELECT rowid FROM v WHERE b MATCH ? AND k = 1 AND ef_search = 8",
+            [f32([0] * 4)],
+        ).fetchall()
+    with pytest.raises(
+        Exception, match="ef_search value in knn query must be greater than 0"
+    ):
+        db.execute(
+            "SELECT rowid FROM v WHERE a MATCH ? AND k = 1 AND ef_search = 0",
+            [f32([0] * 4)],
+        ).fetchall()
+    assert [
+        row[0]
+        for row in db.execute(
+            "SELECT rowid FROM v WHERE c MATCH vec_bit(X'f0') AND k = 1"
+        )
+    ] == [1]
+
+
+@pytest.mark.parametrize("metric", ["l2", "cosine"])
+def test_hnsw_recall(db, metric):
+    db.execute(
+        f"CREATE VIRTUAL TABLE v USING vec0(embedding float[16] distance_metric={metric} indexed_by=hnsw(m=8, ef_construction=64), chunk_size=64)"
+    )
+    db.execute(
+        f"CREATE VIRTUAL TABLE brute USING vec0(embedding float[16] distance_metric={metric}, chunk_size=64)"
+    )
+    rows = random_rows(1000, 16)
+    db.executemany("INSERT INTO v(rowid, embedding) VALUES (?, ?)", rows)
+    db.executemany("INSERT INTO brute(rowid, embedding) VALUES (?, ?)", rows)
+    assert db.execute("select count(*) from v_hnsw_nodes00").fetchone()[0] == 1000
+
+    queries = [row[1] for row in random_rows(20, 16, seed=1)]
+    assert recall(db, queries, 10) >= 0.9
+
+    # an exact match is always found
+    assert knn_rowids(db, "v", rows[500][1], 1) == [501]
+
+    # a larger ef_search only improves results
+    assert recall(db, queries, 10, ef_search=512) >= 0.97
+
+
+def test_hnsw_filters(db):
+    for table, index in [("v", "indexed_by=hnsw(m=8)"), ("brute", "")]:
+        db.execute(
+            f"CREATE VIRTUAL TABLE {table} USING vec0(user int partition key, embedding float[8] {index}, category int, chunk_size=32)"
+        )
+    rnd = random.Random(2)
+    rows = [
+        (rowid, rowid % 3, vector, rnd.randrange(10))
+        for rowid, vector in random_rows(600, 8)
+    ]
+    for table in ["v", "brute"]:
+        db.executemany(
+            f"INSERT INTO {table}(rowid, user, embedding, category) VALUES (?, ?, ?, ?)",
+            rows,
+        )
+
+    queries = [row[1] for row in random_rows(10, 8, seed=3)]
+    # even selective filters are met, as the traversal expands past rows that
+    # don't match
+    assert recall(db, queries, 5, "AND category = 4") >= 0.9
+    assert recall(db, queries, 5, "AND category IN (1, 2)") >= 0.9
+    assert recall(db, queries, 5, "AND user = 2 AND category < 3") >= 0.9
+    assert recall(db, queries, 5, "AND rowid IN (1, 7, 99, 250, 251, 400, 599)") == 1.0
+    for query in queries:
+        for rowid in knn_rowids(db, "v", query, 5, "AND category = 4"):
+            assert rows[rowid - 1][3] == 4
+
+    distance = db.execute(
+        "SELECT distance FROM brute WHERE embedding MATCH ? AND k = 5 ORDER BY distance",
+        [queries[0]],
+    ).fetchall()[2][0]
+    assert knn_rowids(db, "v", queries[0], 3, "AND distance > ?", [distance]) == knn_rowids(
+        db, "brute", queries[0], 3, "AND distance > ?", [distance]
+    )
+
+
+def test_hnsw_maintained(db):
+    db.execute(
+        "CREATE VIRTUAL TABLE v USING vec0(embedding float[8] indexed_by=hnsw(m=4, ef_construction=32), chunk_size=16)"
+    )
+    db.execute("CREATE VIRTUAL TABLE brute USING vec0(embedding float[8], chunk_size=16)")
+    rows = random_rows(300, 8)
+    db.executemany("INSERT INTO v(rowid, embedding) VALUES (?, ?)", rows)
+    db.executemany("INSERT INTO brute(rowid, embedding) VALUES (?, ?)", rows)
+
+    db.execute("DELETE FROM v WHERE rowid % 3 = 0")
+    db.execute("DELETE FROM brute WHERE rowid % 3 = 0")
+    assert db.execute("select count(*) from v_hnsw_nodes00").fetchone()[0] == 200
+    entrypoint = db.execute(
+        "select value from v_info where key = 'HNSW_ENTRYPOINT_00'"
+    ).fetchone()[0]
+    assert entrypoint % 3 != 0
+
+    queries = [row[1] for row in random_rows(10, 8, seed=4)]
+    assert recall(db, queries, 5) >= 0.9
+    for query in queries:
+        assert all(rowid % 3 != 0 for rowid in knn_rowids(db, "v", query, 10))
+
+    # updated vectors are re-linked
+    db.execute("UPDATE v SET embedding = ? WHERE rowid = 1", [f32([50] * 8)])
+    assert knn_rowids(db, "v", f32([49] * 8), 1) == [1]
+
+    # optimize moves rows to other chunks, which cached nodes must pick up
+    db.execute("INSERT INTO v(v) VALUES ('optimize')")
+    db.execute("INSERT INTO brute(brute) VALUES ('optimize')")
+    db.execute("UPDATE brute SET embedding = ? WHERE rowid = 1", [f32([50] * 8)])
+    assert recall(db, queries, 5) >= 0.9
+
+    db.execute("DELETE FROM v")
+    assert db.execute("select count(*) from v_hnsw_nodes00").fetchone()[0] == 0
+    assert knn_rowids(db, "v", queries[0], 5) == []
+    db.execute("INSERT INTO v(rowid, embedding) VALUES (7, ?)", [queries[0]])
+    assert knn_rowids(db, "v", queries[0], 5) == [7]
+
+
+def test_hnsw_rollback(db):
+    db.execute("CREATE VIRTUAL TABLE v USING vec0(embedding float[2] indexed_by=hnsw)")
+    db.executemany(
+        "INSERT INTO v(rowid, embedding) VALUES (?, ?)",
+        [(1, "[0, 0]"), (2, "[10, 10]")],
+    )
+    db.commit()
+    db.execute("BEGIN")
+    db.execute("INSERT INTO v(rowid, embedding) VALUES (3, '[1, 1]')")
+    db.execute("DELETE FROM v WHERE rowid = 1")
+    assert knn_rowids(db, "v", "[0, 0]", 3) == [3, 2]
+    db.execute("ROLLBACK")
+    assert knn_rowids(db, "v", "[0, 0]", 3) == [1, 2]
+
+
+def test_hnsw_rename_and_drop(db):
+    db.execute("CREATE VIRTUAL TABLE v USING vec0(embedding float[2] indexed_by=hnsw)")
+    db.executemany(
+        "INSERT INTO v(rowid, embedding) VALUES (?, ?)",
+        [(1, "[0, 0]"), (2, "[10, 10]")],
+    )
+    db.execute("ALTER TABLE v RENAME TO v2")
+    assert table_names(db, "%hnsw%") == ["v2_hnsw_nodes00"]
+    assert knn_rowids(db, "v2", "[9, 9]", 1) == [2]
+    db.execute("DROP TABLE v2")
+    assert table_names(db, "%hnsw%") == []
@@ -0,0 +1,174 @@
+import sqlite3
+import struct
+
+import pytest
+from conftest import f32, fetch_all
+
+
+def _vectors(n, dims):
+    return [[(i * dims + j) / 8 for j in range(dims)] for i in range(n)]
+
+
+def _raw(vectors, fmt="f"):
+    return b"".join(struct.pack(f"<{len(v)}{fmt}", *v) for v in vectors)
+
+
+def _npy(vectors):
+    header = "{'descr': '<f4', 'fortran_order': False, 'shape': (%d, %d), }" % (
+        len(vectors),
+        len(vectors[0]),
+    )
+    header += " " * (63 - (10 + len(header)) % 64) + "\n"
+    return b"\x93NUMPY\x01\x00" + struct.pack("<H", len(header)) + header.encode() + _raw(vectors)
+
+
+def _vecs(vectors, fmt):
+    return b"".join(struct.pack("<i", len(v)) + struct.pack(f"<{len(v)}{fmt}", *v) for v in vectors)
+
+
+def _check(db, vectors, rowids, where="1"):
+    assert fetch_all(db, f"SELECT rowid, vec_to_json(a) FROM v WHERE {where} ORDER BY rowid") == [
+        (rowid, db.execute("SELECT vec_to_json(?)", [f32(v)]).fetchone()[0])
+        for rowid, v in zip(rowids, vectors)
+    ]
+
+
+def test_import_formats(db, tmp_path):
+    db.execute("create virtual table v using vec0(a float[3], chunk_size=8)")
+    vectors = _vectors(20, 3)
+
+    path = tmp_path / "a.npy"
+    path.write_bytes(_npy(vectors))
+    db.execute("INSERT INTO v(v, a) VALUES ('import', ?)", [str(path)])
+    _check(db, vectors, range(1, 21))
+    assert db.execute("SELECT count(*) FROM v_chunks").fetchone()[0] == 3
+
+    # rowids from the given one, after the rows already there
+    path = tmp_path / "b.fvecs"
+    path.write_bytes(_vecs(vectors[:5], "f"))
+    db.execute("INSERT INTO v(v, rowid, a) VALUES ('import', 100, ?)", [str(path)])
+    path = tmp_path / "c.ivecs"
+    path.write_bytes(_vecs([[int(x) for x in v] for v in vectors[:2]], "i"))
+    db.execute("INSERT INTO v(v, a) VALUES ('import', ?)", [str(path)])
+    path = tmp_path / "d.BVECS"
+    path.write_bytes(_vecs([[int(x) for x in v] for v in vectors[:2]], "B"))
+    db.execute("INSERT INTO v(v, a) VALUES ('import', ?)", [str(path)])
+    path = tmp_path / "e.bin"
+    path.write_bytes(_raw(vectors[:3]))
+    db.execute("INSERT INTO v(v, rowid, a) VALUES ('import', 200, ?)", [str(path)])
+    # the format can be given for other extensions
+    path = tmp_path / "f.dat"
+    path.write_bytes(_vecs(vectors[:1], "f"))
+    db.execute("INSERT INTO v(v, rowid, a) VALUES ('import:fvecs', 300, ?)", [str(path)])
+    db.commit()
+
+    _check(
+        db,
+        [
+            *vectors,
+            *vectors[:5],
+            *[[int(x) for x in v] for v in vectors[:2]],
+            *[[int(x) for x in v] for v in vectors[:2]],
+            *vectors[:3],
+            *vectors[:1],
+        ],
+        [*range(1, 21), *range(100, 105), 105, 106, 107, 108, 200, 201, 202, 300],
+    )
+    assert db.execute("SELECT rowid FROM v WHERE a MATCH ? AND k = 1", [f32(vectors[7])]).fetchone()[0] == 8
+
+
+def test_import_columns(db, tmp_path):
+    db.execute(
+        "create virtual table v using vec0(p text partition key, a float[2], b int8[2], n integer, +aux text, chunk_size=8)"
+    )
+    vectors = _vectors(10, 2)
+    path = tmp_path / "a.npy"
+    path.write_bytes(_npy(vectors))
+    raw = tmp_path / "b.raw"
+    raw.write_bytes(_raw([[1, -2]] * 3, "b"))
+
+    # every row gets the other values of the INSERT
+    db.execute(
+        "INSERT INTO v(v, p, a, b, n, aux) VALUES ('import', 'x', ?, vec_int8('[1, 2]'), 7, 'hello')",
+        [str(path)],
+    )
+    db.execute(
+        "INSERT INTO v(v, rowid, p, a, b, n) VALUES ('import', 50, 'y', ?, ?, 8)",
+        [f32(vectors[0]), str(raw)],
+    )
+    db.commit()
+    assert fetch_all(db, "SELECT p, n, aux, vec_to_json(vec_int8(b)), count(*) FROM v GROUP BY 1, 2, 3, 4") == [
+        ("x", 7, "hello", "[1,2]", 10),
+        ("y", 8, None, "[1,-2]", 3),
+    ]
+    _check(db, vectors, range(1, 11), "p = 'x'")
+    assert fetch_all(db, "SELECT rowid FROM v WHERE rowid >= 50") == [(50,), (51,), (52,)]
+    assert fetch_all(db, "SELECT DISTINCT partition00 FROM v_chunks ORDER BY 1") == [("x",), ("y",)]
+    assert db.execute("SELECT rowid FROM v WHERE a MATCH ? AND k = 1 AND p = 'x' AND n = 7", [f32(vectors[4])]).fetchone()[0] == 5
+
+
+def test_import_bulk(db, tmp_path):
+    db.execute("create virtual table v using vec0(a float[2], chunk_size=8)")
+    vectors = _vectors(12, 2)
+    path = tmp_path / "a.npy"
+    path.write_bytes(_npy(vectors))
+
+    # inside a bulk load, rows stay buffered like other inserts
+    db.execute("INSERT INTO v(v) VALUES ('bulk-begin')")
+    db.execute("INSERT INTO v(rowid, a) VALUES (100, '[1, 1]')")
+    db.execute("INSERT INTO v(v, a) VALUES ('import', ?)", [str(path)])
+    db.execute("INSERT INTO v(v) VALUES ('bulk-end')")
+    db.commit()
+    assert db.execute("SELECT count(*) FROM v").fetchone()[0] == 13
+    assert fetch_all(db, "SELECT chunk_id, count(*) FROM v_rowids GROUP BY 1") == [(1, 8), (2, 5)]
+    _check(db, [[1, 1], *vectors], range(100, 113))
+
+    # like a failed INSERT ... SELECT, a failed import keeps the rows before
+    # the error
+    path.write_bytes(_vecs(vectors, "f"))
+    with pytest.raises(sqlite3.OperationalError, match="UNIQUE constraint failed on v primary key"):
+        db.execute("INSERT INTO v(v, rowid, a) VALUES ('import:fvecs', 90, ?)", [str(path)])
+    db.commit()
+    _check(db, vectors[:10], range(90, 100), "rowid < 100")
+    assert db.execute("SELECT count(*) FROM v").fetchone()[0] == 23
+
+
+def test_import_errors(db, tmp_path):
+    db.execute("create virtual table v using vec0(a float[3], b float[3])")
+    vectors = _vectors(4, 3)
+    npy = tmp_path / "a.npy"
+    npy.write_bytes(_npy(vectors))
+    wrong = tmp_path / "b.npy"
+    wrong.write_bytes(_npy(_vectors(4, 2)))
+    fvecs = tmp_path / "c.fvecs"
+    fvecs.write_bytes(_vecs(vectors[:2], "f") + _vecs(_vectors(1, 2), "f") + _vecs(vectors[2:], "f"))
+    partial = tmp_path / "d.bin"
+    partial.write_bytes(_raw(vectors)[:-1])
+    bits = tmp_path / "e.bvecs"
+    bits.write_bytes(b"\x01\x00\x00\x00\x01")
+
+    for sql, params, message in [
+        ("INSERT INTO v(v) VALUES ('import')", [], "'import' needs the path of the file to read"),
+        ("INSERT INTO v(v, a, b) VALUES ('import', ?, ?)", [str(npy), str(npy)], "several were given a file path"),
+        ("INSERT INTO v(v, a, b) VALUES ('import:csv', ?, ?)", [str(npy), f32(vectors[0])], "Unknown 'import' format 'csv'"),
+        ("INSERT INTO v(v, rowid, a) VALUES ('import', 'x', ?)", [str(npy)], "must be an integer"),
+        ("INSERT INTO v(v, a, b) VALUES ('import', ?, ?)", [str(tmp_path / "missing.npy"), f32(vectors[0])], "Could not open"),
+        ("INSERT INTO v(v, a, b) VALUES ('import', ?, ?)", [str(wrong), f32(vectors[0])], "Expected 3 dimensions but '.*' has 2"),
+        ("INSERT INTO v(v, a, b) VALUES ('import', ?, ?)", [str(fvecs), f32(vectors[0])], "imported vector 2 .* Expected 3 dimensions but received 2"),
+        ("INSERT INTO v(v, a, b) VALUES ('import', ?, ?)", [str(partial), f32(vectors[0])], "ends in the middle of vector 3"),
+        ("INSERT INTO v(v, a, b) VALUES ('import:npy', ?, ?)", [str(fvecs), f32(vectors[0])], "is not a numpy array file"),
+        # the other vector columns are inserted as usual
+        ("INSERT INTO v(v, a) VALUES ('import', ?)", [str(npy)], 'Inserted vector for the "b" column is invalid'),
+    ]:
+        with pytest.raises(sqlite3.OperationalError, match=message):
+            db.execute(sql, params)
+    # only the vectors before the bad one in the last two files
+    assert db.execute("SELECT count(*) FROM v").fetchone()[0] == 5
+
+    db.execute("create virtual table u using vec0(a float[3], c bit[8])")
+    with pytest.raises(sqlite3.OperationalError, match="Only float32 vector columns can be imported from bvecs files"):
+        db.execute("INSERT INTO u(u, a, c) VALUES ('import', ?, ?)", [f32(vectors[0]), str(bits)])
+
+    db.execute("create virtual table t using vec0(id text primary key, a float[3])")
+    with pytest.raises(sqlite3.OperationalError, match="'import' needs an integer primary key"):
+        db.execute("INSERT INTO t(t, a) VALUES ('import', ?)", [str(npy)])
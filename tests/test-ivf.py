@@ -0,0 +1,192 @@
+import json
+import random
+import struct
+
+import pytest
+from conftest import f32, table_names
+
+
+def _knn(db, table, query, k, nprobe=None):
+    sql = f"SELECT rowid, distance FROM {table} WHERE embedding MATCH ? AND k = ?"
+    params = [query, k]
+    if nprobe is not None:
+        sql += " AND nprobe = ?"
+        params.append(nprobe)
+    return [
+        (row["rowid"], row["distance"])
+        for row in db.execute(sql + " ORDER BY distance", params).fetchall()
+    ]
+
+
+def _clustered_rows(n, dims, clusters, seed=0):
+    rnd = random.Random(seed)
+    centers = [[rnd.uniform(-100, 100) for _ in range(dims)] for _ in range(clusters)]
+    rows = []
+    for i in range(n):
+        # rows of a cluster are spread over every chunk, until optimize
+        center = centers[i % clusters]
+        rows.append((i + 1, f32([c + rnd.uniform(-1, 1) for c in center])))
+    return rows
+
+
+def test_ivf_parse(db):
+    for definition in [
+        "embedding float[4] indexed_by=ivf(nlist=0)",
+        "embedding float[4] indexed_by=ivf(nlist=a)",
+        "embedding float[4] indexed_by=ivf(nlist=8 nprobe=2)",
+        "embedding float[4] indexed_by=ivf(bogus=8)",
+        "embedding float[4] indexed_by=ivf(nlist=100000)",
+        "embedding float[4] indexed_by=annoy",
+        "embedding bit[8] indexed_by=ivf",
+    ]:
+        with pytest.raises(Exception, match="could not parse vector column"):
+            db.execute(f"CREATE VIRTUAL TABLE v USING vec0({definition})")
+
+    db.execute(
+        "CREATE VIRTUAL TABLE v USING vec0(a float[4] indexed_by=ivf(nlist=4, nprobe=2), b float[4] indexed_by=flat, c int8[4] indexed_by=ivf)"
+    )
+    assert table_names(db, "v_ivf%") == [
+        "v_ivf_centroids00",
+        "v_ivf_centroids02",
+        "v_ivf_lists00",
+        "v_ivf_lists02",
+    ]
+
+    with pytest.raises(Exception, match='hidden "nprobe" column'):
+        db.execute("INSERT INTO v(rowid, a, b, c, nprobe) VALUES (1, ?, ?, vec_int8('[1,2,3,4]'), 2)", [f32([0] * 4), f32([0] * 4)])
+
+    db.execute("INSERT INTO v(rowid, a, b, c) VALUES (1, ?, ?, vec_int8('[1,2,3,4]'))", [f32([0] * 4), f32([0] * 4)])
+    with pytest.raises(Exception, match="nprobe is only supported"):
+        db.execute("SELECT rowid FROM v WHERE b MATCH ? AND k = 1 AND nprobe = 1", [f32([0] * 4)]).fetchall()
+    with pytest.raises(Exception, match="nprobe value in knn query must be greater than 0"):
+        db.execute("SELECT rowid FROM v WHERE a MATCH ? AND k = 1 AND nprobe = 0", [f32([0] * 4)]).fetchall()
+
+
+def test_ivf_untrained_is_exact(db):
+    db.execute(
+        "CREATE VIRTUAL TABLE v USING vec0(embedding float[4] indexed_by=ivf(nlist=4, nprobe=1), chunk_size=8)"
+    )
+    db.execute("CREATE VIRTUAL TABLE brute USING vec0(embedding float[4], chunk_size=8)")
+    rows = _clustered_rows(100, 4, 4)
+    db.executemany("INSERT INTO v(rowid, embedding) VALUES (?, ?)", rows)
+    db.executemany("INSERT INTO brute(rowid, embedding) VALUES (?, ?)", rows)
+    assert db.execute("select count(*) from v_ivf_lists00").fetchone()[0] == 0
+
+    query = f32([1, 2, 3, 4])
+    assert _knn(db, "v", query, 10) == _knn(db, "brute", query, 10)
+
+
+@pytest.mark.parametrize("metric", ["l2", "cosine"])
+def test_ivf_trained(db, metric):
+    db.execute(
+        f"CREATE VIRTUAL TABLE v USING vec0(embedding float[4] distance_metric={metric} indexed_by=ivf(nlist=4, nprobe=1), chunk_size=8)"
+    )
+    db.execute(
+        f"CREATE VIRTUAL TABLE brute USING vec0(embedding float[4] distance_metric={metric}, chunk_size=8)"
+    )
+    rows = _clustered_rows(200, 4, 4)
+    db.executemany("INSERT INTO v(rowid, embedding) VALUES (?, ?)", rows)
+    db.executemany("INSERT INTO brute(rowid, embedding) VALUES (?, ?)", rows)
+
+    db.execute("INSERT INTO v(v) VALUES ('optimize')")
+    assert db.execute("select count(*) from v_ivf_centroids00").fetchone()[0] == 4
+    assert db.execute("select count(*) from v_ivf_lists00").fetchone()[0] == 200
+    assert (
+        db.execute("select value from v_info where key = 'IVF_GENERATION_00'").fetchone()[0]
+        == 1
+    )
+
+    # optimize stores each list in its own run of chunks
+    chunks_per_list = db.execute(
+        """
+        select l.list_id, count(distinct r.chunk_id)
+        from v_ivf_lists00 l join v_rowids r on r.rowid = l.rowid
+        group by 1
+        """
+    ).fetchall()
+    for list_id, n_chunks in chunks_per_list:
+        n_rows = db.execute(
+            "select count(*) from v_ivf_lists00 where list_id = ?", [list_id]
+        ).fetchone()[0]
+        assert n_chunks <= (n_rows + 7) // 8 + 1
+
+    rnd = random.Random(1)
+    for _ in range(10):
+        center = rows[rnd.randrange(len(rows))][1]
+        query = f32([x + rnd.uniform(-0.5, 0.5) for x in struct.unpack("4f", center)])
+        expected = _knn(db, "brute", query, 5)
+        # every neighbor lives in the nearest list of well separated clusters
+        assert [r for r, _ in _knn(db, "v", query, 5)] == [r for r, _ in expected]
+        # probing every list is an exact scan
+        assert _knn(db, "v", query, 5, nprobe=4) == expected
+
+
+def test_ivf_maintained(db):
+    db.execute(
+        "CREATE VIRTUAL TABLE v USING vec0(embedding float[2] indexed_by=ivf(nlist=2, nprobe=1))"
+    )
+    db.executemany(
+        "INSERT INTO v(rowid, embedding) VALUES (?, ?)",
+        [(1, "[0, 0]"), (2, "[0, 1]"), (3, "[100, 100]"), (4, "[100, 101]")],
+    )
+    db.execute("INSERT INTO v(v) VALUES ('optimize')")
+
+    def list_of(rowid):
+        return db.execute(
+            "select list_id from v_ivf_lists00 where rowid = ?", [rowid]
+        ).fetchone()[0]
+
+    assert list_of(1) == list_of(2)
+    assert list_of(3) == list_of(4)
+    assert list_of(1) != list_of(3)
+
+    # new rows are assigned to their nearest list
+    db.execute("INSERT INTO v(rowid, embedding) VALUES (5, '[99, 99]')")
+    assert list_of(5) == list_of(3)
+    assert [r for r, _ in _knn(db, "v", "[100, 100]", 3)] == [3, 4, 5]
+    assert [r for r, _ in _knn(db, "v", "[0, 0]", 3)] == [1, 2]
+
+    # updated vectors move lists
+    db.execute("UPDATE v SET embedding = '[1, 1]' WHERE rowid = 5")
+    assert list_of(5) == list_of(1)
+    assert [r for r, _ in _knn(db, "v", "[0, 0]", 3)] == [1, 2, 5]
+
+    db.execute("DELETE FROM v WHERE rowid = 5")
+    assert db.execute("select count(*) from v_ivf_lists00").fetchone()[0] == 4
+    assert [r for r, _ in _knn(db, "v", "[0, 0]", 3)] == [1, 2]
+
+
+def test_ivf_rollback_discards_centroids(db):
+    db.execute(
+        "CREATE VIRTUAL TABLE v USING vec0(embedding float[2] indexed_by=ivf(nlist=2, nprobe=1))"
+    )
+    db.executemany(
+        "INSERT INTO v(rowid, embedding) VALUES (?, ?)",
+        [(1, "[0, 0]"), (2, "[100, 100]")],
+    )
+    db.commit()
+    db.execute("BEGIN")
+    db.execute("INSERT INTO v(v) VALUES ('optimize')")
+    assert len(_knn(db, "v", "[0, 0]", 2)) == 1
+    db.execute("ROLLBACK")
+    # untrained again, so an exact scan
+    assert [r for r, _ in _knn(db, "v", "[0, 0]", 2)] == [1, 2]
+
+
+def test_ivf_rename_and_drop(db):
+    db.execute(
+        "CREATE VIRTUAL TABLE v USING vec0(embedding float[2] indexed_by=ivf(nlist=2, nprobe=1))"
+    )
+    db.executemany(
+        "INSERT INTO v(rowid, embedding) VALUES (?, ?)",
+        [(1, "[0, 0]"), (2, "[100, 100]")],
+    )
+    db.execute("INSERT INTO v(v) VALUES ('optimize')")
+    db.execute("ALTER TABLE v RENAME TO v2")
+    assert table_names(db, "%ivf%") == [
+        "v2_ivf_centroids00",
+        "v2_ivf_lists00",
+    ]
+    assert [r for r, _ in _knn(db, "v2", "[100, 100]", 2)] == [2]
+    db.execute("DROP TABLE v2")
+    assert table_names(db, "%ivf%") == []
@@ -0,0 +1,109 @@
+import sqlite3
+
+import pytest
+from conftest import f32
+
+
+def _fill(db, n):
+    db.executemany(
+        "INSERT INTO v(rowid, a) VALUES (?, ?)",
+        [(i, f32([i, -i])) for i in range(1, n + 1)],
+    )
+
+
+def _knn(db, query, k, where="", params=[]):
+    return db.execute(
+        f"SELECT rowid, distance, exact FROM v WHERE a MATCH ? AND k = ? {where}",
+        [query, k, *params],
+    ).fetchall()
+
+
+def test_knn_max_chunks(db):
+    db.execute("create virtual table v using vec0(a float[2], chunk_size=8)")
+    _fill(db, 80)
+    query = f32([0, 0])
+
+    # without a budget, the result is exact
+    rows = _knn(db, query, 3)
+    assert [row["rowid"] for row in rows] == [1, 2, 3]
+    assert {row["exact"] for row in rows} == {1}
+
+    # the newest chunks are scanned first, and the result says it's partial
+    rows = _knn(db, query, 3, "AND max_chunks = 2")
+    assert [row["rowid"] for row in rows] == [65, 66, 67]
+    assert {row["exact"] for row in rows} == {0}
+
+    # a budget covering every chunk gives the exact result
+    rows = _knn(db, query, 3, "AND max_chunks = ?", [10])
+    assert [row["rowid"] for row in rows] == [1, 2, 3]
+    assert {row["exact"] for row in rows} == {1}
+
+    # chunks skipped by other constraints don't use up the budget
+    db.execute("create virtual table w using vec0(p int partition key, a float[2], chunk_size=8)")
+    db.executemany(
+        "INSERT INTO w(rowid, p, a) VALUES (?, ?, ?)",
+        [(i, i % 2, f32([i, -i])) for i in range(1, 81)],
+    )
+    rows = db.execute(
+        "SELECT rowid, exact FROM w WHERE a MATCH ? AND k = 2 AND p = 1 AND max_chunks = 5",
+        [query],
+    ).fetchall()
+    assert [row["rowid"] for row in rows] == [1, 3]
+    assert {row["exact"] for row in rows} == {1}
+
+
+def test_knn_time_budget(db):
+    db.execute("create virtual table v using vec0(a float[2], chunk_size=8)")
+    _fill(db, 80)
+    query = f32([0, 0])
+
+    rows = _knn(db, query, 3, "AND time_budget_ms = 60000")
+    assert [row["rowid"] for row in rows] == [1, 2, 3]
+    assert {row["exact"] for row in rows} == {1}
+    rows = _knn(db, query, 3, "AND time_budget_ms = 60000 AND max_chunks = 1")
+    assert [row["rowid"] for row in rows] == [73, 74, 75]
+    assert {row["exact"] for row in rows} == {0}
+
+    # a budget that's over before the scan starts still reads the newest chunk
+    rows = _knn(db, query, 3, "AND time_budget_ms = 0.001")
+    assert [row["rowid"] for row in rows] == [73, 74, 75]
+    assert {row["exact"] for row in rows} == {0}
+
+
+def test_knn_budget_exact_indexes(db):
+    db.execute(
+        "create virtual table v using vec0(a float[2] indexed_by=ivf(nlist=4, nprobe=1), chunk_size=8)"
+    )
+    _fill(db, 80)
+    query = f32([0, 0])
+    # untrained IVF columns scan every chunk
+    assert {row["exact"] for row in _knn(db, query, 3)} == {1}
+    db.execute("INSERT INTO v(v) VALUES ('optimize')")
+    assert {row["exact"] for row in _knn(db, query, 3)} == {0}
+    assert {row["exact"] for row in _knn(db, query, 3, "AND max_chunks = 100")} == {0}
+
+
+def test_knn_budget_errors(db):
+    db.execute(
+        "create virtual table v using vec0(a float[2], b float[2] indexed_by=hnsw, chunk_size=8)"
+    )
+    db.execute("INSERT INTO v(rowid, a, b) VALUES (1, ?, ?)", [f32([1, 1])] * 2)
+    query = f32([0, 0])
+
+    with pytest.raises(sqlite3.OperationalError, match="max_chunks value in knn query must be greater than 0"):
+        _knn(db, query, 3, "AND max_chunks = 0")
+    with pytest.raises(sqlite3.OperationalError, match="time_budget_ms value in knn query must be greater than 0"):
+        _knn(db, query, 3, "AND time_budget_ms = -1")
+    with pytest.raises(sqlite3.OperationalError, match="max_chunks cannot be used with page_token"):
+        _knn(db, query, 3, "AND max_chunks = 1 AND page_token IS NULL")
+    with pytest.raises(sqlite3.OperationalError, match='time_budget_ms is not supported on vector columns declared with indexed_by=hnsw or indexed_by=diskann, "b" is'):
+        db.execute(
+            "SELECT rowid FROM v WHERE b MATCH ? AND k = 1 AND time_budget_ms = 10",
+            [query],
+        ).fetchall()
+    for column in ["max_chunks", "time_budget_ms", "exact"]:
+        with pytest.raises(
+            sqlite3.OperationalError,
+            match=f'A value was provided for the hidden "{column}" column.',
+        ):
+            db.execute(f"INSERT INTO v(a, b, {column}) VALUES (?, ?, 1)", [query, query])
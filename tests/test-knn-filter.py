@@ -0,0 +1,147 @@
+import random
+import sqlite3
+
+import pytest
+
+
+def _fill(db, n, seed=0):
+    rnd = random.Random(seed)
+    langs = ["en", "fr", "de", "a_language_with_a_long_name"]
+    rows = [
+        (
+            i,
+            rnd.uniform(0, 10),
+            rnd.choice(langs),
+            rnd.randint(0, 1),
+            rnd.randint(-5, 5),
+            rnd.uniform(-1, 1),
+            rnd.choice(["news", "blog", "documentation/reference"]),
+        )
+        for i in range(1, n + 1)
+    ]
+    db.executemany(
+        "INSERT INTO v(rowid, a, lang, fallback, n, f, category) VALUES (?, ?, ?, ?, ?, ?, ?)",
+        [(i, f"[{a}]", *rest) for i, a, *rest in rows],
+    )
+    db.execute(
+        "CREATE TABLE t(id INTEGER PRIMARY KEY, a, lang, fallback, n, f, category)"
+    )
+    db.executemany("INSERT INTO t VALUES (?, ?, ?, ?, ?, ?, ?)", rows)
+
+
+def _create(db, index=""):
+    db.execute(
+        f"""create virtual table v using vec0(
+          a float[1]{index},
+          lang text,
+          fallback boolean,
+          n integer,
+          f float,
+          category text dictionary,
+          chunk_size=8
+        )"""
+    )
+
+
+def test_knn_filter(db):
+    _create(db)
+    _fill(db, 300)
+
+    def check(expression, k=1000):
+        actual = db.execute(
+            "SELECT rowid, distance FROM v WHERE a MATCH '[0]' AND k = ? AND filter = ?",
+            [k, expression],
+        ).fetchall()
+        expected = db.execute(
+            f"SELECT id, a FROM t WHERE {expression} ORDER BY a, id LIMIT ?", [k]
+        ).fetchall()
+        assert [row[0] for row in actual] == [row[0] for row in expected], expression
+
+    for expression in [
+        "lang = 'en' OR fallback = 1",
+        "NOT (lang = 'en' OR fallback = 1)",
+        "lang = 'en' or (lang == 'fr' and not fallback = true)",
+        "n IN (1, 2, 3) AND NOT lang LIKE 'A_LANG%'",
+        "n NOT IN (-5, 0, 5) OR category = 'blog'",
+        "(n > 2 OR f < -0.5) AND category != 'news'",
+        "n >= -1 and n <= 1 and f <> 0.25",
+        "n BETWEEN -2 AND 2 AND NOT f BETWEEN -0.5 AND 0.5",
+        "lang NOT IN ('en', 'fr') AND n < 0",
+        "lang > 'de' and lang < 'fr'",
+        "lang glob 'a_*' or category glob 'doc*'",
+        "lang = 'a_language_with_a_long_name' or lang is 'de'",
+        "category IN ('blog', 'documentation/reference') AND fallback IS NOT 0",
+        "category like 'NEWS' or category > 'c'",
+        "n is null or f is not null and \"lang\" = 'en'",
+        "NOT NOT NOT fallback = 0",
+        "n = -3 or n = +4 or f < -1e-1",
+    ]:
+        check(expression)
+        check(expression, k=7)
+
+    # with other constraints
+    rows = db.execute(
+        "SELECT rowid FROM v WHERE a MATCH '[0]' AND k = 1000 AND n > 0 AND filter = 'lang = ''en'' OR fallback = 1'"
+    ).fetchall()
+    expected = db.execute(
+        "SELECT id FROM t WHERE n > 0 AND (lang = 'en' OR fallback = 1) ORDER BY a, id"
+    ).fetchall()
+    assert [row[0] for row in rows] == [row[0] for row in expected]
+
+
+@pytest.mark.parametrize("index", [" indexed_by=hnsw", " indexed_by=ivf(nlist=4, nprobe=4)"])
+def test_knn_filter_indexes(db, index):
+    _create(db, index)
+    _fill(db, 200)
+    db.execute("INSERT INTO v(v) VALUES ('optimize')")
+    expression = "lang = 'fr' OR (fallback = 1 AND n > 3)"
+    rows = db.execute(
+        "SELECT rowid FROM v WHERE a MATCH '[0]' AND k = 10 AND filter = ?",
+        [expression],
+    ).fetchall()
+    matching = {
+        row[0] for row in db.execute(f"SELECT id FROM t WHERE {expression}").fetchall()
+    }
+    assert len(rows) == 10
+    assert {row[0] for row in rows} <= matching
+
+
+def test_knn_filter_errors(db):
+    _create(db)
+    _fill(db, 10)
+
+    def query(expression):
+        return db.execute(
+            "SELECT rowid FROM v WHERE a MATCH '[0]' AND k = 5 AND filter = ?",
+            [expression],
+        ).fetchall()
+
+    for expression, message in [
+        ("", "expected a metadata column at the end of the filter"),
+        ("lang = ", "expected a string or a number at the end of the filter"),
+        ("lang = 'en' or", "expected a metadata column at the end of the filter"),
+        ("(lang = 'en'", "expected \\) at the end of the filter"),
+        ("lang = 'en')", 'unexpected token near "\\)"'),
+        ("lang = 'en", "unterminated string"),
+        ("lang ~ 'en'", 'unexpected character near "~"'),
+        ("lang = en", 'expected a string or a number near "en"'),
+        ("nope = 1", 'unknown metadata column near "nope"'),
+        ("a = 1", 'unknown metadata column near "a"'),
+        ("fallback > 0", "operator not allowed on a boolean metadata column"),
+        ("n like '1%'", "LIKE and GLOB are only allowed on TEXT metadata columns"),
+        ("f in (1.5)", "IN is only allowed on INTEGER or TEXT metadata columns"),
+        ("n between 1 or 2", 'expected AND near "or"'),
+        ("n = 12abc", "invalid number"),
+        ("n = 0xZZ", "invalid literal in filter"),
+        ("(" * 100 + "n = 1" + ")" * 100, "filter expression is nested too deeply"),
+    ]:
+        with pytest.raises(sqlite3.OperationalError, match=f"Invalid filter: {message}"):
+            query(expression)
+
+    with pytest.raises(sqlite3.OperationalError, match="filter value in knn query must be a string"):
+        query(1)
+    with pytest.raises(
+        sqlite3.OperationalError,
+        match='A value was provided for the hidden "filter" column.',
+    ):
+        db.execute("INSERT INTO v(a, filter) VALUES ('[1]', 'n = 1')")
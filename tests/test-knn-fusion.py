@@ -0,0 +1,152 @@
+import math
+import random
+import sqlite3
+
+import pytest
+from conftest import f32
+
+
+def _fill(db, n, seed=0):
+    rnd = random.Random(seed)
+    db.executemany(
+        "INSERT INTO v(rowid, title, body, c) VALUES (?, ?, ?, ?)",
+        [
+            (
+                i + 1,
+                f32([rnd.uniform(-1, 1) for _ in range(4)]),
+                f32([rnd.uniform(-1, 1) for _ in range(6)]),
+                i % 3,
+            )
+            for i in range(n)
+        ],
+    )
+
+
+def _fused(db, title, body, weights, k, where="", params=[]):
+    rows = db.execute(
+        f"SELECT rowid, distance FROM v WHERE title MATCH ? AND body MATCH ? AND weights = ? AND k = ? {where}",
+        [title, body, weights, k, *params],
+    ).fetchall()
+    return [(row["rowid"], row["distance"]) for row in rows]
+
+
+def _expected(db, title, body, weights, k, where="", params=[]):
+    rows = db.execute(
+        f"""
+        SELECT rowid,
+          ? * vec_distance_l2(title, ?) + ? * vec_distance_cosine(body, ?) AS d
+        FROM v WHERE 1 {where}
+        ORDER BY d, rowid LIMIT ?
+        """,
+        [weights[0], title, weights[1], body, *params, k],
+    ).fetchall()
+    return [(row[0], row[1]) for row in rows]
+
+
+def _assert_same(actual, expected):
+    assert [row[0] for row in actual] == [row[0] for row in expected]
+    for (_, a), (_, b) in zip(actual, expected):
+        assert a == pytest.approx(b, rel=1e-5, abs=1e-5)
+
+
+@pytest.mark.parametrize("index", ["", " indexed_by=hnsw", " indexed_by=ivf(nlist=4)"])
+def test_knn_fusion(db, index):
+    db.execute(
+        f"create virtual table v using vec0(title float[4]{index}, body float[6] distance_metric=cosine, c integer, chunk_size=8)"
+    )
+    _fill(db, 300)
+    if index:
+        db.execute("INSERT INTO v(v) VALUES ('optimize')")
+    title = f32([0.1, -0.4, 0.3, 0.9])
+    body = f32([0.5, 0.5, -0.2, 0.0, 0.3, -0.7])
+
+    # fused queries are exact, whatever the index of the columns
+    for weights in [[0.7, 0.3], [1.0, 0.0], [0.0, 1.0], [2.0, 5.0]]:
+        _assert_same(
+            _fused(db, title, body, f32(weights), 10),
+            _expected(db, title, body, weights, 10),
+        )
+    _assert_same(
+        _fused(db, title, body, "[0.25, 0.75]", 7, "AND c = ?", [1]),
+        _expected(db, title, body, [0.25, 0.75], 7, "AND c = ?", [1]),
+    )
+
+    # weights follow the declaration order of the columns, not the query's
+    rows = db.execute(
+        "SELECT rowid, distance FROM v WHERE body MATCH ? AND title MATCH ? AND weights = ? AND k = 5",
+        [body, title, "[0.7, 0.3]"],
+    ).fetchall()
+    _assert_same(
+        [(row[0], row[1]) for row in rows],
+        _expected(db, title, body, [0.7, 0.3], 5),
+    )
+
+
+def test_knn_fusion_paging(db):
+    db.execute(
+        "create virtual table v using vec0(title float[4], body float[6] distance_metric=cosine, c integer, chunk_size=8)"
+    )
+    _fill(db, 200)
+    title = f32([1, 0, 0, 0])
+    body = f32([0, 1, 0, 0, 0, 0])
+    sql = "SELECT rowid, distance, page_token FROM v WHERE title MATCH ? AND body MATCH ? AND weights = ? AND k = 6 AND page_token = ?"
+
+    pages = []
+    token = None
+    for _ in range(4):
+        rows = db.execute(sql, [title, body, "[0.5, 0.5]", token]).fetchall()
+        pages += [(row["rowid"], row["distance"]) for row in rows]
+        token = rows[-1]["page_token"]
+    _assert_same(pages, _expected(db, title, body, [0.5, 0.5], 24))
+
+    # the token belongs to the query with these weights
+    with pytest.raises(sqlite3.OperationalError, match="different KNN query"):
+        db.execute(sql, [title, body, "[0.5, 0.6]", token]).fetchall()
+
+
+def test_knn_fusion_errors(db):
+    db.execute(
+        "create virtual table v using vec0(title float[4], body float[6] distance_metric=cosine, c integer)"
+    )
+    _fill(db, 20)
+    title = f32([1, 0, 0, 0])
+    body = f32([0, 1, 0, 0, 0, 0])
+    sql = "SELECT rowid FROM v WHERE title MATCH ? AND body MATCH ? AND weights = ? AND k = 5"
+
+    with pytest.raises(sqlite3.OperationalError, match="only 1 MATCH operator"):
+        db.execute(
+            "SELECT rowid FROM v WHERE title MATCH ? AND body MATCH ? AND k = 5",
+            [title, body],
+        ).fetchall()
+    with pytest.raises(sqlite3.OperationalError, match="one weight per MATCH constraint, 2 expected"):
+        db.execute(sql, [title, body, "[1]"]).fetchall()
+    with pytest.raises(sqlite3.OperationalError, match="one weight per MATCH constraint"):
+        db.execute(sql, [title, body, "[1, 2, 3]"]).fetchall()
+    with pytest.raises(sqlite3.OperationalError, match="weights value in knn query is invalid"):
+        db.execute(sql, [title, body, "abc"]).fetchall()
+    with pytest.raises(sqlite3.OperationalError, match="finite"):
+        db.execute(sql, [title, body, f32([1, math.inf])]).fetchall()
+    with pytest.raises(sqlite3.OperationalError, match='"body" column'):
+        db.execute(sql, [title, f32([1, 0]), "[1, 1]"]).fetchall()
+    with pytest.raises(sqlite3.OperationalError, match="mmr_lambda"):
+        db.execute(sql + " AND mmr_lambda = 0.5", [title, body, "[1, 1]"]).fetchall()
+    with pytest.raises(
+        sqlite3.OperationalError,
+        match='A value was provided for the hidden "weights" column.',
+    ):
+        db.execute(
+            "INSERT INTO v(title, body, weights) VALUES (?, ?, '[1, 1]')", [title, body]
+        )
+
+    # a single MATCH with weights scales its distances
+    plain = db.execute(
+        "SELECT rowid, distance FROM v WHERE title MATCH ? AND k = 3", [title]
+    ).fetchall()
+    scaled = db.execute(
+        "SELECT rowid, distance FROM v WHERE title MATCH ? AND weights = '[2]' AND k = 3",
+        [title],
+    ).fetchall()
+    _assert_same(
+        [(row[0], row[1]) for row in scaled],
+        [(row[0], 2 * row[1]) for row in plain],
+    )
@@ -229,6 +229,55 @@ def test_mmr_insert_guard(db, snapshot):
     )
 
 
+def test_mmr_many_chunks(db):
+    """MMR over candidates from many chunks matches a reference greedy MMR."""
+    import math
+    import random
+    import struct
+
+    rnd = random.Random(7)
+    vectors = {
+        i: [rnd.uniform(-1, 1) for _ in range(8)] for i in range(1, 401)
+    }
+    db.execute("create virtual table v using vec0(embedding float[8], chunk_size=8)")
+    db.executemany(
+        "insert into v(rowid, embedding) values (?, ?)",
+        [(i, struct.pack("8f", *vector)) for i, vector in vectors.items()],
+    )
+    query = [rnd.uniform(-1, 1) for _ in range(8)]
+    k, mmr_lambda = 12, 0.4
+
+    # the over-fetched candidates MMR picks from
+    candidates = db.execute(
+        "select rowid, distance from v where embedding match ? and k = ?",
+        [struct.pack("8f", *query), k * 5],
+    ).fetchall()
+    f32 = {i: struct.unpack("8f", struct.pack("8f", *v)) for i, v in vectors.items()}
+
+    def l2(a, b):
+        return math.sqrt(sum((x - y) ** 2 for x, y in zip(a, b)))
+
+    max_dist = max(row["distance"] for row in candidates)
+    expected = []
+    while len(expected) < k:
+        best = max(
+            (row for row in candidates if row["rowid"] not in expected),
+            key=lambda row: mmr_lambda * (1 - row["distance"] / max_dist)
+            - (1 - mmr_lambda)
+            * max(
+                [0.0]
+                + [1 - l2(f32[row["rowid"]], f32[s]) / max_dist for s in expected]
+            ),
+        )
+        expected.append(best["rowid"])
+
+    rows = db.execute(
+        "select rowid from v where embedding match ? and k = ? and mmr_lambda = ?",
+        [struct.pack("8f", *query), k, mmr_lambda],
+    ).fetchall()
+    assert [row["rowid"] for row in rows] == expected
+
+
 def exec(db, sql, parameters=[]):
     try:
         rows = db.execute(sql, parameters).fetchall()
@@ -0,0 +1,135 @@
+import random
+import sqlite3
+
+import pytest
+from conftest import f32
+
+
+def _pages(db, table, query, k, where="", params=[]):
+    pages = []
+    token = None
+    while True:
+        rows = db.execute(
+            f"SELECT rowid, distance, page_token FROM {table} WHERE embedding MATCH ? AND k = ? AND page_token = ? {where}",
+            [query, k, token, *params],
+        ).fetchall()
+        if len(rows) == 0:
+            return pages
+        pages.append([(row["rowid"], row["distance"]) for row in rows])
+        token = rows[-1]["page_token"]
+
+
+def _ordered(db, table, query, where="", params=[]):
+    rows = db.execute(
+        f"SELECT rowid, distance FROM {table} WHERE embedding MATCH ? AND k = 4096 {where}",
+        [query, *params],
+    ).fetchall()
+    return sorted([(row["rowid"], row["distance"]) for row in rows], key=lambda r: (r[1], r[0]))
+
+
+def _fill(db, n, seed=0):
+    # small integer coordinates, so many rows tie on distance
+    rnd = random.Random(seed)
+    db.executemany(
+        "INSERT INTO v(rowid, embedding, c) VALUES (?, ?, ?)",
+        [
+            (i + 1, f32([rnd.randint(0, 3) for _ in range(4)]), i % 3)
+            for i in range(n)
+        ],
+    )
+
+
+@pytest.mark.parametrize("index", ["", " indexed_by=ivf(nlist=4)"])
+def test_knn_paging(db, index):
+    db.execute(f"create virtual table v using vec0(embedding float[4]{index}, c integer)")
+    _fill(db, 600)
+    if index:
+        db.execute("INSERT INTO v(v) VALUES ('optimize')")
+    query = f32([1, 1, 2, 1])
+    nprobe = " AND nprobe = 4" if index else ""
+
+    # pages cover every row exactly once, in (distance, rowid) order, even
+    # though most page boundaries fall between tied rows
+    pages = _pages(db, "v", query, 9, nprobe)
+    assert all(len(page) == 9 for page in pages[:-1])
+    assert sum(pages, []) == _ordered(db, "v", query, nprobe)
+
+    pages = _pages(db, "v", query, 7, "AND c = ?" + nprobe, [1])
+    assert sum(pages, []) == _ordered(db, "v", query, "AND c = ?" + nprobe, [1])
+
+    # without page_token, KNN queries keep their order and return no token
+    rows = db.execute(
+        "SELECT rowid, page_token FROM v WHERE embedding MATCH ? AND k = 3",
+        [query],
+    ).fetchall()
+    assert len(rows) == 3
+    rows = db.execute(
+        "SELECT rowid FROM v WHERE embedding MATCH ? AND k = 3", [query]
+    ).fetchall()
+    assert len(rows) == 3
+    assert db.execute("SELECT page_token FROM v WHERE rowid = 1").fetchone()[0] is None
+
+
+def test_knn_paging_writes(db):
+    db.execute("create virtual table v using vec0(embedding float[4], c integer)")
+    _fill(db, 300)
+    query = f32([0, 1, 2, 3])
+    sql = "SELECT rowid, distance, page_token FROM v WHERE embedding MATCH ? AND k = 5 AND page_token = ?"
+
+    first = db.execute(sql, [query, None]).fetchall()
+    token = first[-1]["page_token"]
+
+    # a page after a write rescans from the token: deleted rows are gone,
+    # new rows after the token show up
+    db.execute("DELETE FROM v WHERE rowid = ?", [_ordered(db, "v", query)[5][0]])
+    db.execute("INSERT INTO v(rowid, embedding, c) VALUES (1000, ?, 0)", [query])
+    db.execute(
+        "INSERT INTO v(rowid, embedding, c) VALUES (1001, ?, 0)",
+        [f32([0, 1, 2, 4])],
+    )
+    after = [
+        row
+        for row in _ordered(db, "v", query)
+        if (row[1], row[0]) > (first[-1]["distance"], first[-1]["rowid"])
+    ]
+    second = db.execute(sql, [query, token]).fetchall()
+    assert [(row["rowid"], row["distance"]) for row in second] == after[:5]
+    assert 1000 not in [row["rowid"] for row in second]
+
+    # pages cached before a rollback aren't served after it
+    db.commit()
+    expected = _ordered(db, "v", query)[:5]
+    db.execute("BEGIN")
+    db.execute("DELETE FROM v WHERE rowid = ?", [expected[0][0]])
+    first = db.execute(sql, [query, None]).fetchall()
+    assert expected[0][0] not in [row["rowid"] for row in first]
+    db.execute("ROLLBACK")
+    first = db.execute(sql, [query, None]).fetchall()
+    assert [(row["rowid"], row["distance"]) for row in first] == expected
+
+
+def test_knn_paging_errors(db):
+    db.execute("create virtual table v using vec0(embedding float[4], c integer)")
+    _fill(db, 50)
+    query = f32([1, 1, 1, 1])
+    sql = "SELECT rowid, page_token FROM v WHERE embedding MATCH ? AND k = 5 AND page_token = ?"
+    token = db.execute(sql, [query, None]).fetchall()[-1]["page_token"]
+
+    with pytest.raises(sqlite3.OperationalError, match="Invalid page_token value"):
+        db.execute(sql, [query, b"abc"]).fetchall()
+    with pytest.raises(sqlite3.OperationalError, match="Invalid page_token value"):
+        db.execute(sql, [query, "abc"]).fetchall()
+    with pytest.raises(sqlite3.OperationalError, match="different KNN query"):
+        db.execute(sql, [f32([0, 0, 0, 0]), token]).fetchall()
+    with pytest.raises(sqlite3.OperationalError, match="different KNN query"):
+        db.execute(sql + " AND c = 1", [query, token]).fetchall()
+    with pytest.raises(sqlite3.OperationalError, match="mmr_lambda"):
+        db.execute(sql + " AND mmr_lambda = 0.5", [query, token]).fetchall()
+    with pytest.raises(
+        sqlite3.OperationalError,
+        match='A value was provided for the hidden "page_token" column.',
+    ):
+        db.execute(
+            "INSERT INTO v(embedding, page_token) VALUES (?, ?)", [query, token]
+        )
+
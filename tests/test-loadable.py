@@ -110,6 +110,7 @@ FUNCTIONS = [
     "vec_normalize",
     "vec_quantize_binary",
     "vec_quantize_int8",
+    "vec_result_cache_stats",
     "vec_slice",
     "vec_sub",
     "vec_to_json",
@@ -306,6 +307,17 @@ def test_vec_debug():
     assert len(d) == 4
 
 
+def test_vec_result_cache_stats():
+    db = connect(EXT_PATH)
+    db.execute("create virtual table v using vec0(a float[1], result_cache=4)")
+    db.execute("insert into v(rowid, a) values (1, '[1]'), (2, '[2]')")
+    for _ in range(3):
+        db.execute("select rowid from v where a match '[1]' and k = 1").fetchall()
+    stats = db.execute("select vec_result_cache_stats('v')").fetchone()[0]
+    assert json.loads(stats) == {"entries": 1, "bytes": 28, "hits": 2, "misses": 1}
+    assert db.execute("select vec_result_cache_stats('x')").fetchone()[0] is None
+
+
 def test_vec_bit():
     vec_bit = lambda *args: db.execute("select vec_bit(?)", args).fetchone()[0]
     assert vec_bit(b"\xff") == b"\xff"
@@ -939,9 +951,13 @@ def test_vec0_inserts():
     db.set_authorizer(None)
 
     # EVIDENCE-OF: V31559_15629 vec0 INSERT error on _chunks shadow insert raises error
-    db.set_authorizer(authorizer_deny_on(sqlite3.SQLITE_READ, "t1_chunks", "chunk_id"))
+    # the latest chunk is only looked up on a partition's first insert of a
+    # transaction, so insert into a new partition
+    db.execute("create virtual table t2 using vec0(p int partition key, aaa float[4])")
+    db.execute("insert into t2 values (1, 1, '[1,1,1,1]')")
+    db.set_authorizer(authorizer_deny_on(sqlite3.SQLITE_READ, "t2_chunks", "chunk_id"))
     with _raises("Internal sqlite-vec error: Could not find latest chunk"):
-        db.execute("insert into t1 values (999, '[2,2,2,2]')")
+        db.execute("insert into t2 values (2, 2, '[2,2,2,2]')")
     db.set_authorizer(None)
 
     # EVIDENCE-OF: V22053_06123 vec0 INSERT error on reading validity blob
@@ -1151,6 +1167,8 @@ def test_vec0_drops():
     ] == [
         "t1",
         "t1_chunks",
+        "t1_free_chunks",
+        "t1_free_chunks_free",
         "t1_info",
         "t1_rowids",
         "t1_vector_chunks00",
@@ -1459,7 +1477,7 @@ def test_vec0_updates():
     with _raises(
         'Dimension mismatch for new updated vector for the "aaa" column. Expected 8 dimensions but received 1.'
     ):
-        db.execute("UPDATE t3 SET aaa = vec_bit(X'AABBCCDD') WHERE rowid = 1")
+        db.execute("UPDATE t3 SET aaa = X'AABBCCDD' WHERE rowid = 1")
 
     # EVIDENCE-OF: V03643_20481 vec0 UPDATE validates vector column type
     with _raises(
@@ -2349,6 +2367,12 @@ def test_smoke():
         {
             "name": "vec_xyz_chunks",
         },
+        {
+            "name": "vec_xyz_free_chunks",
+        },
+        {
+            "name": "vec_xyz_free_chunks_free",
+        },
         {
             "name": "vec_xyz_info",
         },
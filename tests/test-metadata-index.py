@@ -0,0 +1,204 @@
+import random
+import sqlite3
+
+import pytest
+
+
+def _rows(n, seed=0):
+    rnd = random.Random(seed)
+    return [
+        (
+            i,
+            rnd.uniform(0, 10),
+            rnd.randint(0, 40),
+            rnd.choice(["en", "fr", "a_language_with_a_long_name"]),
+            rnd.choice(["news", "blog", "documentation/reference"]),
+        )
+        for i in range(1, n + 1)
+    ]
+
+
+def _create(db, index="", partition=""):
+    db.execute(
+        f"""create virtual table v using vec0(
+          {partition}
+          a float[1]{index},
+          author_id integer indexed,
+          lang text indexed,
+          category text dictionary indexed,
+          chunk_size=8
+        )"""
+    )
+    db.execute("CREATE TABLE t(id INTEGER PRIMARY KEY, a, author_id, lang, category)")
+
+
+def _insert(db, rows):
+    db.executemany(
+        "INSERT INTO v(rowid, a, author_id, lang, category) VALUES (?, ?, ?, ?, ?)",
+        [(i, f"[{a}]", *rest) for i, a, *rest in rows],
+    )
+    db.executemany("INSERT INTO t VALUES (?, ?, ?, ?, ?)", rows)
+
+
+def _check(db, where, params=[], k=1000):
+    actual = db.execute(
+        f"SELECT rowid FROM v WHERE a MATCH '[0]' AND k = ? AND {where}",
+        [k, *params],
+    ).fetchall()
+    expected = db.execute(
+        f"SELECT id FROM t WHERE {where} ORDER BY a, id LIMIT ?", [*params, k]
+    ).fetchall()
+    assert [row[0] for row in actual] == [row[0] for row in expected], where
+
+
+def _index(db, metadata_idx):
+    rows = db.execute(
+        f"SELECT value, chunk_id, hex(slots) FROM v_metadataindex{metadata_idx:02d} ORDER BY 1, 2"
+    ).fetchall()
+    return [tuple(row) for row in rows]
+
+
+def _check_index(db):
+    # the index built from scratch out of the plain table
+    for metadata_idx, value in enumerate(
+        ["t.author_id", "t.lang", "(SELECT code FROM v_metadatadict02 WHERE value = t.category)"]
+    ):
+        slots = {}
+        for row in db.execute(
+            f"SELECT {value}, r.chunk_id, r.chunk_offset FROM v_rowids AS r JOIN t ON t.id = r.rowid"
+        ).fetchall():
+            key = (row[0], row[1])
+            slots[key] = slots.get(key, 0) | (1 << row[2])
+        expected = sorted((*key, f"{bits:02X}") for key, bits in slots.items())
+        assert _index(db, metadata_idx) == expected
+
+
+def _check_all(db):
+    for author_id in [0, 7, 40, 41]:
+        _check(db, "author_id = ?", [author_id])
+        _check(db, "author_id = ?", [author_id], k=3)
+    _check(db, "author_id in (1, 2, 3)")
+    _check(db, "author_id in (1, 2, 3) and lang = 'fr'")
+    _check(db, "lang = 'a_language_with_a_long_name' and author_id > 20")
+    _check(db, "lang in ('en', 'a_language_with_a_long_name') and author_id = 5")
+    _check(db, "category = 'blog' and author_id = 11")
+    _check(db, "category in ('news', 'documentation/reference') and author_id = 12")
+    _check(db, "category = 'missing'")
+
+
+def test_metadata_index(db):
+    _create(db)
+    rows = _rows(300)
+    _insert(db, rows)
+    _check_all(db)
+
+    # deletes and updates move positions out of and between values
+    db.execute("DELETE FROM v WHERE rowid % 3 = 0")
+    db.execute("DELETE FROM t WHERE id % 3 = 0")
+    for sql in [
+        "UPDATE {} SET author_id = 7 WHERE {} % 5 = 1",
+        "UPDATE {} SET lang = 'fr' WHERE {} % 7 = 2",
+        "UPDATE {} SET lang = 'a_language_with_a_long_name' WHERE {} % 11 = 4",
+        "UPDATE {} SET category = 'news' WHERE {} % 4 = 1",
+    ]:
+        db.execute(sql.format("v", "rowid"))
+        db.execute(sql.format("t", "id"))
+    _check_all(db)
+    _check_index(db)
+
+    # optimize moves rows to new positions, and rebuilds the index over them
+    db.execute("INSERT INTO v(v) VALUES ('optimize')")
+    _check_all(db)
+    _check_index(db)
+
+    # inserts after optimize fill the freed positions
+    _insert(db, [(1000 + i, *row[1:]) for i, row in enumerate(_rows(40, seed=1))])
+    db.execute("INSERT INTO v(v) VALUES ('optimize')")
+    _check_all(db)
+    _check_index(db)
+
+    # rolled back writes leave the index as it was
+    index = [_index(db, i) for i in range(3)]
+    db.execute("SAVEPOINT a")
+    db.execute("DELETE FROM v WHERE rowid < 100")
+    db.execute("UPDATE v SET author_id = 99 WHERE rowid > 200")
+    db.execute("ROLLBACK TO a")
+    db.execute("RELEASE a")
+    assert [_index(db, i) for i in range(3)] == index
+
+
+def test_metadata_index_contents(db):
+    _create(db)
+    _insert(
+        db,
+        [
+            (1, 1.0, 5, "en", "news"),
+            (2, 2.0, 5, "a_language_with_a_long_name", "news"),
+            (3, 3.0, 6, "en", "blog"),
+            (9, 4.0, 5, "en", "news"),
+        ],
+    )
+    assert _index(db, 0) == [(5, 1, "0B"), (6, 1, "04")]
+    assert _index(db, 1) == [
+        ("a_language_with_a_long_name", 1, "02"),
+        ("en", 1, "0D"),
+    ]
+    # dictionary columns index their codes
+    assert _index(db, 2) == [(1, 1, "0B"), (2, 1, "04")]
+
+    db.execute("DELETE FROM v WHERE rowid = 3")
+    db.execute("UPDATE v SET lang = 'fr', author_id = 6 WHERE rowid = 2")
+    assert _index(db, 0) == [(5, 1, "09"), (6, 1, "02")]
+    assert _index(db, 1) == [("en", 1, "09"), ("fr", 1, "02")]
+    assert _index(db, 2) == [(1, 1, "0B")]
+
+
+@pytest.mark.parametrize("index", ["", " indexed_by=hnsw", " indexed_by=ivf(nlist=4, nprobe=4)"])
+def test_metadata_index_knn(db, index):
+    _create(db, index, partition="p integer partition key,")
+    rows = _rows(200)
+    db.executemany(
+        "INSERT INTO v(rowid, p, a, author_id, lang, category) VALUES (?, ?, ?, ?, ?, ?)",
+        [(i, i % 2, f"[{a}]", *rest) for i, a, *rest in rows],
+    )
+    db.execute("INSERT INTO v(v) VALUES ('optimize')")
+    for where, params in [
+        ("author_id = ?", [3]),
+        ("author_id in (1, 2) and p = 1", []),
+        ("lang = 'fr' and category = 'blog'", []),
+    ]:
+        result = db.execute(
+            f"SELECT rowid FROM v WHERE a MATCH '[0]' AND k = 5 AND {where}",
+            params,
+        ).fetchall()
+        expected = {
+            row[0]
+            for row in db.execute(
+                f"SELECT rowid FROM v WHERE {where}", params
+            ).fetchall()
+        }
+        assert len(result) == min(5, len(expected))
+        assert {row[0] for row in result} <= expected
+
+
+def test_metadata_index_errors(db):
+    for declaration in ["b boolean indexed", "f double indexed"]:
+        with pytest.raises(
+            sqlite3.OperationalError,
+            match="indexed is only supported on INTEGER or TEXT metadata columns",
+        ):
+            db.execute(f"create virtual table v using vec0(a float[1], {declaration})")
+
+    db.execute(
+        "create virtual table v using vec0(a float[1], n int indexed, s text indexed)"
+    )
+    db.execute("ALTER TABLE v RENAME TO w")
+    db.execute("INSERT INTO w(rowid, a, n, s) VALUES (1, '[1]', 3, 'x')")
+    assert db.execute("SELECT value FROM w_metadataindex01").fetchone()[0] == "x"
+    db.execute("DROP TABLE w")
+    assert (
+        db.execute(
+            "SELECT count(*) FROM sqlite_master WHERE name LIKE '%metadataindex%'"
+        ).fetchone()[0]
+        == 0
+    )
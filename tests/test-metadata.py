@@ -1374,6 +1374,227 @@ def test_stress(db, snapshot):
     ) == snapshot(name="bool-other-op")
 
 
+def test_knn_metadata_kernels(db):
+    # every operator on every chunk position, checked against a plain table
+    db.execute(
+        "create virtual table v using vec0(a float[1], n integer, f float, b boolean, chunk_size=16)"
+    )
+    db.execute("create table t(id integer primary key, a float, n integer, f float, b boolean)")
+    rows = [
+        (i, float(i % 7), (i * 37) % 23 - 11, ((i * 13) % 17) / 4 - 2, i % 3 == 0)
+        for i in range(1, 101)
+    ] + [(101, 1.0, -(2**63), float("-inf"), 1), (102, 2.0, 2**63 - 1, float("inf"), 0)]
+    db.executemany("insert into v(rowid, a, n, f, b) values (?, ?, ?, ?, ?)", [
+        (i, f"[{a}]", n, f, b) for i, a, n, f, b in rows
+    ])
+    db.executemany("insert into t values (?, ?, ?, ?, ?)", rows)
+
+    def check(where, params=[]):
+        actual = db.execute(
+            f"select rowid from v where a match '[0]' and k = 200 and {where}",
+            params,
+        ).fetchall()
+        expected = db.execute(
+            f"select id from t where {where} order by id", params
+        ).fetchall()
+        assert sorted(row[0] for row in actual) == [row[0] for row in expected], where
+
+    for op in ["=", "!=", ">", ">=", "<", "<=", "is", "is not"]:
+        for target in [-(2**63), -11, -3, 0, 4, 11, 2**63 - 1]:
+            check(f"n {op} ?", [target])
+        for target in [float("-inf"), -2, -0.25, 0, 1.5, 2, float("inf")]:
+            check(f"f {op} ?", [target])
+    for op in ["=", "!=", "is", "is not"]:
+        for target in [0, 1]:
+            check(f"b {op} ?", [target])
+    for column in ["n", "f", "b"]:
+        check(f"{column} is null")
+        check(f"{column} is not null")
+
+    # short and long IN lists
+    check("n in (-11, 0, 5)")
+    check("n in (5, 5, -11)")
+    check(f"n in ({', '.join(str(x) for x in range(-30, 30, 2))})")
+    check(f"n in ({', '.join(str(x) for x in range(-30, 30, 2))}, {-(2**63)}, {2**63 - 1})")
+
+
+def test_knn_metadata_filter_order(db):
+    # constraints are evaluated cheapest first and stop once a chunk is empty,
+    # the result is the same whatever order they're written in
+    db.execute(
+        "create virtual table v using vec0(a float[1], n integer, name text, b boolean, chunk_size=8)"
+    )
+    db.execute("create table t(id integer primary key, a float, n integer, name text, b boolean)")
+    names = ["short", "a_long_name_that_is_not_inline", "a_long_name_that_is_different"]
+    # n is the same within a chunk
+    rows = [(i, float(i % 5), (i - 1) // 8, names[i % 3], i % 2) for i in range(1, 81)]
+    db.executemany(
+        "insert into v(rowid, a, n, name, b) values (?, ?, ?, ?, ?)",
+        [(i, f"[{a}]", n, name, b) for i, a, n, name, b in rows],
+    )
+    db.executemany("insert into t values (?, ?, ?, ?, ?)", rows)
+
+    def check(where):
+        actual = db.execute(
+            f"select rowid from v where a match '[0]' and k = 100 and {where}"
+        ).fetchall()
+        # distances are the values of a
+        expected = db.execute(
+            f"select id from t where {where.replace('distance', 'a')} order by id"
+        ).fetchall()
+        assert sorted(row[0] for row in actual) == [row[0] for row in expected], where
+
+    constraints = [
+        "name > 'a_long_name_that_is_e'",
+        "n = 3",
+        "b = 1",
+        "n != 5",
+        "name like 'a_long%'",
+    ]
+    for i in range(len(constraints)):
+        reordered = constraints[i:] + constraints[:i]
+        check(" and ".join(reordered))
+        check(" and ".join(reversed(reordered)))
+    check("n in (1, 4, 9) and name = 'a_long_name_that_is_different'")
+    check("n = 100 and name = 'a_long_name_that_is_different'")
+    check("b = 1 and distance < 3 and n < 6")
+
+    # chunks emptied by metadata constraints don't use up the budget
+    rows = db.execute(
+        "select rowid, exact from v where a match '[0]' and k = 1 and n = 2 and max_chunks = 1"
+    ).fetchall()
+    assert [row[0] for row in rows] == [20]
+    assert {row[1] for row in rows} == {1}
+
+
+def test_long_text_filters(db):
+    db.execute(
+        "create virtual table v using vec0(a float[1], name text, chunk_size=8)"
+    )
+    db.execute("create table t(id integer primary key, name text)")
+    # short, exactly inline, and long values, many sharing their inline prefix
+    names = [
+        "abc",
+        "abcdefghijkl",
+        "abcdefghijklm",
+        "abcdefghijklmnop",
+        "abcdefghijklmnoq",
+        "abcdefghijkm",
+        "abcdefghijkmzzzz",
+        "ABCDEFGHIJKLMNOP",
+        "zzzzzzzzzzzzzzzzzzzz",
+        "",
+    ]
+    rows = [(i, names[(i * 3) % len(names)]) for i in range(1, 101)]
+    db.executemany(
+        "insert into v(rowid, a, name) values (?, '[1]', ?)", rows
+    )
+    db.executemany("insert into t values (?, ?)", rows)
+    # gaps between the long values of a chunk
+    db.execute("delete from v where rowid % 7 = 0")
+    db.execute("delete from t where id % 7 = 0")
+
+    def check(where, params=[]):
+        actual = db.execute(
+            f"select rowid from v where a match '[1]' and k = 100 and {where}",
+            params,
+        ).fetchall()
+        expected = db.execute(
+            f"select id from t where {where} order by id", params
+        ).fetchall()
+        assert sorted(row[0] for row in actual) == [row[0] for row in expected], (
+            where,
+            params,
+        )
+
+    targets = names + ["abcdefghijk", "abcdefghijklmno", "abcdefghijklmnopq", "b"]
+    for op in ["=", "!=", ">", ">=", "<", "<=", "is", "is not"]:
+        for target in targets:
+            check(f"name {op} ?", [target])
+    for pattern in [
+        "abcdefghijklm%",
+        "ABCDEFGHIJKLMNOP%",
+        "abcdefghijkl%",
+        "abc%",
+        "%p",
+        "abcdefghijkl_",
+        "abcdefghijklmnop",
+    ]:
+        check("name like ?", [pattern])
+    for pattern in ["abcdefghijklm*", "abcdefghijkl*", "ABC*", "*q", "abcdefghijklmno?"]:
+        check("name glob ?", [pattern])
+    check("name in ('abcdefghijklmnop', 'abcdefghijklmnoz', 'abc')")
+
+
+def test_dictionary_text(db):
+    db.execute(
+        "create virtual table v using vec0(a float[1], category text dictionary, chunk_size=8, chunk_summaries=true)"
+    )
+    db.execute("create table t(id integer primary key, a float, category text)")
+    categories = [
+        "documentation/reference",
+        "documentation/tutorials",
+        "blog",
+        "forum/questions-and-answers",
+        "Changelog",
+    ]
+    rows = [(i, float(i % 5), categories[(i * 7) % 5]) for i in range(1, 61)]
+    db.executemany(
+        "insert into v(rowid, a, category) values (?, ?, ?)",
+        [(i, f"[{a}]", c) for i, a, c in rows],
+    )
+    db.executemany("insert into t values (?, ?, ?)", rows)
+
+    # one dictionary entry per distinct value, rows store its code
+    assert db.execute("select count(*) from v_metadatadict00").fetchone()[0] == 5
+    assert "v_metadatatext00" not in [
+        row[0] for row in db.execute("select name from sqlite_master")
+    ]
+    assert db.execute("select category from v where rowid = 3").fetchone()[0] == categories[1]
+
+    def check(where, params=[]):
+        actual = db.execute(
+            f"select rowid from v where a match '[0]' and k = 100 and {where}",
+            params,
+        ).fetchall()
+        expected = db.execute(
+            f"select id from t where {where} order by id", params
+        ).fetchall()
+        assert sorted(row[0] for row in actual) == [row[0] for row in expected], where
+
+    for op in ["=", "!=", ">", ">=", "<", "<=", "is", "is not"]:
+        for target in categories + ["", "c", "missing", "zzz"]:
+            check(f"category {op} ?", [target])
+    check("category in ('blog', 'Changelog', 'missing')")
+    check("category in ('missing')")
+    check("category like 'DOC%'")
+    check("category glob 'doc*'")
+    check("category is null")
+    check("category is not null")
+
+    # updates and deletes keep the dictionary, optimize keeps the codes
+    db.execute("update v set category = 'news' where rowid = 1")
+    db.execute("update t set category = 'news' where id = 1")
+    db.execute("delete from v where rowid % 3 = 0")
+    db.execute("delete from t where id % 3 = 0")
+    db.execute("insert into v(v) values ('optimize')")
+    assert db.execute("select count(*) from v_metadatadict00").fetchone()[0] == 6
+    check("category = 'news'")
+    check("category in ('news', 'blog')")
+    check("category > 'd'")
+    assert db.execute("select category from v where rowid = 1").fetchone()[0] == "news"
+
+    with pytest.raises(sqlite3.OperationalError, match="Expected text for TEXT metadata column category"):
+        db.execute("insert into v(a, category) values ('[1]', 1)")
+
+    db.execute("alter table v rename to v2")
+    assert db.execute("select count(*) from v2_metadatadict00").fetchone()[0] == 6
+    db.execute("drop table v2")
+    assert db.execute(
+        "select count(*) from sqlite_master where name like 'v%'"
+    ).fetchone()[0] == 0
+
+
 def test_errors(db, snapshot):
     db.execute("create virtual table v using vec0(vector float[1], t text)")
     db.execute("insert into v(vector, t) values ('[1]', 'aaaaaaaaaaaax')")
@@ -1420,7 +1641,7 @@ def vec0_shadow_table_contents(db, v):
     shadow_tables = [
         row[0]
         for row in db.execute(
-            "select name from sqlite_master where name like ? order by 1", [f"{v}_%"]
+            "select name from sqlite_master where type = 'table' and name like ? order by 1", [f"{v}_%"]
         ).fetchall()
     ]
     o = {}
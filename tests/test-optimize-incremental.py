@@ -0,0 +1,255 @@
+import random
+import sqlite3
+import struct
+
+import pytest
+from conftest import check_chunk_layout, fetch_all
+
+
+def _layout(db, name="v"):
+    return {
+        chunk_id: [bool(validity[i // 8] >> (i % 8) & 1) for i in range(len(validity) * 8)]
+        for chunk_id, validity in db.execute(f"SELECT chunk_id, validity FROM {name}_chunks").fetchall()
+    }
+
+
+def _rows(db, name="v"):
+    return fetch_all(db, f"SELECT * FROM {name} ORDER BY rowid")
+
+
+def _optimize(db, options, name="v"):
+    db.execute(f"INSERT INTO {name}({name}) VALUES (?)", [f"optimize:{options}"])
+
+
+def test_optimize_incremental(db):
+    db.execute("create virtual table v using vec0(a float[2], chunk_size=8)")
+    db.executemany("INSERT INTO v(rowid, a) VALUES (?, ?)", [(i, f"[{i}, {-i}]") for i in range(1, 41)])
+    # chunk 2 keeps 1 row, chunk 4 keeps 3, chunk 3 keeps 6
+    db.execute("DELETE FROM v WHERE rowid BETWEEN 10 AND 16")
+    db.execute("DELETE FROM v WHERE rowid BETWEEN 25 AND 29")
+    db.execute("DELETE FROM v WHERE rowid IN (17, 18)")
+    db.commit()
+    rows = _rows(db)
+    full = fetch_all(db, "SELECT validity, rowids FROM v_chunks WHERE chunk_id IN (1, 5)")
+
+    # the emptiest chunk goes first, into the fullest chunk with free offsets
+    _optimize(db, "max_chunks=1")
+    db.commit()
+    assert sorted(_layout(db)) == [1, 3, 4, 5]
+    assert fetch_all(db, "SELECT chunk_id, chunk_offset FROM v_rowids WHERE rowid = 9") == [(3, 0)]
+    assert _rows(db) == rows
+    check_chunk_layout(db)
+    # full chunks aren't touched
+    assert fetch_all(db, "SELECT validity, rowids FROM v_chunks WHERE chunk_id IN (1, 5)") == full
+
+    # then the others below the fill threshold: chunk 4 fills chunk 3, and
+    # keeps the rows left
+    _optimize(db, "max_chunks=10")
+    db.commit()
+    assert sorted(_layout(db)) == [1, 3, 4, 5]
+    assert [row[0] for row in db.execute("SELECT rowid FROM v_rowids WHERE chunk_id = 3 ORDER BY chunk_offset")] == [
+        9,
+        30,
+        19,
+        20,
+        21,
+        22,
+        23,
+        24,
+    ]
+    assert fetch_all(db, "SELECT chunk_id, chunk_offset FROM v_rowids WHERE rowid IN (31, 32) ORDER BY 1, 2") == [
+        (4, 6),
+        (4, 7),
+    ]
+    assert _rows(db) == rows
+    check_chunk_layout(db)
+    assert fetch_all(db, "SELECT * FROM v_free_chunks") == [(4, 6)]
+
+    # nothing left to move it to
+    _optimize(db, "max_chunks=10")
+    assert sorted(_layout(db)) == [1, 3, 4, 5]
+    assert fetch_all(db, "SELECT rowid FROM v WHERE a MATCH '[30, -30]' AND k = 3") == [(30,), (31,), (32,)]
+
+
+def test_optimize_incremental_fill(db):
+    db.execute("create virtual table v using vec0(a float[1], chunk_size=8)")
+    db.executemany("INSERT INTO v(rowid, a) VALUES (?, '[1]')", [(i,) for i in range(1, 25)])
+    # chunks 1 and 2 are 5/8 full, chunk 3 is full
+    db.execute("DELETE FROM v WHERE rowid IN (1, 2, 3, 9, 10, 11)")
+    db.commit()
+
+    # by default only chunks at most half full are emptied
+    _optimize(db, "max_chunks=10")
+    _optimize(db, "max_fill=60")
+    assert sorted(_layout(db)) == [1, 2, 3]
+    assert fetch_all(db, "SELECT chunk_id, free FROM v_free_chunks ORDER BY 1") == [(1, 3), (2, 3)]
+
+    # rows are moved to the fullest chunk, until it's full
+    _optimize(db, "max_fill=75")
+    db.commit()
+    assert sorted(_layout(db)) == [1, 2, 3]
+    assert fetch_all(db, "SELECT chunk_id, free FROM v_free_chunks ORDER BY 1") == [(1, 6)]
+    check_chunk_layout(db)
+    assert db.execute("SELECT count(*) FROM v").fetchone()[0] == 18
+
+    # empty chunks are deleted
+    db.execute("DELETE FROM v WHERE rowid IN (SELECT rowid FROM v_rowids WHERE chunk_id = 1)")
+    _optimize(db, "max_fill=0")
+    db.commit()
+    assert sorted(_layout(db)) == [2, 3]
+
+
+def test_optimize_incremental_budget(db):
+    db.execute("create virtual table v using vec0(a float[1], chunk_size=8)")
+    db.executemany("INSERT INTO v(rowid, a) VALUES (?, '[1]')", [(i,) for i in range(1, 81)])
+    db.execute("DELETE FROM v WHERE rowid % 8 != 1")
+    db.commit()
+    assert len(_layout(db)) == 10
+
+    # the time budget is checked before every chunk but the first
+    _optimize(db, "time_budget_ms=0")
+    assert len(_layout(db)) == 9
+    _optimize(db, "max_chunks=3,time_budget_ms=100000")
+    assert len(_layout(db)) == 6
+    _optimize(db, "max_chunks=0")
+    assert len(_layout(db)) == 6
+    _optimize(db, "max_fill=50")
+    db.commit()
+    assert len(_layout(db)) == 2
+    check_chunk_layout(db)
+    assert db.execute("SELECT count(*) FROM v").fetchone()[0] == 10
+
+
+def test_optimize_incremental_columns(db):
+    db.execute(
+        "create virtual table v using vec0("
+        "p int partition key, a float[2], b int8[2], "
+        "flag boolean, n integer indexed, x float, label text indexed, "
+        "+aux text, chunk_size=8, chunk_summaries=true)"
+    )
+    long = "a label longer than twelve bytes"
+    db.executemany(
+        "INSERT INTO v(rowid, p, a, b, flag, n, x, label, aux) VALUES (?, ?, ?, vec_int8(?), ?, ?, ?, ?, ?)",
+        [
+            (
+                i,
+                i % 2,
+                f"[{i}, {i % 7}]",
+                f"[{i % 5}, {-(i % 3)}]",
+                i % 3 == 0,
+                i % 4,
+                i / 4,
+                long if i % 5 == 0 else f"l{i % 3}",
+                f"aux{i}",
+            )
+            for i in range(1, 65)
+        ],
+    )
+    db.execute("DELETE FROM v WHERE rowid % 8 NOT IN (1, 2) AND rowid > 16")
+    db.commit()
+    rows = _rows(db)
+    queries = [
+        "SELECT rowid, distance FROM v WHERE a MATCH '[30, 2]' AND k = 5 AND p = 0",
+        "SELECT rowid, distance FROM v WHERE a MATCH '[30, 2]' AND k = 5 AND p = 1 AND n = 1",
+        f"SELECT rowid FROM v WHERE a MATCH '[30, 2]' AND k = 10 AND label = '{long}'",
+        "SELECT rowid FROM v WHERE a MATCH '[30, 2]' AND k = 10 AND label IN ('l0', 'l2') AND flag",
+        "SELECT rowid FROM v WHERE a MATCH '[30, 2]' AND k = 10 AND x > 8",
+        "SELECT rowid, distance FROM v WHERE b MATCH vec_int8('[1, -1]') AND k = 10",
+    ]
+    # ties may come in another order once rows moved
+    results = [sorted(fetch_all(db, q)) for q in queries]
+    chunks = len(_layout(db))
+
+    _optimize(db, "max_chunks=100")
+    db.commit()
+    assert len(_layout(db)) < chunks
+    assert _rows(db) == rows
+    assert [sorted(fetch_all(db, q)) for q in queries] == results
+    check_chunk_layout(db)
+
+    # rows stay in chunks of their partition
+    assert (
+        db.execute(
+            "SELECT count(*) FROM v_rowids AS r JOIN v_chunks AS c USING (chunk_id) WHERE c.partition00 != r.rowid % 2"
+        ).fetchone()[0]
+        == 0
+    )
+    # the bitmap indexes, zones and summaries of deleted chunks are gone
+    for table in ["v_metadataindex01", "v_metadataindex03"]:
+        assert db.execute(f"SELECT count(*) FROM {table} WHERE chunk_id NOT IN (SELECT chunk_id FROM v_chunks)").fetchone()[0] == 0
+    for table in ["v_metadatazones00", "v_vector_summaries00", "v_metadatachunks02"]:
+        assert db.execute(f"SELECT count(*) FROM {table} WHERE rowid NOT IN (SELECT chunk_id FROM v_chunks)").fetchone()[0] == 0
+    assert db.execute("SELECT sum(count) FROM v_vector_summaries00").fetchone()[0] == len(rows)
+
+    # the moved rows can be updated and deleted where they are now
+    db.execute("UPDATE v SET n = 9, label = 'moved' WHERE rowid = 25")
+    assert fetch_all(db, "SELECT rowid FROM v WHERE a MATCH '[25, 4]' AND k = 2 AND n = 9 AND label = 'moved'") == [(25,)]
+    db.execute("DELETE FROM v WHERE rowid = 25")
+    db.commit()
+    check_chunk_layout(db)
+
+
+def test_optimize_incremental_errors(db):
+    db.execute("create virtual table v using vec0(a float[1], chunk_size=8)")
+    for options, message in [
+        ("max_chunks", "Invalid 'optimize' option 'max_chunks'"),
+        ("max_chunks=", "Invalid 'optimize' option 'max_chunks'"),
+        ("max_chunks=-1", "Invalid 'optimize' option 'max_chunks'"),
+        ("max_chunks=1x", "Invalid value for 'optimize' option 'max_chunks'"),
+        ("max_fill=101", "'optimize' option 'max_fill' must be a percentage between 0 and 100"),
+        ("chunks=1", "Unknown 'optimize' option 'chunks'"),
+    ]:
+        with pytest.raises(sqlite3.OperationalError, match=message):
+            _optimize(db, options)
+    # no options is the default budget
+    _optimize(db, "")
+    with pytest.raises(sqlite3.OperationalError, match="Unknown vec0 command 'optimise'"):
+        db.execute("INSERT INTO v(v) VALUES ('optimise')")
+
+
+def test_optimize_incremental_old_tables(tmp_path):
+    path = str(tmp_path / "test.db")
+    db = sqlite3.connect(path)
+    db.enable_load_extension(True)
+    db.load_extension("dist/vec0")
+    db.execute("create virtual table v using vec0(a float[1], chunk_size=8)")
+    db.executemany("INSERT INTO v(rowid, a) VALUES (?, '[1]')", [(i,) for i in range(1, 25)])
+    db.execute("DELETE FROM v WHERE rowid BETWEEN 2 AND 8")
+    db.commit()
+    db.execute("DROP TABLE v_free_chunks")
+    db.commit()
+    db.close()
+
+    # tables created before _free_chunks get it first
+    db = sqlite3.connect(path)
+    db.enable_load_extension(True)
+    db.load_extension("dist/vec0")
+    db.execute("DELETE FROM v WHERE rowid = 24")
+    _optimize(db, "max_chunks=1")
+    db.commit()
+    assert sorted(_layout(db)) == [2, 3]
+    assert fetch_all(db, "SELECT chunk_id, free FROM v_free_chunks") == []
+    db.close()
+
+
+@pytest.mark.parametrize(
+    "index",
+    ["hnsw(m=4, ef_construction=32)", "diskann(r=8, l=32, pq=4)", "ivf(nlist=4, nprobe=4)"],
+)
+def test_optimize_incremental_indexes(db, index):
+    db.execute(f"create virtual table v using vec0(a float[4] indexed_by={index}, chunk_size=16)")
+    rnd = random.Random(0)
+    rows = [(i, struct.pack("4f", *[rnd.gauss(0, 1) for _ in range(4)])) for i in range(1, 161)]
+    db.executemany("INSERT INTO v(rowid, a) VALUES (?, ?)", rows)
+    db.execute("INSERT INTO v(v) VALUES ('optimize')")
+    db.execute("DELETE FROM v WHERE rowid % 4 != 0 AND rowid > 32")
+    db.commit()
+
+    _optimize(db, "max_chunks=100")
+    db.commit()
+    assert len(_layout(db)) < 10
+    check_chunk_layout(db)
+    # moved rows are found where they are now
+    for rowid, vector in rows:
+        if rowid % 4 == 0 or rowid <= 32:
+            assert db.execute("SELECT rowid FROM v WHERE a MATCH ? AND k = 1", [vector]).fetchone()[0] == rowid
@@ -1,4 +1,5 @@
 import sqlite3
+import pytest
 from collections import OrderedDict
 
 
@@ -100,6 +101,136 @@ def test_vacuum(db, snapshot):
     assert cur_page_count < prev_page_count
 
 
+def test_knn_partition_in(db):
+    db.execute(
+        "create virtual table v using vec0(p text partition key, a float[2], chunk_size=8, result_cache=8)"
+    )
+    rows = [(i, "abcdef"[i % 6], f"[{i % 17}, {i % 5}]") for i in range(1, 301)]
+    db.executemany("insert into v(rowid, p, a) values (?, ?, ?)", rows)
+    query = "[3, 1]"
+
+    def knn(where, params=[], k=10):
+        return [
+            tuple(row)
+            for row in db.execute(
+                f"select rowid, p, distance from v where a match ? and k = ? and {where}",
+                [query, k, *params],
+            ).fetchall()
+        ]
+
+    # one top k over the union of the partitions, not k rows per partition
+    expected = sorted(
+        knn("p = 'a'", k=300) + knn("p = 'c'", k=300) + knn("p = 'd'", k=300),
+        key=lambda row: (row[2], row[0]),
+    )
+    result = knn("p in ('a', 'c', 'd')")
+    assert len(result) == 10
+    assert [row[2] for row in result] == [row[2] for row in expected[:10]]
+    assert set(result) <= set(expected)
+    assert knn("p in ('a', 'c', 'd')", k=300) == knn("p in ('d', 'a', 'c', 'a')", k=300)
+    assert sorted(knn("p in ('a', 'c', 'd')", k=300)) == sorted(expected)
+
+    # different lists are different queries for the result cache
+    assert {row[1] for row in knn("p in ('b', 'e')")} == {"b", "e"}
+    assert {row[1] for row in knn("p in ('a', 'f')")} == {"a", "f"}
+    assert knn("p in (?, ?)", ["b", "zzz"]) == knn("p = 'b'")
+    assert knn("p in ('zzz')") == []
+
+    # the partitions index is created with the table, and added to older
+    # tables by optimize
+    def indexes():
+        return [
+            row[0]
+            for row in db.execute(
+                "select name from sqlite_master where type = 'index' and tbl_name = 'v_chunks'"
+            ).fetchall()
+        ]
+
+    assert indexes() == ["v_chunks_partitions"]
+    db.execute("drop index v_chunks_partitions")
+    assert knn("p in ('a', 'b')", k=300) != []
+    db.execute("insert into v(v) values ('optimize')")
+    assert indexes() == ["v_chunks_partitions"]
+    assert len(knn("p in ('a', 'b')", k=300)) == 100
+
+
+def test_knn_k_per_partition(db):
+    db.execute(
+        "create virtual table v using vec0(p text partition key, a float[2], c integer, chunk_size=8)"
+    )
+    rows = [(i, "abcdef"[i % 6], f"[{i % 17}, {i % 5}]", i % 2) for i in range(1, 301)]
+    db.executemany("insert into v(rowid, p, a, c) values (?, ?, ?, ?)", rows)
+    query = "[3, 1]"
+
+    def knn(where, k, params=[]):
+        return [
+            tuple(row)
+            for row in db.execute(
+                f"select rowid, p, distance from v where a match ? and k = ? and {where}",
+                [query, k, *params],
+            ).fetchall()
+        ]
+
+    def group(where, n, params=[]):
+        return [
+            tuple(row)
+            for row in db.execute(
+                f"select rowid, p, distance from v where a match ? and k_per_partition = ? and {where}",
+                [query, n, *params],
+            ).fetchall()
+        ]
+
+    def distances(rows):
+        return [row[2] for row in rows]
+
+    # the top n of every partition, grouped by partition
+    result = group("p in ('a', 'c', 'd')", 3)
+    assert [row[1] for row in result] == ["a"] * 3 + ["c"] * 3 + ["d"] * 3
+    for i, p in enumerate("acd"):
+        assert distances(result[i * 3 : i * 3 + 3]) == distances(knn(f"p = '{p}'", 3))
+        assert set(result[i * 3 : i * 3 + 3]) <= set(knn(f"p = '{p}'", 50))
+
+    # every partition without a partition constraint, with other filters
+    result = group("1", 4)
+    assert len(result) == 24
+    result = group("c = 1 and distance < 5", 2)
+    for p in "abcdef":
+        expected = knn(f"p = '{p}' and c = 1 and distance < 5", 2)
+        assert distances([row for row in result if row[1] == p]) == distances(expected)
+
+    # LIMIT and ORDER BY apply to the rows of every partition
+    assert len(group("1 limit 5", 4)) == 5
+    result = db.execute(
+        "select distance from v where a match ? and k_per_partition = 2 order by distance",
+        [query],
+    ).fetchall()
+    assert [row[0] for row in result] == sorted(row[0] for row in result)
+    assert group("p = 'zzz'", 3) == []
+    assert group("1", 0) == []
+
+    with pytest.raises(sqlite3.OperationalError, match="not both"):
+        db.execute(
+            "select rowid from v where a match ? and k = 3 and k_per_partition = 3",
+            [query],
+        ).fetchall()
+    with pytest.raises(sqlite3.OperationalError, match="k_per_partition value in knn query too large"):
+        group("1", 5000)
+    with pytest.raises(sqlite3.OperationalError, match="greater than or equal to 0"):
+        group("1", -1)
+    with pytest.raises(sqlite3.OperationalError, match="k_per_partition cannot be used with mmr_lambda"):
+        group("mmr_lambda = 0.5", 3)
+    with pytest.raises(sqlite3.OperationalError, match="k_per_partition cannot be used with page_token"):
+        group("page_token is null", 3)
+    with pytest.raises(sqlite3.OperationalError, match='hidden "k_per_partition" column'):
+        db.execute("insert into v(p, a, k_per_partition) values ('a', '[1, 1]', 3)")
+
+    db.execute("create virtual table w using vec0(a float[2])")
+    with pytest.raises(sqlite3.OperationalError, match="partition key columns"):
+        db.execute(
+            "select rowid from w where a match ? and k_per_partition = 3", [query]
+        ).fetchall()
+
+
 class Row:
     def __init__(self):
         pass
@@ -132,7 +263,7 @@ def vec0_shadow_table_contents(db, v):
     shadow_tables = [
         row[0]
         for row in db.execute(
-            "select name from sqlite_master where name like ? order by 1", [f"{v}_%"]
+            "select name from sqlite_master where type = 'table' and name like ? order by 1", [f"{v}_%"]
         ).fetchall()
     ]
     o = {}
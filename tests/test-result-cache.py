@@ -0,0 +1,136 @@
+import json
+import sqlite3
+
+import pytest
+from conftest import f32, get_extension_path
+
+
+def _stats(db, table="v"):
+    value = db.execute("select vec_result_cache_stats(?)", [table]).fetchone()[0]
+    return None if value is None else json.loads(value)
+
+
+def _knn(db, query, k, where="", params=[]):
+    return [
+        tuple(row)
+        for row in db.execute(
+            f"SELECT rowid, distance FROM v WHERE embedding MATCH ? AND k = ? {where}",
+            [query, k, *params],
+        ).fetchall()
+    ]
+
+
+def _fill(db, n):
+    db.executemany(
+        "INSERT INTO v(rowid, embedding, c) VALUES (?, ?, ?)",
+        [(i, f32([i, i % 7, 1, 0]), i % 3) for i in range(1, n + 1)],
+    )
+
+
+def test_result_cache(db):
+    db.execute(
+        "create virtual table v using vec0(embedding float[4], c integer, result_cache=8)"
+    )
+    _fill(db, 100)
+    query = f32([10, 3, 1, 0])
+    assert _stats(db) == {"entries": 0, "bytes": 0, "hits": 0, "misses": 0}
+
+    expected = _knn(db, query, 5)
+    assert _knn(db, query, 5) == expected
+    assert _knn(db, query, 5) == expected
+    stats = _stats(db)
+    assert (stats["entries"], stats["hits"], stats["misses"]) == (1, 2, 1)
+    assert stats["bytes"] > 5 * 12
+
+    # k, constraints and query parameters are all part of the key
+    assert _knn(db, query, 6)[:5] == expected
+    assert _knn(db, query, 5, "AND c = ?", [1]) != expected
+    assert _knn(db, query, 5, "AND c IN (1, 2)") != expected
+    assert _knn(db, query, 5, "AND c IN (0, 2)") != _knn(db, query, 5, "AND c IN (1, 2)")
+    assert _knn(db, query, 5, "AND mmr_lambda = 0.5") != expected
+    assert _knn(db, query, 5, "AND distance > 1") != expected
+    assert _knn(db, query, 5, "AND rowid IN (1, 2, 3)") == _knn(db, query, 5, "AND rowid IN (1, 2, 3)")
+    stats = _stats(db)
+    assert stats["entries"] == 8
+    assert stats["hits"] == 4
+
+    # any write drops the cache
+    db.execute("DELETE FROM v WHERE rowid = ?", [expected[0][0]])
+    assert _stats(db)["entries"] == 0
+    assert _knn(db, query, 5) == expected[1:] + _knn(db, query, 5)[4:]
+    assert expected[0] not in _knn(db, query, 5)
+
+    # so does a rollback
+    db.commit()
+    db.execute("BEGIN")
+    db.execute("DELETE FROM v WHERE rowid = ?", [expected[1][0]])
+    assert expected[1] not in _knn(db, query, 5)
+    db.execute("ROLLBACK")
+    assert expected[1] in _knn(db, query, 5)
+
+    # tables without result_cache have no stats
+    db.execute("create virtual table w using vec0(embedding float[4])")
+    db.execute("SELECT * FROM w").fetchall()
+    assert _stats(db, "w") is None
+    assert _stats(db, "missing") is None
+
+
+def test_result_cache_budgets(db):
+    db.execute(
+        "create virtual table v using vec0(embedding float[4], c integer, result_cache=2, result_cache_bytes=400)"
+    )
+    _fill(db, 100)
+    a, b, c = f32([1, 1, 1, 0]), f32([2, 1, 1, 0]), f32([3, 1, 1, 0])
+
+    # least recently used entries are evicted first
+    _knn(db, a, 2)
+    _knn(db, b, 2)
+    _knn(db, a, 2)
+    _knn(db, c, 2)
+    assert _stats(db)["entries"] == 2
+    _knn(db, a, 2)
+    assert _stats(db)["hits"] == 2
+    _knn(db, b, 2)
+    assert _stats(db)["hits"] == 2
+
+    # results larger than the byte budget aren't cached
+    _knn(db, a, 50)
+    _knn(db, a, 50)
+    stats = _stats(db)
+    assert stats["hits"] == 2
+    assert stats["bytes"] <= 400
+
+
+def test_result_cache_other_connection(tmp_path):
+    path = str(tmp_path / "result_cache.db")
+
+    def connect():
+        db = sqlite3.connect(path, isolation_level=None)
+        db.enable_load_extension(True)
+        db.load_extension(get_extension_path())
+        return db
+
+    db = connect()
+    db.execute(
+        "create virtual table v using vec0(embedding float[4], c integer, result_cache=4)"
+    )
+    _fill(db, 20)
+    query = f32([0, 0, 1, 0])
+    before = _knn(db, query, 3)
+    assert _knn(db, query, 3) == before
+
+    # writes through another connection are seen on the next query
+    other = connect()
+    other.execute("INSERT INTO v(rowid, embedding, c) VALUES (100, ?, 0)", [query])
+    after = _knn(db, query, 3)
+    assert after[0] == (100, 0.0)
+    assert after[1:] == before[:2]
+
+
+def test_result_cache_options(db):
+    for option in ["result_cache=4097", "result_cache=x"]:
+        with pytest.raises(sqlite3.OperationalError, match="result_cache must be"):
+            db.execute(f"create virtual table v using vec0(embedding float[4], {option})")
+    for option in ["result_cache_bytes=0", "result_cache_bytes=x"]:
+        with pytest.raises(sqlite3.OperationalError, match="result_cache_bytes must be"):
+            db.execute(f"create virtual table v using vec0(embedding float[4], {option})")
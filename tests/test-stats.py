@@ -0,0 +1,145 @@
+import sqlite3
+
+import pytest
+from conftest import f32, get_extension_path
+
+
+def _stats(db, table="v"):
+    rows = db.execute(
+        f"select key, value from {table}_info where key like 'STATS_%' order by 1"
+    ).fetchall()
+    return {row[0]: row[1] for row in rows}
+
+
+def _counts(rows, chunks, partitions):
+    return {
+        "STATS_CHUNK_COUNT": chunks,
+        "STATS_PARTITION_COUNT": partitions,
+        "STATS_ROW_COUNT": rows,
+    }
+
+
+def _fill(db, rowids, table="v"):
+    db.executemany(
+        f"INSERT INTO {table}(rowid, embedding) VALUES (?, ?)",
+        [(i, f32([i, i])) for i in rowids],
+    )
+
+
+def test_stats(db):
+    db.execute("create virtual table v using vec0(embedding float[2], chunk_size=8)")
+    assert _stats(db) == {}
+
+    _fill(db, range(1, 11))
+    db.commit()
+    assert _stats(db) == _counts(10, 2, 1)
+
+    db.execute("DELETE FROM v WHERE rowid IN (1, 2, 3)")
+    db.commit()
+    assert _stats(db) == _counts(7, 2, 1)
+
+    # rolled back writes aren't counted
+    db.execute("BEGIN")
+    _fill(db, range(100, 120))
+    db.execute("ROLLBACK")
+    _fill(db, [11])
+    db.commit()
+    assert _stats(db) == _counts(8, 2, 1)
+
+    # neither are writes rolled back to a savepoint, or failed statements
+    db.execute("BEGIN")
+    _fill(db, [12])
+    db.execute("SAVEPOINT a")
+    _fill(db, range(200, 220))
+    db.execute("ROLLBACK TO a")
+    db.execute("RELEASE a")
+    with pytest.raises(sqlite3.OperationalError, match="UNIQUE constraint"):
+        db.execute(
+            "INSERT INTO v(rowid, embedding) VALUES (300, ?), (301, ?), (4, ?)",
+            [f32([1, 1])] * 3,
+        )
+    db.execute("COMMIT")
+    assert _stats(db) == _counts(9, 2, 1)
+
+    # counts that didn't change aren't written
+    def authorizer(action, arg1, *_):
+        if action == sqlite3.SQLITE_INSERT and arg1 == "v_info":
+            return sqlite3.SQLITE_DENY
+        return sqlite3.SQLITE_OK
+
+    db.set_authorizer(authorizer)
+    db.execute("BEGIN")
+    _fill(db, [500])
+    db.execute("DELETE FROM v WHERE rowid = 500")
+    db.execute("COMMIT")
+    db.set_authorizer(None)
+    assert _stats(db) == _counts(9, 2, 1)
+
+    # optimize recounts the chunks it drops
+    db.execute("DELETE FROM v WHERE rowid > 5")
+    db.execute("INSERT INTO v(v) VALUES ('optimize')")
+    db.commit()
+    assert _stats(db) == _counts(2, 1, 1)
+
+
+def test_stats_partitions(db):
+    db.execute(
+        "create virtual table v using vec0(p text partition key, embedding float[2], chunk_size=8)"
+    )
+    db.executemany(
+        "INSERT INTO v(rowid, p, embedding) VALUES (?, ?, ?)",
+        [(i, ["a", "b", "c"][i % 3], f32([i, i])) for i in range(1, 31)],
+    )
+    db.commit()
+    assert _stats(db) == _counts(30, 6, 3)
+
+
+def test_stats_existing_table(tmp_path):
+    path = str(tmp_path / "stats.db")
+
+    def connect():
+        db = sqlite3.connect(path, isolation_level=None)
+        db.enable_load_extension(True)
+        db.load_extension(get_extension_path())
+        return db
+
+    db = connect()
+    db.execute("create virtual table v using vec0(embedding float[2], chunk_size=8)")
+    _fill(db, range(1, 21))
+    # tables without the STATS_* keys are counted on first use
+    db.execute("DELETE FROM v_info WHERE key LIKE 'STATS_%'")
+    db.close()
+
+    db = connect()
+    _fill(db, [21])
+    assert _stats(db) == _counts(21, 3, 1)
+
+    # other connections see the new counts
+    other = connect()
+    _fill(other, range(22, 30))
+    _fill(db, [30])
+    assert _stats(db) == _counts(30, 4, 1)
+
+
+def test_stats_plans(db):
+    db.execute("create virtual table v using vec0(embedding float[2])")
+    db.execute("create table docs(id integer primary key, body text)")
+    db.executemany("INSERT INTO docs VALUES (?, 'x')", [(i * 100,) for i in range(50)])
+    db.execute("ANALYZE")
+
+    def plan(sql):
+        return [
+            row["detail"] for row in db.execute("EXPLAIN QUERY PLAN " + sql).fetchall()
+        ]
+
+    # a handful of vectors: scan them, look up each document
+    _fill(db, range(1, 6))
+    db.commit()
+    sql = "SELECT * FROM docs JOIN v ON v.rowid = docs.id"
+    assert plan(sql)[0].startswith("SCAN v")
+
+    # many vectors: scan the documents, look up each vector by rowid
+    _fill(db, range(6, 5000))
+    db.commit()
+    sql += " WHERE 1"
+    assert plan(sql) == ["SCAN docs", "SCAN v VIRTUAL TABLE INDEX 3:2!___"]